@@ -0,0 +1,54 @@
+/*
+ * This file is shared between libc and the kernel, so don't put anything
+ * in here that won't work in both contexts.
+ */
+
+#ifdef _KERNEL
+#include <types.h>
+#include <lib.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#endif
+
+#include "wordops.h"
+
+/*
+ * C standard function - find the first instance of a byte in a
+ * block of memory.
+ */
+
+void *
+memchr(const void *buf, int ch, size_t len)
+{
+	const unsigned char *s = buf;
+	const unsigned long *w;
+	unsigned char c = ch;
+	unsigned long pattern;
+
+	/*
+	 * Go by bytes to a word boundary, then by words, XORing each
+	 * with C in every byte so that a match becomes a zero byte,
+	 * then by bytes again to find it (or over the leftovers).
+	 */
+	for (; len > 0 && WORD_OFFSET(s) != 0; s++, len--) {
+		if (*s == c) {
+			/* this must launder const */
+			return (void *)s;
+		}
+	}
+
+	pattern = WORD_ONES * c;
+	w = (const unsigned long *)s;
+	while (len >= sizeof(unsigned long) && !WORD_HASZERO(*w ^ pattern)) {
+		w++;
+		len -= sizeof(unsigned long);
+	}
+
+	for (s = (const unsigned char *)w; len > 0; s++, len--) {
+		if (*s == c) {
+			return (void *)s;
+		}
+	}
+	return NULL;
+}
@@ -31,6 +31,7 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
@@ -42,10 +43,43 @@ void *
 memset(void *ptr, int ch, size_t len)
 {
 	char *p = ptr;
+	unsigned long word;
+	long *lp;
 	size_t i;
 
-	for (i=0; i<len; i++) {
-		p[i] = ch;
+	/*
+	 * As in bzero: bytes up to a word boundary, then words, then
+	 * bytes. The word is CH repeated in every byte.
+	 */
+
+	while (len > 0 && (uintptr_t)p % sizeof(long) != 0) {
+		*p++ = ch;
+		len--;
+	}
+
+	word = (unsigned char)ch;
+	for (i=1; i<sizeof(long); i++) {
+		word = (word << 8) | (unsigned char)ch;
+	}
+
+	lp = (long *)p;
+	while (len >= 4 * sizeof(long)) {
+		lp[0] = word;
+		lp[1] = word;
+		lp[2] = word;
+		lp[3] = word;
+		lp += 4;
+		len -= 4 * sizeof(long);
+	}
+	while (len >= sizeof(long)) {
+		*lp++ = word;
+		len -= sizeof(long);
+	}
+	p = (char *)lp;
+
+	while (len > 0) {
+		*p++ = ch;
+		len--;
 	}
 
 	return ptr;
@@ -36,9 +36,12 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
+#include "wordops.h"
+
 /*
  * Standard C string function: compare two strings and return their
  * sort order.
@@ -47,6 +50,7 @@
 int
 strcmp(const char *a, const char *b)
 {
+	const unsigned long *aw, *bw;
 	size_t i;
 
 	/*
@@ -61,11 +65,31 @@ strcmp(const char *a, const char *b)
 	 * that we haven't run off the end of A, because that's the
 	 * same as checking to make sure we haven't run off the end of
 	 * B.
+	 *
+	 * If both strings are equally far from a word boundary, go by
+	 * bytes up to it and then by words while the words match and
+	 * hold no zero byte, before finding the exact place by bytes.
 	 */
 
-	for (i=0; a[i]!=0 && a[i]==b[i]; i++) {
+	i = 0;
+	if (WORD_OFFSET(a) == WORD_OFFSET(b)) {
+		for (; WORD_OFFSET(a + i) != 0; i++) {
+			if (a[i] == 0 || a[i] != b[i]) {
+				goto found;
+			}
+		}
+		aw = (const unsigned long *)(a + i);
+		bw = (const unsigned long *)(b + i);
+		while (*aw == *bw && !WORD_HASZERO(*aw)) {
+			aw++;
+			bw++;
+		}
+		i = (const char *)aw - a;
+	}
+	for (; a[i]!=0 && a[i]==b[i]; i++) {
 		/* nothing */
 	}
+ found:
 
 	/*
 	 * If A is greater than B, return 1. If A is less than B,
@@ -36,9 +36,12 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
+#include "wordops.h"
+
 /*
  * C standard string function: get length of a string
  */
@@ -46,10 +49,24 @@
 size_t
 strlen(const char *str)
 {
-	size_t ret = 0;
+	const char *s = str;
+	const unsigned long *w;
 
-	while (str[ret]) {
-		ret++;
+	/*
+	 * Go by bytes to a word boundary, then by words until one has
+	 * a zero byte, then find which byte it is.
+	 */
+	while (WORD_OFFSET(s) != 0) {
+		if (*s == 0) {
+			return s - str;
+		}
+		s++;
+	}
+	for (w = (const unsigned long *)s; !WORD_HASZERO(*w); w++) {
+		/* nothing */
+	}
+	for (s = (const char *)w; *s; s++) {
+		/* nothing */
 	}
-	return ret;
+	return s - str;
 }
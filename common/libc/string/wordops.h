@@ -0,0 +1,23 @@
+/*
+ * Helpers for the string functions that work a word at a time. This
+ * file is shared between libc and the kernel.
+ *
+ * An aligned word never straddles a page, so once a pointer is
+ * aligned it is safe to load the whole word holding the byte we
+ * want, even if the string or buffer ends partway through it.
+ */
+
+#ifndef _WORDOPS_H_
+#define _WORDOPS_H_
+
+/* 0x01 and 0x80 in every byte of a word */
+#define WORD_ONES	((unsigned long)-1 / 0xff)
+#define WORD_HIGHS	(WORD_ONES * 0x80)
+
+/* nonzero if one of the bytes of W is zero */
+#define WORD_HASZERO(w)	(((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+/* nonzero if P is not on a word boundary */
+#define WORD_OFFSET(p)	((uintptr_t)(p) % sizeof(unsigned long))
+
+#endif /* _WORDOPS_H_ */
@@ -0,0 +1,105 @@
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+/*
+ * Atomic integers for mips, using LL/SC as spinlock_data_testandset
+ * does (see <machine/spinlock.h> for how they work). Each operation
+ * loads the word linked, works out the new value in registers, and
+ * retries until the store conditional goes through. See <atomic.h>.
+ */
+
+#include <membar.h>
+
+/*
+ * Reading or writing a plain 32-bit value is one instruction, and
+ * instructions are atomic with respect to memory.
+ */
+ATOMIC_INLINE
+int
+atomic_get(const struct atomic *a)
+{
+	return a->a_val;
+}
+
+ATOMIC_INLINE
+void
+atomic_set(struct atomic *a, int val)
+{
+	a->a_val = val;
+}
+
+ATOMIC_INLINE
+void
+atomic_inc(struct atomic *a)
+{
+	int x;
+	int y;
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = a->a_val */
+			"addiu %1, %0, 1;"	/*   y = x + 1 */
+			"sc %1, 0(%2);"		/*   a->a_val = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (&a->a_val));
+	} while (y == 0);
+}
+
+ATOMIC_INLINE
+bool
+atomic_dec_and_test(struct atomic *a)
+{
+	int x;
+	int y;
+
+	membar_any_any();
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = a->a_val */
+			"addiu %1, %0, -1;"	/*   y = x - 1 */
+			"sc %1, 0(%2);"		/*   a->a_val = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (&a->a_val));
+	} while (y == 0);
+	membar_any_any();
+	return x == 1;
+}
+
+/*
+ * There's no branching between the LL and the SC: if the value isn't
+ * OLD, MOVN has us store back what we loaded, which changes nothing.
+ */
+ATOMIC_INLINE
+int
+atomic_cmpxchg(struct atomic *a, int old, int new)
+{
+	int x;
+	int y;
+	int t;
+
+	membar_any_any();
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%3);"		/*   x = a->a_val */
+			"move %1, %5;"		/*   y = new */
+			"xor %2, %0, %4;"	/*   t = x ^ old */
+			"movn %1, %0, %2;"	/*   if (t != 0) y = x */
+			"sc %1, 0(%3);"		/*   a->a_val = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y), "=&r" (t)
+			: "r" (&a->a_val), "r" (old), "r" (new));
+	} while (y == 0);
+	membar_any_any();
+	return x;
+}
+
+#endif /* _MIPS_ATOMIC_H_ */
@@ -35,13 +35,10 @@
  * Machine-dependent thread bits.
  */
 
-#include <setjmp.h>
-
-typedef void (*badfaultfunc_t)(void);
+struct trapframe;
 
 struct thread_machdep {
-	badfaultfunc_t tm_badfaultfunc;	/* fault hook used by copyin/out */
-	jmp_buf tm_copyjmp;		/* longjmp area used by copyin/out */
+	struct trapframe *tm_intrframe;	/* interrupt being handled, if any */
 };
 
 
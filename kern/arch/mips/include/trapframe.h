@@ -98,6 +98,12 @@ struct trapframe {
  */
 __DEAD void mips_usermode(struct trapframe *tf);
 
+/*
+ * Entry for system calls that come in through the light trapframe
+ * (all but fork and vfork; see exception-mips1.S).
+ */
+void mips_syscall(struct trapframe *tf);
+
 /*
  * Arrays used to load the kernel stack and curthread on trap entry.
  */
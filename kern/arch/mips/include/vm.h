@@ -78,6 +78,15 @@ kvaddr_to_paddr(vaddr_t vaddr){
     return ((vaddr) - MIPS_KSEG0);
 }
 
+/*
+ * Physical memory from MIPS_KSEG0_RAMTOP up is "high memory": it has
+ * no kseg0 address, so PADDR_TO_KVADDR must not be used on it. The VM
+ * system keeps it for user pages and reaches it through temporary
+ * kseg2 mappings (vm_kmap).
+ */
+#define MIPS_KSEG0_RAMTOP 0x20000000
+#define PADDR_IS_HIGH(paddr) ((paddr) >= MIPS_KSEG0_RAMTOP)
+
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -115,26 +124,43 @@ kvaddr_to_paddr(vaddr_t vaddr){
  * ram_stealmem can be used before ram_getsize is called to allocate
  * memory that cannot be freed later. This is intended for use early
  * in bootup before VM initialization is complete.
+ *
+ * ram_gethighsize returns how much high memory there is, starting at
+ * MIPS_KSEG0_RAMTOP, or 0 if none. It is not part of ram_getsize.
  */
 
 void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
+paddr_t ram_gethighsize(void);
 
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown asks another CPU to drop its TLB entries for the
+ * TS_NPAGES pages starting at TS_VADDR of ASID TS_ASID (from ASID
+ * generation TS_GENERATION; if the target has flushed since, there is
+ * nothing to do), or with TS_VADDR set to TS_FLUSHALL, to flush its
+ * whole TLB. If TS_WAIT is not NULL, the sender is waiting for the
+ * target to finish; see vm.c.
+ *
+ * The VM system sends at most one waited-for request to each CPU at a
+ * time, plus at most one TS_FLUSHALL, so the queue never fills.
  */
 
+struct tlbshootdown_wait;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	unsigned ts_asid;
+	unsigned ts_generation;
+	vaddr_t ts_vaddr;
+	unsigned ts_npages;
+	struct tlbshootdown_wait *ts_wait;
 };
 
+#define TS_FLUSHALL ((vaddr_t)-1)
+
 #define TLBSHOOTDOWN_MAX 16
 
 
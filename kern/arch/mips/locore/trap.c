@@ -41,6 +41,8 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include <prof.h>
+#include <copyinout.h>
 
 
 /* in exception-*.S */
@@ -110,6 +112,9 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 		break;
 	}
 
+	/* Out of memory, maybe, because the OOM killer chose us */
+	proc_checkkill();
+
 	/* For now, keep the message; it can be useful when debugging. */
 	kprintf("Fatal user mode trap %u sig %d (%s, epc 0x%x, vaddr 0x%x)\n",
 		code, sig, trapcodenames[code], epc, vaddr);
@@ -125,6 +130,30 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 	thread_exit();
 }
 
+/*
+ * Record curthread and its kernel stack for this CPU, where the
+ * exception entry code finds them on the next trap from user mode.
+ * We may have moved to another CPU while in the kernel.
+ */
+static
+void
+trap_setcpu(struct trapframe *tf)
+{
+	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
+	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
+
+	/*
+	 * This assertion will fail if either
+	 *   (1) curthread->t_stack is corrupted, or
+	 *   (2) the trap frame is somehow on the wrong kernel stack.
+	 *
+	 * If cpustacks[] is corrupted, the next trap back to the
+	 * kernel will (most likely) hang the system, so it's better
+	 * to find out now.
+	 */
+	KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf));
+}
+
 /*
  * General trap (exception) handling function for mips.
  * This is called by the assembly-language exception handler once
@@ -137,6 +166,7 @@ mips_trap(struct trapframe *tf)
 	/*bool isutlb; -- not used */
 	bool iskern;
 	int spl;
+	vaddr_t fixup;
 
 	/* The trap frame is supposed to be 35 registers long. */
 	KASSERT(sizeof(struct trapframe)==(35*4));
@@ -160,10 +190,13 @@ mips_trap(struct trapframe *tf)
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
+		struct trapframe *old_tf;
 		bool doadjust;
 
 		old_in = curthread->t_in_interrupt;
 		curthread->t_in_interrupt = 1;
+		old_tf = curthread->t_machdep.tm_intrframe;
+		curthread->t_machdep.tm_intrframe = tf;
 
 		/*
 		 * The processor has turned interrupts off; if the
@@ -202,7 +235,20 @@ mips_trap(struct trapframe *tf)
 			curthread->t_curspl = 0;
 		}
 
+		curthread->t_machdep.tm_intrframe = old_tf;
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * A process killed while it computes only finds out
+		 * here. It needs interrupts back on to exit, as for
+		 * any other trap; done checks properly (this peek is
+		 * without the lock).
+		 */
+		if (!iskern && doadjust && curproc->p_killed) {
+			spl = splhigh();
+			splx(spl);
+			goto done;
+		}
 		goto done2;
 	}
 
@@ -287,27 +333,19 @@ mips_trap(struct trapframe *tf)
 	/*
 	 * Fatal fault in kernel mode.
 	 *
-	 * If pcb_badfaultfunc is set, we do not panic; badfaultfunc is
-	 * set by copyin/copyout and related functions to signify that
-	 * the addresses they're accessing are userlevel-supplied and
-	 * not trustable. What we actually want to do is resume
-	 * execution at the function pointed to by badfaultfunc. That's
-	 * going to be "copyfail" (see copyinout.c), which longjmps
-	 * back to copyin/copyout or wherever and returns EFAULT.
-	 *
-	 * Note that we do not just *call* this function, because that
-	 * won't necessarily do anything. We want the control flow
-	 * that is currently executing in copyin (or whichever), and
-	 * is stopped while we process the exception, to *teleport* to
-	 * copyfail.
+	 * If the faulting instruction is one of those in usercopy and
+	 * usercopystr that touch user memory, we do not panic: the
+	 * addresses they're accessing are userlevel-supplied and not
+	 * trustable. copyfixup says where to resume instead, which makes
+	 * the copy return EFAULT (see copyinout.c).
 	 *
 	 * This is accomplished by changing tf->tf_epc and returning
 	 * from the exception handler.
 	 */
 
-	if (curthread != NULL &&
-	    curthread->t_machdep.tm_badfaultfunc != NULL) {
-		tf->tf_epc = (vaddr_t) curthread->t_machdep.tm_badfaultfunc;
+	fixup = copyfixup(tf->tf_epc);
+	if (fixup != 0) {
+		tf->tf_epc = fixup;
 		goto done;
 	}
 
@@ -323,6 +361,11 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/* Don't go back to a process that has been killed meanwhile. */
+	if (!iskern) {
+		proc_checkkill();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -340,19 +383,65 @@ mips_trap(struct trapframe *tf)
 		return;
 	}
 
-	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
-	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
+	trap_setcpu(tf);
+}
 
-	/*
-	 * This assertion will fail if either
-	 *   (1) curthread->t_stack is corrupted, or
-	 *   (2) the trap frame is somehow on the wrong kernel stack.
-	 *
-	 * If cpustacks[] is corrupted, the next trap back to the
-	 * kernel will (most likely) hang the system, so it's better
-	 * to find out now.
-	 */
-	KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf));
+/*
+ * System call entry for the light trapframe.
+ *
+ * exception-mips1.S comes here directly, instead of via mips_trap,
+ * for every system call but fork and vfork. Only the argument
+ * registers, v0, sp, gp, s7, ra, status, cause and epc are in the
+ * frame; the rest of it is garbage. That's enough for syscall(),
+ * which reads only the arguments (and sp for those on the stack)
+ * and writes only v0, v1, a3 and epc.
+ *
+ * This is the EX_SYS case of mips_trap, with its entry and exit
+ * housekeeping.
+ */
+void
+mips_syscall(struct trapframe *tf)
+{
+	int spl;
+
+	/* We only come here from user mode, on a thread's own stack. */
+	KASSERT((tf->tf_status & CST_KUp) != 0);
+	KASSERT(curthread->t_stack != NULL);
+	KASSERT((vaddr_t)tf > (vaddr_t)curthread->t_stack);
+	KASSERT((vaddr_t)tf < (vaddr_t)(curthread->t_stack + STACK_SIZE));
+
+	/* Restore the interrupt state, as mips_trap does. */
+	spl = splhigh();
+	splx(spl);
+
+	/* Interrupts should have been on while in user mode. */
+	KASSERT(curthread->t_curspl == 0);
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	DEBUG(DB_SYSCALL, "syscall: #%d, args %x %x %x %x\n",
+	      tf->tf_v0, tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3);
+
+	syscall(tf);
+
+	/* Don't go back to a process that has been killed meanwhile. */
+	proc_checkkill();
+
+	cpu_irqoff();
+	trap_setcpu(tf);
+}
+
+/*
+ * Where the interrupt being handled came in: see <prof.h>.
+ */
+vaddr_t
+prof_interrupted_pc(bool *user)
+{
+	struct trapframe *tf;
+
+	tf = curthread->t_machdep.tm_intrframe;
+	KASSERT(tf != NULL);
+	*user = (tf->tf_status & CST_KUp) != 0;
+	return tf->tf_epc;
 }
 
 /*
@@ -30,6 +30,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/syscall.h>
+#include <kern/sysstat.h>
+#include <kern/time.h>
 #include <endian.h>
 #include <lib.h>
 #include <mips/trapframe.h>
@@ -37,8 +39,749 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include <ktrace.h>
+#include "opt-dumbvm.h"
 
 
+/*
+ * Per-call argument unpacking. Each of these pulls its arguments out
+ * of the trapframe (note the casts to userptr_t), calls the
+ * machine-independent sys_* function, and hands back the error code;
+ * the value returned on success goes in *retval.
+ */
+typedef int (*syscall_handler)(struct trapframe *tf, int32_t *retval);
+
+static
+int
+sc_reboot(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_reboot(tf->tf_a0);
+}
+
+static
+int
+sc___time(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys___time((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_nanosleep(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_nanosleep((const_userptr_t)tf->tf_a0,
+			     (userptr_t)tf->tf_a1);
+}
+
+/* process calls */
+
+static
+int
+sc_fork(struct trapframe *tf, int32_t *retval)
+{
+	return sys_fork(tf, retval);
+}
+
+static
+int
+sc_vfork(struct trapframe *tf, int32_t *retval)
+{
+	return sys_vfork(tf, retval);
+}
+
+static
+int
+sc_execv(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_spawnv(struct trapframe *tf, int32_t *retval)
+{
+	return sys_spawnv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1, retval);
+}
+
+static
+int
+sc__exit(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	sys__exit(tf->tf_a0);
+	panic("Returning from exit\n");
+}
+
+static
+int
+sc_waitpid(struct trapframe *tf, int32_t *retval)
+{
+	return sys_waitpid(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+			   retval);
+}
+
+static
+int
+sc_getpid(struct trapframe *tf, int32_t *retval)
+{
+	(void)tf;
+	return sys_getpid(retval);
+}
+
+static
+int
+sc_setaffinity(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_setaffinity(tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_getrusage(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_getrlimit(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_getrlimit(tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_setrlimit(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_setrlimit(tf->tf_a0, (const_userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_getpriority(struct trapframe *tf, int32_t *retval)
+{
+	return sys_getpriority(tf->tf_a0, tf->tf_a1, retval);
+}
+
+static
+int
+sc_setpriority(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_setpriority(tf->tf_a0, tf->tf_a1, tf->tf_a2);
+}
+
+static
+int
+sc_sched_setscheduler(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_sched_setscheduler(tf->tf_a0, tf->tf_a1);
+}
+
+static
+int
+sc_sched_getscheduler(struct trapframe *tf, int32_t *retval)
+{
+	return sys_sched_getscheduler(tf->tf_a0, retval);
+}
+
+static
+int
+sc_setgang(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_setgang(tf->tf_a0);
+}
+
+static
+int
+sc_procstat(struct trapframe *tf, int32_t *retval)
+{
+	return sys_procstat((userptr_t)tf->tf_a0, tf->tf_a1, retval);
+}
+
+/* file calls */
+
+static
+int
+sc_open(struct trapframe *tf, int32_t *retval)
+{
+	return sys_open((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2, retval);
+}
+
+static
+int
+sc_dup2(struct trapframe *tf, int32_t *retval)
+{
+	return sys_dup2(tf->tf_a0, tf->tf_a1, retval);
+}
+
+static
+int
+sc_pipe(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_pipe((userptr_t)tf->tf_a0);
+}
+
+static
+int
+sc_mq_create(struct trapframe *tf, int32_t *retval)
+{
+	return sys_mq_create(tf->tf_a0, tf->tf_a1, retval);
+}
+
+static
+int
+sc_mq_send(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_mq_send(tf->tf_a0, (const_userptr_t)tf->tf_a1,
+			   tf->tf_a2, tf->tf_a3);
+}
+
+static
+int
+sc_mq_receive(struct trapframe *tf, int32_t *retval)
+{
+	return sys_mq_receive(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+			      tf->tf_a3, retval);
+}
+
+static
+int
+sc_close(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_close(tf->tf_a0);
+}
+
+static
+int
+sc_read(struct trapframe *tf, int32_t *retval)
+{
+	return sys_read(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, retval);
+}
+
+static
+int
+sc_write(struct trapframe *tf, int32_t *retval)
+{
+	return sys_write(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, retval);
+}
+
+/*
+ * As with mmap, the position for pread, pwrite, preadv, and pwritev
+ * is 64 bits wide and aligned, so it comes from the stack.
+ */
+static
+int
+sc_stackpos(struct trapframe *tf, off_t *pos)
+{
+	return copyin((userptr_t)tf->tf_sp + 16, pos, sizeof(off_t));
+}
+
+static
+int
+sc_pread(struct trapframe *tf, int32_t *retval)
+{
+	off_t pos;
+	int err;
+
+	err = sc_stackpos(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_pread(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, pos,
+			 retval);
+}
+
+static
+int
+sc_pwrite(struct trapframe *tf, int32_t *retval)
+{
+	off_t pos;
+	int err;
+
+	err = sc_stackpos(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_pwrite(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, pos,
+			  retval);
+}
+
+static
+int
+sc_readv(struct trapframe *tf, int32_t *retval)
+{
+	return sys_readv(tf->tf_a0, (const_userptr_t)tf->tf_a1, tf->tf_a2,
+			 retval);
+}
+
+static
+int
+sc_writev(struct trapframe *tf, int32_t *retval)
+{
+	return sys_writev(tf->tf_a0, (const_userptr_t)tf->tf_a1, tf->tf_a2,
+			  retval);
+}
+
+static
+int
+sc_preadv(struct trapframe *tf, int32_t *retval)
+{
+	off_t pos;
+	int err;
+
+	err = sc_stackpos(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_preadv(tf->tf_a0, (const_userptr_t)tf->tf_a1, tf->tf_a2,
+			  pos, retval);
+}
+
+static
+int
+sc_pwritev(struct trapframe *tf, int32_t *retval)
+{
+	off_t pos;
+	int err;
+
+	err = sc_stackpos(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_pwritev(tf->tf_a0, (const_userptr_t)tf->tf_a1, tf->tf_a2,
+			   pos, retval);
+}
+
+static
+int
+sc_sendfile(struct trapframe *tf, int32_t *retval)
+{
+	return sys_sendfile(tf->tf_a0, tf->tf_a1, (userptr_t)tf->tf_a2,
+			    tf->tf_a3, retval);
+}
+
+static
+int
+sc_ioctl(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_ioctl(tf->tf_a0, tf->tf_a1, (userptr_t)tf->tf_a2);
+}
+
+static
+int
+sc_poll(struct trapframe *tf, int32_t *retval)
+{
+	return sys_poll((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2, retval);
+}
+
+static
+int
+sc_semwait(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_semwait(tf->tf_a0, tf->tf_a1);
+}
+
+static
+int
+sc_sempost(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_sempost(tf->tf_a0, tf->tf_a1);
+}
+
+static
+int
+sc_futex(struct trapframe *tf, int32_t *retval)
+{
+	return sys_futex((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+			 tf->tf_a3, retval);
+}
+
+static
+int
+sc_sysstat(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_sysstat(tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_lseek(struct trapframe *tf, int32_t *retval)
+{
+	/*
+	 * Because the position argument is 64 bits wide, it goes in
+	 * the a2/a3 registers and we have to get "whence" from the
+	 * stack. Furthermore, the return value is 64 bits wide, so
+	 * the extra part of it goes in the v1 register.
+	 *
+	 * This is a trifle messy.
+	 */
+	uint64_t offset;
+	int whence;
+	off_t retval64;
+	int err;
+
+	join32to64(tf->tf_a2, tf->tf_a3, &offset);
+
+	err = copyin((userptr_t)tf->tf_sp + 16, &whence, sizeof(int));
+	if (err) {
+		return err;
+	}
+
+	err = sys_lseek(tf->tf_a0, offset, whence, &retval64);
+	if (err) {
+		return err;
+	}
+
+	split64to32(retval64, &tf->tf_v0, &tf->tf_v1);
+	*retval = tf->tf_v0;
+	return 0;
+}
+
+static
+int
+sc_chdir(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_chdir((userptr_t)tf->tf_a0);
+}
+
+static
+int
+sc___getcwd(struct trapframe *tf, int32_t *retval)
+{
+	return sys___getcwd((userptr_t)tf->tf_a0, tf->tf_a1, retval);
+}
+
+static
+int
+sc_sync(struct trapframe *tf, int32_t *retval)
+{
+	(void)tf;
+	(void)retval;
+	return sys_sync();
+}
+
+static
+int
+sc_bufstat(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_bufstat((userptr_t)tf->tf_a0);
+}
+
+static
+int
+sc_mkdir(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_mkdir((userptr_t)tf->tf_a0, tf->tf_a1);
+}
+
+static
+int
+sc_rmdir(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_rmdir((userptr_t)tf->tf_a0);
+}
+
+static
+int
+sc_remove(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_remove((userptr_t)tf->tf_a0);
+}
+
+static
+int
+sc_link(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_link((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_rename(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_rename((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_getdirentry(struct trapframe *tf, int32_t *retval)
+{
+	return sys_getdirentry(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+			       retval);
+}
+
+static
+int
+sc_getdirentries(struct trapframe *tf, int32_t *retval)
+{
+	return sys_getdirentries(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+				 (userptr_t)tf->tf_a3, retval);
+}
+
+static
+int
+sc_fstat(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_fstat(tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_stat(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_stat((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_fsync(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_fsync(tf->tf_a0);
+}
+
+static
+int
+sc_ftruncate(struct trapframe *tf, int32_t *retval)
+{
+	/* Like lseek, the length is 64 bits and aligned */
+	uint64_t len;
+
+	(void)retval;
+	join32to64(tf->tf_a2, tf->tf_a3, &len);
+	return sys_ftruncate(tf->tf_a0, len);
+}
+
+static
+int
+sc_fallocate(struct trapframe *tf, int32_t *retval)
+{
+	/* The position goes in a2/a3, and the length on the stack */
+	uint64_t pos;
+	off_t len;
+	int err;
+
+	(void)retval;
+	join32to64(tf->tf_a2, tf->tf_a3, &pos);
+	err = sc_stackpos(tf, &len);
+	if (err) {
+		return err;
+	}
+	return sys_fallocate(tf->tf_a0, pos, len);
+}
+
+/* vm calls */
+
+#if !OPT_DUMBVM
+static
+int
+sc_sbrk(struct trapframe *tf, int32_t *retval)
+{
+	vaddr_t oldbreak;
+	int err;
+
+	err = sys_sbrk((intptr_t)tf->tf_a0, &oldbreak);
+	*retval = (int32_t)oldbreak;
+	return err;
+}
+
+static
+int
+sc_mmap(struct trapframe *tf, int32_t *retval)
+{
+	/*
+	 * The offset is 64 bits wide and aligned, so it can't go in
+	 * a3 and comes from the stack.
+	 */
+	off_t offset;
+	vaddr_t addr;
+	int err;
+
+	err = sc_stackpos(tf, &offset);
+	if (err) {
+		return err;
+	}
+
+	err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2, offset, &addr);
+	*retval = (int32_t)addr;
+	return err;
+}
+
+static
+int
+sc_munmap(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_munmap((userptr_t)tf->tf_a0);
+}
+
+static
+int
+sc_mprotect(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_mprotect((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+}
+
+static
+int
+sc_madvise(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_madvise((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+}
+
+static
+int
+sc_mincore(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_mincore((userptr_t)tf->tf_a0, tf->tf_a1,
+			   (userptr_t)tf->tf_a2);
+}
+
+static
+int
+sc_mlock(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_mlock((userptr_t)tf->tf_a0, tf->tf_a1, true);
+}
+
+static
+int
+sc_munlock(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_mlock((userptr_t)tf->tf_a0, tf->tf_a1, false);
+}
+
+static
+int
+sc_vmstat(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_vmstat(tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_threadfork(struct trapframe *tf, int32_t *retval)
+{
+	return sys_threadfork((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+			      retval);
+}
+#endif
+
+/*
+ * The dispatch table, indexed by call number. Unimplemented calls
+ * are left NULL and fail with ENOSYS.
+ */
+static const syscall_handler syscall_table[SYSSTAT_NCALLS] = {
+	[SYS_reboot] = sc_reboot,
+	[SYS___time] = sc___time,
+	[SYS_nanosleep] = sc_nanosleep,
+
+	[SYS_fork] = sc_fork,
+	[SYS_vfork] = sc_vfork,
+	[SYS_execv] = sc_execv,
+	[SYS_spawnv] = sc_spawnv,
+	[SYS__exit] = sc__exit,
+	[SYS_waitpid] = sc_waitpid,
+	[SYS_getpid] = sc_getpid,
+	[SYS_setaffinity] = sc_setaffinity,
+	[SYS_getrusage] = sc_getrusage,
+	[SYS_getrlimit] = sc_getrlimit,
+	[SYS_setrlimit] = sc_setrlimit,
+	[SYS_getpriority] = sc_getpriority,
+	[SYS_setpriority] = sc_setpriority,
+	[SYS_sched_setscheduler] = sc_sched_setscheduler,
+	[SYS_sched_getscheduler] = sc_sched_getscheduler,
+	[SYS_setgang] = sc_setgang,
+	[SYS_procstat] = sc_procstat,
+
+	[SYS_open] = sc_open,
+	[SYS_dup2] = sc_dup2,
+	[SYS_pipe] = sc_pipe,
+	[SYS_close] = sc_close,
+	[SYS_read] = sc_read,
+	[SYS_write] = sc_write,
+	[SYS_pread] = sc_pread,
+	[SYS_pwrite] = sc_pwrite,
+	[SYS_readv] = sc_readv,
+	[SYS_writev] = sc_writev,
+	[SYS_preadv] = sc_preadv,
+	[SYS_pwritev] = sc_pwritev,
+	[SYS_sendfile] = sc_sendfile,
+	[SYS_ioctl] = sc_ioctl,
+	[SYS_poll] = sc_poll,
+	[SYS_semwait] = sc_semwait,
+	[SYS_sempost] = sc_sempost,
+	[SYS_mq_create] = sc_mq_create,
+	[SYS_mq_send] = sc_mq_send,
+	[SYS_mq_receive] = sc_mq_receive,
+	[SYS_futex] = sc_futex,
+	[SYS_sysstat] = sc_sysstat,
+	[SYS_lseek] = sc_lseek,
+	[SYS_chdir] = sc_chdir,
+	[SYS___getcwd] = sc___getcwd,
+	[SYS_sync] = sc_sync,
+	[SYS_bufstat] = sc_bufstat,
+	[SYS_mkdir] = sc_mkdir,
+	[SYS_rmdir] = sc_rmdir,
+	[SYS_remove] = sc_remove,
+	[SYS_link] = sc_link,
+	[SYS_rename] = sc_rename,
+	[SYS_getdirentry] = sc_getdirentry,
+	[SYS_getdirentries] = sc_getdirentries,
+	[SYS_fstat] = sc_fstat,
+	[SYS_stat] = sc_stat,
+	[SYS_lstat] = sc_stat,
+	[SYS_fsync] = sc_fsync,
+	[SYS_ftruncate] = sc_ftruncate,
+	[SYS_fallocate] = sc_fallocate,
+
+#if !OPT_DUMBVM
+	[SYS_sbrk] = sc_sbrk,
+	[SYS_mmap] = sc_mmap,
+	[SYS_munmap] = sc_munmap,
+	[SYS_mprotect] = sc_mprotect,
+	[SYS_madvise] = sc_madvise,
+	[SYS_mincore] = sc_mincore,
+	[SYS_mlock] = sc_mlock,
+	[SYS_munlock] = sc_munlock,
+	[SYS_vmstat] = sc_vmstat,
+	[SYS___threadfork] = sc_threadfork,
+#endif
+};
+
 /*
  * System call dispatcher.
  *
@@ -83,12 +826,15 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+	struct timespec start;
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
 	KASSERT(curthread->t_iplhigh_count == 0);
 
 	callno = tf->tf_v0;
+	KTRACE(KTRACE_SYSCALL, callno, 0);
+	sysstat_enter(callno, &start);
 
 	/*
 	 * Initialize retval to 0. Many of the system calls don't
@@ -101,174 +847,17 @@ syscall(struct trapframe *tf)
 
 	retval = 0;
 
-	/* note the casts to userptr_t */
-
-	switch (callno) {
-	    case SYS_reboot:
-		err = sys_reboot(tf->tf_a0);
-		break;
-
-	    case SYS___time:
-		err = sys___time((userptr_t)tf->tf_a0,
-				 (userptr_t)tf->tf_a1);
-		break;
-
-
-	    /* process calls */
-
-	    case SYS_fork:
-		err = sys_fork(tf, &retval);
-		break;
-
-	    case SYS_execv:
-		err = sys_execv(
-			(userptr_t)tf->tf_a0,
-			(userptr_t)tf->tf_a1);
-		break;
-
-	    case SYS__exit:
-		sys__exit(tf->tf_a0);
-		panic("Returning from exit\n");
-
-	    case SYS_waitpid:
-		err = sys_waitpid(
-			tf->tf_a0,
-			(userptr_t)tf->tf_a1,
-			tf->tf_a2,
-			&retval);
-		break;
-
-	    case SYS_getpid:
-		err = sys_getpid(&retval);
-		break;
-
-
-	    /* file calls */
-
-	    case SYS_open:
-		err = sys_open(
-			(userptr_t)tf->tf_a0,
-			tf->tf_a1,
-			tf->tf_a2,
-			&retval);
-		break;
-
-	    case SYS_dup2:
-		err = sys_dup2(
-			tf->tf_a0,
-			tf->tf_a1,
-			&retval);
-		break;
-
-	    case SYS_close:
-		err = sys_close(tf->tf_a0);
-		break;
-
-	    case SYS_read:
-		err = sys_read(
-			tf->tf_a0,
-			(userptr_t)tf->tf_a1,
-			tf->tf_a2,
-			&retval);
-		break;
-	    case SYS_write:
-		err = sys_write(
-			tf->tf_a0,
-			(userptr_t)tf->tf_a1,
-			tf->tf_a2,
-			&retval);
-		break;
-	    case SYS_lseek:
-		{
-			/*
-			 * Because the position argument is 64 bits wide,
-			 * it goes in the a2/a3 registers and we have to
-			 * get "whence" from the stack. Furthermore, the
-			 * return value is 64 bits wide, so the extra
-			 * part of it goes in the v1 register.
-			 *
-			 * This is a trifle messy.
-			 */
-			uint64_t offset;
-			int whence;
-			off_t retval64;
-
-			join32to64(tf->tf_a2, tf->tf_a3, &offset);
-
-			err = copyin((userptr_t)tf->tf_sp + 16,
-				     &whence, sizeof(int));
-			if (err) {
-				break;
-			}
-
-			err = sys_lseek(tf->tf_a0, offset, whence, &retval64);
-			if (err) {
-				break;
-			}
-
-			split64to32(retval64, &tf->tf_v0, &tf->tf_v1);
-			retval = tf->tf_v0;
-		}
-		break;
-
-	    case SYS_chdir:
-		err = sys_chdir((userptr_t)tf->tf_a0);
-		break;
-
-	    case SYS___getcwd:
-		err = sys___getcwd(
-			(userptr_t)tf->tf_a0,
-			tf->tf_a1,
-			&retval);
-		break;
-
-
-	    case SYS_sync:
-		err = sys_sync();
-		break;
-	    case SYS_mkdir:
-		err = sys_mkdir((userptr_t)tf->tf_a0, tf->tf_a1);
-		break;
-	    case SYS_rmdir:
-		err = sys_rmdir((userptr_t)tf->tf_a0);
-		break;
-	    case SYS_remove:
-		err = sys_remove((userptr_t)tf->tf_a0);
-		break;
-	    case SYS_link:
-		err = sys_link((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
-		break;
-	    case SYS_rename:
-		err = sys_rename((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
-		break;
-	    case SYS_getdirentry:
-		err = sys_getdirentry(tf->tf_a0, (userptr_t)tf->tf_a1,
-				      tf->tf_a2, &retval);
-		break;
-	    case SYS_fstat:
-		err = sys_fstat(tf->tf_a0, (userptr_t)tf->tf_a1);
-		break;
-	    case SYS_fsync:
-		err = sys_fsync(tf->tf_a0);
-		break;
-	    case SYS_ftruncate:
-		{
-			/* Like lseek, the length is 64 bits and aligned */
-			uint64_t len;
-
-			join32to64(tf->tf_a2, tf->tf_a3, &len);
-			err = sys_ftruncate(tf->tf_a0, len);
-		}
-		break;
-
-
-
-	    default:
+	if (callno >= 0 && callno < SYSSTAT_NCALLS &&
+	    syscall_table[callno] != NULL) {
+		err = syscall_table[callno](tf, &retval);
+	}
+	else {
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
-		break;
 	}
 
+	KTRACE(KTRACE_SYSRET, callno, err);
+	sysstat_exit(callno, err, &start);
 
 	if (err) {
 		/*
@@ -39,11 +39,11 @@
 void
 thread_machdep_init(struct thread_machdep *tm)
 {
-	tm->tm_badfaultfunc = NULL;
+	tm->tm_intrframe = NULL;
 }
 
 void
 thread_machdep_cleanup(struct thread_machdep *tm)
 {
-	KASSERT(tm->tm_badfaultfunc == NULL);
+	(void)tm;
 }
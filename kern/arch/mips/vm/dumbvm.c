@@ -30,6 +30,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <uio.h>
+#include <vnode.h>
 #include <spl.h>
 #include <cpu.h>
 #include <spinlock.h>
@@ -38,6 +40,7 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kinfo.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -156,6 +159,20 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+bool
+vm_idle(void)
+{
+	/* Nothing to do in the background. */
+	return false;
+}
+
+bool
+vm_reclaim(void)
+{
+	/* No caches to shrink, and no killing; just exited processes. */
+	return as_reap_wait();
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -172,7 +189,10 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
+		/* Only the kernel information pages are read-only */
+		if (faultaddress >= KINFO_VADDR && faultaddress < KINFO_END) {
+			return EFAULT;
+		}
 		panic("dumbvm: got VM_FAULT_READONLY\n");
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
@@ -220,7 +240,15 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
 
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
+	if (faultaddress >= KINFO_VADDR && faultaddress < KINFO_END) {
+		/* Read-only, see below */
+		if (faulttype == VM_FAULT_WRITE) {
+			return EFAULT;
+		}
+		paddr = faultaddress < KINFO_TIMEVADDR ?
+			KVADDR_TO_PADDR(as->as_kinfo) : kinfo_timepage();
+	}
+	else if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
@@ -246,6 +274,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+		if (faultaddress >= KINFO_VADDR && faultaddress < KINFO_END) {
+			elo &= ~TLBLO_DIRTY;
+		}
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
@@ -272,6 +303,12 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	as->as_kinfo = alloc_kpages(1);
+	if (as->as_kinfo == 0) {
+		kfree(as);
+		return NULL;
+	}
+	bzero((void *)as->as_kinfo, PAGE_SIZE);
 
 	return as;
 }
@@ -279,9 +316,16 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	free_kpages(as->as_kinfo);
 	kfree(as);
 }
 
+void
+as_setkinfo(struct addrspace *as, pid_t pid, pid_t ppid)
+{
+	kinfo_set(as->as_kinfo, pid, ppid);
+}
+
 void
 as_activate(void)
 {
@@ -384,6 +428,32 @@ as_prepare_load(struct addrspace *as)
 	return 0;
 }
 
+/*
+ * No demand paging here; just read the segment in now, through the
+ * (already active) address space.
+ */
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr,
+		  struct vnode *vn, off_t offset, size_t filesize)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	uio_uinit(&iov, &u, (userptr_t)vaddr, filesize, offset, UIO_READ);
+	u.uio_space = as;
+
+	result = VOP_READ(vn, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+	return 0;
+}
+
 int
 as_complete_load(struct addrspace *as)
 {
@@ -151,3 +151,13 @@ ram_getfirstfree(void)
 	firstpaddr = lastpaddr = 0;
 	return ret;
 }
+
+/*
+ * Memory past kseg0's reach is left alone here; see unsw.c for a
+ * VM system that uses it.
+ */
+paddr_t
+ram_gethighsize(void)
+{
+	return 0;
+}
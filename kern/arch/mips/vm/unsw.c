@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/vmstat.h>
 #include <lib.h>
 #include <vm.h>
 #include <mainbus.h>
@@ -37,14 +38,52 @@ vaddr_t firstfree;   /* first free virtual address; set by start.S */
 
 static paddr_t firstpaddr;  /* address of first free physical page */
 static paddr_t lastpaddr;   /* one past end of last free physical page */
+static paddr_t highsize;    /* bytes of high memory, from MIPS_KSEG0_RAMTOP */
 
 
 
+/*
+ * Reverse map of a user frame shared copy-on-write: one of these per
+ * page table entry mapping it. See frame_share.
+ */
+struct frame_rmap {
+        struct addrspace *as;
+        vaddr_t vaddr;
+        struct frame_rmap *next;
+};
+
+/*
+ * One of these per physical frame, packed into 16 bytes so that four
+ * share a cache line: the flags and reference count in one word, then
+ * the free list links of a free block, which overlay the owner of an
+ * allocated frame since no frame needs both. Only the head frame of a
+ * free block has its links set; every frame handed out gets its owner
+ * cleared.
+ */
 typedef struct ft_entry {
         unsigned allocated:1; /* the corresponding frame is allocated */
         unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        unsigned free_head:1; /* the frame heads a block on a free list */
+        unsigned order:4; /* log2 size of that free block */
+        unsigned kmalloc_type:4; /* kmalloc size class + 1, or 0 */
+        unsigned refcount:21; /* number of mappings sharing the frame */
+        union {
+                struct {
+                        /* free list links, valid if free_head */
+                        uint32_t next_free;
+                        uint32_t prev_free;
+                };
+                struct {
+                        /* sole user mapping, for page-out, if allocated */
+                        struct addrspace *owner;
+                        vaddr_t owner_vaddr;
+                };
+        };
+        struct frame_rmap *rmap; /* every mapping, if shared and known */
 } ft_entry_t;
 
+#define FT_REFCOUNT_MAX ((1U << 21) - 1)
+
 
 static ft_entry_t * frame_table = NULL; /* base of frame table */
 static uint32_t first_frame;
@@ -54,12 +93,199 @@ static uint32_t last_frame;
 #define TRUE 1
 #define FALSE 0
 
+/*
+ * Free frames are kept in a binary buddy system: free_list[k] holds
+ * blocks of 2^k frames aligned on a 2^k frame boundary. Frame 0 always
+ * belongs to the kernel, so it doubles as the end-of-list marker.
+ */
+#define MAX_ORDER 10 /* largest block is 2^10 frames (4MB) */
+#define FRAME_NONE 0
+
+/*
+ * High memory frames, from HIGH_FRAME up, have free lists of their
+ * own, so that only frame_alloc_high hands them out; the buddy blocks
+ * never straddle HIGH_FRAME, which is far more aligned than MAX_ORDER.
+ * Frames between the end of low RAM and HIGH_FRAME (the I/O area) are
+ * marked allocated for good.
+ */
+#define POOL_LOW  0
+#define POOL_HIGH 1
+#define NPOOLS    2
+#define HIGH_FRAME (MIPS_KSEG0_RAMTOP >> PAGE_BITS)
+#define FRAME_POOL(i) ((i) >= HIGH_FRAME ? POOL_HIGH : POOL_LOW)
+
+static uint32_t free_list[NPOOLS][MAX_ORDER + 1];
+static unsigned nfree; /* frames on the free lists */
+static unsigned nfree_high; /* of which high memory */
+static unsigned nframes; /* frames that were free at boot */
+
+/*
+ * Memory pressure watermarks, in free frames; see frame_pressure. The
+ * frames below frames_min are kept for the kernel: user pages are
+ * paged out for instead.
+ */
+#define WMARK_HIGH_DIV 16 /* frames_high is a 16th of RAM */
+#define WMARK_MIN_DIV  64 /* frames_min a 64th */
+#define WMARK_MIN      4
+static unsigned frames_high;
+static unsigned frames_min;
+
+/* where frame_choose_victim resumes its sweep */
+static uint32_t victim_hand;
+static int victim_policy = VICTIM_CLOCK;
+static unsigned victim_chosen;         /* frames handed out for page-out */
+static unsigned victim_second_chances; /* referenced frames passed over */
+static unsigned victim_busy_passes;    /* frames of active processes passed over */
+
+/*
+ * How many frames of active address spaces frame_choose_victim looks
+ * past for an idle one before going back for the first it saw.
+ */
+#define VICTIM_BUSY_SKIP 64
+
+/*
+ * The order of the largest block alloc_multiple_frames has failed to
+ * find since frame_compact_wanted last asked, or -1.
+ */
+static int compact_wanted = -1;
+
+/*
+ * Spare reverse map entries. They're allocated with kmalloc, which
+ * can't be called with the frame table lock held, so frame_share
+ * stocks up beforehand; ones no longer needed come back here rather
+ * than being freed, for the same reason.
+ */
+static struct frame_rmap *rmap_spares;
+static unsigned rmap_nspares;
+static unsigned rmap_nused;
+
 
 /* frame_table protected by spinlock (interrupt disabling on
  * uniprocessor) as this implementation does not block.
  */ 
 
-static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock_stats frame_table_lockstats =
+    SPINLOCK_STATS_INITIALIZER("frame table");
+static struct spinlock frame_table_spinlock =
+    SPINLOCK_INITIALIZER_STATS(&frame_table_lockstats);
+
+/*
+ * Buddy system helpers. All of these are called with
+ * frame_table_spinlock held (or during bootstrap).
+ */
+
+static void free_list_push(uint32_t i, unsigned order)
+{
+        uint32_t *head = &free_list[FRAME_POOL(i)][order];
+
+        frame_table[i].free_head = TRUE;
+        frame_table[i].order = order;
+        frame_table[i].prev_free = FRAME_NONE;
+        frame_table[i].next_free = *head;
+        if (*head != FRAME_NONE) {
+                frame_table[*head].prev_free = i;
+        }
+        *head = i;
+        nfree += 1 << order;
+        if (FRAME_POOL(i) == POOL_HIGH) {
+                nfree_high += 1 << order;
+        }
+}
+
+static void free_list_remove(uint32_t i)
+{
+        uint32_t prev, next;
+
+        KASSERT(frame_table[i].free_head == TRUE);
+
+        prev = frame_table[i].prev_free;
+        next = frame_table[i].next_free;
+        if (prev != FRAME_NONE) {
+                frame_table[prev].next_free = next;
+        }
+        else {
+                free_list[FRAME_POOL(i)][frame_table[i].order] = next;
+        }
+        if (next != FRAME_NONE) {
+                frame_table[next].prev_free = prev;
+        }
+        frame_table[i].free_head = FALSE;
+        nfree -= 1 << frame_table[i].order;
+        if (FRAME_POOL(i) == POOL_HIGH) {
+                nfree_high -= 1 << frame_table[i].order;
+        }
+}
+
+/*
+ * Return the block of 2^order frames starting at frame i, merging it
+ * with its buddy for as long as the buddy is also free.
+ */
+static void buddy_free(uint32_t i, unsigned order)
+{
+        uint32_t buddy;
+
+        while (order < MAX_ORDER) {
+                buddy = i ^ (1 << order);
+                if (buddy >= last_frame ||
+                    frame_table[buddy].free_head == FALSE ||
+                    frame_table[buddy].order != order) {
+                        break;
+                }
+                free_list_remove(buddy);
+                i &= buddy; /* the merged block starts at the lower half */
+                order++;
+        }
+        free_list_push(i, order);
+}
+
+/*
+ * Take a block of 2^order frames off the free lists of POOL, splitting
+ * a larger block if need be. Returns FRAME_NONE if nothing is big enough.
+ */
+static uint32_t buddy_alloc(unsigned pool, unsigned order)
+{
+        unsigned k;
+        uint32_t i;
+
+        for (k = order; k <= MAX_ORDER; k++) {
+                if (free_list[pool][k] != FRAME_NONE) {
+                        break;
+                }
+        }
+        if (k > MAX_ORDER) {
+                return FRAME_NONE;
+        }
+
+        i = free_list[pool][k];
+        free_list_remove(i);
+
+        /* hand back the upper halves we don't need */
+        while (k > order) {
+                k--;
+                free_list_push(i + (1 << k), k);
+        }
+        return i;
+}
+
+/*
+ * Free the frames [start, end) by breaking the range into the largest
+ * aligned buddy blocks that fit.
+ */
+static void free_range(uint32_t start, uint32_t end)
+{
+        unsigned order;
+
+        while (start < end) {
+                order = 0;
+                while (order < MAX_ORDER &&
+                       (start & ((2 << order) - 1)) == 0 &&
+                       start + (2 << order) <= end) {
+                        order++;
+                }
+                buddy_free(start, order);
+                start += 1 << order;
+        }
+}
 
 /*
  * Called very early in system boot to figure out how much physical
@@ -93,8 +319,22 @@ ram_bootstrap(void)
 	 */
 	firstpaddr = firstfree - MIPS_KSEG0;
 
+	/*
+	 * Anything past kseg0 is high memory, which carries on from
+	 * MIPS_KSEG0_RAMTOP. Stop short of the top of the physical
+	 * address space, so frame numbers and the frame table's size
+	 * don't overflow.
+	 */
+	highsize = mainbus_highramsize() & PAGE_FRAME;
+	if (highsize > 0xf0000000 - MIPS_KSEG0_RAMTOP) {
+		highsize = 0xf0000000 - MIPS_KSEG0_RAMTOP;
+	}
+
 	kprintf("%uk physical memory available\n",
 		(lastpaddr-firstpaddr)/1024);
+	if (highsize > 0) {
+		kprintf("%uk high memory available\n", highsize/1024);
+	}
 
         /*
          * Now do a little sanity checking of assumptions
@@ -103,8 +343,16 @@ ram_bootstrap(void)
 
         KASSERT((firstpaddr & PAGE_FRAME) == firstpaddr);
 	KASSERT((lastpaddr & PAGE_FRAME) == lastpaddr);
+        COMPILE_ASSERT(sizeof(ft_entry_t) == 16);
+        COMPILE_ASSERT(MAX_ORDER < 16);
 
-        npages = lastpaddr / PAGE_SIZE; /* number of pages in ram */
+        /* number of pages in ram, counting the I/O area for high memory */
+        if (highsize > 0) {
+                npages = (MIPS_KSEG0_RAMTOP + highsize) / PAGE_SIZE;
+        }
+        else {
+                npages = lastpaddr / PAGE_SIZE;
+        }
         last_frame = npages;
 
         frametable_size = npages * sizeof(ft_entry_t);
@@ -120,29 +368,56 @@ ram_bootstrap(void)
                 
         }
 
-        /* Now initialise the frame table in two ranges. */
-
-        /* The first range of frames are used by the kernel already
-         * and frametable itself, so mark as used.
+        /*
+         * Now initialise the frame table. An entry of all zeroes is
+         * a free frame not (yet) at the head of a free block, which
+         * is what the free frames, the rest of low memory and high
+         * memory, start out as. So clear the whole table in one go,
+         * which with a large high memory is much quicker than setting
+         * each entry's bitfields one by one, and then mark allocated,
+         * as individual pages, the kernel and frametable itself and
+         * any I/O area below high memory, which stay that way.
          */
 
-        for (i = 0; i < (firstpaddr >> PAGE_BITS); i++) {
-                /* Mark as allocated as individual pages */
-                frame_table[i].allocated = TRUE;
-                frame_table[i].not_last = FALSE;
-        }                                            
-        
-        /* 
-         * The second range of frames are free
-         */
-        
+        bzero(frame_table, last_frame * sizeof(ft_entry_t));
         first_frame = firstpaddr >> PAGE_BITS;
-        
-        for (i = first_frame; i < (lastpaddr >> PAGE_BITS); i++) {
-                frame_table[i].allocated = FALSE;
+
+        for (i = 0; i < last_frame; i++) {
+                if (i == first_frame) {
+                        /* skip to the I/O area, if any */
+                        i = lastpaddr >> PAGE_BITS;
+                        if (i >= last_frame || i >= HIGH_FRAME) {
+                                break;
+                        }
+                }
+                if (i == HIGH_FRAME) {
+                        break;
+                }
+                frame_table[i].allocated = TRUE;
+                frame_table[i].refcount = 1;
         }
+        victim_hand = first_frame;
 
-        
+        for (i = 0; i <= MAX_ORDER; i++) {
+                free_list[POOL_LOW][i] = FRAME_NONE;
+                free_list[POOL_HIGH][i] = FRAME_NONE;
+        }
+        nfree = 0;
+        nfree_high = 0;
+        free_range(first_frame, lastpaddr >> PAGE_BITS);
+        if (last_frame > HIGH_FRAME) {
+                free_range(HIGH_FRAME, last_frame);
+        }
+        nframes = nfree;
+
+        frames_min = nframes / WMARK_MIN_DIV;
+        if (frames_min < WMARK_MIN) {
+                frames_min = WMARK_MIN;
+        }
+        frames_high = nframes / WMARK_HIGH_DIV;
+        if (frames_high < 2 * frames_min) {
+                frames_high = 2 * frames_min;
+        }
 }
 
 /*
@@ -189,109 +464,199 @@ ram_getfirstfree(void)
 }
 
 /*
- * This is a relatively inefficient first-fit allocator. Single pages
- * always fit. Multiframe allocations can suffer from external
- * fragmentation. It is intended to be easy to understand and robust,
- * not efficient.
+ * The frame table manages high memory itself (see frame_alloc_high);
+ * this only reports how much there is.
  */
+paddr_t
+ram_gethighsize(void)
+{
+	return highsize;
+}
 
+/*
+ * Frames come from the buddy free lists, so allocating or freeing a
+ * single frame takes time bounded by MAX_ORDER rather than by how much
+ * of memory is in use. A multiframe allocation takes the smallest block
+ * that fits and returns the unused tail to the free lists straight away.
+ */
+
+/*
+ * Reverse map helpers, called with frame_table_spinlock held.
+ */
 
-static paddr_t alloc_one_frame(unsigned int npages)
+static struct frame_rmap *rmap_get(void)
 {
-        unsigned int i;
+        struct frame_rmap *r;
 
-        /* 
-         * Just scan from the start of the frame_table array for an
-         * unallocated block
-         */
-        
-        KASSERT(npages == 1);
+        r = rmap_spares;
+        if (r != NULL) {
+                rmap_spares = r->next;
+                rmap_nspares--;
+                rmap_nused++;
+        }
+        return r;
+}
 
-        spinlock_acquire(&frame_table_spinlock);
-        for (i =  first_frame; i < last_frame; i++) {
-                if (frame_table[i].allocated == FALSE) {
-                        frame_table[i].allocated = TRUE;
-                        frame_table[i].not_last = FALSE;
+static void rmap_put(struct frame_rmap *r)
+{
+        r->next = rmap_spares;
+        rmap_spares = r;
+        rmap_nspares++;
+        rmap_nused--;
+}
 
-                        spinlock_release(&frame_table_spinlock);
+/* Forget frame I's mappings; it is no longer known who they all are. */
+static void rmap_discard(uint32_t i)
+{
+        struct frame_rmap *r;
 
-                        return (paddr_t) (i << PAGE_BITS);
-                }
+        while ((r = frame_table[i].rmap) != NULL) {
+                frame_table[i].rmap = r->next;
+                rmap_put(r);
         }
-        
-        /* Did not find an unallocated frame :-( */
+}
+
+/*
+ * After a reference to frame I is dropped: a list that no longer
+ * matches the reference count is thrown away, and one down to a single
+ * mapping makes that mapping the owner, so the frame can be paged out
+ * again.
+ */
+static void rmap_settle(uint32_t i)
+{
+        struct frame_rmap *r;
+        unsigned n;
+
+        if (frame_table[i].rmap == NULL) {
+                return;
+        }
+        n = 0;
+        for (r = frame_table[i].rmap; r != NULL; r = r->next) {
+                n++;
+        }
+        if (n != frame_table[i].refcount) {
+                rmap_discard(i);
+        }
+        else if (n == 1) {
+                r = frame_table[i].rmap;
+                frame_table[i].owner = r->as;
+                frame_table[i].owner_vaddr = r->vaddr;
+                rmap_discard(i);
+        }
+}
+
+static paddr_t alloc_one_frame(unsigned int pool)
+{
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        i = buddy_alloc(pool, 0);
+        if (i == FRAME_NONE) {
+                /* Did not find an unallocated frame :-( */
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) 0;
+        }
+
+        KASSERT(frame_table[i].allocated == FALSE);
+        frame_table[i].allocated = TRUE;
+        frame_table[i].not_last = FALSE;
+        frame_table[i].refcount = 1;
+        frame_table[i].owner = NULL;
 
         spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+
+        return (paddr_t) (i << PAGE_BITS);
 }
 
 static paddr_t alloc_multiple_frames(unsigned int npages)
 {
-        unsigned int i,j;
+        unsigned int order;
+        uint32_t i, j;
 
-
-        /* scan from 'i' for the number of needed free frames. If an
-         * allocated frame is encountered, restart the scan from after
-         * that point.
-         */
-        
+        order = 0;
+        while ((1U << order) < npages) {
+                order++;
+        }
+        if (order > MAX_ORDER) {
+                return (paddr_t) 0;
+        }
 
         spinlock_acquire(&frame_table_spinlock);
 
-        i = first_frame; j = 0;
-
-        while (i < (last_frame - npages) && j < npages) {
-                if (frame_table[i+j].allocated == TRUE) {
-                        i = i + j + 1; /* continue scan after allocated frame */
-                        j = 0;         /* restart the count */
-                }
-                else {
-                        j = j + 1; /* increment count of free frames */
+        i = buddy_alloc(POOL_LOW, order);
+        if (i == FRAME_NONE) {
+                /* Did not find an unallocated contiguous range of frames :-( */
+                if ((int)order > compact_wanted) {
+                        compact_wanted = order;
                 }
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) 0;
         }
 
-        if  (j == npages) { /* we exited as we found the number of frames required. */
-                for (j = i; j < i + npages - 1; j++) {
-                        frame_table[j].allocated = TRUE; /* mark frame allocated */
-                        frame_table[j].not_last = TRUE;  /* as a contiguous block */
-                }
-                frame_table[j].allocated = TRUE;
-                frame_table[j].not_last = FALSE;
+        /* give back what we don't need of a rounded-up block */
+        free_range(i + npages, i + (1 << order));
 
-                spinlock_release(&frame_table_spinlock);
-                
-                return (paddr_t) (i << PAGE_BITS);
+        for (j = i; j < i + npages - 1; j++) {
+                frame_table[j].allocated = TRUE; /* mark frame allocated */
+                frame_table[j].not_last = TRUE;  /* as a contiguous block */
+                frame_table[j].owner = NULL;     /* over stale free links */
         }
-        
-        /* Did not find an unallocated contiguous range of frames :-( */
+        frame_table[j].allocated = TRUE;
+        frame_table[j].not_last = FALSE;
+        frame_table[j].owner = NULL;
+        frame_table[i].refcount = 1;
 
         spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+
+        return (paddr_t) (i << PAGE_BITS);
 }
 
-static void free_frames(vaddr_t vaddr)
+/* Drop a reference to the block starting at frame I; caller holds the lock */
+static void free_frames_locked(uint32_t i)
 {
-        paddr_t paddr;
-        uint32_t i;
+        uint32_t start;
 
-        KASSERT(vaddr != (vaddr_t) NULL);
-
-        paddr = KVADDR_TO_PADDR(vaddr);
-
-        i = paddr >> PAGE_BITS;
-
-        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
 
         if (frame_table[i].allocated == FALSE) { /* check for double free error */
                 panic("Double free error!!");
         }
-        
-        while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
+
+        /*
+         * A frame shared copy-on-write is only released when the
+         * last mapping goes away.
+         */
+        KASSERT(frame_table[i].refcount > 0);
+        if (--frame_table[i].refcount > 0) {
+                rmap_settle(i);
+                return;
+        }
+        rmap_discard(i);
+
+        start = i;
+        for (;;) { /* otherwise mark block free */
                 frame_table[i].allocated = FALSE;
-                if (frame_table[i].not_last == TRUE) {
-                        i++;
+                frame_table[i].kmalloc_type = 0;
+                frame_table[i].owner = NULL;
+                if (frame_table[i].not_last == FALSE) {
+                        break;
                 }
+                i++;
         }
+        free_range(start, i + 1);
+}
+
+static void free_frames(vaddr_t vaddr)
+{
+        paddr_t paddr;
+
+        KASSERT(vaddr != (vaddr_t) NULL);
+
+        paddr = KVADDR_TO_PADDR(vaddr);
+
+        spinlock_acquire(&frame_table_spinlock);
+        free_frames_locked(paddr >> PAGE_BITS);
         spinlock_release(&frame_table_spinlock);
 }
         
@@ -302,20 +667,732 @@ alloc_kpages(unsigned npages)
         paddr_t paddr;
         if (npages > 1 ) {
                 paddr = alloc_multiple_frames(npages);
+                if (paddr == 0) {
+                        /* no block that big free: map separate frames */
+                        vaddr_t vaddr = vm_kseg2_alloc(npages);
+                        if (vaddr != 0) {
+                                vmstat_inc(VMSTAT_FRAME_ALLOCS);
+                        }
+                        return vaddr;
+                }
         }
         else {
-                paddr = alloc_one_frame(npages);
+                KASSERT(npages == 1);
+                paddr = alloc_one_frame(POOL_LOW);
         }
         
 	if (paddr == 0) {
 		return 0;
 	}
+        vmstat_inc(VMSTAT_FRAME_ALLOCS);
 	return PADDR_TO_KVADDR(paddr);
 }
 
 void
 free_kpages(vaddr_t addr)
 {
-        free_frames(addr);
+        if (addr >= MIPS_KSEG2) {
+                vm_kseg2_free(addr);
+        }
+        else {
+                free_frames(addr);
+        }
+        vmstat_inc(VMSTAT_FRAME_FREES);
+}
+
+/*
+ * Allocate a single frame of high memory, for a user page; or return
+ * 0 if there is none free. The kernel can only get at it through
+ * vm_kmap.
+ */
+paddr_t
+frame_alloc_high(void)
+{
+        paddr_t paddr;
+
+        if (highsize == 0) {
+                return 0;
+        }
+        paddr = alloc_one_frame(POOL_HIGH);
+        if (paddr != 0) {
+                vmstat_inc(VMSTAT_FRAME_ALLOCS);
+        }
+        return paddr;
+}
+
+/* As free_kpages, for a single frame given by physical address. */
+void
+frame_free(paddr_t paddr)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].not_last == FALSE);
+        free_frames_locked(i);
+        spinlock_release(&frame_table_spinlock);
+        vmstat_inc(VMSTAT_FRAME_FREES);
+}
+
+/*
+ * Drop a reference to each of the N single frames in PADDRS, as
+ * free_kpages would, but taking the frame table lock only once.
+ */
+void
+frame_free_batch(const paddr_t *paddrs, unsigned n)
+{
+        unsigned j;
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (j = 0; j < n; j++) {
+                i = paddrs[j] >> PAGE_BITS;
+                KASSERT(i >= first_frame && i < last_frame);
+                KASSERT(frame_table[i].not_last == FALSE);
+                free_frames_locked(i);
+        }
+        spinlock_release(&frame_table_spinlock);
+        vmstat_add(VMSTAT_FRAME_FREES, n);
+}
+
+/*
+ * Add a reference to an allocated single frame, so that it can be
+ * mapped into more than one address space (copy-on-write). Each
+ * reference is dropped with free_kpages().
+ */
+void
+frame_incref(paddr_t paddr)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].not_last == FALSE);
+        KASSERT(frame_table[i].refcount < FT_REFCOUNT_MAX);
+        frame_table[i].refcount++;
+        /* a shared frame has no single owner, so it can't be paged out */
+        frame_table[i].owner = NULL;
+        /* nor, with a reference from who knows where, a full reverse map */
+        rmap_discard(i);
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Make sure there are at least N spare reverse map entries, as far as
+ * memory allows.
+ */
+static void rmap_reserve(unsigned n)
+{
+        struct frame_rmap *r;
+
+        while (rmap_nspares < n) {
+                r = kmalloc(sizeof(*r));
+                if (r == NULL) {
+                        return;
+                }
+                spinlock_acquire(&frame_table_spinlock);
+                rmap_nused++;
+                rmap_put(r);
+                spinlock_release(&frame_table_spinlock);
+        }
+}
+
+/*
+ * As frame_incref, for sharing the page at OLD_VADDR of OLD with page
+ * NEW_VADDR of NEW (the same page, for fork), but keeping track of
+ * both mappings. A frame that only OLD maps starts a list of the two;
+ * one with a list already gets NEW added to it. If the list can't be kept (a frame already shared
+ * some other way, or no memory for the entries), the frame just has no
+ * reverse map, as with frame_incref.
+ */
+void
+frame_share(paddr_t paddr, struct addrspace *old, vaddr_t old_vaddr,
+            struct addrspace *new, vaddr_t new_vaddr)
+{
+        struct frame_rmap *a, *b;
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        rmap_reserve(2);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].not_last == FALSE);
+        if (frame_table[i].rmap == NULL && frame_table[i].refcount == 1) {
+                /* OLD's is the only mapping: list it first */
+                a = rmap_get();
+                if (a != NULL) {
+                        a->as = old;
+                        a->vaddr = old_vaddr;
+                        a->next = NULL;
+                        frame_table[i].rmap = a;
+                }
+        }
+        b = frame_table[i].rmap == NULL ? NULL : rmap_get();
+        if (b != NULL) {
+                b->as = new;
+                b->vaddr = new_vaddr;
+                b->next = frame_table[i].rmap;
+                frame_table[i].rmap = b;
+        }
+        else {
+                rmap_discard(i);
+        }
+        KASSERT(frame_table[i].refcount < FT_REFCOUNT_MAX);
+        frame_table[i].refcount++;
+        frame_table[i].owner = NULL;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/* Take the entry for VADDR in AS off frame I's reverse map, if there. */
+static void rmap_remove(uint32_t i, struct addrspace *as, vaddr_t vaddr)
+{
+        struct frame_rmap **rp, *r;
+
+        for (rp = &frame_table[i].rmap; (r = *rp) != NULL; rp = &r->next) {
+                if (r->as == as && r->vaddr == vaddr) {
+                        *rp = r->next;
+                        rmap_put(r);
+                        return;
+                }
+        }
+}
+
+/*
+ * Drop the reference held by the mapping of PADDR at VADDR in AS, as
+ * free_kpages would, taking it off the frame's reverse map.
+ */
+void
+frame_unmap(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].not_last == FALSE);
+        rmap_remove(i, as, vaddr);
+        free_frames_locked(i);
+        spinlock_release(&frame_table_spinlock);
+        vmstat_inc(VMSTAT_FRAME_FREES);
+}
+
+/* frame_unmap for N mappings in AS at once, under one lock acquisition. */
+void
+frame_unmap_batch(struct addrspace *as, const paddr_t *paddrs,
+                  const vaddr_t *vaddrs, unsigned n)
+{
+        unsigned j;
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (j = 0; j < n; j++) {
+                i = paddrs[j] >> PAGE_BITS;
+                KASSERT(i >= first_frame && i < last_frame);
+                KASSERT(frame_table[i].not_last == FALSE);
+                rmap_remove(i, as, vaddrs[j]);
+                free_frames_locked(i);
+        }
+        spinlock_release(&frame_table_spinlock);
+        vmstat_add(VMSTAT_FRAME_FREES, n);
+}
+
+/*
+ * Return the number of references to an allocated frame. The answer
+ * is only stable if the caller holds the only reference; if it is
+ * greater than one it may drop at any time.
+ */
+unsigned
+frame_refcount(paddr_t paddr)
+{
+        uint32_t i;
+        unsigned ret;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        ret = frame_table[i].refcount;
+        spinlock_release(&frame_table_spinlock);
+
+        return ret;
+}
+
+/*
+ * Record that the single user mapping of an allocated frame is VADDR
+ * in address space AS (or, with AS NULL, forget it).
+ */
+void
+frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].not_last == FALSE);
+        KASSERT(as == NULL || frame_table[i].refcount == 1);
+        KASSERT(as == NULL || frame_table[i].rmap == NULL);
+        frame_table[i].owner = as;
+        frame_table[i].owner_vaddr = vaddr;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Record that the allocated single frame PADDR is a kmalloc subpage
+ * page of size class TYPE, so that kfree can tell a block's size
+ * without searching the heap. Forgotten when the frame is freed.
+ */
+void
+frame_set_kmalloc_type(paddr_t paddr, unsigned type)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+        KASSERT(type < 15);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].not_last == FALSE);
+        frame_table[i].kmalloc_type = type + 1;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Return the size class recorded for frame PADDR, or -1 if it isn't a
+ * kmalloc subpage page. No lock is needed as long as the caller has a
+ * live block on the page, since the page can't change hands until that
+ * block is freed.
+ */
+int
+frame_kmalloc_type(paddr_t paddr)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        if (i < first_frame || i >= last_frame) {
+                return -1;
+        }
+        return (int)frame_table[i].kmalloc_type - 1;
+}
+
+/*
+ * For page merging: return the next frame from *CURSOR on that has an
+ * owner, handing back the owner, and move *CURSOR past it. At the end
+ * of the frame table, returns 0 and starts *CURSOR over. The caller
+ * must hold the VM lock, as for frame_choose_victim.
+ */
+paddr_t
+frame_next_owned(unsigned *cursor, struct addrspace **as_ret, vaddr_t *vaddr_ret)
+{
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (i = *cursor < first_frame ? first_frame : *cursor;
+             i < last_frame; i++) {
+                if (frame_table[i].allocated == TRUE &&
+                    frame_table[i].owner != NULL) {
+                        *as_ret = frame_table[i].owner;
+                        *vaddr_ret = frame_table[i].owner_vaddr;
+                        *cursor = i + 1;
+                        spinlock_release(&frame_table_spinlock);
+                        return (paddr_t) (i << PAGE_BITS);
+                }
+        }
+        *cursor = first_frame;
+        spinlock_release(&frame_table_spinlock);
+        return (paddr_t) 0;
+}
+
+/*
+ * Is PADDR still an anonymous user frame, whose mappings are all known?
+ * That is, does it have an owner (handed back in *AS_RET and
+ * *VADDR_RET) or a reverse map (*AS_RET is then NULL)? Only frames
+ * mapped read-only everywhere can have a reverse map. Needs the VM
+ * lock to mean anything.
+ */
+bool
+frame_mappings_known(paddr_t paddr, struct addrspace **as_ret,
+                     vaddr_t *vaddr_ret)
+{
+        uint32_t i;
+        bool ret;
+
+        i = paddr >> PAGE_BITS;
+        if (i < first_frame || i >= last_frame) {
+                return false;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+        ret = false;
+        if (frame_table[i].allocated == TRUE &&
+            frame_table[i].not_last == FALSE) {
+                if (frame_table[i].owner != NULL) {
+                        *as_ret = frame_table[i].owner;
+                        *vaddr_ret = frame_table[i].owner_vaddr;
+                        ret = true;
+                }
+                else if (frame_table[i].rmap != NULL) {
+                        *as_ret = NULL;
+                        ret = true;
+                }
+        }
+        spinlock_release(&frame_table_spinlock);
+        return ret;
+}
+
+/*
+ * Compaction (see vm_compact in vm.c) moves user frames whose mappings
+ * are all known out of a window of low memory, so that the window can
+ * be freed as a whole block. Free frames in the window are taken off
+ * the free lists while that happens, and each frame moved out is kept
+ * rather than freed; both are left allocated with no references, which
+ * nothing else in a window can look like. The caller must hold the VM
+ * lock throughout, which keeps the movable frames' mappings still.
+ */
+
+/* Can allocated frame I be moved, all its mappings being known? */
+static bool frame_movable(uint32_t i)
+{
+        return frame_table[i].not_last == FALSE &&
+                frame_table[i].kmalloc_type == 0 &&
+                frame_table[i].refcount > 0 &&
+                (frame_table[i].owner != NULL || frame_table[i].rmap != NULL);
+}
+
+/* Is frame I one that compaction is keeping? */
+static bool frame_compact_kept(uint32_t i)
+{
+        return frame_table[i].allocated == TRUE &&
+                frame_table[i].not_last == FALSE &&
+                frame_table[i].refcount == 0;
+}
+
+/*
+ * Return the order of the largest block alloc_kpages has failed to
+ * find since the last call, or -1 if there's none or one of that size
+ * has been freed since.
+ */
+int
+frame_compact_wanted(void)
+{
+        int order;
+        unsigned k;
+
+        spinlock_acquire(&frame_table_spinlock);
+        order = compact_wanted;
+        compact_wanted = -1;
+        for (k = order < 0 ? MAX_ORDER + 1 : order; k <= MAX_ORDER; k++) {
+                if (free_list[POOL_LOW][k] != FRAME_NONE) {
+                        order = -1;
+                        break;
+                }
+        }
+        spinlock_release(&frame_table_spinlock);
+        return order;
+}
+
+/*
+ * Find the next window of 2^ORDER frames of low memory from *CURSOR
+ * on in which every frame is either free or movable, take its free
+ * frames, and move *CURSOR past it. Returns its address, or 0 at the
+ * end of low memory, starting *CURSOR over.
+ */
+paddr_t
+frame_compact_isolate(unsigned order, unsigned *cursor)
+{
+        uint32_t n, start, end, i, j;
+
+        KASSERT(order <= MAX_ORDER);
+        n = 1 << order;
+        end = last_frame < HIGH_FRAME ? last_frame : HIGH_FRAME;
+
+        spinlock_acquire(&frame_table_spinlock);
+        start = *cursor < first_frame ? first_frame : *cursor;
+        start = (start + n - 1) & ~(n - 1);
+        for (; start + n <= end; start += n) {
+                i = start;
+                while (i < start + n) {
+                        if (frame_table[i].allocated == TRUE) {
+                                if (!frame_movable(i)) {
+                                        break;
+                                }
+                                i++;
+                        }
+                        else {
+                                /* a block bigger than the window holds it */
+                                if (frame_table[i].free_head == FALSE ||
+                                    frame_table[i].order > order) {
+                                        break;
+                                }
+                                i += 1 << frame_table[i].order;
+                        }
+                }
+                if (i < start + n) {
+                        continue;
+                }
+
+                for (i = start; i < start + n; i++) {
+                        if (frame_table[i].allocated == TRUE) {
+                                continue;
+                        }
+                        free_list_remove(i);
+                        for (j = i; j < i + (1U << frame_table[i].order); j++) {
+                                frame_table[j].allocated = TRUE;
+                                frame_table[j].not_last = FALSE;
+                                frame_table[j].refcount = 0;
+                                frame_table[j].owner = NULL;
+                        }
+                        i = j - 1;
+                }
+                *cursor = start + n;
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) (start << PAGE_BITS);
+        }
+        *cursor = 0;
+        spinlock_release(&frame_table_spinlock);
+        return (paddr_t) 0;
+}
+
+/*
+ * Hand back in AS_RET and VADDR_RET the mappings of frame PADDR, in a
+ * window from frame_compact_isolate, and return how many there are:
+ * 0 if the frame is kept already, or -1 if it can't be moved after
+ * all, having more than MAX.
+ */
+int
+frame_compact_mappings(paddr_t paddr, struct addrspace **as_ret,
+                       vaddr_t *vaddr_ret, unsigned max)
+{
+        struct frame_rmap *r;
+        uint32_t i;
+        int n;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < HIGH_FRAME && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        if (frame_compact_kept(i)) {
+                spinlock_release(&frame_table_spinlock);
+                return 0;
+        }
+        KASSERT(frame_table[i].allocated == TRUE && frame_movable(i));
+        if (frame_table[i].owner != NULL) {
+                as_ret[0] = frame_table[i].owner;
+                vaddr_ret[0] = frame_table[i].owner_vaddr;
+                spinlock_release(&frame_table_spinlock);
+                return 1;
+        }
+        n = 0;
+        for (r = frame_table[i].rmap; r != NULL; r = r->next) {
+                if ((unsigned)n == max) {
+                        spinlock_release(&frame_table_spinlock);
+                        return -1;
+                }
+                as_ret[n] = r->as;
+                vaddr_ret[n] = r->vaddr;
+                n++;
+        }
+        spinlock_release(&frame_table_spinlock);
+        return n;
+}
+
+/*
+ * The mappings of frame OLD, in a window, now point at the newly
+ * allocated single frame NEW instead: hand its references, owner, and
+ * reverse map over, and keep OLD for the window.
+ */
+void
+frame_compact_moved(paddr_t old, paddr_t new)
+{
+        uint32_t i, j;
+
+        i = old >> PAGE_BITS;
+        j = new >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+        KASSERT(j >= first_frame && j < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE && frame_movable(i));
+        KASSERT(frame_table[j].allocated == TRUE);
+        KASSERT(frame_table[j].not_last == FALSE);
+        KASSERT(frame_table[j].refcount == 1);
+        KASSERT(frame_table[j].rmap == NULL);
+        frame_table[j].refcount = frame_table[i].refcount;
+        frame_table[j].owner = frame_table[i].owner;
+        frame_table[j].owner_vaddr = frame_table[i].owner_vaddr;
+        frame_table[j].rmap = frame_table[i].rmap;
+        frame_table[i].refcount = 0;
+        frame_table[i].owner = NULL;
+        frame_table[i].rmap = NULL;
+        spinlock_release(&frame_table_spinlock);
+        vmstat_inc(VMSTAT_FRAME_FREES);
+}
+
+/*
+ * Free the frames kept in the window of 2^ORDER frames at START. If
+ * all of them were, that's a whole block.
+ */
+void
+frame_compact_release(paddr_t start, unsigned order)
+{
+        uint32_t i, j, end;
+
+        i = start >> PAGE_BITS;
+        end = i + (1 << order);
+        KASSERT(i >= first_frame && end <= last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        while (i < end) {
+                for (j = i; j < end && frame_compact_kept(j); j++) {
+                        frame_table[j].allocated = FALSE;
+                }
+                if (j > i) {
+                        free_range(i, j);
+                        i = j;
+                }
+                else {
+                        i++;
+                }
+        }
+        spinlock_release(&frame_table_spinlock);
 }
 
+void
+frame_set_victim_policy(int policy)
+{
+        KASSERT(policy == VICTIM_FIFO || policy == VICTIM_CLOCK);
+        victim_policy = policy;
+}
+
+/*
+ * Read without the lock: it's one word, and the answer is only ever a
+ * hint, as it may change straight after anyway.
+ */
+int
+frame_pressure(void)
+{
+        unsigned n = nfree;
+
+        if (n <= frames_min) {
+                return FRAME_PRESSURE_MIN;
+        }
+        if (n <= frames_high) {
+                return FRAME_PRESSURE_LOW;
+        }
+        return FRAME_PRESSURE_NONE;
+}
+
+void
+frame_printstats(void)
+{
+        spinlock_acquire(&frame_table_spinlock);
+        kprintf("Free frames: %u of %u (watermarks: high %u, min %u)\n",
+                nfree, nframes, frames_high, frames_min);
+        if (highsize > 0) {
+                kprintf("  %u of %u high memory frames free\n",
+                        nfree_high, last_frame - HIGH_FRAME);
+        }
+        kprintf("Page replacement: %s, hand at frame %u of %u-%u\n",
+                victim_policy == VICTIM_CLOCK ? "clock" : "fifo",
+                victim_hand, first_frame, last_frame - 1);
+        kprintf("  %u victims chosen, %u second chances, %u busy passed\n",
+                victim_chosen, victim_second_chances, victim_busy_passes);
+        kprintf("  %u reverse map entries in use, %u spare\n",
+                rmap_nused, rmap_nspares);
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Pick a frame to page out: one with a single owning user mapping,
+ * not pinned by mlock.
+ *
+ * Under VICTIM_CLOCK this is the second-chance algorithm: a page used
+ * since the hand last passed loses its referenced bit and is skipped
+ * (see vm_page_test_and_clear_referenced). Under VICTIM_FIFO the hand
+ * just takes the next eligible frame.
+ *
+ * Either way, unless looking in just one address space, frames whose
+ * owner vm_as_idle says is idle go first: up to VICTIM_BUSY_SKIP
+ * eligible frames of active ones are passed over looking for one,
+ * after which the first of them is taken after all. That one is still
+ * unreferenced, since the bit is only set again by a fault, which
+ * needs the VM lock.
+ *
+ * The caller must hold the VM lock, which keeps the owners' page
+ * tables still.
+ *
+ * Returns 0 if no frame qualifies.
+ */
+paddr_t
+frame_choose_victim(struct addrspace *only, struct addrspace **as_ret,
+                    vaddr_t *vaddr_ret)
+{
+        uint32_t n, i, busy = FRAME_NONE;
+        unsigned passed = 0;
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        /* two laps: the first may only be clearing referenced bits */
+        for (n = 0; n < 2 * (last_frame - first_frame); n++) {
+                i = victim_hand;
+                if (++victim_hand == last_frame) {
+                        victim_hand = first_frame;
+                }
+
+                if (frame_table[i].allocated == FALSE ||
+                    frame_table[i].owner == NULL ||
+                    (only != NULL && frame_table[i].owner != only)) {
+                        continue;
+                }
+                KASSERT(frame_table[i].refcount == 1);
+
+                if (vm_page_locked(frame_table[i].owner,
+                                   frame_table[i].owner_vaddr)) {
+                        continue;
+                }
+                if (victim_policy == VICTIM_CLOCK &&
+                    vm_page_test_and_clear_referenced(frame_table[i].owner,
+                                                      frame_table[i].owner_vaddr)) {
+                        victim_second_chances++;
+                        continue;
+                }
+                if (only == NULL && vm_as_idle(frame_table[i].owner) == FALSE) {
+                        if (busy == FRAME_NONE) {
+                                busy = i;
+                        }
+                        if (++passed < VICTIM_BUSY_SKIP) {
+                                victim_busy_passes++;
+                                continue;
+                        }
+                        i = busy;
+                }
+
+                *as_ret = frame_table[i].owner;
+                *vaddr_ret = frame_table[i].owner_vaddr;
+                victim_chosen++;
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) (i << PAGE_BITS);
+        }
+        if (busy != FRAME_NONE) {
+                *as_ret = frame_table[busy].owner;
+                *vaddr_ret = frame_table[busy].owner_vaddr;
+                victim_chosen++;
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) (busy << PAGE_BITS);
+        }
+        spinlock_release(&frame_table_spinlock);
+        return (paddr_t) 0;
+}
@@ -41,18 +41,11 @@
 #include <synch.h>
 #include <mainbus.h>
 #include <sys161/bus.h>
+#include <platform/cpufreq.h>
 #include <lamebus/lamebus.h>
 #include <lamebus/ltrace.h>
 #include "autoconf.h"
 
-/*
- * CPU frequency used by the on-chip timer.
- *
- * Note that we really ought to measure the CPU frequency against the
- * real-time clock instead of compiling it in like this.
- */
-#define CPU_FREQUENCY 25000000 /* 25 MHz */
-
 /*
  * Access to the on-chip timer.
  *
@@ -76,6 +69,53 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read c0_count ($9), the cycles since the timer last went off.
+ */
+static
+uint32_t
+mips_timer_count(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+/*
+ * Least number of cycles to set the timer ahead by, so that c0_count
+ * isn't past c0_compare by the time we've written it (which would
+ * mean waiting for the counter to wrap).
+ */
+#define MIPS_TIMER_MIN 100
+
+void
+mainbus_timer_set(uint32_t nsecs)
+{
+	uint32_t cycles;
+
+	cycles = nsecs / (1000000000 / CPU_FREQUENCY);
+	if (cycles < MIPS_TIMER_MIN) {
+		cycles = MIPS_TIMER_MIN;
+	}
+	mips_timer_set(mips_timer_count() + cycles);
+}
+
+/*
+ * Cycles since the timer last went off. Only good for timing things
+ * between two timer interrupts.
+ */
+uint32_t
+mainbus_cycles(void)
+{
+	return mips_timer_count();
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -115,8 +155,10 @@ mainbus_bootstrap(void)
 
 	/*
 	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
+	 * (From now, not from when it last went off: boot() may have put
+	 * it off for a while.)
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mainbus_timer_set(1000000000 / HZ);
 }
 
 /*
@@ -267,6 +309,24 @@ mainbus_ramsize(void)
 	return ramsize;
 }
 
+/*
+ * Get the size of the RAM that doesn't fit below the LAMEbus I/O
+ * area. A larger memory configuration carries on from 512 megabytes,
+ * past the I/O area; that is out of kseg0's reach, so only the VM
+ * system's high memory support uses it (see unsw.c).
+ */
+uint32_t
+mainbus_highramsize(void)
+{
+	uint32_t ramsize;
+
+	ramsize = lamebus_ramsize();
+	if (ramsize <= 508*1024*1024) {
+		return 0;
+	}
+	return ramsize - 508*1024*1024;
+}
+
 /*
  * Send IPI.
  */
@@ -314,10 +374,14 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 	if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
+		/*
+		 * Reset the timer (this clears the interrupt) to go
+		 * off a tick from now, and let the clock code decide
+		 * whether to call hardclock and when it really wants
+		 * the next interrupt.
+		 */
 		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
-		hardclock();
+		clock_interrupt();
 		seen = true;
 	}
 
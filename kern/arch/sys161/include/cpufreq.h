@@ -0,0 +1,15 @@
+/*
+ * CPU clock rate.
+ */
+
+#ifndef _SYS161_CPUFREQ_H_
+#define _SYS161_CPUFREQ_H_
+
+/*
+ * The rate the CPUs (and so the on-chip timer) run at, in Hz. We
+ * really ought to measure it against the real-time clock instead of
+ * compiling it in like this.
+ */
+#define CPU_FREQUENCY 25000000 /* 25 MHz */
+
+#endif /* _SYS161_CPUFREQ_H_ */
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# gensyms.sh - generate ksyms.c, the kernel's symbol table (see
+# <ksyms.h>), from "nm -n" output on standard input.
+#
+# The kernel is linked twice: once with a table made from no input,
+# then again with one made from the first link's symbols. The table
+# only adds data, so the code, and hence the function addresses,
+# don't move between the two.
+#
+# Usage: gensyms.sh < nm-output > ksyms.c
+#
+
+echo '/* This file is automatically generated. Edits will be lost.*/'
+echo '#include <types.h>'
+echo '#include <ksyms.h>'
+echo ''
+echo 'const struct ksym ksyms[] = {'
+awk '
+	$2 ~ /^[Tt]$/ && $3 ~ /^[A-Za-z_][A-Za-z0-9_.]*$/ {
+		printf("\t{ 0x%s, \"%s\" },\n", $1, $3);
+		n++;
+	}
+	END {
+		printf("\t{ 0, NULL }\n};\n");
+		printf("const unsigned nksyms = %d;\n", n);
+	}
+'
@@ -33,12 +33,21 @@
  * We expose a simple interface to the rest of the kernel: "putch" to
  * print a character, "getch" to read one.
  *
- * As long as the device we're connected to does, we allow printing in
- * an interrupt handler or with interrupts off (by polling),
+ * Output normally goes into a ring buffer of CONSOLE_OUTPUT_BUFFER_SIZE
+ * characters, and the device's write-done interrupt sends the next
+ * one, so writers only wait when the buffer is full. As long as the
+ * device we're connected to does, we allow printing in an interrupt
+ * handler or with interrupts off (by polling, bypassing the buffer),
  * transparently to the caller. Note that getch by polling is not
  * supported, although such support could be added without undue
  * difficulty.
  *
+ * Input is kept in a ring buffer by the interrupt handler until
+ * someone reads it. Reads from userland go through a simple line
+ * discipline: raw by default, handing over whatever has been typed up
+ * to a newline, or canonical (see CONIOC_SETCANON), in which a line is
+ * edited with echo and handed over only once it's finished.
+ *
  * Note that nothing happens until we have a device to write to. A
  * buffer of size DELAYBUFSIZE is used to hold output that is
  * generated before this point. This means that (1) using kprintf for
@@ -49,15 +58,19 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioctl.h>
 #include <lib.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
+#include <poll.h>
 #include "autoconf.h"
 
 /*
@@ -72,6 +85,12 @@ static struct con_softc *the_console = NULL;
 static struct lock *con_userlock_read = NULL;
 static struct lock *con_userlock_write = NULL;
 
+/*
+ * Pollers waiting for input or for room for output. Woken from the
+ * interrupt handler.
+ */
+static struct pollq con_pollq = POLLQ_INITIALIZER;
+
 //////////////////////////////////////////////////
 
 /*
@@ -122,6 +141,52 @@ putch_polled(struct con_softc *cs, int ch)
 
 //////////////////////////////////////////////////
 
+/*
+ * Start sending the next buffered character, if the device isn't
+ * busy with one already. Call with cs_outlock held.
+ */
+static
+void
+con_output_start(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+
+	if (cs->cs_sending || cs->cs_outcount == 0) {
+		return;
+	}
+	ch = cs->cs_outbuf[cs->cs_outhead];
+	cs->cs_outhead = (cs->cs_outhead + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_outcount--;
+	cs->cs_sending = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+/*
+ * Put LEN characters into the output buffer, waiting for room as
+ * needed, and get the device going.
+ */
+static
+void
+con_output(struct con_softc *cs, const char *buf, size_t len)
+{
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		while (cs->cs_outcount == CONSOLE_OUTPUT_BUFFER_SIZE) {
+			con_output_start(cs);
+			wchan_sleep(cs->cs_outwchan, &cs->cs_outlock);
+		}
+		cs->cs_outbuf[(cs->cs_outhead + cs->cs_outcount) %
+			      CONSOLE_OUTPUT_BUFFER_SIZE] = buf[i];
+		cs->cs_outcount++;
+	}
+	con_output_start(cs);
+	spinlock_release(&cs->cs_outlock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -129,8 +194,9 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	con_output(cs, &c, 1);
 }
 
 /*
@@ -174,6 +240,7 @@ con_input(void *vcs, int ch)
 	cs->cs_gotchars_head = nexthead;
 
 	V(cs->cs_rsem);
+	pollq_wakeup(&con_pollq);
 }
 
 /*
@@ -184,7 +251,12 @@ con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_outlock);
+	cs->cs_sending = false;
+	con_output_start(cs);
+	wchan_wakeall(cs->cs_outwchan, &cs->cs_outlock);
+	spinlock_release(&cs->cs_outlock);
+	pollq_wakeup(&con_pollq);
 }
 
 //////////////////////////////////////////////////
@@ -240,72 +312,247 @@ con_eachopen(struct device *dev, int openflags)
 	return 0;
 }
 
+/*
+ * Output is copied in from the user a chunk at a time, with newlines
+ * turned into CR-LF, and handed to the output buffer.
+ */
+#define CON_WRITECHUNK 128
+
 static
 int
-con_io(struct device *dev, struct uio *uio)
+con_write(struct con_softc *cs, struct uio *uio)
 {
+	char in[CON_WRITECHUNK], out[2 * CON_WRITECHUNK];
+	size_t len, olen, i;
 	int result;
-	char ch;
-	struct lock *lk;
 
-	(void)dev;  // unused
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > sizeof(in)) {
+			len = sizeof(in);
+		}
+		result = uiomove(in, len, uio);
+		if (result) {
+			return result;
+		}
+		olen = 0;
+		for (i=0; i<len; i++) {
+			if (in[i]=='\n') {
+				out[olen++] = '\r';
+			}
+			out[olen++] = in[i];
+		}
+		con_output(cs, out, olen);
+	}
+	return 0;
+}
 
-	if (uio->uio_rw==UIO_READ) {
-		lk = con_userlock_read;
+/*
+ * Canonical mode: take one character of input into the line being
+ * edited. Returns true when the line is finished, by a newline or by
+ * ^D (end of file if the line is empty).
+ */
+static
+bool
+con_edit(struct con_softc *cs, int ch)
+{
+	if (ch=='\r' || ch=='\n') {
+		cs->cs_line[cs->cs_linelen++] = '\n';
+		con_output(cs, "\r\n", 2);
+		return true;
 	}
-	else {
-		lk = con_userlock_write;
+	if (ch==4) {
+		/* ^D */
+		return true;
 	}
-
-	KASSERT(lk != NULL);
-	lock_acquire(lk);
-
-	while (uio->uio_resid > 0) {
-		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				break;
-			}
+	if (ch=='\b' || ch==127) {
+		if (cs->cs_linelen > 0) {
+			cs->cs_linelen--;
+			con_output(cs, "\b \b", 3);
 		}
-		else {
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+		return false;
+	}
+	if (ch==21) {
+		/* ^U - erase line */
+		while (cs->cs_linelen > 0) {
+			cs->cs_linelen--;
+			con_output(cs, "\b \b", 3);
 		}
+		return false;
+	}
+	if (ch==23) {
+		/* ^W - erase word */
+		while (cs->cs_linelen > 0 &&
+		       cs->cs_line[cs->cs_linelen-1]==' ') {
+			cs->cs_linelen--;
+			con_output(cs, "\b \b", 3);
+		}
+		while (cs->cs_linelen > 0 &&
+		       cs->cs_line[cs->cs_linelen-1]!=' ') {
+			cs->cs_linelen--;
+			con_output(cs, "\b \b", 3);
+		}
+		return false;
+	}
+	/* keep room for the newline */
+	if (((ch>=32 && ch<127) || ch=='\t') &&
+	    cs->cs_linelen < CONSOLE_LINE_MAX - 1) {
+		cs->cs_line[cs->cs_linelen++] = ch;
+		con_output(cs, &cs->cs_line[cs->cs_linelen-1], 1);
+		return false;
+	}
+	beep();
+	return false;
+}
+
+/*
+ * Canonical read: edit a line, unless part of one is left over from
+ * the last read, and hand over as much of it as fits.
+ */
+static
+int
+con_readline(struct con_softc *cs, struct uio *uio)
+{
+	size_t len;
+	int result;
+
+	while (!cs->cs_lineready) {
+		cs->cs_lineready = con_edit(cs, getch());
+	}
+
+	len = cs->cs_linelen - cs->cs_linepos;
+	if (len > uio->uio_resid) {
+		len = uio->uio_resid;
+	}
+	result = uiomove(cs->cs_line + cs->cs_linepos, len, uio);
+	if (result) {
+		return result;
+	}
+	cs->cs_linepos += len;
+	if (cs->cs_linepos == cs->cs_linelen) {
+		cs->cs_linelen = 0;
+		cs->cs_linepos = 0;
+		cs->cs_lineready = false;
 	}
-	lock_release(lk);
 	return 0;
 }
 
+/*
+ * Raw read: wait for one character, then take whatever else has come
+ * in already, up to a newline, and copy it all out at once.
+ */
+static
+int
+con_readraw(struct con_softc *cs, struct uio *uio)
+{
+	char buf[CONSOLE_INPUT_BUFFER_SIZE];
+	size_t len = 0;
+	char ch;
+
+	do {
+		ch = getch();
+		if (ch=='\r') {
+			ch = '\n';
+		}
+		buf[len++] = ch;
+	} while (ch != '\n' && len < sizeof(buf) && len < uio->uio_resid &&
+		 cs->cs_gotchars_head != cs->cs_gotchars_tail);
+
+	return uiomove(buf, len, uio);
+}
+
+static
+int
+con_io(struct device *dev, struct uio *uio)
+{
+	struct con_softc *cs = dev->d_data;
+	int result;
+
+	if (uio->uio_rw==UIO_WRITE) {
+		KASSERT(con_userlock_write != NULL);
+		lock_acquire(con_userlock_write);
+		result = con_write(cs, uio);
+		lock_release(con_userlock_write);
+		return result;
+	}
+
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	KASSERT(con_userlock_read != NULL);
+	lock_acquire(con_userlock_read);
+	if (cs->cs_canon) {
+		result = con_readline(cs, uio);
+	}
+	else {
+		result = con_readraw(cs, uio);
+	}
+	lock_release(con_userlock_read);
+	return result;
+}
+
+/*
+ * Get and set the line discipline mode. Switching modes throws away
+ * any partly edited line.
+ */
 static
 int
 con_ioctl(struct device *dev, int op, userptr_t data)
 {
-	/* No ioctls. */
-	(void)dev;
-	(void)op;
-	(void)data;
+	struct con_softc *cs = dev->d_data;
+	int canon, result;
+
+	switch (op) {
+	    case CONIOC_GETCANON:
+		canon = cs->cs_canon;
+		return copyout(&canon, data, sizeof(canon));
+	    case CONIOC_SETCANON:
+		result = copyin(data, &canon, sizeof(canon));
+		if (result) {
+			return result;
+		}
+		lock_acquire(con_userlock_read);
+		if (cs->cs_canon != (canon != 0)) {
+			cs->cs_canon = (canon != 0);
+			cs->cs_linelen = 0;
+			cs->cs_linepos = 0;
+			cs->cs_lineready = false;
+		}
+		lock_release(con_userlock_read);
+		return 0;
+	}
 	return EINVAL;
 }
 
+/*
+ * Input is ready if any characters have come in. (A read continues
+ * until a newline, though, so it may still wait for the rest of the
+ * line.) Output is ready while there's room in the buffer.
+ */
+static
+int
+con_poll(struct device *dev, struct pollentry *pe)
+{
+	struct con_softc *cs = dev->d_data;
+	int ret;
+
+	pollq_register(&con_pollq, pe);
+	ret = 0;
+	if (cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+		ret |= POLLIN;
+	}
+	if (cs->cs_outcount < CONSOLE_OUTPUT_BUFFER_SIZE) {
+		ret |= POLLOUT;
+	}
+	return ret;
+}
+
 static const struct device_ops console_devops = {
 	.devop_eachopen = con_eachopen,
 	.devop_io = con_io,
 	.devop_ioctl = con_ioctl,
+	.devop_poll = con_poll,
 };
 
 static
@@ -323,6 +570,7 @@ attach_console_to_vfs(struct con_softc *cs)
 	dev->d_ops = &console_devops;
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
+	dev->d_stats = NULL;
 	dev->d_data = cs;
 
 	result = vfs_adddev("con", dev, 0);
@@ -343,7 +591,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *wwc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -363,29 +612,37 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	wwc = wchan_create("console write");
+	if (wwc == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	cs->cs_canon = false;
+	cs->cs_linelen = 0;
+	cs->cs_linepos = 0;
+	cs->cs_lineready = false;
+	spinlock_init(&cs->cs_outlock);
+	cs->cs_outwchan = wwc;
+	cs->cs_outhead = 0;
+	cs->cs_outcount = 0;
+	cs->cs_sending = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
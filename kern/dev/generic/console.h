@@ -30,6 +30,8 @@
 #ifndef _GENERIC_CONSOLE_H_
 #define _GENERIC_CONSOLE_H_
 
+#include <spinlock.h>
+
 /*
  * Device data for the hardware-independent system console.
  *
@@ -37,7 +39,9 @@
  * device, and are to be initialized by the attach routine.
  */
 
-#define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_INPUT_BUFFER_SIZE 256
+#define CONSOLE_LINE_MAX 256
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -47,10 +51,24 @@ struct con_softc {
 
 	/* initialized by config routine */
 	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+
+	/* line discipline; protected by the console read lock */
+	bool cs_canon;			/* edit input a line at a time */
+	char cs_line[CONSOLE_LINE_MAX];	/* the line being edited or read */
+	unsigned cs_linelen;
+	unsigned cs_linepos;		/* how much has been read */
+	bool cs_lineready;		/* finished, and may be read */
+
+	/* output waiting for the device; protected by cs_outlock */
+	struct spinlock cs_outlock;
+	struct wchan *cs_outwchan;	/* writers waiting for room */
+	unsigned char cs_outbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_outhead;		/* next char to send */
+	unsigned cs_outcount;		/* how many there are */
+	bool cs_sending;		/* the device is busy with one */
 };
 
 /*
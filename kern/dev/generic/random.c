@@ -32,7 +32,11 @@
 #include <kern/fcntl.h>
 #include <lib.h>
 #include <uio.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vfs.h>
+#include <platform/maxcpus.h>
 #include <generic/random.h>
 #include "autoconf.h"
 
@@ -45,10 +49,59 @@
  * The kernel config mechanism can be used to explicitly choose which
  * of the available random sources to use, if more than one is
  * available.
+ *
+ * Each CPU keeps a pool of RANDOM_POOLWORDS words, refilled from the
+ * device all at once when it runs dry, and random() and reads of the
+ * device are served from it; it is touched only by its own CPU, at
+ * splhigh, so it needs no lock. Each CPU also runs a xorshift
+ * generator, seeded from its pool the first time it's used, behind
+ * prandom().
  */
 
+#define RANDOM_POOLWORDS 64
+
 static struct random_softc *the_random = NULL;
 
+static struct random_percpu {
+	uint32_t rp_pool[RANDOM_POOLWORDS];	/* Words not handed out yet */
+	unsigned rp_avail;			/* How many of them */
+	uint32_t rp_prng[4];			/* xorshift128 state */
+	bool rp_seeded;				/* rp_prng came from the device */
+} random_percpu[MAXCPUS];
+
+/*
+ * This CPU's state. Call at splhigh, so we can't be moved elsewhere.
+ */
+static
+struct random_percpu *
+random_mine(void)
+{
+	return &random_percpu[CURCPU_EXISTS() ? curcpu->c_number : 0];
+}
+
+/*
+ * Take up to N words from this CPU's pool into BUF, refilling it
+ * first if it's empty. Returns how many were taken. Call at splhigh.
+ */
+static
+unsigned
+random_take(uint32_t *buf, unsigned n)
+{
+	struct random_percpu *rp = random_mine();
+
+	if (rp->rp_avail == 0) {
+		the_random->rs_fill(the_random->rs_devdata, rp->rp_pool,
+				    RANDOM_POOLWORDS);
+		rp->rp_avail = RANDOM_POOLWORDS;
+	}
+	if (n > rp->rp_avail) {
+		n = rp->rp_avail;
+	}
+	rp->rp_avail -= n;
+	memcpy(buf, &rp->rp_pool[rp->rp_avail], n * sizeof(uint32_t));
+	return n;
+}
+
 /*
  * VFS device functions.
  * open: allow reading only.
@@ -67,19 +120,38 @@ randeachopen(struct device *dev, int openflags)
 }
 
 /*
- * VFS I/O function. Hand off to implementation.
+ * VFS I/O function. Copy out from the pool a block at a time.
  */
 static
 int
 randio(struct device *dev, struct uio *uio)
 {
-	struct random_softc *rs = dev->d_data;
+	uint32_t buf[RANDOM_POOLWORDS];
+	unsigned n;
+	int spl, result;
+
+	(void)dev;
 
 	if (uio->uio_rw != UIO_READ) {
 		return EIO;
 	}
 
-	return rs->rs_read(rs->rs_devdata, uio);
+	while (uio->uio_resid > 0) {
+		n = DIVROUNDUP(uio->uio_resid, sizeof(uint32_t));
+		if (n > RANDOM_POOLWORDS) {
+			n = RANDOM_POOLWORDS;
+		}
+		spl = splhigh();
+		n = random_take(buf, n);
+		splx(spl);
+
+		result = uiomove(buf, n * sizeof(uint32_t), uio);
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
 }
 
 /*
@@ -123,6 +195,7 @@ config_random(struct random_softc *rs, int unit)
 	rs->rs_dev.d_ops = &random_devops;
 	rs->rs_dev.d_blocks = 0;
 	rs->rs_dev.d_blocksize = 1;
+	rs->rs_dev.d_stats = NULL;
 	rs->rs_dev.d_data = rs;
 
 	/* Add the VFS device structure to the VFS device list. */
@@ -142,10 +215,55 @@ config_random(struct random_softc *rs, int unit)
 uint32_t
 random(void)
 {
+	uint32_t val;
+	int spl;
+
 	if (the_random==NULL) {
 		panic("No random device\n");
 	}
-	return the_random->rs_random(the_random->rs_devdata);
+	spl = splhigh();
+	random_take(&val, 1);
+	splx(spl);
+	return val;
+}
+
+/*
+ * Until the random device is attached, generators start from a fixed
+ * seed, and are seeded properly the first time after.
+ */
+uint32_t
+prandom(void)
+{
+	struct random_percpu *rp;
+	uint32_t t;
+	unsigned n;
+	int spl;
+
+	spl = splhigh();
+	rp = random_mine();
+	if (!rp->rp_seeded) {
+		if (the_random != NULL) {
+			/* the pool may have fewer than 4 left; it refills */
+			for (n = 0; n < 4; ) {
+				n += random_take(&rp->rp_prng[n], 4 - n);
+			}
+			rp->rp_seeded = true;
+		}
+		if ((rp->rp_prng[0] | rp->rp_prng[1] |
+		     rp->rp_prng[2] | rp->rp_prng[3]) == 0) {
+			/* all zeros would stay zeros */
+			rp->rp_prng[0] = 0x9e3779b9 + (rp - random_percpu);
+		}
+	}
+
+	t = rp->rp_prng[0] ^ (rp->rp_prng[0] << 11);
+	rp->rp_prng[0] = rp->rp_prng[1];
+	rp->rp_prng[1] = rp->rp_prng[2];
+	rp->rp_prng[2] = rp->rp_prng[3];
+	rp->rp_prng[3] ^= (rp->rp_prng[3] >> 19) ^ t ^ (t >> 8);
+	t = rp->rp_prng[3];
+	splx(spl);
+	return t;
 }
 
 uint32_t
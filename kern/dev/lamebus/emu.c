@@ -44,11 +44,13 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <stat.h>
+#include <limits.h>
 #include <lib.h>
 #include <array.h>
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <vm.h>
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
@@ -414,6 +416,580 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 static int emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			   struct emufs_vnode **ret);
 
+/*
+ * Page cache.
+ *
+ * The host files can only be got at through the device's one I/O
+ * buffer, a request at a time, so reading a program in for exec is a
+ * long string of round trips. Files' pages are therefore kept once
+ * read, up to EMUFS_CACHEPAGES of them in all, and reads that find
+ * them don't go near the device or e_lock. Misses are read in a run
+ * of EMU_MAXIO at a time.
+ *
+ * Every lookup opens a new hardware handle, and so gets a new vnode,
+ * whose pages would go with it at the last close. So the results of
+ * the last EMUFS_NAMES lookups are also remembered, each holding a
+ * reference to the file and to the directory it was looked up in,
+ * and looking the same path up again hands back the same vnode
+ * without a round trip to the host. Directories are remembered too,
+ * for chdir and for the parents of names being created: as emufs
+ * can't remove or rename anything, a name once found stays good.
+ * Names found not to be there are remembered as well, since searching
+ * PATH looks for each command in several directories; those are all
+ * forgotten when anything is created.
+ *
+ * Files' sizes are kept too, for stat, once asked for or found from
+ * the end of a read, and directories' listings are read whole, once,
+ * and then handed out from memory.
+ *
+ * A change to any file through emufs bumps ef_gen and throws out all
+ * the pages and sizes of every file, since the several handles a host
+ * file may be open under can't be told apart; writes here are rare.
+ * Creating a file bumps ef_dirgen, which goes for the listings. Changes
+ * made on the host side, behind System/161's back, aren't noticed.
+ *
+ * ef_cachelock covers the page arrays, sizes, listings, the remembered
+ * lookups, and the counts. Pages are reference counted so readers can
+ * copy out of them without holding it: the uiomove can fault, and the
+ * fault can need to read an emufs file.
+ */
+#define EMUFS_CACHEPAGES	64
+#define EMUFS_RUNPAGES		(EMU_MAXIO / PAGE_SIZE)
+#define EMUFS_DIRMAX		256	/* bigger directories go uncached */
+
+/*
+ * Free a chain of pages.
+ */
+static
+void
+emufs_freepages(struct emufs_page *dead)
+{
+	struct emufs_page *ep;
+
+	while ((ep = dead) != NULL) {
+		dead = ep->ep_next;
+		kfree(ep->ep_data);
+		kfree(ep);
+	}
+}
+
+/*
+ * Drop a reference to a page; the caller frees it if that was the
+ * last, once the lock is released.
+ */
+static
+bool
+emufs_page_decref(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	KASSERT(spinlock_do_i_hold(&ef->ef_cachelock));
+	KASSERT(ep->ep_refs > 0);
+	ep->ep_refs--;
+	return ep->ep_refs == 0;
+}
+
+/*
+ * Take all of EV's pages out of the cache, chaining the ones nobody
+ * is reading onto *DEAD.
+ */
+static
+void
+emufs_droppages(struct emufs_fs *ef, struct emufs_vnode *ev,
+		struct emufs_page **dead)
+{
+	struct emufs_page *ep;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&ef->ef_cachelock));
+
+	for (i=0; i<ev->ev_npages; i++) {
+		ep = ev->ev_pages[i];
+		if (ep == NULL) {
+			continue;
+		}
+		ev->ev_pages[i] = NULL;
+		KASSERT(ef->ef_cachedpages > 0);
+		ef->ef_cachedpages--;
+		if (emufs_page_decref(ef, ep)) {
+			ep->ep_next = *dead;
+			*dead = ep;
+		}
+	}
+}
+
+/*
+ * Throw out every cached page, after a file has been changed.
+ */
+static
+void
+emufs_invalidate(struct emufs_fs *ef)
+{
+	struct emufs_page *dead = NULL;
+	struct vnode *v;
+	unsigned i, num;
+
+	/* e_lock for the vnode table */
+	lock_acquire(ef->ef_emu->e_lock);
+	spinlock_acquire(&ef->ef_cachelock);
+	ef->ef_gen++;
+	num = vnodearray_num(ef->ef_vnodes);
+	for (i=0; i<num && ef->ef_cachedpages > 0; i++) {
+		v = vnodearray_get(ef->ef_vnodes, i);
+		emufs_droppages(ef, v->vn_data, &dead);
+	}
+	spinlock_release(&ef->ef_cachelock);
+	lock_release(ef->ef_emu->e_lock);
+
+	emufs_freepages(dead);
+}
+
+/*
+ * Get page PAGENUM of EV, with a reference, if it's cached.
+ */
+static
+struct emufs_page *
+emufs_getpage(struct emufs_fs *ef, struct emufs_vnode *ev, unsigned pagenum)
+{
+	struct emufs_page *ep = NULL;
+
+	spinlock_acquire(&ef->ef_cachelock);
+	if (pagenum < ev->ev_npages && ev->ev_pages[pagenum] != NULL) {
+		ep = ev->ev_pages[pagenum];
+		ep->ep_refs++;
+	}
+	spinlock_release(&ef->ef_cachelock);
+	return ep;
+}
+
+/*
+ * Release a page got from emufs_getpage.
+ */
+static
+void
+emufs_putpage(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	bool last;
+
+	spinlock_acquire(&ef->ef_cachelock);
+	last = emufs_page_decref(ef, ep);
+	spinlock_release(&ef->ef_cachelock);
+
+	if (last) {
+		ep->ep_next = NULL;
+		emufs_freepages(ep);
+	}
+}
+
+/*
+ * Read EV's pages from PAGENUM on into the cache: EMU_MAXIO worth, or
+ * up to the next page that's already there, in one transfer. If the
+ * cache is full, or memory is short, this may do nothing, and the
+ * caller should read from the device itself.
+ */
+static
+int
+emufs_fill(struct emufs_fs *ef, struct emufs_vnode *ev, unsigned pagenum)
+{
+	struct emufs_page *pages[EMUFS_RUNPAGES];
+	struct iovec iov[EMUFS_RUNPAGES];
+	struct emufs_page **newarray = NULL, **oldarray = NULL;
+	struct emufs_page *ep, *dead = NULL;
+	unsigned i, n, gen, newsize = 0;
+	size_t got, oldresid;
+	struct uio ku;
+	int result;
+
+	/* See how many to read, and whether ev_pages needs to grow. */
+	spinlock_acquire(&ef->ef_cachelock);
+	gen = ef->ef_gen;
+	for (n=0; n<EMUFS_RUNPAGES; n++) {
+		if (ef->ef_cachedpages + n >= EMUFS_CACHEPAGES) {
+			break;
+		}
+		if (pagenum + n < ev->ev_npages &&
+		    ev->ev_pages[pagenum + n] != NULL) {
+			break;
+		}
+	}
+	if (pagenum + n > ev->ev_npages) {
+		newsize = ev->ev_npages * 2;
+		if (newsize < pagenum + n) {
+			newsize = pagenum + n;
+		}
+	}
+	spinlock_release(&ef->ef_cachelock);
+
+	if (newsize > 0) {
+		newarray = kmalloc(newsize * sizeof(newarray[0]));
+		if (newarray == NULL) {
+			return 0;
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		ep = kmalloc(sizeof(*ep));
+		if (ep == NULL) {
+			break;
+		}
+		ep->ep_data = kmalloc(PAGE_SIZE);
+		if (ep->ep_data == NULL) {
+			kfree(ep);
+			break;
+		}
+		ep->ep_refs = 1;
+		pages[i] = ep;
+		iov[i].iov_kbase = ep->ep_data;
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	n = i;
+	if (n == 0) {
+		kfree(newarray);
+		return 0;
+	}
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)pagenum * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+	ku.uio_direct = false;
+
+	result = 0;
+	while (ku.uio_resid > 0) {
+		oldresid = ku.uio_resid;
+		result = emu_read(ev->ev_emu, ev->ev_handle, ku.uio_resid, &ku);
+		if (result || ku.uio_resid == oldresid) {
+			break;
+		}
+	}
+	got = n * PAGE_SIZE - ku.uio_resid;
+
+	spinlock_acquire(&ef->ef_cachelock);
+	if (newarray != NULL && ev->ev_npages < newsize) {
+		for (i=0; i<ev->ev_npages; i++) {
+			newarray[i] = ev->ev_pages[i];
+		}
+		for (; i<newsize; i++) {
+			newarray[i] = NULL;
+		}
+		oldarray = ev->ev_pages;
+		ev->ev_pages = newarray;
+		ev->ev_npages = newsize;
+		newarray = NULL;
+	}
+	if (result == 0 && gen == ef->ef_gen && got < n * PAGE_SIZE) {
+		/* read to EOF */
+		ev->ev_size = (off_t)pagenum * PAGE_SIZE + got;
+		ev->ev_sizegen = gen;
+		ev->ev_sizevalid = true;
+	}
+	for (i=0; i<n; i++) {
+		ep = pages[i];
+		ep->ep_len = got > i * PAGE_SIZE ? got - i * PAGE_SIZE : 0;
+		if (ep->ep_len > PAGE_SIZE) {
+			ep->ep_len = PAGE_SIZE;
+		}
+		/*
+		 * Keep it unless the read failed, the file changed
+		 * meanwhile, it's past EOF, or someone else got there
+		 * first.
+		 */
+		if (result == 0 && gen == ef->ef_gen && ep->ep_len > 0 &&
+		    pagenum + i < ev->ev_npages &&
+		    ev->ev_pages[pagenum + i] == NULL &&
+		    ef->ef_cachedpages < EMUFS_CACHEPAGES) {
+			ev->ev_pages[pagenum + i] = ep;
+			ef->ef_cachedpages++;
+		}
+		else {
+			ep->ep_next = dead;
+			dead = ep;
+		}
+	}
+	spinlock_release(&ef->ef_cachelock);
+
+	kfree(oldarray);
+	kfree(newarray);
+	emufs_freepages(dead);
+	return result;
+}
+
+/*
+ * Look for an earlier lookup of PATH in DIR. If there was one, returns
+ * true and hands back the file found, with a new reference, or NULL if
+ * there wasn't one.
+ */
+static
+bool
+emufs_findname(struct emufs_fs *ef, struct emufs_vnode *dir, const char *path,
+	       struct emufs_vnode **ret)
+{
+	struct emufs_name *en;
+	bool found = false;
+	unsigned i;
+
+	spinlock_acquire(&ef->ef_cachelock);
+	for (i=0; i<EMUFS_NAMES; i++) {
+		en = &ef->ef_names[i];
+		if (en->en_dir == dir && !strcmp(en->en_path, path)) {
+			en->en_lastuse = ++ef->ef_clock;
+			*ret = en->en_file;
+			if (*ret != NULL) {
+				VOP_INCREF(&(*ret)->ev_v);
+			}
+			found = true;
+			break;
+		}
+	}
+	spinlock_release(&ef->ef_cachelock);
+	return found;
+}
+
+/*
+ * Remember that looking PATH up in DIR gave FILE, or nothing if FILE
+ * is NULL, in place of the least recently used entry. DIRGEN is
+ * ef_dirgen from before the lookup; if something has been created
+ * since, nothing is no longer worth remembering.
+ */
+static
+void
+emufs_entername(struct emufs_fs *ef, struct emufs_vnode *dir,
+		const char *path, struct emufs_vnode *file, unsigned dirgen)
+{
+	struct emufs_name *en, *victim = NULL;
+	struct emufs_vnode *olddir, *oldfile;
+	unsigned i;
+
+	if (strlen(path) >= EMUFS_PATHLEN) {
+		return;
+	}
+
+	spinlock_acquire(&ef->ef_cachelock);
+	if (file == NULL && dirgen != ef->ef_dirgen) {
+		spinlock_release(&ef->ef_cachelock);
+		return;
+	}
+	for (i=0; i<EMUFS_NAMES; i++) {
+		en = &ef->ef_names[i];
+		if (en->en_dir == dir && !strcmp(en->en_path, path)) {
+			/* a concurrent lookup got there first */
+			spinlock_release(&ef->ef_cachelock);
+			return;
+		}
+		if (victim == NULL || en->en_lastuse < victim->en_lastuse) {
+			victim = en;
+		}
+	}
+	olddir = victim->en_dir;
+	oldfile = victim->en_file;
+	VOP_INCREF(&dir->ev_v);
+	if (file != NULL) {
+		VOP_INCREF(&file->ev_v);
+	}
+	victim->en_dir = dir;
+	victim->en_file = file;
+	victim->en_lastuse = ++ef->ef_clock;
+	strcpy(victim->en_path, path);
+	spinlock_release(&ef->ef_cachelock);
+
+	if (oldfile != NULL) {
+		VOP_DECREF(&oldfile->ev_v);
+	}
+	if (olddir != NULL) {
+		VOP_DECREF(&olddir->ev_v);
+	}
+}
+
+/*
+ * Something was created: forget the names remembered as not there,
+ * and directory listings.
+ */
+static
+void
+emufs_created(struct emufs_fs *ef)
+{
+	struct emufs_vnode *dirs[EMUFS_NAMES];
+	struct emufs_name *en;
+	unsigned i, n = 0;
+
+	spinlock_acquire(&ef->ef_cachelock);
+	ef->ef_dirgen++;
+	for (i=0; i<EMUFS_NAMES; i++) {
+		en = &ef->ef_names[i];
+		if (en->en_dir != NULL && en->en_file == NULL) {
+			dirs[n++] = en->en_dir;
+			en->en_dir = NULL;
+		}
+	}
+	spinlock_release(&ef->ef_cachelock);
+
+	for (i=0; i<n; i++) {
+		VOP_DECREF(&dirs[i]->ev_v);
+	}
+}
+
+/*
+ * Get EV's size, from the cache if it's there.
+ */
+static
+int
+emufs_getsize(struct emufs_fs *ef, struct emufs_vnode *ev, off_t *ret)
+{
+	unsigned gen;
+	int result;
+
+	spinlock_acquire(&ef->ef_cachelock);
+	if (ev->ev_sizevalid && ev->ev_sizegen == ef->ef_gen) {
+		*ret = ev->ev_size;
+		spinlock_release(&ef->ef_cachelock);
+		return 0;
+	}
+	gen = ef->ef_gen;
+	spinlock_release(&ef->ef_cachelock);
+
+	result = emu_getsize(ev->ev_emu, ev->ev_handle, ret);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&ef->ef_cachelock);
+	if (gen == ef->ef_gen) {
+		ev->ev_size = *ret;
+		ev->ev_sizegen = gen;
+		ev->ev_sizevalid = true;
+	}
+	spinlock_release(&ef->ef_cachelock);
+	return 0;
+}
+
+/*
+ * Free a directory listing.
+ */
+static
+void
+emufs_freedirents(struct emufs_dirent *eds, unsigned num)
+{
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		kfree(eds[i].ed_name);
+	}
+	kfree(eds);
+}
+
+/*
+ * Read the whole of directory EV into its listing, if it isn't there
+ * already and fits in EMUFS_DIRMAX entries. Failing to is not an
+ * error; the caller goes to the device itself.
+ */
+static
+void
+emufs_loaddir(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	struct emufs_dirent *eds, *old = NULL;
+	char name[NAME_MAX + 1];
+	struct iovec iov;
+	struct uio ku;
+	unsigned num, oldnum = 0, gen;
+	uint32_t off;
+	int result;
+
+	spinlock_acquire(&ef->ef_cachelock);
+	gen = ef->ef_dirgen;
+	spinlock_release(&ef->ef_cachelock);
+
+	eds = kmalloc(EMUFS_DIRMAX * sizeof(*eds));
+	if (eds == NULL) {
+		return;
+	}
+
+	off = 0;
+	for (num = 0; ; num++) {
+		uio_kinit(&iov, &ku, name, sizeof(name) - 1, off, UIO_READ);
+		result = emu_readdir(ev->ev_emu, ev->ev_handle,
+				     sizeof(name) - 1, &ku);
+		if (result) {
+			goto fail;
+		}
+		if (ku.uio_resid == sizeof(name) - 1) {
+			/* EOF */
+			break;
+		}
+		if (num == EMUFS_DIRMAX) {
+			goto fail;
+		}
+		name[sizeof(name) - 1 - ku.uio_resid] = 0;
+		eds[num].ed_name = kstrdup(name);
+		if (eds[num].ed_name == NULL) {
+			goto fail;
+		}
+		eds[num].ed_off = off;
+		eds[num].ed_next = off = ku.uio_offset;
+	}
+
+	spinlock_acquire(&ef->ef_cachelock);
+	if (gen == ef->ef_dirgen) {
+		old = ev->ev_dirents;
+		oldnum = ev->ev_ndirents;
+		ev->ev_dirents = eds;
+		ev->ev_ndirents = num;
+		ev->ev_dirgen = gen;
+		eds = NULL;
+	}
+	spinlock_release(&ef->ef_cachelock);
+
+	if (old != NULL) {
+		emufs_freedirents(old, oldnum);
+	}
+	if (eds != NULL) {
+		/* a file was created meanwhile */
+		emufs_freedirents(eds, num);
+	}
+	return;
+
+ fail:
+	emufs_freedirents(eds, num);
+}
+
+/*
+ * Look for the entry of directory EV at OFF in its listing, copying
+ * its name to NAME and its successor's offset to *NEXT. Returns true
+ * if the listing says, with an empty name at the end.
+ */
+static
+bool
+emufs_finddirent(struct emufs_fs *ef, struct emufs_vnode *ev, uint32_t off,
+		 char *name, uint32_t *next)
+{
+	struct emufs_dirent *ed;
+	bool found = false;
+	unsigned i;
+
+	spinlock_acquire(&ef->ef_cachelock);
+	if (ev->ev_dirents == NULL || ev->ev_dirgen != ef->ef_dirgen) {
+		goto out;
+	}
+	for (i=0; i<ev->ev_ndirents; i++) {
+		ed = &ev->ev_dirents[i];
+		if (ed->ed_off == off) {
+			strcpy(name, ed->ed_name);
+			*next = ed->ed_next;
+			found = true;
+			goto out;
+		}
+	}
+	if (off == (ev->ev_ndirents > 0 ?
+		    ev->ev_dirents[ev->ev_ndirents - 1].ed_next : 0)) {
+		name[0] = 0;
+		*next = off;
+		found = true;
+	}
+ out:
+	spinlock_release(&ef->ef_cachelock);
+	return found;
+}
+
 /*
  * VOP_EACHOPEN on files
  */
@@ -469,41 +1045,32 @@ emufs_reclaim(struct vnode *v)
 {
 	struct emufs_vnode *ev = v->vn_data;
 	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_page *dead = NULL;
 	unsigned ix, i, num;
 	int result;
 
 	/*
-	 * Need all of these locks, e_lock to protect the device,
-	 * vfs_biglock to protect the fs-related material, and
-	 * vn_countlock for the reference count.
+	 * Need e_lock to protect the device and the vnode table.
 	 */
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
-	spinlock_acquire(&ev->ev_v.vn_countlock);
-
-	if (ev->ev_v.vn_refcount > 1) {
-		/* consume the reference VOP_DECREF passed us */
-		ev->ev_v.vn_refcount--;
 
-		spinlock_release(&ev->ev_v.vn_countlock);
+	if (vnode_decref_unless_last(&ev->ev_v)) {
+		/* consumed the reference VOP_DECREF passed us */
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return EBUSY;
 	}
-	KASSERT(ev->ev_v.vn_refcount == 1);
 
 	/*
 	 * Since we hold e_lock and are the last ref, nobody can increment
-	 * the refcount, so we can release vn_countlock.
+	 * the refcount.
 	 */
-	spinlock_release(&ev->ev_v.vn_countlock);
+	KASSERT(atomic_get(&ev->ev_v.vn_refcount) == 1);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -526,21 +1093,36 @@ emufs_reclaim(struct vnode *v)
 	vnodearray_remove(ef->ef_vnodes, ix);
 	vnode_cleanup(&ev->ev_v);
 
+	spinlock_acquire(&ef->ef_cachelock);
+	emufs_droppages(ef, ev, &dead);
+	spinlock_release(&ef->ef_cachelock);
+
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
+	emufs_freepages(dead);
+	kfree(ev->ev_pages);
+	if (ev->ev_dirents != NULL) {
+		emufs_freedirents(ev->ev_dirents, ev->ev_ndirents);
+	}
 	kfree(ev);
 	return 0;
 }
 
 /*
  * VOP_READ
+ *
+ * From the cache where possible; what can't be cached goes straight
+ * to the device.
  */
 static
 int
 emufs_read(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_page *ep;
+	unsigned pagenum;
+	size_t pageoff;
 	uint32_t amt;
 	size_t oldresid;
 	int result;
@@ -548,6 +1130,39 @@ emufs_read(struct vnode *v, struct uio *uio)
 	KASSERT(uio->uio_rw==UIO_READ);
 
 	while (uio->uio_resid > 0) {
+		if (uio->uio_offset > (off_t)0xffffffff) {
+			/* as in emu_doread */
+			break;
+		}
+		pagenum = uio->uio_offset / PAGE_SIZE;
+		pageoff = uio->uio_offset % PAGE_SIZE;
+
+		ep = emufs_getpage(ef, ev, pagenum);
+		if (ep == NULL) {
+			result = emufs_fill(ef, ev, pagenum);
+			if (result) {
+				return result;
+			}
+			ep = emufs_getpage(ef, ev, pagenum);
+		}
+		if (ep != NULL) {
+			if (pageoff >= ep->ep_len) {
+				/* EOF */
+				emufs_putpage(ef, ep);
+				break;
+			}
+			amt = ep->ep_len - pageoff;
+			if (amt > uio->uio_resid) {
+				amt = uio->uio_resid;
+			}
+			result = uiomove(ep->ep_data + pageoff, amt, uio);
+			emufs_putpage(ef, ep);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
 			amt = EMU_MAXIO;
@@ -571,16 +1186,39 @@ emufs_read(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_READDIR
+ *
+ * From the directory's listing, read whole the first time through.
  */
 static
 int
 emufs_getdirentry(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	char name[NAME_MAX + 1];
+	uint32_t amt, next;
+	bool cached;
+	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
+	if (uio->uio_offset <= (off_t)0xffffffff) {
+		cached = emufs_finddirent(ef, ev, uio->uio_offset,
+					  name, &next);
+		if (!cached && uio->uio_offset == 0) {
+			emufs_loaddir(ef, ev);
+			cached = emufs_finddirent(ef, ev, 0, name, &next);
+		}
+		if (cached) {
+			result = uiomove(name, strlen(name), uio);
+			if (result) {
+				return result;
+			}
+			uio->uio_offset = next;
+			return 0;
+		}
+	}
+
 	amt = uio->uio_resid;
 	if (amt > EMU_MAXIO) {
 		amt = EMU_MAXIO;
@@ -613,6 +1251,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
+			emufs_invalidate(v->vn_fs->fs_data);
 			return result;
 		}
 
@@ -622,6 +1261,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
+	emufs_invalidate(v->vn_fs->fs_data);
 	return 0;
 }
 
@@ -651,11 +1291,12 @@ int
 emufs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
 	int result;
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
+	result = emufs_getsize(ef, ev, &statbuf->st_size);
 	if (result) {
 		return result;
 	}
@@ -667,6 +1308,7 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 	statbuf->st_mode |= 0644; /* possibly a lie */
 	statbuf->st_nlink = 1;    /* might be a lie, but doesn't matter much */
 	statbuf->st_blocks = 0;   /* almost certainly a lie */
+	statbuf->st_blksize = EMU_MAXIO;
 
 	return 0;
 }
@@ -725,7 +1367,11 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	emufs_invalidate(v->vn_fs->fs_data);
+	return result;
 }
 
 /*
@@ -743,16 +1389,15 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 	int result;
 	int isdir;
 
-	vfs_biglock_acquire();
 	result = emu_open(ev->ev_emu, ev->ev_handle, name, true, excl, mode,
 			  &handle, &isdir);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
+	emufs_created(ef);
+
 	result = emufs_loadvnode(ef, handle, isdir, &newguy);
-	vfs_biglock_release();
 	if (result) {
 		emu_close(ev->ev_emu, handle);
 		return result;
@@ -773,24 +1418,39 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	struct emufs_fs *ef = dir->vn_fs->fs_data;
 	struct emufs_vnode *newguy;
 	uint32_t handle;
+	unsigned dirgen;
 	int result;
 	int isdir;
 
-	vfs_biglock_acquire();
+	if (emufs_findname(ef, ev, pathname, &newguy)) {
+		if (newguy == NULL) {
+			return ENOENT;
+		}
+		*ret = &newguy->ev_v;
+		return 0;
+	}
+
+	spinlock_acquire(&ef->ef_cachelock);
+	dirgen = ef->ef_dirgen;
+	spinlock_release(&ef->ef_cachelock);
+
 	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
 			  &handle, &isdir);
+	if (result == ENOENT) {
+		emufs_entername(ef, ev, pathname, NULL, dirgen);
+	}
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = emufs_loadvnode(ef, handle, isdir, &newguy);
-	vfs_biglock_release();
 	if (result) {
 		emu_close(ev->ev_emu, handle);
 		return result;
 	}
 
+	emufs_entername(ef, ev, pathname, newguy, dirgen);
+
 	*ret = &newguy->ev_v;
 	return 0;
 }
@@ -850,14 +1510,14 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 }
 
 /*
- * VOP_MMAP
+ * VOP_MMAP: files can be mapped; the VM system does the I/O.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -1095,7 +1755,10 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_fsync = emufs_fsync,
 	.vop_mmap = emufs_mmap,
 	.vop_truncate = emufs_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = vopnull_seekhole,
 	.vop_namefile = emufs_uio_op_notdir,
+	.vop_poll = vopnull_poll,
 
 	.vop_creat = emufs_creat_notdir,
 	.vop_symlink = emufs_symlink_notdir,
@@ -1129,7 +1792,10 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_fsync = emufs_void_op_isdir,
 	.vop_mmap = emufs_void_op_isdir,
 	.vop_truncate = emufs_truncate_isdir,
+	.vop_fallocate = vopfail_fallocate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
 	.vop_namefile = emufs_namefile,
+	.vop_poll = vopnull_poll,
 
 	.vop_creat = emufs_creat,
 	.vop_symlink = emufs_symlink,
@@ -1156,7 +1822,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
 	num = vnodearray_num(ef->ef_vnodes);
@@ -1169,7 +1834,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			VOP_INCREF(&ev->ev_v);
 
 			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
 			*ret = ev;
 			return 0;
 		}
@@ -1185,12 +1849,19 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
+	ev->ev_pages = NULL;
+	ev->ev_npages = 0;
+	ev->ev_size = 0;
+	ev->ev_sizevalid = false;
+	ev->ev_sizegen = 0;
+	ev->ev_dirents = NULL;
+	ev->ev_ndirents = 0;
+	ev->ev_dirgen = 0;
 
 	result = vnode_init(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			    &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
@@ -1200,13 +1871,11 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		/* note: vnode_cleanup undoes vnode_init - it does not kfree */
 		vnode_cleanup(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	*ret = ev;
 	return 0;
@@ -1310,6 +1979,12 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
+	spinlock_init(&ef->ef_cachelock);
+	ef->ef_gen = 0;
+	ef->ef_dirgen = 0;
+	ef->ef_cachedpages = 0;
+	ef->ef_clock = 0;
+	bzero(ef->ef_names, sizeof(ef->ef_names));
 	ef->ef_vnodes = vnodearray_create();
 	if (ef->ef_vnodes == NULL) {
 		kfree(ef);
@@ -35,10 +35,16 @@
 #include <lib.h>
 #include <cpu.h>
 #include <membar.h>
+#include <clock.h>
 #include <spinlock.h>
 #include <current.h>
 #include <lamebus/lamebus.h>
 
+/* Interrupts are counted per CPU by slot; there must be room. */
+#if LB_NSLOTS > CPU_IRQSOURCES
+#error "CPU_IRQSOURCES is too small for LAMEbus"
+#endif
+
 /* Register offsets within each config region */
 #define CFGREG_VID   0    /* Vendor ID */
 #define CFGREG_DID   4    /* Device ID */
@@ -426,6 +432,38 @@ lamebus_unmask_interrupt(struct lamebus_softc *lamebus, int slot)
 }
 
 
+/*
+ * Return the number of the lowest set bit in MASK, which must not be 0.
+ */
+static
+unsigned
+lamebus_lowbit(uint32_t mask)
+{
+	unsigned n = 0;
+
+	KASSERT(mask != 0);
+	if ((mask & 0xffff) == 0) {
+		n += 16;
+		mask >>= 16;
+	}
+	if ((mask & 0xff) == 0) {
+		n += 8;
+		mask >>= 8;
+	}
+	if ((mask & 0xf) == 0) {
+		n += 4;
+		mask >>= 4;
+	}
+	if ((mask & 0x3) == 0) {
+		n += 2;
+		mask >>= 2;
+	}
+	if ((mask & 0x1) == 0) {
+		n += 1;
+	}
+	return n;
+}
+
 /*
  * LAMEbus interrupt handling function. (Machine-independent!)
  */
@@ -435,19 +473,22 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 	/*
 	 * Note that despite the fact that "spl" stands for "set
 	 * priority level", we don't actually support interrupt
-	 * priorities. When an interrupt happens, we look through the
-	 * slots to find the first interrupting device and call its
-	 * interrupt routine, no matter what that device is.
+	 * priorities. When an interrupt happens, we service every
+	 * interrupting device, lowest slot first, no matter what
+	 * those devices are.
 	 *
 	 * Note that the entire LAMEbus uses only one on-cpu interrupt line.
 	 * Thus, we do not use any on-cpu interrupt priority system either.
 	 */
 
-	int slot;
+	unsigned slot, i, n;
 	uint32_t mask;
 	uint32_t irqs;
-	void (*handler)(void *);
-	void *data;
+	uint32_t dudmask = 0;
+	lb_irqfunc handlers[LB_NSLOTS];
+	void *data[LB_NSLOTS];
+	unsigned slots[LB_NSLOTS];
+	struct timespec start, end, diff;
 
 	/* For keeping track of how many bogus things happen in a row. */
 	static int duds = 0;
@@ -456,12 +497,10 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 	/* and we better have a valid bus instance. */
 	KASSERT(lamebus != NULL);
 
-	/* Lock the softc */
-	spinlock_acquire(&lamebus->ls_lock);
-
 	/*
 	 * Read the LAMEbus controller register that tells us which
-	 * slots are asserting an interrupt condition.
+	 * slots are asserting an interrupt condition. This doesn't
+	 * need the lock; that's for the softc.
 	 */
 	irqs = read_ctl_register(lamebus, CTLREG_IRQS);
 
@@ -471,14 +510,10 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 		 */
 		kprintf("lamebus: stray interrupt on cpu %u\n",
 			curcpu->c_number);
-		duds++;
 		duds_this_time++;
 
 		/*
-		 * We could just return now, but instead we'll
-		 * continue ahead. Because irqs == 0, nothing in the
-		 * loop will execute, and passing through it gets us
-		 * to the code that checks how many duds we've
+		 * Go on to the code that checks how many duds we've
 		 * seen. This is important, because we just might get
 		 * a stray interrupt that latches itself on. If that
 		 * happens, we're pretty much toast, but it's better
@@ -487,60 +522,58 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 		 */
 	}
 
-	/*
-	 * Go through the bits in the value we got back to see which
-	 * ones are set.
-	 */
-
-	for (mask=1, slot=0; slot<LB_NSLOTS; mask<<=1, slot++) {
-		if ((irqs & mask) == 0) {
-			/* Nope. */
-			continue;
-		}
-
+	while (irqs != 0) {
 		/*
-		 * This slot is signalling an interrupt.
+		 * Pick out the handlers for all the interrupting
+		 * slots under one acquisition of the lock, then drop
+		 * it to call them, in case other CPUs are handling
+		 * interrupts on other devices.
 		 */
+		n = 0;
+		spinlock_acquire(&lamebus->ls_lock);
+		while (irqs != 0) {
+			slot = lamebus_lowbit(irqs);
+			mask = (uint32_t)1 << slot;
+			irqs &= ~mask;
+
+			if ((lamebus->ls_slotsinuse & mask)==0 ||
+			    lamebus->ls_irqfuncs[slot]==NULL) {
+				/*
+				 * No device driver is using this slot,
+				 * or it hasn't installed an interrupt
+				 * handler.
+				 */
+				duds_this_time++;
+				dudmask |= mask;
+				continue;
+			}
 
-		if ((lamebus->ls_slotsinuse & mask)==0) {
-			/*
-			 * No device driver is using this slot.
-			 */
-			duds++;
-			duds_this_time++;
-			continue;
+			handlers[n] = lamebus->ls_irqfuncs[slot];
+			data[n] = lamebus->ls_devdata[slot];
+			slots[n] = slot;
+			n++;
 		}
-
-		if (lamebus->ls_irqfuncs[slot]==NULL) {
-			/*
-			 * The device driver hasn't installed an interrupt
-			 * handler.
-			 */
-			duds++;
-			duds_this_time++;
-			continue;
-		}
-
-		/*
-		 * Call the interrupt handler. Release the spinlock
-		 * while we do so, in case other CPUs are handling
-		 * interrupts on other devices.
-		 */
-		handler = lamebus->ls_irqfuncs[slot];
-		data = lamebus->ls_devdata[slot];
 		spinlock_release(&lamebus->ls_lock);
 
-		handler(data);
-
-		spinlock_acquire(&lamebus->ls_lock);
+		/* Count and time each handler (see cpu_printintrstats). */
+		for (i=0; i<n; i++) {
+			clock_now(&start);
+			handlers[i](data[i]);
+			clock_now(&end);
+			timespec_sub(&end, &start, &diff);
+			curcpu->c_irqs[slots[i]]++;
+			curcpu->c_irqusecs[slots[i]] +=
+				diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+		}
 
 		/*
-		 * Reload the mask of pending IRQs - if we just called
-		 * hardclock, we might not have come back to this
-		 * context for some time, and it might have changed.
+		 * Before returning, pick up anything that came in
+		 * meanwhile, which saves taking another interrupt for
+		 * it - if we just called hardclock, we might not have
+		 * come back to this context for some time. But don't
+		 * go around again for the duds; they'd never go away.
 		 */
-
-		irqs = read_ctl_register(lamebus, CTLREG_IRQS);
+		irqs = read_ctl_register(lamebus, CTLREG_IRQS) & ~dudmask;
 	}
 
 
@@ -560,8 +593,19 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 	 * some stupid device we don't have a driver for, or it might
 	 * have been an electrical transient. In any case, warn and
 	 * clear the dud count.
+	 *
+	 * duds is protected by the lock, but it's normally 0 and
+	 * stays 0, so peek at it first rather than lock every time.
 	 */
 
+	if (duds_this_time == 0 && duds == 0) {
+		return;
+	}
+	curcpu->c_strayirqs += duds_this_time;
+
+	spinlock_acquire(&lamebus->ls_lock);
+	duds += duds_this_time;
+
 	if (duds_this_time == 0 && duds > 0) {
 		kprintf("lamebus: %d dud interrupts\n", duds);
 		duds = 0;
@@ -570,8 +614,6 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 	if (duds > 10000) {
 		panic("lamebus: too many (%d) dud interrupts\n", duds);
 	}
-
-	/* Unlock the softc */
 	spinlock_release(&lamebus->ls_lock);
 }
 
@@ -33,13 +33,18 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioctl.h>
 #include <lib.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <membar.h>
-#include <synch.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
+#include <ktrace.h>
 #include "autoconf.h"
 
 /* Registers (offsets within slot) */
@@ -60,6 +65,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Most polls allowed per transfer (see LHDIOC_SETPOLL) */
+#define LHD_MAXPOLL     20000
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,41 +104,171 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Requests. Transfers are asynchronous: lhd_submit puts a request
+ * (see <device.h>) on the queue and returns, and the interrupt
+ * handler moves each sector of the active request through the
+ * on-card buffer, which holds one, and starts the next. When a
+ * request is finished its completion function is called, still from
+ * the interrupt handler, and the next one begins.
+ *
+ * The queue is kept in no particular order; when the disk comes
+ * free the next request is picked elevator fashion (C-LOOK): the
+ * lowest-numbered at or past where the last one ended, or if there
+ * are none of those the lowest-numbered of all. A request that
+ * continues one still waiting in the queue, in the same direction,
+ * is merged with it, and the two are then done back to back.
+ *
+ * lh_lock is a spinlock, as the interrupt handler needs it.
+ */
+
+/*
+ * The kernel address of the sector REQ is at, skipping over any
+ * empty iovecs.
+ */
+static
+void *
+lhd_reqptr(struct devreq *req)
+{
+	while (req->dr_iov[req->dr_iovidx].iov_len == 0) {
+		req->dr_iovidx++;
+	}
+	return (char *)req->dr_iov[req->dr_iovidx].iov_kbase + req->dr_iovoff;
+}
+
+/*
+ * Trace REQ becoming the active request.
+ */
+#define LHD_TRACESTART(req) \
+	KTRACE(KTRACE_DISKSTART, (req), ((req)->dr_len / LHD_SECTSIZE) | \
+	       ((req)->dr_iswrite ? KTRACE_WRITE : 0))
+
+/*
+ * Start the transfer of the next sector of the active request. With
+ * lh_lock held.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_startsector(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	if (req->dr_iswrite) {
+		memcpy(lh->lh_buf, lhd_reqptr(req), LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+	lhd_wreg(lh, LHD_REG_SECT,
+		 (req->dr_offset + req->dr_pos) / LHD_SECTSIZE);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * The active request is finished: pick the next and start it, if
+ * there is one. With lh_lock held.
+ */
+static
+void
+lhd_next(struct lhd_softc *lh)
+{
+	struct devreq *done = lh->lh_active;
+	struct devreq **p, **ahead, **lowest;
+	off_t endpos;
+
+	endpos = done->dr_offset + done->dr_len;
+
+	if (done->dr_merged != NULL) {
+		lh->lh_active = done->dr_merged;
+	}
+	else {
+		ahead = lowest = NULL;
+		for (p = &lh->lh_queue; *p != NULL; p = &(*p)->dr_next) {
+			if ((*p)->dr_offset >= endpos &&
+			    (ahead == NULL ||
+			     (*p)->dr_offset < (*ahead)->dr_offset)) {
+				ahead = p;
+			}
+			if (lowest == NULL ||
+			    (*p)->dr_offset < (*lowest)->dr_offset) {
+				lowest = p;
+			}
+		}
+		if (ahead == NULL) {
+			ahead = lowest;
+		}
+		if (ahead == NULL) {
+			lh->lh_active = NULL;
+			return;
+		}
+		lh->lh_active = *ahead;
+		*ahead = (*ahead)->dr_next;
+	}
+	LHD_TRACESTART(lh->lh_active);
+	lhd_startsector(lh);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, take care of the sector, and go on to the next.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devreq *req;
 	uint32_t val;
+	int err;
+
+	spinlock_acquire(&lh->lh_lock);
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
 	    case LHD_IDLE:
 	    case LHD_WORKING:
-		break;
+	    default:
+		spinlock_release(&lh->lh_lock);
+		return;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	req = lh->lh_active;
+	if (req == NULL) {
+		/* not ours */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	err = lhd_code_to_errno(lh, val);
+	if (err == 0) {
+		if (!req->dr_iswrite) {
+			membar_load_load();
+			memcpy(lhd_reqptr(req), lh->lh_buf, LHD_SECTSIZE);
+		}
+		req->dr_pos += LHD_SECTSIZE;
+		req->dr_iovoff += LHD_SECTSIZE;
+		if (req->dr_iovoff == req->dr_iov[req->dr_iovidx].iov_len) {
+			req->dr_iovidx++;
+			req->dr_iovoff = 0;
+		}
+		if (req->dr_pos < req->dr_len) {
+			lhd_startsector(lh);
+			spinlock_release(&lh->lh_lock);
+			return;
+		}
+	}
+
+	KTRACE(KTRACE_DISKDONE, req, err);
+	lhd_next(lh);
+	spinlock_release(&lh->lh_lock);
+
+	devstats_done(&lh->lh_stats, req, err);
+	req->dr_done(req, err);
 }
 
 /*
@@ -156,12 +294,24 @@ static
 int
 lhd_ioctl(struct device *d, int op, userptr_t data)
 {
-	/*
-	 * We don't support any ioctls.
-	 */
-	(void)d;
-	(void)op;
-	(void)data;
+	struct lhd_softc *lh = d->d_data;
+	int spins, result;
+
+	switch (op) {
+	    case LHDIOC_GETPOLL:
+		spins = lh->lh_pollspins;
+		return copyout(&spins, data, sizeof(spins));
+	    case LHDIOC_SETPOLL:
+		result = copyin(data, &spins, sizeof(spins));
+		if (result) {
+			return result;
+		}
+		if (spins < 0 || spins > LHD_MAXPOLL) {
+			return EINVAL;
+		}
+		lh->lh_pollspins = spins;
+		return 0;
+	}
 	return EIOCTL;
 }
 
@@ -180,94 +330,264 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * Start a transfer. See <device.h>.
  */
 static
 int
-lhd_io(struct device *d, struct uio *uio)
+lhd_submit(struct device *d, struct devreq *req)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct devreq *q;
+	off_t qend;
+	size_t len;
+	unsigned i;
+
+	len = 0;
+	for (i=0; i<req->dr_iovcnt; i++) {
+		if (req->dr_iov[i].iov_len % LHD_SECTSIZE != 0) {
+			return EINVAL;
+		}
+		len += req->dr_iov[i].iov_len;
+	}
 
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
-
-	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
+	/*
+	 * Don't allow I/O that isn't sector-aligned, or outside the
+	 * disk. With the offset known not to be negative, the end
+	 * check can be done unsigned.
+	 */
+	if (req->dr_offset < 0) {
 		return EINVAL;
 	}
-
-	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (req->dr_offset % LHD_SECTSIZE != 0 || len == 0 ||
+	    (uint64_t)(req->dr_offset / LHD_SECTSIZE) + len / LHD_SECTSIZE
+	    > (uint64_t)lh->lh_dev.d_blocks) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	req->dr_len = len;
+	req->dr_pos = 0;
+	req->dr_iovidx = 0;
+	req->dr_iovoff = 0;
+	req->dr_next = NULL;
+	req->dr_merged = NULL;
+	req->dr_mergetail = req;
+	devstats_submit(&lh->lh_stats, req);
+
+	spinlock_acquire(&lh->lh_lock);
+	KTRACE(KTRACE_DISKQ, req, req->dr_offset / LHD_SECTSIZE);
+
+	if (lh->lh_active == NULL) {
+		lh->lh_active = req;
+		LHD_TRACESTART(req);
+		lhd_startsector(lh);
+		spinlock_release(&lh->lh_lock);
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	for (q = lh->lh_queue; q != NULL; q = q->dr_next) {
+		if (q->dr_iswrite != req->dr_iswrite) {
+			continue;
+		}
+		qend = q->dr_mergetail->dr_offset + q->dr_mergetail->dr_len;
+		if (qend == req->dr_offset) {
+			/* goes on the end */
+			q->dr_mergetail->dr_merged = req;
+			q->dr_mergetail = req;
+			spinlock_release(&lh->lh_lock);
+			return 0;
+		}
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	req->dr_next = lh->lh_queue;
+	lh->lh_queue = req;
+	spinlock_release(&lh->lh_lock);
+	return 0;
+}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
-		}
+/*
+ * Synchronous I/O goes through lhd_submit and waits on lh_wchan, as
+ * waiter class the address of its lhd_wait, so only it is woken.
+ */
+struct lhd_wait {
+	struct lhd_softc *lw_lh;
+	bool lw_done;
+	int lw_result;
+};
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
+static
+void
+lhd_wakeup(struct devreq *req, int result)
+{
+	struct lhd_wait *lw = req->dr_data;
+	struct lhd_softc *lh = lw->lw_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	lw->lw_result = result;
+	lw->lw_done = true;
+	wchan_wakeclass(lh->lh_wchan, &lh->lh_lock, (uintptr_t)lw);
+	spinlock_release(&lh->lh_lock);
+}
 
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
+/*
+ * Transfer the iovecs IOV (IOVCNT of them) at OFFSET and wait for it.
+ */
+static
+int
+lhd_rw(struct lhd_softc *lh, struct iovec *iov, unsigned iovcnt,
+       off_t offset, bool iswrite)
+{
+	struct devreq req;
+	struct lhd_wait lw;
+	unsigned spins;
+	int result, s;
+
+	lw.lw_lh = lh;
+	lw.lw_done = false;
+	lw.lw_result = 0;
+
+	req.dr_offset = offset;
+	req.dr_iov = iov;
+	req.dr_iovcnt = iovcnt;
+	req.dr_iswrite = iswrite;
+	req.dr_done = lhd_wakeup;
+	req.dr_data = &lw;
+
+	result = lhd_submit(&lh->lh_dev, &req);
+	if (result) {
+		return result;
+	}
 
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+	/*
+	 * In polled mode, first watch the disk for a while with
+	 * interrupts off, doing the interrupt handler's work ourselves
+	 * (it does nothing if the disk is still busy), and only sleep
+	 * if the transfer still isn't done after that.
+	 */
+	spins = lh->lh_pollspins;
+	if (spins > 0) {
+		s = splhigh();
+		while (!lw.lw_done && spins > 0) {
+			lhd_irq(lh);
+			spins--;
+		}
+		splx(s);
+	}
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	spinlock_acquire(&lh->lh_lock);
+	while (!lw.lw_done) {
+		wchan_sleep_class(lh->lh_wchan, &lh->lh_lock,
+				  (uintptr_t)&lw);
+	}
+	spinlock_release(&lh->lh_lock);
+	return lw.lw_result;
+}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+/*
+ * Move the uio on by LEN, as uiomove would have.
+ */
+static
+void
+lhd_uioskip(struct uio *uio, size_t len)
+{
+	size_t amt;
+
+	uio->uio_offset += len;
+	uio->uio_resid -= len;
+	while (len > 0) {
+		amt = uio->uio_iov->iov_len < len ? uio->uio_iov->iov_len : len;
+		uio->uio_iov->iov_kbase = (char *)uio->uio_iov->iov_kbase + amt;
+		uio->uio_iov->iov_len -= amt;
+		len -= amt;
+		if (uio->uio_iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
 		}
+	}
+}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+/*
+ * I/O function (for both reads and writes)
+ *
+ * Kernel memory in whole sectors (all the buffer cache and swap ever
+ * use) is handed to the disk as is. Anything else goes through a
+ * bounce buffer, up to LHD_BOUNCE bytes at a time.
+ */
+#define LHD_BOUNCE (8 * LHD_SECTSIZE)
 
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	struct lhd_softc *lh = d->d_data;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	struct iovec iov;
+	size_t len;
+	unsigned i;
+	bool direct;
+	void *bounce;
+	int result;
+
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (uio->uio_offset % LHD_SECTSIZE != 0 ||
+	    uio->uio_resid % LHD_SECTSIZE != 0) {
+		return EINVAL;
+	}
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	direct = (uio->uio_segflg == UIO_SYSSPACE);
+	for (i=0; direct && i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len % LHD_SECTSIZE != 0) {
+			direct = false;
 		}
 	}
+	if (direct) {
+		result = lhd_rw(lh, uio->uio_iov, uio->uio_iovcnt,
+				uio->uio_offset, iswrite);
+		if (result == 0) {
+			lhd_uioskip(uio, uio->uio_resid);
+		}
+		return result;
+	}
 
-	return 0;
+	bounce = kmalloc(LHD_BOUNCE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	result = 0;
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid < LHD_BOUNCE ? uio->uio_resid : LHD_BOUNCE;
+		iov.iov_kbase = bounce;
+		iov.iov_len = len;
+		if (iswrite) {
+			result = uiomove(bounce, len, uio);
+			if (result) {
+				break;
+			}
+			/* uiomove moved the offset on; the disk hasn't */
+			result = lhd_rw(lh, &iov, 1, uio->uio_offset - len,
+					true);
+		}
+		else {
+			result = lhd_rw(lh, &iov, 1, uio->uio_offset, false);
+			if (result == 0) {
+				result = uiomove(bounce, len, uio);
+			}
+		}
+		if (result) {
+			break;
+		}
+	}
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_submit = lhd_submit,
 };
 
 /*
@@ -284,23 +604,23 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
+	spinlock_init(&lh->lh_lock);
+	lh->lh_active = NULL;
+	lh->lh_queue = NULL;
+	lh->lh_pollspins = 0;
+	devstats_init(&lh->lh_stats);
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
+	lh->lh_dev.d_stats = &lh->lh_stats;
 	lh->lh_dev.d_data = lh;
 
 	/* Add the VFS device structure to the VFS device list. */
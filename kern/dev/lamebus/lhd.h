@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,14 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	/* Requests; see lhd.c */
+	struct spinlock lh_lock;	/* protects these */
+	struct devreq *lh_active;	/* being done */
+	struct devreq *lh_queue;	/* waiting */
+	struct wchan *lh_wchan;		/* for synchronous I/O */
+	unsigned lh_pollspins;		/* polls before sleeping; see lhd_rw */
+	struct devstats lh_stats;	/* I/O statistics */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -27,20 +27,432 @@
  * SUCH DAMAGE.
  */
 
+/*
+ * Driver for the LAMEbus network card.
+ *
+ * The card holds one received packet and one packet to send, each in
+ * a buffer of LNET_MTU bytes on the card, and interrupts when a packet
+ * has arrived or has gone. Every packet starts with the link header of
+ * <kern/lnet.h>.
+ *
+ * Receiving is interrupt-driven: the handler copies the packet off the
+ * card into the next of a ring of page-sized buffers allocated at
+ * config time, and acknowledges it so the card can take the next one
+ * at once, whether or not anybody is reading. If the ring is full the
+ * packet is dropped and counted. A read takes the oldest packet out
+ * of the ring; when it is reading into a whole page of its own the
+ * buffer page is mapped there instead of copied (see vm_accept_page),
+ * and a fresh page goes in the ring in its place.
+ *
+ * Sending is one packet at a time, under ln_txlock. The packet is put
+ * together in a page-sized buffer of our own, or for a whole page of
+ * the writer's memory sent from a loan of that page (see
+ * vm_loan_page), and then copied straight onto the card. The writer
+ * waits for the transmit interrupt.
+ */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioctl.h>
+#include <kern/lnet.h>
 #include <lib.h>
-/*#include <lamebus/lnet.h>*/ /* not yet */
+#include <uio.h>
+#include <copyinout.h>
+#include <membar.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <platform/bus.h>
+#include <vfs.h>
+#include <lamebus/lnet.h>
 #include "autoconf.h"
+#include "opt-dumbvm.h"
+
+/* Registers (offsets within slot) */
+#define LNET_REG_RIRQ   0   /* Receive interrupt */
+#define LNET_REG_TIRQ   4   /* Transmit interrupt */
+#define LNET_REG_CTRL   8   /* Control */
+#define LNET_REG_STAT   12  /* Status: hardware address in low 16 bits */
+
+/* Bits in the interrupt registers */
+#define LNET_IRQ_DONE   1   /* Packet arrived or sent; write 0 to clear */
+
+/* Bits in the control register */
+#define LNET_CTRL_PROMISC  1  /* Receive packets for anybody */
+#define LNET_CTRL_START    2  /* Send the packet in the transmit buffer */
+
+/* Buffer offsets within slot */
+#define LNET_RBUF       32768
+#define LNET_TBUF       (32768 + LNET_MTU)
+
+/*
+ * Shortcut for reading a register.
+ */
+static
+inline
+uint32_t lnet_rdreg(struct lnet_softc *ln, uint32_t reg)
+{
+	return bus_read_register(ln->ln_busdata, ln->ln_buspos, reg);
+}
+
+/*
+ * Shortcut for writing a register.
+ */
+static
+inline
+void lnet_wreg(struct lnet_softc *ln, uint32_t reg, uint32_t val)
+{
+	bus_write_register(ln->ln_busdata, ln->ln_buspos, reg, val);
+}
+
+/*
+ * Take a received packet off the card into the ring, if there's a
+ * buffer free, and let the card go on to the next. Call with ln_lock
+ * held.
+ */
+static
+void
+lnet_receive(struct lnet_softc *ln)
+{
+	struct lnet_linkheader *lh = ln->ln_rbuf;
+	vaddr_t page;
+	size_t len;
+
+	membar_load_load();
+	len = lh->lh_packetlen;
+	if (lh->lh_frameword != LNET_FRAMEWORD ||
+	    len < sizeof(*lh) || len > LNET_MTU) {
+		/* garbage; drop it */
+		ln->ln_rxdrops++;
+	}
+	else if (ln->ln_nfree == 0) {
+		ln->ln_rxdrops++;
+	}
+	else {
+		page = ln->ln_free[--ln->ln_nfree];
+		memcpy((void *)page, ln->ln_rbuf, len);
+		ln->ln_rx[(ln->ln_rxhead + ln->ln_rxcount) % LNET_RXPAGES] =
+			page;
+		ln->ln_rxcount++;
+		wchan_wakeone(ln->ln_rxwchan, &ln->ln_lock);
+		pollq_wakeup(&ln->ln_pollq);
+	}
+
+	lnet_wreg(ln, LNET_REG_RIRQ, 0);
+}
 
+/*
+ * Interrupt handler for lnet.
+ */
+void
+lnet_irq(void *vln)
+{
+	struct lnet_softc *ln = vln;
+
+	spinlock_acquire(&ln->ln_lock);
+
+	if (lnet_rdreg(ln, LNET_REG_RIRQ) & LNET_IRQ_DONE) {
+		lnet_receive(ln);
+	}
+	if (lnet_rdreg(ln, LNET_REG_TIRQ) & LNET_IRQ_DONE) {
+		lnet_wreg(ln, LNET_REG_TIRQ, 0);
+		ln->ln_txbusy = false;
+		wchan_wakeall(ln->ln_txwchan, &ln->ln_lock);
+		pollq_wakeup(&ln->ln_pollq);
+	}
+
+	spinlock_release(&ln->ln_lock);
+}
+
+/*
+ * Give the ring back a buffer emptied by a read.
+ */
+static
+void
+lnet_putfree(struct lnet_softc *ln, vaddr_t page)
+{
+	spinlock_acquire(&ln->ln_lock);
+	KASSERT(ln->ln_nfree < LNET_RXPAGES);
+	ln->ln_free[ln->ln_nfree++] = page;
+	spinlock_release(&ln->ln_lock);
+}
+
+/*
+ * Map the packet in PAGE into UIO in place of copying it, if UIO
+ * wants a whole page of user memory. A new page is put in the ring
+ * in its place; if there isn't one to be had we copy after all.
+ */
+static
+bool
+lnet_flip(struct lnet_softc *ln, vaddr_t page, size_t len, struct uio *uio)
+{
+#if OPT_DUMBVM
+	(void)ln;
+	(void)page;
+	(void)len;
+	(void)uio;
+	return false;
+#else
+	vaddr_t upage, newpage;
+
+	if (!uio_userpage(uio, &upage)) {
+		return false;
+	}
+	newpage = alloc_kpages(1);
+	if (newpage == 0) {
+		return false;
+	}
+
+	/* none of the last packet in this buffer may go with it */
+	bzero((char *)page + len, PAGE_SIZE - len);
+	if (vm_accept_page(uio->uio_space, upage, KVADDR_TO_PADDR(page))) {
+		free_kpages(newpage);
+		return false;
+	}
+	uio_skip(uio, len);
+	lnet_putfree(ln, newpage);
+	return true;
+#endif
+}
+
+/*
+ * Read: wait for a packet and hand back the whole of it. If it doesn't
+ * fit, the rest is lost.
+ */
+static
 int
-config_lnet(struct lnet_softc *sc, int lnetno)
+lnet_read(struct lnet_softc *ln, struct uio *uio)
 {
-	(void)sc;
+	struct lnet_linkheader *lh;
+	vaddr_t page;
+	size_t len;
+	int result;
 
-	kprintf("lnet%d: No network support in system\n", lnetno);
+	spinlock_acquire(&ln->ln_lock);
+	while (ln->ln_rxcount == 0) {
+		wchan_sleep(ln->ln_rxwchan, &ln->ln_lock);
+	}
+	page = ln->ln_rx[ln->ln_rxhead];
+	ln->ln_rxhead = (ln->ln_rxhead + 1) % LNET_RXPAGES;
+	ln->ln_rxcount--;
+	spinlock_release(&ln->ln_lock);
 
-	return ENODEV;
+	lh = (struct lnet_linkheader *)page;
+	len = lh->lh_packetlen;
+
+	if (lnet_flip(ln, page, len, uio)) {
+		return 0;
+	}
+
+	if (len > uio->uio_resid) {
+		len = uio->uio_resid;
+	}
+	result = uiomove((void *)page, len, uio);
+	lnet_putfree(ln, page);
+	return result;
 }
 
+/*
+ * Write: send UIO as one packet, filling in the header, and wait for
+ * it to go.
+ */
+static
+int
+lnet_write(struct lnet_softc *ln, struct uio *uio)
+{
+	struct lnet_linkheader *lh;
+	const void *src;
+	paddr_t loan;
+	vaddr_t upage;
+	size_t len;
+	int result;
+
+	len = uio->uio_resid;
+	if (len < sizeof(struct lnet_linkheader)) {
+		return EINVAL;
+	}
+	if (len > LNET_MTU) {
+		return EMSGSIZE;
+	}
+
+	lock_acquire(ln->ln_txlock);
+
+	loan = 0;
+#if !OPT_DUMBVM
+	if (uio_userpage(uio, &upage) &&
+	    vm_loan_page(uio->uio_space, upage, &loan) == 0) {
+		uio_skip(uio, PAGE_SIZE);
+	}
+	else {
+		loan = 0;
+	}
+#else
+	(void)upage;
+#endif
+	if (loan != 0) {
+		src = (const void *)PADDR_TO_KVADDR(loan);
+	}
+	else {
+		result = uiomove((void *)ln->ln_txpage, len, uio);
+		if (result) {
+			lock_release(ln->ln_txlock);
+			return result;
+		}
+		src = (const void *)ln->ln_txpage;
+	}
+
+	memcpy(ln->ln_tbuf, src, len);
+	if (loan != 0) {
+		free_kpages(PADDR_TO_KVADDR(loan));
+	}
+	lh = ln->ln_tbuf;
+	lh->lh_frameword = LNET_FRAMEWORD;
+	lh->lh_from = ln->ln_hwaddr;
+	lh->lh_packetlen = len;
+	membar_store_store();
+
+	spinlock_acquire(&ln->ln_lock);
+	ln->ln_txbusy = true;
+	lnet_wreg(ln, LNET_REG_CTRL, LNET_CTRL_START);
+	while (ln->ln_txbusy) {
+		wchan_sleep(ln->ln_txwchan, &ln->ln_lock);
+	}
+	spinlock_release(&ln->ln_lock);
+
+	lock_release(ln->ln_txlock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// device operations
+
+/*
+ * Function called when we are open()'d.
+ */
+static
+int
+lnet_eachopen(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+lnet_io(struct device *d, struct uio *uio)
+{
+	struct lnet_softc *ln = d->d_data;
+
+	if (uio->uio_rw == UIO_READ) {
+		return lnet_read(ln, uio);
+	}
+	return lnet_write(ln, uio);
+}
+
+/*
+ * Function for handling ioctls.
+ */
+static
+int
+lnet_ioctl(struct device *d, int op, userptr_t data)
+{
+	struct lnet_softc *ln = d->d_data;
+	int addr;
+
+	switch (op) {
+	    case LNETIOC_GETADDR:
+		addr = ln->ln_hwaddr;
+		return copyout(&addr, data, sizeof(addr));
+	}
+	return EIOCTL;
+}
+
+/*
+ * Poll: readable when a packet is waiting in the ring, writable when
+ * the card isn't sending.
+ */
+static
+int
+lnet_poll(struct device *d, struct pollentry *pe)
+{
+	struct lnet_softc *ln = d->d_data;
+	int ret = 0;
+
+	spinlock_acquire(&ln->ln_lock);
+	pollq_register(&ln->ln_pollq, pe);
+	if (ln->ln_rxcount > 0) {
+		ret |= POLLIN;
+	}
+	if (!ln->ln_txbusy) {
+		ret |= POLLOUT;
+	}
+	spinlock_release(&ln->ln_lock);
+
+	return ret;
+}
+
+static const struct device_ops lnet_devops = {
+	.devop_eachopen = lnet_eachopen,
+	.devop_io = lnet_io,
+	.devop_ioctl = lnet_ioctl,
+	.devop_poll = lnet_poll,
+};
 
+/*
+ * Setup routine called by autoconf.c when an lnet is found.
+ */
+int
+config_lnet(struct lnet_softc *ln, int lnetno)
+{
+	char name[32];
+	unsigned i;
+
+	/* Figure out what our name is. */
+	snprintf(name, sizeof(name), "lnet%d", lnetno);
+
+	/* Get pointers to the on-card buffers, and our address. */
+	ln->ln_rbuf = bus_map_area(ln->ln_busdata, ln->ln_buspos, LNET_RBUF);
+	ln->ln_tbuf = bus_map_area(ln->ln_busdata, ln->ln_buspos, LNET_TBUF);
+	ln->ln_hwaddr = lnet_rdreg(ln, LNET_REG_STAT) & 0xffff;
+
+	/* Set up the receive ring and the transmit side. */
+	ln->ln_rxwchan = wchan_create("lnet rx");
+	ln->ln_txwchan = wchan_create("lnet tx");
+	ln->ln_txlock = lock_create("lnet tx");
+	ln->ln_txpage = alloc_kpages(1);
+	if (ln->ln_rxwchan == NULL || ln->ln_txwchan == NULL ||
+	    ln->ln_txlock == NULL || ln->ln_txpage == 0) {
+		return ENOMEM;
+	}
+	spinlock_init(&ln->ln_lock);
+	for (i=0; i<LNET_RXPAGES; i++) {
+		ln->ln_free[i] = alloc_kpages(1);
+		if (ln->ln_free[i] == 0) {
+			return ENOMEM;
+		}
+	}
+	ln->ln_nfree = LNET_RXPAGES;
+	ln->ln_rxhead = 0;
+	ln->ln_rxcount = 0;
+	ln->ln_rxdrops = 0;
+	ln->ln_txbusy = false;
+	pollq_init(&ln->ln_pollq);
+
+	/* Clear anything that came in before we were ready. */
+	lnet_wreg(ln, LNET_REG_RIRQ, 0);
+	lnet_wreg(ln, LNET_REG_TIRQ, 0);
+
+	kprintf("lnet%d: hardware address %u\n", lnetno, ln->ln_hwaddr);
+
+	/* Set up the VFS device structure. */
+	ln->ln_dev.d_ops = &lnet_devops;
+	ln->ln_dev.d_blocks = 0;
+	ln->ln_dev.d_blocksize = 1;
+	ln->ln_dev.d_stats = NULL;
+	ln->ln_dev.d_data = ln;
+
+	/* Add the VFS device structure to the VFS device list. */
+	return vfs_adddev(name, &ln->ln_dev, 0);
+}
@@ -0,0 +1,57 @@
+/*
+ * LAMEbus network card.
+ */
+
+#ifndef _LAMEBUS_LNET_H_
+#define _LAMEBUS_LNET_H_
+
+#include <spinlock.h>
+#include <device.h>
+#include <poll.h>
+
+/*
+ * Received packets are taken off the card into a ring of LNET_RXPAGES
+ * page-sized buffers; see lnet.c.
+ */
+#define LNET_RXPAGES  16
+
+/*
+ * Hardware device data associated with lnet (LAMEbus network card)
+ */
+struct lnet_softc {
+	/* Initialized by lower-level attach code */
+	void *ln_busdata;		/* The bus we're on */
+	uint32_t ln_buspos;		/* Our slot on that bus */
+	int ln_unit;			/* What number lnet we are */
+
+	/*
+	 * Initialized by config_lnet
+	 */
+
+	void *ln_rbuf;			/* On-card receive buffer */
+	void *ln_tbuf;			/* On-card transmit buffer */
+	uint16_t ln_hwaddr;		/* Our hardware address */
+
+	/* Receive ring, under ln_lock */
+	struct spinlock ln_lock;	/* protects these and ln_txbusy */
+	vaddr_t ln_free[LNET_RXPAGES];	/* empty buffers */
+	unsigned ln_nfree;
+	vaddr_t ln_rx[LNET_RXPAGES];	/* received packets, oldest first */
+	unsigned ln_rxhead, ln_rxcount;
+	unsigned ln_rxdrops;		/* packets lost for want of a buffer */
+	struct wchan *ln_rxwchan;	/* readers waiting for a packet */
+
+	/* Transmit */
+	struct lock *ln_txlock;		/* one packet on the card at a time */
+	vaddr_t ln_txpage;		/* buffer to send from, under ln_txlock */
+	bool ln_txbusy;			/* card is sending */
+	struct wchan *ln_txwchan;	/* sender waiting for it */
+
+	struct pollq ln_pollq;		/* pollers */
+	struct device ln_dev;		/* VFS device structure */
+};
+
+/* Functions called by lower-level drivers */
+void lnet_irq(/*struct lnet_softc*/ void *);	/* Interrupt handler */
+
+#endif /* _LAMEBUS_LNET_H_ */
@@ -32,7 +32,6 @@
  */
 #include <types.h>
 #include <lib.h>
-#include <uio.h>
 #include <platform/bus.h>
 #include <lamebus/lrandom.h>
 #include "autoconf.h"
@@ -65,21 +64,17 @@ lrandom_randmax(void *devdata)
 	return LR_RANDMAX;
 }
 
-int
-lrandom_read(void *devdata, struct uio *uio)
+/*
+ * Fill BUF with N words at once, for the generic device's pools.
+ */
+void
+lrandom_fill(void *devdata, uint32_t *buf, unsigned n)
 {
 	struct lrandom_softc *lr = devdata;
-	uint32_t val;
-	int result;
+	unsigned i;
 
-	while (uio->uio_resid > 0) {
-		val = bus_read_register(lr->lr_bus, lr->lr_buspos,
-					  LR_REG_RAND);
-		result = uiomove(&val, sizeof(val), uio);
-		if (result) {
-			return result;
-		}
+	for (i=0; i<n; i++) {
+		buf[i] = bus_read_register(lr->lr_bus, lr->lr_buspos,
+					   LR_REG_RAND);
 	}
-
-	return 0;
 }
@@ -31,8 +31,10 @@
 #define SEMFS_H
 
 #include <array.h>
+#include <spinlock.h>
 #include <fs.h>
 #include <vnode.h>
+#include <poll.h>
 
 #ifndef SEMFS_INLINE
 #define SEMFS_INLINE INLINE
@@ -43,6 +45,7 @@
  */
 
 #define SEMFS_ROOTDIR	0xffffffffU		/* semnum for root dir */
+#define SEMFS_DIRHASH	64			/* name hash chains */
 
 /*
  * A user-facing semaphore.
@@ -52,20 +55,25 @@
  * XXX: or would we? review once all this is done.
  */
 struct semfs_sem {
-	struct lock *sems_lock;			/* Lock to protect count */
-	struct cv *sems_cv;			/* CV to wait */
+	struct spinlock sems_lock;		/* Lock to protect count */
+	struct wchan *sems_wchan;		/* Where P waits */
 	unsigned sems_count;			/* Semaphore count */
-	bool sems_hasvnode;			/* The vnode exists */
+	struct semfs_vnode *sems_vnode;		/* Its vnode, if it has one */
 	bool sems_linked;			/* In the directory */
+	struct pollq sems_pollq;		/* Pollers waiting for a count */
 };
 DECLARRAY(semfs_sem, SEMFS_INLINE);
 
 /*
- * Directory entry; name and reference to a semaphore.
+ * Directory entry; name and reference to a semaphore. Entries are
+ * kept in slots of semfs_dents, for reading the directory in order,
+ * and also hashed by name, for lookup.
  */
 struct semfs_direntry {
 	char *semd_name;			/* Name */
 	unsigned semd_semnum;			/* Which semaphore */
+	unsigned semd_slot;			/* Where in semfs_dents */
+	struct semfs_direntry *semd_next;	/* Next on the hash chain */
 };
 DECLARRAY(semfs_direntry, SEMFS_INLINE);
 
@@ -80,6 +88,7 @@ struct semfs_vnode {
 	struct vnode semv_absvn;		/* Abstract vnode */
 	struct semfs *semv_semfs;		/* Back-pointer to fs */
 	unsigned semv_semnum;			/* Which semaphore */
+	struct semfs_sem *semv_sem;		/* It (NULL for the root) */
 };
 
 /*
@@ -90,11 +99,15 @@ struct semfs {
 	struct fs semfs_absfs;			/* Abstract fs object */
 
 	struct lock *semfs_tablelock;		/* Lock for following */
-	struct vnodearray *semfs_vnodes;	/* Currently extant vnodes */
+	struct semfs_vnode *semfs_rootvn;	/* Root vnode, if it exists */
+	unsigned semfs_nvnodes;			/* Currently extant vnodes */
 	struct semfs_semarray *semfs_sems;	/* Semaphores */
+	unsigned semfs_semfree;			/* No free slot before */
 
 	struct lock *semfs_dirlock;		/* Lock for following */
 	struct semfs_direntryarray *semfs_dents; /* The root directory */
+	unsigned semfs_dentfree;		/* No free slot before */
+	struct semfs_direntry *semfs_hash[SEMFS_DIRHASH]; /* By name */
 };
 
 /*
@@ -112,6 +125,7 @@ DEFARRAY(semfs_direntry, SEMFS_INLINE);
 /* in semfs_obj.c */
 struct semfs_sem *semfs_sem_create(const char *name);
 int semfs_sem_insert(struct semfs *, struct semfs_sem *, unsigned *);
+void semfs_sem_uninsert(struct semfs *, unsigned semnum);
 void semfs_sem_destroy(struct semfs_sem *);
 struct semfs_direntry *semfs_direntry_create(const char *name, unsigned semno);
 void semfs_direntry_destroy(struct semfs_direntry *);
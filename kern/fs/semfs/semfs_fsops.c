@@ -114,7 +114,6 @@ semfs_destroy(struct semfs *semfs)
 	semfs_direntryarray_destroy(semfs->semfs_dents);
 	lock_destroy(semfs->semfs_dirlock);
 	semfs_semarray_destroy(semfs->semfs_sems);
-	vnodearray_destroy(semfs->semfs_vnodes);
 	lock_destroy(semfs->semfs_tablelock);
 	kfree(semfs);
 }
@@ -130,7 +129,7 @@ semfs_unmount(struct fs *fs)
 	struct semfs *semfs = fs->fs_data;
 
 	lock_acquire(semfs->semfs_tablelock);
-	if (vnodearray_num(semfs->semfs_vnodes) > 0) {
+	if (semfs->semfs_nvnodes > 0) {
 		lock_release(semfs->semfs_tablelock);
 		return EBUSY;
 	}
@@ -159,6 +158,7 @@ struct semfs *
 semfs_create(void)
 {
 	struct semfs *semfs;
+	unsigned i;
 
 	semfs = kmalloc(sizeof(*semfs));
 	if (semfs == NULL) {
@@ -169,14 +169,13 @@ semfs_create(void)
 	if (semfs->semfs_tablelock == NULL) {
 		goto fail_semfs;
 	}
-	semfs->semfs_vnodes = vnodearray_create();
-	if (semfs->semfs_vnodes == NULL) {
-		goto fail_tablelock;
-	}
+	semfs->semfs_rootvn = NULL;
+	semfs->semfs_nvnodes = 0;
 	semfs->semfs_sems = semfs_semarray_create();
 	if (semfs->semfs_sems == NULL) {
-		goto fail_vnodes;
+		goto fail_tablelock;
 	}
+	semfs->semfs_semfree = 0;
 
 	semfs->semfs_dirlock = lock_create("semfs_dir");
 	if (semfs->semfs_dirlock == NULL) {
@@ -186,6 +185,10 @@ semfs_create(void)
 	if (semfs->semfs_dents == NULL) {
 		goto fail_dirlock;
 	}
+	semfs->semfs_dentfree = 0;
+	for (i=0; i<SEMFS_DIRHASH; i++) {
+		semfs->semfs_hash[i] = NULL;
+	}
 
 	semfs->semfs_absfs.fs_data = semfs;
 	semfs->semfs_absfs.fs_ops = &semfs_fsops;
@@ -195,8 +198,6 @@ semfs_create(void)
 	lock_destroy(semfs->semfs_dirlock);
  fail_sems:
 	semfs_semarray_destroy(semfs->semfs_sems);
- fail_vnodes:
-	vnodearray_destroy(semfs->semfs_vnodes);
  fail_tablelock:
 	lock_destroy(semfs->semfs_tablelock);
  fail_semfs:
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <synch.h>
+#include <wchan.h>
 
 #define SEMFS_INLINE
 #include "semfs.h"
@@ -44,31 +45,25 @@ struct semfs_sem *
 semfs_sem_create(const char *name)
 {
 	struct semfs_sem *sem;
-	char lockname[32];
-	char cvname[32];
 
-	snprintf(lockname, sizeof(lockname), "sem:l.%s", name);
-	snprintf(cvname, sizeof(cvname), "sem:%s", name);
+	/* wchan_create keeps the pointer to the name; don't use NAME */
+	(void)name;
 
 	sem = kmalloc(sizeof(*sem));
 	if (sem == NULL) {
 		goto fail_return;
 	}
-	sem->sems_lock = lock_create(lockname);
-	if (sem->sems_lock == NULL) {
+	sem->sems_wchan = wchan_create("semfs-sem");
+	if (sem->sems_wchan == NULL) {
 		goto fail_sem;
 	}
-	sem->sems_cv = cv_create(cvname);
-	if (sem->sems_cv == NULL) {
-		goto fail_lock;
-	}
+	spinlock_init(&sem->sems_lock);
 	sem->sems_count = 0;
-	sem->sems_hasvnode = false;
+	sem->sems_vnode = NULL;
 	sem->sems_linked = false;
+	pollq_init(&sem->sems_pollq);
 	return sem;
 
- fail_lock:
-	lock_destroy(sem->sems_lock);
  fail_sem:
 	kfree(sem);
  fail_return:
@@ -81,18 +76,22 @@ semfs_sem_create(const char *name)
 void
 semfs_sem_destroy(struct semfs_sem *sem)
 {
-	cv_destroy(sem->sems_cv);
-	lock_destroy(sem->sems_lock);
+	pollq_cleanup(&sem->sems_pollq);
+	spinlock_cleanup(&sem->sems_lock);
+	wchan_destroy(sem->sems_wchan);
 	kfree(sem);
 }
 
 /*
- * Helper to insert a semfs_sem into the semaphore table.
+ * Helper to insert a semfs_sem into the semaphore table. The search
+ * for a free slot starts from semfs_semfree, so filling the table
+ * doesn't go over it again each time.
  */
 int
 semfs_sem_insert(struct semfs *semfs, struct semfs_sem *sem, unsigned *ret)
 {
 	unsigned i, num;
+	int result;
 
 	KASSERT(lock_do_i_hold(semfs->semfs_tablelock));
 	num = semfs_semarray_num(semfs->semfs_sems);
@@ -100,14 +99,32 @@ semfs_sem_insert(struct semfs *semfs, struct semfs_sem *sem, unsigned *ret)
 		/* Too many */
 		return ENOSPC;
 	}
-	for (i=0; i<num; i++) {
+	for (i=semfs->semfs_semfree; i<num; i++) {
 		if (semfs_semarray_get(semfs->semfs_sems, i) == NULL) {
 			semfs_semarray_set(semfs->semfs_sems, i, sem);
+			semfs->semfs_semfree = i + 1;
 			*ret = i;
 			return 0;
 		}
 	}
-	return semfs_semarray_add(semfs->semfs_sems, sem, ret);
+	result = semfs_semarray_add(semfs->semfs_sems, sem, ret);
+	if (result == 0) {
+		semfs->semfs_semfree = *ret + 1;
+	}
+	return result;
+}
+
+/*
+ * Helper to take semaphore SEMNUM out of the semaphore table.
+ */
+void
+semfs_sem_uninsert(struct semfs *semfs, unsigned semnum)
+{
+	KASSERT(lock_do_i_hold(semfs->semfs_tablelock));
+	semfs_semarray_set(semfs->semfs_sems, semnum, NULL);
+	if (semnum < semfs->semfs_semfree) {
+		semfs->semfs_semfree = semnum;
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -131,6 +148,8 @@ semfs_direntry_create(const char *name, unsigned semnum)
 		return NULL;
 	}
 	dent->semd_semnum = semnum;
+	dent->semd_slot = 0;
+	dent->semd_next = NULL;
 	return dent;
 }
 
@@ -33,6 +33,7 @@
 #include <stat.h>
 #include <uio.h>
 #include <synch.h>
+#include <wchan.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
@@ -107,36 +108,22 @@ semfs_fsync(struct vnode *vn)
 // semaphore ops
 
 /*
- * XXX fold these two together
+ * The semaphore stays put as long as the vnode does, so this needn't
+ * go through the table.
  */
-
-static
-struct semfs_sem *
-semfs_getsembynum(struct semfs *semfs, unsigned semnum)
-{
-	struct semfs_sem *sem;
-
-	lock_acquire(semfs->semfs_tablelock);
-	sem = semfs_semarray_get(semfs->semfs_sems, semnum);
-	lock_release(semfs->semfs_tablelock);
-
-	return sem;
-}
-
 static
 struct semfs_sem *
 semfs_getsem(struct semfs_vnode *semv)
 {
-	struct semfs *semfs = semv->semv_semfs;
-
-	return semfs_getsembynum(semfs, semv->semv_semnum);
+	KASSERT(semv->semv_sem != NULL);
+	return semv->semv_sem;
 }
 
 /*
  * Wakeup helper. We only need to wake up if there are sleepers, which
  * should only be the case if the old count is 0; and we only
  * potentially need to wake more than one sleeper if the new count
- * will be more than 1.
+ * will be more than 1. Pollers waiting to P also want to know.
  */
 static
 void
@@ -145,14 +132,73 @@ semfs_wakeup(struct semfs_sem *sem, unsigned newcount)
 	if (sem->sems_count > 0 || newcount == 0) {
 		return;
 	}
+	pollq_wakeup(&sem->sems_pollq);
 	if (newcount == 1) {
-		cv_signal(sem->sems_cv, sem->sems_lock);
+		wchan_wakeone(sem->sems_wchan, &sem->sems_lock);
 	}
 	else {
-		cv_broadcast(sem->sems_cv, sem->sems_lock);
+		wchan_wakeall(sem->sems_wchan, &sem->sems_lock);
 	}
 }
 
+/*
+ * P: take COUNT from the count, waiting for it as necessary.
+ */
+static
+void
+semfs_p(struct semfs_vnode *semv, struct semfs_sem *sem, size_t count)
+{
+	size_t consume;
+
+	spinlock_acquire(&sem->sems_lock);
+	while (count > 0) {
+		if (sem->sems_count > 0) {
+			consume = count;
+			if (consume > sem->sems_count) {
+				consume = sem->sems_count;
+			}
+			DEBUG(DB_SEMFS, "semfs: sem%u: P, count %u -> %u\n",
+			      semv->semv_semnum, sem->sems_count,
+			      sem->sems_count - consume);
+			sem->sems_count -= consume;
+			count -= consume;
+		}
+		if (count == 0) {
+			break;
+		}
+		if (sem->sems_count == 0) {
+			DEBUG(DB_SEMFS, "semfs: sem%u: blocking\n",
+			      semv->semv_semnum);
+			wchan_sleep(sem->sems_wchan, &sem->sems_lock);
+		}
+	}
+	spinlock_release(&sem->sems_lock);
+}
+
+/*
+ * V: add COUNT to the count.
+ */
+static
+int
+semfs_v(struct semfs_vnode *semv, struct semfs_sem *sem, size_t count)
+{
+	unsigned newcount;
+
+	spinlock_acquire(&sem->sems_lock);
+	newcount = sem->sems_count + count;
+	if (newcount < sem->sems_count) {
+		/* overflow */
+		spinlock_release(&sem->sems_lock);
+		return EFBIG;
+	}
+	DEBUG(DB_SEMFS, "semfs: sem%u: V, count %u -> %u\n",
+	      semv->semv_semnum, sem->sems_count, newcount);
+	semfs_wakeup(sem, newcount);
+	sem->sems_count = newcount;
+	spinlock_release(&sem->sems_lock);
+	return 0;
+}
+
 /*
  * stat() for semaphore vnodes
  */
@@ -167,10 +213,10 @@ semfs_semstat(struct vnode *vn, struct stat *buf)
 
 	bzero(buf, sizeof(*buf));
 
-	lock_acquire(sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
 	buf->st_size = sem->sems_count;
 	buf->st_nlink = sem->sems_linked ? 1 : 0;
-	lock_release(sem->sems_lock);
+	spinlock_release(&sem->sems_lock);
 
 	buf->st_mode = S_IFREG | 0666;
 	buf->st_blocks = 0;
@@ -189,36 +235,11 @@ int
 semfs_read(struct vnode *vn, struct uio *uio)
 {
 	struct semfs_vnode *semv = vn->vn_data;
-	struct semfs_sem *sem;
-	size_t consume;
-
-	sem = semfs_getsem(semv);
 
-	lock_acquire(sem->sems_lock);
-	while (uio->uio_resid > 0) {
-		if (sem->sems_count > 0) {
-			consume = uio->uio_resid;
-			if (consume > sem->sems_count) {
-				consume = sem->sems_count;
-			}
-			DEBUG(DB_SEMFS, "semfs: sem%u: P, count %u -> %u\n",
-			      semv->semv_semnum, sem->sems_count,
-			      sem->sems_count - consume);
-			sem->sems_count -= consume;
-			/* don't bother advancing the uio data pointers */
-			uio->uio_offset += consume;
-			uio->uio_resid -= consume;
-		}
-		if (uio->uio_resid == 0) {
-			break;
-		}
-		if (sem->sems_count == 0) {
-			DEBUG(DB_SEMFS, "semfs: sem%u: blocking\n",
-			      semv->semv_semnum);
-			cv_wait(sem->sems_cv, sem->sems_lock);
-		}
-	}
-	lock_release(sem->sems_lock);
+	semfs_p(semv, semfs_getsem(semv), uio->uio_resid);
+	/* don't bother advancing the uio data pointers */
+	uio->uio_offset += uio->uio_resid;
+	uio->uio_resid = 0;
 	return 0;
 }
 
@@ -231,27 +252,14 @@ int
 semfs_write(struct vnode *vn, struct uio *uio)
 {
 	struct semfs_vnode *semv = vn->vn_data;
-	struct semfs_sem *sem;
-	unsigned newcount;
-
-	sem = semfs_getsem(semv);
+	int result;
 
-	lock_acquire(sem->sems_lock);
-	while (uio->uio_resid > 0) {
-		newcount = sem->sems_count + uio->uio_resid;
-		if (newcount < sem->sems_count) {
-			/* overflow */
-			lock_release(sem->sems_lock);
-			return EFBIG;
-		}
-		DEBUG(DB_SEMFS, "semfs: sem%u: V, count %u -> %u\n",
-		      semv->semv_semnum, sem->sems_count, newcount);
-		semfs_wakeup(sem, newcount);
-		sem->sems_count = newcount;
-		uio->uio_offset += uio->uio_resid;
-		uio->uio_resid = 0;
-	}
-	lock_release(sem->sems_lock);
+	result = semfs_v(semv, semfs_getsem(semv), uio->uio_resid);
+	if (result) {
+		return result;
+	}
+	uio->uio_offset += uio->uio_resid;
+	uio->uio_resid = 0;
 	return 0;
 }
 
@@ -283,14 +291,39 @@ semfs_truncate(struct vnode *vn, off_t len)
 
 	sem = semfs_getsem(semv);
 
-	lock_acquire(sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
 	semfs_wakeup(sem, newcount);
 	sem->sems_count = newcount;
-	lock_release(sem->sems_lock);
+	spinlock_release(&sem->sems_lock);
 
 	return 0;
 }
 
+/*
+ * Poll. Reading (P) is ready when the count isn't 0; writing (V)
+ * never blocks.
+ */
+static
+int
+semfs_poll(struct vnode *vn, struct pollentry *pe)
+{
+	struct semfs_vnode *semv = vn->vn_data;
+	struct semfs_sem *sem;
+	int ret;
+
+	sem = semfs_getsem(semv);
+
+	spinlock_acquire(&sem->sems_lock);
+	pollq_register(&sem->sems_pollq, pe);
+	ret = POLLOUT;
+	if (sem->sems_count > 0) {
+		ret |= POLLIN;
+	}
+	spinlock_release(&sem->sems_lock);
+
+	return ret;
+}
+
 ////////////////////////////////////////////////////////////
 // directory ops
 
@@ -366,6 +399,101 @@ semfs_namefile(struct vnode *vn, struct uio *uio)
 	return 0;
 }
 
+/*
+ * Hash a name to its chain (FNV-1a, as for tmpfs).
+ */
+static
+unsigned
+semfs_dirhash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash = (hash ^ (unsigned char)*name) * 16777619U;
+		name++;
+	}
+	return hash % SEMFS_DIRHASH;
+}
+
+/*
+ * Find the directory entry for NAME. The caller holds semfs_dirlock.
+ */
+static
+struct semfs_direntry *
+semfs_dir_find(struct semfs *semfs, const char *name)
+{
+	struct semfs_direntry *dent;
+
+	KASSERT(lock_do_i_hold(semfs->semfs_dirlock));
+	for (dent = semfs->semfs_hash[semfs_dirhash(name)]; dent != NULL;
+	     dent = dent->semd_next) {
+		if (!strcmp(dent->semd_name, name)) {
+			return dent;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Put DENT in the first free slot and on its hash chain. The caller
+ * holds semfs_dirlock.
+ */
+static
+int
+semfs_dir_add(struct semfs *semfs, struct semfs_direntry *dent)
+{
+	struct semfs_direntry **head;
+	unsigned i, num;
+	int result;
+
+	KASSERT(lock_do_i_hold(semfs->semfs_dirlock));
+	num = semfs_direntryarray_num(semfs->semfs_dents);
+	for (i=semfs->semfs_dentfree; i<num; i++) {
+		if (semfs_direntryarray_get(semfs->semfs_dents, i) == NULL) {
+			break;
+		}
+	}
+	if (i < num) {
+		semfs_direntryarray_set(semfs->semfs_dents, i, dent);
+	}
+	else {
+		result = semfs_direntryarray_add(semfs->semfs_dents, dent, &i);
+		if (result) {
+			return result;
+		}
+	}
+	dent->semd_slot = i;
+	semfs->semfs_dentfree = i + 1;
+
+	head = &semfs->semfs_hash[semfs_dirhash(dent->semd_name)];
+	dent->semd_next = *head;
+	*head = dent;
+	return 0;
+}
+
+/*
+ * Take DENT out of its slot and off its hash chain. The caller holds
+ * semfs_dirlock, and destroys DENT.
+ */
+static
+void
+semfs_dir_remove(struct semfs *semfs, struct semfs_direntry *dent)
+{
+	struct semfs_direntry **dp;
+
+	KASSERT(lock_do_i_hold(semfs->semfs_dirlock));
+	for (dp = &semfs->semfs_hash[semfs_dirhash(dent->semd_name)];
+	     *dp != dent; dp = &(*dp)->semd_next) {
+		KASSERT(*dp != NULL);
+	}
+	*dp = dent->semd_next;
+
+	semfs_direntryarray_set(semfs->semfs_dents, dent->semd_slot, NULL);
+	if (dent->semd_slot < semfs->semfs_dentfree) {
+		semfs->semfs_dentfree = dent->semd_slot;
+	}
+}
+
 /*
  * Create a semaphore.
  */
@@ -378,7 +506,7 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
 	struct semfs_sem *sem;
-	unsigned i, num, empty, semnum;
+	unsigned semnum;
 	int result;
 
 	(void)mode;
@@ -387,27 +515,15 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	}
 
 	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	empty = num;
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			if (empty == num) {
-				empty = i;
-			}
-			continue;
-		}
-		if (!strcmp(dent->semd_name, name)) {
-			/* found */
-			if (excl) {
-				lock_release(semfs->semfs_dirlock);
-				return EEXIST;
-			}
-			result = semfs_getvnode(semfs, dent->semd_semnum,
-						resultvn);
+	dent = semfs_dir_find(semfs, name);
+	if (dent != NULL) {
+		if (excl) {
 			lock_release(semfs->semfs_dirlock);
-			return result;
+			return EEXIST;
 		}
+		result = semfs_getvnode(semfs, dent->semd_semnum, resultvn);
+		lock_release(semfs->semfs_dirlock);
+		return result;
 	}
 
 	/* create it */
@@ -425,18 +541,13 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 
 	dent = semfs_direntry_create(name, semnum);
 	if (dent == NULL) {
+		result = ENOMEM;
 		goto fail_uninsert;
 	}
 
-	if (empty < num) {
-		semfs_direntryarray_set(semfs->semfs_dents, empty, dent);
-	}
-	else {
-		result = semfs_direntryarray_add(semfs->semfs_dents, dent,
-						 &empty);
-		if (result) {
-			goto fail_undent;
-		}
+	result = semfs_dir_add(semfs, dent);
+	if (result) {
+		goto fail_undent;
 	}
 
 	result = semfs_getvnode(semfs, semnum, resultvn);
@@ -449,12 +560,12 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	return 0;
 
  fail_undir:
-	semfs_direntryarray_set(semfs->semfs_dents, empty, NULL);
+	semfs_dir_remove(semfs, dent);
  fail_undent:
 	semfs_direntry_destroy(dent);
  fail_uninsert:
 	lock_acquire(semfs->semfs_tablelock);
-	semfs_semarray_set(semfs->semfs_sems, semnum, NULL);
+	semfs_sem_uninsert(semfs, semnum);
 	lock_release(semfs->semfs_tablelock);
  fail_uncreate:
 	semfs_sem_destroy(sem);
@@ -475,47 +586,39 @@ semfs_remove(struct vnode *dirvn, const char *name)
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
 	struct semfs_sem *sem;
-	unsigned i, num;
-	int result;
+	bool destroy;
 
 	if (!strcmp(name, ".") || !strcmp(name, "..")) {
 		return EINVAL;
 	}
 
 	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			continue;
-		}
-		if (!strcmp(name, dent->semd_name)) {
-			/* found */
-			sem = semfs_getsembynum(semfs, dent->semd_semnum);
-			lock_acquire(sem->sems_lock);
-			KASSERT(sem->sems_linked);
-			sem->sems_linked = false;
-			if (sem->sems_hasvnode == false) {
-				lock_acquire(semfs->semfs_tablelock);
-				semfs_semarray_set(semfs->semfs_sems,
-						   dent->semd_semnum, NULL);
-				lock_release(semfs->semfs_tablelock);
-				lock_release(sem->sems_lock);
-				semfs_sem_destroy(sem);
-			}
-			else {
-				lock_release(sem->sems_lock);
-			}
-			semfs_direntryarray_set(semfs->semfs_dents, i, NULL);
-			semfs_direntry_destroy(dent);
-			result = 0;
-			goto out;
-		}
+	dent = semfs_dir_find(semfs, name);
+	if (dent == NULL) {
+		lock_release(semfs->semfs_dirlock);
+		return ENOENT;
+	}
+
+	/* the table lock also covers sems_vnode */
+	lock_acquire(semfs->semfs_tablelock);
+	sem = semfs_semarray_get(semfs->semfs_sems, dent->semd_semnum);
+	spinlock_acquire(&sem->sems_lock);
+	KASSERT(sem->sems_linked);
+	sem->sems_linked = false;
+	destroy = sem->sems_vnode == NULL;
+	spinlock_release(&sem->sems_lock);
+	if (destroy) {
+		semfs_sem_uninsert(semfs, dent->semd_semnum);
 	}
-	result = ENOENT;
- out:
+	lock_release(semfs->semfs_tablelock);
+	if (destroy) {
+		semfs_sem_destroy(sem);
+	}
+	semfs_dir_remove(semfs, dent);
+	semfs_direntry_destroy(dent);
+
 	lock_release(semfs->semfs_dirlock);
-	return result;
+	return 0;
 }
 
 /*
@@ -528,7 +631,6 @@ semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
 	struct semfs_vnode *dirsemv = dirvn->vn_data;
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
-	unsigned i, num;
 	int result;
 
 	if (!strcmp(path, ".") || !strcmp(path, "..")) {
@@ -538,21 +640,15 @@ semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
 	}
 
 	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			continue;
-		}
-		if (!strcmp(path, dent->semd_name)) {
-			result = semfs_getvnode(semfs, dent->semd_semnum,
-						resultvn);
-			lock_release(semfs->semfs_dirlock);
-			return result;
-		}
+	dent = semfs_dir_find(semfs, path);
+	if (dent == NULL) {
+		result = ENOENT;
+	}
+	else {
+		result = semfs_getvnode(semfs, dent->semd_semnum, resultvn);
 	}
 	lock_release(semfs->semfs_dirlock);
-	return ENOENT;
+	return result;
 }
 
 /*
@@ -597,42 +693,29 @@ semfs_reclaim(struct vnode *vn)
 {
 	struct semfs_vnode *semv = vn->vn_data;
 	struct semfs *semfs = semv->semv_semfs;
-	struct vnode *vn2;
 	struct semfs_sem *sem;
-	unsigned i, num;
 
 	lock_acquire(semfs->semfs_tablelock);
 
-	/* vnode refcount is protected by the vnode's ->vn_countlock */
-	spinlock_acquire(&vn->vn_countlock);
-	if (vn->vn_refcount > 1) {
-		/* consume the reference VOP_DECREF passed us */
-		vn->vn_refcount--;
-
-		spinlock_release(&vn->vn_countlock);
+	if (vnode_decref_unless_last(vn)) {
+		/* consumed the reference VOP_DECREF passed us */
 		lock_release(semfs->semfs_tablelock);
 		return EBUSY;
 	}
 
-	spinlock_release(&vn->vn_countlock);
-
-	/* remove from the table */
-	num = vnodearray_num(semfs->semfs_vnodes);
-	for (i=0; i<num; i++) {
-		vn2 = vnodearray_get(semfs->semfs_vnodes, i);
-		if (vn2 == vn) {
-			vnodearray_remove(semfs->semfs_vnodes, i);
-			break;
-		}
+	/* detach from its semaphore */
+	KASSERT(semfs->semfs_nvnodes > 0);
+	semfs->semfs_nvnodes--;
+	if (semv->semv_semnum == SEMFS_ROOTDIR) {
+		KASSERT(semfs->semfs_rootvn == semv);
+		semfs->semfs_rootvn = NULL;
 	}
-
-	if (semv->semv_semnum != SEMFS_ROOTDIR) {
-		sem = semfs_semarray_get(semfs->semfs_sems, semv->semv_semnum);
-		KASSERT(sem->sems_hasvnode);
-		sem->sems_hasvnode = false;
+	else {
+		sem = semv->semv_sem;
+		KASSERT(sem->sems_vnode == semv);
+		sem->sems_vnode = NULL;
 		if (sem->sems_linked == false) {
-			semfs_semarray_set(semfs->semfs_sems,
-					   semv->semv_semnum, NULL);
+			semfs_sem_uninsert(semfs, semv->semv_semnum);
 			semfs_sem_destroy(sem);
 		}
 	}
@@ -665,7 +748,10 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_fsync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_fallocate = vopfail_fallocate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
 	.vop_namefile = semfs_namefile,
+	.vop_poll = vopnull_poll,
 
 	.vop_creat = semfs_creat,
 	.vop_symlink = vopfail_symlink_nosys,
@@ -698,7 +784,10 @@ static const struct vnode_ops semfs_semops = {
 	.vop_fsync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_perm,
 	.vop_truncate = semfs_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = vopfail_seekhole_nosys,
 	.vop_namefile = vopfail_uio_notdir,
+	.vop_poll = semfs_poll,
 
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
@@ -736,6 +825,7 @@ semfs_vnode_create(struct semfs *semfs, unsigned semnum)
 
 	semv->semv_semfs = semfs;
 	semv->semv_semnum = semnum;
+	semv->semv_sem = NULL;
 
 	result = vnode_init(&semv->semv_absvn, optable,
 			    &semfs->semfs_absfs, semv);
@@ -747,31 +837,31 @@ semfs_vnode_create(struct semfs *semfs, unsigned semnum)
 
 /*
  * Look up the vnode for a semaphore by number; if it doesn't exist,
- * create it.
+ * create it. The semaphore points at its vnode, if it has one.
  */
 int
 semfs_getvnode(struct semfs *semfs, unsigned semnum, struct vnode **ret)
 {
-	struct vnode *vn;
 	struct semfs_vnode *semv;
-	struct semfs_sem *sem;
-	unsigned i, num;
-	int result;
+	struct semfs_sem *sem = NULL;
 
 	/* Lock the vnode table */
 	lock_acquire(semfs->semfs_tablelock);
 
 	/* Look for it */
-	num = vnodearray_num(semfs->semfs_vnodes);
-	for (i=0; i<num; i++) {
-		vn = vnodearray_get(semfs->semfs_vnodes, i);
-		semv = vn->vn_data;
-		if (semv->semv_semnum == semnum) {
-			VOP_INCREF(vn);
-			lock_release(semfs->semfs_tablelock);
-			*ret = vn;
-			return 0;
-		}
+	if (semnum == SEMFS_ROOTDIR) {
+		semv = semfs->semfs_rootvn;
+	}
+	else {
+		sem = semfs_semarray_get(semfs->semfs_sems, semnum);
+		KASSERT(sem != NULL);
+		semv = sem->sems_vnode;
+	}
+	if (semv != NULL) {
+		VOP_INCREF(&semv->semv_absvn);
+		lock_release(semfs->semfs_tablelock);
+		*ret = &semv->semv_absvn;
+		return 0;
 	}
 
 	/* Make it */
@@ -780,20 +870,49 @@ semfs_getvnode(struct semfs *semfs, unsigned semnum, struct vnode **ret)
 		lock_release(semfs->semfs_tablelock);
 		return ENOMEM;
 	}
-	result = vnodearray_add(semfs->semfs_vnodes, &semv->semv_absvn, NULL);
-	if (result) {
-		semfs_vnode_destroy(semv);
-		lock_release(semfs->semfs_tablelock);
-		return ENOMEM;
+	semfs->semfs_nvnodes++;
+	if (sem == NULL) {
+		semfs->semfs_rootvn = semv;
 	}
-	if (semnum != SEMFS_ROOTDIR) {
-		sem = semfs_semarray_get(semfs->semfs_sems, semnum);
-		KASSERT(sem != NULL);
-		KASSERT(sem->sems_hasvnode == false);
-		sem->sems_hasvnode = true;
+	else {
+		sem->sems_vnode = semv;
+		semv->semv_sem = sem;
 	}
 	lock_release(semfs->semfs_tablelock);
 
 	*ret = &semv->semv_absvn;
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// semwait and sempost
+
+/*
+ * P and V on a semaphore vnode directly, for sys_semwait and
+ * sys_sempost, without going through VOP_READ and VOP_WRITE and
+ * setting up a uio for every operation.
+ */
+int
+semfs_semwait(struct vnode *vn, unsigned count)
+{
+	struct semfs_vnode *semv;
+
+	if (vn->vn_ops != &semfs_semops) {
+		return EINVAL;
+	}
+	semv = vn->vn_data;
+	semfs_p(semv, semfs_getsem(semv), count);
+	return 0;
+}
+
+int
+semfs_sempost(struct vnode *vn, unsigned count)
+{
+	struct semfs_vnode *semv;
+
+	if (vn->vn_ops != &semfs_semops) {
+		return EINVAL;
+	}
+	semv = vn->vn_data;
+	return semfs_v(semv, semfs_getsem(semv), count);
+}
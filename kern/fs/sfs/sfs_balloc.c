@@ -35,57 +35,186 @@
 #include <types.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This only needs a buffer, not a read; the
+ * zeros get to the disk when it's written back (or when OWNER, if not
+ * NULL, is synced; see buf_setowner).
  */
-static
 int
-sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
+sfs_clearblock(struct sfs_fs *sfs, daddr_t block, const void *owner)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *b;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = buf_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buf_data(b), sfs->sfs_blocksize);
+	if (owner != NULL) {
+		buf_setowner(b, owner);
+	}
+	buf_markdirty(b);
+	buf_release(b);
+	return 0;
 }
 
 /*
- * Allocate a block.
+ * Allocate a run of up to MAX consecutive blocks, starting at the
+ * first free one at or after GOAL, and return the first and how many
+ * there are. They are not cleared.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_balloc_run(struct sfs_fs *sfs, daddr_t goal, unsigned max,
+	       daddr_t *start, unsigned *count)
 {
+	daddr_t block;
+	unsigned n;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	KASSERT(max > 0);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, &block);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
+	if (block >= sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc: invalid block %u\n",
+		      sfs->sfs_sb.sb_volname, block);
+	}
+	for (n = 1; n < max && block + n < sfs->sfs_sb.sb_nblocks; n++) {
+		if (bitmap_isset(sfs->sfs_freemap, block + n)) {
+			break;
+		}
+		bitmap_mark(sfs->sfs_freemap, block + n);
+	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
-		panic("sfs: %s: balloc: invalid block %u\n",
-		      sfs->sfs_sb.sb_volname, *diskblock);
+	*start = block;
+	*count = n;
+	return 0;
+}
+
+/*
+ * Allocate a block, as near after GOAL as there is one free. The
+ * block is cleared without the freemap lock held; it's already
+ * marked, so nobody else can be handed it.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	unsigned n;
+	int result;
+
+	result = sfs_balloc_run(sfs, goal, 1, diskblock, &n);
+	if (result) {
+		return result;
 	}
 
 	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
+	result = sfs_clearblock(sfs, *diskblock, NULL);
 	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
 /*
- * Free a block.
+ * Free a block. Its contents no longer matter, so the buffer cache
+ * can forget them; this has to be done while the block is still
+ * marked, or it might be handed out again and cleared first.
+ *
+ * On a volume with a journal it stays marked until the next commit,
+ * when sfs_bfree_commit frees it for real: until the metadata that no
+ * longer uses it is committed, a crash could leave it in use.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_bfree_run(sfs, diskblock, 1);
+}
+
+/*
+ * Free COUNT consecutive blocks from START on, as sfs_bfree, taking
+ * the freemap lock once and changing the bitmap a word at a time.
+ */
+void
+sfs_bfree_run(struct sfs_fs *sfs, daddr_t start, unsigned count)
+{
+	unsigned i;
+
+	for (i=0; i<count; i++) {
+		buf_discard(sfs->sfs_device, start + i);
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_journaled) {
+		bitmap_mark_range(sfs->sfs_jfreed, start, count);
+		sfs->sfs_jnfreed += count;
+	}
+	else {
+		bitmap_unmark_range(sfs->sfs_freemap, start, count);
+		sfs->sfs_freemapdirty = true;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Batching frees: blocks that come one after another on disk, as a
+ * file's mostly do, are saved up in BATCH and freed together when one
+ * doesn't follow on, or at sfs_bfree_flush.
+ */
+void
+sfs_bfree_batch(struct sfs_fs *sfs, struct sfs_freebatch *batch,
+		daddr_t diskblock)
+{
+	if (batch->fb_count > 0 &&
+	    diskblock == batch->fb_start + batch->fb_count) {
+		batch->fb_count++;
+		return;
+	}
+	sfs_bfree_flush(sfs, batch);
+	batch->fb_start = diskblock;
+	batch->fb_count = 1;
+}
+
+void
+sfs_bfree_flush(struct sfs_fs *sfs, struct sfs_freebatch *batch)
+{
+	if (batch->fb_count > 0) {
+		sfs_bfree_run(sfs, batch->fb_start, batch->fb_count);
+		batch->fb_count = 0;
+	}
+}
+
+/*
+ * Free the blocks sfs_bfree has put off freeing, for a commit.
+ */
+void
+sfs_bfree_commit(struct sfs_fs *sfs)
+{
+	daddr_t block;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (block = 0; sfs->sfs_jnfreed > 0; block++) {
+		if (bitmap_isset(sfs->sfs_jfreed, block)) {
+			bitmap_unmark(sfs->sfs_jfreed, block);
+			bitmap_unmark(sfs->sfs_freemap, block);
+			sfs->sfs_jnfreed--;
+			sfs->sfs_freemapdirty = true;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +223,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int result;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return result;
 }
 
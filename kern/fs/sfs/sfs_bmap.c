@@ -35,39 +35,165 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Block placement. A file's next block goes right after its previous
+ * one if that's free, or failing that the next free block after it
+ * (the first block of a file, after its inode). So that files being
+ * written at the same time don't end up interleaved, each allocation
+ * for a vnode that doesn't continue its reservation takes a run of up
+ * to SFS_PREALLOC free blocks, and keeps the rest reserved for the
+ * blocks of the file that follow. Reserved blocks are marked in the
+ * freemap; the reservation is given back when the vnode is reclaimed
+ * or the file truncated. (If the system crashes first, they show up
+ * as allocated but unused, which sfsck fixes.) While preallocating,
+ * sv_rsvkeep says to go on taking the reservation in order whatever
+ * the goal.
+ */
+#define SFS_PREALLOC 8
+
+/*
+ * Give back the blocks SV has reserved.
+ */
+void
+sfs_bmap_unreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	KASSERT(sfs_vnode_do_i_hold(sv));
+
+	while (sv->sv_nreserved > 0) {
+		sfs_bfree(sfs, sv->sv_reserved);
+		sv->sv_reserved++;
+		sv->sv_nreserved--;
+	}
+}
+
+/*
+ * Allocate a block for SV, at GOAL if possible. It is cleared unless
+ * FRESH is set.
+ */
+static
+int
+sfs_bmap_alloc(struct sfs_vnode *sv, daddr_t goal, bool fresh,
+	       daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	unsigned n;
+	int result;
+
+	if (sv->sv_nreserved > 0 &&
+	    (sv->sv_reserved == goal || sv->sv_rsvkeep)) {
+		block = sv->sv_reserved++;
+		sv->sv_nreserved--;
+	}
+	else {
+		sfs_bmap_unreserve(sv);
+		result = sfs_balloc_run(sfs, goal, SFS_PREALLOC, &block, &n);
+		if (result) {
+			return result;
+		}
+		sv->sv_reserved = block + 1;
+		sv->sv_nreserved = n - 1;
+	}
+
+	if (!fresh) {
+		result = sfs_clearblock(sfs, block, sv);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * The inode's indirect block of level LEVEL: 1 for the single
+ * indirect block, 2 for the double, 3 for the triple.
+ */
+#define SFS_INDIRECT_LEVELS 3
+
+static
+uint32_t *
+sfs_bmap_top(struct sfs_dinode *sfi, unsigned level)
+{
+	switch (level) {
+	    case 1: return &sfi->sfi_indirect;
+	    case 2: return &sfi->sfi_dindirect;
+	    case 3: return &sfi->sfi_tindirect;
+	}
+	panic("sfs: no indirect block of level %u\n", level);
+	return NULL;
+}
+
+/*
+ * The bmap cache. Each vnode remembers the last run of file blocks
+ * found under its indirect blocks that are also consecutive on disk,
+ * so that going through a file in order reads each indirect block
+ * once rather than once per block. Only blocks actually there are
+ * remembered, and the only thing that takes a block away from a file
+ * is truncation, which forgets the lot; allocating fills a hole, so
+ * it can only make the run longer.
+ */
+static
+void
+sfs_bmap_remember(struct sfs_vnode *sv, uint32_t fileblock, daddr_t block)
+{
+	if (sv->sv_bmlen > 0 &&
+	    fileblock == sv->sv_bmfile + sv->sv_bmlen &&
+	    block == sv->sv_bmdisk + sv->sv_bmlen) {
+		sv->sv_bmlen++;
+		return;
+	}
+	sv->sv_bmfile = fileblock;
+	sv->sv_bmdisk = block;
+	sv->sv_bmlen = 1;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * A newly allocated data block is cleared, unless FRESH is not NULL;
+ * then *FRESH says whether the block is new, and if it is the caller
+ * must fill all of it in.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+	 bool *fresh, daddr_t *diskblock)
 {
 	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * Buffer for the indirect block, and its contents. The file's
+	 * lock, which we hold, covers them.
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *iddata;
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	daddr_t parent;
+	daddr_t goal;
+	uint32_t *top;
+	uint64_t range;		/* can pass 2^32 with big blocks */
+	uint32_t idoff;
+	uint32_t origblock = fileblock;
+	unsigned level;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(sfs_vnode_do_i_hold(sv));
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	if (fresh != NULL) {
+		*fresh = false;
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,14 +208,24 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			/* Put it after the previous block, or the inode */
+			goal = fileblock > 0 ?
+				sv->sv_i.sfi_direct[fileblock-1] : sv->sv_ino;
+			if (goal == 0) {
+				goal = sv->sv_ino;
+			}
+			result = sfs_bmap_alloc(sv, goal + 1, fresh != NULL,
+						&block);
 			if (result) {
 				return result;
 			}
+			if (fresh != NULL) {
+				*fresh = true;
+			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 
 		/*
@@ -104,30 +240,35 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		return 0;
 	}
 
+	/* Under the indirect blocks, try the bmap cache first */
+	if (fileblock >= sv->sv_bmfile &&
+	    fileblock - sv->sv_bmfile < sv->sv_bmlen) {
+		*diskblock = sv->sv_bmdisk + (fileblock - sv->sv_bmfile);
+		return 0;
+	}
+
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block; it must be under one of the
+	 * indirect blocks. Subtract off the blocks mapped before that
+	 * one, so FILEBLOCK is now the offset into the space it maps.
 	 */
-
 	fileblock -= SFS_NDIRECT;
+	range = SFS_DBPERIDB(sfs->sfs_blocksize);
+	for (level = 1; level <= SFS_INDIRECT_LEVELS; level++) {
+		if (fileblock < range) {
+			break;
+		}
+		fileblock -= range;
+		range *= SFS_DBPERIDB(sfs->sfs_blocksize);
+	}
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum >= SFS_NINDIRECT) {
+	/* If the offset we were asked for is too large, fail. */
+	if (level > SFS_INDIRECT_LEVELS) {
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
+	top = sfs_bmap_top(&sv->sv_i, level);
+	if (*top == 0 && !doalloc) {
 		/*
 		 * There's no indirect block allocated. We weren't
 		 * asked to allocate anything, so pretend the indirect
@@ -136,168 +277,508 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
+
+	if (*top == 0) {
 		/*
 		 * There's no indirect block allocated, but we need to
 		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * it. Thus, we need to allocate an indirect block,
+		 * cleared. Put it after whatever maps the blocks just
+		 * before the ones it maps, or failing that the inode.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		goal = level > 1 ? *sfs_bmap_top(&sv->sv_i, level - 1) :
+			sv->sv_i.sfi_direct[SFS_NDIRECT-1];
+		if (goal == 0) {
+			goal = sv->sv_ino;
+		}
+		result = sfs_bmap_alloc(sv, goal + 1, false, &block);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*top = block;
 
 		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		sfs_dirty_inode(sv);
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+
+	/*
+	 * Walk down from there. At each level, RANGE is how many file
+	 * blocks the indirect block PARENT maps, and FILEBLOCK the
+	 * offset into them; at the end BLOCK is the data block.
+	 */
+	block = *top;
+	while (level > 0) {
+		parent = block;
+		range /= SFS_DBPERIDB(sfs->sfs_blocksize);
+		idoff = fileblock / range;
+		fileblock %= range;
+
+		/* Load the indirect block */
+		result = buf_read(sfs->sfs_device, parent, &idbuf);
 		if (result) {
 			return result;
 		}
-	}
+		iddata = buf_data(idbuf);
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+		/* Get the block out of the indirect block buffer */
+		block = iddata[idoff];
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
-		}
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			/*
+			 * Put it after the previous block in this
+			 * indirect block, or after the indirect block.
+			 * A data block needn't be cleared if the
+			 * caller says so; indirect blocks must be.
+			 */
+			goal = idoff > 0 && iddata[idoff-1] != 0 ?
+				iddata[idoff-1] : parent;
+			result = sfs_bmap_alloc(sv, goal + 1,
+						level == 1 && fresh != NULL,
+						&block);
+			if (result) {
+				buf_release(idbuf);
+				return result;
+			}
+			if (level == 1 && fresh != NULL) {
+				*fresh = true;
+			}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+			/* Remember the block we allocated */
+			iddata[idoff] = block;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+			/* The indirect block is now dirty */
+			buf_setowner(idbuf, sv);
+			sfs_markmeta(sfs, idbuf);
 		}
+		buf_release(idbuf);
+
+		if (block == 0) {
+			/* Nothing mapped here, and not allocating */
+			KASSERT(!doalloc);
+			*diskblock = 0;
+			return 0;
+		}
+		level--;
 	}
 
 	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
+	if (!sfs_bused(sfs, block)) {
 		panic("sfs: %s: Data block %u (block %u of file %u) "
 		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
+		      block, origblock, sv->sv_ino);
 	}
+	sfs_bmap_remember(sv, origblock, block);
 	*diskblock = block;
 	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Look under the indirect block IBLOCK, of level LEVEL and mapping
+ * file blocks from BASE on, for the first block from START up to END
+ * that is mapped (if MAPPED is set) or not. If there is one, set
+ * *FOUND to it.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_bmap_seek_indirect(struct sfs_vnode *sv, daddr_t iblock, unsigned level,
+		       uint64_t base, uint32_t start, uint32_t end,
+		       bool mapped, uint32_t *found)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	/* The indirect block; see sfs_bmap. */
+	struct buf *idbuf;
+	uint32_t *iddata;
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
+	uint64_t entrysize, entry;
 	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	/* How many file blocks each entry maps */
+	entrysize = 1;
+	for (i=1; i<level; i++) {
+		entrysize *= SFS_DBPERIDB(sfs->sfs_blocksize);
+	}
 
-	vfs_biglock_acquire();
+	result = buf_read(sfs->sfs_device, iblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buf_data(idbuf);
 
-	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
-	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
-			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+	for (j=0; j<SFS_DBPERIDB(sfs->sfs_blocksize) && *found == end; j++) {
+		entry = base + j * entrysize;
+		if (entry >= end) {
+			break;
+		}
+		if (entry + entrysize <= start) {
+			continue;
+		}
+		if (iddata[j] == 0 || level == 1) {
+			/* the whole entry is one way or the other */
+			if ((iddata[j] != 0) == mapped) {
+				*found = entry > start ? entry : start;
+			}
+		}
+		else {
+			result = sfs_bmap_seek_indirect(sv, iddata[j],
+							level - 1, entry,
+							start, end, mapped,
+							found);
+			if (result) {
+				break;
+			}
 		}
 	}
+	buf_release(idbuf);
+	return result;
+}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
+/*
+ * Find the first of file blocks START up to END that is mapped (if
+ * MAPPED is set) or a hole (if not), for SEEK_DATA and SEEK_HOLE; or
+ * END if there isn't one. Indirect blocks that aren't there are
+ * skipped over whole, so a big hole costs next to nothing.
+ */
+int
+sfs_bmap_seek(struct sfs_vnode *sv, uint32_t start, uint32_t end,
+	      bool mapped, uint32_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint64_t base, range;
+	uint32_t i, *top;
+	unsigned level;
+	int result;
 
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
+	KASSERT(sfs_vnode_do_i_hold(sv));
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
+	*ret = end;
+	for (i=start; i<SFS_NDIRECT && i<end; i++) {
+		if ((sv->sv_i.sfi_direct[i] != 0) == mapped) {
+			*ret = i;
+			return 0;
+		}
+	}
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+	base = SFS_NDIRECT;
+	range = SFS_DBPERIDB(sfs->sfs_blocksize);
+	for (level = 1; level <= SFS_INDIRECT_LEVELS && base < end; level++) {
+		if (base + range > start) {
+			top = sfs_bmap_top(&sv->sv_i, level);
+			if (*top == 0) {
+				if (!mapped) {
+					*ret = base > start ? base : start;
+					return 0;
+				}
+			}
+			else {
+				result = sfs_bmap_seek_indirect(sv, *top, level,
+								base, start,
+								end, mapped,
+								ret);
+				if (result || *ret < end) {
+					return result;
+				}
+			}
+		}
+		base += range;
+		range *= SFS_DBPERIDB(sfs->sfs_blocksize);
+	}
+	return 0;
+}
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+/*
+ * Preallocation (fallocate; see SFS_FEATURE_PREALLOC in <kern/sfs.h>).
+ * Whatever isn't mapped yet of file blocks START up to END is filled
+ * in from runs taken from the freemap as large as they come, each
+ * taken whole by one sfs_balloc_run and used up in order, indirect
+ * blocks and all, so the blocks land one after another on disk. The
+ * data blocks aren't cleared: the caller keeps them past EOF, where
+ * they count as never written.
+ */
+int
+sfs_bmap_prealloc(struct sfs_vnode *sv, uint32_t start, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block, prev;
+	uint32_t fileblock;
+	unsigned n;
+	bool fresh;
+	int result;
+
+	KASSERT(sfs_vnode_do_i_hold(sv));
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_PREALLOC);
+
+	prev = sv->sv_ino;
+	result = 0;
+	sv->sv_rsvkeep = true;
+	for (fileblock = start; fileblock < end; fileblock++) {
+		result = sfs_bmap(sv, fileblock, false, NULL, &block);
 		if (result) {
-			vfs_biglock_release();
-			return result;
+			break;
 		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
+		if (block == 0) {
+			if (sv->sv_nreserved == 0) {
+				result = sfs_balloc_run(sfs, prev + 1,
+							end - fileblock,
+							&sv->sv_reserved, &n);
+				if (result) {
+					break;
+				}
+				sv->sv_nreserved = n;
 			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
+			result = sfs_bmap(sv, fileblock, true, &fresh, &block);
+			if (result) {
+				break;
 			}
 		}
+		prev = block;
+	}
+	sv->sv_rsvkeep = false;
+	return result;
+}
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
+/*
+ * Clear whatever is mapped of file blocks START up to END in a
+ * preallocated file: they were past EOF, so never written, and are
+ * about to come inside the file without being written now.
+ */
+int
+sfs_bmap_settle(struct sfs_vnode *sv, uint32_t start, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	uint32_t fileblock;
+	int result;
+
+	KASSERT(sfs_vnode_do_i_hold(sv));
+
+	if ((sv->sv_i.sfi_flags & SFS_IFLAG_PREALLOC) == 0) {
+		return 0;
+	}
+	for (fileblock = start; fileblock < end; fileblock++) {
+		result = sfs_bmap(sv, fileblock, false, NULL, &block);
+		if (result == EFBIG) {
+			/* nothing can be mapped from here on */
+			break;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
+		if (result) {
+			return result;
+		}
+		if (block != 0) {
+			result = sfs_clearblock(sfs, block, sv);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * True if file block FILEBLOCK of SV, which is mapped, has never been
+ * written: it is preallocated and wholly past EOF.
+ */
+bool
+sfs_bmap_unwritten(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	return (sv->sv_i.sfi_flags & SFS_IFLAG_PREALLOC) &&
+		fileblock >= DIVROUNDUP(sv->sv_i.sfi_size, sfs->sfs_blocksize);
+}
+
+/*
+ * Free whatever is mapped under the indirect block *IBLOCK, of level
+ * LEVEL and mapping file blocks from BASE on, at or past BLOCKLEN; and
+ * if that leaves it empty, free it too, clear *IBLOCK, and set
+ * *CHANGED. The blocks go into BATCH.
+ */
+static
+int
+sfs_itrunc_indirect(struct sfs_vnode *sv, uint32_t *iblock, unsigned level,
+		    uint32_t base, uint32_t blocklen,
+		    struct sfs_freebatch *batch, bool *changed)
+{
+	/* The indirect block; see sfs_bmap. */
+	struct buf *idbuf;
+	uint32_t *iddata;
+
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t entrysize, start;
+	uint32_t i, j;
+	bool hasnonzero, iddirty;
+	int result;
+
+	if (*iblock == 0) {
+		return 0;
+	}
+
+	/* How many file blocks each entry maps */
+	entrysize = 1;
+	for (i=1; i<level; i++) {
+		entrysize *= SFS_DBPERIDB(sfs->sfs_blocksize);
+	}
+
+	if (base + (uint64_t)entrysize * SFS_DBPERIDB(sfs->sfs_blocksize) <=
+	    blocklen) {
+		/* All before the new EOF; nothing to do */
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = buf_read(sfs->sfs_device, *iblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buf_data(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB(sfs->sfs_blocksize); j++) {
+		start = base + j * entrysize;
+		if (iddata[j] != 0 && level > 1) {
+			result = sfs_itrunc_indirect(sv, &iddata[j], level - 1,
+						     start, blocklen, batch,
+						     &iddirty);
 			if (result) {
-				vfs_biglock_release();
+				if (iddirty) {
+					buf_setowner(idbuf, sv);
+					sfs_markmeta(sfs, idbuf);
+				}
+				buf_release(idbuf);
 				return result;
 			}
 		}
+		else if (iddata[j] != 0 && start >= blocklen) {
+			/* Discard data blocks past the new EOF */
+			sfs_bfree_batch(sfs, batch, iddata[j]);
+			iddata[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
 	}
 
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		buf_release(idbuf);
+		sfs_bfree_batch(sfs, batch, *iblock);
+		*iblock = 0;
+		*changed = true;
+	}
+	else {
+		if (iddirty) {
+			/* The indirect block is dirty */
+			buf_setowner(idbuf, sv);
+			sfs_markmeta(sfs, idbuf);
+		}
+		buf_release(idbuf);
+	}
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim. The blocks freed are
+ * batched into runs (see sfs_bfree_batch), so that a big file that
+ * was laid out in order goes back to the freemap a run at a time.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = DIVROUNDUP(len, sfs->sfs_blocksize);
+
+	uint32_t i;
+	daddr_t block;
+	uint32_t base, range;
+	unsigned level;
+	struct sfs_freebatch batch;
+	bool changed;
+	int result;
+
+	KASSERT(sfs_vnode_do_i_hold(sv));
+
+	/*
+	 * An inline file stays that way if it still fits; the space
+	 * past the end is kept zeroed, for the file to grow into.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (len <= SFS_INLINESIZE) {
+			bzero(sv->sv_i.sfi_inline + len, SFS_INLINESIZE - len);
+			sv->sv_i.sfi_size = len;
+			sfs_dirty_inode(sv);
+			return 0;
+		}
+		result = sfs_inline_evict(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	/*
+	 * Growing a preallocated file brings blocks it had past EOF
+	 * inside it, so they have to be cleared. Everything past the
+	 * new EOF goes below, so after that it isn't preallocated.
+	 */
+	result = sfs_bmap_settle(sv, DIVROUNDUP(sv->sv_i.sfi_size,
+						sfs->sfs_blocksize), blocklen);
+	if (result) {
+		return result;
+	}
+
+	/* Give back any blocks held for the file to grow into */
+	sfs_bmap_unreserve(sv);
+
+	/* Forget what it had; some of it may be going */
+	sv->sv_bmlen = 0;
+	batch.fb_count = 0;
+
+	/*
+	 * Go through the direct blocks. Discard any that are
+	 * past the limit we're truncating to.
+	 */
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sv->sv_i.sfi_direct[i];
+		if (i >= blocklen && block != 0) {
+			sfs_bfree_batch(sfs, &batch, block);
+			sv->sv_i.sfi_direct[i] = 0;
+			sfs_dirty_inode(sv);
+		}
+	}
+
+	/* Then what's under each of the indirect blocks */
+	base = SFS_NDIRECT;
+	range = SFS_DBPERIDB(sfs->sfs_blocksize);
+	for (level = 1; level <= SFS_INDIRECT_LEVELS; level++) {
+		changed = false;
+		result = sfs_itrunc_indirect(sv, sfs_bmap_top(&sv->sv_i, level),
+					     level, base, blocklen, &batch,
+					     &changed);
+		if (changed) {
+			sfs_dirty_inode(sv);
+		}
+		if (result) {
+			sfs_bfree_flush(sfs, &batch);
+			return result;
+		}
+		base += range;
+		range *= SFS_DBPERIDB(sfs->sfs_blocksize);
+	}
+	sfs_bfree_flush(sfs, &batch);
+
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
+	sv->sv_i.sfi_flags &= ~SFS_IFLAG_PREALLOC;
 
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_dirty_inode(sv);
 
-	vfs_biglock_release();
 	return 0;
 }
-
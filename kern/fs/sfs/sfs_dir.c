@@ -36,6 +36,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <namecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -95,23 +96,224 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Hashed directories
+
+/*
+ * A hashed directory (see <kern/sfs.h>) has one bucket per block, and
+ * the entry for a name can only be in the name's bucket. When that is
+ * full and another name wants to go in it, the directory is doubled:
+ * as buckets are found by taking the hash modulo their number, each
+ * bucket B's entries stay put or move to bucket B + (old number), so
+ * one bucket at a time can be split in place. Doubling costs as much
+ * as the directory is big, but happens less and less often as it
+ * grows.
+ *
+ * A directory of exactly one full block is already a hashed directory
+ * with one bucket, so plain directories become hashed, if the volume
+ * allows it, when they first outgrow a block. Bigger plain ones (made
+ * without the feature) stay plain.
+ */
+
+/* Don't double a directory past this many buckets */
+#define SFS_DIRHASH_MAXBUCKETS 8192
+
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t hash = SFS_DIRHASH_BASIS;
+
+	for (; *name != 0; name++) {
+		hash = (hash ^ (unsigned char)*name) * SFS_DIRHASH_PRIME;
+	}
+	return hash;
+}
+
+static
+bool
+sfs_dir_ishashed(struct sfs_vnode *sv)
+{
+	return (sv->sv_i.sfi_flags & SFS_IFLAG_HASHDIR) != 0;
+}
+
+/*
+ * Number of buckets in a hashed directory.
+ */
+static
+unsigned
+sfs_dir_nbuckets(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	KASSERT(sfs_dir_ishashed(sv));
+
+	if (sv->sv_i.sfi_size == 0 ||
+	    sv->sv_i.sfi_size % sfs->sfs_blocksize != 0) {
+		panic("sfs: %s: hashed directory %u: Invalid size %u\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, sv->sv_i.sfi_size);
+	}
+	return sv->sv_i.sfi_size / sfs->sfs_blocksize;
+}
+
+/*
+ * Double a hashed directory, splitting each bucket in turn. Each
+ * entry that moves is written into its new bucket before it is
+ * erased from its old one, so a crash partway leaves duplicates,
+ * which sfsck can cope with, rather than losing anything.
+ */
+static
+int
+sfs_dir_double(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry sd, empty;
+	unsigned nbuckets, perblock, b, i, j;
+	int result;
+
+	perblock = SFS_DIRPERBLOCK(sfs->sfs_blocksize);
+
+	nbuckets = sfs_dir_nbuckets(sv);
+	if (nbuckets >= SFS_DIRHASH_MAXBUCKETS) {
+		return ENOSPC;
+	}
+
+	bzero(&empty, sizeof(empty));
+	empty.sfd_ino = SFS_NOINO;
+
+	for (b=0; b<nbuckets; b++) {
+		j = 0;
+		for (i=0; i<perblock; i++) {
+			result = sfs_readdir(sv, b*perblock + i, &sd);
+			if (result) {
+				return result;
+			}
+			if (sd.sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+			if (sfs_dirhash(sd.sfd_name) % (2*nbuckets) == b) {
+				continue;
+			}
+			result = sfs_writedir(sv,
+				(b+nbuckets)*perblock + j, &sd);
+			if (result) {
+				return result;
+			}
+			j++;
+			result = sfs_writedir(sv, b*perblock + i,
+					      &empty);
+			if (result) {
+				return result;
+			}
+		}
+		/* fill out the new bucket, which also sets the size */
+		for (; j<perblock; j++) {
+			result = sfs_writedir(sv,
+				(b+nbuckets)*perblock + j, &empty);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	KASSERT(sfs_dir_nbuckets(sv) == 2*nbuckets);
+	return 0;
+}
+
+/*
+ * Find a slot for NAME, which isn't in the directory and for which
+ * sfs_dir_findname found no empty slot: in a plain directory, the end;
+ * in a hashed one, a slot in its bucket once the directory has been
+ * doubled enough to make room.
+ */
+static
+int
+sfs_dir_grow(struct sfs_vnode *sv, const char *name, int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int emptyslot;
+	int result;
+
+	if (!sfs_dir_ishashed(sv)) {
+		if ((sfs->sfs_sb.sb_features & SFS_FEATURE_HASHDIRS) == 0 ||
+		    sv->sv_i.sfi_size != sfs->sfs_blocksize) {
+			*slot = sfs_dir_nentries(sv);
+			return 0;
+		}
+		/* It's a full block, so it's a hashed directory already */
+		sv->sv_i.sfi_flags |= SFS_IFLAG_HASHDIR;
+		sfs_dirty_inode(sv);
+	}
+
+	do {
+		result = sfs_dir_double(sv);
+		/* entries have moved, so the name cache is wrong */
+		namecache_purge(&sv->sv_absvn);
+		if (result) {
+			return result;
+		}
+
+		emptyslot = -1;
+		result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+		if (result != ENOENT) {
+			return result == 0 ? EEXIST : result;
+		}
+	} while (emptyslot < 0);
+
+	*slot = emptyslot;
+	return 0;
+}
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * empty directory slot if one is found. In a hashed directory only
+ * the name's bucket is searched, for the name and for empty slots.
+ *
+ * The name cache knows where names are, and that they aren't, but
+ * not where the empty slots are; so it's only used when no empty
+ * slot is wanted. Whatever the search finds goes into it.
  */
 int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	ino_t cachedino;
+	int cachedslot;
+	int found, first, last, i, result;
+
+	KASSERT(sfs_vnode_do_i_hold(sv));
+
+	if (emptyslot == NULL &&
+	    namecache_lookup(&sv->sv_absvn, name, &cachedino, &cachedslot)) {
+		if (cachedino == SFS_NOINO) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = cachedslot;
+		}
+		if (ino != NULL) {
+			*ino = cachedino;
+		}
+		return 0;
+	}
 
-	nentries = sfs_dir_nentries(sv);
+	if (sfs_dir_ishashed(sv)) {
+		first = (sfs_dirhash(name) % sfs_dir_nbuckets(sv))
+			* SFS_DIRPERBLOCK(sfs->sfs_blocksize);
+		last = first + SFS_DIRPERBLOCK(sfs->sfs_blocksize);
+	}
+	else {
+		first = 0;
+		last = sfs_dir_nentries(sv);
+	}
 
 	/* For each slot... */
 	found = 0;
-	for (i=0; i<nentries; i++) {
+	for (i=first; i<last; i++) {
 
 		/* Read the entry from that slot */
 		result = sfs_readdir(sv, i, &tsd);
@@ -133,6 +335,8 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 				KASSERT(found==0);
 
 				found = 1;
+				cachedino = tsd.sfd_ino;
+				cachedslot = i;
 				if (slot != NULL) {
 					*slot = i;
 				}
@@ -143,7 +347,12 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		}
 	}
 
-	return found ? 0 : ENOENT;
+	if (!found) {
+		namecache_enter(&sv->sv_absvn, name, SFS_NOINO, -1);
+		return ENOENT;
+	}
+	namecache_enter(&sv->sv_absvn, name, cachedino, cachedslot);
+	return 0;
 }
 
 /*
@@ -170,9 +379,12 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
+	/* If we didn't get an empty slot, make one. */
 	if (emptyslot < 0) {
-		emptyslot = sfs_dir_nentries(sv);
+		result = sfs_dir_grow(sv, name, &emptyslot);
+		if (result) {
+			return result;
+		}
 	}
 
 	/* Set up the entry. */
@@ -185,24 +397,38 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		*slot = emptyslot;
 	}
 
-	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	/* Write the entry, and tell the name cache. */
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		namecache_remove(&sv->sv_absvn, name);
+		return result;
+	}
+	namecache_enter(&sv->sv_absvn, name, ino, emptyslot);
+	return 0;
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Unlink a name in a directory, by slot number. NAME is the name in
+ * that slot, for the name cache.
  */
 int
-sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+sfs_dir_unlink(struct sfs_vnode *sv, const char *name, int slot)
 {
 	struct sfs_direntry sd;
+	int result;
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		namecache_remove(&sv->sv_absvn, name);
+		return result;
+	}
+	namecache_enter(&sv->sv_absvn, name, SFS_NOINO, -1);
+	return 0;
 }
 
 /*
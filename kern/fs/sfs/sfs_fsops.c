@@ -36,33 +36,55 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
-#define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
-#define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
+#define SFS_FS_FREEMAPBITS(sfs) \
+	SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs), (sfs)->sfs_blocksize)
+#define SFS_FS_FREEMAPBLOCKS(sfs) \
+	SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs), (sfs)->sfs_blocksize)
 
 /*
- * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Are two blocks' worth of data different?
+ */
+static
+bool
+sfs_blockdiffers(struct sfs_fs *sfs, const void *a, const void *b)
+{
+	const uint32_t *wa = a, *wb = b;
+	unsigned i;
+
+	for (i=0; i<sfs->sfs_blocksize / sizeof(uint32_t); i++) {
+		if (wa[i] != wb[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Routine for doing I/O (reads or writes) on the free block bitmap,
+ * through the buffer cache. We always do the whole bitmap at once,
+ * but only the blocks of it that have changed are marked for writing
+ * (which keeps them out of the journal, if there is one).
  *
- * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
- * sectors of bits, one bit for each sector on the filesystem. The
- * number of blocks in the bitmap is thus rounded up to the nearest
- * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
- * This means that the bitmap will (in general) contain space for some
- * number of invalid sectors that are actually beyond the end of the
- * disk device. This is ok. These sectors are supposed to be marked
- * "in use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_FREEMAPBLOCKS blocks of bits,
+ * one bit for each block on the filesystem. The number of blocks in
+ * the bitmap is thus rounded up to the nearest multiple of the bits in
+ * a block (512*8 = 4096, with 512-byte blocks). (This rounded number
+ * is SFS_FREEMAPBITS.) This means that the bitmap will (in general)
+ * contain space for some number of invalid blocks that are actually
+ * beyond the end of the disk device. This is ok. These blocks are
+ * supposed to be marked "in use" by mksfs and never get marked "free".
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
@@ -73,6 +95,7 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
 	uint32_t j, freemapblocks;
 	char *freemapdata;
+	struct buf *b;
 	int result;
 
 	/* Number of blocks in the free block bitmap. */
@@ -85,60 +108,113 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	for (j=0; j<freemapblocks; j++) {
 
 		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
+		void *ptr = freemapdata + j*sfs->sfs_blocksize;
 
 		/* and read or write it. The freemap starts at sector 2. */
-		if (rw == UIO_READ) {
-			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
-		}
-		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
-		}
+		result = buf_read(sfs->sfs_device, SFS_FREEMAP_START+j, &b);
 
 		/* If we failed, stop. */
 		if (result) {
 			return result;
 		}
+
+		if (rw == UIO_READ) {
+			memcpy(ptr, buf_data(b), sfs->sfs_blocksize);
+		}
+		else if (sfs_blockdiffers(sfs, buf_data(b), ptr)) {
+			memcpy(buf_data(b), ptr, sfs->sfs_blocksize);
+			buf_setowner(b, sfs);
+			sfs_markmeta(sfs, b);
+		}
+		buf_release(b);
 	}
 	return 0;
 }
 
 /*
- * Sync routine for the vnode table.
+ * Sync routine for the vnode table: write back the inodes on the
+ * dirty list, in inode order, into the buffer cache.
+ *
+ * The vnodes can't be synced with the table locked, as syncing takes
+ * each vnode's own lock, which comes first; and dropping the last
+ * reference may reclaim one, which takes the table lock. So take a
+ * reference to each under the table lock, and sync them afterwards.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct sfs_vnode **svs;
+	struct sfs_vnode *sv;
+	unsigned i, j, num;
+	int result, err;
+
+	/* Size the array first, as it can't be allocated under a spinlock */
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	num = sfs->sfs_ndirty;
+	spinlock_release(&sfs->sfs_dirtylock);
+	if (num == 0) {
+		return 0;
+	}
+	svs = kmalloc(num * sizeof(*svs));
+	if (svs == NULL) {
+		return ENOMEM;
+	}
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* ones dirtied after we looked wait for next time */
+	lock_acquire(sfs->sfs_vnlock);
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	i = 0;
+	for (sv = sfs->sfs_dirtylist; sv != NULL && i < num;
+	     sv = sv->sv_dirtynext) {
+		VOP_INCREF(&sv->sv_absvn);
+		svs[i++] = sv;
+	}
+	num = i;
+	spinlock_release(&sfs->sfs_dirtylock);
+	lock_release(sfs->sfs_vnlock);
+
+	/* Sort by inode number, so they're written in disk order */
+	for (i=1; i<num; i++) {
+		sv = svs[i];
+		for (j=i; j>0 && svs[j-1]->sv_ino > sv->sv_ino; j--) {
+			svs[j] = svs[j-1];
+		}
+		svs[j] = sv;
+	}
+
+	err = 0;
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sfs_vnode_lock(svs[i]);
+		result = sfs_sync_inode(svs[i]);
+		sfs_vnode_unlock(svs[i]);
+		if (result && err == 0) {
+			err = result;
+		}
+		VOP_DECREF(&svs[i]->sv_absvn);
 	}
-	return 0;
+	kfree(svs);
+	return err;
 }
 
 /*
  * Sync routine for the freemap.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
@@ -152,14 +228,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -174,8 +253,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -208,28 +285,42 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* If any vnodes need to be written, write them. */
-	result = sfs_sync_vnodes(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (sfs->sfs_journaled) {
+		/*
+		 * The inodes went into their buffers as they were
+		 * changed; a commit does the rest.
+		 */
+		result = sfs_jcommit(sfs);
+		if (result) {
+			return result;
+		}
 	}
+	else {
+		/* If any vnodes need to be written, write them. */
+		result = sfs_sync_vnodes(sfs);
+		if (result) {
+			return result;
+		}
 
-	/* If the free block map needs to be written, write it. */
-	result = sfs_sync_freemap(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+		/* If the free block map needs to be written, write it. */
+		result = sfs_sync_freemap(sfs);
+		if (result) {
+			return result;
+		}
+
+		/* All of that went into the buffer cache; write it out. */
+		result = buf_sync(sfs->sfs_device);
+		if (result) {
+			return result;
+		}
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -243,13 +334,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* The volume name doesn't change once mounted */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +349,16 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	KASSERT(sfs->sfs_nvnodes == 0);
+	KASSERT(sfs->sfs_ndirty == 0);
+	sfs_jcleanup(sfs);
+	KASSERT(sfs->sfs_orphans == NULL);
+	KASSERT(!sfs->sfs_reaprunning);
+	cv_destroy(sfs->sfs_reapcv);
+	lock_destroy(sfs->sfs_reaplock);
+	lock_destroy(sfs->sfs_vnlock);
+	spinlock_cleanup(&sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_freemaplock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,18 +373,67 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Finish freeing unlinked files first, as the reaper has
+	 * vnodes loaded while it works.
+	 */
+	sfs_reapstop(sfs);
 
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * layer holds the biglock, so nobody can look up a new one.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
+		(void)sfs_reapstart(sfs);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
+
+	/* Write back what the reaper did since the sync before this */
+	result = sfs_sync(fs);
+	if (result) {
+		(void)sfs_reapstart(sfs);
+		return result;
+	}
+
+	/* Stop committing; there's nothing left to commit. */
+	sfs_jstop(sfs);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_jnfreed == 0);
+
+	/* Drop our blocks from the buffer cache */
+	result = buf_detach(sfs->sfs_device);
+	if (result) {
+		/* still mounted, so keep committing */
+		(void)sfs_jstart(sfs);
+		(void)sfs_reapstart(sfs);
+		return result;
+	}
+
+	/*
+	 * Everything is on disk now; clear the journal and mark the
+	 * volume clean. If that fails it just gets checked (or the
+	 * journal replayed) when it needn't be.
+	 */
+	result = sfs_jclear(sfs);
+	if (result) {
+		kprintf("sfs: %s: could not clear the journal: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+	}
+	sfs->sfs_sb.sb_clean = SFS_CLEAN;
+	result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+				sizeof(sfs->sfs_sb));
+	if (result) {
+		kprintf("sfs: %s: could not mark clean: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+	}
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -297,7 +442,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -321,6 +465,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -349,19 +494,73 @@ sfs_fs_create(void)
 
 	/* device we mount on */
 	sfs->sfs_device = NULL;
+	sfs->sfs_blocksize = SFS_BLOCKSIZE;	/* until we know better */
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnlock = lock_create("sfs_vnodes");
+	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_object;
 	}
+	for (i=0; i<SFS_VNHASH; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnlist = NULL;
+	sfs->sfs_nvnodes = 0;
+	spinlock_init(&sfs->sfs_dirtylock);
+	sfs->sfs_dirtylist = NULL;
+	sfs->sfs_ndirty = 0;
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs_freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnlock;
+	}
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
 
+	/* reaper; started once mounted */
+	sfs->sfs_reaplock = lock_create("sfs_reap");
+	if (sfs->sfs_reaplock == NULL) {
+		goto cleanup_freemaplock;
+	}
+	sfs->sfs_reapcv = cv_create("sfs_reap");
+	if (sfs->sfs_reapcv == NULL) {
+		goto cleanup_reaplock;
+	}
+	sfs->sfs_orphans = NULL;
+	sfs->sfs_reapstop = false;
+	sfs->sfs_reaprunning = false;
+
+	/* journal; set up by sfs_jmount if there is one */
+	sfs->sfs_journaled = false;
+	sfs->sfs_jfreed = NULL;
+	sfs->sfs_jnfreed = 0;
+	sfs->sfs_jlock = NULL;
+	sfs->sfs_jcv = NULL;
+	sfs->sfs_jstate = SFS_JOPEN;
+	sfs->sfs_jops = 0;
+	sfs->sfs_jheld = 0;
+	sfs->sfs_jpending = false;
+	sfs->sfs_jcommitter = NULL;
+	sfs->sfs_jstop = false;
+	sfs->sfs_jrunning = false;
+	sfs->sfs_jseq = 1;
+	sfs->sfs_jondisk = false;
+	sfs->sfs_jwarned = false;
+	sfs->sfs_jbufs = NULL;
+	sfs->sfs_jiov = NULL;
+	sfs->sfs_jhead = NULL;
+	sfs->sfs_jtail = NULL;
+
 	return sfs;
 
+cleanup_reaplock:
+	lock_destroy(sfs->sfs_reaplock);
+cleanup_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_vnlock:
+	spinlock_cleanup(&sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,21 +587,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
+	/* vfs_mount's biglock keeps two mounts from racing */
 
 	/* We don't pass any options through mount */
 	(void)options;
 
 	/*
-	 * We can't mount on devices with the wrong sector size.
-	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * We can't mount on devices with the wrong sector size. (A
+	 * filesystem block may be several sectors, but the superblock
+	 * and inodes are one.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +605,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -423,7 +617,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,38 +629,111 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
-		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_sb.sb_nblocks, dev->d_blocks);
+	if (sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		kprintf("sfs: Unknown features in superblock (0x%x)\n",
+			sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	sfs->sfs_blocksize = SFS_SB_BLOCKSIZE(&sfs->sfs_sb);
+	if (sfs->sfs_blocksize < SFS_BLOCKSIZE ||
+	    sfs->sfs_blocksize > SFS_MAXBLOCKSIZE ||
+	    (sfs->sfs_blocksize & (sfs->sfs_blocksize - 1)) != 0) {
+		kprintf("sfs: Bad block size in superblock (%u)\n",
+			sfs->sfs_blocksize);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	if ((uint64_t)sfs->sfs_sb.sb_nblocks * sfs->sfs_blocksize >
+	    (uint64_t)dev->d_blocks * dev->d_blocksize) {
+		kprintf("sfs: warning - fs has %u blocks of %u bytes, "
+			"device has %u of %zu\n", sfs->sfs_sb.sb_nblocks,
+			sfs->sfs_blocksize, dev->d_blocks, dev->d_blocksize);
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Have the buffer cache use our block size */
+	result = buf_attach(dev, sfs->sfs_blocksize);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
+	/*
+	 * Set up the journal, if there is one, and replay whatever was
+	 * committed to it, before reading anything it might change.
+	 */
+	result = sfs_jmount(sfs);
+	if (result) {
+		(void)buf_detach(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
+		(void)buf_detach(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
+		/* the blocks that were read are only clean copies */
+		(void)buf_detach(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
+	/*
+	 * Mark the volume not clean on disk until it's unmounted, so
+	 * that if we crash first sfsck knows to check it.
+	 */
+	sfs->sfs_sb.sb_clean = 0;
+	result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+				sizeof(sfs->sfs_sb));
+	if (result) {
+		(void)buf_detach(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
+	/* Start the journal's commit thread */
+	result = sfs_jstart(sfs);
+	if (result) {
+		(void)buf_detach(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
+	/* ... and the reaper */
+	result = sfs_reapstart(sfs);
+	if (result) {
+		sfs_jstop(sfs);
+		(void)buf_detach(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -35,31 +35,311 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
 #include <vfs.h>
+#include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Lock a vnode. The lock is recursive, like the VFS biglock it
+ * replaces: a read or write may take a page fault on a page mapped
+ * from the same file, which comes back in through VOP_READ. The
+ * thread's t_fsdepth counts vnode locks held, for the journal.
+ */
+void
+sfs_vnode_lock(struct sfs_vnode *sv)
+{
+	if (lock_do_i_hold(sv->sv_lock)) {
+		sv->sv_lockdepth++;
+		return;
+	}
+	lock_acquire(sv->sv_lock);
+	KASSERT(sv->sv_lockdepth == 0);
+	sv->sv_lockdepth = 1;
+	curthread->t_fsdepth++;
+}
+
+void
+sfs_vnode_unlock(struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_lockdepth > 0);
+	sv->sv_lockdepth--;
+	if (sv->sv_lockdepth == 0) {
+		KASSERT(curthread->t_fsdepth > 0);
+		curthread->t_fsdepth--;
+		lock_release(sv->sv_lock);
+	}
+}
+
+bool
+sfs_vnode_do_i_hold(struct sfs_vnode *sv)
+{
+	return lock_do_i_hold(sv->sv_lock);
+}
+
+/*
+ * Note that SV's inode has been changed, and put the vnode on the
+ * dirty list for sfs_sync to find.
+ */
+void
+sfs_dirty_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	sv->sv_dirty = true;
+	if (sv->sv_dirtyprevp != NULL) {
+		return;
+	}
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	sv->sv_dirtynext = sfs->sfs_dirtylist;
+	if (sfs->sfs_dirtylist != NULL) {
+		sfs->sfs_dirtylist->sv_dirtyprevp = &sv->sv_dirtynext;
+	}
+	sv->sv_dirtyprevp = &sfs->sfs_dirtylist;
+	sfs->sfs_dirtylist = sv;
+	sfs->sfs_ndirty++;
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+/*
+ * Take SV off the dirty list, if it's there.
+ */
+static
+void
+sfs_undirty_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sv->sv_dirtyprevp == NULL) {
+		return;
+	}
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	*sv->sv_dirtyprevp = sv->sv_dirtynext;
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprevp = sv->sv_dirtyprevp;
+	}
+	sv->sv_dirtynext = NULL;
+	sv->sv_dirtyprevp = NULL;
+	KASSERT(sfs->sfs_ndirty > 0);
+	sfs->sfs_ndirty--;
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+/*
+ * Write an on-disk inode structure back out to its block in the
+ * buffer cache. (An inode is a whole block, so it needn't be read;
+ * with blocks bigger than inodes, the rest of the block is zeros.)
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *b;
 	int result;
 
+	KASSERT(sfs_vnode_do_i_hold(sv));
+
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		result = buf_get(sfs->sfs_device, sv->sv_ino, &b);
 		if (result) {
 			return result;
 		}
+		if (!buf_valid(b)) {
+			bzero((char *)buf_data(b) + sizeof(sv->sv_i),
+			      sfs->sfs_blocksize - sizeof(sv->sv_i));
+		}
+		memcpy(buf_data(b), &sv->sv_i, sizeof(sv->sv_i));
+		buf_setowner(b, sv);
+		sfs_markmeta(sfs, b);
+		buf_release(b);
 		sv->sv_dirty = false;
 	}
+	sfs_undirty_inode(sv);
 	return 0;
 }
 
+/*
+ * Return the link in the vnode table pointing at the vnode for inode
+ * INO, or at the NULL ending its chain. With sfs_vnlock held.
+ */
+static
+struct sfs_vnode **
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode **link;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	link = &sfs->sfs_vnhash[ino % SFS_VNHASH];
+	while (*link != NULL && (*link)->sv_ino != ino) {
+		link = &(*link)->sv_hashnext;
+	}
+	return link;
+}
+
+/*
+ * Erasing a big file, once nothing refers to it any more, means going
+ * through all its indirect blocks, which can take a while; rather than
+ * make the last close or remove wait for that, sfs_reclaim hands any
+ * file with indirect blocks to the reaper thread. Until it gets there
+ * the inode stays allocated, with its link count of zero, and nothing
+ * can find it. (If the system crashes first, sfsck frees it.)
+ *
+ * The reaper truncates the file SFS_REAPSTEP blocks at a time, each in
+ * its own journal transaction, so as not to hold things up for others
+ * either; then lets go of it, which frees what's left and the inode.
+ */
+#define SFS_REAPSTEP 256
+
+struct sfs_orphan {
+	uint32_t so_ino;
+	struct sfs_orphan *so_next;
+};
+
+/*
+ * Free the blocks of the unlinked file INO, and then the file.
+ */
+static
+void
+sfs_reap(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+	off_t len, step;
+	int result;
+
+	result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &sv);
+	if (result) {
+		kprintf("sfs: %s: could not free inode %u: %s\n",
+			sfs->sfs_sb.sb_volname, ino, strerror(result));
+		return;
+	}
+	KASSERT(sv->sv_i.sfi_linkcount == 0);
+
+	step = (off_t)SFS_REAPSTEP * sfs->sfs_blocksize;
+	len = sv->sv_i.sfi_size;
+	do {
+		len = len > step ? len - step : 0;
+		sfs_jbegin(sfs);
+		sfs_vnode_lock(sv);
+		result = sfs_itrunc(sv, len);
+		sfs_jinode(sv);
+		sfs_vnode_unlock(sv);
+		sfs_jend(sfs);
+	} while (result == 0 && len > 0);
+	if (result) {
+		kprintf("sfs: %s: freeing inode %u: %s\n",
+			sfs->sfs_sb.sb_volname, ino, strerror(result));
+	}
+
+	/* The last reference; sfs_reclaim does the rest */
+	VOP_DECREF(&sv->sv_absvn);
+}
+
+static
+void
+sfs_reapthread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	struct sfs_orphan *so;
+
+	(void)data2;
+
+	lock_acquire(sfs->sfs_reaplock);
+	while (1) {
+		so = sfs->sfs_orphans;
+		if (so == NULL) {
+			if (sfs->sfs_reapstop) {
+				break;
+			}
+			cv_wait(sfs->sfs_reapcv, sfs->sfs_reaplock);
+			continue;
+		}
+		sfs->sfs_orphans = so->so_next;
+		lock_release(sfs->sfs_reaplock);
+
+		sfs_reap(sfs, so->so_ino);
+		kfree(so);
+
+		lock_acquire(sfs->sfs_reaplock);
+	}
+	sfs->sfs_reaprunning = false;
+	cv_broadcast(sfs->sfs_reapcv, sfs->sfs_reaplock);
+	lock_release(sfs->sfs_reaplock);
+	thread_exit();
+}
+
+/*
+ * Called from sfs_reclaim for an unlinked file: hand it to the reaper
+ * if it's worth it, and the reaper is there to take it.
+ */
+static
+bool
+sfs_reap_later(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_orphan *so;
+
+	if (sv->sv_i.sfi_indirect == 0 && sv->sv_i.sfi_dindirect == 0 &&
+	    sv->sv_i.sfi_tindirect == 0) {
+		return false;
+	}
+
+	so = kmalloc(sizeof(*so));
+	if (so == NULL) {
+		return false;
+	}
+	so->so_ino = sv->sv_ino;
+
+	lock_acquire(sfs->sfs_reaplock);
+	if (!sfs->sfs_reaprunning || sfs->sfs_reapstop) {
+		lock_release(sfs->sfs_reaplock);
+		kfree(so);
+		return false;
+	}
+	so->so_next = sfs->sfs_orphans;
+	sfs->sfs_orphans = so;
+	cv_signal(sfs->sfs_reapcv, sfs->sfs_reaplock);
+	lock_release(sfs->sfs_reaplock);
+	return true;
+}
+
+int
+sfs_reapstart(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(!sfs->sfs_reaprunning);
+	sfs->sfs_reapstop = false;
+	sfs->sfs_reaprunning = true;
+	result = thread_fork("sfsreaper", NULL, sfs_reapthread, sfs, 0);
+	if (result) {
+		sfs->sfs_reaprunning = false;
+	}
+	return result;
+}
+
+/*
+ * Stop the reaper, once it has freed everything it was given.
+ */
+void
+sfs_reapstop(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_reaplock);
+	sfs->sfs_reapstop = true;
+	cv_broadcast(sfs->sfs_reapcv, sfs->sfs_reaplock);
+	while (sfs->sfs_reaprunning) {
+		cv_wait(sfs->sfs_reapcv, sfs->sfs_reaplock);
+	}
+	lock_release(sfs->sfs_reaplock);
+	KASSERT(sfs->sfs_orphans == NULL);
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,34 +350,53 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode **link;
+	bool orphaned;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. Holding the vnode table lock
+	 * keeps sfs_loadvnode from finding it, or from reading the inode
+	 * afresh before we've written it back.
+	 */
+	sfs_jbegin(sfs);
+	lock_acquire(sfs->sfs_vnlock);
+	if (vnode_decref_unless_last(v)) {
+		/* consumed the reference VOP_DECREF gave us */
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
+		return EBUSY;
+	}
+
+	/*
+	 * Ours is the only reference, so nobody else can hold or want
+	 * the vnode lock; this is just for the benefit of the asserts.
 	 */
-	spinlock_acquire(&v->vn_countlock);
-	if (v->vn_refcount != 1) {
+	sfs_vnode_lock(sv);
 
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
+	/* Give back blocks held for the file to grow into */
+	sfs_bmap_unreserve(sv);
 
-		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
-		return EBUSY;
+	/* Forget the names looked up in it; the vnode is going away */
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		namecache_purge(v);
 	}
-	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
+	/*
+	 * If there are no on-disk references to the file either, erase
+	 * it; or if that would take a while, leave it to the reaper.
+	 */
+	orphaned = false;
 	if (sv->sv_i.sfi_linkcount == 0) {
+		orphaned = sfs_reap_later(sv);
+	}
+	if (sv->sv_i.sfi_linkcount == 0 && !orphaned) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			sfs_vnode_unlock(sv);
+			lock_release(sfs->sfs_vnlock);
+			sfs_jend(sfs);
 			return result;
 		}
 	}
@@ -105,37 +404,40 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnode_unlock(sv);
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
+	if (sv->sv_i.sfi_linkcount==0 && !orphaned) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
+	sfs_vnode_unlock(sv);
+	KASSERT(sv->sv_dirtyprevp == NULL);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
+	link = sfs_vnhash_find(sfs, sv->sv_ino);
+	if (*link != sv) {
 		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
 		      sfs->sfs_sb.sb_volname, sv->sv_ino);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	*link = sv->sv_hashnext;
+	*sv->sv_listprevp = sv->sv_listnext;
+	if (sv->sv_listnext != NULL) {
+		sv->sv_listnext->sv_listprevp = sv->sv_listprevp;
+	}
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
 
 	vnode_cleanup(&sv->sv_absvn);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+	sfs_jend(sfs);
 
 	/* Release the storage for the vnode structure itself. */
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -150,19 +452,19 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
+	struct sfs_vnode **link;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	struct buf *b;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	lock_acquire(sfs->sfs_vnlock);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	/* Look in the vnodes table */
+	link = sfs_vnhash_find(sfs, ino);
+	sv = *link;
+	if (sv != NULL) {
+		/* Found */
 
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
@@ -170,24 +472,36 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
+	sv->sv_lockdepth = 0;
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+	sv->sv_reserved = 0;
+	sv->sv_nreserved = 0;
+	sv->sv_rsvkeep = false;
+	sv->sv_bmlen = 0;
 
 	/* Must be in an allocated block */
 	if (!sfs_bused(sfs, ino)) {
@@ -196,14 +510,20 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
+	result = buf_read(sfs->sfs_device, ino, &b);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	memcpy(&sv->sv_i, buf_data(b), sizeof(sv->sv_i));
+	buf_release(b);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
+	sv->sv_dirtynext = NULL;
+	sv->sv_dirtyprevp = NULL;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -213,6 +533,10 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
+		if (forcetype == SFS_TYPE_FILE &&
+		    (sfs->sfs_sb.sb_features & SFS_FEATURE_INLINE)) {
+			sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+		}
 		sv->sv_dirty = true;
 	}
 
@@ -235,20 +559,34 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
 
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
+	/*
+	 * Add it to our table. LINK is still the end of its chain, as
+	 * we've held the table lock throughout.
+	 */
+	KASSERT(*link == NULL);
+	sv->sv_hashnext = NULL;
+	*link = sv;
+	sv->sv_listnext = sfs->sfs_vnlist;
+	if (sfs->sfs_vnlist != NULL) {
+		sfs->sfs_vnlist->sv_listprevp = &sv->sv_listnext;
 	}
+	sv->sv_listprevp = &sfs->sfs_vnlist;
+	sfs->sfs_vnlist = sv;
+	sfs->sfs_nvnodes++;
+	if (sv->sv_dirty) {
+		/* and onto the dirty list, now that it's all there */
+		sfs_dirty_inode(sv);
+	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -269,7 +607,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +634,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
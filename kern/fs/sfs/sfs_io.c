@@ -38,6 +38,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -50,23 +51,24 @@
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
  * except sfs_device.
+ *
+ * Everything but the superblock goes through the buffer
+ * cache (see <buf.h>) instead.
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read or write a block (or a run of them, for the journal), retrying
+ * I/O errors.
  */
-static
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	      uio->uio_offset / sfs->sfs_blocksize);
 
  retry:
 	result = DEVOP_IO(sfs->sfs_device, uio);
@@ -84,7 +86,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 			tries++;
 			kprintf("sfs: %s: block %llu I/O error, retrying\n",
 				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
+				uio->uio_offset / sfs->sfs_blocksize);
 			goto retry;
 		}
 		else if (tries < 10) {
@@ -95,14 +97,15 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 			kprintf("sfs: %s: block %llu I/O error, giving up "
 				"after %d retries\n",
 				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
+				uio->uio_offset / sfs->sfs_blocksize, tries);
 		}
 	}
 	return result;
 }
 
 /*
- * Read a block.
+ * Read a block, or the first LEN bytes of it (for the superblock
+ * and the like, which are SFS_BLOCKSIZE whatever the block size).
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -110,14 +113,14 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len <= sfs->sfs_blocksize && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	SFSUIO(sfs, &iov, &ku, data, len, block, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block, or the first LEN bytes of it.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -125,9 +128,9 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len <= sfs->sfs_blocksize && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	SFSUIO(sfs, &iov, &ku, data, len, block, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
@@ -137,9 +140,9 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * need the original block in the buffer cache first, even if we're
+ * writing, so we don't clobber the portion of the block we're not
+ * intending to write over.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,16 +153,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -167,16 +162,15 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	KASSERT(skipstart + len <= sfs->sfs_blocksize);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(sfs_vnode_do_i_hold(sv));
 
 	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, NULL, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -184,16 +178,26 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
+	}
+
+	/*
+	 * Get the block. One preallocated and never written has
+	 * nothing in it worth reading; it starts out as zeros.
+	 */
+	if (sfs_bmap_unwritten(sv, fileblock)) {
+		KASSERT(uio->uio_rw == UIO_WRITE);
+		result = buf_get(sfs->sfs_device, diskblock, &iobuf);
+		if (result) {
+			return result;
+		}
+		bzero(buf_data(iobuf), sfs->sfs_blocksize);
 	}
 	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
+		result = buf_read(sfs->sfs_device, diskblock, &iobuf);
 		if (result) {
 			return result;
 		}
@@ -202,22 +206,19 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
-		return result;
-	}
+	result = uiomove((char *)buf_data(iobuf) + skipstart, len, uio);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the block is dirty now, even if only
+	 * some of it was copied before a fault; it'll get written back.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buf_setowner(iobuf, sv);
+		buf_markdirty(iobuf);
 	}
 
-	return 0;
+	buf_release(iobuf);
+	return result;
 }
 
 /*
@@ -228,20 +229,22 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	size_t resid, done;
+	bool fresh;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Look up the disk block number. A new block isn't cleared
+	 * first, as we're about to write all of it.
+	 */
+	result = sfs_bmap(sv, fileblock, doalloc, &fresh, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -254,49 +257,323 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		 * allocated a block for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		return uiomovezeros(sfs->sfs_blocksize, uio);
+	}
+
+	/* A preallocated block never written is as good as new */
+	if (sfs_bmap_unwritten(sv, fileblock)) {
+		KASSERT(uio->uio_rw == UIO_WRITE);
+		fresh = true;
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Go through the buffer cache. A block that's about to be
+	 * overwritten completely needn't be read in first.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	KASSERT(uio->uio_resid >= sfs->sfs_blocksize);
+	if (uio->uio_rw == UIO_READ) {
+		result = buf_read(sfs->sfs_device, diskblock, &iobuf);
+	}
+	else {
+		result = buf_get(sfs->sfs_device, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
+
+	resid = uio->uio_resid;
+	result = uiomove(buf_data(iobuf), sfs->sfs_blocksize, uio);
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * A write that faulted partway leaves a cached block partly
+	 * updated, which is as good as a short write; but a fresh
+	 * buffer with only part of the block in it is no good at all,
+	 * and goes away when released. Unless the block is new to the
+	 * file: then the rest must be zeroed, so that nothing left
+	 * over from its last use shows through.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	if (uio->uio_rw == UIO_WRITE && result != 0 && fresh) {
+		done = resid - uio->uio_resid;
+		bzero((char *)buf_data(iobuf) + done, sfs->sfs_blocksize - done);
+	}
+	if (uio->uio_rw == UIO_WRITE &&
+	    (result == 0 || fresh || buf_valid(iobuf))) {
+		buf_setowner(iobuf, sv);
+		buf_markdirty(iobuf);
+	}
+
+	buf_release(iobuf);
+	return result;
+}
 
-	result = sfs_rwblock(sfs, uio);
+/*
+ * Do I/O of NBLOCKS whole blocks straight between the disk and the
+ * caller's memory, not through the buffer cache (O_DIRECT), a run of
+ * blocks consecutive on disk at a time. The file's dirty buffers are
+ * written back first, so a read sees what they hold, and a write
+ * throws away any cached copies of the blocks it covers, so none goes
+ * stale. The disk is used as is; unlike sfs_rwblock, failures aren't
+ * retried, as by then the transfer may have gone partway.
+ *
+ * New blocks aren't cleared first, since they're about to be written
+ * whole; but if writing them fails they are, so nothing left over from
+ * their last use shows in the file.
+ */
+static
+int
+sfs_directio(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct uio runuio;
+	daddr_t start, block;
+	uint32_t fileblock, run, i;
+	bool fresh, runfresh, pending;
+	size_t done;
+	int result;
+
+	/* Allocate missing blocks if and only if we're writing */
+	bool doalloc = (uio->uio_rw==UIO_WRITE);
+
+	KASSERT(sfs_vnode_do_i_hold(sv));
+
+	result = buf_syncowner(sfs->sfs_device, sv);
+	if (result) {
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
+	 * PENDING says the first block of the next run has been mapped
+	 * already, into BLOCK and FRESH, by finding it didn't go on
+	 * from the last one.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	pending = false;
+	while (nblocks > 0) {
+		fileblock = uio->uio_offset / sfs->sfs_blocksize;
+		if (!pending) {
+			result = sfs_bmap(sv, fileblock, doalloc, &fresh,
+					  &block);
+			if (result) {
+				return result;
+			}
+		}
+		pending = false;
+		start = block;
+		runfresh = fresh || (block != 0 &&
+				     sfs_bmap_unwritten(sv, fileblock));
+
+		if (start == 0) {
+			/* A hole reads as zeros */
+			KASSERT(uio->uio_rw == UIO_READ);
+			result = uiomovezeros(sfs->sfs_blocksize, uio);
+			if (result) {
+				return result;
+			}
+			nblocks--;
+			continue;
+		}
+
+		/* Take in the blocks that follow on, new or old alike */
+		for (run = 1; run < nblocks; run++) {
+			result = sfs_bmap(sv, fileblock + run, doalloc, &fresh,
+					  &block);
+			if (result) {
+				break;
+			}
+			if (block != start + run ||
+			    (fresh || sfs_bmap_unwritten(sv, fileblock + run))
+			    != runfresh) {
+				pending = true;
+				break;
+			}
+		}
+
+		for (i=0; i<run && doalloc; i++) {
+			buf_discard(sfs->sfs_device, start + i);
+		}
+
+		if (result == 0) {
+			runuio = *uio;
+			runuio.uio_offset = (off_t)start * sfs->sfs_blocksize;
+			runuio.uio_resid = run * sfs->sfs_blocksize;
+			result = DEVOP_IO(sfs->sfs_device, &runuio);
+
+			/* the iovecs are shared, and moved on already */
+			done = run * sfs->sfs_blocksize - runuio.uio_resid;
+			uio->uio_iov = runuio.uio_iov;
+			uio->uio_iovcnt = runuio.uio_iovcnt;
+			uio->uio_offset += done;
+			uio->uio_resid -= done;
+			nblocks -= run;
+		}
+
+		if (result) {
+			if (doalloc && runfresh) {
+				for (i=0; i<run; i++) {
+					sfs_clearblock(sfs, start + i, sv);
+				}
+			}
+			if (pending && fresh) {
+				sfs_clearblock(sfs, block, sv);
+			}
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Do I/O to a file whose contents are in its inode (see
+ * SFS_FEATURE_INLINE in <kern/sfs.h>). The caller has checked that it
+ * all fits.
+ */
+static
+int
+sfs_inlineio(struct sfs_vnode *sv, struct uio *uio)
+{
+	int result;
+
+	KASSERT(uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE);
 
+	result = uiomove(sv->sv_i.sfi_inline + uio->uio_offset,
+			 uio->uio_resid, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		sfs_dirty_inode(sv);
+	}
 	return result;
 }
 
+/*
+ * Move an inline file's contents out to a block of its own, because
+ * it's about to outgrow the inode.
+ */
+int
+sfs_inline_evict(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	daddr_t diskblock;
+	bool fresh;
+	int result;
+
+	KASSERT(sfs_vnode_do_i_hold(sv));
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_INLINE);
+
+	sv->sv_i.sfi_flags &= ~SFS_IFLAG_INLINE;
+	result = sfs_bmap(sv, 0, true, &fresh, &diskblock);
+	if (result) {
+		sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+		return result;
+	}
+	/* an inline file has no blocks, so this one is new */
+	KASSERT(fresh);
+
+	result = buf_get(sfs->sfs_device, diskblock, &iobuf);
+	if (result) {
+		sfs_bfree(sfs, diskblock);
+		sv->sv_i.sfi_direct[0] = 0;
+		sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+		return result;
+	}
+	memcpy(buf_data(iobuf), sv->sv_i.sfi_inline, SFS_INLINESIZE);
+	bzero((char *)buf_data(iobuf) + SFS_INLINESIZE,
+	      sfs->sfs_blocksize - SFS_INLINESIZE);
+	buf_setowner(iobuf, sv);
+	buf_markdirty(iobuf);
+	buf_release(iobuf);
+
+	bzero(sv->sv_i.sfi_inline, sizeof(sv->sv_i.sfi_inline));
+	sfs_dirty_inode(sv);
+	return 0;
+}
+
+/*
+ * Read-ahead. A read that starts where the last one ended counts as
+ * sequential, and each one in a row doubles the number of blocks past
+ * it that we have the buffer cache fetch in the background, from
+ * SFS_RA_MIN up to SFS_RA_MAX; any other read turns it off again.
+ * More is only asked for once the reader is halfway into what was
+ * asked for last time, so that requests come in useful sizes. Runs of
+ * consecutive disk blocks go as one request each.
+ *
+ * START and END are the file offsets the read just done covered.
+ */
+#define SFS_RA_MIN 4
+#define SFS_RA_MAX 32
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t next, last, fileblock;
+	daddr_t diskblock, runstart = 0;
+	unsigned runlen;
+
+	if (start != sv->sv_ranext) {
+		sv->sv_ranext = end;
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+		return;
+	}
+	sv->sv_ranext = end;
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MIN;
+	}
+	else if (sv->sv_rawindow < SFS_RA_MAX) {
+		sv->sv_rawindow *= 2;
+	}
+
+	/* The block END is in, if partway through, was just read */
+	next = DIVROUNDUP(end, sfs->sfs_blocksize);
+	last = next + sv->sv_rawindow;
+	if (last > DIVROUNDUP(sv->sv_i.sfi_size, sfs->sfs_blocksize)) {
+		last = DIVROUNDUP(sv->sv_i.sfi_size, sfs->sfs_blocksize);
+	}
+	if (sv->sv_raend < next) {
+		sv->sv_raend = next;
+	}
+	if (sv->sv_raend >= last ||
+	    sv->sv_raend - next > sv->sv_rawindow / 2) {
+		return;
+	}
+
+	runlen = 0;
+	for (fileblock = sv->sv_raend; fileblock < last; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, NULL, &diskblock)) {
+			break;
+		}
+		if (runlen > 0 && diskblock == runstart + runlen) {
+			runlen++;
+			continue;
+		}
+		if (runlen > 0) {
+			buf_readahead(sfs->sfs_device, runstart, runlen);
+		}
+		/* holes have nothing to read */
+		runstart = diskblock;
+		runlen = diskblock != 0 ? 1 : 0;
+	}
+	if (runlen > 0) {
+		buf_readahead(sfs->sfs_device, runstart, runlen);
+	}
+	sv->sv_raend = fileblock;
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	uint32_t blkoff;
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origoffset;
 
 	origresid = uio->uio_resid;
+	origoffset = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -319,16 +596,45 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/*
+	 * An inline file is read and written in the inode, until a
+	 * write would take it past the end of the space there.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE) {
+			result = sfs_inlineio(sv, uio);
+			goto out;
+		}
+		result = sfs_inline_evict(sv);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/*
+	 * In a preallocated file, blocks this write skips over past
+	 * EOF are about to come inside the file unwritten; clear them.
+	 */
+	if (uio->uio_rw == UIO_WRITE) {
+		result = sfs_bmap_settle(sv,
+				DIVROUNDUP(sv->sv_i.sfi_size, sfs->sfs_blocksize),
+				uio->uio_offset / sfs->sfs_blocksize);
+		if (result) {
+			goto out;
+		}
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = uio->uio_offset % sfs->sfs_blocksize;
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = sfs->sfs_blocksize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -350,8 +656,15 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	KASSERT(uio->uio_offset % sfs->sfs_blocksize == 0);
+	nblocks = uio->uio_resid / sfs->sfs_blocksize;
+	if (uio->uio_direct && nblocks > 0) {
+		result = sfs_directio(sv, uio, nblocks);
+		if (result) {
+			goto out;
+		}
+		nblocks = 0;
+	}
 	for (i=0; i<nblocks; i++) {
 		result = sfs_blockio(sv, uio);
 		if (result) {
@@ -362,7 +675,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < sfs->sfs_blocksize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -378,7 +691,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
+	}
+
+	if (uio->uio_rw == UIO_READ && result == 0 && !uio->uio_direct) {
+		sfs_readahead(sv, origoffset, uio->uio_offset);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -414,25 +731,18 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
+	/* I/O buffer for metadata ops; see sfs_partialio. */
+	struct buf *metaiobuf;
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(sfs_vnode_do_i_hold(sv));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
-	vnblock = actualpos / SFS_BLOCKSIZE;
-	blockoffset = actualpos % SFS_BLOCKSIZE;
+	vnblock = actualpos / sfs->sfs_blocksize;
+	blockoffset = actualpos % sfs->sfs_blocksize;
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock, doalloc, NULL, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -446,35 +756,34 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buf_read(sfs->sfs_device, diskblock, &metaiobuf);
 	if (result) {
 		return result;
 	}
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, (char *)buf_data(metaiobuf) + blockoffset, len);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
+		memcpy((char *)buf_data(metaiobuf) + blockoffset, data, len);
 
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* It gets written back later (by way of the journal) */
+		buf_setowner(metaiobuf, sv);
+		sfs_markmeta(sfs, metaiobuf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)sv->sv_i.sfi_size) {
 			sv->sv_i.sfi_size = endpos;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
+	buf_release(metaiobuf);
+
 	/* Done */
 	return 0;
 }
@@ -0,0 +1,641 @@
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
+#include <uio.h>
+#include <device.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * On a volume with a journal (SFS_FEATURE_JOURNAL; see kern/sfs.h),
+ * metadata blocks are marked with sfs_markmeta rather than
+ * buf_markdirty, which holds them in the buffer cache, and operations
+ * that change metadata are bracketed by sfs_jbegin and sfs_jend. A
+ * commit lets the operations in progress finish and keeps new ones
+ * from starting, so that the held blocks make a consistent whole;
+ * writes them all to the journal in one transfer; and then lets them
+ * go home as ordinary dirty buffers. So a batch of operations costs
+ * one sequential write more than it did, rather than however many
+ * scattered ones in an order that survives a crash (which nothing
+ * tried for), and a crash costs the batch being put together rather
+ * than an sfsck.
+ *
+ * Operations copy the inodes they change into their buffers before
+ * they end (sfs_jinode), so that a commit needs none of the vnode
+ * locks, and they start before taking any, so that a commit waiting
+ * for operations to finish doesn't wait for one that is waiting for
+ * it. Not quite: while a commit is waiting, a thread that's already
+ * inside an operation, or holds a vnode lock (say, paging out in the
+ * middle of a read), is let in anyway, as what it holds might be what
+ * the operations being waited for need. t_fsdepth counts these.
+ *
+ * Commits happen when an operation ends with SFS_JCOMMIT_BLOCKS
+ * blocks held, every SFS_JCOMMIT_PERIOD seconds from the commit
+ * thread, and for sync and fsync. A commit first writes back the
+ * buffers that aren't held, so that file data reaches the disk before
+ * the metadata that points at it. Blocks freed since the last commit
+ * aren't free for reuse until this one (see sfs_bfree), so file data
+ * can't land in a block the journal might yet put back metadata that
+ * uses.
+ *
+ * A transaction too big for the journal (more than SFS_JHOMES blocks,
+ * which takes something like truncating a very large file) goes home
+ * directly instead, the journal having been cleared first; a crash in
+ * the middle of that needs sfsck as before.
+ */
+#define SFS_JCOMMIT_BLOCKS (SFS_JHOMES / 2)
+#define SFS_JCOMMIT_PERIOD 5		/* seconds */
+#define SFS_JTICK 500000000		/* nanoseconds */
+
+/*
+ * Add LEN bytes at DATA to the checksum SUM.
+ */
+static
+uint32_t
+sfs_jsum(uint32_t sum, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		sum ^= p[i];
+		sum *= SFS_DIRHASH_PRIME;
+	}
+	return sum;
+}
+
+////////////////////////////////////////////////////////////
+// Operations
+
+void
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	if (sfs->sfs_jcommitter != curthread) {
+		while (sfs->sfs_jstate == SFS_JLOCKED ||
+		       (sfs->sfs_jstate == SFS_JDRAINING &&
+			curthread->t_fsdepth == 0)) {
+			cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+		}
+	}
+	sfs->sfs_jops++;
+	lock_release(sfs->sfs_jlock);
+	curthread->t_fsdepth++;
+}
+
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	bool commit;
+	int result;
+
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+
+	KASSERT(curthread->t_fsdepth > 0);
+	curthread->t_fsdepth--;
+
+	lock_acquire(sfs->sfs_jlock);
+	KASSERT(sfs->sfs_jops > 0);
+	sfs->sfs_jops--;
+	if (sfs->sfs_jops == 0) {
+		cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jpending = true;
+	commit = curthread->t_fsdepth == 0 &&
+		sfs->sfs_jstate == SFS_JOPEN &&
+		sfs->sfs_jheld >= SFS_JCOMMIT_BLOCKS;
+	lock_release(sfs->sfs_jlock);
+
+	if (commit) {
+		result = sfs_jcommit(sfs);
+		if (result) {
+			kprintf("sfs: %s: journal commit failed: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+		}
+	}
+}
+
+/*
+ * Copy SV's inode into its buffer, if it's changed, at the end of an
+ * operation. If that fails (for want of memory) the inode stays
+ * dirty, and goes with a later transaction.
+ */
+void
+sfs_jinode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sfs->sfs_journaled) {
+		(void)sfs_sync_inode(sv);
+	}
+}
+
+/*
+ * Mark a metadata block dirty: held for the journal if there is one.
+ */
+void
+sfs_markmeta(struct sfs_fs *sfs, struct buf *b)
+{
+	if (!sfs->sfs_journaled) {
+		buf_markdirty(b);
+		return;
+	}
+	if (buf_markheld(b)) {
+		lock_acquire(sfs->sfs_jlock);
+		sfs->sfs_jheld++;
+		lock_release(sfs->sfs_jlock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Commit
+
+/*
+ * Write the header, the N buffers in sfs_jbufs, and the commit block
+ * to the journal, in one go.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs, unsigned n)
+{
+	struct sfs_jheader *jh = sfs->sfs_jhead;
+	struct sfs_jcommit *jc = sfs->sfs_jtail;
+	struct iovec *iov = sfs->sfs_jiov;
+	struct uio ku;
+	uint32_t sum;
+	unsigned i;
+
+	KASSERT(n > 0 && n <= SFS_JHOMES);
+
+	/* with big blocks, the rest of the block is zeros */
+	bzero(jh, sfs->sfs_blocksize);
+	jh->jh_magic = SFS_JMAGIC;
+	jh->jh_seq = sfs->sfs_jseq;
+	jh->jh_nblocks = n;
+	for (i=0; i<n; i++) {
+		jh->jh_home[i] = buf_block(sfs->sfs_jbufs[i]);
+	}
+
+	sum = sfs_jsum(SFS_DIRHASH_BASIS, jh->jh_home, n * sizeof(uint32_t));
+	for (i=0; i<n; i++) {
+		sum = sfs_jsum(sum, buf_data(sfs->sfs_jbufs[i]),
+			       sfs->sfs_blocksize);
+	}
+
+	bzero(jc, sfs->sfs_blocksize);
+	jc->jc_magic = SFS_JCMAGIC;
+	jc->jc_seq = sfs->sfs_jseq;
+	jc->jc_nblocks = n;
+	jc->jc_sum = sum;
+
+	uio_kinit(&iov[0], &ku, jh, (n + 2) * sfs->sfs_blocksize,
+		  (off_t)sfs->sfs_sb.sb_journalstart * sfs->sfs_blocksize,
+		  UIO_WRITE);
+	iov[0].iov_len = sfs->sfs_blocksize;
+	for (i=0; i<n; i++) {
+		iov[i+1].iov_kbase = buf_data(sfs->sfs_jbufs[i]);
+		iov[i+1].iov_len = sfs->sfs_blocksize;
+	}
+	iov[n+1].iov_kbase = jc;
+	iov[n+1].iov_len = sfs->sfs_blocksize;
+	ku.uio_iovcnt = n + 2;
+
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Clear the journal, so that what's in it isn't replayed. Its header
+ * keeps the sequence number, so that the next transaction can't be
+ * mistaken for an old one.
+ */
+int
+sfs_jclear(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (!sfs->sfs_jondisk) {
+		return 0;
+	}
+	bzero(sfs->sfs_jhead, sizeof(*sfs->sfs_jhead));
+	sfs->sfs_jhead->jh_seq = sfs->sfs_jseq - 1;
+	result = sfs_writeblock(sfs, sfs->sfs_sb.sb_journalstart,
+				sfs->sfs_jhead, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_jondisk = false;
+	return 0;
+}
+
+/*
+ * Write a transaction too big for the journal straight home: clear
+ * the journal, lest it be replayed over the top afterwards, and let go
+ * of everything.
+ */
+static
+int
+sfs_jspill(struct sfs_fs *sfs, unsigned n)
+{
+	unsigned i;
+	int result;
+
+	result = sfs_jclear(sfs);
+	if (result) {
+		return result;
+	}
+	if (!sfs->sfs_jwarned) {
+		kprintf("sfs: %s: %u blocks changed at once, too many for "
+			"the journal; writing them in place\n",
+			sfs->sfs_sb.sb_volname, n);
+		sfs->sfs_jwarned = true;
+	}
+
+	do {
+		for (i=0; i<n && i<SFS_JHOMES; i++) {
+			buf_unhold(sfs->sfs_jbufs[i]);
+		}
+		n = buf_held(sfs->sfs_device, sfs->sfs_jbufs, SFS_JHOMES);
+	} while (n > 0);
+
+	return buf_sync(sfs->sfs_device);
+}
+
+/*
+ * The part of a commit done with operations kept out.
+ */
+static
+int
+sfs_jdocommit(struct sfs_fs *sfs)
+{
+	unsigned n, i;
+	int result;
+
+	/* The freemap, as of this transaction, goes with it */
+	sfs_bfree_commit(sfs);
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* File data first, so nothing committed points at garbage */
+	result = buf_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	n = buf_held(sfs->sfs_device, sfs->sfs_jbufs, SFS_JHOMES);
+	if (n == 0) {
+		return 0;
+	}
+	if (n > SFS_JHOMES) {
+		return sfs_jspill(sfs, n);
+	}
+
+	result = sfs_jwrite(sfs, n);
+	if (result) {
+		/* they stay held, and go with the next try */
+		return result;
+	}
+	sfs->sfs_jondisk = true;
+	sfs->sfs_jseq++;
+
+	/* Committed; now they can go home */
+	for (i=0; i<n; i++) {
+		buf_unhold(sfs->sfs_jbufs[i]);
+	}
+	return buf_sync(sfs->sfs_device);
+}
+
+/*
+ * Commit what the operations so far have done. Must be called from
+ * outside any operation, without vnode locks.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (!sfs->sfs_journaled) {
+		return 0;
+	}
+	KASSERT(curthread->t_fsdepth == 0);
+
+	lock_acquire(sfs->sfs_jlock);
+	while (sfs->sfs_jstate != SFS_JOPEN) {
+		/* someone else is committing; then it's our turn */
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jstate = SFS_JDRAINING;
+	while (sfs->sfs_jops > 0) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jstate = SFS_JLOCKED;
+	sfs->sfs_jcommitter = curthread;
+	sfs->sfs_jpending = false;
+	lock_release(sfs->sfs_jlock);
+
+	result = sfs_jdocommit(sfs);
+
+	lock_acquire(sfs->sfs_jlock);
+	if (result) {
+		sfs->sfs_jpending = true;
+	}
+	else {
+		sfs->sfs_jheld = 0;
+	}
+	sfs->sfs_jstate = SFS_JOPEN;
+	sfs->sfs_jcommitter = NULL;
+	cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	lock_release(sfs->sfs_jlock);
+
+	return result;
+}
+
+/*
+ * Commit, for fsync, if there are any metadata blocks waiting; with
+ * none, there's nothing that needs the journal.
+ */
+int
+sfs_jsync(struct sfs_fs *sfs)
+{
+	unsigned held;
+
+	if (!sfs->sfs_journaled) {
+		return 0;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	held = sfs->sfs_jheld;
+	lock_release(sfs->sfs_jlock);
+
+	if (held == 0) {
+		return 0;
+	}
+	return sfs_jcommit(sfs);
+}
+
+/*
+ * The commit thread, so that changes don't sit in memory indefinitely
+ * when nothing else commits them. It looks every SFS_JTICK for whether
+ * it's to stop, so that unmounting doesn't wait long.
+ */
+static
+void
+sfs_jthread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	struct timespec tick;
+	unsigned ticks;
+	bool stop, pending;
+	int result;
+
+	(void)data2;
+
+	tick.tv_sec = 0;
+	tick.tv_nsec = SFS_JTICK;
+	ticks = 0;
+
+	while (1) {
+		clocknanosleep(&tick);
+		ticks++;
+
+		lock_acquire(sfs->sfs_jlock);
+		stop = sfs->sfs_jstop;
+		pending = sfs->sfs_jpending;
+		lock_release(sfs->sfs_jlock);
+		if (stop) {
+			break;
+		}
+
+		if (pending && ticks * (SFS_JTICK / 1000000) >=
+		    SFS_JCOMMIT_PERIOD * 1000) {
+			ticks = 0;
+			result = sfs_jcommit(sfs);
+			if (result) {
+				kprintf("sfs: %s: journal commit failed: %s\n",
+					sfs->sfs_sb.sb_volname,
+					strerror(result));
+			}
+		}
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jrunning = false;
+	cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	lock_release(sfs->sfs_jlock);
+	thread_exit();
+}
+
+int
+sfs_jstart(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (!sfs->sfs_journaled) {
+		return 0;
+	}
+	KASSERT(!sfs->sfs_jrunning);
+	sfs->sfs_jstop = false;
+	sfs->sfs_jrunning = true;
+	result = thread_fork("sfsjournal", NULL, sfs_jthread, sfs, 0);
+	if (result) {
+		sfs->sfs_jrunning = false;
+	}
+	return result;
+}
+
+void
+sfs_jstop(struct sfs_fs *sfs)
+{
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jstop = true;
+	while (sfs->sfs_jrunning) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	lock_release(sfs->sfs_jlock);
+}
+
+////////////////////////////////////////////////////////////
+// Mounting
+
+/*
+ * If the journal holds a committed transaction, write it home. This
+ * is before anything is read through the buffer cache, so it can go
+ * straight to the disk. If the header or commit block doesn't match,
+ * or the checksum is wrong, the transaction didn't get committed, and
+ * nothing of it went home either.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs)
+{
+	struct sfs_jheader *jh = sfs->sfs_jhead;
+	struct sfs_jcommit *jc = sfs->sfs_jtail;
+	uint32_t start = sfs->sfs_sb.sb_journalstart;
+	uint32_t end = start + sfs->sfs_sb.sb_journalblocks;
+	uint32_t n, i, sum;
+	void *block;
+	int result;
+
+	result = sfs_readblock(sfs, start, jh, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_jseq = jh->jh_seq + 1;
+	n = jh->jh_nblocks;
+	if (jh->jh_magic != SFS_JMAGIC || n == 0 || n > SFS_JHOMES) {
+		return 0;
+	}
+
+	result = sfs_readblock(sfs, start + 1 + n, jc, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	if (jc->jc_magic != SFS_JCMAGIC || jc->jc_seq != jh->jh_seq ||
+	    jc->jc_nblocks != n) {
+		return 0;
+	}
+
+	block = kmalloc(sfs->sfs_blocksize);
+	if (block == NULL) {
+		return ENOMEM;
+	}
+
+	sum = sfs_jsum(SFS_DIRHASH_BASIS, jh->jh_home, n * sizeof(uint32_t));
+	for (i=0; i<n; i++) {
+		result = sfs_readblock(sfs, start + 1 + i, block,
+				       sfs->sfs_blocksize);
+		if (result) {
+			kfree(block);
+			return result;
+		}
+		sum = sfs_jsum(sum, block, sfs->sfs_blocksize);
+	}
+	if (sum != jc->jc_sum) {
+		kfree(block);
+		return 0;
+	}
+
+	for (i=0; i<n; i++) {
+		if (jh->jh_home[i] == SFS_SUPER_BLOCK ||
+		    jh->jh_home[i] >= sfs->sfs_sb.sb_nblocks ||
+		    (jh->jh_home[i] >= start && jh->jh_home[i] < end)) {
+			kprintf("sfs: %s: journal has block %u going to "
+				"%u; not replaying it\n",
+				sfs->sfs_sb.sb_volname, i, jh->jh_home[i]);
+			kfree(block);
+			return EINVAL;
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		result = sfs_readblock(sfs, start + 1 + i, block,
+				       sfs->sfs_blocksize);
+		if (result) {
+			kfree(block);
+			return result;
+		}
+		result = sfs_writeblock(sfs, jh->jh_home[i], block,
+					sfs->sfs_blocksize);
+		if (result) {
+			kfree(block);
+			return result;
+		}
+	}
+	kfree(block);
+
+	kprintf("sfs: %s: replayed %u blocks from the journal\n",
+		sfs->sfs_sb.sb_volname, n);
+	sfs->sfs_jondisk = true;
+	return 0;
+}
+
+/*
+ * Set up the journal, if the volume has one, and replay it. Called
+ * when mounting, once the superblock has been read.
+ */
+int
+sfs_jmount(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+
+	COMPILE_ASSERT(sizeof(struct sfs_jheader) == SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_jcommit) == SFS_BLOCKSIZE);
+
+	if ((sb->sb_features & SFS_FEATURE_JOURNAL) == 0) {
+		return 0;
+	}
+
+	if (sb->sb_journalblocks < SFS_JOURNAL_SIZE ||
+	    sb->sb_journalblocks > sb->sb_nblocks ||
+	    sb->sb_journalstart < SFS_FREEMAP_START +
+	    SFS_FREEMAPBLOCKS(sb->sb_nblocks, sfs->sfs_blocksize) ||
+	    sb->sb_journalstart > sb->sb_nblocks - sb->sb_journalblocks) {
+		kprintf("sfs: %s: bad journal (%u blocks at %u)\n",
+			sb->sb_volname, sb->sb_journalblocks,
+			sb->sb_journalstart);
+		return EINVAL;
+	}
+
+	sfs->sfs_jlock = lock_create("sfs_journal");
+	sfs->sfs_jcv = cv_create("sfs_journal");
+	sfs->sfs_jfreed = bitmap_create(SFS_FREEMAPBITS(sb->sb_nblocks,
+							sfs->sfs_blocksize));
+	sfs->sfs_jbufs = kmalloc(SFS_JHOMES * sizeof(struct buf *));
+	sfs->sfs_jiov = kmalloc((SFS_JHOMES + 2) * sizeof(struct iovec));
+	/* these are a whole block each, for sfs_jwrite */
+	sfs->sfs_jhead = kmalloc(sfs->sfs_blocksize);
+	sfs->sfs_jtail = kmalloc(sfs->sfs_blocksize);
+	if (sfs->sfs_jlock == NULL || sfs->sfs_jcv == NULL ||
+	    sfs->sfs_jfreed == NULL || sfs->sfs_jbufs == NULL ||
+	    sfs->sfs_jiov == NULL || sfs->sfs_jhead == NULL ||
+	    sfs->sfs_jtail == NULL) {
+		return ENOMEM;
+	}
+	sfs->sfs_journaled = true;
+
+	return sfs_jreplay(sfs);
+}
+
+/*
+ * Throw away what sfs_jmount set up, when the fs is destroyed.
+ */
+void
+sfs_jcleanup(struct sfs_fs *sfs)
+{
+	KASSERT(!sfs->sfs_jrunning);
+
+	if (sfs->sfs_jlock != NULL) {
+		lock_destroy(sfs->sfs_jlock);
+	}
+	if (sfs->sfs_jcv != NULL) {
+		cv_destroy(sfs->sfs_jcv);
+	}
+	if (sfs->sfs_jfreed != NULL) {
+		bitmap_destroy(sfs->sfs_jfreed);
+	}
+	kfree(sfs->sfs_jbufs);
+	kfree(sfs->sfs_jiov);
+	kfree(sfs->sfs_jhead);
+	kfree(sfs->sfs_jtail);
+}
@@ -37,8 +37,10 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -102,9 +104,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	sfs_vnode_lock(sv);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	sfs_vnode_unlock(sv);
 
 	return result;
 }
@@ -117,13 +119,17 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	sfs_vnode_lock(sv);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	sfs_jinode(sv);
+	sfs_vnode_unlock(sv);
+	sfs_jend(sfs);
 
 	return result;
 }
@@ -154,6 +160,7 @@ int
 sfs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	/* Fill in the stat structure */
@@ -164,13 +171,16 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	sfs_vnode_lock(sv);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	sfs_vnode_unlock(sv);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
 
-	/* Fill in other fields as desired/possible... */
+	statbuf->st_ino = sv->sv_ino;
+	statbuf->st_blksize = sfs->sfs_blocksize;
 
 	return 0;
 }
@@ -185,16 +195,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
+	/* The type is set when the vnode is loaded, so needs no lock */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -214,32 +221,62 @@ sfs_isseekable(struct vnode *v)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Called for fsync().
+ *
+ * The file's blocks (data, indirect, and inode) are marked as its in
+ * the buffer cache, so only those need writing back, with the freemap
+ * blocks, which may have its new blocks allocated in them. With a
+ * journal, metadata can't be committed a file at a time, so if any
+ * is waiting the whole journal is committed.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	sfs_vnode_lock(sv);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	sfs_vnode_unlock(sv);
+	sfs_jend(sfs);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	if (sfs->sfs_journaled) {
+		/* the data first, so the commit never points at garbage */
+		result = buf_syncowner(sfs->sfs_device, sv);
+		if (result) {
+			return result;
+		}
+		return sfs_jsync(sfs);
+	}
+
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+	result = buf_syncowner(sfs->sfs_device, sfs);
+	if (result) {
+		return result;
+	}
+	return buf_syncowner(sfs->sfs_device, sv);
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Regular files can be mapped; the pages
+ * themselves come in through the VM system's page cache with
+ * VOP_READ and go back with VOP_WRITE.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
@@ -250,8 +287,127 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	sfs_jbegin(sfs);
+	sfs_vnode_lock(sv);
+	result = sfs_itrunc(sv, len);
+	sfs_jinode(sv);
+	sfs_vnode_unlock(sv);
+	sfs_jend(sfs);
+
+	return result;
+}
+
+/*
+ * Called for fallocate(). Sets aside blocks for the bytes from POS up
+ * to POS+LEN, as far as possible one after another on disk. The file
+ * keeps its size; the blocks past its end are taken up as it's
+ * written.
+ */
+static
+int
+sfs_fallocate(struct vnode *v, off_t pos, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	uint32_t start, end;
+	int result;
+
+	/* sfi_size is 32 bits */
+	if (pos + len > (off_t)0xffffffff) {
+		return EFBIG;
+	}
+	start = pos / sfs->sfs_blocksize;
+	end = DIVROUNDUP(pos + len, sfs->sfs_blocksize);
+
+	sfs_jbegin(sfs);
+	sfs_vnode_lock(sv);
+
+	/* An inline file already has room in its inode */
+	result = 0;
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (pos + len <= SFS_INLINESIZE) {
+			goto out;
+		}
+		result = sfs_inline_evict(sv);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/* The first time, mark the volume as using preallocation */
+	lock_acquire(sfs->sfs_freemaplock);
+	if ((sfs->sfs_sb.sb_features & SFS_FEATURE_PREALLOC) == 0) {
+		sfs->sfs_sb.sb_features |= SFS_FEATURE_PREALLOC;
+		sfs->sfs_superdirty = true;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	if ((sv->sv_i.sfi_flags & SFS_IFLAG_PREALLOC) == 0) {
+		sv->sv_i.sfi_flags |= SFS_IFLAG_PREALLOC;
+		sfs_dirty_inode(sv);
+	}
+	result = sfs_bmap_prealloc(sv, start, end);
+
+ out:
+	sfs_jinode(sv);
+	sfs_vnode_unlock(sv);
+	sfs_jend(sfs);
+
+	return result;
+}
+
+/*
+ * Called for lseek() with SEEK_DATA and SEEK_HOLE. Holes are whole
+ * unmapped blocks, found with sfs_bmap_seek.
+ */
+static
+int
+sfs_seekhole(struct vnode *v, off_t pos, bool hole, off_t *ret)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	off_t size, where;
+	uint32_t block;
+	int result;
+
+	sfs_vnode_lock(sv);
+	size = sv->sv_i.sfi_size;
+	if (pos >= size) {
+		sfs_vnode_unlock(sv);
+		return ENXIO;
+	}
+
+	/* An inline file has no holes */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		sfs_vnode_unlock(sv);
+		*ret = hole ? size : pos;
+		return 0;
+	}
+
+	result = sfs_bmap_seek(sv, pos / sfs->sfs_blocksize,
+			       DIVROUNDUP(size, sfs->sfs_blocksize),
+			       !hole, &block);
+	sfs_vnode_unlock(sv);
+	if (result) {
+		return result;
+	}
 
-	return sfs_itrunc(sv, len);
+	where = (off_t)block * sfs->sfs_blocksize;
+	if (where < pos) {
+		where = pos;
+	}
+	if (where >= size) {
+		/* no more holes but the end; no more data at all */
+		if (!hole) {
+			return ENXIO;
+		}
+		where = size;
+	}
+	*ret = where;
+	return 0;
 }
 
 /*
@@ -289,37 +445,41 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	sfs_vnode_lock(sv);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		sfs_vnode_unlock(sv);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		sfs_vnode_unlock(sv);
+		sfs_jend(sfs);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		sfs_vnode_unlock(sv);
+		sfs_jend(sfs);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnode_unlock(sv);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -329,20 +489,26 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		sfs_vnode_unlock(sv);
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	sfs_vnode_lock(newguy);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	sfs_dirty_inode(newguy);
+	sfs_jinode(newguy);
+	sfs_vnode_unlock(newguy);
 
-	*ret = &newguy->sv_absvn;
+	sfs_jinode(sv);
+	sfs_vnode_unlock(sv);
+	sfs_jend(sfs);
 
-	vfs_biglock_release();
+	*ret = &newguy->sv_absvn;
 	return 0;
 }
 
@@ -357,30 +523,37 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
-
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
+	sfs_jbegin(sfs);
+	sfs_vnode_lock(sv);
+
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnode_unlock(sv);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	sfs_vnode_lock(f);
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_dirty_inode(f);
+	sfs_jinode(f);
+	sfs_vnode_unlock(f);
 
-	vfs_biglock_release();
+	sfs_jinode(sv);
+	sfs_vnode_unlock(sv);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -392,32 +565,41 @@ int
 sfs_remove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	sfs_vnode_lock(sv);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnode_unlock(sv);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* Erase its directory entry. */
-	result = sfs_dir_unlink(sv, slot);
+	result = sfs_dir_unlink(sv, name, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		sfs_vnode_lock(victim);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty_inode(victim);
+		sfs_jinode(victim);
+		sfs_vnode_unlock(victim);
+		sfs_jinode(sv);
 	}
 
+	sfs_vnode_unlock(sv);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
+	sfs_jend(sfs);
 	return result;
 }
 
@@ -438,15 +620,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
 
+	sfs_jbegin(sfs);
+	sfs_vnode_lock(sv);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnode_unlock(sv);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -467,11 +651,20 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 
 	/* Increment the link count, and mark inode dirty */
+	sfs_vnode_lock(g1);
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+	sfs_vnode_unlock(g1);
 
-	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	/*
+	 * Unlink the old slot. Making room for the new name may have
+	 * moved the old one, if the directory is hashed, so look again.
+	 */
+	result = sfs_dir_findname(sv, n1, NULL, &slot1, NULL);
+	if (result) {
+		goto puke_harder;
+	}
+	result = sfs_dir_unlink(sv, n1, slot1);
 	if (result) {
 		goto puke_harder;
 	}
@@ -480,21 +673,27 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	sfs_vnode_lock(g1);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+	sfs_jinode(g1);
+	sfs_vnode_unlock(g1);
+
+	sfs_jinode(sv);
+	sfs_vnode_unlock(sv);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
+	sfs_jend(sfs);
 	return 0;
 
  puke_harder:
 	/*
 	 * Error recovery: try to undo what we already did
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_unlink(sv, n2, slot2);
 	if (result2) {
 		kprintf("sfs: %s: rename: %s\n",
 			sfs->sfs_sb.sb_volname, strerror(result));
@@ -503,20 +702,71 @@ sfs_rename(struct vnode *d1, const char *n1,
 		panic("sfs: %s: rename: Cannot recover\n",
 		      sfs->sfs_sb.sb_volname);
 	}
+	sfs_vnode_lock(g1);
 	g1->sv_i.sfi_linkcount--;
+	sfs_vnode_unlock(g1);
  puke:
+	sfs_vnode_unlock(sv);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
+	sfs_jend(sfs);
 	return result;
 }
 
+/*
+ * Walk PATH from the directory SV a name at a time, in place. If LAST
+ * is not NULL, stop short of the final name and hand it back there
+ * (NULL if there are no names) instead of looking it up. Returns the
+ * vnode reached, with a reference.
+ *
+ * We don't support subdirectories, so in practice every name but the
+ * last has to be "." or it's a file and we fail with ENOTDIR; but the
+ * path is no longer handed whole to sfs_lookonce as one name.
+ */
+static
+int
+sfs_walk(struct sfs_vnode *sv, char *path, char **last,
+	 struct sfs_vnode **ret)
+{
+	struct sfs_vnode *next;
+	char *name;
+	int result;
+
+	if (last != NULL) {
+		*last = NULL;
+	}
+
+	VOP_INCREF(&sv->sv_absvn);
+	while ((name = vfs_nextname(&path)) != NULL) {
+		if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
+			VOP_DECREF(&sv->sv_absvn);
+			return ENOTDIR;
+		}
+		if (last != NULL && *path == 0) {
+			*last = name;
+			break;
+		}
+		if (!strcmp(name, ".")) {
+			continue;
+		}
+
+		sfs_vnode_lock(sv);
+		result = sfs_lookonce(sv, name, &next, NULL);
+		sfs_vnode_unlock(sv);
+		VOP_DECREF(&sv->sv_absvn);
+		if (result) {
+			return result;
+		}
+		sv = next;
+	}
+
+	*ret = sv;
+	return 0;
+}
+
 /*
  * lookparent returns the last path component as a string and the
  * directory it's in as a vnode.
- *
- * Since we don't support subdirectories, this is very easy -
- * return the root dir and copy the path.
  */
 static
 int
@@ -524,32 +774,37 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 		  char *buf, size_t buflen)
 {
 	struct sfs_vnode *sv = v->vn_data;
-
-	vfs_biglock_acquire();
+	struct sfs_vnode *dir;
+	char *name;
+	int result;
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
-	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
-		return ENAMETOOLONG;
+	result = sfs_walk(sv, path, &name, &dir);
+	if (result) {
+		return result;
 	}
-	strcpy(buf, path);
 
-	VOP_INCREF(&sv->sv_absvn);
-	*ret = &sv->sv_absvn;
+	if (name == NULL) {
+		result = EINVAL;
+	}
+	else if (strlen(name)+1 > buflen) {
+		result = ENAMETOOLONG;
+	}
+	if (result) {
+		VOP_DECREF(&dir->sv_absvn);
+		return result;
+	}
+	strcpy(buf, name);
 
-	vfs_biglock_release();
+	*ret = &dir->sv_absvn;
 	return 0;
 }
 
 /*
  * Lookup gets a vnode for a pathname.
- *
- * Since we don't support subdirectories, it's easy - just look up the
- * name.
  */
 static
 int
@@ -559,22 +814,16 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
-	result = sfs_lookonce(sv, path, &final, NULL);
+	result = sfs_walk(sv, path, NULL, &final);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
-
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -601,7 +850,10 @@ const struct vnode_ops sfs_fileops = {
 	.vop_fsync = sfs_fsync,
 	.vop_mmap = sfs_mmap,
 	.vop_truncate = sfs_truncate,
+	.vop_fallocate = sfs_fallocate,
+	.vop_seekhole = sfs_seekhole,
 	.vop_namefile = vopfail_uio_notdir,
+	.vop_poll = vopnull_poll,
 
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
@@ -635,7 +887,10 @@ const struct vnode_ops sfs_dirops = {
 	.vop_fsync = sfs_fsync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_fallocate = vopfail_fallocate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
 	.vop_namefile = sfs_namefile,
+	.vop_poll = vopnull_poll,
 
 	.vop_creat = sfs_creat,
 	.vop_symlink = vopfail_symlink_nosys,
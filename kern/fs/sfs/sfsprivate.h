@@ -38,18 +38,44 @@ extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
 /* Macro for initializing a uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+#define SFSUIO(sfs, iov, uio, ptr, len, block, rw) \
+    uio_kinit(iov, uio, ptr, len, ((off_t)(block))*(sfs)->sfs_blocksize, rw)
+
+
+/* Journal states, for sfs_jstate (see sfs_journal.c) */
+#define SFS_JOPEN     0         /* operations may start */
+#define SFS_JDRAINING 1         /* a commit waits for them to finish */
+#define SFS_JLOCKED   2         /* ... and is under way */
+
+/* A run of blocks to be freed together (see sfs_bfree_batch) */
+struct sfs_freebatch {
+	daddr_t fb_start;
+	unsigned fb_count;
+};
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_clearblock(struct sfs_fs *sfs, daddr_t block, const void *owner);
+int sfs_balloc_run(struct sfs_fs *sfs, daddr_t goal, unsigned max,
+		daddr_t *start, unsigned *count);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bfree_run(struct sfs_fs *sfs, daddr_t start, unsigned count);
+void sfs_bfree_batch(struct sfs_fs *sfs, struct sfs_freebatch *batch,
+		     daddr_t diskblock);
+void sfs_bfree_flush(struct sfs_fs *sfs, struct sfs_freebatch *batch);
+void sfs_bfree_commit(struct sfs_fs *sfs);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-		daddr_t *diskblock);
+		bool *fresh, daddr_t *diskblock);
+void sfs_bmap_unreserve(struct sfs_vnode *sv);
+int sfs_bmap_prealloc(struct sfs_vnode *sv, uint32_t start, uint32_t end);
+int sfs_bmap_settle(struct sfs_vnode *sv, uint32_t start, uint32_t end);
+bool sfs_bmap_unwritten(struct sfs_vnode *sv, uint32_t fileblock);
+int sfs_bmap_seek(struct sfs_vnode *sv, uint32_t start, uint32_t end,
+		  bool mapped, uint32_t *ret);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -57,25 +83,50 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot);
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
-int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+int sfs_dir_unlink(struct sfs_vnode *sv, const char *name, int slot);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
+void sfs_vnode_lock(struct sfs_vnode *sv);
+void sfs_vnode_unlock(struct sfs_vnode *sv);
+bool sfs_vnode_do_i_hold(struct sfs_vnode *sv);
+void sfs_dirty_inode(struct sfs_vnode *sv);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
+int sfs_reapstart(struct sfs_fs *sfs);
+void sfs_reapstop(struct sfs_fs *sfs);
 int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+int sfs_inline_evict(struct sfs_vnode *sv);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
+/* Functions in sfs_journal.c */
+struct buf;
+int sfs_jmount(struct sfs_fs *sfs);
+int sfs_jstart(struct sfs_fs *sfs);
+void sfs_jstop(struct sfs_fs *sfs);
+int sfs_jclear(struct sfs_fs *sfs);
+void sfs_jcleanup(struct sfs_fs *sfs);
+void sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+void sfs_jinode(struct sfs_vnode *sv);
+void sfs_markmeta(struct sfs_fs *sfs, struct buf *b);
+int sfs_jcommit(struct sfs_fs *sfs);
+int sfs_jsync(struct sfs_fs *sfs);
+
 
 #endif /* _SFSPRIVATE_H_ */
@@ -0,0 +1,110 @@
+/*
+ * tmpfs: a filesystem kept entirely in memory, for scratch files.
+ * Nothing in it survives a reboot.
+ */
+
+#ifndef TMPFS_H
+#define TMPFS_H
+
+#include <spinlock.h>
+#include <fs.h>
+#include <vnode.h>
+
+/*
+ * Constants
+ */
+
+#define TMPFS_DIRHASH	32		/* hash chains per directory */
+#define TMPFS_ROOTINO	1		/* inode number of the root dir */
+
+/*
+ * Directory entry: a name for a node, on one of its directory's hash
+ * chains.
+ */
+struct tmpfs_dirent {
+	char *td_name;				/* Name */
+	struct tmpfs_node *td_node;		/* What it names */
+	struct tmpfs_dirent *td_next;		/* Next on the chain */
+};
+
+/*
+ * A file or directory. Files keep their data in whole pages from
+ * alloc_kpages, indexed by file page number; a 0 entry is a hole and
+ * reads as zeros. Directories hash their names on TMPFS_DIRHASH
+ * chains.
+ *
+ * The vnode is separate, as in semfs, so it can come and go at the
+ * whim of VOP_RECLAIM while the node stays put as long as it has a
+ * name.
+ */
+struct tmpfs_node {
+	struct tmpfs *tn_tmpfs;			/* Back-pointer to fs */
+	mode_t tn_type;				/* S_IFREG or S_IFDIR */
+	unsigned tn_ino;			/* Inode number */
+	unsigned tn_linkcount;			/* Names for it */
+	struct tmpfs_vnode *tn_vnode;		/* Vnode, if it has one */
+
+	/* for files, under tn_lock */
+	struct lock *tn_lock;			/* Lock for data and size */
+	off_t tn_size;				/* Size in bytes */
+	vaddr_t *tn_pages;			/* Data pages */
+	unsigned tn_npages;			/* Size of tn_pages */
+
+	/* for directories, under tmpfs_lock */
+	struct tmpfs_node *tn_parent;		/* Containing dir, or NULL */
+	struct tmpfs_dirent *tn_hash[TMPFS_DIRHASH]; /* Entries */
+	unsigned tn_nents;			/* Number of entries */
+};
+
+/*
+ * Vnode.
+ */
+struct tmpfs_vnode {
+	struct vnode tv_absvn;			/* Abstract vnode */
+	struct tmpfs_node *tv_node;		/* Its node */
+};
+
+/*
+ * The structure for one tmpfs.
+ *
+ * tmpfs_lock covers the shape of the tree: the directories, link
+ * counts, and which nodes have vnodes. A file's data has its own
+ * lock, which may be taken while holding tmpfs_lock but not the other
+ * way around.
+ */
+struct tmpfs {
+	struct fs tmpfs_absfs;			/* Abstract fs object */
+	char *tmpfs_name;			/* Volume name */
+
+	struct lock *tmpfs_lock;		/* Lock for the tree */
+	struct tmpfs_node *tmpfs_root;		/* Root directory */
+	unsigned tmpfs_nextino;			/* Next inode number */
+
+	struct spinlock tmpfs_pagelock;		/* Lock for following */
+	unsigned tmpfs_npages;			/* Pages holding data */
+	unsigned tmpfs_maxpages;		/* Most we may take */
+};
+
+/*
+ * Functions.
+ */
+
+/* in tmpfs_obj.c */
+struct tmpfs_node *tmpfs_node_create(struct tmpfs *, mode_t type);
+void tmpfs_node_destroy(struct tmpfs_node *);
+int tmpfs_getpage(struct tmpfs_node *, unsigned pagenum, bool alloc,
+		  vaddr_t *ret);
+void tmpfs_freepages(struct tmpfs_node *, off_t len);
+struct tmpfs_dirent *tmpfs_dir_find(struct tmpfs_node *dir, const char *name);
+int tmpfs_dir_add(struct tmpfs_node *dir, const char *name,
+		  struct tmpfs_node *node);
+void tmpfs_dir_remove(struct tmpfs_node *dir, struct tmpfs_dirent *td);
+struct tmpfs_dirent *tmpfs_dir_byslot(struct tmpfs_node *dir, off_t *slot);
+struct tmpfs_dirent *tmpfs_dir_bynode(struct tmpfs_node *dir,
+				      struct tmpfs_node *node);
+
+/* in tmpfs_vnops.c */
+int tmpfs_getvnode(struct tmpfs_node *, struct vnode **ret);
+
+
+#endif /* TMPFS_H */
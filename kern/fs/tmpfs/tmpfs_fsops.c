@@ -0,0 +1,216 @@
+/*
+ * tmpfs fs-level operations, and making one.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <mainbus.h>
+#include <vm.h>
+#include <vfs.h>
+#include <fs.h>
+#include <vnode.h>
+
+#include "tmpfs.h"
+
+////////////////////////////////////////////////////////////
+// fs-level operations
+
+/*
+ * Sync doesn't need to do anything.
+ */
+static
+int
+tmpfs_sync(struct fs *fs)
+{
+	(void)fs;
+	return 0;
+}
+
+/*
+ * The volume name is the name it was mounted as.
+ */
+static
+const char *
+tmpfs_getvolname(struct fs *fs)
+{
+	struct tmpfs *tmpfs = fs->fs_data;
+
+	return tmpfs->tmpfs_name;
+}
+
+/*
+ * Get the root directory vnode.
+ */
+static
+int
+tmpfs_getroot(struct fs *fs, struct vnode **ret)
+{
+	struct tmpfs *tmpfs = fs->fs_data;
+	int result;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	result = tmpfs_getvnode(tmpfs->tmpfs_root, ret);
+	lock_release(tmpfs->tmpfs_lock);
+	if (result) {
+		kprintf("tmpfs: %s: couldn't load root vnode: %s\n",
+			tmpfs->tmpfs_name, strerror(result));
+		return result;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// mount and unmount logic
+
+/*
+ * Destructor for struct tmpfs.
+ */
+static
+void
+tmpfs_destroy(struct tmpfs *tmpfs)
+{
+	KASSERT(tmpfs->tmpfs_npages == 0);
+	spinlock_cleanup(&tmpfs->tmpfs_pagelock);
+	lock_destroy(tmpfs->tmpfs_lock);
+	kfree(tmpfs->tmpfs_name);
+	kfree(tmpfs);
+}
+
+/*
+ * Unmount routine. Since the contents would be lost, only an empty
+ * tmpfs that nothing is using can go. (Like semfs, tmpfs is attached
+ * with vfs_addfs, so at present nothing calls this.)
+ */
+static
+int
+tmpfs_unmount(struct fs *fs)
+{
+	struct tmpfs *tmpfs = fs->fs_data;
+	struct tmpfs_node *root;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	root = tmpfs->tmpfs_root;
+	if (root->tn_nents > 0 || root->tn_vnode != NULL) {
+		lock_release(tmpfs->tmpfs_lock);
+		return EBUSY;
+	}
+	KASSERT(root->tn_linkcount == 1);
+	root->tn_linkcount = 0;
+	tmpfs_node_destroy(root);
+	lock_release(tmpfs->tmpfs_lock);
+
+	tmpfs_destroy(tmpfs);
+	return 0;
+}
+
+/*
+ * Operations table.
+ */
+static const struct fs_ops tmpfs_fsops = {
+	.fsop_sync = tmpfs_sync,
+	.fsop_getvolname = tmpfs_getvolname,
+	.fsop_getroot = tmpfs_getroot,
+	.fsop_unmount = tmpfs_unmount,
+};
+
+/*
+ * Constructor for struct tmpfs. It may hold data in up to a quarter
+ * of physical memory.
+ */
+static
+struct tmpfs *
+tmpfs_create(const char *name)
+{
+	struct tmpfs *tmpfs;
+
+	tmpfs = kmalloc(sizeof(*tmpfs));
+	if (tmpfs == NULL) {
+		goto fail_total;
+	}
+
+	tmpfs->tmpfs_name = kstrdup(name);
+	if (tmpfs->tmpfs_name == NULL) {
+		goto fail_tmpfs;
+	}
+	tmpfs->tmpfs_lock = lock_create("tmpfs");
+	if (tmpfs->tmpfs_lock == NULL) {
+		goto fail_name;
+	}
+	spinlock_init(&tmpfs->tmpfs_pagelock);
+	tmpfs->tmpfs_npages = 0;
+	tmpfs->tmpfs_maxpages = mainbus_ramsize() / PAGE_SIZE / 4;
+	tmpfs->tmpfs_nextino = TMPFS_ROOTINO;
+
+	tmpfs->tmpfs_root = tmpfs_node_create(tmpfs, S_IFDIR);
+	if (tmpfs->tmpfs_root == NULL) {
+		goto fail_lock;
+	}
+	/* the root is its own name; it never goes away */
+	tmpfs->tmpfs_root->tn_linkcount = 1;
+
+	tmpfs->tmpfs_absfs.fs_data = tmpfs;
+	tmpfs->tmpfs_absfs.fs_ops = &tmpfs_fsops;
+	return tmpfs;
+
+ fail_lock:
+	spinlock_cleanup(&tmpfs->tmpfs_pagelock);
+	lock_destroy(tmpfs->tmpfs_lock);
+ fail_name:
+	kfree(tmpfs->tmpfs_name);
+ fail_tmpfs:
+	kfree(tmpfs);
+ fail_total:
+	return NULL;
+}
+
+/*
+ * Make a new, empty tmpfs and attach it as NAME:, as for
+ * "mount tmpfs tmp" from the menu. There is no device behind it.
+ */
+int
+tmpfs_mount(const char *name)
+{
+	struct tmpfs *tmpfs;
+	int result;
+
+	tmpfs = tmpfs_create(name);
+	if (tmpfs == NULL) {
+		return ENOMEM;
+	}
+
+	result = vfs_addfs(name, &tmpfs->tmpfs_absfs);
+	if (result) {
+		tmpfs->tmpfs_root->tn_linkcount = 0;
+		tmpfs_node_destroy(tmpfs->tmpfs_root);
+		tmpfs_destroy(tmpfs);
+		return result;
+	}
+
+	kprintf("tmpfs: Mounted %s:\n", name);
+	return 0;
+}
+
+/*
+ * Create the tmpfs for shared memory, attached as "shm:" during
+ * bootup. Named shared-memory objects are files in it, and mmap makes
+ * shared anonymous memory from nameless ones.
+ */
+void
+tmpfs_bootstrap(void)
+{
+	struct tmpfs *tmpfs;
+	int result;
+
+	tmpfs = tmpfs_create("shm");
+	if (tmpfs == NULL) {
+		panic("Out of memory creating shm tmpfs\n");
+	}
+	result = vfs_addfs("shm", &tmpfs->tmpfs_absfs);
+	if (result) {
+		panic("Attaching shm tmpfs: %s\n", strerror(result));
+	}
+}
@@ -0,0 +1,350 @@
+/*
+ * tmpfs nodes: their data pages and their directory entries.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vm.h>
+
+#include "tmpfs.h"
+
+////////////////////////////////////////////////////////////
+// tmpfs_node
+
+/*
+ * Constructor for tmpfs_node. The caller holds tmpfs_lock, or is
+ * setting up the fs and has the only reference to it.
+ */
+struct tmpfs_node *
+tmpfs_node_create(struct tmpfs *tmpfs, mode_t type)
+{
+	struct tmpfs_node *tn;
+	unsigned i;
+
+	KASSERT(type == S_IFREG || type == S_IFDIR);
+
+	tn = kmalloc(sizeof(*tn));
+	if (tn == NULL) {
+		return NULL;
+	}
+	tn->tn_lock = lock_create("tmpfs_node");
+	if (tn->tn_lock == NULL) {
+		kfree(tn);
+		return NULL;
+	}
+
+	tn->tn_tmpfs = tmpfs;
+	tn->tn_type = type;
+	tn->tn_ino = tmpfs->tmpfs_nextino++;
+	tn->tn_linkcount = 0;
+	tn->tn_vnode = NULL;
+
+	tn->tn_size = 0;
+	tn->tn_pages = NULL;
+	tn->tn_npages = 0;
+
+	tn->tn_parent = NULL;
+	for (i=0; i<TMPFS_DIRHASH; i++) {
+		tn->tn_hash[i] = NULL;
+	}
+	tn->tn_nents = 0;
+
+	return tn;
+}
+
+/*
+ * Destructor for tmpfs_node. Gives back its pages.
+ */
+void
+tmpfs_node_destroy(struct tmpfs_node *tn)
+{
+	KASSERT(tn->tn_linkcount == 0);
+	KASSERT(tn->tn_vnode == NULL);
+	KASSERT(tn->tn_nents == 0);
+
+	tmpfs_freepages(tn, 0);
+	if (tn->tn_pages != NULL) {
+		kfree(tn->tn_pages);
+	}
+	lock_destroy(tn->tn_lock);
+	kfree(tn);
+}
+
+////////////////////////////////////////////////////////////
+// data pages
+
+/*
+ * Take a page from the fs's allowance and the kernel, zeroed.
+ */
+static
+int
+tmpfs_page_alloc(struct tmpfs *tmpfs, vaddr_t *ret)
+{
+	vaddr_t page;
+
+	spinlock_acquire(&tmpfs->tmpfs_pagelock);
+	if (tmpfs->tmpfs_npages >= tmpfs->tmpfs_maxpages) {
+		spinlock_release(&tmpfs->tmpfs_pagelock);
+		return ENOSPC;
+	}
+	tmpfs->tmpfs_npages++;
+	spinlock_release(&tmpfs->tmpfs_pagelock);
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		spinlock_acquire(&tmpfs->tmpfs_pagelock);
+		tmpfs->tmpfs_npages--;
+		spinlock_release(&tmpfs->tmpfs_pagelock);
+		return ENOSPC;
+	}
+	page_zero(page);
+
+	*ret = page;
+	return 0;
+}
+
+/*
+ * Get page PAGENUM of the file TN, which the caller has locked. If
+ * there isn't one, make it if ALLOC is set and otherwise hand back 0,
+ * meaning a hole.
+ */
+int
+tmpfs_getpage(struct tmpfs_node *tn, unsigned pagenum, bool alloc,
+	      vaddr_t *ret)
+{
+	vaddr_t *newpages;
+	unsigned newnum, i;
+	int result;
+
+	KASSERT(lock_do_i_hold(tn->tn_lock));
+
+	if (pagenum >= tn->tn_npages) {
+		if (!alloc) {
+			*ret = 0;
+			return 0;
+		}
+
+		/* Grow the page array, at least doubling it. */
+		newnum = tn->tn_npages * 2;
+		if (newnum <= pagenum) {
+			newnum = pagenum + 1;
+		}
+		newpages = kmalloc(newnum * sizeof(vaddr_t));
+		if (newpages == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<tn->tn_npages; i++) {
+			newpages[i] = tn->tn_pages[i];
+		}
+		for (; i<newnum; i++) {
+			newpages[i] = 0;
+		}
+		if (tn->tn_pages != NULL) {
+			kfree(tn->tn_pages);
+		}
+		tn->tn_pages = newpages;
+		tn->tn_npages = newnum;
+	}
+
+	if (tn->tn_pages[pagenum] == 0 && alloc) {
+		result = tmpfs_page_alloc(tn->tn_tmpfs,
+					  &tn->tn_pages[pagenum]);
+		if (result) {
+			return result;
+		}
+	}
+
+	*ret = tn->tn_pages[pagenum];
+	return 0;
+}
+
+/*
+ * Throw away the data of the file TN past LEN bytes: the pages wholly
+ * past it are freed, and the rest of the page LEN ends in is zeroed
+ * so it reads back as zeros if the file grows again. The caller has
+ * the file locked, or the only reference to it.
+ */
+void
+tmpfs_freepages(struct tmpfs_node *tn, off_t len)
+{
+	struct tmpfs *tmpfs = tn->tn_tmpfs;
+	unsigned first, i, freed;
+	size_t tail;
+
+	first = DIVROUNDUP(len, PAGE_SIZE);
+	tail = len % PAGE_SIZE;
+	if (tail > 0 && first - 1 < tn->tn_npages &&
+	    tn->tn_pages[first - 1] != 0) {
+		bzero((char *)tn->tn_pages[first - 1] + tail,
+		      PAGE_SIZE - tail);
+	}
+
+	freed = 0;
+	for (i=first; i<tn->tn_npages; i++) {
+		if (tn->tn_pages[i] != 0) {
+			free_kpages(tn->tn_pages[i]);
+			tn->tn_pages[i] = 0;
+			freed++;
+		}
+	}
+
+	if (freed > 0) {
+		spinlock_acquire(&tmpfs->tmpfs_pagelock);
+		KASSERT(tmpfs->tmpfs_npages >= freed);
+		tmpfs->tmpfs_npages -= freed;
+		spinlock_release(&tmpfs->tmpfs_pagelock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// directories
+
+/*
+ * Hash a name to its chain (FNV-1a, as for SFS hashed directories).
+ */
+static
+unsigned
+tmpfs_dirhash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash = (hash ^ (unsigned char)*name) * 16777619U;
+		name++;
+	}
+	return hash % TMPFS_DIRHASH;
+}
+
+/*
+ * Look for NAME in DIR. The caller holds tmpfs_lock.
+ */
+struct tmpfs_dirent *
+tmpfs_dir_find(struct tmpfs_node *dir, const char *name)
+{
+	struct tmpfs_dirent *td;
+
+	KASSERT(dir->tn_type == S_IFDIR);
+
+	for (td = dir->tn_hash[tmpfs_dirhash(name)]; td != NULL;
+	     td = td->td_next) {
+		if (!strcmp(td->td_name, name)) {
+			return td;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add NAME for NODE to DIR, which doesn't have it already, and count
+ * the link. The caller holds tmpfs_lock.
+ *
+ * New entries go at the end of their chain so as not to move the
+ * ones before them out from under getdirentry.
+ */
+int
+tmpfs_dir_add(struct tmpfs_node *dir, const char *name,
+	      struct tmpfs_node *node)
+{
+	struct tmpfs_dirent *td, **tdp;
+
+	KASSERT(dir->tn_type == S_IFDIR);
+
+	td = kmalloc(sizeof(*td));
+	if (td == NULL) {
+		return ENOMEM;
+	}
+	td->td_name = kstrdup(name);
+	if (td->td_name == NULL) {
+		kfree(td);
+		return ENOMEM;
+	}
+	td->td_node = node;
+	td->td_next = NULL;
+
+	for (tdp = &dir->tn_hash[tmpfs_dirhash(name)]; *tdp != NULL;
+	     tdp = &(*tdp)->td_next) {
+		/* nothing */
+	}
+	*tdp = td;
+
+	dir->tn_nents++;
+	node->tn_linkcount++;
+	return 0;
+}
+
+/*
+ * Take the entry TD out of DIR and drop its link. The node it named
+ * is the caller's problem. The caller holds tmpfs_lock.
+ */
+void
+tmpfs_dir_remove(struct tmpfs_node *dir, struct tmpfs_dirent *td)
+{
+	struct tmpfs_dirent **tdp;
+
+	for (tdp = &dir->tn_hash[tmpfs_dirhash(td->td_name)]; *tdp != td;
+	     tdp = &(*tdp)->td_next) {
+		KASSERT(*tdp != NULL);
+	}
+	*tdp = td->td_next;
+
+	KASSERT(dir->tn_nents > 0);
+	dir->tn_nents--;
+	KASSERT(td->td_node->tn_linkcount > 0);
+	td->td_node->tn_linkcount--;
+
+	kfree(td->td_name);
+	kfree(td);
+}
+
+/*
+ * Find the first entry of DIR at or after position *SLOT, updating
+ * *SLOT to where it was found. A position is the chain number in the
+ * upper 32 bits and the place on the chain in the lower. Returns NULL
+ * past the end. The caller holds tmpfs_lock.
+ */
+struct tmpfs_dirent *
+tmpfs_dir_byslot(struct tmpfs_node *dir, off_t *slot)
+{
+	struct tmpfs_dirent *td;
+	unsigned chain, place, i;
+
+	KASSERT(*slot >= 0);
+	chain = *slot >> 32;
+	place = *slot & 0xffffffff;
+
+	for (; chain < TMPFS_DIRHASH; chain++, place = 0) {
+		td = dir->tn_hash[chain];
+		for (i=0; td != NULL && i < place; i++) {
+			td = td->td_next;
+		}
+		if (td != NULL) {
+			*slot = ((off_t)chain << 32) | place;
+			return td;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the entry in DIR for NODE, for working out pathnames. The
+ * caller holds tmpfs_lock.
+ */
+struct tmpfs_dirent *
+tmpfs_dir_bynode(struct tmpfs_node *dir, struct tmpfs_node *node)
+{
+	struct tmpfs_dirent *td;
+	unsigned i;
+
+	for (i=0; i<TMPFS_DIRHASH; i++) {
+		for (td = dir->tn_hash[i]; td != NULL; td = td->td_next) {
+			if (td->td_node == node) {
+				return td;
+			}
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,964 @@
+/*
+ * tmpfs vnode operations.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <limits.h>
+#include <stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <vm.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#include "tmpfs.h"
+
+/* Largest file we keep; as for SFS, sizes must fit in 32 bits. */
+#define TMPFS_MAXSIZE	((off_t)0xffffffff)
+
+static const struct vnode_ops tmpfs_fileops;
+static const struct vnode_ops tmpfs_dirops;
+
+/*
+ * Get the node behind a vnode.
+ */
+static
+struct tmpfs_node *
+tmpfs_vnnode(struct vnode *vn)
+{
+	struct tmpfs_vnode *tv = vn->vn_data;
+
+	return tv->tv_node;
+}
+
+////////////////////////////////////////////////////////////
+// basic ops
+
+static
+int
+tmpfs_eachopen(struct vnode *vn, int openflags)
+{
+	struct tmpfs_node *tn = tmpfs_vnnode(vn);
+
+	if (tn->tn_type == S_IFDIR) {
+		if ((openflags & O_ACCMODE) != O_RDONLY) {
+			return EISDIR;
+		}
+		if (openflags & O_APPEND) {
+			return EISDIR;
+		}
+	}
+
+	return 0;
+}
+
+static
+int
+tmpfs_ioctl(struct vnode *vn, int op, userptr_t data)
+{
+	(void)vn;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+tmpfs_stat(struct vnode *vn, struct stat *buf)
+{
+	struct tmpfs_node *tn = tmpfs_vnnode(vn);
+	struct tmpfs *tmpfs = tn->tn_tmpfs;
+	unsigned i;
+
+	bzero(buf, sizeof(*buf));
+
+	if (tn->tn_type == S_IFDIR) {
+		lock_acquire(tmpfs->tmpfs_lock);
+		buf->st_size = tn->tn_nents;
+		buf->st_nlink = tn->tn_linkcount;
+		lock_release(tmpfs->tmpfs_lock);
+		buf->st_mode = S_IFDIR | 0777;
+	}
+	else {
+		lock_acquire(tmpfs->tmpfs_lock);
+		buf->st_nlink = tn->tn_linkcount;
+		lock_release(tmpfs->tmpfs_lock);
+
+		lock_acquire(tn->tn_lock);
+		buf->st_size = tn->tn_size;
+		for (i=0; i<tn->tn_npages; i++) {
+			if (tn->tn_pages[i] != 0) {
+				buf->st_blocks += PAGE_SIZE / 512;
+			}
+		}
+		lock_release(tn->tn_lock);
+		buf->st_mode = S_IFREG | 0666;
+	}
+
+	buf->st_ino = tn->tn_ino;
+	buf->st_blksize = PAGE_SIZE;
+
+	return 0;
+}
+
+static
+int
+tmpfs_gettype(struct vnode *vn, mode_t *ret)
+{
+	struct tmpfs_node *tn = tmpfs_vnnode(vn);
+
+	*ret = tn->tn_type;
+	return 0;
+}
+
+static
+bool
+tmpfs_isseekable(struct vnode *vn)
+{
+	(void)vn;
+	return true;
+}
+
+/*
+ * Nothing is ever written anywhere, so there's nothing to sync.
+ */
+static
+int
+tmpfs_fsync(struct vnode *vn)
+{
+	(void)vn;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// file ops
+
+/*
+ * Read. Holes read as zeros without taking pages for them.
+ */
+static
+int
+tmpfs_read(struct vnode *vn, struct uio *uio)
+{
+	struct tmpfs_node *tn = tmpfs_vnnode(vn);
+	vaddr_t page;
+	size_t pageoff, len;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	lock_acquire(tn->tn_lock);
+	while (uio->uio_resid > 0 && uio->uio_offset < tn->tn_size) {
+		pageoff = uio->uio_offset % PAGE_SIZE;
+		len = PAGE_SIZE - pageoff;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		if ((off_t)len > tn->tn_size - uio->uio_offset) {
+			len = tn->tn_size - uio->uio_offset;
+		}
+
+		result = tmpfs_getpage(tn, uio->uio_offset / PAGE_SIZE, false,
+				       &page);
+		if (result) {
+			break;
+		}
+		if (page == 0) {
+			result = uiomovezeros(len, uio);
+		}
+		else {
+			result = uiomove((char *)page + pageoff, len, uio);
+		}
+		if (result) {
+			break;
+		}
+	}
+	lock_release(tn->tn_lock);
+
+	return result;
+}
+
+/*
+ * Write. Pages are made as they're first written to.
+ */
+static
+int
+tmpfs_write(struct vnode *vn, struct uio *uio)
+{
+	struct tmpfs_node *tn = tmpfs_vnnode(vn);
+	vaddr_t page;
+	size_t pageoff, len;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+
+	if (uio->uio_offset + uio->uio_resid > TMPFS_MAXSIZE) {
+		return EFBIG;
+	}
+
+	lock_acquire(tn->tn_lock);
+	while (uio->uio_resid > 0) {
+		pageoff = uio->uio_offset % PAGE_SIZE;
+		len = PAGE_SIZE - pageoff;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		result = tmpfs_getpage(tn, uio->uio_offset / PAGE_SIZE, true,
+				       &page);
+		if (result) {
+			break;
+		}
+		result = uiomove((char *)page + pageoff, len, uio);
+		if (uio->uio_offset > tn->tn_size) {
+			tn->tn_size = uio->uio_offset;
+		}
+		if (result) {
+			break;
+		}
+	}
+	lock_release(tn->tn_lock);
+
+	return result;
+}
+
+/*
+ * Mapping goes through VOP_READ and VOP_WRITE like any other file.
+ */
+static
+int
+tmpfs_mmap(struct vnode *vn)
+{
+	(void)vn;
+	return 0;
+}
+
+/*
+ * Truncate: shrinking gives back the pages past the new end; growing
+ * just leaves a hole.
+ */
+static
+int
+tmpfs_truncate(struct vnode *vn, off_t len)
+{
+	struct tmpfs_node *tn = tmpfs_vnnode(vn);
+
+	if (len < 0) {
+		return EINVAL;
+	}
+	if (len > TMPFS_MAXSIZE) {
+		return EFBIG;
+	}
+
+	lock_acquire(tn->tn_lock);
+	if (len < tn->tn_size) {
+		tmpfs_freepages(tn, len);
+	}
+	tn->tn_size = len;
+	lock_release(tn->tn_lock);
+
+	return 0;
+}
+
+/*
+ * Fallocate: make the pages for the range now, so later writes to it
+ * can't run out of space.
+ */
+static
+int
+tmpfs_fallocate(struct vnode *vn, off_t pos, off_t len)
+{
+	struct tmpfs_node *tn = tmpfs_vnnode(vn);
+	vaddr_t page;
+	off_t end;
+	unsigned i;
+	int result = 0;
+
+	if (pos < 0 || len <= 0) {
+		return EINVAL;
+	}
+	end = pos + len;
+	if (end > TMPFS_MAXSIZE) {
+		return EFBIG;
+	}
+
+	lock_acquire(tn->tn_lock);
+	for (i = pos / PAGE_SIZE; i < DIVROUNDUP(end, PAGE_SIZE); i++) {
+		result = tmpfs_getpage(tn, i, true, &page);
+		if (result) {
+			break;
+		}
+	}
+	if (result == 0 && end > tn->tn_size) {
+		tn->tn_size = end;
+	}
+	lock_release(tn->tn_lock);
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// directory ops
+
+/*
+ * Directory read: one name per call. The seek position is the
+ * position of the next entry, as tmpfs_dir_byslot counts them.
+ */
+static
+int
+tmpfs_getdirentry(struct vnode *dirvn, struct uio *uio)
+{
+	struct tmpfs_node *dir = tmpfs_vnnode(dirvn);
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_dirent *td;
+	off_t slot;
+	int result;
+
+	if (uio->uio_offset < 0) {
+		return EINVAL;
+	}
+	slot = uio->uio_offset;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	td = tmpfs_dir_byslot(dir, &slot);
+	if (td == NULL) {
+		/* EOF */
+		result = 0;
+	}
+	else {
+		result = uiomove(td->td_name, strlen(td->td_name), uio);
+		if (result == 0) {
+			uio->uio_offset = slot + 1;
+		}
+	}
+	lock_release(tmpfs->tmpfs_lock);
+
+	return result;
+}
+
+/*
+ * Backend for getcwd: the names from the root down to DIRVN, found
+ * by climbing the parent pointers. The root is the empty string.
+ */
+static
+int
+tmpfs_namefile(struct vnode *dirvn, struct uio *uio)
+{
+	struct tmpfs_node *dir = tmpfs_vnnode(dirvn);
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_node *tn;
+	struct tmpfs_dirent *td;
+	char *buf;
+	size_t pos, len;
+	int result = 0;
+
+	buf = kmalloc(PATH_MAX);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	pos = PATH_MAX;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	for (tn = dir; tn != tmpfs->tmpfs_root; tn = tn->tn_parent) {
+		if (tn->tn_parent == NULL) {
+			/* removed */
+			result = ENOENT;
+			break;
+		}
+		td = tmpfs_dir_bynode(tn->tn_parent, tn);
+		KASSERT(td != NULL);
+		len = strlen(td->td_name);
+		if (len + 1 > pos) {
+			result = ENAMETOOLONG;
+			break;
+		}
+		pos -= len;
+		memcpy(buf + pos, td->td_name, len);
+		if (tn->tn_parent != tmpfs->tmpfs_root) {
+			buf[--pos] = '/';
+		}
+	}
+	lock_release(tmpfs->tmpfs_lock);
+
+	if (result == 0) {
+		result = uiomove(buf + pos, PATH_MAX - pos, uio);
+	}
+	kfree(buf);
+	return result;
+}
+
+/*
+ * Common code for creat and mkdir: make a node of type TYPE called
+ * NAME in DIR. If the name exists already, hand back the existing
+ * vnode unless EXCL is set, as for creat. The caller holds
+ * tmpfs_lock.
+ */
+static
+int
+tmpfs_makenode(struct tmpfs_node *dir, const char *name, mode_t type,
+	       bool excl, struct vnode **ret)
+{
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_dirent *td;
+	struct tmpfs_node *tn;
+	int result;
+
+	KASSERT(lock_do_i_hold(tmpfs->tmpfs_lock));
+
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return EEXIST;
+	}
+	if (dir->tn_linkcount == 0) {
+		/* the dir has been removed */
+		return ENOENT;
+	}
+
+	td = tmpfs_dir_find(dir, name);
+	if (td != NULL) {
+		if (excl) {
+			return EEXIST;
+		}
+		if (td->td_node->tn_type != type) {
+			return EISDIR;
+		}
+		return tmpfs_getvnode(td->td_node, ret);
+	}
+
+	tn = tmpfs_node_create(tmpfs, type);
+	if (tn == NULL) {
+		return ENOMEM;
+	}
+	if (type == S_IFDIR) {
+		tn->tn_parent = dir;
+	}
+
+	result = tmpfs_dir_add(dir, name, tn);
+	if (result) {
+		tmpfs_node_destroy(tn);
+		return result;
+	}
+
+	result = tmpfs_getvnode(tn, ret);
+	if (result) {
+		tmpfs_dir_remove(dir, tmpfs_dir_find(dir, name));
+		tmpfs_node_destroy(tn);
+		return result;
+	}
+
+	return 0;
+}
+
+/*
+ * Create a file.
+ */
+static
+int
+tmpfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
+	    struct vnode **ret)
+{
+	struct tmpfs_node *dir = tmpfs_vnnode(dirvn);
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	int result;
+
+	(void)mode;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	result = tmpfs_makenode(dir, name, S_IFREG, excl, ret);
+	lock_release(tmpfs->tmpfs_lock);
+
+	return result;
+}
+
+/*
+ * Make a directory.
+ */
+static
+int
+tmpfs_mkdir(struct vnode *dirvn, const char *name, mode_t mode)
+{
+	struct tmpfs_node *dir = tmpfs_vnnode(dirvn);
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct vnode *vn;
+	int result;
+
+	(void)mode;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	result = tmpfs_makenode(dir, name, S_IFDIR, true, &vn);
+	lock_release(tmpfs->tmpfs_lock);
+	if (result) {
+		return result;
+	}
+
+	VOP_DECREF(vn);
+	return 0;
+}
+
+/*
+ * Make a hard link to a file.
+ */
+static
+int
+tmpfs_link(struct vnode *dirvn, const char *name, struct vnode *filevn)
+{
+	struct tmpfs_node *dir = tmpfs_vnnode(dirvn);
+	struct tmpfs_node *tn = tmpfs_vnnode(filevn);
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	int result;
+
+	if (tn->tn_type == S_IFDIR) {
+		return EINVAL;
+	}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return EEXIST;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	if (dir->tn_linkcount == 0) {
+		result = ENOENT;
+	}
+	else if (tmpfs_dir_find(dir, name) != NULL) {
+		result = EEXIST;
+	}
+	else {
+		result = tmpfs_dir_add(dir, name, tn);
+	}
+	lock_release(tmpfs->tmpfs_lock);
+
+	return result;
+}
+
+/*
+ * Drop a node that may have just lost its last name: if nothing has
+ * it open either, it's gone. The caller holds tmpfs_lock.
+ */
+static
+void
+tmpfs_unlinked(struct tmpfs_node *tn)
+{
+	if (tn->tn_linkcount == 0 && tn->tn_vnode == NULL) {
+		tmpfs_node_destroy(tn);
+	}
+}
+
+/*
+ * Delete a file. As with other files, it may not actually go away if
+ * it's currently open.
+ */
+static
+int
+tmpfs_remove(struct vnode *dirvn, const char *name)
+{
+	struct tmpfs_node *dir = tmpfs_vnnode(dirvn);
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_dirent *td;
+	struct tmpfs_node *tn;
+	int result = 0;
+
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return EISDIR;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	td = tmpfs_dir_find(dir, name);
+	if (td == NULL) {
+		result = ENOENT;
+	}
+	else if (td->td_node->tn_type == S_IFDIR) {
+		result = EISDIR;
+	}
+	else {
+		tn = td->td_node;
+		tmpfs_dir_remove(dir, td);
+		tmpfs_unlinked(tn);
+	}
+	lock_release(tmpfs->tmpfs_lock);
+
+	return result;
+}
+
+/*
+ * Delete an empty directory.
+ */
+static
+int
+tmpfs_rmdir(struct vnode *dirvn, const char *name)
+{
+	struct tmpfs_node *dir = tmpfs_vnnode(dirvn);
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_dirent *td;
+	struct tmpfs_node *tn;
+	int result = 0;
+
+	if (!strcmp(name, ".")) {
+		return EINVAL;
+	}
+	if (!strcmp(name, "..")) {
+		return ENOTEMPTY;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	td = tmpfs_dir_find(dir, name);
+	if (td == NULL) {
+		result = ENOENT;
+	}
+	else if (td->td_node->tn_type != S_IFDIR) {
+		result = ENOTDIR;
+	}
+	else if (td->td_node->tn_nents > 0) {
+		result = ENOTEMPTY;
+	}
+	else {
+		tn = td->td_node;
+		tmpfs_dir_remove(dir, td);
+		tn->tn_parent = NULL;
+		tmpfs_unlinked(tn);
+	}
+	lock_release(tmpfs->tmpfs_lock);
+
+	return result;
+}
+
+/*
+ * Rename NAME1 in DIR1 to NAME2 in DIR2, replacing whatever NAME2 was.
+ */
+static
+int
+tmpfs_rename(struct vnode *dirvn1, const char *name1,
+	     struct vnode *dirvn2, const char *name2)
+{
+	struct tmpfs_node *dir1 = tmpfs_vnnode(dirvn1);
+	struct tmpfs_node *dir2 = tmpfs_vnnode(dirvn2);
+	struct tmpfs *tmpfs = dir1->tn_tmpfs;
+	struct tmpfs_dirent *td1, *td2;
+	struct tmpfs_node *tn, *old, *up;
+	int result;
+
+	if (!strcmp(name1, ".") || !strcmp(name1, "..") ||
+	    !strcmp(name2, ".") || !strcmp(name2, "..")) {
+		return EINVAL;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+
+	td1 = tmpfs_dir_find(dir1, name1);
+	if (td1 == NULL) {
+		result = ENOENT;
+		goto out;
+	}
+	tn = td1->td_node;
+	if (dir2->tn_linkcount == 0) {
+		result = ENOENT;
+		goto out;
+	}
+
+	td2 = tmpfs_dir_find(dir2, name2);
+	old = td2 != NULL ? td2->td_node : NULL;
+	if (old == tn) {
+		/* same file; nothing to do */
+		result = 0;
+		goto out;
+	}
+
+	if (tn->tn_type == S_IFDIR) {
+		/* can't move a directory under itself */
+		for (up = dir2; up != NULL; up = up->tn_parent) {
+			if (up == tn) {
+				result = EINVAL;
+				goto out;
+			}
+			if (up == tmpfs->tmpfs_root) {
+				break;
+			}
+		}
+		if (old != NULL && old->tn_type != S_IFDIR) {
+			result = ENOTDIR;
+			goto out;
+		}
+		if (old != NULL && old->tn_nents > 0) {
+			result = ENOTEMPTY;
+			goto out;
+		}
+	}
+	else if (old != NULL && old->tn_type == S_IFDIR) {
+		result = EISDIR;
+		goto out;
+	}
+
+	if (old != NULL) {
+		/* Point the existing entry at the file instead. */
+		td2->td_node = tn;
+		tn->tn_linkcount++;
+		old->tn_linkcount--;
+		if (old->tn_type == S_IFDIR) {
+			old->tn_parent = NULL;
+		}
+	}
+	else {
+		result = tmpfs_dir_add(dir2, name2, tn);
+		if (result) {
+			goto out;
+		}
+	}
+	tmpfs_dir_remove(dir1, td1);
+	if (tn->tn_type == S_IFDIR) {
+		tn->tn_parent = dir2;
+	}
+	if (old != NULL) {
+		tmpfs_unlinked(old);
+	}
+
+ out:
+	lock_release(tmpfs->tmpfs_lock);
+	return result;
+}
+
+/*
+ * Walk PATH from DIR a name at a time. If LAST is not NULL, stop
+ * short of the final name and hand it back there. The caller holds
+ * tmpfs_lock, which keeps the nodes passed through from going away,
+ * so this takes no references.
+ */
+static
+int
+tmpfs_walk(struct tmpfs_node *dir, char *path, char **last,
+	   struct tmpfs_node **ret)
+{
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_dirent *td;
+	char *name;
+
+	if (last != NULL) {
+		*last = NULL;
+	}
+
+	while ((name = vfs_nextname(&path)) != NULL) {
+		if (dir->tn_type != S_IFDIR) {
+			return ENOTDIR;
+		}
+		if (last != NULL && *path == 0) {
+			*last = name;
+			break;
+		}
+		if (!strcmp(name, ".")) {
+			continue;
+		}
+		if (!strcmp(name, "..")) {
+			if (dir == tmpfs->tmpfs_root) {
+				continue;
+			}
+			if (dir->tn_parent == NULL) {
+				return ENOENT;
+			}
+			dir = dir->tn_parent;
+			continue;
+		}
+		td = tmpfs_dir_find(dir, name);
+		if (td == NULL) {
+			return ENOENT;
+		}
+		dir = td->td_node;
+	}
+
+	*ret = dir;
+	return 0;
+}
+
+/*
+ * Lookup: get a vnode for a pathname.
+ */
+static
+int
+tmpfs_lookup(struct vnode *dirvn, char *path, struct vnode **ret)
+{
+	struct tmpfs_node *dir = tmpfs_vnnode(dirvn);
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_node *tn;
+	int result;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	result = tmpfs_walk(dir, path, NULL, &tn);
+	if (result == 0) {
+		result = tmpfs_getvnode(tn, ret);
+	}
+	lock_release(tmpfs->tmpfs_lock);
+
+	return result;
+}
+
+/*
+ * Lookparent: get the directory a pathname is in, and the last name.
+ */
+static
+int
+tmpfs_lookparent(struct vnode *dirvn, char *path, struct vnode **ret,
+		 char *buf, size_t buflen)
+{
+	struct tmpfs_node *dir = tmpfs_vnnode(dirvn);
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_node *tn;
+	char *name;
+	int result;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	result = tmpfs_walk(dir, path, &name, &tn);
+	if (result == 0 && name == NULL) {
+		result = EINVAL;
+	}
+	if (result == 0 && strlen(name)+1 > buflen) {
+		result = ENAMETOOLONG;
+	}
+	if (result == 0) {
+		strcpy(buf, name);
+		result = tmpfs_getvnode(tn, ret);
+	}
+	lock_release(tmpfs->tmpfs_lock);
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// vnode lifecycle operations
+
+/*
+ * Reclaim - drop a vnode that's no longer in use. The node goes too
+ * if it has no names left.
+ */
+static
+int
+tmpfs_reclaim(struct vnode *vn)
+{
+	struct tmpfs_vnode *tv = vn->vn_data;
+	struct tmpfs_node *tn = tv->tv_node;
+	struct tmpfs *tmpfs = tn->tn_tmpfs;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+
+	if (vnode_decref_unless_last(vn)) {
+		/* consumed the reference VOP_DECREF passed us */
+		lock_release(tmpfs->tmpfs_lock);
+		return EBUSY;
+	}
+
+	KASSERT(tn->tn_vnode == tv);
+	tn->tn_vnode = NULL;
+	tmpfs_unlinked(tn);
+
+	lock_release(tmpfs->tmpfs_lock);
+
+	vnode_cleanup(&tv->tv_absvn);
+	kfree(tv);
+	return 0;
+}
+
+/*
+ * Vnode ops table for dirs.
+ */
+static const struct vnode_ops tmpfs_dirops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = tmpfs_eachopen,
+	.vop_reclaim = tmpfs_reclaim,
+
+	.vop_read = vopfail_uio_isdir,
+	.vop_readlink = vopfail_uio_isdir,
+	.vop_getdirentry = tmpfs_getdirentry,
+	.vop_write = vopfail_uio_isdir,
+	.vop_ioctl = tmpfs_ioctl,
+	.vop_stat = tmpfs_stat,
+	.vop_gettype = tmpfs_gettype,
+	.vop_isseekable = tmpfs_isseekable,
+	.vop_fsync = tmpfs_fsync,
+	.vop_mmap = vopfail_mmap_isdir,
+	.vop_truncate = vopfail_truncate_isdir,
+	.vop_fallocate = vopfail_fallocate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
+	.vop_namefile = tmpfs_namefile,
+	.vop_poll = vopnull_poll,
+
+	.vop_creat = tmpfs_creat,
+	.vop_symlink = vopfail_symlink_nosys,
+	.vop_mkdir = tmpfs_mkdir,
+	.vop_link = tmpfs_link,
+	.vop_remove = tmpfs_remove,
+	.vop_rmdir = tmpfs_rmdir,
+	.vop_rename = tmpfs_rename,
+	.vop_lookup = tmpfs_lookup,
+	.vop_lookparent = tmpfs_lookparent,
+};
+
+/*
+ * Vnode ops table for files.
+ */
+static const struct vnode_ops tmpfs_fileops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = tmpfs_eachopen,
+	.vop_reclaim = tmpfs_reclaim,
+
+	.vop_read = tmpfs_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = tmpfs_write,
+	.vop_ioctl = tmpfs_ioctl,
+	.vop_stat = tmpfs_stat,
+	.vop_gettype = tmpfs_gettype,
+	.vop_isseekable = tmpfs_isseekable,
+	.vop_fsync = tmpfs_fsync,
+	.vop_mmap = tmpfs_mmap,
+	.vop_truncate = tmpfs_truncate,
+	.vop_fallocate = tmpfs_fallocate,
+	.vop_seekhole = vopnull_seekhole,
+	.vop_namefile = vopfail_uio_notdir,
+	.vop_poll = vopnull_poll,
+
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
+
+/*
+ * Get the vnode for a node, making it if it doesn't have one. The
+ * caller holds tmpfs_lock.
+ */
+int
+tmpfs_getvnode(struct tmpfs_node *tn, struct vnode **ret)
+{
+	struct tmpfs *tmpfs = tn->tn_tmpfs;
+	struct tmpfs_vnode *tv;
+	int result;
+
+	KASSERT(lock_do_i_hold(tmpfs->tmpfs_lock));
+
+	if (tn->tn_vnode != NULL) {
+		VOP_INCREF(&tn->tn_vnode->tv_absvn);
+		*ret = &tn->tn_vnode->tv_absvn;
+		return 0;
+	}
+
+	tv = kmalloc(sizeof(*tv));
+	if (tv == NULL) {
+		return ENOMEM;
+	}
+	tv->tv_node = tn;
+
+	result = vnode_init(&tv->tv_absvn,
+			    tn->tn_type == S_IFDIR ?
+			    &tmpfs_dirops : &tmpfs_fileops,
+			    &tmpfs->tmpfs_absfs, tv);
+	/* vnode_init doesn't actually fail */
+	KASSERT(result == 0);
+
+	tn->tn_vnode = tv;
+	*ret = &tv->tv_absvn;
+	return 0;
+}
@@ -36,8 +36,10 @@
 
 #include <vm.h>
 #include "opt-dumbvm.h"
+#include "opt-hashpt.h"
 
 struct vnode;
+struct rwlock;
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -53,7 +55,16 @@ struct vnode;
 #define L1_INDEX(x) ((x) >> (L2_BITS + OFFSET_BITS))
 #define L2_INDEX(x) (((x) >> OFFSET_BITS) & ((1 << L2_BITS) - 1))
 
-#define YANG_VM_STACKPAGES 18
+/*
+ * The main stack starts out YANG_VM_STACKPAGES long, enough for the
+ * arguments exec copies out (see runprogram.c), and grows down as it
+ * is faulted on, up to YANG_VM_STACKMAXPAGES. Address space for the
+ * whole of that, plus an unmapped guard page below, is kept clear of
+ * mmap, thread stacks and the heap; see as_grow_stack.
+ */
+#define YANG_VM_STACKPAGES 8
+#define YANG_VM_STACKMAXPAGES 1024
+#define YANG_VM_THREAD_STACKPAGES 16 // each thread after the first, see as_define_thread_stack
 
 struct region {
     vaddr_t vbase;
@@ -62,26 +73,134 @@ struct region {
     unsigned int readable : 1;
     unsigned int writeable : 1;
     unsigned int executable : 1;
-    struct region *next;
+    unsigned int mmapped : 1;   // made by as_mmap, may be unmapped
+    unsigned int threadstack : 1; // made by as_define_thread_stack
+    unsigned int growsdown : 1; // the main stack, see as_grow_stack
+    unsigned int advice : 2;    // MADV_NORMAL, _RANDOM or _SEQUENTIAL, see as_madvise
+    unsigned int continued : 1; // split off the top of the region below by as_mprotect
+    unsigned int maywrite : 1;  // as_mprotect may make it writeable
+    struct vnode *vn;           // file mapped shared, or NULL for anonymous memory
+    off_t file_offset;          // offset in vn of vbase
+    /*
+     * An ELF segment is read in a page at a time on first touch: the
+     * ELF_FILESIZE bytes at ELF_OFFSET in ELF_VN belong at ELF_VADDR
+     * (the segment start, not necessarily page aligned) and the rest
+     * of the region is zero-filled. ELF_VN is NULL for other regions.
+     */
+    struct vnode *elf_vn;
+    off_t elf_offset;
+    vaddr_t elf_vaddr;
+    size_t elf_filesize;
 };
 
 // How many pages are we going to have for one page table?
 
+/*
+ * A page table entry is a single word in TLBLO format: the physical
+ * frame plus the TLBLO_DIRTY and TLBLO_VALID bits (see <machine/tlb.h>).
+ * An entry with the valid bit clear maps nothing (but see PTE_SWAPPED).
+ */
 typedef struct page_table_entry {
     paddr_t frame;
 } PTE; // total 32 bits
 
+#define PTE_VALID(pte) (((pte)->frame & TLBLO_VALID) != 0)
+
+/*
+ * A page that has been paged out has the valid bit clear, PTE_SWAPPED
+ * set (a bit TLBLO leaves unused), and its swap slot in the frame bits.
+ */
+#define PTE_SWAPPED 0x1
+#define PTE_IS_SWAPPED(pte) (((pte)->frame & PTE_SWAPPED) != 0)
+#define PTE_SWAP_SLOT(pte) ((pte)->frame >> OFFSET_BITS)
+#define PTE_MAKE_SWAPPED(slot) (((paddr_t)(slot) << OFFSET_BITS) | PTE_SWAPPED)
+
+/*
+ * PTE_REFERENCED is set whenever vm_fault loads the page into the TLB
+ * and cleared by the clock hand; the assembly refill handler only loads
+ * pages that already have it set. The low byte of a PTE is software bits that never go in the TLB.
+ */
+#define PTE_REFERENCED 0x2
+#define PTE_SOFTBITS 0xff
+
+/*
+ * PTE_LOCKED marks a page pinned by mlock: it stays resident and is
+ * never chosen for page-out. It goes with the entry, not the frame, so
+ * it survives copy-on-write and merging; fork doesn't pass it on.
+ */
+#define PTE_LOCKED 0x4
+
+#if OPT_HASHPT
+
+/*
+ * With "options hashpt", page table entries instead live in one hash
+ * table for the whole system, keyed by (page table, page) and with as
+ * many buckets as there are physical frames, so that memory spent on
+ * page tables goes with the number of pages mapped rather than with
+ * how spread out they are. A PageTable is then just the list of its
+ * own entries, to walk on fork and exit. Entries stay put once made,
+ * so PTE pointers work as with the two-level table, and are only freed
+ * with the page table. mips_utlb_refill can't walk this, so every TLB
+ * miss goes to vm_fault.
+ */
+struct hashpt_entry;
+
+typedef struct page_table {
+    struct hashpt_entry *entries; // all of this table's, linked through pt_next
+    unsigned nentries;
+} PageTable;
+
+#else
+
 typedef struct l2_page_table {
-    PTE *entries[1 << L2_BITS];
+    PTE entries[1 << L2_BITS];
 } L2Table;
-// A second-level page table has 1 << 9 = 512 entries
+// A second-level page table has 1 << 9 = 512 entries, stored inline
 // Each entry is 4 bytes, so 512 * 4 = 2KB
 
+/*
+ * The first level is kept compact. Text, data, heap and stack each tend
+ * to live in their own 4MB span (one L1 index), so a page table starts
+ * with a handful of inline (L1 index, L2 table) slots and only grows a
+ * full 2048-entry directory (8KB) once a process touches more spans
+ * than that. Use the page_table_*_l2 functions rather than poking at
+ * the representation directly.
+ */
+#define PT_INLINE_SLOTS 6
+
+/*
+ * What's in each L2 table, so the walks on fork and exit and the RSS
+ * count look only at entries that may be in use: how many entries are
+ * nonzero, and which groups of 32 entries may hold any. Group bits are
+ * set as entries fill but only cleared lazily, by a walk that finds
+ * the group empty (or when LIVE drops to 0). Kept beside the L2 table
+ * rather than in it, since an L2Table is exactly the 2KB kmalloc size
+ * class and a page is the next one up. Kept up to date by
+ * page_table_set_pte.
+ */
+#define L2_GROUP_BITS 5
+#define L2_GROUP_SIZE (1 << L2_GROUP_BITS)
+
+struct l2_occupancy {
+    uint16_t live;   // entries not 0
+    uint16_t groups; // bit G: entries [G * L2_GROUP_SIZE, (G + 1) * L2_GROUP_SIZE) may be in use
+};
+
+#define L2_GROUP_MAYBE_LIVE(occ, j) ((((occ)->groups >> ((j) >> L2_GROUP_BITS)) & 1) != 0)
+
 typedef struct page_table {
-    L2Table *tables[1 << L1_BITS]; // Pointers to second-level page tables
+    unsigned nslots; // inline slots in use (unused once directory exists)
+    struct {
+        unsigned l1_index;
+        L2Table *table;
+    } slots[PT_INLINE_SLOTS];
+    L2Table **directory; // full L1 table, NULL until the slots run out
+    // (mips_utlb_refill knows the offsets of the fields above)
+    struct l2_occupancy occupancy[PT_INLINE_SLOTS]; // of each inline slot's table
+    struct l2_occupancy *dir_occupancy; // indexed like directory, allocated with it
 } PageTable;
-// A first level page table has 1 << 11 = 2048 entries
-// Each entry is 4 bytes, so 2048 * 4 = 8KB
+
+#endif /* OPT_HASHPT */
 
 struct addrspace {
 #if OPT_DUMBVM
@@ -92,10 +211,31 @@ struct addrspace {
     paddr_t as_pbase2;
     size_t as_npages2;
     paddr_t as_stackpbase;
+    vaddr_t as_kinfo;
 #else
-    struct region *regions;
-    bool force_readwrite;
+    /*
+     * Held for reading by vm_fault and for writing by whatever changes
+     * the regions once the address space is in use, since threads of
+     * the same process share it.
+     */
+    struct rwlock *regions_lock;
+    struct region *regions;      // sorted by vbase, non-overlapping
+    unsigned nregions;
+    unsigned regions_max;        // allocated length of regions
+    struct region *last_region;  // last hit in as_region_lookup, or NULL
+    vaddr_t heap_start;          // base of the heap region (page aligned)
+    vaddr_t heap_end;            // current break
     PageTable *page_table;
+    unsigned asid;            // TLB tag, see vm_tlb_activate
+    unsigned asid_generation; // generation asid belongs to, 0 for none
+    uint32_t tlb_cpus;        // CPUs that have run with this asid, see vm.c
+    vaddr_t fault_next;       // where a sequential run of faults would fault next
+    unsigned rss_estimate;    // at least the resident pages, if RLIMIT_RSS is set; see vm.c
+    unsigned ws_window;       // sampling window ws_count is for, see vm.c
+    unsigned ws_count;        // pages seen referenced so far in it
+    unsigned ws_pages;        // pages referenced in the window before
+    unsigned ws_active;       // last window any page was referenced in
+    vaddr_t kinfo;            // kernel page mapped at KINFO_VADDR, see <kinfo.h>
 #endif
 };
 
@@ -123,15 +263,89 @@ struct addrspace {
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_reset  - empty an address space in place for exec to reuse,
+ *                keeping its allocations.
+ *
+ *    as_destroy_async - as_destroy, but later, in a work queue thread,
+ *                so that an exiting process needn't wait for it. If
+ *                it can't be queued it's done at once.
+ *
+ *    as_reap_wait - if any address spaces are waiting to be destroyed,
+ *                wait until they have been (and their memory is free)
+ *                and return true; otherwise return false. For callers
+ *                that are out of memory, to see whether to retry.
+ *                Must not hold the VM lock or any regions lock.
+ *
+ *    as_reap_bootstrap - set up for as_reap_wait. Until then
+ *                as_destroy_async destroys at once.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_backing - arrange for the region at VADDR to be filled in
+ *                from FILESIZE bytes of VN at OFFSET, as it is touched.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
+ *    as_region_lookup - return the region containing VADDR, or NULL.
+ *
+ *    as_sbrk   - move the break by AMOUNT, returning the old break. The
+ *                heap region is set up by as_complete_load, just past
+ *                the last ELF segment.
+ *
+ *    as_mmap   - map LENGTH bytes of VN from OFFSET (or zero-fill memory
+ *                if VN is NULL) somewhere between the heap and the stack,
+ *                returning the address chosen. File mappings are shared
+ *                through the page cache; see <pagecache.h>.
+ *
+ *    as_munmap - remove the mapping made by as_mmap at ADDR.
+ *
+ *    as_define_thread_stack - set up a stack region for another thread
+ *                of the process, the way as_mmap finds space, with an
+ *                unmapped guard page below it. Hands back its initial
+ *                stack pointer.
+ *
+ *    as_destroy_thread_stack - remove the stack region made by
+ *                as_define_thread_stack whose initial stack pointer
+ *                was STACKPTR.
+ *
+ *    as_grow_stack - if VADDR is in the space below the main stack
+ *                that it may grow into, move the bottom of the stack
+ *                down to take it in. Fails with EFAULT if it isn't.
+ *                Called by vm_fault on finding no region at VADDR.
+ *
+ *    as_madvise - act on ADVICE (see <kern/mman.h>) for the pages in
+ *                [START, END), both page aligned. Fails with ENOMEM
+ *                unless regions cover the whole range.
+ *
+ *    as_mincore - set VEC[i] to 1 if page START + i * PAGE_SIZE is
+ *                resident, 0 if not, for NPAGES pages. Fails as
+ *                as_madvise does.
+ *
+ *    as_mlock - with LOCK, bring in the pages in [START, END) and pin
+ *                them (see PTE_LOCKED); otherwise unpin them. Fails as
+ *                as_madvise does, or if the pages can't be brought in,
+ *                in which case those pinned so far stay pinned.
+ *
+ *    as_mprotect - give the pages in [START, END), both page aligned,
+ *                new permissions, splitting regions as need be. Fails
+ *                with ENOMEM unless regions cover the whole range, and
+ *                with EACCES for a change the region can't take (see
+ *                region_may_protect).
+ *
+ *    as_setkinfo - fill in the kernel information page (see
+ *                <kinfo.h>) for the process PID, with parent PPID,
+ *                that is to run in AS.
+ *
+ * as_copy, as_sbrk, as_mmap, as_munmap, as_grow_stack, the thread
+ * stack functions and the madvise family take the regions lock
+ * themselves; the functions that set up a new address space for
+ * loading don't, as nothing else can see it yet.
+ *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
@@ -145,23 +359,211 @@ int as_copy(struct addrspace *src, struct addrspace **ret);
 void as_activate(void);
 void as_deactivate(void);
 void as_destroy(struct addrspace *);
+void as_reset(struct addrspace *as);
+void as_destroy_async(struct addrspace *as);
+bool as_reap_wait(void);
+void as_reap_bootstrap(void);
 
 int as_define_region(struct addrspace *as,
                      vaddr_t vaddr, size_t sz,
                      int readable,
                      int writeable,
                      int executable);
+int as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                      struct vnode *vn, off_t offset, size_t filesize);
 int as_prepare_load(struct addrspace *as);
 int as_complete_load(struct addrspace *as);
 int as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+struct region *as_region_lookup(struct addrspace *as, vaddr_t vaddr);
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak);
+int as_mmap(struct addrspace *as, size_t length, int readable, int writeable,
+            struct vnode *vn, off_t offset, vaddr_t *addr_ret);
+int as_munmap(struct addrspace *as, vaddr_t addr);
+int as_define_thread_stack(struct addrspace *as, vaddr_t *stackptr);
+void as_destroy_thread_stack(struct addrspace *as, vaddr_t stackptr);
+int as_grow_stack(struct addrspace *as, vaddr_t vaddr);
+int as_madvise(struct addrspace *as, vaddr_t start, vaddr_t end, int advice);
+int as_mincore(struct addrspace *as, vaddr_t start, unsigned npages,
+               unsigned char *vec);
+int as_mlock(struct addrspace *as, vaddr_t start, vaddr_t end, bool lock);
+int as_mprotect(struct addrspace *as, vaddr_t start, vaddr_t end,
+                int readable, int writeable);
+void as_setkinfo(struct addrspace *as, pid_t pid, pid_t ppid);
+
+#if OPT_HASHPT
+
+/*
+ * Hashed page table access, in vm.c. All of these need the VM lock.
+ *
+ *    page_table_find - return the entry for page VADDR, valid or not,
+ *                or NULL if there is none. With CREATE, makes an empty
+ *                one if need be, returning NULL only if out of memory.
+ *
+ *    page_table_next_entry - iterate over the entries present, valid
+ *                or not, handing back each one's page in *VADDR_RET.
+ *                Start with *CURSOR set to NULL; returns NULL when
+ *                done.
+ *
+ *    page_table_free_entries - remove and free all of PT's entries,
+ *                whatever they hold; the caller deals with the frames
+ *                and swap slots first.
+ */
+
+PTE *page_table_find(PageTable *pt, vaddr_t vaddr, bool create);
+PTE *page_table_next_entry(PageTable *pt, struct hashpt_entry **cursor,
+                           vaddr_t *vaddr_ret);
+void page_table_free_entries(PageTable *pt);
+
+#else
+
+/*
+ * First-level page table access, in vm.c:
+ *
+ *    page_table_get_l2 - return the L2 table covering L1_INDEX, or NULL.
+ *
+ *    page_table_get_occupancy - return the occupancy of that L2 table,
+ *                or NULL if there is none.
+ *
+ *    page_table_set_l2 - install an L2 table for an L1_INDEX that has
+ *                none yet. May fail with ENOMEM if the directory has to
+ *                be widened.
+ *
+ *    page_table_next_l2 - iterate over the L2 tables present. Start with
+ *                *CURSOR set to 0; returns false when done.
+ */
+
+L2Table *page_table_get_l2(PageTable *pt, unsigned l1_index);
+struct l2_occupancy *page_table_get_occupancy(PageTable *pt, unsigned l1_index);
+int page_table_set_l2(PageTable *pt, unsigned l1_index, L2Table *l2);
+bool page_table_next_l2(PageTable *pt, unsigned *cursor,
+                        unsigned *l1_index_ret, L2Table **l2_ret);
+
+#endif /* OPT_HASHPT */
+
+/*
+ * Set page table entry PTE, for page VADDR of PT, to FRAME. Entries
+ * going between 0 and not must be set this way, to keep the L2 table's
+ * occupancy right; changing bits of an entry that stays nonzero needn't
+ * be. In vm.c; needs the VM lock.
+ */
+void page_table_set_pte(PageTable *pt, vaddr_t vaddr, PTE *pte, paddr_t frame);
+
+/*
+ * Throw away the pages of AS in [START, END), both page aligned:
+ * resident frames are released and swap slots freed. In vm.c.
+ */
+void vm_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+
+/*
+ * Likewise for the whole of REGION, handing any pages that came from
+ * the page cache (file mappings and shared program text) back to it.
+ * Must be called without the VM lock, since pages may be written back.
+ * In vm.c.
+ */
+void vm_unmap_region(struct addrspace *as, struct region *region);
+
+/*
+ * Page-level work for the madvise family, in vm.c. The caller holds the
+ * regions lock (for reading is enough) and not the VM lock; [START, END)
+ * is page aligned and within REGION.
+ *
+ *    vm_discard_range - as vm_unmap_region, for just [START, END), but
+ *                leaving locked pages be (MADV_DONTNEED).
+ *
+ *    vm_prefault_range - bring in the pages that would otherwise need
+ *                I/O when touched: swapped out, or from a file. Stops
+ *                at the first that fails (MADV_WILLNEED).
+ *
+ *    vm_lock_range - as as_mlock, for the pages in REGION. AS must be
+ *                current, as pages are faulted in.
+ *
+ *    vm_mincore_range - as as_mincore; needs no region.
+ *
+ * And for as_mprotect, which holds the regions lock for writing:
+ *
+ *    vm_protect_range - bring the resident pages in [START, END) into
+ *                line with new region permissions: write-protected
+ *                unless WRITEABLE, kept out of the TLB if neither
+ *                READABLE nor WRITEABLE. Anything granted is left to
+ *                the fault path.
+ */
+void vm_discard_range(struct addrspace *as, struct region *region,
+                      vaddr_t start, vaddr_t end);
+void vm_prefault_range(struct addrspace *as, struct region *region,
+                       vaddr_t start, vaddr_t end);
+int vm_lock_range(struct addrspace *as, struct region *region,
+                  vaddr_t start, vaddr_t end, bool lock);
+void vm_mincore_range(struct addrspace *as, vaddr_t start, unsigned npages,
+                      unsigned char *vec);
+void vm_protect_range(struct addrspace *as, vaddr_t start, vaddr_t end,
+                      int readable, int writeable);
+
+/*
+ * Hand KPAGE, a page from alloc_kpages, over to AS as its page at
+ * VADDR, which must be in a writeable region and not mapped yet. AS
+ * needn't be current; this is for building a new program's stack.
+ * In vm.c.
+ */
+int vm_map_kpage(struct addrspace *as, vaddr_t vaddr, vaddr_t kpage);
+
+/*
+ * Page loaning, for moving whole pages of user memory through the
+ * kernel without copying them. Both share the page copy-on-write, so
+ * either side may go on using its copy. Both work on pages of private
+ * memory only, and fail (EINVAL) for anything else, including pages
+ * not in memory at the time; the caller should just copy instead.
+ * AS must be current. In vm.c.
+ *
+ *    vm_loan_page - return the frame of page VADDR of AS, with a new
+ *                reference, to be dropped with free_kpages or handed
+ *                to vm_accept_page.
+ *
+ *    vm_accept_page - map the frame PADDR as page VADDR of AS, which
+ *                must be writeable, in place of whatever was there.
+ *                The caller's reference to the frame is handed over.
+ */
+int vm_loan_page(struct addrspace *as, vaddr_t vaddr, paddr_t *paddr_ret);
+int vm_accept_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+
+/*
+ * Count the pages of AS resident in memory, for ps. AS must be kept
+ * from going away meanwhile. In vm.c.
+ */
+unsigned vm_resident_pages(struct addrspace *as);
+
+/*
+ * Working set sampling, in vm.c.
+ *
+ *    vm_ws_init - start AS's working set estimate afresh, for
+ *                as_create and as_reset.
+ *
+ *    vm_working_set - the pages of AS referenced in the last complete
+ *                sampling window, for ps.
+ */
+void vm_ws_init(struct addrspace *as);
+unsigned vm_working_set(struct addrspace *as);
 
 /*
  * Functions in loadelf.c
- *    load_elf - load an ELF user program executable into the current
- *               address space. Returns the entry point (initial PC)
- *               in the space pointed to by ENTRYPOINT.
+ *    load_elf - load an ELF user program executable into the address
+ *               space AS, which need not be the current one. Returns
+ *               the entry point (initial PC) in the space pointed to
+ *               by ENTRYPOINT. The layouts of recently loaded
+ *               executables are cached, with references to their
+ *               vnodes.
+ *
+ *    load_elf_check - check that V is an executable load_elf would
+ *               take, without loading it anywhere (it is left in the
+ *               cache, for the load_elf that follows).
+ *
+ *    load_elf_purge - drop the cached layouts of executables on FS,
+ *               and the references, before unmounting it.
  */
 
-int load_elf(struct vnode *v, vaddr_t *entrypoint);
+struct fs;
+
+int load_elf(struct addrspace *as, struct vnode *v, vaddr_t *entrypoint);
+int load_elf_check(struct vnode *v);
+void load_elf_purge(struct fs *fs);
 
 #endif /* _ADDRSPACE_H_ */
@@ -0,0 +1,52 @@
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+/*
+ * Atomic integers, for counters (reference counts and the like) that
+ * would otherwise each need a spinlock. While the guts are machine-
+ * dependent, the operations are the same everywhere:
+ *
+ *    atomic_get - read the value.
+ *
+ *    atomic_set - write the value. Only for initializing, or when no
+ *                 one else can be looking.
+ *
+ *    atomic_inc - add one.
+ *
+ *    atomic_dec_and_test - subtract one, and return true if that took
+ *                 it to 0.
+ *
+ *    atomic_cmpxchg - if the value is OLD make it NEW, all at once;
+ *                 returns what the value was, so it worked if that's
+ *                 OLD.
+ *
+ * atomic_dec_and_test and atomic_cmpxchg are full memory barriers, so
+ * that whoever sees a count drop (or a compare and swap go through)
+ * also sees what was done before it; atomic_inc is not, as taking a
+ * reference to something one already has a reference to needs no
+ * ordering.
+ */
+
+#include <cdefs.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef ATOMIC_INLINE
+#define ATOMIC_INLINE INLINE
+#endif
+
+struct atomic {
+	volatile int a_val;
+};
+
+#define ATOMIC_INITIALIZER(val) { (val) }
+
+ATOMIC_INLINE int atomic_get(const struct atomic *a);
+ATOMIC_INLINE void atomic_set(struct atomic *a, int val);
+ATOMIC_INLINE void atomic_inc(struct atomic *a);
+ATOMIC_INLINE bool atomic_dec_and_test(struct atomic *a);
+ATOMIC_INLINE int atomic_cmpxchg(struct atomic *a, int old, int new);
+
+/* Get the implementation. */
+#include <machine/atomic.h>
+
+#endif /* _ATOMIC_H_ */
@@ -38,8 +38,17 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *                      It's always the lowest one; a hint makes finding
+ *                      it cheap even when the bits below are all set.
+ *     bitmap_alloc_near - same, but the first cleared bit at or after a
+ *                      given one, wrapping around if need be.
+ *     bitmap_alloc_range - locate a run of a given number of cleared
+ *                      bits, set them all, and return the first one's
+ *                      index.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
+ *     bitmap_mark_range, bitmap_unmark_range - the same, for a run of
+ *                      bits, a whole word at a time where they can.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
  */
@@ -50,8 +59,16 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned goal,
+                                 unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned count,
+                                  unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
+void           bitmap_mark_range(struct bitmap *, unsigned index,
+                                 unsigned count);
+void           bitmap_unmark_range(struct bitmap *, unsigned index,
+                                   unsigned count);
 int            bitmap_isset(struct bitmap *, unsigned index);
 void           bitmap_destroy(struct bitmap *);
 
@@ -0,0 +1,132 @@
+/*
+ * Buffer cache.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * The buffer cache holds recently used disk blocks in memory, keyed
+ * by (device, block number), and writes them back lazily: changes go
+ * into the cached copy and reach the disk when a flusher thread gets
+ * to them, a few seconds later, or when the buffer is evicted or
+ * buf_sync is called. Runs of adjacent dirty blocks are written
+ * together. It works in blocks of the device's own size, or of a
+ * larger size set with buf_attach (as a file system with bigger
+ * blocks would).
+ *
+ * A buffer handed out by buf_read or buf_get is pinned: it stays put,
+ * and isn't evicted, until buf_release. The cache does not serialize
+ * use of a block's contents; that's up to the file system, which
+ * generally already has a lock covering whatever the block holds.
+ * Change the contents and then call buf_markdirty, in that order, as
+ * a concurrent buf_sync may be writing the block out meanwhile.
+ *
+ * Functions:
+ *
+ *    buf_bootstrap - set up the cache and start the flusher. Needs
+ *              the clock going.
+ *
+ *    buf_attach - use DEV in blocks of BLOCKSIZE bytes, a multiple of
+ *              its own block size, until buf_detach. Block numbers
+ *              for DEV are then in those units. Nothing of DEV may be
+ *              cached already.
+ *
+ *    buf_read - get the block, reading it in if it isn't cached.
+ *
+ *    buf_get - get the block without reading it, for overwriting it
+ *              completely. If it wasn't cached the contents are
+ *              garbage, and buf_valid is false until buf_markdirty;
+ *              a buffer released in that state is thrown away.
+ *
+ *    buf_data - the block's contents.
+ *
+ *    buf_valid - whether the contents are the block's, so far as the
+ *              cache knows.
+ *
+ *    buf_markdirty - note that the contents have been changed (or
+ *              filled in) and must be written back.
+ *
+ *    buf_setowner - note that the block belongs to OWNER (a file,
+ *              say), for buf_syncowner. It stays so until the buffer
+ *              is reused for another block, discarded, or given
+ *              another owner.
+ *
+ *    buf_release - unpin a buffer.
+ *
+ *    buf_discard - forget the block, without writing it back, as its
+ *              contents no longer matter (e.g. it has been freed).
+ *
+ *    buf_sync - write back all the dirty buffers of a device, but
+ *              for any held (see below).
+ *
+ *    buf_syncowner - buf_sync, but only for the buffers of the
+ *              device given to OWNER with buf_setowner (and any dirty
+ *              neighbours they happen to be written with).
+ *
+ *    buf_readahead - start reading in a run of blocks in the
+ *              background, for a reader expected to want them soon.
+ *              Blocks already cached are skipped; the request may be
+ *              dropped if there are too many outstanding.
+ *
+ *    buf_detach - write back and then throw away all the buffers of a
+ *              device, for unmounting, and forget any buf_attach. None
+ *              may be pinned.
+ *
+ *    buf_shrink - throw away all the buffers that can go without any
+ *              I/O (clean and not pinned), for when memory is short.
+ *              Returns how many went.
+ *
+ *    buf_printstats - print hit and miss counts and so forth.
+ *
+ *    buf_getstats - the same counts, as a struct bufstat (see
+ *              <kern/iostat.h>).
+ *
+ * For a file system that journals its metadata, a dirty buffer can be
+ * held: then nothing but the file system writes it anywhere until it
+ * lets go, so it reaches its home only after going to the journal.
+ * A held buffer stays pinned (and cached) until then.
+ *
+ *    buf_markheld - as buf_markdirty, and hold the buffer. Returns
+ *              true if it wasn't held already, for keeping count.
+ *
+ *    buf_held - put (up to MAX of) DEV's held buffers in BUFS, and
+ *              return how many there are in all.
+ *
+ *    buf_unhold - let go of a held buffer, which is then an ordinary
+ *              dirty one. Discarding a held buffer lets go too.
+ *
+ *    buf_block - the block a buffer is of.
+ */
+
+struct buf;
+struct device;
+struct bufstat;
+
+void buf_bootstrap(void);
+int buf_attach(struct device *dev, unsigned blocksize);
+
+int buf_read(struct device *dev, daddr_t block, struct buf **ret);
+int buf_get(struct device *dev, daddr_t block, struct buf **ret);
+void *buf_data(struct buf *b);
+bool buf_valid(struct buf *b);
+void buf_markdirty(struct buf *b);
+void buf_setowner(struct buf *b, const void *owner);
+void buf_release(struct buf *b);
+
+bool buf_markheld(struct buf *b);
+unsigned buf_held(struct device *dev, struct buf **bufs, unsigned max);
+void buf_unhold(struct buf *b);
+daddr_t buf_block(struct buf *b);
+
+void buf_discard(struct device *dev, daddr_t block);
+int buf_sync(struct device *dev);
+int buf_syncowner(struct device *dev, const void *owner);
+void buf_readahead(struct device *dev, daddr_t block, unsigned nblocks);
+int buf_detach(struct device *dev);
+
+unsigned buf_shrink(void);
+void buf_printstats(void);
+void buf_getstats(struct bufstat *ret);
+
+#endif /* _BUF_H_ */
@@ -38,15 +38,26 @@
 
 
 /*
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, only when the
+ * CPU is not idle, for scheduling.
+ *
+ * The MD code calls clock_interrupt() on every timer interrupt, and
+ * provides mainbus_timer_set() (in <mainbus.h>) for it to ask for the
+ * next one; clock_interrupt decides when hardclock and the one-shot
+ * timers used by clocknanosleep are due. hardclock_start() is called
+ * once gettime() works; until then the timer just ticks. The idle
+ * loop calls clock_idle() as it goes idle and as it finds a thread
+ * to run, so that idle CPUs stop ticking.
  */
 
 /* hardclocks per second */
 #define HZ  100
 
 void hardclock_bootstrap(void);
+void hardclock_start(void);
 void hardclock(void);
+void clock_interrupt(void);
+void clock_idle(bool idle);
 
 /*
  * timerclock() is called on one CPU once a second to allow simple
@@ -59,6 +70,12 @@ void timerclock(void);
  */
 void gettime(struct timespec *ret);
 
+/*
+ * clock_now() is gettime() for code that may run before there is a
+ * clock (such as the scheduler); until hardclock_start() it returns 0.
+ */
+void clock_now(struct timespec *ret);
+
 /*
  * arithmetic on times
  *
@@ -76,8 +93,37 @@ void timespec_sub(const struct timespec *t1,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * clocknanosleep() is the same, for a time that needn't be whole
+ * seconds or ticks.
  */
 void clocksleep(int seconds);
+void clocknanosleep(const struct timespec *ts);
+
+/*
+ * One-shot timers, for code that must wait for something else and
+ * also give up after a while. clocktimer_start arranges for
+ * FUNC(DATA) to be called once TS has passed. It is called from the
+ * timer interrupt, with interrupts off and the timer lock held, so it
+ * may take spinlocks (that aren't held while starting or stopping a
+ * timer) but must not sleep. clocktimer_stop cancels the timer if it
+ * hasn't gone off; once it returns, FUNC isn't running either, and
+ * the timer's memory may be reused. The structure is the caller's,
+ * but only the clock code looks inside it.
+ */
+struct cpu;	/* in cpu.h */
+
+struct clocktimer {
+	struct timespec ct_when;
+	bool ct_done;
+	struct cpu *ct_cpu;		/* whose c_timers it's on */
+	void (*ct_func)(void *);	/* NULL for clocknanosleep */
+	void *ct_data;
+	struct clocktimer *ct_next;
+};
+
+void clocktimer_start(struct clocktimer *ct, const struct timespec *ts,
+		      void (*func)(void *), void *data);
+void clocktimer_stop(struct clocktimer *ct);
 
 
 #endif /* _CLOCK_H_ */
@@ -69,5 +69,26 @@ int copyout(const void *src, userptr_t userdest, size_t len);
 int copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *got);
 int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
 
+/*
+ * The machine-dependent copying these are built on (on mips, in
+ * arch/mips/vm/usercopy.S):
+ *
+ *    usercopy - copy LEN bytes from SRC to DEST. Returns 0, or EFAULT
+ *               if the user address faulted.
+ *
+ *    usercopystr - copy a string of at most LEN bytes from SRC to
+ *               DEST, storing its length in *GOT if GOT isn't NULL.
+ *               Returns 0, ENAMETOOLONG if there was no null
+ *               terminator within LEN bytes, or EFAULT.
+ *
+ *    copyfixup - for the trap code. If PC is one of the instructions
+ *               in the above that touch user memory, returns where to
+ *               resume after a fault there that couldn't be handled,
+ *               so that the copy returns EFAULT; otherwise 0.
+ */
+int usercopy(void *dest, const void *src, size_t len);
+int usercopystr(char *dest, const char *src, size_t len, size_t *got);
+vaddr_t copyfixup(vaddr_t pc);
+
 
 #endif /* _COPYINOUT_H_ */
@@ -32,10 +32,33 @@
 
 
 #include <spinlock.h>
+#include <atomic.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <kern/time.h>   /* for struct timespec */
+
+struct clocktimer;       /* in clock.h */
+struct work;             /* in workqueue.h */
 
 
+/*
+ * Number of scheduling priorities; each has its own run queue. 0 is the
+ * highest, and is only for SCHED_FIFO threads; time-sharing threads
+ * use RUNQUEUE_TS and below. See thread.c.
+ */
+#define RUNQUEUE_LEVELS 5
+#define RUNQUEUE_RT	0
+#define RUNQUEUE_TS	1
+
+/*
+ * CPUs are taken to share a cache in groups of CPU_SIBLINGS, by cpu
+ * number (0 and 1, 2 and 3, ...), and the scheduler prefers to wake a
+ * thread on an idle sibling of the waker's CPU over one further away.
+ * System/161 doesn't model caches, so this only sets the policy; it
+ * should match the real topology on hardware that has one.
+ */
+#define CPU_SIBLINGS 2
+
 /*
  * Per-cpu structure
  *
@@ -46,6 +69,18 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/* IPI types (see "Interprocessor interrupts" below) */
+#define IPI_PANIC		0	/* System has called panic() */
+#define IPI_OFFLINE		1	/* CPU is requested to go offline */
+#define IPI_UNIDLE		2	/* Runnable threads are available */
+#define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_NTYPES		4
+
+#define IPI_NAMES { "panic", "offline", "unidle", "shootdown" }
+
+/* Device interrupt sources counted per CPU (LAMEbus slots) */
+#define CPU_IRQSOURCES		32
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -59,16 +94,53 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadpool;	/* Reaped threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct kmalloc_cpu *c_kmalloc;	/* Magazines (see kmalloc.c) */
+	struct timespec c_nexttick;	/* When hardclock is next due */
+	bool c_tickless;		/* Periodic tick stopped while idle */
+	struct clocktimer *c_timers;	/* One-shot timers, soonest first */
+	struct timespec c_switchtime;	/* When thread_switch last picked */
+	unsigned c_gangslot;		/* Gang time slot last seen */
+	unsigned c_gang;		/* Gang whose slot it is, or 0 */
+
+	/*
+	 * Interrupt counts. Updated only by this cpu, with interrupts
+	 * off; read by cpu_printintrstats without a lock, so perhaps
+	 * an interrupt or two stale.
+	 */
+	uint32_t c_irqs[CPU_IRQSOURCES];	/* Device interrupts, by source */
+	uint64_t c_irqusecs[CPU_IRQSOURCES];	/* ... time in their handlers */
+	uint32_t c_strayirqs;			/* Ones no handler was for */
+	uint32_t c_ipis[IPI_NTYPES];		/* IPIs taken, by type */
+	uint32_t c_ipisent[IPI_NTYPES];		/* ... and sent from here */
+	uint64_t c_ipiusecs;			/* Time handling IPIs */
+	uint32_t c_shootdowns;			/* TLB shootdowns done */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[RUNQUEUE_LEVELS]; /* Run queues, by priority */
 	struct spinlock c_runqueue_lock;
+	struct spinlock_stats c_runqueue_stats;
+
+	/*
+	 * Threads woken from other cpus, not yet on the run queue.
+	 * Pushed to without any lock; emptied under the runqueue lock.
+	 */
+	struct atomic c_inbox;		/* Top thread, as an int, or 0 */
+
+	/*
+	 * Accessed by this cpu's interrupt handlers and work thread.
+	 * Protected by the work lock. See workqueue.c.
+	 */
+	struct work *c_work;		/* Deferred work, oldest first */
+	struct work **c_worktail;	/* Link to add the next item at */
+	struct wchan *c_workwchan;	/* Where the work thread waits */
+	struct spinlock c_work_lock;
 
 	/*
 	 * Accessed by other cpus.
@@ -112,6 +184,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Return the cpu whose c_number is NUM, or NULL if there is none.
+ * CPUs are numbered from 0 up, and all are there once boot() has
+ * called thread_start_cpus.
+ */
+struct cpu *cpu_bynumber(unsigned num);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -160,11 +239,7 @@ void cpu_halt(void);
  * received.
  */
 
-/* IPI types */
-#define IPI_PANIC		0	/* System has called panic() */
-#define IPI_OFFLINE		1	/* CPU is requested to go offline */
-#define IPI_UNIDLE		2	/* Runnable threads are available */
-#define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+/* (The IPI types are defined above struct cpu.) */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
@@ -172,5 +247,10 @@ void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
+/*
+ * Print each CPU's interrupt and IPI counts.
+ */
+void cpu_printintrstats(void);
+
 
 #endif /* _CPU_H_ */
@@ -34,8 +34,13 @@
  * Devices.
  */
 
+#include <spinlock.h>
+#include <kern/iostat.h>
+#include <kern/time.h>
 
 struct uio;  /* in <uio.h> */
+struct iovec;  /* in <kern/iovec.h> */
+struct pollentry;  /* in <poll.h> */
 
 /*
  * Filesystem-namespace-accessible device.
@@ -48,19 +53,76 @@ struct device {
 
 	dev_t d_devnumber;	/* serial number for this device */
 
+	struct devstats *d_stats;	/* I/O statistics, or NULL */
+
 	void *d_data;		/* device-specific data */
 };
 
+/*
+ * Asynchronous block I/O request, for devices with devop_submit.
+ *
+ * The caller fills in the first part. DR_IOV and DR_IOVCNT describe
+ * kernel memory, each piece a whole number of blocks, and DR_OFFSET
+ * is a block-aligned byte offset on the device. DR_DONE is called
+ * with 0 or an error code when the transfer is over; it is called
+ * from the device's interrupt handler, so must not sleep. The rest
+ * belongs to the driver while the request is outstanding.
+ */
+struct devreq {
+	off_t dr_offset;
+	struct iovec *dr_iov;
+	unsigned dr_iovcnt;
+	bool dr_iswrite;
+	void (*dr_done)(struct devreq *dr, int result);
+	void *dr_data;			/* for dr_done's use */
+
+	size_t dr_len;			/* total bytes */
+	size_t dr_pos;			/* bytes done so far */
+	unsigned dr_iovidx;		/* where dr_pos is in dr_iov */
+	size_t dr_iovoff;
+	struct devreq *dr_next;		/* on the driver's queue */
+	struct devreq *dr_merged;	/* to be done straight after */
+	struct devreq *dr_mergetail;	/* last of the dr_merged chain */
+	struct timespec dr_start;	/* when submitted, for devstats */
+};
+
+/*
+ * I/O statistics for a block device (see <kern/iostat.h>), which the
+ * device points to with d_stats. The driver calls devstats_submit
+ * when it accepts a request and devstats_done when the request is
+ * finished, just before calling its dr_done; they may be called from
+ * interrupt handlers. The counts are read by DIOC_GETSTATS on the
+ * device and the "io" menu command. See devstats.c.
+ */
+struct devstats {
+	struct spinlock ds_lock;
+	struct iostat ds_io;
+};
+
+void devstats_init(struct devstats *ds);
+void devstats_cleanup(struct devstats *ds);
+void devstats_submit(struct devstats *ds, struct devreq *req);
+void devstats_done(struct devstats *ds, struct devreq *req, int result);
+void devstats_get(struct devstats *ds, struct iostat *ret);
+void devstats_reset(struct devstats *ds);
+void devstats_print(const char *name, struct devstats *ds);
+
 /*
  * Device operations.
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_submit - start a devreq and return without waiting; NULL
+ *              for devices that don't do block I/O this way
+ *      devop_poll - as for vop_poll (see <vnode.h>); NULL for devices
+ *              that are always ready
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_submit)(struct device *, struct devreq *);
+	int (*devop_poll)(struct device *, struct pollentry *);
 };
 
 /*
@@ -69,6 +131,8 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_SUBMIT(d, r)	((d)->d_ops->devop_submit(d, r))
+#define DEVOP_POLL(d, pe)	((d)->d_ops->devop_poll(d, pe))
 
 
 /* Create vnode for a vfs-level device. */
@@ -80,6 +144,13 @@ void dev_uncreate_vnode(struct vnode *vn);
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
 
+/*
+ * Make a mountable device NAME striped UNIT bytes at a time across
+ * the NDISKS disks named in DISKS. See devstripe.c.
+ */
+int devstripe_create(const char *name, size_t unit, unsigned ndisks,
+		     char **disks);
+
 /* Function that kicks off device probe and attach. */
 void dev_bootstrap(void);
 
@@ -34,6 +34,7 @@
 /*
  * Get abstract structure definitions
  */
+#include <spinlock.h>
 #include <fs.h>
 #include <vnode.h>
 
@@ -41,10 +42,51 @@
  * Our structures
  */
 
+/*
+ * A cached page of a file (see the page cache in emu.c).
+ */
+struct emufs_page {
+	unsigned ep_refs;		/* the cache's, plus readers' */
+	size_t ep_len;			/* bytes valid; < PAGE_SIZE only at EOF */
+	char *ep_data;			/* the contents */
+	struct emufs_page *ep_next;	/* for freeing in batches */
+};
+
+/*
+ * A cached directory entry: reading the directory at ED_OFF gives
+ * ED_NAME and moves on to ED_NEXT.
+ */
+struct emufs_dirent {
+	char *ed_name;
+	uint32_t ed_off;
+	uint32_t ed_next;
+};
+
 struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+	struct emufs_page **ev_pages;	/* cached pages, by page number */
+	unsigned ev_npages;		/* size of ev_pages */
+	off_t ev_size;			/* cached size, if ev_sizevalid */
+	bool ev_sizevalid;		/* ...and ev_sizegen is current */
+	unsigned ev_sizegen;		/* ef_gen when ev_size was got */
+	struct emufs_dirent *ev_dirents; /* whole listing, or NULL */
+	unsigned ev_ndirents;		/* entries in it */
+	unsigned ev_dirgen;		/* ef_dirgen when it was read */
+};
+
+/*
+ * A remembered lookup: looking PATH up in DIR gave FILE, or nothing.
+ */
+#define EMUFS_NAMES	16
+#define EMUFS_PATHLEN	64
+
+struct emufs_name {
+	struct emufs_vnode *en_dir;	/* referenced; NULL if unused */
+	struct emufs_vnode *en_file;	/* referenced; NULL if not there */
+	unsigned en_lastuse;		/* for LRU replacement */
+	char en_path[EMUFS_PATHLEN];
 };
 
 struct emufs_fs {
@@ -52,6 +94,13 @@ struct emufs_fs {
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+
+	struct spinlock ef_cachelock;	/* protects the rest, and ev_pages */
+	unsigned ef_gen;		/* bumped when any file changes */
+	unsigned ef_dirgen;		/* bumped when a file is created */
+	unsigned ef_cachedpages;	/* pages cached, all files */
+	unsigned ef_clock;		/* for en_lastuse */
+	struct emufs_name ef_names[EMUFS_NAMES];
 };
 
 
@@ -35,28 +35,47 @@
 #define _FILETABLE_H_
 
 #include <limits.h> /* for OPEN_MAX */
+#include <spinlock.h>
+
+struct bitmap;
 
 
 /*
- * The file table is an array of open files.
+ * The file table is an array of open files, indexed by fd.
+ *
+ * It starts out with room for FT_MINSIZE files and doubles as needed,
+ * up to OPEN_MAX; it never shrinks. ft_used has a bit set for each
+ * slot in use, so placing a file finds the lowest free fd without
+ * looking through the array, and ft_maxfd is one past the highest fd
+ * in use, so that fork copies only that much of it.
  *
- * There is no particular reason to use a fixed size array (of size
- * OPEN_MAX) instead of a dynamically sized array (using array.h) --
- * the code was just written this way years ago and there's no
- * compelling reason to change it that outweighs this benefit: you can
- * look through the code to see what it would take to make it dynamic,
- * or even to make it dynamic with the limit being user-settable. (See
- * setrlimit(2) on a Unix machine.)
+ * The threads of a process share its file table, so changes to the
+ * slots are serialized by ft_lock. On fork, the table is copied. So
+ * that one thread can close() a file while another is in the middle
+ * of e.g. read() on it, filetable_get hands out a reference of its
+ * own, which filetable_put drops; the file stays open until that read
+ * finishes.
  *
- * Because we only have single-threaded processes, the file table is
- * never shared and so it doesn't require synchronization. On fork,
- * the table is copied. Another exercise: what would you need to do to
- * make this code safe for multithreaded processes? What happens if
- * one thread calls close() while another one is in the middle of e.g.
- * read() using the same file handle?
+ * filetable_get, which every read and write goes through, doesn't take
+ * ft_lock: it reads the slot, gets a reference if the file hasn't been
+ * closed for good meanwhile (openfiles are type-safe, so the memory is
+ * still an openfile even then), and reads the slot again, in the
+ * current array, to make sure the file is still the one there. For
+ * the same reason an array that has been outgrown isn't freed until
+ * the table is: someone may still be looking at it.
  */
+struct fdarray {
+	unsigned fa_size;
+	struct fdarray *fa_prev;	/* the one this replaced, or NULL */
+	struct openfile *volatile fa_files[];
+};
+
 struct filetable {
-	struct openfile *ft_openfiles[OPEN_MAX];
+	struct spinlock ft_lock;
+	struct fdarray *volatile ft_files;
+	struct bitmap *ft_used;		/* which fds are in use */
+	unsigned ft_maxfd;		/* one past the highest in use */
+	unsigned ft_limit;		/* new fds must be below (RLIMIT_NOFILE) */
 };
 
 /*
@@ -68,10 +87,17 @@ struct filetable {
  * okfd -    Check if a file handle is in range.
  * get/put - Retrieve a fd for use and put it back when done. (Checks
  *           okfd and also fails on files not open; returned openfile
- *           is not NULL.) Call put with the file returned from get.
+ *           is not NULL.) Call put with the file returned from get;
+ *           the fd may have been closed or reused in between.
  * place -   Insert a file and return the fd.
  * placeat - Insert a file at a specific slot and return the file
- *           previously there.
+ *           previously there. To insert a file, the table must
+ *           reach the slot; see reserve.
+ * reserve - Make the table big enough to have a slot for fd. Fails
+ *           with EBADF if fd is at or past the limit.
+ * count -   Count the files open.
+ * setlimit - Set how far new fds may go (they must be below it); fds
+ *           already open past it stay open. Copied along with the table.
  */
 
 struct filetable *filetable_create(void);
@@ -85,6 +111,9 @@ void filetable_put(struct filetable *ft, int fd, struct openfile *file);
 int filetable_place(struct filetable *ft, struct openfile *file, int *fd);
 void filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
 		       struct openfile **oldfile_ret);
+int filetable_reserve(struct filetable *ft, int fd);
+unsigned filetable_count(struct filetable *ft);
+void filetable_setlimit(struct filetable *ft, unsigned limit);
 
 
 #endif /* _FILETABLE_H_ */
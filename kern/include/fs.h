@@ -86,6 +86,17 @@ struct fs_ops {
 
 /* Initialization functions for builtin fake file systems. */
 void semfs_bootstrap(void);
+void tmpfs_bootstrap(void);	/* the shm: tmpfs */
+
+/* Make an empty in-memory filesystem and attach it as NAME:. */
+int tmpfs_mount(const char *name);
+
+/*
+ * P and V on a semfs semaphore, for the semwait and sempost system
+ * calls. EINVAL if VN isn't one.
+ */
+int semfs_semwait(struct vnode *vn, unsigned count);
+int semfs_sempost(struct vnode *vn, unsigned count);
 
 
 #endif /* _FS_H_ */
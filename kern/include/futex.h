@@ -0,0 +1,19 @@
+/*
+ * Futexes: threads waiting on words of their own memory.
+ */
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+/*
+ * A waiting thread is keyed by its address space and the virtual
+ * address of the word, and sleeps in a hash table of wait channels;
+ * see <kern/futex.h> for the operations. Only threads of the same
+ * process (sharing an address space) can meet on a futex.
+ *
+ *    futex_bootstrap - set up the table.
+ */
+
+void futex_bootstrap(void);
+
+#endif /* _FUTEX_H_ */
@@ -0,0 +1,33 @@
+#ifndef _KERN_DIRENT_H_
+#define _KERN_DIRENT_H_
+
+/*
+ * Directory records for getdirentries(), shared between the kernel
+ * and libc's <unistd.h>. Each call fills the buffer with as many
+ * whole records as fit, one per name, each with what stat() would say
+ * about it, so listing a directory doesn't take an open and fstat per
+ * name. The cookie says where to carry on from; it starts at 0 and is
+ * nothing else the caller should interpret. A name that went away
+ * between being read and being looked at comes back with everything
+ * but the name 0.
+ *
+ * Records are d_reclen bytes long, so the next one starts that far
+ * on; the name is NUL-terminated.
+ */
+
+struct dirent {
+	__off_t d_size;		/* size in bytes */
+	__ino_t d_ino;		/* inode number */
+	__mode_t d_mode;	/* file type and permissions, as st_mode */
+	__blkcnt_t d_blocks;	/* blocks in use */
+	__u16 d_nlink;		/* hard links */
+	__u16 d_reclen;		/* length of the whole record */
+	__u16 d_namlen;		/* length of the name, without the NUL */
+	char d_name[];
+};
+
+/* Length of the record for a name of NAMLEN bytes */
+#define _DIRENT_RECLEN(namlen) \
+	((sizeof(struct dirent) + (namlen) + 1 + 7) & ~(__u32)7)
+
+#endif /* _KERN_DIRENT_H_ */
@@ -0,0 +1,23 @@
+#ifndef _KERN_FUTEX_H_
+#define _KERN_FUTEX_H_
+
+/*
+ * Operations for futex(), shared between the kernel and libc's
+ * <unistd.h>.
+ *
+ * FUTEX_WAIT sleeps if the word at ADDR still holds VAL, until a
+ * FUTEX_WAKE on the same word of the same process, or until TIMEOUT
+ * milliseconds have passed (forever if it's negative). It fails with
+ * EAGAIN if the word doesn't hold VAL, and ETIMEDOUT if the time runs
+ * out.
+ *
+ * FUTEX_WAKE wakes up to VAL of the threads waiting on ADDR, oldest
+ * first, and returns how many it woke.
+ *
+ * ADDR must be word-aligned.
+ */
+
+#define FUTEX_WAIT	0
+#define FUTEX_WAKE	1
+
+#endif /* _KERN_FUTEX_H_ */
@@ -34,6 +34,39 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/*
+ * Console line discipline. The argument points to an int, nonzero
+ * for canonical mode: input is edited a line at a time, with echo,
+ * and reads return at most one line. Otherwise (the default) reads
+ * return whatever has been typed, up to a newline, without echo.
+ */
+#define CONIOC_GETCANON   1
+#define CONIOC_SETCANON   2
+
+/*
+ * Disk (lhd) polling. The argument points to an int: how many times
+ * synchronous I/O checks the disk for completion before going to
+ * sleep to wait for the interrupt. 0, the default, means always
+ * sleep. Polling saves the interrupt and context switch for transfers
+ * that finish quickly, at the cost of the CPU while it lasts.
+ */
+#define LHDIOC_GETPOLL    3
+#define LHDIOC_SETPOLL    4
+
+/*
+ * Disk statistics. For DIOC_GETSTATS the argument points to a struct
+ * iostat (see <kern/iostat.h>) to fill in; DIOC_RESETSTATS, which
+ * takes no argument, zeroes the counts. Devices that don't keep them
+ * fail with EIOCTL.
+ */
+#define DIOC_GETSTATS     5
+#define DIOC_RESETSTATS   6
+
+/*
+ * Network card (lnet) hardware address. The argument points to an
+ * int to fill in with the address other cards send to; see
+ * <kern/lnet.h>.
+ */
+#define LNETIOC_GETADDR   7
 
 #endif /* _KERN_IOCTL_H_*/
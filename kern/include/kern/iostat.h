@@ -0,0 +1,57 @@
+#ifndef _KERN_IOSTAT_H_
+#define _KERN_IOSTAT_H_
+
+/*
+ * Block I/O statistics, shared between the kernel and libc's
+ * <unistd.h>.
+ *
+ * struct iostat is one disk's counts since boot (or since they were
+ * last reset), from the ioctl DIOC_GETSTATS on its device, e.g.
+ * lhd0raw:. A request is counted when it finishes, and its latency
+ * runs from when it was submitted, so includes time spent waiting in
+ * the queue behind others. Requests the disk merged are still counted
+ * one by one.
+ *
+ * is_hist is a histogram of the latencies: bucket 0 counts requests
+ * that took under 2^IOSTAT_HISTSHIFT microseconds, and bucket I
+ * those from 2^(I-1+IOSTAT_HISTSHIFT) up to twice that. The last
+ * bucket also takes everything slower.
+ */
+
+#define IOSTAT_NBUCKETS  16
+#define IOSTAT_HISTSHIFT 6	/* bucket 0 is under 64 us */
+
+struct iostat {
+	__u32 is_reads;		/* read requests done */
+	__u32 is_writes;	/* write requests done */
+	__u64 is_rbytes;	/* bytes read */
+	__u64 is_wbytes;	/* bytes written */
+	__u32 is_errors;	/* requests that failed */
+	__u32 is_queued;	/* requests outstanding now */
+	__u32 is_maxqueued;	/* most ever outstanding at once */
+	__u32 is_maxusecs;	/* slowest single request */
+	__u64 is_usecs;		/* total latency, in microseconds */
+	__u32 is_hist[IOSTAT_NBUCKETS];
+};
+
+/*
+ * Buffer cache counts since boot, from bufstat(). A hit is a block
+ * found in the cache, a miss one that had to be read; writes are
+ * writebacks of dirty buffers, each of one or more blocks.
+ */
+struct bufstat {
+	__u32 bs_buffers;	/* buffers now */
+	__u32 bs_dirty;		/* ... of which dirty */
+	__u32 bs_hits;
+	__u32 bs_misses;
+	__u32 bs_evictions;	/* buffers reused for other blocks */
+	__u32 bs_writes;	/* writebacks */
+	__u32 bs_blockswritten;	/* ... and the blocks they wrote */
+	__u32 bs_flushes;	/* writebacks done by the flusher thread */
+	__u32 bs_raread;	/* blocks read ahead */
+	__u32 bs_rahits;	/* ... and then used */
+	__u32 bs_radropped;	/* read-ahead requests dropped */
+	__u32 bs_shrunk;	/* buffers given up for memory */
+};
+
+#endif /* _KERN_IOSTAT_H_ */
@@ -0,0 +1,35 @@
+#ifndef _KERN_KINFO_H_
+#define _KERN_KINFO_H_
+
+/*
+ * The kernel information pages, mapped read-only into every user
+ * address space so that libc can get at these things without a system
+ * call. The first page, at KINFO_VADDR, is the process's own and
+ * starts with a struct kinfo; the second, at KINFO_TIMEVADDR, is
+ * shared by all processes and starts with a struct kinfo_time, which
+ * the kernel brings up to date on every clock tick.
+ *
+ * They sit just below where programs are linked; no program segment
+ * or mapping may overlap them.
+ */
+#define KINFO_VADDR     0x003fe000
+#define KINFO_TIMEVADDR 0x003ff000
+#define KINFO_END       0x00400000
+
+struct kinfo {
+	__i32 ki_pid;		/* this process */
+	__i32 ki_ppid;		/* its parent, when it was made */
+};
+
+/*
+ * The time of the latest clock tick, so up to a tick behind. kt_seq is
+ * odd while the kernel is changing the rest: read kt_seq, then the
+ * time, then kt_seq again, and if it was odd or has changed, retry.
+ */
+struct kinfo_time {
+	__u32 kt_seq;
+	__u32 kt_nsec;
+	__i64 kt_sec;
+};
+
+#endif /* _KERN_KINFO_H_ */
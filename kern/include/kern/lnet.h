@@ -0,0 +1,26 @@
+#ifndef _KERN_LNET_H_
+#define _KERN_LNET_H_
+
+/*
+ * Packets on the LAMEbus network card (lnetN:), shared between the
+ * kernel and userland. Each read of the device returns one whole
+ * packet as it came off the wire, header and all; each write sends
+ * one, of which the caller fills in lh_to and the data and the driver
+ * the rest of the header. Packets go through the System/161 hub to
+ * the card with hardware address lh_to, or every card for
+ * LNET_BROADCAST.
+ */
+
+#define LNET_MTU        4096        /* biggest packet, header included */
+#define LNET_FRAMEWORD  0xa4b3c2d1  /* start of every packet */
+#define LNET_BROADCAST  0xffff      /* hardware address of everyone */
+
+struct lnet_linkheader {
+	uint32_t lh_frameword;	/* LNET_FRAMEWORD */
+	uint16_t lh_from;	/* hardware address of the sender */
+	uint16_t lh_packetlen;	/* bytes in the packet, header included */
+	uint16_t lh_to;		/* hardware address it's for */
+	uint16_t lh_unused;
+};
+
+#endif /* _KERN_LNET_H_ */
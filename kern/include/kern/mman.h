@@ -0,0 +1,35 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Protection bits for mmap() and mprotect(), and advice for madvise(), shared between
+ * the kernel and libc's <unistd.h>.
+ *
+ * Named shared-memory objects are files in the in-memory "shm:" volume;
+ * see shm_open() in <unistd.h>.
+ */
+
+#define PROT_NONE  0   /* pages may not be touched */
+#define PROT_READ  1   /* pages may be read */
+#define PROT_WRITE 2   /* pages may be written */
+
+/*
+ * The UNSW mmap() has no flags argument, so this goes in with the
+ * protection bits. With an fd of -1 it makes the zero-filled pages
+ * shared rather than private: children forked afterwards see the same
+ * pages, not copies. File mappings are always shared.
+ */
+#define MAP_SHARED 0x100
+
+/*
+ * How the pages will be used. The first three describe the access
+ * pattern and stay with each region the range touches, until the next
+ * such advice; the last two act on the pages there and then.
+ */
+#define MADV_NORMAL     0   /* no particular pattern (the default) */
+#define MADV_RANDOM     1   /* no point mapping pages ahead of faults */
+#define MADV_SEQUENTIAL 2   /* read in order: always map pages ahead */
+#define MADV_WILLNEED   3   /* bring the pages in from swap or file now */
+#define MADV_DONTNEED   4   /* throw the pages away now */
+
+#endif /* _KERN_MMAN_H_ */
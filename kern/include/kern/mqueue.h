@@ -0,0 +1,16 @@
+#ifndef _KERN_MQUEUE_H_
+#define _KERN_MQUEUE_H_
+
+/*
+ * Definitions for message queues, shared between the kernel and
+ * libc's <unistd.h>. A queue holds up to a fixed number of messages of
+ * up to a fixed size each; see mq_create().
+ */
+
+#define MQ_NONBLOCK    1       /* fail with EAGAIN rather than wait */
+
+#define MQ_MSGSIZE_MAX 4096    /* biggest message size a queue may take */
+#define MQ_MAXMSG_MAX  256     /* most messages a queue may hold */
+#define MQ_BYTES_MAX   65536   /* most slot space one queue may have */
+
+#endif /* _KERN_MQUEUE_H_ */
@@ -0,0 +1,25 @@
+#ifndef _KERN_POLL_H_
+#define _KERN_POLL_H_
+
+/*
+ * Definitions for poll(), shared between the kernel and libc's
+ * <unistd.h>. Each pollfd names a file handle and the events of
+ * interest; poll fills in which have happened. POLLERR, POLLHUP, and
+ * POLLNVAL are reported whether asked for or not. A negative fd is
+ * skipped.
+ */
+
+#define POLLIN      0x001   /* can read without blocking */
+#define POLLPRI     0x002   /* urgent data (never, in OS/161) */
+#define POLLOUT     0x004   /* can write without blocking */
+#define POLLERR     0x008   /* error */
+#define POLLHUP     0x010   /* the other end has gone */
+#define POLLNVAL    0x020   /* fd not open */
+
+struct pollfd {
+	int fd;
+	short events;
+	short revents;
+};
+
+#endif /* _KERN_POLL_H_ */
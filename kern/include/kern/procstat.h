@@ -0,0 +1,42 @@
+#ifndef _KERN_PROCSTAT_H_
+#define _KERN_PROCSTAT_H_
+
+/*
+ * Process table snapshots, shared between the kernel and libc's
+ * <unistd.h>. procstat() fills in one of these for each process that
+ * exists, up to the number asked for, and returns how many there
+ * are; if that's more, ask again with a bigger buffer. Processes that
+ * have exited but not been waited for are gone already and aren't
+ * listed.
+ *
+ * The state is that of the most active thread: a process with a
+ * thread on a CPU is running, otherwise one with a thread on a run
+ * queue is ready, and so on. A process with no threads is on its way
+ * out. The run and wait times are as for getrusage (and like it need
+ * struct timeval).
+ */
+
+#define PROCSTAT_NAMELEN  32
+
+#define PS_RUNNING        0   /* a thread is on a CPU */
+#define PS_READY          1   /* ... or waiting for one */
+#define PS_SLEEPING       2   /* all threads are asleep */
+#define PS_EXITING        3   /* no threads left */
+
+/* One-letter abbreviations, indexed by the above */
+#define PS_STATECHARS     "RrSE"
+
+struct procstat {
+	__pid_t ps_pid;
+	__pid_t ps_ppid;		/* 0 if the parent has gone */
+	__u32 ps_state;			/* PS_* */
+	__u32 ps_nthreads;
+	__u32 ps_respages;		/* pages resident in memory */
+	__u32 ps_wspages;		/* working set: pages used lately */
+	__u32 ps_nfiles;		/* open file handles */
+	struct timeval ps_runtime;	/* time spent running */
+	struct timeval ps_waittime;	/* time spent waiting to run */
+	char ps_name[PROCSTAT_NAMELEN];	/* truncated if need be */
+};
+
+#endif /* _KERN_PROCSTAT_H_ */
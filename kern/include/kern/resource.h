@@ -46,10 +46,25 @@
 #define PRIO_PGRP	1
 #define PRIO_USER	2
 
+/*
+ * Scheduling classes for sched_setscheduler(). SCHED_OTHER threads
+ * share the CPUs by time slices, weighted by their nice values.
+ * SCHED_FIFO threads run ahead of all of them, and keep the CPU until
+ * they block or yield.
+ */
+#define SCHED_OTHER	0
+#define SCHED_FIFO	1
+
 /* flags for getrusage() */
 #define RUSAGE_SELF	0
 #define RUSAGE_CHILDREN	(-1)
 
+/*
+ * OS/161 doesn't separate user and system time: ru_utime is all the
+ * time spent running and ru_stime is zero. It adds ru_wtime, the time
+ * spent runnable but waiting for a CPU. Of the counts, only the
+ * context switches are kept; the rest are zero.
+ */
 struct rusage {
 	struct timeval ru_utime;
 	struct timeval ru_stime;
@@ -67,11 +82,19 @@ struct rusage {
 	__counter_t ru_nsignals;	/* signals delivered (count) */
 	__counter_t ru_nvcsw;		/* voluntary context switches (count)*/
 	__counter_t ru_nivcsw;		/* involuntary ditto (count) */
+	struct timeval ru_wtime;	/* time waiting to run (OS/161) */
 };
 
-/* limit codes for getrusage/setrusage */
+/*
+ * Limit codes for getrlimit/setrlimit. OS/161 has no users, so
+ * RLIMIT_NPROC is per process: how many children it may have that
+ * haven't been waited for. Only it, RLIMIT_NOFILE, RLIMIT_RSS (which
+ * pages a process out to itself rather than fail) and RLIMIT_AS are
+ * enforced; the rest are kept but have no effect. Limits are
+ * inherited by new processes and kept across exec.
+ */
 
-#define RLIMIT_NPROC		0	/* max procs per user (count) */
+#define RLIMIT_NPROC		0	/* max children per proc (count) */
 #define RLIMIT_NOFILE		1	/* max open files per proc (count) */
 #define RLIMIT_CPU		2	/* cpu usage (seconds) */
 #define RLIMIT_DATA		3	/* max .data/sbrk size (bytes) */
@@ -80,7 +103,8 @@ struct rusage {
 #define RLIMIT_RSS		6	/* max RSS (bytes) */
 #define RLIMIT_CORE		7	/* core file size (bytes) */
 #define RLIMIT_FSIZE		8	/* max file size (bytes) */
-#define __RLIMIT_NUM		9	/* number of limits */
+#define RLIMIT_AS		9	/* max address space size (bytes) */
+#define __RLIMIT_NUM		10	/* number of limits */
 
 struct rlimit {
 	__rlim_t rlim_cur;	/* soft limit */
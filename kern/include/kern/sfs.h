@@ -37,36 +37,140 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_BLOCKSIZE     512           /* size of blocks, by default */
+#define SFS_MAXBLOCKSIZE  8192          /* largest sb_blocksize */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
 
+/*
+ * The sizes below depend on the volume's block size, BS (see
+ * SFS_FEATURE_BLOCKSIZE).
+ */
+
 /* Number of bits in a block */
-#define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BITSPERBLOCK(bs) ((bs) * CHAR_BIT)
+
+/* # direct blks per indirect blk */
+#define SFS_DBPERIDB(bs) ((bs) / sizeof(uint32_t))
 
 /* Utility macro */
 #define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
 
 /* Size of free block bitmap (in bits) */
-#define SFS_FREEMAPBITS(nblocks) SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBITS(nblocks, bs) \
+	SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK(bs))
 
 /* Size of free block bitmap (in blocks) */
-#define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBLOCKS(nblocks, bs) \
+	(SFS_FREEMAPBITS(nblocks, bs)/SFS_BITSPERBLOCK(bs))
 
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/*
+ * Feature flags for sb_features. A volume with a flag not listed in
+ * SFS_FEATURES_KNOWN must not be mounted or checked.
+ *
+ * SFS_FEATURE_HASHDIRS: directories may be hashed (SFS_IFLAG_HASHDIR)
+ * so that a name can be found by reading one block. A hashed
+ * directory is a whole number of blocks, each a bucket; the entry
+ * for a name is in block SFS_DIRHASH(name) % (number of blocks). It
+ * is also a valid directory read the plain way, by scanning every
+ * slot, so clearing the flag is always safe.
+ */
+#define SFS_FEATURE_HASHDIRS  0x1
+#define SFS_FEATURE_JOURNAL   0x2
+#define SFS_FEATURE_BLOCKSIZE 0x4
+#define SFS_FEATURE_INLINE    0x8
+#define SFS_FEATURE_PREALLOC  0x10
+#define SFS_FEATURES_KNOWN    (SFS_FEATURE_HASHDIRS | SFS_FEATURE_JOURNAL | \
+			       SFS_FEATURE_BLOCKSIZE | SFS_FEATURE_INLINE | \
+			       SFS_FEATURE_PREALLOC)
+
+/*
+ * SFS_FEATURE_BLOCKSIZE: blocks are sb_blocksize bytes, a power of two
+ * from SFS_BLOCKSIZE to SFS_MAXBLOCKSIZE, rather than SFS_BLOCKSIZE.
+ * Block numbers everywhere count in those. The superblock, inodes,
+ * and the journal's header and commit block are still SFS_BLOCKSIZE
+ * bytes, at the start of their blocks, with the rest zero; directory,
+ * indirect, and freemap blocks are full of entries as ever.
+ */
+#define SFS_SB_BLOCKSIZE(sb) \
+	(((sb)->sb_features & SFS_FEATURE_BLOCKSIZE) ? \
+	 (sb)->sb_blocksize : SFS_BLOCKSIZE)
+
+/*
+ * SFS_FEATURE_INLINE: a regular file of at most SFS_INLINESIZE bytes
+ * may keep its contents in the inode itself, in sfi_inline, with
+ * SFS_IFLAG_INLINE set; it then has no blocks, and the bytes of
+ * sfi_inline past sfi_size are zero. New files start out that way and
+ * move to blocks of their own when they outgrow it.
+ */
+#define SFS_INLINESIZE    ((128-6-SFS_NDIRECT)*4)
+
+/*
+ * SFS_FEATURE_PREALLOC: a regular file with SFS_IFLAG_PREALLOC set
+ * may have blocks past its end, set aside for it by fallocate. Their
+ * contents are garbage until written: a block wholly past sfi_size
+ * counts as never written, and is cleared before it comes inside the
+ * file any other way. The kernel sets the feature when it first
+ * preallocates; older kernels, which would read those blocks, then
+ * won't mount the volume.
+ */
+
+/*
+ * sb_clean is SFS_CLEAN only while the volume isn't mounted and was
+ * last unmounted cleanly (or just made, or checked): the kernel clears
+ * it on disk when mounting and sets it again after the final sync at
+ * unmount. sfsck doesn't check a clean volume unless made to. Volumes
+ * from before there was such a thing have 0 there, so get checked.
+ */
+#define SFS_CLEAN         0x600dd15c
+
+/*
+ * SFS_FEATURE_JOURNAL: changes to metadata (inodes, indirect blocks,
+ * directories, the freemap) go first to the journal, the
+ * sb_journalblocks blocks from sb_journalstart, which mksfs marks in
+ * use. The journal holds at most one transaction at a time, from its
+ * start: a struct sfs_jheader listing the home blocks of the
+ * jh_nblocks blocks logged, the blocks themselves, and then a struct
+ * sfs_jcommit. It's written in one go, and is committed if the commit
+ * block matches the header and its checksum is right; then the
+ * blocks are written to their homes. A committed transaction found
+ * when mounting (or checking) is written home again before anything
+ * else, which is harmless if it had been already. The journal is
+ * cleared (jh_magic zeroed) when the volume is unmounted cleanly.
+ *
+ * The checksum is FNV-1a, as for directories below, over the bytes of
+ * jh_home[0..jh_nblocks) and then those of the blocks in order.
+ */
+#define SFS_JMAGIC        0x10c0b00c    /* jh_magic */
+#define SFS_JCMAGIC       0xc0aa1a7e    /* jc_magic */
+#define SFS_JHOMES        125           /* most blocks in a transaction */
+#define SFS_JOURNAL_SIZE  (SFS_JHOMES + 2) /* blocks mksfs makes */
+
+/* Inode flags for sfi_flags */
+#define SFS_IFLAG_HASHDIR 0x1     /* directory is hashed (see above) */
+#define SFS_IFLAG_INLINE  0x2     /* file data is in sfi_inline (ditto) */
+#define SFS_IFLAG_PREALLOC 0x4    /* may have blocks past EOF (ditto) */
+
+/*
+ * Directory hash: FNV-1a over the bytes of the name. For kernel and
+ * tools alike; changing it changes the on-disk format.
+ */
+#define SFS_DIRHASH_BASIS 2166136261U
+#define SFS_DIRHASH_PRIME 16777619U
+
 /*
  * On-disk superblock
  */
@@ -74,7 +178,30 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_features;			/* SFS_FEATURE_* flags */
+	uint32_t sb_clean;			/* SFS_CLEAN if unmounted cleanly */
+	uint32_t sb_journalstart;		/* 1st block of the journal */
+	uint32_t sb_journalblocks;		/* # of blocks in the journal */
+	uint32_t sb_blocksize;			/* bytes per block */
+	uint32_t reserved[113];			/* unused, set to 0 */
+};
+
+/*
+ * On-disk journal header and commit block (see above)
+ */
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JMAGIC */
+	uint32_t jh_seq;			/* transaction number */
+	uint32_t jh_nblocks;			/* # of blocks logged */
+	uint32_t jh_home[SFS_JHOMES];		/* where each belongs */
+};
+
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JCMAGIC */
+	uint32_t jc_seq;			/* same as jh_seq */
+	uint32_t jc_nblocks;			/* same as jh_nblocks */
+	uint32_t jc_sum;			/* checksum */
+	uint32_t jc_waste[128-4];		/* unused, set to 0 */
 };
 
 /*
@@ -86,7 +213,10 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IFLAG_* flags */
+	char sfi_inline[SFS_INLINESIZE];	/* inline file data, else 0 */
 };
 
 /*
@@ -97,5 +227,8 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/* Number of directory entries in a block of BS bytes */
+#define SFS_DIRPERBLOCK(bs) ((bs) / sizeof(struct sfs_direntry))
+
 
 #endif /* _KERN_SFS_H_ */
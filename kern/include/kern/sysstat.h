@@ -0,0 +1,72 @@
+#ifndef _KERN_SYSSTAT_H_
+#define _KERN_SYSSTAT_H_
+
+/*
+ * System call statistics, shared between the kernel and libc's
+ * <unistd.h>. Each CPU keeps a struct sysstat per call number;
+ * sysstat() copies out one CPU's, or with CPU -1 the sums over all of
+ * them (with the largest of the maxima), as an array of
+ * SYSSTAT_NCALLS indexed by call number.
+ *
+ * A call is counted on entry and its time (from entry to return to
+ * user mode, including any time spent asleep) when it returns, so
+ * calls that don't return (_exit, a successful execv) count but add
+ * no time. Errors are calls that returned one.
+ */
+
+#define SYSSTAT_NCALLS 140	/* one more than the highest call number */
+
+struct sysstat {
+	__u32 ss_calls;		/* times called */
+	__u32 ss_errors;	/* ... that failed */
+	__u64 ss_usecs;		/* total time, in microseconds */
+	__u32 ss_maxusecs;	/* longest single call */
+	__u32 ss_unused;
+};
+
+/*
+ * Printable names, indexed by call number, for the calls there are;
+ * the rest are NULL. Needs <kern/syscall.h>.
+ */
+#define SYSSTAT_NAMES { \
+	[SYS_fork] = "fork", [SYS_vfork] = "vfork", \
+	[SYS_execv] = "execv", [SYS__exit] = "_exit", \
+	[SYS_waitpid] = "waitpid", [SYS_getpid] = "getpid", \
+	[SYS_sbrk] = "sbrk", [SYS_mmap] = "mmap", \
+	[SYS_munmap] = "munmap", [SYS_mprotect] = "mprotect", \
+	[SYS_madvise] = "madvise", [SYS_mincore] = "mincore", \
+	[SYS_mlock] = "mlock", [SYS_munlock] = "munlock", \
+	[SYS_getrusage] = "getrusage", [SYS_getrlimit] = "getrlimit", \
+	[SYS_setrlimit] = "setrlimit", \
+	[SYS_getpriority] = "getpriority", \
+	[SYS_setpriority] = "setpriority", \
+	[SYS_open] = "open", [SYS_pipe] = "pipe", \
+	[SYS_dup2] = "dup2", [SYS_close] = "close", \
+	[SYS_read] = "read", [SYS_pread] = "pread", \
+	[SYS_readv] = "readv", [SYS_preadv] = "preadv", \
+	[SYS_getdirentry] = "getdirentry", \
+	[SYS_getdirentries] = "getdirentries", [SYS_write] = "write", \
+	[SYS_pwrite] = "pwrite", [SYS_writev] = "writev", \
+	[SYS_pwritev] = "pwritev", [SYS_lseek] = "lseek", \
+	[SYS_fstat] = "fstat", [SYS_stat] = "stat", \
+	[SYS_lstat] = "lstat", [SYS_ftruncate] = "ftruncate", \
+	[SYS_fsync] = "fsync", [SYS_ioctl] = "ioctl", \
+	[SYS_poll] = "poll", [SYS_link] = "link", \
+	[SYS_remove] = "remove", [SYS_mkdir] = "mkdir", \
+	[SYS_rmdir] = "rmdir", [SYS_rename] = "rename", \
+	[SYS_chdir] = "chdir", [SYS___getcwd] = "__getcwd", \
+	[SYS___time] = "__time", [SYS_sync] = "sync", \
+	[SYS_reboot] = "reboot", [SYS_vmstat] = "vmstat", \
+	[SYS_setaffinity] = "setaffinity", \
+	[SYS___threadfork] = "__threadfork", [SYS_spawnv] = "spawnv", \
+	[SYS_procstat] = "procstat", [SYS_sendfile] = "sendfile", \
+	[SYS_semwait] = "semwait", [SYS_sempost] = "sempost", \
+	[SYS_futex] = "futex", [SYS_sysstat] = "sysstat", \
+	[SYS_fallocate] = "fallocate", [SYS_bufstat] = "bufstat", \
+	[SYS_sched_setscheduler] = "sched_setscheduler", \
+	[SYS_sched_getscheduler] = "sched_getscheduler", \
+	[SYS_setgang] = "setgang", [SYS_mq_create] = "mq_create", \
+	[SYS_mq_send] = "mq_send", [SYS_mq_receive] = "mq_receive", \
+}
+
+#endif /* _KERN_SYSSTAT_H_ */
@@ -0,0 +1,73 @@
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * Virtual memory event counters, shared between the kernel and libc's
+ * <unistd.h>. Each CPU counts its own events; vmstat() returns one
+ * CPU's counters, or with CPU -1 the sum over all of them.
+ *
+ * Faults here are the ones that reach vm_fault: TLB misses satisfied
+ * by the assembly refill handler are not counted.
+ */
+
+#define VMSTAT_FAULTS            0   /* calls to vm_fault */
+#define VMSTAT_FAULTS_READ       1   /* ... of each type */
+#define VMSTAT_FAULTS_WRITE      2
+#define VMSTAT_FAULTS_READONLY   3
+#define VMSTAT_FAULTS_FAILED     4   /* ... that returned an error */
+#define VMSTAT_TLB_LOADS         5   /* entries written into the TLB */
+#define VMSTAT_TLB_RELOADS       6   /* faults on a page already resident */
+#define VMSTAT_ZERO_FILLS        7   /* frames zeroed on demand */
+#define VMSTAT_PREZEROED         8   /* ... or taken already zeroed from the pool */
+#define VMSTAT_ZERO_FRAME_MAPS   9   /* reads mapped to the shared zero frame */
+#define VMSTAT_COW_COPIES        10  /* copy-on-write faults that copied */
+#define VMSTAT_COW_REUSES        11  /* ... that found the frame unshared */
+#define VMSTAT_FORK_SHARED       12  /* pages shared by fork */
+#define VMSTAT_FORK_SWAPCOPIES   13  /* swap slots copied by fork */
+#define VMSTAT_ELF_READS         14  /* program pages read from the executable */
+#define VMSTAT_CACHE_MAPS        15  /* pages mapped from the page cache */
+#define VMSTAT_FAULT_AROUND      16  /* pages mapped ahead of a sequential fault */
+#define VMSTAT_EVICTIONS         17  /* pages written out to swap */
+#define VMSTAT_SWAPINS           18  /* pages read back from swap */
+#define VMSTAT_SHOOTDOWNS_SENT   19  /* TLB shootdowns sent to other CPUs */
+#define VMSTAT_SHOOTDOWNS_RECV   20  /* ... and handled here */
+#define VMSTAT_FRAME_ALLOCS      21  /* alloc_kpages calls that succeeded */
+#define VMSTAT_FRAME_FREES       22  /* free_kpages calls */
+#define VMSTAT_PAGE_LOANS        23  /* pages lent out copy-on-write (pipes) */
+#define VMSTAT_PAGE_FLIPS        24  /* ... and mapped in instead of copied */
+#define VMSTAT_STACK_GROWS       25  /* faults that grew the stack down */
+#define VMSTAT_MERGE_SCANS       26  /* pages looked at for merging */
+#define VMSTAT_PAGES_MERGED      27  /* ... and merged with an identical one */
+#define VMSTAT_ZSWAP_STORES      28  /* evictions kept in the compressed pool */
+#define VMSTAT_ZSWAP_LOADS       29  /* swapins served from the pool */
+#define VMSTAT_ZSWAP_WRITEBACKS  30  /* pool pages moved out to disk */
+#define VMSTAT_PREFAULTS         31  /* pages brought in early by MADV_WILLNEED */
+#define VMSTAT_RECLAIMS          32  /* times the caches were shrunk for memory */
+#define VMSTAT_OOM_KILLS         33  /* processes killed for memory */
+#define VMSTAT_RSS_EVICTIONS     34  /* pages paged out to keep to RLIMIT_RSS */
+#define VMSTAT_SWAP_CLUSTERS     35  /* writebacks of several pages at once */
+#define VMSTAT_SWAP_RAHITS       36  /* swapins served from swap read-ahead */
+#define VMSTAT_COMPACTIONS       37  /* free blocks made by moving user pages */
+#define VMSTAT_PAGES_MIGRATED    38  /* ... the pages moved */
+#define VMSTAT_NCOUNTERS         39
+
+/* Printable names, indexed by the above */
+#define VMSTAT_NAMES { \
+        "faults", "read faults", "write faults", "readonly faults", \
+        "failed faults", "tlb loads", "tlb reloads", "zero fills", \
+        "prezeroed", "zero frame maps", "cow copies", "cow reuses", \
+        "fork shared", "fork swap copies", "elf reads", "cache maps", \
+        "fault around", "evictions", "swapins", "shootdowns sent", \
+        "shootdowns recv", "frame allocs", "frame frees", "page loans", \
+        "page flips", "stack grows", "merge scans", "pages merged", \
+        "zswap stores", "zswap loads", "zswap writebacks", \
+        "prefaults", "reclaims", "oom kills", "rss evictions", \
+        "swap clusters", "swap readahead hits", "compactions", \
+        "pages migrated" \
+}
+
+struct vmstat {
+        __u32 vs_count[VMSTAT_NCOUNTERS];
+};
+
+#endif /* _KERN_VMSTAT_H_ */
@@ -0,0 +1,34 @@
+/*
+ * Kernel information pages.
+ */
+
+#ifndef _KINFO_H_
+#define _KINFO_H_
+
+#include <kern/kinfo.h>
+
+/*
+ * The layout and the user side are in <kern/kinfo.h>; each address
+ * space keeps its own page (see as_setkinfo) and the VM maps it, and
+ * the shared time page, at the fixed addresses on demand.
+ *
+ * Functions:
+ *
+ *    kinfo_bootstrap - set up the shared time page. Call once the
+ *              VM system is up.
+ *
+ *    kinfo_hardclock - update the time in it. Called from hardclock().
+ *
+ *    kinfo_timepage - return the physical address of the time page,
+ *              or 0 before kinfo_bootstrap.
+ *
+ *    kinfo_set - fill in KPAGE, a process's page, for process PID,
+ *              whose parent is PPID.
+ */
+
+void kinfo_bootstrap(void);
+void kinfo_hardclock(void);
+paddr_t kinfo_timepage(void);
+void kinfo_set(vaddr_t kpage, pid_t pid, pid_t ppid);
+
+#endif /* _KINFO_H_ */
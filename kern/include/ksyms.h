@@ -0,0 +1,32 @@
+/*
+ * Kernel symbol table.
+ */
+
+#ifndef _KSYMS_H_
+#define _KSYMS_H_
+
+/*
+ * The kernel's function symbols, sorted by address, so as to be able
+ * to say what code an address is in. The table is generated at link
+ * time (see conf/gensyms.sh) from the kernel's own symbols; there is
+ * one entry per symbol, which covers everything from its address up
+ * to the next one's.
+ *
+ * ksym_lookup returns the name of the symbol covering ADDR, handing
+ * back ADDR's offset from its start in OFFSET, or NULL if ADDR is
+ * below every symbol. ksym_index is the same but returns the index
+ * in ksyms[], or -1.
+ */
+
+struct ksym {
+	vaddr_t ks_addr;
+	const char *ks_name;
+};
+
+extern const struct ksym ksyms[];
+extern const unsigned nksyms;
+
+const char *ksym_lookup(vaddr_t addr, vaddr_t *offset);
+int ksym_index(vaddr_t addr);
+
+#endif /* _KSYMS_H_ */
@@ -0,0 +1,47 @@
+/*
+ * Kernel region timing.
+ */
+
+#ifndef _KTIME_H_
+#define _KTIME_H_
+
+/*
+ * ktime_begin(tag) and ktime_end(tag) bracket a piece of kernel code,
+ * and for each tag the kernel keeps how many times it ran, the total
+ * and longest times, and a histogram of the times in powers of two,
+ * all in CPU cycles. The start time is kept in the thread, so a
+ * region may sleep or move to another CPU in the middle and each tag
+ * can be open once per thread at a time. A region whose end is never
+ * reached (an error return, say) just isn't counted.
+ *
+ * The cycle counter itself can't be used, as it's restarted by the
+ * timer and differs between CPUs, so times are read from the
+ * real-time clock and converted; on System/161 the two tick together.
+ *
+ * Functions:
+ *
+ *    ktime_begin - start timing TAG in the current thread.
+ *
+ *    ktime_end - stop timing TAG and count the time.
+ *
+ *    ktime_reset - clear the counts.
+ *
+ *    ktime_print - print the counts, with the histograms.
+ */
+
+/* Tags */
+#define KTIME_FORK	0	/* sys_fork */
+#define KTIME_EXEC	1	/* sys_execv, successful ones */
+#define KTIME_FAULT	2	/* vm_fault on user addresses */
+#define KTIME_READ	3	/* the read calls */
+#define KTIME_WRITE	4	/* the write calls */
+#define KTIME_NTAGS	5
+
+#define KTIME_NAMES { "fork", "execv", "fault", "read", "write" }
+
+void ktime_begin(unsigned tag);
+void ktime_end(unsigned tag);
+void ktime_reset(void);
+void ktime_print(void);
+
+#endif /* _KTIME_H_ */
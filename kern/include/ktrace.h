@@ -0,0 +1,69 @@
+/*
+ * Kernel event tracing.
+ */
+
+#ifndef _KTRACE_H_
+#define _KTRACE_H_
+
+#include "opt-ktrace.h"
+
+/*
+ * A trace is a stream of timestamped binary events, each recording
+ * what happened, on which CPU and in which thread, and two words
+ * saying more. Each CPU writes its events into its own fixed-size
+ * ring, without locking, and when a ring is full the oldest events
+ * are overwritten. Recording an event costs reading the clock
+ * and filling in a few words, so it can go in hot paths, unlike
+ * kprintf.
+ *
+ * The whole thing is only compiled in with "options ktrace" in the
+ * kernel config; otherwise KTRACE() is nothing. Even then nothing is
+ * recorded until it's turned on, from the "ktrace" menu command.
+ *
+ * KTRACE(type, a, b) records an event.
+ *
+ * Functions:
+ *
+ *    ktrace_start - clear the rings and start recording. Fails with
+ *              ENOMEM.
+ *
+ *    ktrace_stop - stop recording; the events are kept.
+ *
+ *    ktrace_print - decode the events and print them in time order,
+ *              across all CPUs. For events ending something (a
+ *              system call, a fault, a disk request), it also prints
+ *              how long that took, if the start is still in the
+ *              trace.
+ *
+ *    ktrace_record - what KTRACE() calls.
+ */
+
+/* Event types, A and B */
+#define KTRACE_SWITCH     1	/* thread switch: next thread, old state */
+#define KTRACE_SYSCALL    2	/* system call: call number, - */
+#define KTRACE_SYSRET     3	/* system call return: call number, error */
+#define KTRACE_FAULT      4	/* vm_fault: fault type, address */
+#define KTRACE_FAULTDONE  5	/* vm_fault return: error, address */
+#define KTRACE_DISKQ      6	/* disk request queued: request, sector */
+#define KTRACE_DISKSTART  7	/* ... started: request, sectors|KTRACE_WRITE */
+#define KTRACE_DISKDONE   8	/* ... finished: request, error */
+
+#define KTRACE_WRITE      0x80000000	/* for KTRACE_DISKSTART */
+
+#if OPT_KTRACE
+
+#define KTRACE(type, a, b) \
+	ktrace_record(type, (uint32_t)(a), (uint32_t)(b))
+
+void ktrace_record(unsigned type, uint32_t a, uint32_t b);
+int ktrace_start(void);
+void ktrace_stop(void);
+void ktrace_print(void);
+
+#else
+
+#define KTRACE(type, a, b) ((void)0)
+
+#endif
+
+#endif /* _KTRACE_H_ */
@@ -114,10 +114,16 @@ extern uint32_t dbflags;
  * Random number generator, using the random device.
  *
  * random() returns a number between 0 and randmax() inclusive.
+ *
+ * prandom() is much cheaper, never touching the device once seeded,
+ * but predictable from its output: fine for hash seeds, sampling and
+ * tests, not for anything that must not be guessed. Any 32-bit value
+ * may come back. Both may be called from interrupt handlers.
  */
 #define RANDOM_MAX (randmax())
 uint32_t randmax(void);
 uint32_t random(void);
+uint32_t prandom(void);
 
 /*
  * Kernel heap memory allocation. Like malloc/free.
@@ -125,10 +131,22 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_trace turns on (or off) extra accounting printed by
+ * kheap_printstats: a histogram of kmalloc latency, and/or counts of
+ * allocations by call site.
+ *
+ * kheap_usage reports how many bytes of small blocks are outstanding
+ * and how many bytes of pages are held to carve them from.
  */
+#define KHEAP_TRACE_LATENCY 1
+#define KHEAP_TRACE_SITES   2
+
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_trace(int what, bool on);
+void kheap_usage(size_t *used, size_t *held);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
@@ -151,6 +169,8 @@ char *strtok_r(char *buf, const char *seps, char **context);
 void *memcpy(void *dest, const void *src, size_t len);
 void *memmove(void *dest, const void *src, size_t len);
 void *memset(void *block, int ch, size_t len);
+int memcmp(const void *a, const void *b, size_t len);
+void *memchr(const void *block, int ch, size_t len);
 void bzero(void *ptr, size_t len);
 int atoi(const char *str);
 
@@ -177,6 +197,12 @@ void beep(void);
  * kprintf_bootstrap sets up a lock for kprintf and should be called
  * during boot once malloc is available and before any additional
  * threads are created.
+ *
+ * kprintf_async_bootstrap, called once the work queues are running,
+ * turns on per-CPU buffering of kprintf output, which is then printed
+ * to the console by the work queue threads. kprintf_flush prints out
+ * what's buffered now; kprintf_sync does that and turns buffering off
+ * again, for shutdown.
  */
 int kprintf(const char *format, ...) __PF(1,2);
 __DEAD void panic(const char *format, ...) __PF(1,2);
@@ -186,6 +212,9 @@ __DEAD void badassert(const char *expr, const char *file,
 void kgets(char *buf, size_t maxbuflen);
 
 void kprintf_bootstrap(void);
+void kprintf_async_bootstrap(void);
+void kprintf_flush(void);
+void kprintf_sync(void);
 
 /*
  * Other miscellaneous stuff
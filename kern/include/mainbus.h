@@ -52,6 +52,15 @@ void mainbus_interrupt(struct trapframe *);
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
 
+/* Find the size of any RAM past the I/O area, beyond kseg0's reach. */
+size_t mainbus_highramsize(void);
+
+/* Have this CPU's timer interrupt NSECS from now; see <clock.h>. */
+void mainbus_timer_set(uint32_t nsecs);
+
+/* Cycles since this CPU's timer last interrupted (see mainbus_timer_set). */
+uint32_t mainbus_cycles(void);
+
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
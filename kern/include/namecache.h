@@ -0,0 +1,51 @@
+/*
+ * Name cache.
+ */
+
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+/*
+ * The name cache remembers the results of looking names up in
+ * directories, so that a file system needn't search the directory
+ * again: (directory vnode, name) -> (inode number, cookie), where the
+ * cookie is the file system's to use, e.g. for the entry's position
+ * in the directory. An inode number of 0 is a negative entry: the name
+ * was looked for and isn't there.
+ *
+ * Entries don't hold references to anything, and the cache doesn't
+ * know when directories change; the file system uses it under its
+ * own per-directory locking and must keep it up to date. That is,
+ * when a name is added to or removed from a directory it must enter
+ * or remove that name, and before a directory vnode is reclaimed it
+ * must purge the directory's entries. Names longer than the cache
+ * keeps are simply not cached. The cache is a bounded LRU; anything
+ * may drop out of it at any time.
+ *
+ * Functions:
+ *
+ *    namecache_lookup - look for an entry. Returns true, handing back
+ *              the inode number and cookie, on a hit (positive or
+ *              negative), and false if there is no entry.
+ *
+ *    namecache_enter - add or replace an entry.
+ *
+ *    namecache_remove - drop the entry for one name, if there is one.
+ *
+ *    namecache_purge - drop all the entries for a directory.
+ *
+ *    namecache_printstats - print hit and miss counts.
+ */
+
+struct vnode;
+
+bool namecache_lookup(struct vnode *dir, const char *name,
+		      ino_t *ino, int *cookie);
+void namecache_enter(struct vnode *dir, const char *name,
+		     ino_t ino, int cookie);
+void namecache_remove(struct vnode *dir, const char *name);
+void namecache_purge(struct vnode *dir);
+
+void namecache_printstats(void);
+
+#endif /* _NAMECACHE_H_ */
@@ -0,0 +1,75 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches: a slab allocator for fixed-size kernel objects.
+ *
+ * Each cache carves whole pages ("slabs") into objects of exactly its
+ * size, so there is no rounding up to a kmalloc size class. Objects
+ * can also be kept constructed: the cache's CTOR is run on each object
+ * once, when the slab it lives in is created, and DTOR when the slab
+ * is given back. Objects come out of objcache_alloc in the constructed
+ * state and must be put back in that state before objcache_free. (A
+ * cache without a ctor just hands out uninitialized memory.) CTOR
+ * returns 0 or an error code; either may be NULL.
+ *
+ * Objects must fit at least one to a page, less a slab header.
+ *
+ * A cache may be created with objcache_create, or declared statically
+ * with OBJCACHE_INITIALIZER, like a spinlock. Either way the structure
+ * is public only so it needn't be malloc'd; use the functions.
+ *
+ * A cache declared with OBJCACHE_TYPESAFE_INITIALIZER instead never
+ * gives its slabs back, so memory that has once held one of its
+ * objects always does: a freed object may be reused, but stays a
+ * constructed object of the type. That lets code look at an object it
+ * has no reference to, as long as it checks afterwards that it got the
+ * one it wanted (see filetable_get).
+ *
+ * objcache_printstats prints usage for every cache that has been used.
+ */
+
+#include <spinlock.h>
+
+struct slab;
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;			/* object size, as given */
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+	bool oc_typesafe;		/* never destroy slabs */
+
+	struct spinlock oc_lock;	/* protects everything below */
+	size_t oc_stride;		/* bytes per object, 0 until first use */
+	unsigned oc_perslab;		/* objects per slab */
+	struct slab *oc_partial;	/* slabs with free objects */
+	struct slab *oc_full;		/* slabs with none */
+	unsigned oc_nslabs;
+	unsigned oc_nempty;		/* slabs with no objects in use */
+	unsigned oc_inuse;		/* objects handed out */
+	unsigned oc_allocs;		/* lifetime counts */
+	unsigned oc_frees;
+	unsigned oc_ctors;
+	struct objcache *oc_next;	/* list of all caches */
+	bool oc_listed;			/* on that list yet? */
+};
+
+#define OBJCACHE_INITIALIZER(name, size, ctor, dtor) \
+	{ name, size, ctor, dtor, false, SPINLOCK_INITIALIZER, \
+	  0, 0, NULL, NULL, 0, 0, 0, 0, 0, 0, NULL, false }
+#define OBJCACHE_TYPESAFE_INITIALIZER(name, size, ctor, dtor) \
+	{ name, size, ctor, dtor, true, SPINLOCK_INITIALIZER, \
+	  0, 0, NULL, NULL, 0, 0, 0, 0, 0, 0, NULL, false }
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 int (*ctor)(void *obj),
+				 void (*dtor)(void *obj));
+void objcache_destroy(struct objcache *oc);
+
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+
+void objcache_printstats(void);
+
+#endif /* _OBJCACHE_H_ */
@@ -34,7 +34,7 @@
 #ifndef _OPENFILE_H_
 #define _OPENFILE_H_
 
-#include <spinlock.h>
+#include <atomic.h>
 
 
 /*
@@ -51,21 +51,31 @@
 struct openfile {
 	struct vnode *of_vnode;
 	int of_accmode;	/* from open: O_RDONLY, O_WRONLY, or O_RDWR */
+	bool of_direct;	/* from open: O_DIRECT */
 
 	struct lock *of_offsetlock;	/* lock for of_offset */
 	off_t of_offset;
 
-	struct spinlock of_reflock;	/* lock for of_refcount */
-	int of_refcount;
+	struct atomic of_refcount;
 };
 
 /* open a file (args must be kernel pointers; destroys filename) */
 int openfile_open(char *filename, int openflags, mode_t mode,
 		  struct openfile **ret);
 
+/* make a pipe, returning its read and write ends */
+int openfile_openpipe(struct openfile **readret, struct openfile **writeret);
+
+/* make a message queue, open for reading and writing */
+int openfile_openmq(unsigned msgsize, unsigned maxmsgs,
+		    struct openfile **ret);
+
 /* adjust the refcount on an openfile */
 void openfile_incref(struct openfile *);
 void openfile_decref(struct openfile *);
 
+/* add a reference unless it has already been dropped to zero */
+bool openfile_tryincref(struct openfile *);
+
 
 #endif /* _OPENFILE_H_ */
@@ -0,0 +1,56 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for memory-mapped files and program text.
+ *
+ * Each page of a file that is mapped anywhere has one frame, shared by
+ * every mapping of it (see region_cached_page in vm.c). The cache holds one reference to the frame and
+ * each mapping holds another (taken with frame_incref). When the last
+ * mapping lets go, the page is written back if it was dirtied and the
+ * frame is freed.
+ *
+ * These do file I/O, so none of them may be called with the VM lock
+ * held, except pagecache_mark_dirty, which does no I/O.
+ *
+ *    pagecache_bootstrap - set up the cache.
+ *
+ *    pagecache_get - return the frame for page OFFSET of VN, reading it
+ *                in (into the spare frame KPAGE) if it isn't cached.
+ *                The caller gets a reference to the frame; it must
+ *                free KPAGE itself if it was not used.
+ *
+ *    pagecache_mark_dirty - note that the page has been written.
+ *
+ *    pagecache_release - call after dropping a mapping's reference to
+ *                the page; writes it back and frees it if that was the
+ *                last mapping.
+ *
+ *    pagecache_retain - keep VN's pages cached after their last mapping
+ *                goes, up to PAGECACHE_IDLE_MAX such pages in all, so
+ *                the next mapping needn't read them in again. Used for
+ *                the text of programs that will probably be run again.
+ *                Returns false if too many vnodes are retained already.
+ *                Retaining a vnode twice is the same as once.
+ *
+ *    pagecache_forget - undo pagecache_retain, freeing VN's pages that
+ *                nothing maps.
+ *
+ *    pagecache_shrink - free every retained page that nothing maps,
+ *                for when memory is short, and return how many. Pages
+ *                aren't retained at all while memory is low (see
+ *                frame_pressure).
+ */
+
+struct vnode;
+
+void pagecache_bootstrap(void);
+int pagecache_get(struct vnode *vn, off_t offset, vaddr_t kpage,
+                  paddr_t *paddr_ret, bool *used_kpage);
+void pagecache_mark_dirty(struct vnode *vn, off_t offset);
+void pagecache_release(struct vnode *vn, off_t offset);
+bool pagecache_retain(struct vnode *vn);
+void pagecache_forget(struct vnode *vn);
+unsigned pagecache_shrink(void);
+
+#endif /* _PAGECACHE_H_ */
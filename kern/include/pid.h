@@ -58,6 +58,17 @@ void pid_unalloc(pid_t targetpid);
  */
 void pid_disown(pid_t targetpid);
 
+/*
+ * Get the parent of a pid, or INVALID_PID if it has been disowned.
+ */
+pid_t pid_getppid(pid_t targetpid);
+
+/*
+ * Count the current process's children that haven't been waited for,
+ * but stop at MAX.
+ */
+unsigned pid_countchildren(unsigned max);
+
 /*
  * Set the exit status of the current thread to status.  Wakes up any threads
  * waiting to read this status, and decrefs the current thread's pid.
@@ -65,8 +76,9 @@ void pid_disown(pid_t targetpid);
 void pid_setexitstatus(int status);
 
 /*
- * Causes the current thread to wait for the thread with pid PID to
- * exit, returning the exit status when it does.
+ * Causes the current thread to wait for the thread with pid PID, or
+ * with WAIT_ANY any child, to exit, returning the exit status when it
+ * does.
  */
 int pid_wait(pid_t targetpid, int *status, int flags, pid_t *retpid);
 
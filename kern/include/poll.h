@@ -0,0 +1,85 @@
+/*
+ * Waiting on several objects at once, for poll().
+ */
+
+#ifndef _POLL_H_
+#define _POLL_H_
+
+#include <spinlock.h>
+#include <kern/poll.h>
+
+/*
+ * Anything a process may want to wait for without blocking in read or
+ * write -- a pipe, the console, a semfs semaphore -- has a pollq, and
+ * calls pollq_wakeup on it whenever its state changes in a way that
+ * may make it ready (data arrives, room appears, the other end goes).
+ *
+ * A poll() call has a pollset, with a pollentry for each file it is
+ * looking at. That file's VOP_POLL puts the entry on the object's
+ * pollq with pollq_register and then reports which events are ready
+ * now; registering first means a change that happens while the check
+ * is going on isn't missed. If nothing is ready, the caller sleeps in
+ * pollset_wait until a pollq the set is on is woken, or the timeout
+ * set by pollset_timeout runs out, and checks again. Entries stay on
+ * their queues until pollset_destroy.
+ *
+ * The caller must keep the files in the set open (hold references)
+ * until pollset_destroy, so that the pollqs they're on stay put. An
+ * object's pollq may only be cleaned up when nothing is on it.
+ *
+ * pollq_wakeup needs only spinlocks, so may be called from interrupt
+ * handlers and with other locks held.
+ *
+ * Functions:
+ *
+ *    pollq_init/pollq_cleanup - set up and tear down a pollq, if it
+ *              isn't statically initialized with POLLQ_INITIALIZER.
+ *
+ *    pollq_register - put entry PE on the queue, if it isn't on it
+ *              already. PE may be NULL, meaning the caller only wants
+ *              to know what's ready and won't wait.
+ *
+ *    pollq_wakeup - wake every poller on the queue.
+ *
+ *    pollset_create - make a set of N entries, for pollset_entry to
+ *              hand out by index.
+ *
+ *    pollset_timeout - arrange for pollset_wait to give up TS from
+ *              now. Without it, pollset_wait waits forever.
+ *
+ *    pollset_wait - wait for the set to be woken since the last call.
+ *              Returns false if the time ran out instead.
+ *
+ *    pollset_destroy - take the entries off their queues and free
+ *              the set.
+ */
+
+struct pollset;			/* Opaque. */
+struct timespec;		/* in <kern/time.h> */
+
+struct pollentry {
+	struct pollset *pe_set;
+	struct pollq *pe_q;		/* the queue it's on, or NULL */
+	struct pollentry *pe_next;
+	struct pollentry **pe_prevp;	/* what points at us on the queue */
+};
+
+struct pollq {
+	struct spinlock pq_lock;
+	struct pollentry *pq_entries;
+};
+
+#define POLLQ_INITIALIZER { SPINLOCK_INITIALIZER, NULL }
+
+void pollq_init(struct pollq *pq);
+void pollq_cleanup(struct pollq *pq);
+void pollq_register(struct pollq *pq, struct pollentry *pe);
+void pollq_wakeup(struct pollq *pq);
+
+struct pollset *pollset_create(unsigned n);
+struct pollentry *pollset_entry(struct pollset *ps, unsigned i);
+void pollset_timeout(struct pollset *ps, const struct timespec *ts);
+bool pollset_wait(struct pollset *ps);
+void pollset_destroy(struct pollset *ps);
+
+#endif /* _POLL_H_ */
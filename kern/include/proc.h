@@ -37,9 +37,13 @@
  */
 
 #include <spinlock.h>
+#include <kern/time.h>
+#include <kern/resource.h> /* uses struct timeval */
 #include <thread.h> /* required for struct threadarray */
 
 struct addrspace;
+struct procstat;
+struct semaphore;
 struct vnode;
 
 /*
@@ -53,18 +57,32 @@ struct vnode;
  */
 struct proc {
 	char *p_name;			/* Name of this process */
-	struct lock *p_threadslock;	/* Lock for p_threads */
+	struct lock *p_threadslock;	/* Lock for p_threads and p_exec */
 	struct threadarray p_threads;	/* Threads in this process */
+	bool p_exec;			/* In execv; no new threads */
 	struct spinlock p_lock;		/* Lock for rest of this structure */
 	pid_t p_pid;			/* Process ID */
+	bool p_killed;			/* by the OOM killer; exit ASAP */
+	struct rlimit p_rlimits[__RLIMIT_NUM]; /* see <kern/resource.h> */
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	struct semaphore *p_vforkwait;	/* if borrowed by vfork, V when done */
+	struct proc *p_vforkparent;	/* ... and who from */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
+	char *p_cwdname;		/* its name for getcwd, or NULL */
 	struct filetable *p_filetable;	/* table of open files */
 
+	/* Accounting, protected by p_threadslock; see proc_getstats */
+	struct schedstats p_stats;	/* of threads that have left */
+	struct schedstats p_childstats;	/* of children waited for */
+
+	/* On the list of all processes; see proc_snapshot */
+	struct proc *p_allnext;
+	struct proc **p_allprevp;
+
 	/* add more material here as needed */
 };
 
@@ -80,21 +98,91 @@ int proc_create_runprogram(const char *name, struct proc **ret);
 /* Create a fresh process for use by fork() */
 int proc_fork(struct proc **ret);
 
-/* Undo proc_fork if nothing's run in the new process yet. */
+/*
+ * Create a process for vfork(), which borrows the current process's
+ * address space until it execs or exits and then does V(WAIT). Fails
+ * with EINVAL if the current process has more than one thread.
+ */
+int proc_vfork(struct proc **ret, struct semaphore *wait);
+
+/*
+ * Create a child process running in AS, a fresh address space, for
+ * spawn. AS belongs to the new process only if this succeeds.
+ */
+int proc_spawn(struct proc **ret, struct addrspace *as);
+
+/* Undo any of those if nothing's run in the new process yet. */
 void proc_unfork(struct proc *proc);
 
+/*
+ * If PROC's address space AS is borrowed from its parent by vfork,
+ * give it back (without clearing p_addrspace) and return true.
+ */
+bool proc_vfork_return(struct proc *proc, struct addrspace *as);
+
+/*
+ * Sum the scheduling accounting of PROC's threads, present and past,
+ * or with CHILDREN, of the children it has waited for (and theirs).
+ */
+void proc_getstats(struct proc *proc, bool children, struct schedstats *ret);
+
+/*
+ * Describe each process that exists in BUF, which has room for MAX,
+ * for ps; returns how many there are, which may be more than MAX.
+ */
+unsigned proc_snapshot(struct procstat *buf, unsigned max);
+
+/*
+ * Resource limits of the current process: proc_getrlimit returns the
+ * (soft) limit on RESOURCE, RLIM_INFINITY for a kernel thread;
+ * proc_setrlimit changes both limits, which can only be lowered, and
+ * the soft limit no higher than the hard one (EINVAL if so, or if
+ * RESOURCE is no limit code; EPERM to raise the hard limit).
+ * proc_checkchildren fails with EAGAIN if the process already has as
+ * many children as RLIMIT_NPROC lets it.
+ */
+rlim_t proc_getrlimit(int resource);
+int proc_setrlimit(int resource, const struct rlimit *rl);
+int proc_checkchildren(void);
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
+/*
+ * Bracket replacing the process image in execv: fails with EBUSY if
+ * the process has other threads, and keeps new ones from being added
+ * until proc_exec_end.
+ */
+int proc_exec_begin(struct proc *proc);
+void proc_exec_end(struct proc *proc);
+
 /*
  * Cause the current process to exit. The current thread switches
  * itself into the kernel process.
  *
+ * If the process has other threads, only the current one goes, and
+ * the process carries on until the last one exits; its exit status is
+ * the one that last thread gives.
+ *
  * The status code should be prepared with one of the _MKWAIT macros
  * defined in <kern/wait.h>.
  */
 void proc_exit(int status);
 
+/*
+ * The OOM killer (see vm_reclaim). proc_kill_largest kills the user
+ * process with the most pages resident, and waits a while for it to
+ * go. It returns true if it went; false if there was nobody to kill,
+ * if the victim didn't exit in time (it may be asleep in the kernel),
+ * or if it was the caller's own process, whose allocation should then
+ * just fail. While one victim is still exiting no other is chosen.
+ *
+ * A killed process's threads exit, as if on SIGKILL, once they head
+ * back to user mode: the trap code calls proc_checkkill on the way.
+ */
+bool proc_kill_largest(void);
+void proc_checkkill(void);
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
@@ -0,0 +1,41 @@
+/*
+ * Kernel profiler.
+ */
+
+#ifndef _PROF_H_
+#define _PROF_H_
+
+/*
+ * A sampling profiler: while it's on, every hardclock records the PC
+ * the clock interrupt came in at, in a buffer for the CPU concerned.
+ * Kernel PCs are kept, to be looked up in the kernel symbol table
+ * (<ksyms.h>); user ones are only counted. Idle CPUs don't tick, so
+ * time spent idle isn't sampled at all.
+ *
+ * Functions:
+ *
+ *    prof_start - throw away any old samples and start sampling.
+ *              Fails with ENOMEM.
+ *
+ *    prof_stop - stop sampling; the samples are kept.
+ *
+ *    prof_hardclock - take a sample, if on. Called from hardclock().
+ *
+ *    prof_print - print how many samples were taken where, busiest
+ *              functions first, up to MAX of them.
+ *
+ * and, machine-dependent:
+ *
+ *    prof_interrupted_pc - return the PC at which the interrupt being
+ *              handled came in, and set USER to whether it was in
+ *              user mode. Only valid in an interrupt handler.
+ */
+
+int prof_start(void);
+void prof_stop(void);
+void prof_hardclock(void);
+void prof_print(unsigned max);
+
+vaddr_t prof_interrupted_pc(bool *user);
+
+#endif /* _PROF_H_ */
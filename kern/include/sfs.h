@@ -41,6 +41,7 @@
  */
 #include <fs.h>
 #include <vnode.h>
+#include <spinlock.h>
 
 /*
  * Get on-disk structures and constants that are made available to
@@ -50,25 +51,96 @@
 
 /*
  * In-memory inode
+ *
+ * sv_lock covers sv_i, sv_dirty, and the file's (or directory's)
+ * contents; sfs_dirtylock covers the dirty list links. It may be taken recursively, since a read or write can
+ * fault on a page mapped from the same file; use sfs_vnode_lock and
+ * sfs_vnode_unlock rather than the lock directly.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* protects the above and the data */
+	unsigned sv_lockdepth;          /* recursion count for sv_lock */
+	off_t sv_ranext;                /* where the last read ended */
+	uint32_t sv_rawindow;           /* read-ahead window, in blocks */
+	uint32_t sv_raend;              /* file block read ahead up to */
+	daddr_t sv_reserved;            /* blocks held for it to grow into */
+	unsigned sv_nreserved;          /* ... and how many */
+	bool sv_rsvkeep;                /* use them up in order (prealloc) */
+	uint32_t sv_bmfile;             /* bmap cache: a run of file blocks */
+	daddr_t sv_bmdisk;              /* ... where the first is on disk */
+	uint32_t sv_bmlen;              /* ... and how many (0 for none) */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash bucket */
+	struct sfs_vnode *sv_listnext;  /* next on sfs_vnlist */
+	struct sfs_vnode **sv_listprevp; /* what points at us there */
+	struct sfs_vnode *sv_dirtynext; /* next on sfs_dirtylist */
+	struct sfs_vnode **sv_dirtyprevp; /* ... what points at us, or NULL */
 };
 
+/* Buckets in the table of loaded vnodes, hashed by inode number */
+#define SFS_VNHASH 128
+
 /*
  * In-memory info for a whole fs volume
+ *
+ * Lock order: a directory's sv_lock, then the sv_lock of a file in it,
+ * then sfs_vnlock, then sfs_freemaplock, then sfs_jlock; sfs_reaplock
+ * is taken with any of those held, but nothing after it. The buffer
+ * cache's own lock comes after all of them. On a volume with a journal
+ * an operation that changes metadata starts (with sfs_jbegin) before
+ * taking any of them; see sfs_journal.c.
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	unsigned sfs_blocksize;		/* bytes per block (see kern/sfs.h) */
+	struct lock *sfs_vnlock;        /* protects the vnode table */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH]; /* vnodes loaded, by ino */
+	struct sfs_vnode *sfs_vnlist;   /* ... and all in a list */
+	unsigned sfs_nvnodes;           /* ... and how many */
+	struct spinlock sfs_dirtylock;  /* protects the dirty list */
+	struct sfs_vnode *sfs_dirtylist; /* vnodes with sv_dirty set */
+	unsigned sfs_ndirty;            /* ... and how many */
+	struct lock *sfs_freemaplock;   /* protects the freemap and sb */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+
+	/* Unlinked files still to be freed (see sfs_inode.c) */
+	struct lock *sfs_reaplock;      /* protects the state below */
+	struct cv *sfs_reapcv;          /* for changes to it */
+	struct sfs_orphan *sfs_orphans; /* the files' inodes */
+	bool sfs_reapstop;              /* reaper thread is to exit */
+	bool sfs_reaprunning;           /* ... and hasn't yet */
+
+	/*
+	 * Journal, if the volume has one (see sfs_journal.c). The
+	 * blocks freed since the last commit are under sfs_freemaplock;
+	 * the state is under sfs_jlock; the rest is the committer's.
+	 */
+	bool sfs_journaled;             /* SFS_FEATURE_JOURNAL is set */
+	struct bitmap *sfs_jfreed;      /* blocks freed, not yet free */
+	unsigned sfs_jnfreed;           /* ... and how many */
+	struct lock *sfs_jlock;         /* protects the state below */
+	struct cv *sfs_jcv;             /* for changes to it */
+	int sfs_jstate;                 /* SFS_JOPEN etc. */
+	unsigned sfs_jops;              /* operations in progress */
+	unsigned sfs_jheld;             /* buffers held (or a few more) */
+	bool sfs_jpending;              /* operations since the commit */
+	struct thread *sfs_jcommitter;  /* thread committing, if any */
+	bool sfs_jstop;                 /* commit thread is to exit */
+	bool sfs_jrunning;              /* ... and hasn't yet */
+	uint32_t sfs_jseq;              /* number of the next transaction */
+	bool sfs_jondisk;               /* the journal holds one */
+	bool sfs_jwarned;               /* one didn't fit, and we said so */
+	struct buf **sfs_jbufs;         /* the buffers being committed */
+	struct iovec *sfs_jiov;         /* ... and the write of them */
+	struct sfs_jheader *sfs_jhead;  /* ... with its header */
+	struct sfs_jcommit *sfs_jtail;  /* ... and commit block */
 };
 
 /*
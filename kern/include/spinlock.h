@@ -46,9 +46,42 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+/*
+ * Contention counts for one spinlock, or a few. These are only kept
+ * for locks they've been attached to, either with spinlock_setstats
+ * or SPINLOCK_INITIALIZER_STATS, as they cost a little on every
+ * acquire; they're meant for the hot global locks. The counts are
+ * updated with the lock held. A spin is one trip round the wait loop.
+ *
+ * While profiling is on (see spinlock_profile) the time spent waiting
+ * for and holding these locks is measured too, in nanoseconds.
+ */
+struct spinlock_stats {
+	char sls_name[16];
+	unsigned sls_acquires;		/* Times acquired */
+	unsigned sls_contended;		/* ... after waiting */
+	unsigned sls_spins;		/* Total spins waiting */
+	unsigned sls_maxspins;		/* Longest single wait */
+	uint64_t sls_waitnsec;		/* Total time waiting */
+	uint64_t sls_holdnsec;		/* Total time held */
+	uint32_t sls_maxwait;		/* Longest single wait */
+	uint32_t sls_maxhold;		/* Longest single hold */
+	struct spinlock_stats *sls_next; /* List of all stats */
+	bool sls_listed;		/* On that list yet? */
+};
+
+#define SPINLOCK_STATS_INITIALIZER(name) \
+	{ name, 0, 0, 0, 0, 0, 0, 0, 0, NULL, false }
+
 /*
  * Basic spinlock.
  *
+ * This is a ticket lock: each CPU that wants the lock takes the next
+ * number from splk_next and waits until splk_lock, the number being
+ * served, comes round to it. So waiters get the lock in the order
+ * they asked for it, and while waiting they only read the lock word,
+ * which the holder writes once to let go.
+ *
  * Note that spinlocks are held by CPUs, not by threads.
  *
  * This structure is made public so spinlocks do not have to be
@@ -57,19 +90,26 @@
  */
 struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_next; /* Next ticket to hand out. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	struct spinlock_stats *splk_stats;  /* Contention counts, or NULL. */
+	uint32_t splk_since;		    /* When acquired, if profiling. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or global.
  */
 #ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#define SPINLOCK_INITIALIZER_STATS(stats) \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, \
+	  stats, 0, HANGMAN_LOCKABLE_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER_STATS(stats) \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, \
+	  stats, 0 }
 #endif
+#define SPINLOCK_INITIALIZER	SPINLOCK_INITIALIZER_STATS(NULL)
 
 /*
  * Spinlock functions.
@@ -81,6 +121,13 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setstats	Count contention on the lock in STATS, which may be shared
+ *		with other locks. Call before the lock is used.
+ * profile	Turn timing of waits and holds on or off. Turning it on
+ *		clears all the counts.
+ * printstats	Print the counts for every lock that has them, the ones
+ *		waited for longest (or most) first.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -91,5 +138,9 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_setstats(struct spinlock *lk, struct spinlock_stats *stats);
+void spinlock_profile(bool on);
+void spinlock_printstats(void);
+
 
 #endif /* _SPINLOCK_H_ */
@@ -0,0 +1,40 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space: page-sized slots, used to page out user frames when
+ * physical memory runs out. A slot's page is kept compressed in a pool
+ * of kernel memory if it will fit, or else on a raw disk device.
+ *
+ * All of these must be called with the VM lock held (vm_lock_acquire).
+ *
+ *    swap_bootstrap - open the swap device and size the pool. If the
+ *                device is missing, only the pool is used.
+ *
+ *    swap_alloc - reserve a free slot. Returns ENOSPC if there is none.
+ *
+ *    swap_alloc_near - the same, preferring slot GOAL or the first free
+ *                one after it. Pages in slots next to each other go to
+ *                disk and come back together, so the VM gives a page
+ *                the slot after that of the page before it.
+ *
+ *    swap_free - release a slot.
+ *
+ *    swap_in/swap_out - read/write a slot from/to the page of kernel
+ *                memory at KPAGE.
+ *
+ *    swap_copy - reserve a new slot holding a copy of slot FROM.
+ *
+ *    swap_printstats - print how full the pool and disk are.
+ */
+
+void swap_bootstrap(void);
+int swap_alloc(unsigned *slot_ret);
+int swap_alloc_near(unsigned goal, unsigned *slot_ret);
+void swap_free(unsigned slot);
+int swap_in(unsigned slot, vaddr_t kpage);
+int swap_out(unsigned slot, vaddr_t kpage);
+int swap_copy(unsigned from, unsigned *slot_ret);
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
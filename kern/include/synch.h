@@ -35,6 +35,7 @@
  */
 
 
+#include <kern/time.h>   /* for struct timespec */
 #include <spinlock.h>
 
 /*
@@ -71,6 +72,19 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * A lock made with lock_create_adaptive is for short critical
+ * sections: a thread that finds it held by a thread running on
+ * another CPU spins for a while, expecting it to be released soon,
+ * before going to sleep. The counts are kept under lk_lock; lock_stats
+ * prints the totals over all adaptive locks.
+ *
+ * A thread that sleeps waiting for a lock lends the holder its run
+ * queue level until the holder lets go (see thread_lend_priority), so
+ * a busy low-priority holder can't hold up a more important waiter.
+ *
+ * While profiling is on (see lock_profile) every lock also times how
+ * long threads wait for it and how long they hold it.
  */
 struct lock {
         char *lk_name;
@@ -78,10 +92,38 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         struct thread *volatile lk_holder;
+        bool lk_adaptive;               /* Spin before sleeping? */
+        unsigned lk_waitlevel;          /* Best level of sleepers */
+        bool lk_lent;                   /* Lent it to lk_holder? */
+        unsigned lk_acquires;           /* Times acquired */
+        unsigned lk_contended;          /* ... when already held */
+        unsigned lk_spun;               /* ... and got by spinning */
+        unsigned lk_slept;              /* Times a waiter slept */
+        uint64_t lk_waitnsec;           /* Total time waiting */
+        uint64_t lk_holdnsec;           /* Total time held */
+        uint64_t lk_maxwait;            /* Longest single wait */
+        uint64_t lk_maxhold;            /* Longest single hold */
+        struct timespec lk_since;       /* When acquired ... */
+        bool lk_timed;                  /* ... if that's being timed */
+        struct lock *lk_next;           /* List of all locks */
+        struct lock **lk_prevp;
 };
 
 struct lock *lock_create(const char *name);
+struct lock *lock_create_adaptive(const char *name);
 void lock_destroy(struct lock *);
+void lock_stats(void);
+
+/*
+ * Contention profiling:
+ *    lock_profile - Turn timing of lock waits and holds, for sleep
+ *                   locks and for spinlocks that keep stats, on or
+ *                   off. Turning it on clears all the counts.
+ *    lock_printprofile - Print the counts, summed over locks with the
+ *                   same name, the ones waited for longest first.
+ */
+void lock_profile(bool on);
+void lock_printprofile(void);
 
 /*
  * Operations:
@@ -139,5 +181,122 @@ void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * Waiter classes, for a CV shared by waiters for many things:
+ *    cv_wait_class      - cv_wait, as a waiter of class CLASS (say, the
+ *                         address of the object waited for).
+ *    cv_broadcast_class - Wake up only the waiters of class CLASS.
+ *
+ * cv_signal and cv_broadcast wake waiters of any class.
+ */
+void cv_wait_class(struct cv *cv, struct lock *lock, uintptr_t class);
+void cv_broadcast_class(struct cv *cv, struct lock *lock, uintptr_t class);
+
+/*
+ *    cv_timedwait - cv_wait, but give up once TS has passed; returns
+ *                   ETIMEDOUT if it did, or 0 if woken first.
+ */
+struct timespec;
+int cv_timedwait(struct cv *cv, struct lock *lock, const struct timespec *ts);
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers have preference: once a writer is waiting, new readers
+ * wait behind it, so a steady stream of readers can't shut writers
+ * out. Taking or dropping a read lock that nobody is writing costs
+ * just the internal spinlock.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+
+struct rwlock {
+        char *rwlock_name;
+        struct spinlock rw_lock;        /* protects the rest */
+        struct wchan *rw_readwchan;     /* readers wait here */
+        struct wchan *rw_writewchan;    /* writers wait here */
+        unsigned rw_readers;            /* readers holding the lock */
+        unsigned rw_writerswaiting;     /* writers waiting for it */
+        struct thread *rw_writer;       /* writer holding it, or NULL */
+};
+
+struct rwlock *rwlock_create(const char *);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Multiple threads can
+ *                          hold the lock for reading at the same time.
+ *    rwlock_release_read  - Free the lock.
+ *    rwlock_acquire_write - Get the lock for writing. Only one thread can
+ *                           hold the write lock at one time.
+ *    rwlock_release_write - Free the write lock.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the write lock. (There is no such test for
+ *                           readers, who aren't tracked individually.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
+/*
+ * Completion.
+ *
+ * For waiting until something has happened, such as another thread
+ * getting through its part of a job. complete() records one event and
+ * wakes one waiter; completion_wait() waits for an event and uses it
+ * up, so N calls to complete() let N waits through however they are
+ * interleaved. complete_all() lets every wait through, now and from
+ * then on, until completion_reinit().
+ *
+ * complete and complete_all don't sleep, so they may be called from
+ * interrupt handlers.
+ */
+
+struct completion {
+        char *cm_name;
+        struct wchan *cm_wchan;
+        struct spinlock cm_lock;
+        unsigned cm_done;               /* events not yet waited for */
+        bool cm_all;                    /* complete_all was called */
+};
+
+struct completion *completion_create(const char *name);
+void completion_destroy(struct completion *);
+void complete(struct completion *);
+void complete_all(struct completion *);
+void completion_wait(struct completion *);
+void completion_reinit(struct completion *);
+
+
+/*
+ * Barrier.
+ *
+ * kbarrier_wait makes each of COUNT threads wait until all of them
+ * have called it. The last to arrive lets the others go, all at once,
+ * and gets true back; the rest get false. The barrier can be used
+ * again straight away for the next round, but not destroyed until
+ * everyone has returned from the last one.
+ */
+
+struct kbarrier {
+        char *kb_name;
+        struct wchan *kb_wchan;
+        struct spinlock kb_lock;
+        unsigned kb_count;              /* threads in a round */
+        unsigned kb_arrived;            /* ... arrived so far */
+        unsigned kb_round;              /* rounds finished */
+};
+
+struct kbarrier *kbarrier_create(const char *name, unsigned count);
+void kbarrier_destroy(struct kbarrier *);
+bool kbarrier_wait(struct kbarrier *);
+
 
 #endif /* _SYNCH_H_ */
@@ -51,8 +51,17 @@ void enter_forked_process(struct trapframe *tf);
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
 
-/* Setup function for exec. */
-void exec_bootstrap(void);
+/*
+ * Per-call statistics (see <kern/sysstat.h>), kept by the dispatcher.
+ * sysstat_bootstrap sets them up once all the CPUs are running;
+ * sysstat_enter and sysstat_exit count a call and its time, and
+ * sysstat_print prints the totals.
+ */
+struct timespec;
+void sysstat_bootstrap(void);
+void sysstat_enter(int callno, struct timespec *start);
+void sysstat_exit(int callno, int err, const struct timespec *start);
+void sysstat_print(void);
 
 
 /*
@@ -64,32 +73,81 @@ void exec_bootstrap(void);
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
 
 int sys_fork(struct trapframe *tf, pid_t *retval);
+int sys_vfork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t prog, userptr_t args);
+int sys_spawnv(userptr_t prog, userptr_t args, pid_t *retval);
 __DEAD void sys__exit(int code);
 int sys_waitpid(pid_t pid, userptr_t returncode, int flags, pid_t *retval);
 int sys_getpid(pid_t *retval);
+int sys_setaffinity(unsigned mask, userptr_t oldmask);
+int sys_getrusage(int who, userptr_t usage);
+int sys_getrlimit(int resource, userptr_t rlp);
+int sys_setrlimit(int resource, const_userptr_t rlp);
+int sys_getpriority(int which, int who, int *retval);
+int sys_setpriority(int which, int who, int prio);
+int sys_sched_setscheduler(pid_t pid, int policy);
+int sys_sched_getscheduler(pid_t pid, int *retval);
+int sys_setgang(int on);
+int sys_procstat(userptr_t buf, size_t max, int *retval);
 
 int sys_open(const_userptr_t filename, int flags, mode_t mode, int *retval);
 int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_pipe(userptr_t fds);
 int sys_close(int fd);
 int sys_read(int fd, userptr_t buf, size_t size, int *retval);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
+int sys_pread(int fd, userptr_t buf, size_t size, off_t pos, int *retval);
+int sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, int *retval);
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_preadv(int fd, const_userptr_t iov, int iovcnt, off_t pos,
+	       int *retval);
+int sys_pwritev(int fd, const_userptr_t iov, int iovcnt, off_t pos,
+		int *retval);
+int sys_sendfile(int outfd, int infd, userptr_t offset, size_t count,
+		 int *retval);
+int sys_ioctl(int fd, int code, userptr_t data);
+int sys_poll(userptr_t fds, unsigned nfds, int timeout, int *retval);
+int sys_semwait(int fd, unsigned count);
+int sys_sempost(int fd, unsigned count);
+int sys_mq_create(unsigned msgsize, unsigned maxmsgs, int *retval);
+int sys_mq_send(int fd, const_userptr_t buf, size_t len, int flags);
+int sys_mq_receive(int fd, userptr_t buf, size_t len, int flags,
+		   int *retval);
 int sys_lseek(int fd, off_t offset, int code, off_t *retval);
 
 int sys_chdir(const_userptr_t path);
 int sys___getcwd(userptr_t buf, size_t buflen, int *retval);
 
 int sys_sync(void);
+int sys_bufstat(userptr_t buf);
 int sys_mkdir(userptr_t path, mode_t mode);
 int sys_rmdir(userptr_t path);
 int sys_remove(userptr_t path);
 int sys_link(userptr_t oldpath, userptr_t newpath);
 int sys_rename(userptr_t oldpath, userptr_t newpath);
 int sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval);
+int sys_getdirentries(int fd, userptr_t buf, size_t buflen, userptr_t cookie,
+		      int *retval);
 int sys_fstat(int fd, userptr_t statptr);
+int sys_stat(userptr_t path, userptr_t statptr);
 int sys_fsync(int fd);
 int sys_ftruncate(int fd, off_t len);
+int sys_fallocate(int fd, off_t pos, off_t len);
+
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(size_t length, int prot, int fd, off_t offset, vaddr_t *retval);
+int sys_munmap(userptr_t addr);
+int sys_mprotect(userptr_t addr, size_t length, int prot);
+int sys_madvise(userptr_t addr, size_t length, int advice);
+int sys_mincore(userptr_t addr, size_t length, userptr_t vec);
+int sys_mlock(userptr_t addr, size_t length, bool lock);
+int sys_vmstat(int cpu, userptr_t buf);
+int sys_threadfork(userptr_t entry, userptr_t arg, int *retval);
+int sys_futex(userptr_t addr, int op, int val, int timeout, int *retval);
+int sys_sysstat(int cpu, userptr_t buf);
 
 #endif /* _SYSCALL_H_ */
@@ -57,6 +57,10 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int synchbench_lock(int, char **);
+int synchbench_cv(int, char **);
+int synchbench_sem(int, char **);
+int synchbench_spinlock(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -96,11 +100,17 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmallocbench(int, char **);
+int kmallocbench_mp(int, char **);
+int kmallocfrag(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
+/* Report the time from boot to the first program run (in main.c). */
+void boot_firstexec(void);
+
 /* Kernel menu system. */
 void menu(char *argstr);
 
@@ -39,6 +39,8 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <kern/time.h>
+#include <ktime.h>
 
 struct cpu;
 
@@ -64,6 +66,17 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/*
+ * Scheduling accounting, kept for each thread by thread_switch and
+ * summed for processes (see proc_getstats).
+ */
+struct schedstats {
+	struct timespec ss_runtime;	/* time spent running */
+	struct timespec ss_waittime;	/* time spent runnable but not running */
+	unsigned ss_nvcsw;		/* switches by sleeping or yielding */
+	unsigned ss_nivcsw;		/* preemptions by the scheduler */
+};
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -84,6 +97,23 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
+	int t_class;			/* SCHED_OTHER or SCHED_FIFO */
+	int t_nice;			/* PRIO_MIN to PRIO_MAX, 0 normal */
+	unsigned t_priority;		/* Run queue level, 0 is highest */
+	unsigned t_inherit;		/* Level lent by lock waiters */
+	unsigned t_nlenders;		/* Locks held that lent t_inherit */
+	struct spinlock t_inheritlock;	/* Lock for t_inherit, t_nlenders */
+	unsigned t_ticks;		/* Hardclocks used of current quantum */
+	unsigned t_arrived;		/* t_cpu's c_hardclocks when it moved */
+	uintptr_t t_wchan_class;	/* Waiter class, see wchan_sleep_class */
+	uint32_t t_affinity;		/* CPUs it may run on, by c_number bit */
+	unsigned t_gang;		/* Gang it's in, or 0 */
+	struct cpu *t_lastcpu;		/* CPU it last ran on, or NULL */
+	struct thread *t_inboxnext;	/* Next in its CPU's c_inbox */
+	struct schedstats t_stats;	/* Accounting, see thread_switch */
+	struct timespec t_stamp;	/* When it last began running/waiting */
+	vaddr_t t_ustack;		/* User stack from threadfork, or 0 */
+	struct timespec t_ktime[KTIME_NTAGS]; /* Starts, see <ktime.h> */
 
 	/*
 	 * Interrupt state fields.
@@ -106,9 +136,22 @@ struct thread {
 	 * Public fields
 	 */
 
+	unsigned t_fsdepth;		/* SFS ops and vnode locks, see sfs.h */
+
 	/* add more here as needed */
 };
 
+/* t_affinity meaning any CPU at all */
+#define THREAD_AFFINITY_ALL 0xffffffff
+
+/* Is thread T allowed on cpu C? */
+#define THREAD_CAN_RUN(t, c) \
+	(((t)->t_affinity & ((uint32_t)1 << (c)->c_number)) != 0)
+
+/* Run queue level T goes on: its own, or a better one lent to it */
+#define THREAD_LEVEL(t) \
+	((t)->t_priority < (t)->t_inherit ? (t)->t_priority : (t)->t_inherit)
+
 /*
  * Array of threads.
  */
@@ -145,6 +188,58 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Restrict the current thread to the CPUs whose numbers are the bits
+ * set in MASK, handing back the previous mask in OLDMASK. New threads
+ * inherit the mask of the thread that forks them. Fails with EINVAL
+ * if MASK names no CPU that exists. If the current CPU is no longer
+ * allowed, the thread yields and is moved off it by the scheduler
+ * once something else runs there, or when it next wakes up.
+ */
+int thread_setaffinity(uint32_t mask, uint32_t *oldmask);
+
+/*
+ * Scheduling class (SCHED_*) and nice value (PRIO_MIN to PRIO_MAX,
+ * higher being less favoured) of the current thread; see
+ * <kern/resource.h>. New threads inherit both from the thread that
+ * forks them. The setters fail with EINVAL for values out of range.
+ */
+int thread_getclass(void);
+int thread_setclass(int class);
+int thread_getnice(void);
+int thread_setnice(int nice);
+
+/*
+ * Start a new gang with the current thread in it (ON true), or leave
+ * the one it is in. Threads it forks from then on, and so the
+ * processes it forks, join it too; a gang's threads are scheduled to
+ * run at the same time on different CPUs (see thread.c). Fails with
+ * EAGAIN if there are too many gangs already.
+ */
+int thread_setgang(bool on);
+
+/*
+ * Priority inheritance, for sleep locks. A thread about to sleep on a
+ * lock lends its run queue level LEVEL to the holder HOLDER with
+ * thread_lend_priority, with NEWLOCK set the first time that lock
+ * lends to this holder; if HOLDER is waiting on a run queue it moves
+ * up. Once it lets go of a lock that lent to it, the holder calls
+ * thread_unlend_priority, and when it holds no more such locks it
+ * goes back to its own level. Call both with the lock's spinlock held.
+ */
+void thread_lend_priority(struct thread *holder, unsigned level,
+			  bool newlock);
+void thread_unlend_priority(void);
+
+/*
+ * Add the accounting in FROM to TO. thread_getstats fetches the current
+ * thread's, including the time it has been running since it was last
+ * switched in; thread_takestats does the same and zeroes it.
+ */
+void schedstats_add(struct schedstats *to, const struct schedstats *from);
+void thread_getstats(struct schedstats *ret);
+void thread_takestats(struct schedstats *ret);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -163,6 +258,13 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for a hardclock, and switch to another
+ * if it has used up its time slice or something more important is
+ * waiting. Called from the timer interrupt.
+ */
+void thread_timeslice(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -78,6 +78,7 @@ struct uio {
 	enum uio_seg      uio_segflg;	/* What kind of pointer we have */
 	enum uio_rw       uio_rw;	/* Whether op is a read or write */
 	struct addrspace *uio_space;	/* Address space for user pointer */
+	bool              uio_direct;	/* Bypass the buffer cache */
 };
 
 
@@ -144,5 +145,21 @@ void uio_kinit(struct iovec *, struct uio *,
 void uio_uinit(struct iovec *, struct uio *,
 	       userptr_t ubuf, size_t len, off_t pos, enum uio_rw rw);
 
+/*
+ * The same, for IOVCNT user buffers described by the (kernel) array
+ * IOV, as for readv and writev.
+ */
+void uio_uinitv(struct iovec *iov, unsigned iovcnt, struct uio *,
+		off_t pos, enum uio_rw rw);
+
+/*
+ * For moving whole pages without copying (see vm_loan_page):
+ * uio_userpage returns true, with the address in *PAGE, if the next
+ * PAGE_SIZE bytes of a user uio are exactly one page of user memory;
+ * once the page has been dealt with, uio_skip moves the uio past it.
+ */
+bool uio_userpage(struct uio *uio, vaddr_t *page);
+void uio_skip(struct uio *uio, size_t len);
+
 
 #endif /* _UIO_H_ */
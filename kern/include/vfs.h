@@ -73,13 +73,16 @@ const char *vfs_getdevname(struct fs *fs);
  *                     or a name relative to the current directory, and
  *                     goes to the correct filesystem.
  *    vfs_lookparent - Likewise, for VOP_LOOKPARENT.
+ *    vfs_nextname   - Take the next name off the front of a path, in
+ *                     place, for filesystems walking it in VOP_LOOKUP.
  *
- * Both of these may destroy the path passed in.
+ * All of these may destroy the path passed in.
  */
 
 int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
+char *vfs_nextname(char **path);
 
 /*
  * VFS layer high-level operations on pathnames
@@ -99,6 +102,18 @@ int vfs_lookparent(char *path, struct vnode **result,
  *
  *    vfs_close  - Close a vnode opened with vfs_open. Does not fail.
  *                 (See vfspath.c for a discussion of why.)
+ *
+ *    vfs_pipe   - Make a pipe, returning its read and write ends as
+ *                 vnodes, each to be closed with vfs_close.
+ *
+ *    vfs_mqueue - Make a message queue of MAXMSGS messages of up to
+ *                 MSGSIZE bytes, returning a vnode to be closed with
+ *                 vfs_close. Read and write on it receive and send
+ *                 one message each, waiting as need be.
+ *
+ *    vfs_mqueue_send, vfs_mqueue_receive - Send or receive one
+ *                 message on a queue, failing with EAGAIN instead of
+ *                 waiting if NONBLOCK. EINVAL if VN isn't a queue.
  */
 
 int vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret);
@@ -114,6 +129,11 @@ int vfs_rename(char *oldpath, char *newpath);
 int vfs_chdir(char *path);
 int vfs_getcwd(struct uio *buf);
 
+int vfs_pipe(struct vnode **readvn, struct vnode **writevn);
+int vfs_mqueue(unsigned msgsize, unsigned maxmsgs, struct vnode **ret);
+int vfs_mqueue_send(struct vnode *vn, struct uio *uio, bool nonblock);
+int vfs_mqueue_receive(struct vnode *vn, struct uio *uio, bool nonblock);
+
 /*
  * Misc
  *
@@ -163,7 +183,16 @@ int vfs_getcwd(struct uio *buf);
  *                    previously returned by vfs_swapon should be
  *                    decref'd first. Similar to vfs_unmount.
  *
+ *    vfs_claimdev  - Look up DEVNAME and mark it as in use by another
+ *                    device, returning the device. Similar to
+ *                    vfs_swapon.
+ *
+ *    vfs_unclaimdev - Undo vfs_claimdev.
+ *
  *    vfs_unmountall - Unmount all mounted filesystems.
+ *
+ *    vfs_printiostats - Print the I/O statistics of each device that
+ *                    keeps them (see <device.h>).
  */
 
 void vfs_bootstrap(void);
@@ -181,7 +210,10 @@ int vfs_mount(const char *devname, void *data,
 int vfs_unmount(const char *devname);
 int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
+int vfs_claimdev(const char *devname, struct device **result);
+void vfs_unclaimdev(const char *devname);
 int vfs_unmountall(void);
+void vfs_printiostats(void);
 
 /*
  * Array of vnodes.
@@ -194,7 +226,9 @@ DECLARRAY(vnode, VFSINLINE);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
+ * Global lock for the VFS layer's own state: the mount list, bootfs,
+ * and path lookup from the top. Filesystems lock their own vnodes and
+ * don't take it; sfs and emufs no longer do.
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
@@ -51,10 +51,221 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/*
+ * Zero or copy one whole page, both page aligned. Faster than bzero
+ * and memcpy for the purpose; in arch/mips/vm/pageops.S.
+ */
+void page_zero(vaddr_t page);
+void page_copy(vaddr_t dst, vaddr_t src);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Mapped kernel heap (see vm.c): alloc_kpages falls back to mapping
+ * NPAGES separate frames into kseg2 when it can't find them together,
+ * and free_kpages hands kseg2 addresses to vm_kseg2_free.
+ */
+vaddr_t vm_kseg2_alloc(unsigned npages);
+void vm_kseg2_free(vaddr_t addr);
+
+/*
+ * Share single user frames between address spaces (copy-on-write).
+ * frame_incref adds a reference that must be dropped with free_kpages;
+ * frame_refcount reports how many references there currently are.
+ */
+void frame_incref(paddr_t paddr);
+unsigned frame_refcount(paddr_t paddr);
+
+/*
+ * Drop a reference to each of N single frames at once, as free_kpages
+ * on each would, for tearing down a whole page table cheaply.
+ */
+void frame_free_batch(const paddr_t *paddrs, unsigned n);
+
+/*
+ * High memory (see <machine/vm.h>). frame_alloc_high returns a single
+ * frame of it for a user page, or 0 if there is none free; frame_free
+ * drops a reference to any single frame, as free_kpages would, by
+ * physical address. vm_kmap gives the kernel a temporary address for
+ * any frame, high or not, in mapping slot SLOT (0 or 1, so that two
+ * can be mapped at once) until the matching vm_kunmap. Interrupts are
+ * off in between, so don't sleep.
+ */
+paddr_t frame_alloc_high(void);
+void frame_free(paddr_t paddr);
+vaddr_t vm_kmap(paddr_t paddr, unsigned slot);
+void vm_kunmap(vaddr_t va, unsigned slot);
+
+/*
+ * Size class tags on kmalloc's subpage pages, so kfree can find a
+ * block's size class cheaply (see kmalloc.c). frame_kmalloc_type
+ * returns -1 for frames that aren't tagged.
+ */
+void frame_set_kmalloc_type(paddr_t paddr, unsigned type);
+int frame_kmalloc_type(paddr_t paddr);
+
+/*
+ * Paging support. A user frame mapped by exactly one page table entry
+ * records which address space and page map it, so that it can be
+ * chosen for page-out; frame_choose_victim returns such a frame (or 0
+ * if there is none), of the address space ONLY if that isn't NULL.
+ * Shared frames are never chosen.
+ */
+struct addrspace;
+void frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+paddr_t frame_choose_victim(struct addrspace *only, struct addrspace **as_ret,
+                            vaddr_t *vaddr_ret);
+
+/*
+ * Reverse maps. A frame fork shares with frame_share keeps a list of
+ * every (address space, page) mapping it, which user mappings going
+ * away leave with frame_unmap (or frame_unmap_batch) rather than
+ * free_kpages. When it's down to one mapping that becomes the owner
+ * above, so the frame may be paged out again without anyone having
+ * to write to it first. A reference taken any other way (frame_incref)
+ * loses track and the list is dropped.
+ */
+void frame_share(paddr_t paddr, struct addrspace *old, vaddr_t old_vaddr,
+                 struct addrspace *new, vaddr_t new_vaddr);
+void frame_unmap(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void frame_unmap_batch(struct addrspace *as, const paddr_t *paddrs,
+                       const vaddr_t *vaddrs, unsigned n);
+
+/*
+ * For same-page merging (see vm_merge_start in vm.c): walk the frames
+ * that have owners, and check that a frame is still one whose mappings
+ * are all known.
+ */
+paddr_t frame_next_owned(unsigned *cursor, struct addrspace **as_ret,
+                         vaddr_t *vaddr_ret);
+bool frame_mappings_known(paddr_t paddr, struct addrspace **as_ret,
+                          vaddr_t *vaddr_ret);
+
+/*
+ * For compaction (see vm_compact in vm.c): find out what size of block
+ * alloc_kpages last went without, take a window of that many frames
+ * holding only free ones and ones that can be moved, find the mappings
+ * of each of the latter, record each one's move to another frame, and
+ * free the window again.
+ */
+int frame_compact_wanted(void);
+paddr_t frame_compact_isolate(unsigned order, unsigned *cursor);
+int frame_compact_mappings(paddr_t paddr, struct addrspace **as_ret,
+                           vaddr_t *vaddr_ret, unsigned max);
+void frame_compact_moved(paddr_t old, paddr_t new);
+void frame_compact_release(paddr_t start, unsigned order);
+
+/*
+ * Replacement policy for frame_choose_victim. VICTIM_CLOCK (the
+ * default) gives pages that vm_page_test_and_clear_referenced reports
+ * as used a second chance; VICTIM_FIFO sweeps the frame table in
+ * order regardless. Either way, pages vm_page_locked reports as pinned
+ * by mlock are passed over, and pages of address spaces vm_as_idle
+ * says have been idle for a sampling window are preferred.
+ */
+#define VICTIM_FIFO  0
+#define VICTIM_CLOCK 1
+bool vm_page_locked(struct addrspace *as, vaddr_t vaddr);
+bool vm_page_test_and_clear_referenced(struct addrspace *as, vaddr_t vaddr);
+bool vm_as_idle(struct addrspace *as);
+void frame_set_victim_policy(int policy);
+void frame_printstats(void);
+
+/*
+ * Memory pressure, from how many frames are free, against watermarks
+ * set from the size of RAM. Under FRAME_PRESSURE_LOW caches stop
+ * growing (the pre-zeroed pool, idle page cache pages); under
+ * FRAME_PRESSURE_MIN the frames left are kept for the kernel, and user
+ * pages are got by paging others out.
+ */
+#define FRAME_PRESSURE_NONE 0
+#define FRAME_PRESSURE_LOW  1
+#define FRAME_PRESSURE_MIN  2
+int frame_pressure(void);
+
+/*
+ * TLB management by address space ID (see vm.c):
+ *
+ *    vm_tlb_activate - make AS's ASID current, assigning a new one
+ *                if it doesn't have one from this generation.
+ *
+ *    vm_tlb_deactivate - stop the TLB refill handler using AS's page
+ *                table (whichever is in use, if AS is NULL).
+ *
+ *    vm_tlb_forget - drop all of AS's TLB entries by retiring its ASID.
+ *
+ *    vm_tlb_invalidate - drop AS's TLB entry for the page VADDR.
+ *
+ *    vm_tlb_flush - invalidate the whole TLB.
+ */
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_deactivate(struct addrspace *as);
+void vm_tlb_forget(struct addrspace *as);
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+void vm_tlb_flush(void);
+
+/*
+ * VM event counters, kept per CPU (see <kern/vmstat.h>):
+ *
+ *    vmstat_inc - count one COUNTER event on this CPU. Callable from
+ *                anywhere, interrupt handlers included.
+ *
+ *    vmstat_add - likewise, N events.
+ *
+ *    vm_getstats - fill in RET with CPU's counters, or the totals if
+ *                CPU is -1. Fails with EINVAL if CPU is out of range.
+ */
+struct vmstat;
+void vmstat_inc(unsigned counter);
+void vmstat_add(unsigned counter, uint32_t n);
+int vm_getstats(int cpu, struct vmstat *ret);
+
+/* Print paging statistics (the "vm" menu command) */
+void vm_printstats(void);
+
+/*
+ * For when a fault or fork has run out of memory even after paging
+ * out: get some back, in order, by waiting for exited processes'
+ * address spaces to be destroyed, by compacting memory if a block of
+ * frames was wanted together, by shrinking the buffer cache and
+ * page cache, and then, under OOM_KILL_LARGEST (the default), by
+ * killing the process with the most pages resident. Returns true if
+ * it's worth trying again. Under OOM_KILL_FAULTING nobody is killed,
+ * and the allocation that failed fails. Must be called without locks
+ * held.
+ */
+#define OOM_KILL_FAULTING 0
+#define OOM_KILL_LARGEST  1
+bool vm_reclaim(void);
+void vm_set_oom_policy(int policy);
+int vm_get_oom_policy(void);
+
+/*
+ * Same-page merging of identical anonymous pages, in the background
+ * (the "merge" menu command; see vm.c). vm_merge_start may fail with
+ * the errors of thread_fork.
+ */
+int vm_merge_start(void);
+void vm_merge_stop(void);
+bool vm_merge_running(void);
+
+/*
+ * The VM lock serializes changes to user page tables and frame owners
+ * against page-out, which may touch any address space.
+ */
+void vm_lock_acquire(void);
+void vm_lock_release(void);
+bool vm_lock_do_i_hold(void);
+
+/*
+ * Called by thread_switch when the CPU has nothing to run, before it
+ * goes idle. Returns true if it made a thread runnable (the page
+ * zeroing thread), in which case the CPU shouldn't idle after all.
+ */
+bool vm_idle(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
@@ -30,9 +30,10 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
-#include <spinlock.h>
+#include <atomic.h>
 struct uio;
 struct stat;
+struct pollentry;
 
 
 /*
@@ -49,8 +50,8 @@ struct stat;
  * Note: vn_fs may be null if the vnode refers to a device.
  */
 struct vnode {
-	int vn_refcount;                /* Reference count */
-	struct spinlock vn_countlock;   /* Lock for vn_refcount */
+	struct atomic vn_refcount;      /* Reference count */
+	struct atomic vn_wgen;          /* Bumped by each write, truncate */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -120,18 +121,38 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check whether the file can be mapped into
+ *                      memory. Returns 0 if so; the VM system then
+ *                      reads and writes the pages itself with
+ *                      vop_read and vop_write.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
  *
+ *    vop_fallocate   - Set aside space on disk for the LEN bytes of
+ *                      the file from POS on, without changing its
+ *                      size, so that writing them later can't run out
+ *                      of space. Returns ENOSYS if the file system
+ *                      doesn't do that.
+ *
+ *    vop_seekhole    - Find the first offset at or after POS, which
+ *                      must be inside the file, that is in a hole (if
+ *                      HOLE is set) or has data (if not). The end of
+ *                      the file counts as a hole. Returns ENXIO if
+ *                      POS is at or past EOF, or there's no data
+ *                      after it.
+ *
  *    vop_namefile    - Compute pathname relative to filesystem root
  *                      of the file and copy to the specified
  *                      uio. Need not work on objects that are not
  *                      directories.
  *
+ *    vop_poll        - Return which of POLLIN, POLLOUT, POLLHUP, and
+ *                      POLLERR (see <kern/poll.h>) hold for the object
+ *                      now, after registering poll entry PE (if not
+ *                      NULL) on whatever the object wakes when that
+ *                      changes. See <poll.h>. Must not block for long.
+ *
  *****************************************
  *
  *    vop_creat       - Create a regular file named NAME in the passed
@@ -193,9 +214,13 @@ struct vnode_ops {
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	bool (*vop_isseekable)(struct vnode *object);
 	int (*vop_fsync)(struct vnode *object);
-	int (*vop_mmap)(struct vnode *file /* add stuff */);
+	int (*vop_mmap)(struct vnode *file);
 	int (*vop_truncate)(struct vnode *file, off_t len);
+	int (*vop_fallocate)(struct vnode *file, off_t pos, off_t len);
+	int (*vop_seekhole)(struct vnode *file, off_t pos, bool hole,
+			    off_t *result);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
+	int (*vop_poll)(struct vnode *object, struct pollentry *pe);
 
 
 	int (*vop_creat)(struct vnode *dir,
@@ -231,15 +256,18 @@ struct vnode_ops {
 #define VOP_READ(vn, uio)               (__VOP(vn, read)(vn, uio))
 #define VOP_READLINK(vn, uio)           (__VOP(vn, readlink)(vn, uio))
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
-#define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
+#define VOP_WRITE(vn, uio)  (vnode_wrote(vn, __VOP(vn, write)(vn, uio)))
 #define VOP_IOCTL(vn, code, buf)        (__VOP(vn, ioctl)(vn,code,buf))
 #define VOP_STAT(vn, ptr) 	        (__VOP(vn, stat)(vn, ptr))
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_ISSEEKABLE(vn)              (__VOP(vn, isseekable)(vn))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
-#define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
-#define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
+#define VOP_MMAP(vn)                    (__VOP(vn, mmap)(vn))
+#define VOP_TRUNCATE(vn, pos) (vnode_wrote(vn, __VOP(vn, truncate)(vn, pos)))
+#define VOP_FALLOCATE(vn, pos, len)     (__VOP(vn, fallocate)(vn, pos, len))
+#define VOP_SEEKHOLE(vn, pos, hole, res) (__VOP(vn, seekhole)(vn,pos,hole,res))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
+#define VOP_POLL(vn, pe)                (__VOP(vn, poll)(vn, pe))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
 #define VOP_SYMLINK(vn, name, content)  (__VOP(vn, symlink)(vn, name, content))
@@ -257,12 +285,27 @@ struct vnode_ops {
  */
 void vnode_check(struct vnode *, const char *op);
 
+/*
+ * Bump vn_wgen after a write or truncate, so anything remembering
+ * what was in the file (e.g. load_elf) can tell it may have changed;
+ * returns RESULT. Called by VOP_WRITE and VOP_TRUNCATE.
+ */
+int vnode_wrote(struct vnode *, int result);
+
 /*
  * Reference count manipulation (handled above filesystem level)
  */
 void vnode_incref(struct vnode *);
 void vnode_decref(struct vnode *);
 
+/*
+ * Drop a reference unless it's the last one; returns true if it was
+ * dropped. For VOP_RECLAIM, which VOP_DECREF hands the last reference,
+ * to find out (holding whatever lock keeps the filesystem from handing
+ * out new ones) whether someone has picked the vnode up since.
+ */
+bool vnode_decref_unless_last(struct vnode *);
+
 #define VOP_INCREF(vn) 			vnode_incref(vn)
 #define VOP_DECREF(vn) 			vnode_decref(vn)
 
@@ -279,6 +322,16 @@ int vnode_init(struct vnode *, const struct vnode_ops *ops,
  */
 void vnode_cleanup(struct vnode *);
 
+/*
+ * Common vop_poll for objects that are always ready (in vfspoll.c).
+ */
+int vopnull_poll(struct vnode *vn, struct pollentry *pe);
+
+/*
+ * Common vop_seekhole for objects with no holes (in vnode.c).
+ */
+int vopnull_seekhole(struct vnode *vn, off_t pos, bool hole, off_t *result);
+
 /*
  * Common stubs for vnode functions that just fail, in various ways.
  */
@@ -286,10 +339,16 @@ int vopfail_uio_notdir(struct vnode *vn, struct uio *uio);
 int vopfail_uio_isdir(struct vnode *vn, struct uio *uio);
 int vopfail_uio_inval(struct vnode *vn, struct uio *uio);
 int vopfail_uio_nosys(struct vnode *vn, struct uio *uio);
-int vopfail_mmap_isdir(struct vnode *vn /* add stuff */);
-int vopfail_mmap_perm(struct vnode *vn /* add stuff */);
-int vopfail_mmap_nosys(struct vnode *vn /* add stuff */);
+int vopfail_mmap_isdir(struct vnode *vn);
+int vopfail_mmap_perm(struct vnode *vn);
+int vopfail_mmap_nosys(struct vnode *vn);
 int vopfail_truncate_isdir(struct vnode *vn, off_t pos);
+int vopfail_fallocate_isdir(struct vnode *vn, off_t pos, off_t len);
+int vopfail_fallocate_nosys(struct vnode *vn, off_t pos, off_t len);
+int vopfail_seekhole_isdir(struct vnode *vn, off_t pos, bool hole,
+			   off_t *result);
+int vopfail_seekhole_nosys(struct vnode *vn, off_t pos, bool hole,
+			   off_t *result);
 int vopfail_creat_notdir(struct vnode *vn, const char *name, bool excl,
 			 mode_t mode, struct vnode **result);
 int vopfail_symlink_notdir(struct vnode *vn, const char *contents,
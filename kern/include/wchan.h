@@ -66,6 +66,14 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Likewise, but tagged with a waiter class: an arbitrary value, such
+ * as the address of the object being waited for, that lets
+ * wchan_wakeclass pick out some of the sleepers. wchan_sleep sleeps
+ * with class 0.
+ */
+void wchan_sleep_class(struct wchan *wc, struct spinlock *lk, uintptr_t class);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
@@ -76,5 +84,11 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Wake up every thread sleeping on the channel with class CLASS.
+ * The associated spinlock should be locked.
+ */
+void wchan_wakeclass(struct wchan *wc, struct spinlock *lk, uintptr_t class);
+
 
 #endif /* _WCHAN_H_ */
@@ -0,0 +1,54 @@
+/*
+ * Deferred work.
+ */
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+#include <spinlock.h>
+
+/*
+ * A work item is a function and argument to be called later, in
+ * thread context, by a worker thread. Each CPU has its own queue and
+ * worker, and an item runs on the CPU that queued it, in the order
+ * queued. This is how interrupt handlers put off what they needn't do
+ * with interrupts off, or what may sleep: the handler queues an item
+ * and returns, and the worker, just woken and so at top priority,
+ * runs it soon afterwards. Work functions may sleep, but anything
+ * queued behind them on that CPU waits meanwhile.
+ *
+ * Functions:
+ *
+ *    workqueue_bootstrap - start the workers. Needs all the CPUs up;
+ *              work queued before this runs once it has.
+ *
+ *    work_init - set up a work item. The structure is the caller's,
+ *              but only the work queue code looks inside it.
+ *
+ *    work_schedule - queue a work item on this CPU. Never sleeps or
+ *              allocates memory, so it may be called from interrupt
+ *              handlers and with spinlocks held. Does nothing if the
+ *              item is already queued; returns whether it queued it.
+ *              Once the item's function has been called the item may
+ *              be queued again or reused.
+ *
+ *    workqueue_enqueue - queue FUNC(ARG) on this CPU, using a work
+ *              item it allocates and frees itself. Thread context
+ *              only, as it calls kmalloc. Fails with ENOMEM.
+ */
+
+struct work {
+	void (*w_func)(void *);
+	void *w_arg;
+	volatile spinlock_data_t w_queued;
+	bool w_allocated;	/* kfree it before calling w_func */
+	struct work *w_next;
+};
+
+void workqueue_bootstrap(void);
+
+void work_init(struct work *w, void (*func)(void *), void *arg);
+bool work_schedule(struct work *w);
+int workqueue_enqueue(void (*func)(void *), void *arg);
+
+#endif /* _WORKQUEUE_H_ */
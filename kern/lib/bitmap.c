@@ -47,8 +47,24 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * For skipping over full words quickly, we look at them four at a
+ * time. Whether four bytes are all ones doesn't depend on the byte
+ * order, so this doesn't bring back the endianness problem. The
+ * attribute tells gcc the same memory is also accessed as bytes.
+ */
+typedef uint32_t __attribute__((__may_alias__)) CHUNK_TYPE;
+#define WORDS_PER_CHUNK (sizeof(CHUNK_TYPE) / sizeof(WORD_TYPE))
+#define CHUNK_ALLBITS   (0xffffffff)
+
+/*
+ * hint is a word index such that every word below it is full; it
+ * isn't necessarily the first word with a clear bit, but allocation
+ * can start looking there rather than at the beginning.
+ */
 struct bitmap {
         unsigned nbits;
+        unsigned hint;
         WORD_TYPE *v;
 };
 
@@ -72,6 +88,7 @@ bitmap_create(unsigned nbits)
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->hint = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -89,48 +106,190 @@ bitmap_create(unsigned nbits)
         return b;
 }
 
+/*
+ * The caller may change the bits through the pointer, so forget the
+ * hint.
+ */
 void *
 bitmap_getdata(struct bitmap *b)
 {
+        b->hint = 0;
         return b->v;
 }
 
-int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+static
+inline
+void
+bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
         unsigned offset;
+        *ix = bitno / BITS_PER_WORD;
+        offset = bitno % BITS_PER_WORD;
+        *mask = ((WORD_TYPE)1) << offset;
+}
+
+/*
+ * Return the number of consecutive set bits at the bottom of W.
+ */
+static
+inline
+unsigned
+bitmap_trailing_ones(WORD_TYPE w)
+{
+        unsigned n = 0;
+
+        if ((w & 0xf) == 0xf) {
+                n += 4;
+                w >>= 4;
+        }
+        if ((w & 0x3) == 0x3) {
+                n += 2;
+                w >>= 2;
+        }
+        if ((w & 0x1) == 0x1) {
+                n += 1;
+                w >>= 1;
+                /* for 0xff, there's one more */
+                n += w & 0x1;
+        }
+        return n;
+}
+
+/*
+ * Return the index of the first word from IX on, but before MAXIX,
+ * that isn't full, or MAXIX if there isn't one.
+ */
+static
+unsigned
+bitmap_nextword(struct bitmap *b, unsigned ix, unsigned maxix)
+{
+        while (ix < maxix) {
+                if (ix % WORDS_PER_CHUNK == 0 && ix + WORDS_PER_CHUNK <= maxix
+                    && *(CHUNK_TYPE *)&b->v[ix] == CHUNK_ALLBITS) {
+                        ix += WORDS_PER_CHUNK;
+                        continue;
+                }
+                if (b->v[ix] != WORD_ALLBITS) {
+                        return ix;
+                }
+                ix++;
+        }
+        return maxix;
+}
+
+/*
+ * Find the first clear bit from START up to END. Returns ENOSPC if
+ * there isn't one.
+ */
+static
+int
+bitmap_find(struct bitmap *b, unsigned start, unsigned end, unsigned *index)
+{
+        unsigned maxix = DIVROUNDUP(end, BITS_PER_WORD);
+        unsigned ix, offset, bit;
+        WORD_TYPE w;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
+        if (start >= end) {
+                return ENOSPC;
+        }
+        ix = start / BITS_PER_WORD;
+        offset = start % BITS_PER_WORD;
+        while ((ix = bitmap_nextword(b, ix, maxix)) < maxix) {
+                if (ix != start / BITS_PER_WORD) {
+                        offset = 0;
+                }
+                /* ignore the bits below START in its word */
+                w = b->v[ix] | (WORD_TYPE)(((WORD_TYPE)1 << offset) - 1);
+                if (w != WORD_ALLBITS) {
+                        bit = ix*BITS_PER_WORD + bitmap_trailing_ones(w);
+                        if (bit >= end) {
+                                break;
                         }
-                        KASSERT(0);
+                        *index = bit;
+                        return 0;
                 }
+                ix++;
         }
         return ENOSPC;
 }
 
-static
-inline
-void
-bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
 {
-        unsigned offset;
-        *ix = bitno / BITS_PER_WORD;
-        offset = bitno % BITS_PER_WORD;
-        *mask = ((WORD_TYPE)1) << offset;
+        unsigned ix;
+        WORD_TYPE mask;
+
+        if (bitmap_find(b, b->hint * BITS_PER_WORD, b->nbits, index)) {
+                b->hint = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+                return ENOSPC;
+        }
+        bitmap_translate(*index, &ix, &mask);
+        b->v[ix] |= mask;
+        b->hint = ix;
+        return 0;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned ix;
+        WORD_TYPE mask;
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+        if (bitmap_find(b, goal, b->nbits, index) &&
+            bitmap_find(b, 0, goal, index)) {
+                return ENOSPC;
+        }
+        bitmap_translate(*index, &ix, &mask);
+        b->v[ix] |= mask;
+        return 0;
+}
+
+/*
+ * Look for COUNT clear bits in a row, lowest first. Each time the run
+ * so far hits a set bit, start again from the next clear bit past it.
+ */
+int
+bitmap_alloc_range(struct bitmap *b, unsigned count, unsigned *index)
+{
+        unsigned start, first, i, ix;
+        WORD_TYPE mask;
+
+        KASSERT(count > 0);
+
+        start = b->hint * BITS_PER_WORD;
+        while (bitmap_find(b, start, b->nbits, &first) == 0) {
+                if (count > b->nbits - first) {
+                        break;
+                }
+                for (i = first; i < first + count; i++) {
+                        if (i % BITS_PER_WORD == 0 &&
+                            i + BITS_PER_WORD <= first + count &&
+                            b->v[i / BITS_PER_WORD] == 0) {
+                                i += BITS_PER_WORD - 1;
+                                continue;
+                        }
+                        bitmap_translate(i, &ix, &mask);
+                        if (b->v[ix] & mask) {
+                                break;
+                        }
+                }
+                if (i == first + count) {
+                        for (i = first; i < first + count; i++) {
+                                bitmap_translate(i, &ix, &mask);
+                                b->v[ix] |= mask;
+                        }
+                        *index = first;
+                        return 0;
+                }
+                start = i + 1;
+        }
+        return ENOSPC;
 }
 
+
 void
 bitmap_mark(struct bitmap *b, unsigned index)
 {
@@ -155,6 +314,67 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        if (ix < b->hint) {
+                b->hint = ix;
+        }
+}
+
+
+/*
+ * Set or clear COUNT bits from INDEX on: whole words in one go, and
+ * bit by bit only at the ends.
+ */
+void
+bitmap_mark_range(struct bitmap *b, unsigned index, unsigned count)
+{
+        unsigned ix, end;
+        WORD_TYPE mask;
+
+        end = index + count;
+        KASSERT(end >= index && end <= b->nbits);
+
+        while (index < end) {
+                if (index % BITS_PER_WORD == 0 &&
+                    index + BITS_PER_WORD <= end) {
+                        ix = index / BITS_PER_WORD;
+                        KASSERT(b->v[ix] == 0);
+                        b->v[ix] = WORD_ALLBITS;
+                        index += BITS_PER_WORD;
+                        continue;
+                }
+                bitmap_translate(index, &ix, &mask);
+                KASSERT((b->v[ix] & mask)==0);
+                b->v[ix] |= mask;
+                index++;
+        }
+}
+
+void
+bitmap_unmark_range(struct bitmap *b, unsigned index, unsigned count)
+{
+        unsigned ix, end;
+        WORD_TYPE mask;
+
+        end = index + count;
+        KASSERT(end >= index && end <= b->nbits);
+
+        if (count > 0 && index / BITS_PER_WORD < b->hint) {
+                b->hint = index / BITS_PER_WORD;
+        }
+        while (index < end) {
+                if (index % BITS_PER_WORD == 0 &&
+                    index + BITS_PER_WORD <= end) {
+                        ix = index / BITS_PER_WORD;
+                        KASSERT(b->v[ix] == WORD_ALLBITS);
+                        b->v[ix] = 0;
+                        index += BITS_PER_WORD;
+                        continue;
+                }
+                bitmap_translate(index, &ix, &mask);
+                KASSERT((b->v[ix] & mask)!=0);
+                b->v[ix] &= ~mask;
+                index++;
+        }
 }
 
 
@@ -56,6 +56,9 @@ kgets(char *buf, size_t maxlen)
 	size_t pos = 0;
 	int ch;
 
+	/* get the prompt out before echoing anything */
+	kprintf_flush();
+
 	while (1) {
 		ch = getch();
 		if (ch=='\n' || ch=='\r') {
@@ -36,7 +36,10 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <membar.h>
+#include <workqueue.h>
 #include <mainbus.h>
+#include <platform/maxcpus.h>
 #include <vfs.h>          // for vfs_sync()
 #include <lamebus/ltrace.h> // for ltrace_stop()
 
@@ -50,6 +53,37 @@ static struct lock *kprintf_lock;
 /* Lock for polled kprintfs */
 static struct spinlock kprintf_spinlock;
 
+/*
+ * Per-CPU log buffers. Once kprintf_async_bootstrap has run, kprintf
+ * just formats into the buffer of the CPU it's on and queues that
+ * CPU's work item to copy it out to the console later; so a kprintf
+ * costs about as much as an snprintf and doesn't wait for the console
+ * or for other CPUs. Printing the buffers is still one at a time,
+ * under kprintf_lock, so messages come out whole.
+ *
+ * A caller that may sleep and finds its buffer half full prints it
+ * out itself first, which keeps chatty threads from running away
+ * from the console. Interrupt handlers and holders of spinlocks
+ * can't, and what they print once the buffer is full is lost (and
+ * counted).
+ *
+ * panic, shutdown, and kgets need the output there now, so they
+ * print the buffers out directly (kprintf_sync, kprintf_flush).
+ */
+#define KLOG_SIZE	4096
+
+struct klogbuf {
+	struct spinlock kl_lock;
+	char kl_buf[KLOG_SIZE];
+	unsigned kl_head;		/* Oldest character */
+	unsigned kl_count;		/* Characters waiting */
+	unsigned kl_lost;		/* Characters thrown away */
+	struct work kl_work;		/* Queued to print the buffer */
+};
+
+static struct klogbuf *klogbufs[MAXCPUS];
+static volatile bool klog_on;
+
 
 /*
  * Warning: all this has to work from interrupt handlers and when
@@ -89,6 +123,162 @@ console_send(void *junk, const char *data, size_t len)
 	}
 }
 
+/*
+ * Add characters to a log buffer, whose lock is held. Backend for
+ * __printf.
+ */
+static
+void
+klog_send(void *vkl, const char *data, size_t len)
+{
+	struct klogbuf *kl = vkl;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (kl->kl_count == KLOG_SIZE) {
+			kl->kl_lost += len - i;
+			return;
+		}
+		kl->kl_buf[(kl->kl_head + kl->kl_count) % KLOG_SIZE] = data[i];
+		kl->kl_count++;
+	}
+}
+
+/*
+ * Print out what's in a log buffer, in chunks so as not to hold its
+ * lock while the console is busy. If POLLED, we're panicking with the
+ * other CPUs stopped and must not wait for anything; otherwise the
+ * caller holds kprintf_lock.
+ */
+static
+void
+klog_print(struct klogbuf *kl, bool polled)
+{
+	char chunk[128];
+	unsigned n, i, lost;
+
+	while (1) {
+		if (!polled) {
+			spinlock_acquire(&kl->kl_lock);
+		}
+		n = 0;
+		while (n < sizeof(chunk) && kl->kl_count > 0) {
+			chunk[n++] = kl->kl_buf[kl->kl_head];
+			kl->kl_head = (kl->kl_head + 1) % KLOG_SIZE;
+			kl->kl_count--;
+		}
+		lost = n == 0 ? kl->kl_lost : 0;
+		if (lost > 0) {
+			kl->kl_lost = 0;
+		}
+		if (!polled) {
+			spinlock_release(&kl->kl_lock);
+		}
+
+		if (n == 0) {
+			break;
+		}
+		for (i=0; i<n; i++) {
+			putch(chunk[i]);
+		}
+	}
+
+	if (lost > 0) {
+		snprintf(chunk, sizeof(chunk),
+			 "kprintf: %u characters lost\n", lost);
+		for (i=0; chunk[i] != 0; i++) {
+			putch(chunk[i]);
+		}
+	}
+}
+
+/*
+ * Work function: print out a CPU's log buffer.
+ */
+static
+void
+klog_work(void *vkl)
+{
+	struct klogbuf *kl = vkl;
+
+	lock_acquire(kprintf_lock);
+	klog_print(kl, false);
+	lock_release(kprintf_lock);
+}
+
+/*
+ * Set up the per-CPU log buffers and turn them on. Must be called
+ * after workqueue_bootstrap.
+ */
+void
+kprintf_async_bootstrap(void)
+{
+	struct klogbuf *kl;
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; (c = cpu_bynumber(i)) != NULL; i++) {
+		KASSERT(i < MAXCPUS);
+		kl = kmalloc(sizeof(*kl));
+		if (kl == NULL) {
+			panic("kprintf_async_bootstrap: Out of memory\n");
+		}
+		spinlock_init(&kl->kl_lock);
+		kl->kl_head = 0;
+		kl->kl_count = 0;
+		kl->kl_lost = 0;
+		work_init(&kl->kl_work, klog_work, kl);
+		klogbufs[i] = kl;
+	}
+	membar_store_store();
+	klog_on = true;
+}
+
+/*
+ * Print out all the log buffers.
+ */
+static
+void
+klog_printall(bool polled)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS && klogbufs[i] != NULL; i++) {
+		klog_print(klogbufs[i], polled);
+	}
+}
+
+/*
+ * Print out everything buffered so far. Thread context only.
+ */
+void
+kprintf_flush(void)
+{
+	if (!klog_on) {
+		return;
+	}
+	lock_acquire(kprintf_lock);
+	klog_printall(false);
+	lock_release(kprintf_lock);
+}
+
+/*
+ * Turn the log buffers off, printing out what's in them; from here on
+ * kprintf writes to the console directly. For shutdown.
+ */
+void
+kprintf_sync(void)
+{
+	if (!klog_on) {
+		return;
+	}
+	klog_on = false;
+	membar_store_any();
+	lock_acquire(kprintf_lock);
+	klog_printall(false);
+	lock_release(kprintf_lock);
+}
+
 /*
  * Printf to the console.
  */
@@ -98,12 +288,30 @@ kprintf(const char *fmt, ...)
 	int chars;
 	va_list ap;
 	bool dolock;
+	struct klogbuf *kl;
 
 	dolock = kprintf_lock != NULL
 		&& curthread->t_in_interrupt == false
 		&& curthread->t_curspl == 0
 		&& curcpu->c_spinlocks == 0;
 
+	if (klog_on) {
+		/* if we move to another cpu meanwhile, no matter */
+		kl = klogbufs[curcpu->c_number];
+		if (dolock && kl->kl_count > KLOG_SIZE / 2) {
+			klog_work(kl);
+		}
+
+		spinlock_acquire(&kl->kl_lock);
+		va_start(ap, fmt);
+		chars = __vprintf(klog_send, kl, fmt, ap);
+		va_end(ap);
+		spinlock_release(&kl->kl_lock);
+
+		work_schedule(&kl->kl_work);
+		return chars;
+	}
+
 	if (dolock) {
 		lock_acquire(kprintf_lock);
 	}
@@ -155,9 +363,11 @@ panic(const char *fmt, ...)
 		 * Not only do we not want to be interrupted while
 		 * panicking, but we also want the console to be
 		 * printing in polling mode so as not to do context
-		 * switches. So turn interrupts off on this CPU.
+		 * switches. So turn interrupts off on this CPU, and
+		 * stop buffering.
 		 */
 		splhigh();
+		klog_on = false;
 	}
 
 	if (evil == 1) {
@@ -170,7 +380,8 @@ panic(const char *fmt, ...)
 	if (evil == 2) {
 		evil = 3;
 
-		/* Print the message. */
+		/* Print what's still buffered, then the message. */
+		klog_printall(true);
 		kprintf("panic: ");
 		va_start(ap, fmt);
 		__vprintf(console_send, NULL, fmt, ap);
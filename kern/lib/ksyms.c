@@ -0,0 +1,44 @@
+/*
+ * Kernel symbol lookup; see <ksyms.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <ksyms.h>
+
+int
+ksym_index(vaddr_t addr)
+{
+	unsigned lo, hi, mid;
+
+	if (nksyms == 0 || addr < ksyms[0].ks_addr) {
+		return -1;
+	}
+
+	/* find the last entry at or below ADDR */
+	lo = 0;
+	hi = nksyms;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (ksyms[mid].ks_addr <= addr) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+const char *
+ksym_lookup(vaddr_t addr, vaddr_t *offset)
+{
+	int i;
+
+	i = ksym_index(addr);
+	if (i < 0) {
+		return NULL;
+	}
+	*offset = addr - ksyms[i].ks_addr;
+	return ksyms[i].ks_name;
+}
@@ -33,6 +33,7 @@
 #include <proc.h>
 #include <current.h>
 #include <copyinout.h>
+#include <vm.h>
 
 /*
  * See uio.h for a description.
@@ -82,11 +83,12 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 
 		switch (uio->uio_segflg) {
 		    case UIO_SYSSPACE:
+			    /* two buffers in the kernel never overlap */
 			    if (uio->uio_rw == UIO_READ) {
-				    memmove(iov->iov_kbase, ptr, size);
+				    memcpy(iov->iov_kbase, ptr, size);
 			    }
 			    else {
-				    memmove(ptr, iov->iov_kbase, size);
+				    memcpy(ptr, iov->iov_kbase, size);
 			    }
 			    iov->iov_kbase = ((char *)iov->iov_kbase+size);
 			    break;
@@ -161,6 +163,7 @@ uio_kinit(struct iovec *iov, struct uio *u,
 	u->uio_segflg = UIO_SYSSPACE;
 	u->uio_rw = rw;
 	u->uio_space = NULL;
+	u->uio_direct = false;
 }
 
 /*
@@ -183,4 +186,71 @@ uio_uinit(struct iovec *iov, struct uio *u,
 	u->uio_segflg = UIO_USERSPACE;
 	u->uio_rw = rw;
 	u->uio_space = proc_getas();
+	u->uio_direct = false;
+}
+
+/*
+ * Set up a uio for a userspace transfer to or from several buffers,
+ * whose iovecs are already in the kernel.
+ */
+
+void
+uio_uinitv(struct iovec *iov, unsigned iovcnt, struct uio *u,
+	   off_t offset, enum uio_rw rw)
+{
+	unsigned i;
+
+	DEBUGASSERT(iov != NULL);
+	DEBUGASSERT(u != NULL);
+
+	u->uio_iov = iov;
+	u->uio_iovcnt = iovcnt;
+	u->uio_offset = offset;
+	u->uio_resid = 0;
+	for (i=0; i<iovcnt; i++) {
+		u->uio_resid += iov[i].iov_len;
+	}
+	u->uio_segflg = UIO_USERSPACE;
+	u->uio_rw = rw;
+	u->uio_space = proc_getas();
+	u->uio_direct = false;
+}
+
+/*
+ * Whole user pages, for moving them by remapping rather than copying.
+ */
+
+bool
+uio_userpage(struct uio *uio, vaddr_t *page)
+{
+	vaddr_t base;
+
+	if (uio->uio_segflg != UIO_USERSPACE || uio->uio_resid < PAGE_SIZE) {
+		return false;
+	}
+
+	/* uiomove leaves used-up iovecs behind; step past them */
+	while (uio->uio_iov->iov_len == 0) {
+		KASSERT(uio->uio_iovcnt > 1);
+		uio->uio_iov++;
+		uio->uio_iovcnt--;
+	}
+
+	base = (vaddr_t)uio->uio_iov->iov_ubase;
+	if (uio->uio_iov->iov_len < PAGE_SIZE || base % PAGE_SIZE != 0) {
+		return false;
+	}
+	*page = base;
+	return true;
+}
+
+void
+uio_skip(struct uio *uio, size_t len)
+{
+	KASSERT(uio->uio_iov->iov_len >= len);
+
+	uio->uio_iov->iov_ubase += len;
+	uio->uio_iov->iov_len -= len;
+	uio->uio_resid -= len;
+	uio->uio_offset += len;
 }
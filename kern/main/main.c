@@ -36,6 +36,7 @@
 #include <kern/reboot.h>
 #include <kern/unistd.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <spl.h>
 #include <clock.h>
 #include <thread.h>
@@ -43,13 +44,19 @@
 #include <current.h>
 #include <synch.h>
 #include <vm.h>
+#include <addrspace.h>
+#include <kinfo.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <buf.h>
 #include <device.h>
 #include <pid.h>
+#include <futex.h>
+#include <workqueue.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <platform/cpufreq.h>
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -73,6 +80,100 @@ static const char harvard_copyright[] =
     "   President and Fellows of Harvard College.  All rights reserved.\n";
 
 
+/*
+ * Boot timing. boot() calls boot_mark at the end of each phase, and
+ * the times are printed once it's done; boot_firstexec then reports
+ * how long after that the first program got started.
+ *
+ * Until the devices are in there's no clock, so the early phases are
+ * timed by CPU 0's cycle counter, which counts from when the timer
+ * last went off; boot() puts the timer off (with interrupts still
+ * disabled) until mainbus_bootstrap sets it going. From there on the
+ * clock is used.
+ */
+#define BOOT_NPHASES	5
+
+static const char *const boot_phasenames[BOOT_NPHASES] = {
+	"early", "devices", "late", "cpus", "bootfs",
+};
+static uint32_t boot_usecs[BOOT_NPHASES];
+static unsigned boot_phase;
+static uint32_t boot_lastcycles;
+static bool boot_clock;
+static struct timespec boot_lasttime;
+static volatile spinlock_data_t boot_execed;
+
+static
+void
+boot_mark(void)
+{
+	struct timespec now, diff;
+	uint32_t cycles;
+
+	KASSERT(boot_phase < BOOT_NPHASES);
+	if (!boot_clock) {
+		cycles = mainbus_cycles();
+		boot_usecs[boot_phase] = (cycles - boot_lastcycles) /
+			(CPU_FREQUENCY / 1000000);
+		boot_lastcycles = cycles;
+	}
+	else {
+		gettime(&now);
+		timespec_sub(&now, &boot_lasttime, &diff);
+		boot_usecs[boot_phase] = diff.tv_sec * 1000000 +
+			diff.tv_nsec / 1000;
+		boot_lasttime = now;
+	}
+	boot_phase++;
+}
+
+/*
+ * Switch from the cycle counter to the clock.
+ */
+static
+void
+boot_startclock(void)
+{
+	gettime(&boot_lasttime);
+	boot_clock = true;
+}
+
+static
+void
+boot_printtimes(void)
+{
+	uint32_t total;
+	unsigned i;
+
+	total = 0;
+	kprintf("Boot phases:");
+	for (i=0; i<boot_phase; i++) {
+		kprintf(" %s %u.%03u ms", boot_phasenames[i],
+			boot_usecs[i] / 1000, boot_usecs[i] % 1000);
+		total += boot_usecs[i];
+	}
+	kprintf("; total %u.%03u ms\n", total / 1000, total % 1000);
+}
+
+/*
+ * Called by runprogram as it starts a program; reports the time
+ * since boot finished the first time.
+ */
+void
+boot_firstexec(void)
+{
+	struct timespec now, diff;
+
+	if (!boot_clock || spinlock_data_testandset(&boot_execed) != 0) {
+		return;
+	}
+	gettime(&now);
+	timespec_sub(&now, &boot_lasttime, &diff);
+	kprintf("First exec %llu.%03lu ms after boot\n",
+		(unsigned long long)diff.tv_sec * 1000 + diff.tv_nsec / 1000000,
+		(unsigned long)(diff.tv_nsec / 1000) % 1000);
+}
+
 /*
  * Initial boot sequence.
  */
@@ -107,20 +208,29 @@ boot(void)
 		GROUP_VERSION, buildconfig, buildversion);
 	kprintf("\n");
 
+	/* Put the timer off, for timing the first phases by cycles. */
+	mainbus_timer_set(0xffffffff);
+	boot_lastcycles = mainbus_cycles();
+
 	/* Early initialization. */
 	ram_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	pid_bootstrap();
+	futex_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
 	kheap_nextgeneration();
+	boot_mark();
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
 	KASSERT(curthread->t_curspl > 0);
 	mainbus_bootstrap();
+	boot_mark();
+	boot_startclock();
 	KASSERT(curthread->t_curspl == 0);
+	hardclock_start();
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
@@ -128,14 +238,23 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	kinfo_bootstrap();
+	buf_bootstrap();
 	kprintf_bootstrap();
-	exec_bootstrap();
+	boot_mark();
 	thread_start_cpus();
+	workqueue_bootstrap();
+	kprintf_async_bootstrap();
+	as_reap_bootstrap();
+	sysstat_bootstrap();
+	boot_mark();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
+	boot_mark();
 
 	kheap_nextgeneration();
+	boot_printtimes();
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -152,6 +271,7 @@ void
 shutdown(void)
 {
 
+	kprintf_sync();
 	kprintf("Shutting down.\n");
 
 	vfs_clearbootfs();
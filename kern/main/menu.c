@@ -36,17 +36,29 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <mainbus.h>
 #include <synch.h>
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <fs.h>
+#include <device.h>
 #include <sfs.h>
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <objcache.h>
+#include <buf.h>
+#include <namecache.h>
+#include <prof.h>
+#include <ktime.h>
+#include <ktrace.h>
 #include "opt-sfs.h"
+#include "opt-tmpfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -377,6 +389,9 @@ static const struct {
 #if OPT_SFS
 	{ "sfs", sfs_mount },
 #endif
+#if OPT_TMPFS
+	{ "tmpfs", tmpfs_mount },
+#endif
 };
 
 static
@@ -430,6 +445,40 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+/*
+ * Command to make a striped device out of several disks, e.g.
+ * "stripe sd0 16384 lhd1 lhd2" for sd0 across lhd1 and lhd2 in
+ * 16K units, which can then be mounted like a disk.
+ */
+static
+int
+cmd_stripe(int nargs, char **args)
+{
+	char *disk;
+	int unit, i;
+
+	if (nargs < 4) {
+		kprintf("Usage: stripe name unitbytes disk...\n");
+		return EINVAL;
+	}
+
+	unit = atoi(args[2]);
+	if (unit <= 0) {
+		kprintf("stripe: bad stripe unit %s\n", args[2]);
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colons after device names */
+	for (i=3; i<nargs; i++) {
+		disk = args[i];
+		if (disk[strlen(disk)-1]==':') {
+			disk[strlen(disk)-1] = 0;
+		}
+	}
+
+	return devstripe_create(args[1], unit, nargs - 3, &args[3]);
+}
+
 /*
  * Command to set the "boot fs".
  *
@@ -462,11 +511,133 @@ cmd_bootfs(int nargs, char **args)
 static
 int
 cmd_kheapstats(int nargs, char **args)
+{
+	int what;
+
+	if (nargs == 1) {
+		kheap_printstats();
+		objcache_printstats();
+		return 0;
+	}
+
+	if (nargs == 3 && !strcmp(args[1], "latency")) {
+		what = KHEAP_TRACE_LATENCY;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "sites")) {
+		what = KHEAP_TRACE_SITES;
+	}
+	else {
+		what = 0;
+	}
+
+	if (what != 0 && !strcmp(args[2], "on")) {
+		kheap_trace(what, true);
+	}
+	else if (what != 0 && !strcmp(args[2], "off")) {
+		kheap_trace(what, false);
+	}
+	else {
+		kprintf("Usage: kh [latency|sites on|off]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for lock contention: start or stop profiling, or with no
+ * argument print the counts so far.
+ */
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "start")) {
+		lock_profile(true);
+		kprintf("Lock profiling started.\n");
+		return 0;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		lock_profile(false);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: lk [start|stop]\n");
+		return 0;
+	}
+
+	lock_stats();
+	lock_printprofile();
+	spinlock_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buf_printstats();
+	namecache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_iostats(int nargs, char **args)
 {
 	(void)nargs;
 	(void)args;
 
-	kheap_printstats();
+	vfs_printiostats();
+	buf_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_sysstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sysstat_print();
+
+	return 0;
+}
+
+static
+int
+cmd_intrstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cpu_printintrstats();
+
+	return 0;
+}
+
+/*
+ * Command for region timing: print the counts, or clear them.
+ */
+static
+int
+cmd_ktime(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		ktime_reset();
+	}
+	else if (nargs == 1) {
+		ktime_print();
+	}
+	else {
+		kprintf("Usage: ktime [reset]\n");
+	}
 
 	return 0;
 }
@@ -500,6 +671,148 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "fifo")) {
+		frame_set_victim_policy(VICTIM_FIFO);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "clock")) {
+		frame_set_victim_policy(VICTIM_CLOCK);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vm [fifo|clock]\n");
+		return 0;
+	}
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for same-page merging: turn it on or off, or with no
+ * argument say whether it's on. The counts are in "vm".
+ */
+static
+int
+cmd_merge(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		result = vm_merge_start();
+		if (result) {
+			return result;
+		}
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_merge_stop();
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: merge [on|off]\n");
+		return 0;
+	}
+
+	kprintf("Page merging is %s.\n", vm_merge_running() ? "on" : "off");
+	return 0;
+}
+
+/*
+ * Command for what to do when memory runs out: kill the process using
+ * the most, or just fail the allocation that ran out.
+ */
+static
+int
+cmd_oom(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "largest")) {
+		vm_set_oom_policy(OOM_KILL_LARGEST);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "faulting")) {
+		vm_set_oom_policy(OOM_KILL_FAULTING);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: oom [largest|faulting]\n");
+		return 0;
+	}
+
+	kprintf("Out of memory, %s.\n",
+		vm_get_oom_policy() == OOM_KILL_LARGEST ?
+		"the largest process is killed" :
+		"the allocation fails");
+	return 0;
+}
+#endif
+
+/*
+ * Command for the profiler: start or stop it, or with no argument
+ * print the busiest functions so far.
+ */
+#define PROF_SHOW 20
+
+static
+int
+cmd_prof(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "start")) {
+		result = prof_start();
+		if (result) {
+			return result;
+		}
+		kprintf("Profiling started.\n");
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		prof_stop();
+		prof_print(PROF_SHOW);
+	}
+	else if (nargs == 1) {
+		prof_print(PROF_SHOW);
+	}
+	else {
+		kprintf("Usage: prof [start|stop]\n");
+	}
+
+	return 0;
+}
+
+#if OPT_KTRACE
+/*
+ * Command for event tracing: start or stop it, or with no argument
+ * print what has been recorded.
+ */
+static
+int
+cmd_ktrace(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "start")) {
+		result = ktrace_start();
+		if (result) {
+			return result;
+		}
+		kprintf("Tracing started.\n");
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		ktrace_stop();
+		kprintf("Tracing stopped.\n");
+	}
+	else if (nargs == 1) {
+		ktrace_print();
+	}
+	else {
+		kprintf("Usage: ktrace [start|stop]\n");
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -534,6 +847,7 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+	"[stripe]  Stripe disks together     ",
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
@@ -566,6 +880,9 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmalloc benchmark             ",
+	"[km6] kmalloc benchmark, all CPUs   ",
+	"[km7] kmalloc fragmentation test    ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -576,6 +893,10 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[sb1] Lock benchmark                ",
+	"[sb2] CV ping-pong benchmark        ",
+	"[sb3] Semaphore handoff benchmark   ",
+	"[sb4] Spinlock benchmark            ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[wt]  waitpid test                  ",
 	"[fs1] Filesystem test               ",
@@ -606,6 +927,21 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[lk] Lock contention [start|stop]   ",
+	"[bc] Buffer cache stats             ",
+	"[io] Disk I/O stats                 ",
+#if !OPT_DUMBVM
+	"[vm] Paging stats [fifo|clock]      ",
+	"[merge] Page merging [on|off]       ",
+	"[oom] OOM policy [largest|faulting] ",
+#endif
+	"[sys] System call stats             ",
+	"[intr] Interrupt and IPI stats      ",
+	"[ktime] Region timing [reset]       ",
+	"[prof] Profiler [start|stop]        ",
+#if OPT_KTRACE
+	"[ktrace] Event trace [start|stop]   ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -641,6 +977,7 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
+	{ "stripe",	cmd_stripe },
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
@@ -657,6 +994,21 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "lk",         cmd_lockstats },
+	{ "bc",         cmd_bufstats },
+	{ "io",         cmd_iostats },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+	{ "merge",      cmd_merge },
+	{ "oom",        cmd_oom },
+#endif
+	{ "sys",        cmd_sysstats },
+	{ "intr",       cmd_intrstats },
+	{ "ktime",      cmd_ktime },
+	{ "prof",       cmd_prof },
+#if OPT_KTRACE
+	{ "ktrace",     cmd_ktrace },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +1019,9 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmallocbench },
+	{ "km6",	kmallocbench_mp },
+	{ "km7",	kmallocfrag },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -680,6 +1035,12 @@ static struct {
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
 
+	/* synchronization benchmarks */
+	{ "sb1",	synchbench_lock },
+	{ "sb2",	synchbench_cv },
+	{ "sb3",	synchbench_sem },
+	{ "sb4",	synchbench_spinlock },
+
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
 	{ "semu2",	semu2 },
@@ -42,6 +42,8 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <membar.h>
+#include <objcache.h>
 #include <pid.h>
 
 /*
@@ -50,29 +52,111 @@
  * If pi_ppid is INVALID_PID, the parent has gone away and will not be
  * waiting. If pi_ppid is INVALID_PID and pi_exited is true, the
  * structure can be freed.
+ *
+ * While the parent is around, the structure is also on its list of
+ * children, so that when the parent exits it can disown them, and
+ * waitpid can find one that has exited, without going through the
+ * whole table. pi_cv is signalled whenever one of our children exits.
  */
 struct pidinfo {
 	pid_t pi_pid;			// process id of this thread
 	pid_t pi_ppid;			// process id of parent thread
 	volatile bool pi_exited;	// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
-	struct cv *pi_cv;		// use to wait for thread exit
+	struct schedstats pi_usage;	// accounting, with its children's
+	struct cv *pi_cv;		// use to wait for a child's exit
+	struct pidinfo *pi_children;	// our children that we may wait for
+	struct pidinfo *pi_sibnext;	// next on our parent's list
+	struct pidinfo **pi_sibprevp;	// what points at us on that list
 };
 
 
 /*
  * Global pid and exit data.
  *
- * The process table is an el-cheapo hash table. It's indexed by
- * (pid % PROCS_MAX), and only allows one process per slot. If a
- * new pid allocation would cause a hash collision, we just don't
- * use that pid.
+ * The process table is a two-level radix tree indexed by the pid
+ * itself: pidtable has a pointer to a leaf of PIDLEAF_SIZE slots for
+ * each block of pids, and the leaves are allocated as pids in their
+ * block are first used. Leaves are never freed. Which pids are in use
+ * is kept in the pid_inuse bitmap, and which words of that are full
+ * in pid_wordfull, so finding the next free pid looks at no more than
+ * a few dozen words however full the table is. Pids are handed out
+ * in order from nextpid, wrapping, so they aren't reused right away.
+ *
+ * Changes to the table and the bitmaps are made holding pidlock, and
+ * nothing else is: it is held only for the few stores that put a
+ * pidinfo in or take it out.
+ *
+ * A process's list of children, and the exit fields (pi_ppid,
+ * pi_exited, pi_exitstatus, pi_usage) of the children on it, are
+ * covered instead by its family lock: one of PIDFAMILY_LOCKS, picked
+ * by the parent's pid, so that fork, exit and wait in unrelated
+ * processes mostly don't meet. While we hold our own family lock our
+ * children can't be freed, since only we can take them off our list.
+ * The family lock comes before pidlock.
+ *
+ * A child only ever changes pi_ppid to INVALID_PID, and once it has
+ * the child is nobody else's business: an orphan that exits frees
+ * its own pidinfo without taking any family lock.
+ *
+ * Lookups can also be done without any lock, by pi_peek, for checks
+ * in pid_wait that don't wait or reap. pidtable_seq is a sequence
+ * count that pi_drop makes odd while it takes a pidinfo out and frees
+ * it, and even again afterwards: a lockless reader that sees the same
+ * even count before and after knows nothing it looked at was freed
+ * underneath it.
  */
-static struct lock *pidlock;		// lock for global exit data
-static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
+#define NPIDS		(PID_MAX + 1)
+#define PIDLEAF_SIZE	256
+#define NPIDLEAVES	DIVROUNDUP(NPIDS, PIDLEAF_SIZE)
+#define NPIDWORDS	DIVROUNDUP(NPIDS, 32)
+#define NPIDFULLWORDS	DIVROUNDUP(NPIDWORDS, 32)
+#define PIDFAMILY_LOCKS	32
+#define PIDFAMILY(pid)	(pidfamily[(pid) % PIDFAMILY_LOCKS])
+
+struct pidleaf {
+	struct pidinfo *volatile pl_slots[PIDLEAF_SIZE];
+};
+
+static struct lock *pidlock;		// lock for the table
+static struct lock *pidfamily[PIDFAMILY_LOCKS]; // locks for child lists
+static struct pidleaf *volatile pidtable[NPIDLEAVES]; // actual pid info
+static uint32_t pid_inuse[NPIDWORDS];	// pids allocated
+static uint32_t pid_wordfull[NPIDFULLWORDS]; // pid_inuse words ~0
+static volatile unsigned pidtable_seq;	// for lockless lookups
 static pid_t nextpid;			// next candidate pid
-static int nprocs;			// number of allocated pids
 
+/*
+ * pidinfo structures are cached with their CVs already made, since
+ * every fork and exit goes through one.
+ */
+static int pidinfo_ctor(void *obj);
+static void pidinfo_dtor(void *obj);
+static struct objcache pidinfo_cache =
+	OBJCACHE_INITIALIZER("pidinfo", sizeof(struct pidinfo),
+			     pidinfo_ctor, pidinfo_dtor);
+
+static
+int
+pidinfo_ctor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	pi->pi_cv = cv_create("pidinfo cv");
+	if (pi->pi_cv == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+pidinfo_dtor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	cv_destroy(pi->pi_cv);
+}
 
 
 /*
@@ -86,21 +170,18 @@ pidinfo_create(pid_t pid, pid_t ppid)
 
 	KASSERT(pid != INVALID_PID);
 
-	pi = kmalloc(sizeof(struct pidinfo));
+	pi = objcache_alloc(&pidinfo_cache);
 	if (pi==NULL) {
 		return NULL;
 	}
 
-	pi->pi_cv = cv_create("pidinfo cv");
-	if (pi->pi_cv == NULL) {
-		kfree(pi);
-		return NULL;
-	}
-
 	pi->pi_pid = pid;
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
 	pi->pi_exitstatus = 0xbeef;  /* Recognizably invalid value */
+	pi->pi_children = NULL;
+	pi->pi_sibnext = NULL;
+	pi->pi_sibprevp = NULL;
 
 	return pi;
 }
@@ -114,8 +195,106 @@ pidinfo_destroy(struct pidinfo *pi)
 {
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
-	cv_destroy(pi->pi_cv);
-	kfree(pi);
+	KASSERT(pi->pi_children == NULL);
+	KASSERT(pi->pi_sibprevp == NULL);
+	/* the cv stays with it in the cache */
+	objcache_free(&pidinfo_cache, pi);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Mark PID used or free in the bitmaps.
+ */
+static
+void
+pid_mark(pid_t pid, bool used)
+{
+	unsigned w = pid / 32;
+
+	if (used) {
+		pid_inuse[w] |= (uint32_t)1 << (pid % 32);
+	}
+	else {
+		pid_inuse[w] &= ~((uint32_t)1 << (pid % 32));
+	}
+
+	if (pid_inuse[w] == 0xffffffff) {
+		pid_wordfull[w / 32] |= (uint32_t)1 << (w % 32);
+	}
+	else {
+		pid_wordfull[w / 32] &= ~((uint32_t)1 << (w % 32));
+	}
+}
+
+/*
+ * The lowest clear bit in BITS, which isn't all ones.
+ */
+static
+unsigned
+lowzero(uint32_t bits)
+{
+	unsigned i;
+
+	KASSERT(bits != 0xffffffff);
+	for (i=0; bits & 1; i++) {
+		bits >>= 1;
+	}
+	return i;
+}
+
+/*
+ * The first pid_inuse word at or after FROM with a free pid, or -1.
+ */
+static
+int
+pid_findword(unsigned from)
+{
+	unsigned s;
+	uint32_t bits;
+
+	for (s = from / 32; s < NPIDFULLWORDS; s++) {
+		bits = pid_wordfull[s];
+		if (s == from / 32) {
+			/* not the words before FROM */
+			bits |= ((uint32_t)1 << (from % 32)) - 1;
+		}
+		if (bits != 0xffffffff) {
+			return s * 32 + lowzero(bits);
+		}
+	}
+	return -1;
+}
+
+/*
+ * The next free pid from nextpid on, wrapping round, or INVALID_PID
+ * if they're all in use.
+ */
+static
+pid_t
+pid_findfree(void)
+{
+	unsigned w;
+	uint32_t bits;
+	int ww;
+
+	KASSERT(lock_do_i_hold(pidlock));
+
+	/* nextpid's own word, from nextpid up */
+	w = nextpid / 32;
+	bits = pid_inuse[w] | (((uint32_t)1 << (nextpid % 32)) - 1);
+	if (bits != 0xffffffff) {
+		return w * 32 + lowzero(bits);
+	}
+
+	ww = pid_findword(w + 1);
+	if (ww < 0) {
+		ww = pid_findword(0);
+		if (ww < 0) {
+			return INVALID_PID;
+		}
+	}
+	return ww * 32 + lowzero(pid_inuse[ww]);
 }
 
 ////////////////////////////////////////////////////////////
@@ -126,104 +305,248 @@ pidinfo_destroy(struct pidinfo *pi)
 void
 pid_bootstrap(void)
 {
-	int i;
+	struct pidinfo *pi;
+	pid_t pid;
+	unsigned i;
 
-	pidlock = lock_create("pidlock");
+	pidlock = lock_create_adaptive("pidlock");
 	if (pidlock == NULL) {
 		panic("Out of memory creating pid lock\n");
 	}
+	for (i=0; i<PIDFAMILY_LOCKS; i++) {
+		pidfamily[i] = lock_create_adaptive("pidfamily");
+		if (pidfamily[i] == NULL) {
+			panic("Out of memory creating pid family locks\n");
+		}
+	}
 
-	/* not really necessary - should start zeroed */
-	for (i=0; i<PROCS_MAX; i++) {
-		pidinfo[i] = NULL;
+	/* The tables start zeroed; pids below PID_MIN are never handed out */
+	for (pid = 0; pid < PID_MIN; pid++) {
+		pid_mark(pid, true);
+	}
+	/* Nor are the bits past PID_MAX in the last word */
+	for (pid = NPIDS; pid < NPIDWORDS * 32; pid++) {
+		pid_mark(pid, true);
 	}
 
-	pidinfo[KERNEL_PID] = pidinfo_create(KERNEL_PID, INVALID_PID);
-	if (pidinfo[KERNEL_PID]==NULL) {
+	pidtable[0] = kmalloc(sizeof(struct pidleaf));
+	if (pidtable[0] == NULL) {
+		panic("Out of memory creating pid table\n");
+	}
+	bzero(pidtable[0], sizeof(struct pidleaf));
+
+	pi = pidinfo_create(KERNEL_PID, INVALID_PID);
+	if (pi==NULL) {
 		panic("Out of memory creating kernel pid data\n");
 	}
+	pidtable[0]->pl_slots[KERNEL_PID] = pi;
 
 	nextpid = PID_MIN;
-	nprocs = 1;
 }
 
 /*
- * pi_get: look up a pidinfo in the process table.
+ * pi_get: look up a pidinfo in the process table. Call with pidlock
+ * held, or, if it's our own or one of our children, with our family
+ * lock held; otherwise it might be freed as soon as we have it.
  */
 static
 struct pidinfo *
 pi_get(pid_t pid)
 {
-	struct pidinfo *pi;
+	struct pidleaf *leaf;
 
 	KASSERT(pid>=0);
 	KASSERT(pid != INVALID_PID);
-	KASSERT(lock_do_i_hold(pidlock));
 
-	pi = pidinfo[pid % PROCS_MAX];
-	if (pi==NULL) {
+	if (pid > PID_MAX) {
 		return NULL;
 	}
-	if (pi->pi_pid != pid) {
+	leaf = pidtable[pid / PIDLEAF_SIZE];
+	if (leaf == NULL) {
 		return NULL;
 	}
-	return pi;
+	return leaf->pl_slots[pid % PIDLEAF_SIZE];
 }
 
 /*
- * pi_put: insert a new pidinfo in the process table. The right slot
- * must be empty.
+ * pi_peek: check, without any lock, whether PID is a live child of
+ * PPID that hasn't exited, as pid_wait does before waiting. Returns
+ * 0 if so, ESRCH if there's no such pid, or EAGAIN if it's anything
+ * else or the table changed while we looked; then take the family
+ * lock and look again properly.
+ */
+static
+int
+pi_peek(pid_t pid, pid_t ppid)
+{
+	struct pidleaf *leaf;
+	struct pidinfo *pi;
+	unsigned seq;
+	int result;
+
+	if (pid > PID_MAX) {
+		return ESRCH;
+	}
+
+	seq = pidtable_seq;
+	if (seq % 2 != 0) {
+		return EAGAIN;
+	}
+	membar_load_load();
+
+	leaf = pidtable[pid / PIDLEAF_SIZE];
+	pi = leaf == NULL ? NULL : leaf->pl_slots[pid % PIDLEAF_SIZE];
+	if (pi == NULL) {
+		/* we saw it empty, so it was; nothing after that matters */
+		return ESRCH;
+	}
+	if (pi->pi_pid == pid && pi->pi_ppid == ppid && !pi->pi_exited) {
+		result = 0;
+	}
+	else {
+		result = EAGAIN;
+	}
+
+	membar_load_load();
+	if (pidtable_seq != seq) {
+		return EAGAIN;
+	}
+	return result;
+}
+
+/*
+ * pi_put: insert a new pidinfo in the process table, and on its
+ * parent's list of children. The slot must be empty and its leaf
+ * must exist. Call with the parent's family lock and pidlock held.
  */
 static
 void
 pi_put(pid_t pid, struct pidinfo *pi)
 {
+	struct pidleaf *leaf;
+	struct pidinfo *parent;
+
+	KASSERT(lock_do_i_hold(PIDFAMILY(pi->pi_ppid)));
 	KASSERT(lock_do_i_hold(pidlock));
 
 	KASSERT(pid != INVALID_PID);
 
-	KASSERT(pidinfo[pid % PROCS_MAX] == NULL);
-	pidinfo[pid % PROCS_MAX] = pi;
-	nprocs++;
+	parent = pi_get(pi->pi_ppid);
+	KASSERT(parent != NULL);
+	pi->pi_sibnext = parent->pi_children;
+	if (parent->pi_children != NULL) {
+		parent->pi_children->pi_sibprevp = &pi->pi_sibnext;
+	}
+	pi->pi_sibprevp = &parent->pi_children;
+	parent->pi_children = pi;
+
+	leaf = pidtable[pid / PIDLEAF_SIZE];
+	KASSERT(leaf != NULL);
+	KASSERT(leaf->pl_slots[pid % PIDLEAF_SIZE] == NULL);
+	pid_mark(pid, true);
+
+	/* lockless readers must see it filled in before it's there */
+	membar_store_store();
+	leaf->pl_slots[pid % PIDLEAF_SIZE] = pi;
+}
+
+/*
+ * pi_orphan: take a pidinfo off its parent's list of children and
+ * forget the parent. Call with the parent's family lock held.
+ */
+static
+void
+pi_orphan(struct pidinfo *pi)
+{
+	KASSERT(pi->pi_ppid != INVALID_PID);
+	KASSERT(lock_do_i_hold(PIDFAMILY(pi->pi_ppid)));
+	KASSERT(pi->pi_sibprevp != NULL);
+
+	*pi->pi_sibprevp = pi->pi_sibnext;
+	if (pi->pi_sibnext != NULL) {
+		pi->pi_sibnext->pi_sibprevp = pi->pi_sibprevp;
+	}
+	pi->pi_sibnext = NULL;
+	pi->pi_sibprevp = NULL;
+
+	/* an exiting child that sees INVALID_PID must see it unlinked */
+	membar_store_store();
+	pi->pi_ppid = INVALID_PID;
 }
 
 /*
  * pi_drop: remove a pidinfo structure from the process table and free
  * it. It should reflect a process that has already exited and been
- * waited for.
+ * waited for or orphaned.
  */
 static
 void
-pi_drop(pid_t pid)
+pi_drop(struct pidinfo *pi)
 {
-	struct pidinfo *pi;
+	pid_t pid = pi->pi_pid;
 
-	KASSERT(lock_do_i_hold(pidlock));
+	lock_acquire(pidlock);
+	KASSERT(pi_get(pid) == pi);
 
-	pi = pidinfo[pid % PROCS_MAX];
-	KASSERT(pi != NULL);
-	KASSERT(pi->pi_pid == pid);
+	pidtable_seq++;
+	membar_store_store();
+	pidtable[pid / PIDLEAF_SIZE]->pl_slots[pid % PIDLEAF_SIZE] = NULL;
+	membar_store_store();
+	pidtable_seq++;
 
+	pid_mark(pid, false);
+	lock_release(pidlock);
+
+	/* lockless readers that saw it will see the count change */
 	pidinfo_destroy(pi);
-	pidinfo[pid % PROCS_MAX] = NULL;
-	nprocs--;
+}
+
+/*
+ * pi_findchild: look on our list of children for PID, or with
+ * WAIT_ANY for any that has exited. Call with our family lock held.
+ */
+static
+struct pidinfo *
+pi_findchild(struct pidinfo *us, pid_t pid)
+{
+	struct pidinfo *kid;
+
+	KASSERT(lock_do_i_hold(PIDFAMILY(us->pi_pid)));
+
+	for (kid = us->pi_children; kid != NULL; kid = kid->pi_sibnext) {
+		KASSERT(kid->pi_ppid == us->pi_pid);
+		if (pid == WAIT_ANY ? kid->pi_exited : kid->pi_pid == pid) {
+			return kid;
+		}
+	}
+	return NULL;
 }
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Helper function for pid_alloc.
+ * Make sure the leaf of the table that PID goes in exists.
  */
 static
-void
-inc_nextpid(void)
+int
+pi_getleaf(pid_t pid)
 {
+	struct pidleaf *leaf;
+
 	KASSERT(lock_do_i_hold(pidlock));
 
-	nextpid++;
-	if (nextpid > PID_MAX) {
-		nextpid = PID_MIN;
+	if (pidtable[pid / PIDLEAF_SIZE] != NULL) {
+		return 0;
+	}
+
+	leaf = kmalloc(sizeof(*leaf));
+	if (leaf == NULL) {
+		return ENOMEM;
 	}
+	bzero(leaf, sizeof(*leaf));
+	membar_store_store();
+	pidtable[pid / PIDLEAF_SIZE] = leaf;
+	return 0;
 }
 
 /*
@@ -234,46 +557,44 @@ pid_alloc(pid_t *retval)
 {
 	struct pidinfo *pi;
 	pid_t pid;
-	int count;
+	int result;
 
 	KASSERT(curproc->p_pid != INVALID_PID);
 
-	/* lock the table */
+	/* lock our child list, then the table */
+	lock_acquire(PIDFAMILY(curproc->p_pid));
 	lock_acquire(pidlock);
 
-	if (nprocs == PROCS_MAX) {
+	pid = pid_findfree();
+	if (pid == INVALID_PID) {
 		lock_release(pidlock);
+		lock_release(PIDFAMILY(curproc->p_pid));
 		return EAGAIN;
 	}
 
-	/*
-	 * The above test guarantees that this loop terminates, unless
-	 * our nprocs count is off. Even so, assert we aren't looping
-	 * forever.
-	 */
-	count = 0;
-	while (pidinfo[nextpid % PROCS_MAX] != NULL) {
-
-		/* avoid various boundary cases by allowing extra loops */
-		KASSERT(count < PROCS_MAX*2+5);
-		count++;
-
-		inc_nextpid();
+	result = pi_getleaf(pid);
+	if (result) {
+		lock_release(pidlock);
+		lock_release(PIDFAMILY(curproc->p_pid));
+		return result;
 	}
 
-	pid = nextpid;
-
 	pi = pidinfo_create(pid, curproc->p_pid);
 	if (pi==NULL) {
 		lock_release(pidlock);
+		lock_release(PIDFAMILY(curproc->p_pid));
 		return ENOMEM;
 	}
 
 	pi_put(pid, pi);
 
-	inc_nextpid();
+	nextpid = pid + 1;
+	if (nextpid > PID_MAX) {
+		nextpid = PID_MIN;
+	}
 
 	lock_release(pidlock);
+	lock_release(PIDFAMILY(curproc->p_pid));
 
 	*retval = pid;
 	return 0;
@@ -290,21 +611,22 @@ pid_unalloc(pid_t theirpid)
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
+	lock_acquire(PIDFAMILY(curproc->p_pid));
 
 	them = pi_get(theirpid);
 	KASSERT(them != NULL);
 	KASSERT(them->pi_exited == false);
 	KASSERT(them->pi_ppid == curproc->p_pid);
+	KASSERT(them->pi_children == NULL);
 
 	/* keep pidinfo_destroy from complaining */
 	them->pi_exitstatus = 0xdead;
 	them->pi_exited = true;
-	them->pi_ppid = INVALID_PID;
+	pi_orphan(them);
 
-	pi_drop(theirpid);
+	pi_drop(them);
 
-	lock_release(pidlock);
+	lock_release(PIDFAMILY(curproc->p_pid));
 }
 
 /*
@@ -318,18 +640,59 @@ pid_disown(pid_t theirpid)
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
+	lock_acquire(PIDFAMILY(curproc->p_pid));
 
 	them = pi_get(theirpid);
 	KASSERT(them != NULL);
 	KASSERT(them->pi_ppid==curproc->p_pid);
 
-	them->pi_ppid = INVALID_PID;
+	pi_orphan(them);
 	if (them->pi_exited) {
-		pi_drop(them->pi_pid);
+		pi_drop(them);
 	}
 
+	lock_release(PIDFAMILY(curproc->p_pid));
+}
+
+/*
+ * pid_getppid - return the parent of PID, or INVALID_PID if it has
+ * none any more (or PID itself is gone).
+ */
+pid_t
+pid_getppid(pid_t targetpid)
+{
+	struct pidinfo *pi;
+	pid_t ppid;
+
+	lock_acquire(pidlock);
+	pi = pi_get(targetpid);
+	ppid = pi == NULL ? INVALID_PID : pi->pi_ppid;
 	lock_release(pidlock);
+
+	return ppid;
+}
+
+/*
+ * pid_countchildren - count the current process's children that are
+ * still on its list (not waited for or disowned), up to MAX.
+ */
+unsigned
+pid_countchildren(unsigned max)
+{
+	struct pidinfo *us, *kid;
+	unsigned n;
+
+	n = 0;
+	lock_acquire(PIDFAMILY(curproc->p_pid));
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
+	for (kid = us->pi_children; kid != NULL && n < max;
+	     kid = kid->pi_sibnext) {
+		n++;
+	}
+	lock_release(PIDFAMILY(curproc->p_pid));
+
+	return n;
 }
 
 /*
@@ -343,42 +706,65 @@ pid_disown(pid_t theirpid)
 void
 pid_setexitstatus(int status)
 {
-	struct pidinfo *us;
-	int i;
+	struct pidinfo *us, *kid, *parent;
+	struct schedstats usage, childusage;
+	pid_t mypid, ppid;
 
-	lock_acquire(pidlock);
-	KASSERT(curproc->p_pid != INVALID_PID);
+	/* Total our accounting for the parent, before taking any locks */
+	proc_getstats(curproc, false, &usage);
+	proc_getstats(curproc, true, &childusage);
+	schedstats_add(&usage, &childusage);
+
+	mypid = curproc->p_pid;
+	KASSERT(mypid != INVALID_PID);
 
 	/* First, disown all children */
-	for (i=0; i<PROCS_MAX; i++) {
-		if (pidinfo[i]==NULL) {
-			continue;
-		}
-		if (pidinfo[i]->pi_ppid == curproc->p_pid) {
-			pidinfo[i]->pi_ppid = INVALID_PID;
-			if (pidinfo[i]->pi_exited) {
-				pi_drop(pidinfo[i]->pi_pid);
-			}
+	lock_acquire(PIDFAMILY(mypid));
+	us = pi_get(mypid);
+	KASSERT(us != NULL);
+	while ((kid = us->pi_children) != NULL) {
+		pi_orphan(kid);
+		if (kid->pi_exited) {
+			pi_drop(kid);
 		}
 	}
+	lock_release(PIDFAMILY(mypid));
 
-	/* Now, wake up our parent */
-	us = pi_get(curproc->p_pid);
-	KASSERT(us != NULL);
+	/*
+	 * Now find our parent's family lock. The parent may orphan us
+	 * while we look, but it can't adopt us again, so by the time
+	 * we have the lock for the pid we saw either it's still ours
+	 * or we have none.
+	 */
+	while (1) {
+		ppid = us->pi_ppid;
+		if (ppid == INVALID_PID) {
+			break;
+		}
+		lock_acquire(PIDFAMILY(ppid));
+		if (us->pi_ppid == ppid) {
+			break;
+		}
+		lock_release(PIDFAMILY(ppid));
+	}
 
 	us->pi_exitstatus = status;
+	us->pi_usage = usage;
 	us->pi_exited = true;
+	curproc->p_pid = INVALID_PID;
 
-	if (us->pi_ppid == INVALID_PID) {
-		/* no parent */
-		pi_drop(curproc->p_pid);
+	if (ppid == INVALID_PID) {
+		/* no parent; pi_orphan unlinked us before we saw that */
+		membar_load_load();
+		pi_drop(us);
 	}
 	else {
-		cv_broadcast(us->pi_cv, pidlock);
+		/* it hasn't got round to disowning us, so it's still there */
+		parent = pi_get(ppid);
+		KASSERT(parent != NULL);
+		cv_broadcast(parent->pi_cv, PIDFAMILY(ppid));
+		lock_release(PIDFAMILY(ppid));
 	}
-
-	curproc->p_pid = INVALID_PID;
-	lock_release(pidlock);
 }
 
 /*
@@ -386,27 +772,32 @@ pid_setexitstatus(int status)
  * status and ret are a kernel pointers, but pid/flags may come from
  * userland and may thus be maliciously invalid.
  *
+ * theirpid may be WAIT_ANY, to take whichever child exits first.
+ *
  * status may be null, in which case the status is thrown away. ret
- * may only be null if WNOHANG is not set.
+ * may only be null if WNOHANG is not set and theirpid isn't WAIT_ANY.
  */
 int
 pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 {
-	struct pidinfo *them;
+	struct pidinfo *us, *them;
+	pid_t mypid;
+	int result;
 
-	KASSERT(curproc->p_pid != INVALID_PID);
+	mypid = curproc->p_pid;
+	KASSERT(mypid != INVALID_PID);
 
 	/* Don't let a process wait for itself. */
-	if (theirpid == curproc->p_pid) {
+	if (theirpid == mypid) {
 		return EINVAL;
 	}
 
 	/*
-	 * We don't support the Unix meanings of negative pids or 0
-	 * (0 is INVALID_PID) and other code may break on them, so
-	 * check now.
+	 * We don't support process groups, so the Unix meanings of
+	 * other negative pids and 0 (which is INVALID_PID and other
+	 * code may break on) aren't either; check now.
 	 */
-	if (theirpid == INVALID_PID || theirpid<0) {
+	if (theirpid == INVALID_PID || (theirpid < 0 && theirpid != WAIT_ANY)) {
 		return ENOSYS;
 	}
 
@@ -415,51 +806,79 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 		return EINVAL;
 	}
 
-	lock_acquire(pidlock);
-
-	them = pi_get(theirpid);
-	if (them==NULL) {
-		lock_release(pidlock);
-		return ESRCH;
+	if (theirpid != WAIT_ANY) {
+		/*
+		 * Sort out a missing pid, and polling a child
+		 * that's still running, without taking any lock.
+		 * Anything else is looked at again below.
+		 */
+		result = pi_peek(theirpid, mypid);
+		if (result == ESRCH) {
+			return ESRCH;
+		}
+		if (result == 0 && flags == WNOHANG) {
+			KASSERT(ret != NULL);
+			*ret = 0;
+			return 0;
+		}
 	}
 
-	KASSERT(them->pi_pid==theirpid);
+	lock_acquire(PIDFAMILY(mypid));
+	us = pi_get(mypid);
+	KASSERT(us != NULL);
 
-	/* Only allow waiting for own children. */
-	if (them->pi_ppid != curproc->p_pid) {
-		lock_release(pidlock);
-		return EPERM;
-	}
+	while (1) {
+		them = pi_findchild(us, theirpid);
+		if (them == NULL && theirpid == WAIT_ANY) {
+			if (us->pi_children == NULL) {
+				lock_release(PIDFAMILY(mypid));
+				return ECHILD;
+			}
+		}
+		else if (them == NULL) {
+			/* Only allow waiting for own children. */
+			lock_release(PIDFAMILY(mypid));
+			lock_acquire(pidlock);
+			result = pi_get(theirpid) == NULL ? ESRCH : EPERM;
+			lock_release(pidlock);
+			return result;
+		}
+		else if (them->pi_exited) {
+			break;
+		}
 
-	if (them->pi_exited == false) {
 		if (flags == WNOHANG) {
-			lock_release(pidlock);
+			lock_release(PIDFAMILY(mypid));
 			KASSERT(ret != NULL);
 			*ret = 0;
 			return 0;
 		}
-		/* don't need to loop on this */
-		cv_wait(them->pi_cv, pidlock);
-		KASSERT(them->pi_exited == true);
+		/*
+		 * Any of our children exiting wakes us, and another
+		 * of our threads may reap the one we want, so look
+		 * again each time.
+		 */
+		cv_wait(us->pi_cv, PIDFAMILY(mypid));
 	}
 
 	if (status != NULL) {
 		*status = them->pi_exitstatus;
 	}
 	if (ret != NULL) {
-		/*
-		 * In Unix you can wait for any of several possible
-		 * processes by passing particular magic values of
-		 * pid. wait then returns the pid you actually
-		 * found. We don't support this, so always return the
-		 * pid we looked for.
-		 */
-		*ret = theirpid;
+		*ret = them->pi_pid;
+	}
+	else {
+		KASSERT(theirpid != WAIT_ANY);
 	}
 
-	them->pi_ppid = 0;
-	pi_drop(them->pi_pid);
+	/* Reaping it makes its time count as our children's */
+	lock_acquire(curproc->p_threadslock);
+	schedstats_add(&curproc->p_childstats, &them->pi_usage);
+	lock_release(curproc->p_threadslock);
 
-	lock_release(pidlock);
+	pi_orphan(them);
+	pi_drop(them);
+
+	lock_release(PIDFAMILY(mypid));
 	return 0;
 }
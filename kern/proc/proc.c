@@ -44,11 +44,17 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/procstat.h>
+#include <kern/wait.h>
+#include <signal.h>
 #include <spl.h>
 #include <synch.h>
+#include <clock.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <vnode.h>
 #include <pid.h>
 #include <filetable.h>
@@ -58,6 +64,26 @@
  */
 struct proc *kproc;
 
+/*
+ * All the processes, for ps. A process is on the list from when it's
+ * made until proc_destroy starts taking it apart, so holding
+ * allproc_lock keeps every process on it in one piece.
+ */
+static struct lock *allproc_lock;
+static struct proc *allproc;
+static unsigned nprocs;
+
+/*
+ * Processes the OOM killer has killed that are still on the list,
+ * under allproc_lock. It waits for a victim OOM_WAIT_TRIES times
+ * OOM_WAIT_NSEC at most.
+ */
+static unsigned nkilled;
+#define OOM_WAIT_NSEC	20000000	/* 20ms */
+#define OOM_WAIT_TRIES	50
+
+static void proc_remthread_locked(struct proc *proc, struct thread *t);
+
 /*
  * Create a proc structure.
  */
@@ -66,6 +92,7 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+	unsigned i;
 
 	proc = kmalloc(sizeof(*proc));
 	if (proc == NULL) {
@@ -77,24 +104,50 @@ proc_create(const char *name)
 		return NULL;
 	}
 
-	proc->p_threadslock = lock_create("p_threads");
+	proc->p_threadslock = lock_create_adaptive("p_threads");
 	if (proc->p_threadslock == NULL) {
 		kfree(proc->p_name);
 		kfree(proc);
 		return NULL;
 	}
 	threadarray_init(&proc->p_threads);
+	proc->p_exec = false;
 
 	spinlock_init(&proc->p_lock);
 	proc->p_pid = INVALID_PID;
+	proc->p_killed = false;
+	for (i=0; i<__RLIMIT_NUM; i++) {
+		proc->p_rlimits[i].rlim_cur = RLIM_INFINITY;
+		proc->p_rlimits[i].rlim_max = RLIM_INFINITY;
+	}
+	/* as far as a file table can go anyway */
+	proc->p_rlimits[RLIMIT_NOFILE].rlim_cur = OPEN_MAX;
+	proc->p_rlimits[RLIMIT_NOFILE].rlim_max = OPEN_MAX;
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_vforkwait = NULL;
+	proc->p_vforkparent = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
+	proc->p_cwdname = NULL;
 	proc->p_filetable = NULL;
 
+	/* Accounting */
+	bzero(&proc->p_stats, sizeof(proc->p_stats));
+	bzero(&proc->p_childstats, sizeof(proc->p_childstats));
+
+	lock_acquire(allproc_lock);
+	proc->p_allnext = allproc;
+	if (allproc != NULL) {
+		allproc->p_allprevp = &proc->p_allnext;
+	}
+	proc->p_allprevp = &allproc;
+	allproc = proc;
+	nprocs++;
+	lock_release(allproc_lock);
+
 	return proc;
 }
 
@@ -121,14 +174,30 @@ proc_destroy(struct proc *proc)
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
-	 * incorrect to destroy it.)
+	 * incorrect to destroy it.) But ps may be looking at it, so
+	 * wait for that and take it off the list first.
 	 */
+	lock_acquire(allproc_lock);
+	*proc->p_allprevp = proc->p_allnext;
+	if (proc->p_allnext != NULL) {
+		proc->p_allnext->p_allprevp = proc->p_allprevp;
+	}
+	nprocs--;
+	if (proc->p_killed) {
+		KASSERT(nkilled > 0);
+		nkilled--;
+	}
+	lock_release(allproc_lock);
 
 	/* VFS fields */
 	if (proc->p_cwd) {
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
 	}
+	if (proc->p_cwdname) {
+		kfree(proc->p_cwdname);
+		proc->p_cwdname = NULL;
+	}
 	if (proc->p_filetable) {
 		filetable_destroy(proc->p_filetable);
 		proc->p_filetable = NULL;
@@ -179,7 +248,14 @@ proc_destroy(struct proc *proc)
 			as = proc->p_addrspace;
 			proc->p_addrspace = NULL;
 		}
-		as_destroy(as);
+		/*
+		 * A vfork child hands the parent's back instead.
+		 * Otherwise tearing it down is left to a work queue
+		 * thread, so an exiting process doesn't wait for it.
+		 */
+		if (!proc_vfork_return(proc, as)) {
+			as_destroy_async(as);
+		}
 	}
 
 	KASSERT(proc->p_pid == INVALID_PID);
@@ -197,6 +273,11 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	allproc_lock = lock_create("allproc");
+	if (allproc_lock == NULL) {
+		panic("Could not create allproc lock\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -253,23 +334,38 @@ proc_create_runprogram(const char *name, struct proc **ret)
 }
 
 /*
- * Clone the current process.
+ * Fill in the kernel information page of AS, which PROC is to run in.
+ */
+static
+void
+proc_setkinfo(struct proc *proc, struct addrspace *as)
+{
+	if (as != NULL) {
+		as_setkinfo(as, proc->p_pid, pid_getppid(proc->p_pid));
+	}
+}
+
+/*
+ * Clone the current process, apart from its address space: the new
+ * process gets AS, and takes it over only if this succeeds.
  *
- * The new thread is given a copy of the caller's file handles if RET
- * is not null. (If RET is null, what we're creating is a kernel-only
- * thread and it doesn't need an address space or file handles.)
- * However, the new thread always inherits its current working
- * directory from the caller. The new thread is given no address space
- * (the caller decides that).
+ * The new process is given a copy of the caller's file handles, if
+ * it has any, and inherits its current working directory. This
+ * doesn't create a thread (the caller decides that).
  */
+static
 int
-proc_fork(struct proc **ret)
+proc_clone(struct addrspace *as, struct proc **ret)
 {
 	struct proc *newproc;
-	struct addrspace *as;
 	struct filetable *tbl;
 	int result;
 
+	result = proc_checkchildren();
+	if (result) {
+		return result;
+	}
+
 	newproc = proc_create(curproc->p_name);
 	if (newproc == NULL) {
 		return ENOMEM;
@@ -291,25 +387,11 @@ proc_fork(struct proc **ret)
 	}
 #endif
 
-	/* VM fields */
-	as = proc_getas();
-	if (as != NULL) {
-		result = as_copy(as, &newproc->p_addrspace);
-		if (result) {
-			pid_unalloc(newproc->p_pid);
-			newproc->p_pid = INVALID_PID;
-			proc_destroy(newproc);
-			return result;
-		}
-	}
-
 	/* VFS fields */
 	tbl = curproc->p_filetable;
 	if (tbl != NULL) {
 		result = filetable_copy(tbl, &newproc->p_filetable);
 		if (result) {
-			as_destroy(newproc->p_addrspace);
-			newproc->p_addrspace = NULL;
 			pid_unalloc(newproc->p_pid);
 			newproc->p_pid = INVALID_PID;
 			proc_destroy(newproc);
@@ -327,12 +409,129 @@ proc_fork(struct proc **ret)
 		VOP_INCREF(curproc->p_cwd);
 		newproc->p_cwd = curproc->p_cwd;
 	}
+	memcpy(newproc->p_rlimits, curproc->p_rlimits,
+	       sizeof(newproc->p_rlimits));
 	spinlock_release(&curproc->p_lock);
 
+	/* VM fields */
+	newproc->p_addrspace = as;
+
 	*ret = newproc;
 	return 0;
 }
 
+/*
+ * Clone the current process, with a copy of its address space.
+ */
+int
+proc_fork(struct proc **ret)
+{
+	struct addrspace *as, *newas;
+	int result;
+
+	/* before copying the address space for nothing */
+	result = proc_checkchildren();
+	if (result) {
+		return result;
+	}
+
+	newas = NULL;
+	as = proc_getas();
+	if (as != NULL) {
+		result = as_copy(as, &newas);
+		/* memory may be got back, or in the last resort taken */
+		while (result == ENOMEM && vm_reclaim()) {
+			result = as_copy(as, &newas);
+		}
+		if (result) {
+			return result;
+		}
+	}
+
+	result = proc_clone(newas, ret);
+	if (result) {
+		if (newas != NULL) {
+			as_destroy(newas);
+		}
+		return result;
+	}
+	proc_setkinfo(*ret, newas);
+	return 0;
+}
+
+/*
+ * Clone the current process, sharing its address space; see
+ * proc_vfork_return for giving it back. The kernel information page
+ * is the child's meanwhile, so getpid() in the child gives its own
+ * pid. That's only safe because nothing in the parent can read it:
+ * the calling thread sleeps until then, and we refuse (with EINVAL)
+ * if the process has other threads, which would go on running. Only
+ * a process's own threads add threads to it, so none can appear
+ * while the caller sleeps.
+ */
+int
+proc_vfork(struct proc **ret, struct semaphore *wait)
+{
+	struct proc *proc = curproc;
+	unsigned num;
+	int result;
+
+	KASSERT(proc_getas() != NULL);
+
+	lock_acquire(proc->p_threadslock);
+	num = threadarray_num(&proc->p_threads);
+	lock_release(proc->p_threadslock);
+	if (num > 1) {
+		return EINVAL;
+	}
+
+	result = proc_clone(proc_getas(), ret);
+	if (result) {
+		return result;
+	}
+	(*ret)->p_vforkwait = wait;
+	(*ret)->p_vforkparent = curproc;
+	proc_setkinfo(*ret, proc_getas());
+	return 0;
+}
+
+/*
+ * Clone the current process into a new address space.
+ */
+int
+proc_spawn(struct proc **ret, struct addrspace *as)
+{
+	int result;
+
+	result = proc_clone(as, ret);
+	if (result) {
+		return result;
+	}
+	proc_setkinfo(*ret, as);
+	return 0;
+}
+
+/*
+ * Once the child of a vfork has execed or exited, the parent, asleep
+ * in vfork, can have its address space back. Call once the child no
+ * longer has it as p_addrspace, as the parent may go and destroy it.
+ * Only the process itself (or proc_destroy) calls this, so
+ * p_vforkwait needs no lock. The kernel information page in AS goes
+ * back to being the parent's first.
+ */
+bool
+proc_vfork_return(struct proc *proc, struct addrspace *as)
+{
+	if (proc->p_vforkwait == NULL) {
+		return false;
+	}
+	proc_setkinfo(proc->p_vforkparent, as);
+	V(proc->p_vforkwait);
+	proc->p_vforkwait = NULL;
+	proc->p_vforkparent = NULL;
+	return true;
+}
+
 /*
  * Undo proc_fork if nothing's run in the new process yet.
  */
@@ -351,10 +550,39 @@ void
 proc_exit(int status)
 {
 	struct proc *proc = curproc;
+	bool last;
 
 	/* The kernel isn't supposed to exit. */
 	KASSERT(proc != kproc);
 
+#if !OPT_DUMBVM
+	/* A thread made by threadfork gives back its user stack. */
+	if (curthread->t_ustack != 0) {
+		as_destroy_thread_stack(proc->p_addrspace,
+					curthread->t_ustack);
+		curthread->t_ustack = 0;
+	}
+#endif
+
+	/*
+	 * Only the threads of the process make more threads in it, so
+	 * once we're the only one left, we stay that way. Otherwise just
+	 * this thread leaves, which has to be decided and done under the
+	 * lock, so that of two threads exiting at once one is last. Once
+	 * we're out, the last thread may destroy PROC at any moment.
+	 */
+	lock_acquire(proc->p_threadslock);
+	last = threadarray_num(&proc->p_threads) == 1;
+	if (!last) {
+		proc_remthread_locked(proc, curthread);
+	}
+	lock_release(proc->p_threadslock);
+
+	if (!last) {
+		proc_addthread(kproc, curthread);
+		thread_exit();
+	}
+
 	/* Set exit status and wake up anyone waiting for us. */
 	pid_setexitstatus(status);
 
@@ -390,6 +618,11 @@ proc_addthread(struct proc *proc, struct thread *t)
 	KASSERT(t->t_proc == NULL);
 
 	lock_acquire(proc->p_threadslock);
+	if (proc->p_exec) {
+		/* its image is about to be replaced */
+		lock_release(proc->p_threadslock);
+		return EBUSY;
+	}
 	result = threadarray_add(&proc->p_threads, t, NULL);
 	lock_release(proc->p_threadslock);
 	if (result) {
@@ -404,44 +637,362 @@ proc_addthread(struct proc *proc, struct thread *t)
 }
 
 /*
- * Remove a thread from its process. Either the thread or the process
- * might or might not be current.
+ * Remove a thread from PROC, its process, with p_threadslock held.
+ * Either the thread or the process might or might not be current.
  *
  * Turn off interrupts on the local cpu while changing t_proc, in
  * case it's current, to protect against the as_activate call in
  * the timer interrupt context switch, and any other implicit uses
  * of "curproc".
  */
+static
 void
-proc_remthread(struct thread *t)
+proc_remthread_locked(struct proc *proc, struct thread *t)
 {
-	struct proc *proc;
+	struct schedstats stats;
 	unsigned num, i;
 	int spl;
 
-	proc = t->t_proc;
-	KASSERT(proc != NULL);
+	KASSERT(lock_do_i_hold(proc->p_threadslock));
+	KASSERT(t->t_proc == proc);
 
-	lock_acquire(proc->p_threadslock);
 	/* ugh: find the thread in the array */
 	num = threadarray_num(&proc->p_threads);
 	for (i=0; i<num; i++) {
 		if (threadarray_get(&proc->p_threads, i) == t) {
 			threadarray_remove(&proc->p_threads, i);
-			lock_release(proc->p_threadslock);
 			goto finish;
 		}
 	}
 	/* Did not find it. */
-	lock_release(proc->p_threadslock);
 	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
 
 finish:
+	/* Its time so far is ours; from here on it isn't */
+	if (t == curthread) {
+		thread_takestats(&stats);
+	}
+	else {
+		stats = t->t_stats;
+		bzero(&t->t_stats, sizeof(t->t_stats));
+	}
+	schedstats_add(&proc->p_stats, &stats);
+
 	spl = splhigh();
 	t->t_proc = NULL;
 	splx(spl);
 }
 
+/*
+ * Remove a thread from its process.
+ */
+void
+proc_remthread(struct thread *t)
+{
+	struct proc *proc;
+
+	proc = t->t_proc;
+	KASSERT(proc != NULL);
+
+	lock_acquire(proc->p_threadslock);
+	proc_remthread_locked(proc, t);
+	lock_release(proc->p_threadslock);
+}
+
+int
+proc_exec_begin(struct proc *proc)
+{
+	int result;
+
+	lock_acquire(proc->p_threadslock);
+	if (threadarray_num(&proc->p_threads) > 1) {
+		result = EBUSY;
+	}
+	else {
+		proc->p_exec = true;
+		result = 0;
+	}
+	lock_release(proc->p_threadslock);
+	return result;
+}
+
+void
+proc_exec_end(struct proc *proc)
+{
+	lock_acquire(proc->p_threadslock);
+	KASSERT(proc->p_exec);
+	proc->p_exec = false;
+	lock_release(proc->p_threadslock);
+}
+
+/*
+ * Sum the accounting of PROC's threads, or of its reaped children.
+ * Threads other than curthread that are running right now are counted
+ * up to when they were switched in.
+ */
+void
+proc_getstats(struct proc *proc, bool children, struct schedstats *ret)
+{
+	struct schedstats stats;
+	struct thread *t;
+	unsigned num, i;
+
+	lock_acquire(proc->p_threadslock);
+	if (children) {
+		*ret = proc->p_childstats;
+		lock_release(proc->p_threadslock);
+		return;
+	}
+
+	*ret = proc->p_stats;
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&proc->p_threads, i);
+		if (t == curthread) {
+			thread_getstats(&stats);
+		}
+		else {
+			stats = t->t_stats;
+		}
+		schedstats_add(ret, &stats);
+	}
+	lock_release(proc->p_threadslock);
+}
+
+/*
+ * Fill in PS for PROC, which is on the list and numbered PID, with
+ * allproc_lock held.
+ *
+ * The address space is only looked at when the process isn't in
+ * execv, since there's nothing to stop execv destroying the old one
+ * underneath us; proc_exec_begin can't start while we hold
+ * p_threadslock. The parent is left for the caller.
+ */
+static
+void
+proc_describe(struct proc *proc, pid_t pid, struct procstat *ps)
+{
+	struct schedstats stats;
+	struct thread *t;
+	unsigned num, i;
+
+	KASSERT(lock_do_i_hold(allproc_lock));
+
+	bzero(ps, sizeof(*ps));
+	ps->ps_pid = pid;
+	snprintf(ps->ps_name, sizeof(ps->ps_name), "%s", proc->p_name);
+
+	proc_getstats(proc, false, &stats);
+	ps->ps_runtime.tv_sec = stats.ss_runtime.tv_sec;
+	ps->ps_runtime.tv_usec = stats.ss_runtime.tv_nsec / 1000;
+	ps->ps_waittime.tv_sec = stats.ss_waittime.tv_sec;
+	ps->ps_waittime.tv_usec = stats.ss_waittime.tv_nsec / 1000;
+
+	lock_acquire(proc->p_threadslock);
+	num = threadarray_num(&proc->p_threads);
+	ps->ps_nthreads = num;
+	ps->ps_state = num > 0 ? PS_SLEEPING : PS_EXITING;
+	for (i=0; i<num; i++) {
+		/* unlocked, but it's only a snapshot */
+		t = threadarray_get(&proc->p_threads, i);
+		if (t->t_state == S_RUN) {
+			ps->ps_state = PS_RUNNING;
+		}
+		else if (t->t_state == S_READY &&
+			 ps->ps_state != PS_RUNNING) {
+			ps->ps_state = PS_READY;
+		}
+	}
+#if !OPT_DUMBVM
+	if (!proc->p_exec && proc->p_addrspace != NULL) {
+		ps->ps_respages = vm_resident_pages(proc->p_addrspace);
+		ps->ps_wspages = vm_working_set(proc->p_addrspace);
+	}
+#endif
+	lock_release(proc->p_threadslock);
+
+	if (proc->p_filetable != NULL) {
+		ps->ps_nfiles = filetable_count(proc->p_filetable);
+	}
+}
+
+unsigned
+proc_snapshot(struct procstat *buf, unsigned max)
+{
+	struct proc *proc;
+	unsigned num, i;
+	pid_t pid;
+
+	num = 0;
+	lock_acquire(allproc_lock);
+	for (proc = allproc; proc != NULL; proc = proc->p_allnext) {
+		pid = proc->p_pid;
+		if (pid == INVALID_PID) {
+			/* not yet numbered, or already reported its exit */
+			continue;
+		}
+		if (num < max) {
+			proc_describe(proc, pid, &buf[num]);
+		}
+		num++;
+	}
+	lock_release(allproc_lock);
+
+	/* The parents come from the pid table; no need to hold the list */
+	for (i=0; i<num && i<max; i++) {
+		buf[i].ps_ppid = pid_getppid(buf[i].ps_pid);
+	}
+	return num;
+}
+
+#if !OPT_DUMBVM
+/*
+ * The OOM killer; see <proc.h>. Address spaces borrowed by vfork are
+ * only counted for the parent, whose they are.
+ */
+bool
+proc_kill_largest(void)
+{
+	struct proc *proc, *victim;
+	struct timespec ts;
+	unsigned pages, most, i;
+	bool gone;
+
+	victim = NULL;
+	most = 0;
+	lock_acquire(allproc_lock);
+	if (nkilled == 0) {
+		for (proc = allproc; proc != NULL; proc = proc->p_allnext) {
+			if (proc == kproc || proc->p_pid == INVALID_PID) {
+				continue;
+			}
+			pages = 0;
+			lock_acquire(proc->p_threadslock);
+			if (!proc->p_exec && proc->p_vforkwait == NULL &&
+			    proc->p_addrspace != NULL) {
+				pages = vm_resident_pages(proc->p_addrspace);
+			}
+			lock_release(proc->p_threadslock);
+			if (pages > most) {
+				most = pages;
+				victim = proc;
+			}
+		}
+		if (victim == NULL) {
+			lock_release(allproc_lock);
+			return false;
+		}
+		kprintf("Out of memory: killing process %d (%s), "
+			"%u pages resident\n", victim->p_pid, victim->p_name,
+			most);
+		spinlock_acquire(&victim->p_lock);
+		victim->p_killed = true;
+		spinlock_release(&victim->p_lock);
+		nkilled++;
+	}
+	lock_release(allproc_lock);
+
+	if (victim == curproc) {
+		return false;
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = OOM_WAIT_NSEC;
+	for (i=0; i<OOM_WAIT_TRIES; i++) {
+		lock_acquire(allproc_lock);
+		gone = nkilled == 0;
+		lock_release(allproc_lock);
+		if (gone) {
+			return true;
+		}
+		clocknanosleep(&ts);
+	}
+	return false;
+}
+#endif
+
+rlim_t
+proc_getrlimit(int resource)
+{
+	struct proc *proc = curproc;
+	rlim_t limit;
+
+	KASSERT(resource >= 0 && resource < __RLIMIT_NUM);
+	if (proc == NULL || proc == kproc) {
+		return RLIM_INFINITY;
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	limit = proc->p_rlimits[resource].rlim_cur;
+	spinlock_release(&proc->p_lock);
+	return limit;
+}
+
+int
+proc_setrlimit(int resource, const struct rlimit *rl)
+{
+	struct proc *proc = curproc;
+	struct rlimit *old;
+
+	if (resource < 0 || resource >= __RLIMIT_NUM ||
+	    rl->rlim_cur > rl->rlim_max) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	old = &proc->p_rlimits[resource];
+	if (rl->rlim_max > old->rlim_max) {
+		spinlock_release(&proc->p_lock);
+		return EPERM;
+	}
+	*old = *rl;
+	spinlock_release(&proc->p_lock);
+
+	/* the file table keeps its own copy, to check without p_lock */
+	if (resource == RLIMIT_NOFILE && proc->p_filetable != NULL) {
+		filetable_setlimit(proc->p_filetable,
+				   rl->rlim_cur < OPEN_MAX ?
+				   rl->rlim_cur : OPEN_MAX);
+	}
+	return 0;
+}
+
+int
+proc_checkchildren(void)
+{
+	rlim_t max;
+
+	/* there can't be more children than pids */
+	max = proc_getrlimit(RLIMIT_NPROC);
+	if (max <= PID_MAX && pid_countchildren(max) >= max) {
+		return EAGAIN;
+	}
+	return 0;
+}
+
+/*
+ * If the current process has been killed, exit rather than return to
+ * user mode.
+ */
+void
+proc_checkkill(void)
+{
+	struct proc *proc = curproc;
+	bool killed;
+
+	if (proc == NULL || proc == kproc) {
+		return;
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	killed = proc->p_killed;
+	spinlock_release(&proc->p_lock);
+
+	if (killed) {
+		proc_exit(_MKWAIT_SIG(SIGKILL));
+	}
+}
+
 /*
  * Fetch the address space of (the current) process.
  *
@@ -467,8 +1018,9 @@ proc_getas(void)
 }
 
 /*
- * Change the address space of (the current) process. Return the old
- * one for later restoration or disposal.
+ * Change the address space of (the current) process, filling in its
+ * kernel information page. Return the old one for later restoration
+ * or disposal.
  */
 struct addrspace *
 proc_setas(struct addrspace *newas)
@@ -478,6 +1030,8 @@ proc_setas(struct addrspace *newas)
 
 	KASSERT(proc != NULL);
 
+	proc_setkinfo(proc, newas);
+
 	spinlock_acquire(&proc->p_lock);
 	oldas = proc->p_addrspace;
 	proc->p_addrspace = newas;
@@ -35,8 +35,10 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <kern/limits.h>
+#include <kern/mqueue.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
+#include <kern/time.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -44,9 +46,12 @@
 #include <synch.h>
 #include <copyinout.h>
 #include <vfs.h>
+#include <fs.h>
 #include <vnode.h>
 #include <openfile.h>
 #include <filetable.h>
+#include <poll.h>
+#include <ktime.h>
 #include <syscall.h>
 
 /*
@@ -57,7 +62,8 @@ int
 sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 {
 	const int allflags =
-		O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND | O_NOCTTY;
+		O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND | O_NOCTTY |
+		O_DIRECT;
 
 	char *kpath;
 	struct openfile *file;
@@ -105,36 +111,60 @@ sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 }
 
 /*
- * Common logic for read and write.
+ * Common logic for read, write, and their positional and vectored
+ * variants.
  *
- * Look up the fd, then use VOP_READ or VOP_WRITE.
+ * Look up the fd, then use VOP_READ or VOP_WRITE on the IOVCNT user
+ * buffers in IOV. If UPOS is NULL the I/O is at the seek position,
+ * which is updated; otherwise it's at *UPOS, and the seek position is
+ * neither used nor locked, so that positional I/O on a shared file
+ * can go on in parallel.
  */
 static
 int
-sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
-	      int badaccmode, ssize_t *retval)
+sys_readwrite(int fd, struct iovec *iov, unsigned iovcnt, const off_t *upos,
+	      enum uio_rw rw, int badaccmode, ssize_t *retval)
 {
 	struct openfile *file;
 	bool locked;
 	off_t pos;
-	struct iovec iov;
+	size_t size;
 	struct uio useruio;
+	unsigned tag;
 	int result;
 
+	tag = (rw == UIO_READ) ? KTIME_READ : KTIME_WRITE;
+	ktime_begin(tag);
+
 	/* better be a valid file descriptor */
 	result = filetable_get(curproc->p_filetable, fd, &file);
 	if (result) {
 		return result;
 	}
 
-	/* Only lock the seek position if we're really using it. */
-	locked = VOP_ISSEEKABLE(file->of_vnode);
-	if (locked) {
-		lock_acquire(file->of_offsetlock);
-		pos = file->of_offset;
+	if (upos != NULL) {
+		/* Positional I/O needs something to position in. */
+		locked = false;
+		pos = *upos;
+		if (!VOP_ISSEEKABLE(file->of_vnode)) {
+			result = ESPIPE;
+			goto fail;
+		}
+		if (pos < 0) {
+			result = EINVAL;
+			goto fail;
+		}
 	}
 	else {
-		pos = 0;
+		/* Only lock the seek position if we're really using it. */
+		locked = VOP_ISSEEKABLE(file->of_vnode);
+		if (locked) {
+			lock_acquire(file->of_offsetlock);
+			pos = file->of_offset;
+		}
+		else {
+			pos = 0;
+		}
 	}
 
 	if (file->of_accmode == badaccmode) {
@@ -142,8 +172,10 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 		goto fail;
 	}
 
-	/* set up a uio with the buffer, its size, and the current offset */
-	uio_uinit(&iov, &useruio, buf, size, pos, rw);
+	/* set up a uio with the buffers, their size, and the offset */
+	uio_uinitv(iov, iovcnt, &useruio, pos, rw);
+	useruio.uio_direct = file->of_direct;
+	size = useruio.uio_resid;
 
 	/* do the read or write */
 	result = (rw == UIO_READ) ?
@@ -167,6 +199,7 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	 */
 	*retval = size - useruio.uio_resid;
 
+	ktime_end(tag);
 	return 0;
 
 fail:
@@ -174,25 +207,310 @@ fail:
 		lock_release(file->of_offsetlock);
 	}
 	filetable_put(curproc->p_filetable, fd, file);
+	ktime_end(tag);
 	return result;
 }
 
 /*
- * read() - use sys_readwrite
+ * Common logic for the calls with one buffer.
+ */
+static
+int
+sys_readwrite1(int fd, userptr_t buf, size_t size, const off_t *upos,
+	       enum uio_rw rw, int badaccmode, ssize_t *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwrite(fd, &iov, 1, upos, rw, badaccmode, retval);
+}
+
+/*
+ * Common logic for the vectored calls: copy in the iovecs, and check
+ * that there's a sensible number and that the total size fits in the
+ * return value.
+ */
+static
+int
+sys_readwritev(int fd, const_userptr_t uiov, int iovcnt, const off_t *upos,
+	       enum uio_rw rw, int badaccmode, ssize_t *retval)
+{
+	struct iovec *iov;
+	size_t total;
+	int i, result;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+
+	iov = kmalloc(iovcnt * sizeof(*iov));
+	if (iov == NULL) {
+		return ENOMEM;
+	}
+	result = copyin(uiov, iov, iovcnt * sizeof(*iov));
+	if (result) {
+		kfree(iov);
+		return result;
+	}
+
+	total = 0;
+	for (i=0; i<iovcnt; i++) {
+		if (iov[i].iov_len > ((size_t)-1 >> 1) - total) {
+			kfree(iov);
+			return EINVAL;
+		}
+		total += iov[i].iov_len;
+	}
+
+	result = sys_readwrite(fd, iov, iovcnt, upos, rw, badaccmode, retval);
+	kfree(iov);
+	return result;
+}
+
+/*
+ * read() - use sys_readwrite1
  */
 int
 sys_read(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_READ, O_WRONLY, retval);
+	return sys_readwrite1(fd, buf, size, NULL, UIO_READ, O_WRONLY, retval);
 }
 
 /*
- * write() - use sys_readwrite
+ * write() - use sys_readwrite1
  */
 int
 sys_write(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_WRITE, O_RDONLY, retval);
+	return sys_readwrite1(fd, buf, size, NULL, UIO_WRITE, O_RDONLY,
+			      retval);
+}
+
+/*
+ * pread() - use sys_readwrite1
+ */
+int
+sys_pread(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+	return sys_readwrite1(fd, buf, size, &pos, UIO_READ, O_WRONLY,
+			      retval);
+}
+
+/*
+ * pwrite() - use sys_readwrite1
+ */
+int
+sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+	return sys_readwrite1(fd, buf, size, &pos, UIO_WRITE, O_RDONLY,
+			      retval);
+}
+
+/*
+ * readv() - use sys_readwritev
+ */
+int
+sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return sys_readwritev(fd, iov, iovcnt, NULL, UIO_READ, O_WRONLY,
+			      retval);
+}
+
+/*
+ * writev() - use sys_readwritev
+ */
+int
+sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return sys_readwritev(fd, iov, iovcnt, NULL, UIO_WRITE, O_RDONLY,
+			      retval);
+}
+
+/*
+ * preadv() - use sys_readwritev
+ */
+int
+sys_preadv(int fd, const_userptr_t iov, int iovcnt, off_t pos, int *retval)
+{
+	return sys_readwritev(fd, iov, iovcnt, &pos, UIO_READ, O_WRONLY,
+			      retval);
+}
+
+/*
+ * pwritev() - use sys_readwritev
+ */
+int
+sys_pwritev(int fd, const_userptr_t iov, int iovcnt, off_t pos, int *retval)
+{
+	return sys_readwritev(fd, iov, iovcnt, &pos, UIO_WRITE, O_RDONLY,
+			      retval);
+}
+
+/*
+ * Size of the kernel buffer sendfile copies through.
+ */
+#define SENDFILE_BUFSIZE 16384
+
+/*
+ * sendfile() - copy up to COUNT bytes from INFD to OUTFD through a
+ * kernel buffer, without going by way of user memory. OUTFD is
+ * written at its seek position. INFD is read at its seek position,
+ * or, if UOFFSET isn't NULL, at *UOFFSET, which is updated instead.
+ * As with write, an error after something has been copied shows up
+ * only as a short count.
+ */
+int
+sys_sendfile(int outfd, int infd, userptr_t uoffset, size_t count,
+	     int *retval)
+{
+	struct filetable *ft;
+	struct openfile *infile, *outfile;
+	struct lock *lock1, *lock2;
+	bool inlocked, outlocked;
+	off_t inpos, outpos;
+	struct iovec iov;
+	struct uio kuio;
+	char *buf;
+	size_t done, amt, got, wrote;
+	int result;
+
+	ft = curproc->p_filetable;
+
+	/* the count has to fit in the return value */
+	if (count > ((size_t)-1 >> 1)) {
+		count = (size_t)-1 >> 1;
+	}
+
+	result = filetable_get(ft, infd, &infile);
+	if (result) {
+		return result;
+	}
+	result = filetable_get(ft, outfd, &outfile);
+	if (result) {
+		filetable_put(ft, infd, infile);
+		return result;
+	}
+
+	if (infile == outfile) {
+		result = EINVAL;
+		goto out;
+	}
+	if (infile->of_accmode == O_WRONLY ||
+	    outfile->of_accmode == O_RDONLY) {
+		result = EBADF;
+		goto out;
+	}
+
+	inpos = 0;
+	if (uoffset != NULL) {
+		inlocked = false;
+		if (!VOP_ISSEEKABLE(infile->of_vnode)) {
+			result = ESPIPE;
+			goto out;
+		}
+		result = copyin(uoffset, &inpos, sizeof(inpos));
+		if (result) {
+			goto out;
+		}
+		if (inpos < 0) {
+			result = EINVAL;
+			goto out;
+		}
+	}
+	else {
+		inlocked = VOP_ISSEEKABLE(infile->of_vnode);
+	}
+	outlocked = VOP_ISSEEKABLE(outfile->of_vnode);
+
+	buf = kmalloc(SENDFILE_BUFSIZE);
+	if (buf == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * Take the seek position locks in address order, as another
+	 * sendfile may be going the other way between the same files.
+	 */
+	lock1 = inlocked ? infile->of_offsetlock : NULL;
+	lock2 = outlocked ? outfile->of_offsetlock : NULL;
+	if (lock1 != NULL && lock2 != NULL && lock2 < lock1) {
+		lock1 = outfile->of_offsetlock;
+		lock2 = infile->of_offsetlock;
+	}
+	if (lock1 != NULL) {
+		lock_acquire(lock1);
+	}
+	if (lock2 != NULL) {
+		lock_acquire(lock2);
+	}
+	if (inlocked) {
+		inpos = infile->of_offset;
+	}
+	outpos = outlocked ? outfile->of_offset : 0;
+
+	/*
+	 * If the output takes less than was read, what's left over is
+	 * dropped; the input position (if any) only moves past what
+	 * was written.
+	 */
+	done = 0;
+	while (done < count) {
+		amt = count - done;
+		if (amt > SENDFILE_BUFSIZE) {
+			amt = SENDFILE_BUFSIZE;
+		}
+		uio_kinit(&iov, &kuio, buf, amt, inpos, UIO_READ);
+		result = VOP_READ(infile->of_vnode, &kuio);
+		if (result) {
+			break;
+		}
+		got = amt - kuio.uio_resid;
+		if (got == 0) {
+			/* EOF */
+			break;
+		}
+
+		uio_kinit(&iov, &kuio, buf, got, outpos, UIO_WRITE);
+		result = VOP_WRITE(outfile->of_vnode, &kuio);
+		wrote = got - kuio.uio_resid;
+		inpos += wrote;
+		outpos += wrote;
+		done += wrote;
+		if (result || wrote < got) {
+			break;
+		}
+	}
+	if (done > 0) {
+		result = 0;
+	}
+
+	if (inlocked) {
+		infile->of_offset = inpos;
+	}
+	if (outlocked) {
+		outfile->of_offset = outpos;
+	}
+	if (lock2 != NULL) {
+		lock_release(lock2);
+	}
+	if (lock1 != NULL) {
+		lock_release(lock1);
+	}
+	kfree(buf);
+
+	if (result == 0 && uoffset != NULL) {
+		result = copyout(&inpos, uoffset, sizeof(inpos));
+	}
+	if (result == 0) {
+		*retval = done;
+	}
+
+out:
+	filetable_put(ft, outfd, outfile);
+	filetable_put(ft, infd, infile);
+	return result;
 }
 
 /*
@@ -266,6 +584,21 @@ sys_lseek(int fd, off_t offset, int whence, off_t *retval)
 		}
 		*retval = info.st_size + offset;
 		break;
+	    case SEEK_DATA:
+	    case SEEK_HOLE:
+		if (offset < 0) {
+			result = ENXIO;
+		}
+		else {
+			result = VOP_SEEKHOLE(file->of_vnode, offset,
+					      whence == SEEK_HOLE, retval);
+		}
+		if (result) {
+			lock_release(file->of_offsetlock);
+			filetable_put(curproc->p_filetable, fd, file);
+			return result;
+		}
+		break;
 	    default:
 		lock_release(file->of_offsetlock);
 		filetable_put(curproc->p_filetable, fd, file);
@@ -310,6 +643,12 @@ sys_dup2(int oldfd, int newfd, int *retval)
 		return 0;
 	}
 
+	/* make sure the table reaches newfd */
+	result = filetable_reserve(ft, newfd);
+	if (result) {
+		return result;
+	}
+
 	/* get the file */
 	result = filetable_get(ft, oldfd, &oldfdfile);
 	if (result) {
@@ -333,6 +672,323 @@ sys_dup2(int oldfd, int newfd, int *retval)
 	return 0;
 }
 
+/*
+ * pipe() - make a pipe and put its two ends in the file table.
+ */
+int
+sys_pipe(userptr_t ufds)
+{
+	struct filetable *ft;
+	struct openfile *readfile, *writefile, *junk;
+	int fds[2];
+	int result;
+
+	ft = curproc->p_filetable;
+
+	result = openfile_openpipe(&readfile, &writefile);
+	if (result) {
+		return result;
+	}
+
+	result = filetable_place(ft, readfile, &fds[0]);
+	if (result) {
+		openfile_decref(readfile);
+		openfile_decref(writefile);
+		return result;
+	}
+	result = filetable_place(ft, writefile, &fds[1]);
+	if (result) {
+		filetable_placeat(ft, NULL, fds[0], &junk);
+		if (junk != NULL) {
+			openfile_decref(junk);
+		}
+		openfile_decref(writefile);
+		return result;
+	}
+
+	result = copyout(fds, ufds, sizeof(fds));
+	if (result) {
+		/*
+		 * Another thread may have closed or replaced the fds
+		 * meanwhile; drop whatever is there now.
+		 */
+		filetable_placeat(ft, NULL, fds[0], &junk);
+		if (junk != NULL) {
+			openfile_decref(junk);
+		}
+		filetable_placeat(ft, NULL, fds[1], &junk);
+		if (junk != NULL) {
+			openfile_decref(junk);
+		}
+		return result;
+	}
+
+	return 0;
+}
+
+/*
+ * ioctl() - pass a control operation through to the object.
+ */
+int
+sys_ioctl(int fd, int code, userptr_t data)
+{
+	struct openfile *file;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+	result = VOP_IOCTL(file->of_vnode, code, data);
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * semwait() and sempost() - P and V on a semfs semaphore, the same as
+ * reading or writing COUNT bytes, but without the seek position or a
+ * uio. The file must be open for reading or writing respectively.
+ */
+int
+sys_semwait(int fd, unsigned count)
+{
+	struct openfile *file;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+	if (file->of_accmode == O_WRONLY) {
+		result = EBADF;
+	}
+	else {
+		result = semfs_semwait(file->of_vnode, count);
+	}
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+int
+sys_sempost(int fd, unsigned count)
+{
+	struct openfile *file;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+	if (file->of_accmode == O_RDONLY) {
+		result = EBADF;
+	}
+	else {
+		result = semfs_sempost(file->of_vnode, count);
+	}
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * mq_create() - make a message queue and put it in the file table.
+ */
+int
+sys_mq_create(unsigned msgsize, unsigned maxmsgs, int *retval)
+{
+	struct openfile *file;
+	int result;
+
+	result = openfile_openmq(msgsize, maxmsgs, &file);
+	if (result) {
+		return result;
+	}
+
+	result = filetable_place(curproc->p_filetable, file, retval);
+	if (result) {
+		openfile_decref(file);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * mq_send() and mq_receive() - move one message to or from a queue,
+ * waiting unless FLAGS has MQ_NONBLOCK. Like semwait and sempost, the
+ * file must be open for writing or reading respectively.
+ */
+int
+sys_mq_send(int fd, const_userptr_t buf, size_t len, int flags)
+{
+	struct openfile *file;
+	struct iovec iov;
+	struct uio useruio;
+	int result;
+
+	if ((flags & ~MQ_NONBLOCK) != 0) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+	if (file->of_accmode == O_RDONLY) {
+		result = EBADF;
+	}
+	else {
+		uio_uinit(&iov, &useruio, (userptr_t)buf, len, 0, UIO_WRITE);
+		result = vfs_mqueue_send(file->of_vnode, &useruio,
+					 (flags & MQ_NONBLOCK) != 0);
+	}
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+int
+sys_mq_receive(int fd, userptr_t buf, size_t len, int flags, int *retval)
+{
+	struct openfile *file;
+	struct iovec iov;
+	struct uio useruio;
+	int result;
+
+	if ((flags & ~MQ_NONBLOCK) != 0) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+	if (file->of_accmode == O_WRONLY) {
+		result = EBADF;
+	}
+	else {
+		uio_uinit(&iov, &useruio, buf, len, 0, UIO_READ);
+		result = vfs_mqueue_receive(file->of_vnode, &useruio,
+					    (flags & MQ_NONBLOCK) != 0);
+	}
+	filetable_put(curproc->p_filetable, fd, file);
+	if (result) {
+		return result;
+	}
+	*retval = len - useruio.uio_resid;
+	return 0;
+}
+
+/*
+ * poll() - wait until some of a set of files are ready, or TIMEOUT
+ * milliseconds have passed (forever if it's negative).
+ *
+ * The files are held for the whole call, so that the queues their
+ * VOP_POLLs put us on stay put; the first time round each one
+ * registers its entry, and after that we sleep until one of them
+ * (or the timer) wakes us and look at them all again. Once something
+ * is ready, the rest needn't register.
+ */
+int
+sys_poll(userptr_t ufds, unsigned nfds, int timeout, int *retval)
+{
+	struct filetable *ft;
+	struct pollfd *fds;
+	struct openfile **files;
+	struct pollset *ps;
+	struct pollentry *pe;
+	struct timespec ts;
+	unsigned i, ready;
+	int revents, result;
+
+	if (nfds > OPEN_MAX) {
+		return EINVAL;
+	}
+
+	ft = curproc->p_filetable;
+
+	fds = kmalloc(nfds * sizeof(*fds));
+	if (fds == NULL) {
+		return ENOMEM;
+	}
+	files = kmalloc(nfds * sizeof(*files));
+	if (files == NULL) {
+		kfree(fds);
+		return ENOMEM;
+	}
+	result = copyin(ufds, fds, nfds * sizeof(*fds));
+	if (result) {
+		kfree(files);
+		kfree(fds);
+		return result;
+	}
+	ps = pollset_create(nfds);
+	if (ps == NULL) {
+		kfree(files);
+		kfree(fds);
+		return ENOMEM;
+	}
+
+	for (i=0; i<nfds; i++) {
+		files[i] = NULL;
+		fds[i].revents = 0;
+		if (fds[i].fd < 0) {
+			continue;
+		}
+		if (filetable_get(ft, fds[i].fd, &files[i])) {
+			files[i] = NULL;
+			fds[i].revents = POLLNVAL;
+		}
+	}
+
+	if (timeout > 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		pollset_timeout(ps, &ts);
+	}
+
+	while (1) {
+		ready = 0;
+		for (i=0; i<nfds; i++) {
+			if (files[i] == NULL) {
+				if (fds[i].revents != 0) {
+					ready++;
+				}
+				continue;
+			}
+			pe = (ready == 0 && timeout != 0) ?
+				pollset_entry(ps, i) : NULL;
+			revents = VOP_POLL(files[i]->of_vnode, pe);
+			fds[i].revents = revents &
+				(fds[i].events | POLLERR | POLLHUP);
+			if (fds[i].revents != 0) {
+				ready++;
+			}
+		}
+		if (ready > 0 || timeout == 0) {
+			break;
+		}
+		if (!pollset_wait(ps)) {
+			/* timed out */
+			break;
+		}
+	}
+
+	pollset_destroy(ps);
+	for (i=0; i<nfds; i++) {
+		if (files[i] != NULL) {
+			filetable_put(ft, fds[i].fd, files[i]);
+		}
+	}
+
+	result = copyout(fds, ufds, nfds * sizeof(*fds));
+	kfree(files);
+	kfree(fds);
+	if (result) {
+		return result;
+	}
+
+	*retval = ready;
+	return 0;
+}
+
 /*
  * chdir() - change directory. Send the path off to the vfs layer.
  */
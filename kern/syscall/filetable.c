@@ -34,9 +34,36 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <bitmap.h>
+#include <membar.h>
 #include <openfile.h>
 #include <filetable.h>
 
+/* Room the table starts out with; it doubles from there. */
+#define FT_MINSIZE 32
+
+
+/*
+ * Make an empty array of SIZE slots.
+ */
+static
+struct fdarray *
+fdarray_create(unsigned size)
+{
+	struct fdarray *files;
+	unsigned fd;
+
+	files = kmalloc(sizeof(*files) + size * sizeof(files->fa_files[0]));
+	if (files == NULL) {
+		return NULL;
+	}
+	files->fa_size = size;
+	files->fa_prev = NULL;
+	for (fd = 0; fd < size; fd++) {
+		files->fa_files[fd] = NULL;
+	}
+	return files;
+}
 
 /*
  * Construct a filetable.
@@ -45,7 +72,6 @@ struct filetable *
 filetable_create(void)
 {
 	struct filetable *ft;
-	int fd;
 
 	ft = kmalloc(sizeof(struct filetable));
 	if (ft == NULL) {
@@ -53,9 +79,21 @@ filetable_create(void)
 	}
 
 	/* the table starts empty */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		ft->ft_openfiles[fd] = NULL;
+	ft->ft_files = fdarray_create(FT_MINSIZE);
+	if (ft->ft_files == NULL) {
+		kfree(ft);
+		return NULL;
 	}
+	ft->ft_used = bitmap_create(FT_MINSIZE);
+	if (ft->ft_used == NULL) {
+		kfree(ft->ft_files);
+		kfree(ft);
+		return NULL;
+	}
+	ft->ft_maxfd = 0;
+	ft->ft_limit = OPEN_MAX;
+
+	spinlock_init(&ft->ft_lock);
 
 	return ft;
 }
@@ -66,20 +104,95 @@ filetable_create(void)
 void
 filetable_destroy(struct filetable *ft)
 {
-	int fd;
+	struct fdarray *files, *prev;
+	unsigned fd;
 
 	KASSERT(ft != NULL);
 
 	/* Close any open files. */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		if (ft->ft_openfiles[fd] != NULL) {
-			openfile_decref(ft->ft_openfiles[fd]);
-			ft->ft_openfiles[fd] = NULL;
+	files = ft->ft_files;
+	for (fd = 0; fd < ft->ft_maxfd; fd++) {
+		if (files->fa_files[fd] != NULL) {
+			openfile_decref(files->fa_files[fd]);
+			files->fa_files[fd] = NULL;
 		}
 	}
+
+	/* Now nobody can be looking at the old arrays either. */
+	while (files != NULL) {
+		prev = files->fa_prev;
+		kfree(files);
+		files = prev;
+	}
+	bitmap_destroy(ft->ft_used);
+	spinlock_cleanup(&ft->ft_lock);
 	kfree(ft);
 }
 
+/*
+ * Make the table have at least NEED slots, by doubling it until it
+ * does. The new array and bitmap are allocated without the lock, so
+ * another thread may have grown the table meanwhile; if so, throw
+ * them away and look again.
+ *
+ * The new array is filled in before being put in place, so that
+ * filetable_get never sees it half copied. The old one is kept.
+ */
+static
+int
+filetable_grow(struct filetable *ft, unsigned need)
+{
+	struct fdarray *old, *new;
+	struct bitmap *used, *oldused;
+	unsigned size, fd;
+
+	KASSERT(need <= OPEN_MAX);
+
+	while (ft->ft_files->fa_size < need) {
+		size = ft->ft_files->fa_size;
+		while (size < need) {
+			size *= 2;
+		}
+		if (size > OPEN_MAX) {
+			size = OPEN_MAX;
+		}
+
+		new = fdarray_create(size);
+		if (new == NULL) {
+			return ENOMEM;
+		}
+		used = bitmap_create(size);
+		if (used == NULL) {
+			kfree(new);
+			return ENOMEM;
+		}
+
+		spinlock_acquire(&ft->ft_lock);
+		old = ft->ft_files;
+		if (old->fa_size >= size) {
+			spinlock_release(&ft->ft_lock);
+			bitmap_destroy(used);
+			kfree(new);
+			continue;
+		}
+		for (fd = 0; fd < ft->ft_maxfd; fd++) {
+			new->fa_files[fd] = old->fa_files[fd];
+			if (new->fa_files[fd] != NULL) {
+				bitmap_mark(used, fd);
+			}
+		}
+		new->fa_prev = old;
+		membar_store_store();
+		ft->ft_files = new;
+		oldused = ft->ft_used;
+		ft->ft_used = used;
+		spinlock_release(&ft->ft_lock);
+
+		bitmap_destroy(oldused);
+	}
+	return 0;
+}
+
 /*
  * Clone a filetable, for use in fork.
  *
@@ -94,13 +207,20 @@ filetable_destroy(struct filetable *ft)
  *
  * produce the intended output instead of having the second echo
  * command overwrite the first.
+ *
+ * Only the slots up to the highest one in use are looked at. The new
+ * table is made big enough for them first, without holding the old
+ * one's lock; if the old table has grown past that by the time we
+ * have the lock, try again.
  */
 int
 filetable_copy(struct filetable *src, struct filetable **dest_ret)
 {
 	struct filetable *dest;
+	struct fdarray *srcfiles, *destfiles;
 	struct openfile *file;
-	int fd;
+	unsigned fd;
+	int result;
 
 	/* Copying the nonexistent table avoids special cases elsewhere */
 	if (src == NULL) {
@@ -113,14 +233,33 @@ filetable_copy(struct filetable *src, struct filetable **dest_ret)
 		return ENOMEM;
 	}
 
+	while (1) {
+		result = filetable_grow(dest, src->ft_maxfd);
+		if (result) {
+			filetable_destroy(dest);
+			return result;
+		}
+		spinlock_acquire(&src->ft_lock);
+		if (src->ft_maxfd <= dest->ft_files->fa_size) {
+			break;
+		}
+		spinlock_release(&src->ft_lock);
+	}
+
 	/* share the entries */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		file = src->ft_openfiles[fd];
+	srcfiles = src->ft_files;
+	destfiles = dest->ft_files;
+	for (fd = 0; fd < src->ft_maxfd; fd++) {
+		file = srcfiles->fa_files[fd];
 		if (file != NULL) {
 			openfile_incref(file);
+			bitmap_mark(dest->ft_used, fd);
 		}
-		dest->ft_openfiles[fd] = file;
+		destfiles->fa_files[fd] = file;
 	}
+	dest->ft_maxfd = src->ft_maxfd;
+	dest->ft_limit = src->ft_limit;
+	spinlock_release(&src->ft_lock);
 
 	*dest_ret = dest;
 	return 0;
@@ -132,7 +271,10 @@ filetable_copy(struct filetable *src, struct filetable **dest_ret)
 bool
 filetable_okfd(struct filetable *ft, int fd)
 {
-	/* We have a fixed-size table so we don't need to check the size */
+	/*
+	 * Any fd the table could grow to reach is in range; one it
+	 * doesn't reach yet just isn't open.
+	 */
 	(void)ft;
 
 	return (fd >= 0 && fd < OPEN_MAX);
@@ -145,19 +287,38 @@ filetable_okfd(struct filetable *ft, int fd)
  * This checks that the file handle is in range and fails rather than
  * returning a null openfile; it only yields files that are actually
  * open.
+ *
+ * No lock is taken on the table (see filetable.h). If another thread
+ * closes or replaces the fd while we're getting our reference, we
+ * either fail to get one or get one to a file that's no longer in the
+ * slot; either way, drop it and look again.
  */
 int
 filetable_get(struct filetable *ft, int fd, struct openfile **ret)
 {
+	struct fdarray *files;
 	struct openfile *file;
 
 	if (!filetable_okfd(ft, fd)) {
 		return EBADF;
 	}
 
-	file = ft->ft_openfiles[fd];
-	if (file == NULL) {
-		return EBADF;
+	while (1) {
+		files = ft->ft_files;
+		if ((unsigned)fd >= files->fa_size) {
+			return EBADF;
+		}
+		file = files->fa_files[fd];
+		if (file == NULL) {
+			return EBADF;
+		}
+		/* our own reference, in case another thread closes the fd */
+		if (openfile_tryincref(file)) {
+			if (ft->ft_files->fa_files[fd] == file) {
+				break;
+			}
+			openfile_decref(file);
+		}
 	}
 
 	*ret = file;
@@ -165,26 +326,20 @@ filetable_get(struct filetable *ft, int fd, struct openfile **ret)
 }
 
 /*
- * Put a file handle back when done with it. This does not actually do
- * anything (other than crosscheck) but it's always good practice to
- * build things so when you take them out you put them back again
- * rather than dropping them on the floor. Then if you need to do
- * something at cleanup time you can put it in this function instead
- * of having to hunt for all the places to insert the new logic.
- *
- * (For example, if you have multithreaded processes you will need to
- * insert additional lock and/or refcount manipulations here and in
- * filetable_get.)
+ * Put a file handle back when done with it, dropping the reference
+ * filetable_get took. If another thread closed the fd meanwhile, this
+ * may be the last reference and close the file.
  *
  * The openfile should be the one returned from filetable_get. If you
- * want to manipulate the table so the assertion's no longer true, get
- * your own reference to the openfile (with openfile_incref) and call
- * filetable_put before mucking about.
+ * want to keep using it afterwards, get your own reference (with
+ * openfile_incref) before calling filetable_put.
  */
 void
 filetable_put(struct filetable *ft, int fd, struct openfile *file)
 {
-	KASSERT(ft->ft_openfiles[fd] == file);
+	(void)ft;
+	(void)fd;
+	openfile_decref(file);
 }
 
 /*
@@ -192,7 +347,8 @@ filetable_put(struct filetable *ft, int fd, struct openfile *file)
  * use the smallest available descriptor, because Unix works that way.
  * (Unix works that way because in the days before dup2 was invented,
  * the behavior had to be defined explicitly in order to allow
- * manipulating stdin/stdout/stderr.)
+ * manipulating stdin/stdout/stderr.) If every slot is full, grow the
+ * table and try again, as far as the limit.
  *
  * Consumes a reference to the openfile object. (That reference is
  * placed in the table.)
@@ -200,22 +356,44 @@ filetable_put(struct filetable *ft, int fd, struct openfile *file)
 int
 filetable_place(struct filetable *ft, struct openfile *file, int *fd_ret)
 {
-	int fd;
+	unsigned fd, size;
+	int result;
 
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		if (ft->ft_openfiles[fd] == NULL) {
-			ft->ft_openfiles[fd] = file;
-			*fd_ret = fd;
-			return 0;
+	spinlock_acquire(&ft->ft_lock);
+	while (bitmap_alloc(ft->ft_used, &fd)) {
+		size = ft->ft_files->fa_size;
+		spinlock_release(&ft->ft_lock);
+		if (size >= ft->ft_limit) {
+			return EMFILE;
+		}
+		result = filetable_grow(ft, size + 1);
+		if (result) {
+			return result;
 		}
+		spinlock_acquire(&ft->ft_lock);
 	}
+	if (fd >= ft->ft_limit) {
+		/* the table is bigger than it now may be */
+		bitmap_unmark(ft->ft_used, fd);
+		spinlock_release(&ft->ft_lock);
+		return EMFILE;
+	}
+	KASSERT(ft->ft_files->fa_files[fd] == NULL);
+	ft->ft_files->fa_files[fd] = file;
+	if (fd >= ft->ft_maxfd) {
+		ft->ft_maxfd = fd + 1;
+	}
+	spinlock_release(&ft->ft_lock);
 
-	return EMFILE;
+	*fd_ret = fd;
+	return 0;
 }
 
 /*
  * Place a file in a file table at a specific location and return the
  * file previously at that location. The location must be in range.
+ * Placing a file (rather than NULL) requires the table to reach that
+ * far already; use filetable_reserve first.
  *
  * Consumes a reference to the passed-in openfile object; returns a
  * reference to the old openfile object (if not NULL); this should
@@ -229,9 +407,87 @@ filetable_place(struct filetable *ft, struct openfile *file, int *fd_ret)
 void
 filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
 		  struct openfile **oldfile_ret)
+{
+	struct fdarray *files;
+	struct openfile *oldfile;
+
+	KASSERT(filetable_okfd(ft, fd));
+
+	spinlock_acquire(&ft->ft_lock);
+	files = ft->ft_files;
+	if ((unsigned)fd >= files->fa_size) {
+		/* nothing there, and nothing to put there */
+		KASSERT(newfile == NULL);
+		spinlock_release(&ft->ft_lock);
+		*oldfile_ret = NULL;
+		return;
+	}
+
+	oldfile = files->fa_files[fd];
+	files->fa_files[fd] = newfile;
+	if (newfile != NULL) {
+		if (oldfile == NULL) {
+			bitmap_mark(ft->ft_used, fd);
+		}
+		if ((unsigned)fd >= ft->ft_maxfd) {
+			ft->ft_maxfd = fd + 1;
+		}
+	}
+	else if (oldfile != NULL) {
+		bitmap_unmark(ft->ft_used, fd);
+		while (ft->ft_maxfd > 0 &&
+		       files->fa_files[ft->ft_maxfd - 1] == NULL) {
+			ft->ft_maxfd--;
+		}
+	}
+	spinlock_release(&ft->ft_lock);
+
+	*oldfile_ret = oldfile;
+}
+
+/*
+ * Make sure a file table has a slot for FD, growing it if need be.
+ */
+int
+filetable_reserve(struct filetable *ft, int fd)
 {
 	KASSERT(filetable_okfd(ft, fd));
 
-	*oldfile_ret = ft->ft_openfiles[fd];
-	ft->ft_openfiles[fd] = newfile;
+	if ((unsigned)fd >= ft->ft_limit) {
+		return EBADF;
+	}
+	return filetable_grow(ft, fd + 1);
+}
+
+/*
+ * Set the limit on new fds. Fds past it that are open already stay so.
+ */
+void
+filetable_setlimit(struct filetable *ft, unsigned limit)
+{
+	spinlock_acquire(&ft->ft_lock);
+	ft->ft_limit = limit < OPEN_MAX ? limit : OPEN_MAX;
+	spinlock_release(&ft->ft_lock);
+}
+
+/*
+ * Count the files open in a file table.
+ */
+unsigned
+filetable_count(struct filetable *ft)
+{
+	struct fdarray *files;
+	unsigned count;
+	unsigned fd;
+
+	count = 0;
+	spinlock_acquire(&ft->ft_lock);
+	files = ft->ft_files;
+	for (fd = 0; fd < ft->ft_maxfd; fd++) {
+		if (files->fa_files[fd] != NULL) {
+			count++;
+		}
+	}
+	spinlock_release(&ft->ft_lock);
+	return count;
 }
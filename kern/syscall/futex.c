@@ -0,0 +1,226 @@
+/*
+ * Futexes; see <futex.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <futex.h>
+#include <syscall.h>
+
+/*
+ * Each bucket has a list of its waiters, oldest first, and a wait
+ * channel they all sleep on; each sleeps in a class of its own (its
+ * futex_waiter's address) so a wakeup can pick out exactly the ones
+ * it means. fb_lock covers the list and the waiters' flags.
+ *
+ * A waiter goes on the list before looking at the word. A thread
+ * changing the word and then waking the futex therefore either
+ * changes it before we look, in which case we see the new value and
+ * don't sleep, or finds us on the list.
+ */
+#define FUTEX_BUCKETS	64
+
+struct futex_bucket;
+
+struct futex_waiter {
+	struct addrspace *fw_as;
+	vaddr_t fw_addr;
+	struct futex_bucket *fw_bucket;
+	bool fw_queued;			/* on fb_waiters */
+	bool fw_timedout;
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct spinlock fb_lock;
+	struct wchan *fb_wchan;
+	struct futex_waiter *fb_waiters;
+	struct futex_waiter **fb_tail;
+};
+
+static struct futex_bucket futex_table[FUTEX_BUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	struct futex_bucket *fb;
+	unsigned i;
+
+	for (i=0; i<FUTEX_BUCKETS; i++) {
+		fb = &futex_table[i];
+		spinlock_init(&fb->fb_lock);
+		fb->fb_wchan = wchan_create("futex");
+		if (fb->fb_wchan == NULL) {
+			panic("futex_bootstrap: out of memory\n");
+		}
+		fb->fb_waiters = NULL;
+		fb->fb_tail = &fb->fb_waiters;
+	}
+}
+
+static
+struct futex_bucket *
+futex_bucket(struct addrspace *as, vaddr_t addr)
+{
+	unsigned hash;
+
+	hash = (uintptr_t)as / sizeof(void *) + addr / sizeof(int);
+	return &futex_table[hash % FUTEX_BUCKETS];
+}
+
+/*
+ * Take FW off its bucket's list. The bucket must be locked.
+ */
+static
+void
+futex_dequeue(struct futex_waiter *fw)
+{
+	struct futex_bucket *fb = fw->fw_bucket;
+	struct futex_waiter **link;
+
+	KASSERT(spinlock_do_i_hold(&fb->fb_lock));
+	KASSERT(fw->fw_queued);
+
+	for (link = &fb->fb_waiters; *link != fw; link = &(*link)->fw_next) {
+		KASSERT(*link != NULL);
+	}
+	*link = fw->fw_next;
+	if (fb->fb_tail == &fw->fw_next) {
+		fb->fb_tail = link;
+	}
+	fw->fw_queued = false;
+}
+
+/*
+ * Timer function: called from the timer interrupt.
+ */
+static
+void
+futex_expire(void *data)
+{
+	struct futex_waiter *fw = data;
+	struct futex_bucket *fb = fw->fw_bucket;
+
+	spinlock_acquire(&fb->fb_lock);
+	if (fw->fw_queued) {
+		futex_dequeue(fw);
+		fw->fw_timedout = true;
+		wchan_wakeclass(fb->fb_wchan, &fb->fb_lock, (uintptr_t)fw);
+	}
+	spinlock_release(&fb->fb_lock);
+}
+
+static
+int
+futex_wait(struct addrspace *as, userptr_t addr, int val, int timeout)
+{
+	struct futex_waiter fw;
+	struct futex_bucket *fb;
+	struct clocktimer ct;
+	struct timespec ts;
+	int word, result;
+
+	fw.fw_as = as;
+	fw.fw_addr = (vaddr_t)addr;
+	fw.fw_bucket = fb = futex_bucket(as, fw.fw_addr);
+	fw.fw_queued = true;
+	fw.fw_timedout = false;
+	fw.fw_next = NULL;
+
+	spinlock_acquire(&fb->fb_lock);
+	*fb->fb_tail = &fw;
+	fb->fb_tail = &fw.fw_next;
+	spinlock_release(&fb->fb_lock);
+
+	/* can't hold the spinlock over this; it may fault */
+	result = copyin(addr, &word, sizeof(word));
+	if (result == 0 && word != val) {
+		result = EAGAIN;
+	}
+	if (result == 0 && timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		clocktimer_start(&ct, &ts, futex_expire, &fw);
+	}
+
+	spinlock_acquire(&fb->fb_lock);
+	if (result) {
+		if (fw.fw_queued) {
+			futex_dequeue(&fw);
+		}
+		spinlock_release(&fb->fb_lock);
+		return result;
+	}
+	while (fw.fw_queued) {
+		wchan_sleep_class(fb->fb_wchan, &fb->fb_lock, (uintptr_t)&fw);
+	}
+	spinlock_release(&fb->fb_lock);
+
+	if (timeout >= 0) {
+		clocktimer_stop(&ct);
+	}
+	return fw.fw_timedout ? ETIMEDOUT : 0;
+}
+
+static
+int
+futex_wake(struct addrspace *as, userptr_t addr, int count)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter *fw, *next;
+	int woken;
+
+	fb = futex_bucket(as, (vaddr_t)addr);
+	woken = 0;
+
+	spinlock_acquire(&fb->fb_lock);
+	for (fw = fb->fb_waiters; fw != NULL && woken < count; fw = next) {
+		next = fw->fw_next;
+		if (fw->fw_as != as || fw->fw_addr != (vaddr_t)addr) {
+			continue;
+		}
+		futex_dequeue(fw);
+		wchan_wakeclass(fb->fb_wchan, &fb->fb_lock, (uintptr_t)fw);
+		woken++;
+	}
+	spinlock_release(&fb->fb_lock);
+
+	return woken;
+}
+
+/*
+ * futex() - wait for, or wake waiters on, a word of user memory.
+ */
+int
+sys_futex(userptr_t addr, int op, int val, int timeout, int *retval)
+{
+	struct addrspace *as;
+	int result;
+
+	if ((vaddr_t)addr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+	as = proc_getas();
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		result = futex_wait(as, addr, val, timeout);
+		*retval = 0;
+		break;
+	    case FUTEX_WAKE:
+		*retval = futex_wake(as, addr, val);
+		result = 0;
+		break;
+	    default:
+		result = EINVAL;
+		break;
+	}
+	return result;
+}
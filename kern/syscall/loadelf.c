@@ -29,12 +29,12 @@
 
 
 /*
- * Code to load an ELF-format executable into the current address space.
+ * Code to load an ELF-format executable into an address space.
  *
  * It makes the following address space calls:
  *    - first, as_define_region once for each segment of the program;
  *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
+ *    - then it sets up loading each chunk of the program;
  *    - finally, as_complete_load.
  *
  * This gives the VM code enough flexibility to deal with even grossly
@@ -42,8 +42,20 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * The segments are not read in here; load_segment just tells the VM
+ * system where in the file each one lives, and pages are read in as
+ * the program touches them.
+ *
+ * The headers are read once into a struct execimage, which holds what
+ * loading needs: the entry point and the loadable segments. Programs
+ * tend to be run over and over, so the images of the last EXECCACHE_SIZE
+ * executables loaded are kept, and loading one of them again goes
+ * straight to the address space calls without reading the file at all.
+ * A cached image holds a reference to the vnode, and with the page
+ * cache has the program's shared text kept in memory between runs as
+ * well (see pagecache_retain). It is good until the file's vn_wgen
+ * moves; changes the kernel doesn't see (e.g. on the host side of
+ * emufs) aren't noticed.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,115 +64,59 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <uio.h>
-#include <proc.h>
-#include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <pagecache.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
+
+#define EXECCACHE_SIZE	8
+
+struct execseg {
+	off_t es_offset;		/* where the data is in the file */
+	vaddr_t es_vaddr;		/* where it goes in memory */
+	size_t es_memsize;
+	size_t es_filesize;
+	uint32_t es_flags;		/* PF_R, PF_W, PF_X */
+};
+
+struct execimage {
+	unsigned ei_refs;		/* the cache's, plus loaders' */
+	struct vnode *ei_vn;		/* referenced; NULL if not cached */
+	unsigned ei_wgen;		/* vn_wgen when the headers were read */
+	unsigned ei_lastuse;		/* for LRU replacement */
+	vaddr_t ei_entry;		/* initial PC */
+	unsigned ei_nsegs;
+	struct execseg ei_segs[];
+};
+
+/* execcache_lock protects the table and the images' refcounts */
+static struct spinlock execcache_lock = SPINLOCK_INITIALIZER;
+static struct execimage *execcache[EXECCACHE_SIZE];
+static unsigned execcache_clock;
 
 /*
- * Load a segment at virtual address VADDR. The segment in memory
- * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
- * segment on disk is located at file offset OFFSET and has length
- * FILESIZE.
- *
- * FILESIZE may be less than MEMSIZE; if so the remaining portion of
- * the in-memory segment should be zero-filled.
- *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * Read the headers of executable V into a new image.
  */
 static
 int
-load_segment(struct addrspace *as, struct vnode *v,
-	     off_t offset, vaddr_t vaddr,
-	     size_t memsize, size_t filesize,
-	     int is_executable)
-{
-	struct iovec iov;
-	struct uio u;
-	int result;
-
-	if (filesize > memsize) {
-		kprintf("ELF: warning: segment filesize > segment memsize\n");
-		filesize = memsize;
-	}
-
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
-	      (unsigned long) filesize, (unsigned long) vaddr);
-
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = as;
-
-	result = VOP_READ(v, &u);
-	if (result) {
-		return result;
-	}
-
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
-		return ENOEXEC;
-	}
-
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
-
-	return result;
-}
-
-/*
- * Load an ELF executable user program into the current address space.
- *
- * Returns the entry point (initial PC) for the program in ENTRYPOINT.
- */
-int
-load_elf(struct vnode *v, vaddr_t *entrypoint)
+read_image(struct vnode *v, struct execimage **ret)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
+	struct execimage *img;
+	struct execseg *seg;
+	struct stat st;
 	int result, i;
+	unsigned j;
 	struct iovec iov;
 	struct uio ku;
-	struct addrspace *as;
 
-	as = proc_getas();
+	img = NULL;
 
 	/*
 	 * Read the executable header from offset 0 in the file.
@@ -202,8 +158,25 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
+	/* Room for all the segments, in case they're all PT_LOAD */
+	img = kmalloc(sizeof(*img) + eh.e_phnum * sizeof(img->ei_segs[0]));
+	if (img == NULL) {
+		return ENOMEM;
+	}
+	img->ei_refs = 1;
+	img->ei_vn = NULL;
+	img->ei_lastuse = 0;
+	img->ei_entry = eh.e_entry;
+	img->ei_nsegs = 0;
+
+	/*
+	 * Note the version of the file before reading any further, so
+	 * that if it's changed while we're at it the image won't match.
+	 */
+	img->ei_wgen = atomic_get(&v->vn_wgen);
+
 	/*
-	 * Go through the list of segments and set up the address space.
+	 * Go through the list of segments and collect the ones to load.
 	 *
 	 * Ordinarily there will be one code segment, one read-only
 	 * data segment, and one data/bss segment, but there might
@@ -223,13 +196,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 
 		result = VOP_READ(v, &ku);
 		if (result) {
-			return result;
+			goto fail;
 		}
 
 		if (ku.uio_resid != 0) {
 			/* short read; problem with executable? */
 			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
+			result = ENOEXEC;
+			goto fail;
 		}
 
 		switch (ph.p_type) {
@@ -240,14 +214,246 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		    default:
 			kprintf("loadelf: unknown segment type %d\n",
 				ph.p_type);
-			return ENOEXEC;
+			result = ENOEXEC;
+			goto fail;
+		}
+
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > "
+				"segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+
+		seg = &img->ei_segs[img->ei_nsegs++];
+		seg->es_offset = ph.p_offset;
+		seg->es_vaddr = ph.p_vaddr;
+		seg->es_memsize = ph.p_memsz;
+		seg->es_filesize = ph.p_filesz;
+		seg->es_flags = ph.p_flags;
+	}
+
+	/*
+	 * Nothing is actually read in when loading (see load_segment),
+	 * so check now what reading it all in with uiomove would have
+	 * caught: that the file is long enough.
+	 */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		goto fail;
+	}
+	for (j=0; j<img->ei_nsegs; j++) {
+		seg = &img->ei_segs[j];
+		if (seg->es_offset + (off_t)seg->es_filesize > st.st_size) {
+			/* short file; problem with executable? */
+			kprintf("ELF: short read on segment - "
+				"file truncated?\n");
+			result = ENOEXEC;
+			goto fail;
+		}
+	}
+
+	*ret = img;
+	return 0;
+
+ fail:
+	kfree(img);
+	return result;
+}
+
+/*
+ * Drop a reference to an image.
+ */
+static
+void
+execimage_release(struct execimage *img)
+{
+	bool last;
+
+	spinlock_acquire(&execcache_lock);
+	KASSERT(img->ei_refs > 0);
+	img->ei_refs--;
+	last = img->ei_refs == 0;
+	spinlock_release(&execcache_lock);
+
+	if (last) {
+		KASSERT(img->ei_vn == NULL);
+		kfree(img);
+	}
+}
+
+/*
+ * Finish taking IMG out of the cache, once it's out of the table:
+ * drop the cache's hold on the vnode and on the image.
+ */
+static
+void
+execcache_drop(struct execimage *img)
+{
+	struct vnode *v;
+
+	v = img->ei_vn;
+	img->ei_vn = NULL;
+#if !OPT_DUMBVM
+	pagecache_forget(v);
+#endif
+	VOP_DECREF(v);
+	execimage_release(img);
+}
+
+/*
+ * Find the cached image of V, with a reference, or NULL. One that's
+ * out of date is thrown away.
+ */
+static
+struct execimage *
+execcache_get(struct vnode *v)
+{
+	struct execimage *img, *stale = NULL;
+	unsigned i, wgen;
+
+	spinlock_acquire(&execcache_lock);
+	for (i=0; i<EXECCACHE_SIZE; i++) {
+		img = execcache[i];
+		if (img == NULL || img->ei_vn != v) {
+			continue;
+		}
+
+		wgen = atomic_get(&v->vn_wgen);
+
+		if (img->ei_wgen != wgen) {
+			execcache[i] = NULL;
+			stale = img;
+			break;
+		}
+		img->ei_refs++;
+		img->ei_lastuse = ++execcache_clock;
+		spinlock_release(&execcache_lock);
+		return img;
+	}
+	spinlock_release(&execcache_lock);
+
+	if (stale != NULL) {
+		execcache_drop(stale);
+	}
+	return NULL;
+}
+
+/*
+ * Cache IMG, just read from V, in place of the least recently used
+ * image.
+ */
+static
+void
+execcache_enter(struct vnode *v, struct execimage *img)
+{
+	struct execimage *victim;
+	unsigned i, vix;
+
+#if !OPT_DUMBVM
+	/* before anyone can find it in the table, and drop it */
+	pagecache_retain(v);
+#endif
+
+	spinlock_acquire(&execcache_lock);
+	vix = 0;
+	for (i=0; i<EXECCACHE_SIZE; i++) {
+		if (execcache[i] != NULL && execcache[i]->ei_vn == v) {
+			/* someone loading V concurrently got there first */
+			spinlock_release(&execcache_lock);
+			return;
+		}
+		if (execcache[i] == NULL) {
+			vix = i;
+		}
+		else if (execcache[vix] != NULL &&
+			 execcache[i]->ei_lastuse < execcache[vix]->ei_lastuse) {
+			vix = i;
+		}
+	}
+	victim = execcache[vix];
+	VOP_INCREF(v);
+	img->ei_vn = v;
+	img->ei_refs++;
+	img->ei_lastuse = ++execcache_clock;
+	execcache[vix] = img;
+	spinlock_release(&execcache_lock);
+
+	if (victim != NULL) {
+		execcache_drop(victim);
+	}
+}
+
+void
+load_elf_purge(struct fs *fs)
+{
+	struct execimage *img;
+	unsigned i;
+
+	spinlock_acquire(&execcache_lock);
+	for (i=0; i<EXECCACHE_SIZE; i++) {
+		img = execcache[i];
+		if (img == NULL || img->ei_vn->vn_fs != fs) {
+			continue;
 		}
+		execcache[i] = NULL;
+		spinlock_release(&execcache_lock);
+		execcache_drop(img);
+		spinlock_acquire(&execcache_lock);
+	}
+	spinlock_release(&execcache_lock);
+}
+
+/*
+ * Load a segment at virtual address VADDR. The segment in memory
+ * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
+ * segment on disk is located at file offset OFFSET and has length
+ * FILESIZE.
+ *
+ * FILESIZE may be less than MEMSIZE; if so the remaining portion of
+ * the in-memory segment is zero-filled.
+ *
+ * Nothing is actually read here: the VM system reads each page from
+ * the file the first time it is touched (see as_define_backing).
+ * read_image has already checked the file is long enough, so check
+ * the rest of what reading it in with uiomove would have caught: that
+ * the segment lies in user space.
+ */
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+	     off_t offset, vaddr_t vaddr,
+	     size_t memsize, size_t filesize)
+{
+	KASSERT(filesize <= memsize);
+
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
 
+	return as_define_backing(as, vaddr, v, offset, filesize);
+}
+
+/*
+ * Set up AS from IMG, the image of V.
+ */
+static
+int
+load_image(struct addrspace *as, struct vnode *v, struct execimage *img)
+{
+	struct execseg *seg;
+	unsigned i;
+	int result;
+
+	for (i=0; i<img->ei_nsegs; i++) {
+		seg = &img->ei_segs[i];
 		result = as_define_region(as,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+					  seg->es_vaddr, seg->es_memsize,
+					  seg->es_flags & PF_R,
+					  seg->es_flags & PF_W,
+					  seg->es_flags & PF_X);
 		if (result) {
 			return result;
 		}
@@ -262,46 +468,80 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	 * Now actually load each segment.
 	 */
 
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
-
-		result = VOP_READ(v, &ku);
+	for (i=0; i<img->ei_nsegs; i++) {
+		seg = &img->ei_segs[i];
+		result = load_segment(as, v, seg->es_offset, seg->es_vaddr,
+				      seg->es_memsize, seg->es_filesize);
 		if (result) {
 			return result;
 		}
+	}
 
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
+	return as_complete_load(as);
+}
 
-		switch (ph.p_type) {
-		    case PT_NULL: /* skip */ continue;
-		    case PT_PHDR: /* skip */ continue;
-		    case PT_MIPS_REGINFO: /* skip */ continue;
-		    case PT_LOAD: break;
-		    default:
-			kprintf("loadelf: unknown segment type %d\n",
-				ph.p_type);
-			return ENOEXEC;
-		}
+/*
+ * Get the layout of V, from the cache or else by reading it in (and
+ * caching it).
+ */
+static
+int
+get_image(struct vnode *v, struct execimage **ret)
+{
+	struct execimage *img;
+	int result;
 
-		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+	img = execcache_get(v);
+	if (img == NULL) {
+		result = read_image(v, &img);
 		if (result) {
 			return result;
 		}
+		execcache_enter(v, img);
 	}
+	*ret = img;
+	return 0;
+}
+
+/*
+ * Check that V is a loadable executable, so it can be committed to
+ * before there is anywhere to load it.
+ */
+int
+load_elf_check(struct vnode *v)
+{
+	struct execimage *img;
+	int result;
 
-	result = as_complete_load(as);
+	result = get_image(v, &img);
 	if (result) {
 		return result;
 	}
+	execimage_release(img);
+	return 0;
+}
 
-	*entrypoint = eh.e_entry;
+/*
+ * Load an ELF executable user program into AS. Nothing is copied into
+ * user memory, so AS needn't be current.
+ *
+ * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ */
+int
+load_elf(struct addrspace *as, struct vnode *v, vaddr_t *entrypoint)
+{
+	struct execimage *img;
+	int result;
 
-	return 0;
+	result = get_image(v, &img);
+	if (result) {
+		return result;
+	}
+
+	result = load_image(as, v, img);
+	if (result == 0) {
+		*entrypoint = img->ei_entry;
+	}
+	execimage_release(img);
+	return result;
 }
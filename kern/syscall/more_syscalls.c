@@ -32,8 +32,10 @@
  */
 
 #include <types.h>
+#include <kern/dirent.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/iostat.h>
 #include <kern/limits.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
@@ -44,6 +46,7 @@
 #include <synch.h>
 #include <copyinout.h>
 #include <vfs.h>
+#include <buf.h>
 #include <vnode.h>
 #include <openfile.h>
 #include <filetable.h>
@@ -127,6 +130,18 @@ sys_sync(void)
 	return 0;
 }
 
+/*
+ * bufstat - copy out the buffer cache's counts
+ */
+int
+sys_bufstat(userptr_t buf)
+{
+	struct bufstat bs;
+
+	buf_getstats(&bs);
+	return copyout(&bs, buf, sizeof(bs));
+}
+
 /*
  * mkdir - call vfs_mkdir
  */
@@ -338,6 +353,179 @@ sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval)
 	return 0;
 }
 
+/*
+ * Size of the kernel buffer getdirentries builds records in.
+ */
+#define GETDIRENTRIES_BUFSIZE 4096
+
+/*
+ * Fill in REC for NAME (NAMLEN bytes, NUL-terminated), read from
+ * directory DIR. VOP_LOOKUP may destroy NAME, so it's copied first.
+ */
+static
+void
+getdirentries_fill(struct vnode *dir, char *name, size_t namlen,
+		   struct dirent *rec)
+{
+	struct vnode *vn;
+	struct stat st;
+
+	bzero(rec, sizeof(*rec));
+	rec->d_reclen = _DIRENT_RECLEN(namlen);
+	rec->d_namlen = namlen;
+	memcpy(rec->d_name, name, namlen + 1);
+
+	/* if it's gone already, say nothing but the name */
+	if (VOP_LOOKUP(dir, name, &vn)) {
+		return;
+	}
+	if (VOP_STAT(vn, &st) == 0) {
+		rec->d_size = st.st_size;
+		rec->d_ino = st.st_ino;
+		rec->d_mode = st.st_mode;
+		rec->d_blocks = st.st_blocks;
+		rec->d_nlink = st.st_nlink;
+	}
+	VOP_DECREF(vn);
+}
+
+/*
+ * getdirentries - fill BUF with as many directory records (see
+ * <kern/dirent.h>) as fit, reading the directory with VOP_GETDIRENTRY
+ * from *UCOOKIE, which is updated, or from the seek position if
+ * UCOOKIE is NULL. Returns 0 at the end of the directory. As with
+ * read, an error after some records have been returned shows up only
+ * as a short count.
+ */
+int
+sys_getdirentries(int fd, userptr_t buf, size_t buflen, userptr_t ucookie,
+		  int *retval)
+{
+	struct iovec iov;
+	struct uio kuio;
+	struct openfile *file;
+	struct vnode *dir;
+	char *kbuf, *name;
+	size_t done, kdone, got, reclen;
+	off_t pos, donepos;
+	int result, err;
+
+	/* the count has to fit in the return value */
+	if (buflen > ((size_t)-1 >> 1)) {
+		buflen = (size_t)-1 >> 1;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+	dir = file->of_vnode;
+
+	if (file->of_accmode == O_WRONLY) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EBADF;
+	}
+
+	kbuf = kmalloc(GETDIRENTRIES_BUFSIZE + NAME_MAX + 1);
+	if (kbuf == NULL) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return ENOMEM;
+	}
+	name = kbuf + GETDIRENTRIES_BUFSIZE;
+
+	if (ucookie != NULL) {
+		result = copyin(ucookie, &pos, sizeof(pos));
+		if (result == 0 && pos < 0) {
+			result = EINVAL;
+		}
+		if (result) {
+			kfree(kbuf);
+			filetable_put(curproc->p_filetable, fd, file);
+			return result;
+		}
+	}
+	else {
+		lock_acquire(file->of_offsetlock);
+		pos = file->of_offset;
+	}
+
+	/*
+	 * Records are built in KBUF and copied out when it's full;
+	 * DONEPOS is where the directory is read up to for the DONE
+	 * bytes that have been.
+	 */
+	done = kdone = 0;
+	donepos = pos;
+	while (1) {
+		uio_kinit(&iov, &kuio, name, NAME_MAX, pos, UIO_READ);
+		result = VOP_GETDIRENTRY(dir, &kuio);
+		if (result) {
+			break;
+		}
+		got = NAME_MAX - kuio.uio_resid;
+		if (got == 0) {
+			/* EOF */
+			break;
+		}
+		name[got] = 0;
+
+		reclen = _DIRENT_RECLEN(got);
+		if (done + kdone + reclen > buflen) {
+			if (done + kdone == 0) {
+				/* not even one will fit */
+				result = EINVAL;
+			}
+			break;
+		}
+		if (kdone + reclen > GETDIRENTRIES_BUFSIZE) {
+			result = copyout(kbuf, (userptr_t)((char *)buf + done),
+					 kdone);
+			if (result) {
+				kdone = 0;
+				break;
+			}
+			done += kdone;
+			donepos = pos;
+			kdone = 0;
+		}
+
+		getdirentries_fill(dir, name, got,
+				   (struct dirent *)(kbuf + kdone));
+		kdone += reclen;
+		pos = kuio.uio_offset;
+	}
+	if (kdone > 0) {
+		err = copyout(kbuf, (userptr_t)((char *)buf + done), kdone);
+		if (err == 0) {
+			done += kdone;
+			donepos = pos;
+		}
+		else if (result == 0) {
+			result = err;
+		}
+	}
+	if (done > 0) {
+		result = 0;
+	}
+
+	if (ucookie != NULL) {
+		if (result == 0) {
+			result = copyout(&donepos, ucookie, sizeof(donepos));
+		}
+	}
+	else {
+		file->of_offset = donepos;
+		lock_release(file->of_offsetlock);
+	}
+	kfree(kbuf);
+	filetable_put(curproc->p_filetable, fd, file);
+
+	if (result == 0) {
+		*retval = done;
+	}
+	return result;
+}
+
 /*
  * fstat - call VOP_FSTAT
  */
@@ -368,6 +556,44 @@ sys_fstat(int fd, userptr_t statptr)
 	return copyout(&kbuf, statptr, sizeof(struct stat));
 }
 
+/*
+ * stat - look the name up and call VOP_STAT, without opening it. There
+ * are no symlinks to follow here, so this is lstat too.
+ */
+int
+sys_stat(userptr_t path, userptr_t statptr)
+{
+	struct stat kbuf;
+	struct vnode *vn;
+	char *pathbuf;
+	int err;
+
+	pathbuf = kmalloc(PATH_MAX);
+	if (pathbuf == NULL) {
+		return ENOMEM;
+	}
+
+	err = copyinstr(path, pathbuf, PATH_MAX, NULL);
+	if (err) {
+		kfree(pathbuf);
+		return err;
+	}
+
+	err = vfs_lookup(pathbuf, &vn);
+	kfree(pathbuf);
+	if (err) {
+		return err;
+	}
+
+	err = VOP_STAT(vn, &kbuf);
+	VOP_DECREF(vn);
+	if (err) {
+		return err;
+	}
+
+	return copyout(&kbuf, statptr, sizeof(struct stat));
+}
+
 /*
  * fsync - call VOP_FSYNC
  */
@@ -427,3 +653,31 @@ sys_ftruncate(int fd, off_t len)
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
+
+/*
+ * fallocate - call VOP_FALLOCATE
+ */
+int
+sys_fallocate(int fd, off_t pos, off_t len)
+{
+	struct openfile *file;
+	int err;
+
+	if (pos < 0 || len <= 0) {
+		return EINVAL;
+	}
+
+	err = filetable_get(curproc->p_filetable, fd, &file);
+	if (err) {
+		return err;
+	}
+
+	if (file->of_accmode == O_RDONLY) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EBADF;
+	}
+
+	err = VOP_FALLOCATE(file->of_vnode, pos, len);
+	filetable_put(curproc->p_filetable, fd, file);
+	return err;
+}
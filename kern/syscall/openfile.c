@@ -36,9 +36,44 @@
 #include <kern/fcntl.h>
 #include <lib.h>
 #include <synch.h>
+#include <objcache.h>
 #include <vfs.h>
 #include <openfile.h>
 
+/*
+ * Cache of openfiles, kept with their locks made. It's type-safe, so
+ * that filetable_get can try openfile_tryincref on an openfile that
+ * may have been closed and freed meanwhile.
+ */
+static int openfile_ctor(void *obj);
+static void openfile_dtor(void *obj);
+static struct objcache openfile_cache =
+	OBJCACHE_TYPESAFE_INITIALIZER("openfile", sizeof(struct openfile),
+				      openfile_ctor, openfile_dtor);
+
+static
+int
+openfile_ctor(void *obj)
+{
+	struct openfile *file = obj;
+
+	file->of_offsetlock = lock_create_adaptive("openfile");
+	if (file->of_offsetlock == NULL) {
+		return ENOMEM;
+	}
+	atomic_set(&file->of_refcount, 0);
+	return 0;
+}
+
+static
+void
+openfile_dtor(void *obj)
+{
+	struct openfile *file = obj;
+
+	lock_destroy(file->of_offsetlock);
+}
+
 /*
  * Constructor for struct openfile.
  */
@@ -53,23 +88,16 @@ openfile_create(struct vnode *vn, int accmode)
 		accmode == O_WRONLY ||
 		accmode == O_RDWR);
 
-	file = kmalloc(sizeof(struct openfile));
+	file = objcache_alloc(&openfile_cache);
 	if (file == NULL) {
 		return NULL;
 	}
 
-	file->of_offsetlock = lock_create("openfile");
-	if (file->of_offsetlock == NULL) {
-		kfree(file);
-		return NULL;
-	}
-
-	spinlock_init(&file->of_reflock);
-
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
+	file->of_direct = false;
 	file->of_offset = 0;
-	file->of_refcount = 1;
+	atomic_set(&file->of_refcount, 1);
 
 	return file;
 }
@@ -85,9 +113,8 @@ openfile_destroy(struct openfile *file)
 	/* balance vfs_open with vfs_close (not VOP_DECREF) */
 	vfs_close(file->of_vnode);
 
-	spinlock_cleanup(&file->of_reflock);
-	lock_destroy(file->of_offsetlock);
-	kfree(file);
+	/* the locks stay with it in the cache */
+	objcache_free(&openfile_cache, file);
 }
 
 /*
@@ -111,6 +138,67 @@ openfile_open(char *filename, int openflags, mode_t mode,
 		vfs_close(vn);
 		return ENOMEM;
 	}
+	file->of_direct = (openflags & O_DIRECT) != 0;
+
+	*ret = file;
+	return 0;
+}
+
+/*
+ * Make a pipe (with vfs_pipe) and wrap each end in an openfile
+ * object, the read end read-only and the write end write-only.
+ */
+int
+openfile_openpipe(struct openfile **readret, struct openfile **writeret)
+{
+	struct vnode *readvn, *writevn;
+	struct openfile *readfile, *writefile;
+	int result;
+
+	result = vfs_pipe(&readvn, &writevn);
+	if (result) {
+		return result;
+	}
+
+	readfile = openfile_create(readvn, O_RDONLY);
+	if (readfile == NULL) {
+		vfs_close(readvn);
+		vfs_close(writevn);
+		return ENOMEM;
+	}
+	writefile = openfile_create(writevn, O_WRONLY);
+	if (writefile == NULL) {
+		openfile_decref(readfile);
+		vfs_close(writevn);
+		return ENOMEM;
+	}
+
+	*readret = readfile;
+	*writeret = writefile;
+	return 0;
+}
+
+/*
+ * Make a message queue (with vfs_mqueue) and wrap it in an openfile
+ * object, open for both sending and receiving.
+ */
+int
+openfile_openmq(unsigned msgsize, unsigned maxmsgs, struct openfile **ret)
+{
+	struct vnode *vn;
+	struct openfile *file;
+	int result;
+
+	result = vfs_mqueue(msgsize, maxmsgs, &vn);
+	if (result) {
+		return result;
+	}
+
+	file = openfile_create(vn, O_RDWR);
+	if (file == NULL) {
+		vfs_close(vn);
+		return ENOMEM;
+	}
 
 	*ret = file;
 	return 0;
@@ -122,9 +210,27 @@ openfile_open(char *filename, int openflags, mode_t mode,
 void
 openfile_incref(struct openfile *file)
 {
-	spinlock_acquire(&file->of_reflock);
-	file->of_refcount++;
-	spinlock_release(&file->of_reflock);
+	atomic_inc(&file->of_refcount);
+}
+
+/*
+ * Add a reference to an openfile that the caller holds no reference
+ * to, and that may therefore be free: fails if the reference count has
+ * already dropped to zero. (If it succeeds, the openfile may still be
+ * a new one that has reused the memory; the caller must check.)
+ */
+bool
+openfile_tryincref(struct openfile *file)
+{
+	int count;
+
+	do {
+		count = atomic_get(&file->of_refcount);
+		if (count == 0) {
+			return false;
+		}
+	} while (atomic_cmpxchg(&file->of_refcount, count, count + 1) != count);
+	return true;
 }
 
 /*
@@ -134,16 +240,13 @@ openfile_incref(struct openfile *file)
 void
 openfile_decref(struct openfile *file)
 {
-	spinlock_acquire(&file->of_reflock);
+	KASSERT(atomic_get(&file->of_refcount) > 0);
 
-	/* if this is the last close of this file, free it up */
-	if (file->of_refcount == 1) {
-		spinlock_release(&file->of_reflock);
+	/*
+	 * If this is the last close of this file, free it up. The count
+	 * is left at zero, so openfile_tryincref won't bring it back.
+	 */
+	if (atomic_dec_and_test(&file->of_refcount)) {
 		openfile_destroy(file);
 	}
-	else {
-		KASSERT(file->of_refcount > 1);
-		file->of_refcount--;
-		spinlock_release(&file->of_reflock);
-	}
 }
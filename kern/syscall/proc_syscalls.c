@@ -34,12 +34,19 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <kern/procstat.h>
 #include <lib.h>
+#include <addrspace.h>
 #include <machine/trapframe.h>
+#include <objcache.h>
 #include <clock.h>
+#include <ktime.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
+#include <synch.h>
 #include <copyinout.h>
 #include <pid.h>
 #include <syscall.h>
@@ -79,6 +86,11 @@ sys__exit(int status)
  * create a new process, which begins executing in fork_newthread().
  */
 
+/* Trapframe copies handed from parent to child in fork */
+static struct objcache trapframe_cache =
+	OBJCACHE_INITIALIZER("trapframe", sizeof(struct trapframe),
+			     NULL, NULL);
+
 static
 void
 fork_newthread(void *vtf, unsigned long junk)
@@ -90,12 +102,12 @@ fork_newthread(void *vtf, unsigned long junk)
 
 	/*
 	 * Now copy the trapframe to our stack, so we can free the one
-	 * that was malloced and use the one on our stack for going to
+	 * that was allocated and use the one on our stack for going to
 	 * userspace.
 	 */
 
 	mytf = *ntf;
-	kfree(ntf);
+	objcache_free(&trapframe_cache, ntf);
 
 	enter_forked_process(&mytf);
 }
@@ -107,13 +119,15 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	int result;
 	struct proc *newproc;
 
+	ktime_begin(KTIME_FORK);
+
 	/*
 	 * Copy the trapframe to the heap, because we might return to
 	 * userlevel and make another syscall (changing the trapframe)
 	 * before the child runs. The child will free the copy.
 	 */
 
-	ntf = kmalloc(sizeof(struct trapframe));
+	ntf = objcache_alloc(&trapframe_cache);
 	if (ntf==NULL) {
 		return ENOMEM;
 	}
@@ -121,22 +135,150 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 
 	result = proc_fork(&newproc);
 	if (result) {
-		kfree(ntf);
+		objcache_free(&trapframe_cache, ntf);
 		return result;
 	}
 	*retval = newproc->p_pid;
 
 	result = thread_fork(curthread->t_name, newproc,
 			     fork_newthread, ntf, 0);
+	/* the stack is several pages, which may need compacting for */
+	while (result == ENOMEM && vm_reclaim()) {
+		result = thread_fork(curthread->t_name, newproc,
+				     fork_newthread, ntf, 0);
+	}
 	if (result) {
 		proc_unfork(newproc);
-		kfree(ntf);
+		objcache_free(&trapframe_cache, ntf);
 		return result;
 	}
 
+	ktime_end(KTIME_FORK);
 	return 0;
 }
 
+/*
+ * sys_vfork
+ * like fork, but the child runs in our address space instead of a
+ * copy, and we wait until it has execed or exited and no longer needs
+ * it. Until then the child is using our user stack too, so it should
+ * do nothing much but call execv or _exit.
+ */
+int
+sys_vfork(struct trapframe *tf, pid_t *retval)
+{
+	struct trapframe *ntf;
+	struct semaphore *wait;
+	struct proc *newproc;
+	int result;
+
+	if (proc_getas() == NULL) {
+		return EINVAL;
+	}
+
+	wait = sem_create("vfork", 0);
+	if (wait == NULL) {
+		return ENOMEM;
+	}
+
+	ntf = objcache_alloc(&trapframe_cache);
+	if (ntf==NULL) {
+		sem_destroy(wait);
+		return ENOMEM;
+	}
+	*ntf = *tf;
+
+	result = proc_vfork(&newproc, wait);
+	if (result) {
+		objcache_free(&trapframe_cache, ntf);
+		sem_destroy(wait);
+		return result;
+	}
+	*retval = newproc->p_pid;
+
+	result = thread_fork(curthread->t_name, newproc,
+			     fork_newthread, ntf, 0);
+	if (result) {
+		proc_unfork(newproc);
+		objcache_free(&trapframe_cache, ntf);
+		sem_destroy(wait);
+		return result;
+	}
+
+	P(wait);
+	sem_destroy(wait);
+	return 0;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Where a thread made by threadfork starts in userspace.
+ */
+struct threadstart {
+	vaddr_t ts_entry;
+	vaddr_t ts_arg;
+	vaddr_t ts_stack;
+};
+
+static
+void
+threadfork_newthread(void *vts, unsigned long junk)
+{
+	struct threadstart ts;
+
+	(void)junk;
+
+	ts = *(struct threadstart *)vts;
+	kfree(vts);
+
+	/* proc_exit gives the stack back */
+	curthread->t_ustack = ts.ts_stack;
+
+	/* The argument goes in a0, in the place of argc */
+	enter_new_process((int)ts.ts_arg, NULL, NULL,
+			  ts.ts_stack, ts.ts_entry);
+}
+
+/*
+ * sys_threadfork
+ * start a thread in the current process, running ENTRY(ARG) on a new
+ * stack. The address space and file table are shared, not copied.
+ */
+int
+sys_threadfork(userptr_t entry, userptr_t arg, int *retval)
+{
+	struct addrspace *as = proc_getas();
+	struct threadstart *ts;
+	vaddr_t stack;
+	int result;
+
+	ts = kmalloc(sizeof(*ts));
+	if (ts == NULL) {
+		return ENOMEM;
+	}
+
+	result = as_define_thread_stack(as, &stack);
+	if (result) {
+		kfree(ts);
+		return result;
+	}
+	ts->ts_entry = (vaddr_t)entry;
+	ts->ts_arg = (vaddr_t)arg;
+	ts->ts_stack = stack;
+
+	result = thread_fork(curthread->t_name, NULL,
+			     threadfork_newthread, ts, 0);
+	if (result) {
+		as_destroy_thread_stack(as, stack);
+		kfree(ts);
+		return result;
+	}
+
+	*retval = 0;
+	return 0;
+}
+#endif /* !OPT_DUMBVM */
+
 /*
  * sys_waitpid
  * just pass off the work to the pid code.
@@ -157,3 +299,236 @@ sys_waitpid(pid_t pid, userptr_t retstatus, int flags, pid_t *retval)
 	}
 	return result;
 }
+
+/*
+ * sys_setaffinity
+ * pin the calling thread to the CPUs in MASK; see thread_setaffinity.
+ */
+int
+sys_setaffinity(unsigned mask, userptr_t oldmask)
+{
+	uint32_t old;
+	int result;
+
+	result = thread_setaffinity(mask, &old);
+	if (result) {
+		return result;
+	}
+
+	if (oldmask != NULL) {
+		result = copyout(&old, oldmask, sizeof(old));
+	}
+	return result;
+}
+
+/*
+ * Convert a timespec to the coarser timeval of struct rusage.
+ */
+static
+void
+rusage_time(const struct timespec *ts, struct timeval *tv)
+{
+	tv->tv_sec = ts->tv_sec;
+	tv->tv_usec = ts->tv_nsec / 1000;
+}
+
+/*
+ * sys_getrusage
+ * report the accounting of the current process or its reaped children.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	struct schedstats stats;
+	struct rusage ru;
+
+	if (who != RUSAGE_SELF && who != RUSAGE_CHILDREN) {
+		return EINVAL;
+	}
+
+	proc_getstats(curproc, who == RUSAGE_CHILDREN, &stats);
+
+	bzero(&ru, sizeof(ru));
+	rusage_time(&stats.ss_runtime, &ru.ru_utime);
+	rusage_time(&stats.ss_waittime, &ru.ru_wtime);
+	ru.ru_nvcsw = stats.ss_nvcsw;
+	ru.ru_nivcsw = stats.ss_nivcsw;
+
+	return copyout(&ru, usage, sizeof(ru));
+}
+
+/*
+ * sys_getrlimit
+ * report one of the current process's resource limits.
+ */
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+	struct rlimit rl;
+
+	if (resource < 0 || resource >= __RLIMIT_NUM) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	rl = curproc->p_rlimits[resource];
+	spinlock_release(&curproc->p_lock);
+
+	return copyout(&rl, rlp, sizeof(rl));
+}
+
+/*
+ * sys_setrlimit
+ * change one of them; see proc_setrlimit.
+ */
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+	struct rlimit rl;
+	int result;
+
+	result = copyin(rlp, &rl, sizeof(rl));
+	if (result) {
+		return result;
+	}
+	return proc_setrlimit(resource, &rl);
+}
+
+/*
+ * Check the which/who (or just who) of the priority calls. There are
+ * no process groups or users, and a thread can only change itself, so
+ * the only thing that can be named is the calling process.
+ */
+static
+int
+prio_target(int which, int who)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who != 0 && who != curproc->p_pid) {
+		return EPERM;
+	}
+	return 0;
+}
+
+/*
+ * sys_getpriority
+ * report the calling thread's nice value.
+ */
+int
+sys_getpriority(int which, int who, int *retval)
+{
+	int result;
+
+	result = prio_target(which, who);
+	if (result) {
+		return result;
+	}
+	*retval = thread_getnice();
+	return 0;
+}
+
+/*
+ * sys_setpriority
+ * set it; values past PRIO_MIN and PRIO_MAX are clamped, as in BSD.
+ */
+int
+sys_setpriority(int which, int who, int prio)
+{
+	int result;
+
+	result = prio_target(which, who);
+	if (result) {
+		return result;
+	}
+	if (prio < PRIO_MIN) {
+		prio = PRIO_MIN;
+	}
+	if (prio > PRIO_MAX) {
+		prio = PRIO_MAX;
+	}
+	return thread_setnice(prio);
+}
+
+/*
+ * sys_sched_setscheduler
+ * move the calling thread to scheduling class POLICY.
+ */
+int
+sys_sched_setscheduler(pid_t pid, int policy)
+{
+	int result;
+
+	result = prio_target(PRIO_PROCESS, pid);
+	if (result) {
+		return result;
+	}
+	return thread_setclass(policy);
+}
+
+/*
+ * sys_sched_getscheduler
+ * report its class.
+ */
+int
+sys_sched_getscheduler(pid_t pid, int *retval)
+{
+	int result;
+
+	result = prio_target(PRIO_PROCESS, pid);
+	if (result) {
+		return result;
+	}
+	*retval = thread_getclass();
+	return 0;
+}
+
+/*
+ * sys_setgang
+ * start a gang of the calling thread and what it forks, or leave one;
+ * see thread_setgang.
+ */
+int
+sys_setgang(int on)
+{
+	return thread_setgang(on != 0);
+}
+
+/*
+ * sys_procstat
+ * describe up to MAX processes, for ps, and return how many there are.
+ */
+int
+sys_procstat(userptr_t buf, size_t max, int *retval)
+{
+	struct procstat *kbuf;
+	unsigned num;
+	int result;
+
+	/* Don't take the user's word for how much to allocate */
+	num = proc_snapshot(NULL, 0);
+	if (max > num) {
+		max = num;
+	}
+	kbuf = NULL;
+	if (max > 0) {
+		kbuf = kmalloc(max * sizeof(*kbuf));
+		if (kbuf == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	num = proc_snapshot(kbuf, max);
+	result = 0;
+	if (max > 0) {
+		result = copyout(kbuf, buf,
+				 (num < max ? num : max) * sizeof(*kbuf));
+		kfree(kbuf);
+	}
+	if (result) {
+		return result;
+	}
+	*retval = num;
+	return 0;
+}
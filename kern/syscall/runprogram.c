@@ -36,14 +36,17 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <kern/unistd.h>
+#include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
+#include <signal.h>
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
 #include <copyinout.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <ktime.h>
 #include <vfs.h>
 #include <openfile.h>
 #include <filetable.h>
@@ -55,34 +58,22 @@
  *
  * This is an abstraction that holds an argv while it's being shuffled
  * through the kernel during exec.
+ *
+ * The strings are copied in just once, straight into a fresh page,
+ * which then becomes the top page of the new program's stack as it
+ * is (see argbuf_install) instead of being copied out again. So the
+ * user address of each string is known as soon as it's copied in.
+ * That's why all the strings have to fit in one page.
  */
 struct argbuf {
-	char *data;
-	size_t len;
-	size_t max;
+	vaddr_t page;		/* the strings, or 0 */
+	size_t len;		/* bytes of strings */
 	int nargs;
-	bool tooksem;
 };
 
-/*
- * Throttle to limit the number of processes in exec at once. Or,
- * rather, the number trying to use large exec buffers at once. See
- * design notes for the rationale.
- */
-#define EXEC_BIGBUF_THROTTLE	1
-static struct semaphore *execthrottle;
-
-/*
- * Set things up.
- */
-void
-exec_bootstrap(void)
-{
-	execthrottle = sem_create("exec", EXEC_BIGBUF_THROTTLE);
-	if (execthrottle == NULL) {
-		panic("Cannot create exec throttle semaphore\n");
-	}
-}
+/* Most pages the argv pointers (and the NULL) can take up */
+#define ARGV_MAXPAGES \
+	DIVROUNDUP((ARG_MAX + 1) * sizeof(userptr_t), PAGE_SIZE)
 
 /*
  * Initialize an argv buffer.
@@ -91,11 +82,9 @@ static
 void
 argbuf_init(struct argbuf *buf)
 {
-	buf->data = NULL;
+	buf->page = 0;
 	buf->len = 0;
-	buf->max = 0;
 	buf->nargs = 0;
-	buf->tooksem = false;
 }
 
 /*
@@ -105,31 +94,27 @@ static
 void
 argbuf_cleanup(struct argbuf *buf)
 {
-	if (buf->data != NULL) {
-		kfree(buf->data);
-		buf->data = NULL;
+	if (buf->page != 0) {
+		free_kpages(buf->page);
+		buf->page = 0;
 	}
 	buf->len = 0;
-	buf->max = 0;
 	buf->nargs = 0;
-	if (buf->tooksem) {
-		V(execthrottle);
-		buf->tooksem = false;
-	}
 }
 
 /*
- * Allocate the memory for an argv buffer.
+ * Allocate the page for an argv buffer.
  */
 static
 int
-argbuf_allocate(struct argbuf *buf, size_t size)
+argbuf_allocate(struct argbuf *buf)
 {
-	buf->data = kmalloc(size);
-	if (buf->data == NULL) {
+	COMPILE_ASSERT(ARG_MAX <= PAGE_SIZE);
+
+	buf->page = alloc_kpages(1);
+	if (buf->page == 0) {
 		return ENOMEM;
 	}
-	buf->max = size;
 	return 0;
 }
 
@@ -147,12 +132,15 @@ argbuf_fromkernel(struct argbuf *buf, const char *progname)
 	int result;
 
 	len = strlen(progname) + 1;
+	if (len > ARG_MAX) {
+		return E2BIG;
+	}
 
-	result = argbuf_allocate(buf, len);
+	result = argbuf_allocate(buf);
 	if (result) {
 		return result;
 	}
-	strcpy(buf->data, progname);
+	strcpy((char *)buf->page, progname);
 	buf->len = len;
 	buf->nargs = 1;
 
@@ -160,16 +148,21 @@ argbuf_fromkernel(struct argbuf *buf, const char *progname)
 }
 
 /*
- * Copy an argv array into kernel space, using an argvdata buffer.
+ * Get an argv from user space, grabbing each string into the page.
  */
 static
 int
-argbuf_copyin(struct argbuf *buf, userptr_t uargv)
+argbuf_fromuser(struct argbuf *buf, userptr_t uargv)
 {
 	userptr_t thisarg;
 	size_t thisarglen;
 	int result;
 
+	result = argbuf_allocate(buf);
+	if (result) {
+		return result;
+	}
+
 	/* loop through the argv, grabbing each arg string */
 	buf->nargs = 0;
 	while (1) {
@@ -188,8 +181,8 @@ argbuf_copyin(struct argbuf *buf, userptr_t uargv)
 		}
 
 		/* Use the pointer to fetch the argument string. */
-		result = copyinstr(thisarg, buf->data + buf->len,
-				   buf->max - buf->len, &thisarglen);
+		result = copyinstr(thisarg, (char *)buf->page + buf->len,
+				   ARG_MAX - buf->len, &thisarglen);
 		if (result == ENAMETOOLONG) {
 			return E2BIG;
 		}
@@ -207,143 +200,148 @@ argbuf_copyin(struct argbuf *buf, userptr_t uargv)
 }
 
 /*
- * Get an argv from user space.
+ * Give the argv to AS, a new address space that need not be current:
+ * the page of strings is mapped as the top page of the stack, and
+ * the argv pointers, which point into it, go in fresh pages below.
+ *
+ * Note: ustackp is an in/out argument, and must start at the top of
+ * the stack.
  */
 static
 int
-argbuf_fromuser(struct argbuf *buf, userptr_t uargv)
+argbuf_install(struct argbuf *buf, struct addrspace *as, vaddr_t *ustackp,
+	       int *argc_ret, userptr_t *uargv_ret)
 {
+	vaddr_t ustringbase, uargvbase, uslot, firstpage;
+	vaddr_t ptrpages[ARGV_MAXPAGES];
+	unsigned nptrpages, i, p;
+	size_t pos;
 	int result;
 
-	/* try with a small buffer */
-	result = argbuf_allocate(buf, PAGE_SIZE);
-	if (result) {
-		return result;
+	KASSERT(*ustackp % PAGE_SIZE == 0);
+
+	ustringbase = *ustackp - PAGE_SIZE;
+
+	/* Leave an extra slot for the ending NULL. */
+	uargvbase = ustringbase - (buf->nargs + 1) * sizeof(userptr_t);
+	firstpage = uargvbase & PAGE_FRAME;
+	nptrpages = (ustringbase - firstpage) / PAGE_SIZE;
+	KASSERT(nptrpages <= ARGV_MAXPAGES);
+
+	for (p=0; p<nptrpages; p++) {
+		ptrpages[p] = alloc_kpages(1);
+		if (ptrpages[p] == 0) {
+			result = ENOMEM;
+			goto fail;
+		}
+		bzero((void *)ptrpages[p], PAGE_SIZE);
 	}
 
-	/* do the copyin */
-	result = argbuf_copyin(buf, uargv);
-	if (result == E2BIG) {
-		/*
-		 * Try again with the full-size buffer. Just start
-		 * over instead of trying to keep the page we already
-		 * did; this is a bit inefficient but it's not that
-		 * important.
-		 */
-		argbuf_cleanup(buf);
-		argbuf_init(buf);
+	/*
+	 * Walk the strings, pointing at each. The slot after the last
+	 * is left as the NULL. This has to be done before the pages go
+	 * to AS, as after that they might be paged out.
+	 */
+	pos = 0;
+	for (i=0; i<(unsigned)buf->nargs; i++) {
+		uslot = uargvbase + i * sizeof(userptr_t);
+		p = (uslot - firstpage) / PAGE_SIZE;
+		*(userptr_t *)(ptrpages[p] + uslot % PAGE_SIZE) =
+			(userptr_t)(ustringbase + pos);
+		pos += strlen((char *)buf->page + pos) + 1;
+	}
+	/* Should have come out even... */
+	KASSERT(pos == buf->len);
+
+	/* Don't give the process what was in the rest of the page. */
+	bzero((char *)buf->page + buf->len, PAGE_SIZE - buf->len);
 
-		/* Wait on the semaphore, to throttle this allocation */
-		P(execthrottle);
-		buf->tooksem = true;
+	result = vm_map_kpage(as, ustringbase, buf->page);
+	if (result) {
+		goto fail;
+	}
+	buf->page = 0;
 
-		result = argbuf_allocate(buf, ARG_MAX);
+	for (p=0; p<nptrpages; p++) {
+		result = vm_map_kpage(as, firstpage + p * PAGE_SIZE,
+				      ptrpages[p]);
 		if (result) {
+			/* the ones before are AS's now */
+			free_kpages(ptrpages[p]);
+			while (++p < nptrpages) {
+				free_kpages(ptrpages[p]);
+			}
 			return result;
 		}
+	}
+
+	*ustackp = uargvbase;
+	*argc_ret = buf->nargs;
+	*uargv_ret = (userptr_t)uargvbase;
+	return 0;
 
-		result = argbuf_copyin(buf, uargv);
+ fail:
+	while (p-- > 0) {
+		free_kpages(ptrpages[p]);
 	}
 	return result;
 }
 
 /*
- * Copy an argv out of kernel space to user space.
- *
- * Note: ustackp is an in/out argument.
+ * Where a new program starts in user mode.
+ */
+struct execstart {
+	vaddr_t es_entry;
+	vaddr_t es_stack;
+	int es_argc;
+	userptr_t es_argv;
+};
+
+/*
+ * Fill in the empty address space AS from the executable V, with its
+ * stack and the argv in ARGS. On failure AS may be partly filled in.
  */
 static
 int
-argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
-	       int *argc_ret, userptr_t *uargv_ret)
+fillimage(struct addrspace *as, struct vnode *v, struct argbuf *args,
+	  struct execstart *es)
 {
-	vaddr_t ustack;
-	userptr_t ustringbase, uargvbase, uargv_i;
-	userptr_t thisarg;
-	size_t thisarglen;
-	size_t pos;
 	int result;
 
-	/* Begin the stack at the passed in top. */
-	ustack = *ustackp;
-
-	/*
-	 * Allocate space.
-	 *
-	 * buf->pos is the amount of space used by the strings; put that
-	 * first, then align the stack, then make space for the argv
-	 * pointers. Allow an extra slot for the ending NULL.
-	 */
-
-	ustack -= buf->len;
-	ustack -= (ustack & (sizeof(void *) - 1));
-	ustringbase = (userptr_t)ustack;
-
-	ustack -= (buf->nargs + 1) * sizeof(userptr_t);
-	uargvbase = (userptr_t)ustack;
-
-	/* Now copy the data out. */
-	pos = 0;
-	uargv_i = uargvbase;
-	while (pos < buf->len) {
-		/* The user address of the string will be ustringbase + pos. */
-		thisarg = ustringbase + pos;
-
-		/* Place it in the argv array. */
-		result = copyout(&thisarg, uargv_i, sizeof(thisarg));
-		if (result) {
-			return result;
-		}
-
-		/* Push out the string. */
-		result = copyoutstr(buf->data + pos, thisarg,
-				    buf->len - pos, &thisarglen);
-		if (result) {
-			return result;
-		}
-
-		/* thisarglen includes the \0 */
-		pos += thisarglen;
-		uargv_i += sizeof(thisarg);
+	/* Load the executable. */
+	result = load_elf(as, v, &es->es_entry);
+	if (result) {
+		return result;
 	}
-	/* Should have come out even... */
-	KASSERT(pos == buf->len);
 
-	/* Add the NULL. */
-	thisarg = NULL;
-	result = copyout(&thisarg, uargv_i, sizeof(userptr_t));
+	/* Define the user stack in the address space */
+	result = as_define_stack(as, &es->es_stack);
 	if (result) {
 		return result;
 	}
 
-	*ustackp = ustack;
-	*argc_ret = buf->nargs;
-	*uargv_ret = uargvbase;
-	return 0;
+	/* Send the argv strings to the process. */
+	return argbuf_install(args, as, &es->es_stack,
+			      &es->es_argc, &es->es_argv);
 }
 
 /*
- * Common code for execv and runprogram: loading the executable.
+ * Common code for execv, runprogram, and spawnv: build a new address
+ * space from the executable PATH, with its stack and the argv in
+ * ARGS, without switching to it. PATH may be altered.
  */
 static
 int
-loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
+loadimage(char *path, struct argbuf *args, struct addrspace **ret,
+	  struct execstart *es)
 {
-	struct addrspace *newvm, *oldvm;
+	struct addrspace *newvm;
 	struct vnode *v;
-	char *newname;
 	int result;
 
-	/* new name for thread */
-	newname = kstrdup(path);
-	if (newname == NULL) {
-		return ENOMEM;
-	}
-
 	/* open the file. */
 	result = vfs_open(path, O_RDONLY, 0, &v);
 	if (result) {
-		kfree(newname);
 		return result;
 	}
 
@@ -351,48 +349,112 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 	newvm = as_create();
 	if (newvm == NULL) {
 		vfs_close(v);
-		kfree(newname);
 		return ENOMEM;
 	}
 
-	/* replace address spaces, and activate the new one */
-	oldvm = proc_setas(newvm);
-	as_activate();
-
- 	/*
-	 * Load the executable. If it fails, restore the old address
-	 * space and (re-)activate it.
-	 */
-	result = load_elf(v, entrypoint);
+	result = fillimage(newvm, v, args, es);
+	vfs_close(v);
 	if (result) {
-		vfs_close(v);
-		proc_setas(oldvm);
-		as_activate();
 		as_destroy(newvm);
-		kfree(newname);
 		return result;
 	}
 
-	vfs_close(v);
+	*ret = newvm;
+	return 0;
+}
 
-	/* Define the user stack in the address space */
-	result = as_define_stack(newvm, stackptr);
+/*
+ * Build the new image in the current process's own address space,
+ * emptied out first, so the old image's memory is free again before
+ * the new one starts taking any, and the page table's allocations
+ * are reused. The executable is opened and checked before anything
+ * is thrown away, so the usual failures still come back to the
+ * caller; but if loading fails after that, *WIPED is set and there
+ * is no old image left to return to.
+ */
+static
+int
+loadinplace(char *path, struct argbuf *args, struct execstart *es,
+	    bool *wiped)
+{
+	struct addrspace *as;
+	struct vnode *v;
+	int result;
+
+	/* open the file. */
+	result = vfs_open(path, O_RDONLY, 0, &v);
 	if (result) {
-		proc_setas(oldvm);
-		as_activate();
-		as_destroy(newvm);
-		kfree(newname);
 		return result;
-        }
+	}
+
+	result = load_elf_check(v);
+	if (result) {
+		vfs_close(v);
+		return result;
+	}
+
+	as = proc_getas();
+	as_reset(as);
+	*wiped = true;
+
+	result = fillimage(as, v, args, es);
+	vfs_close(v);
+	return result;
+}
+
+/*
+ * Common code for execv and runprogram: loading the executable in
+ * place of the current one. If it fails with *WIPED set, the current
+ * image is already gone and the process can only exit.
+ */
+static
+int
+loadexec(char *path, struct argbuf *args, struct execstart *es,
+	 bool *wiped)
+{
+	struct addrspace *newvm, *oldvm;
+	char *newname;
+	int result;
+
+	*wiped = false;
+
+	/* new name for thread */
+	newname = kstrdup(path);
+	if (newname == NULL) {
+		return ENOMEM;
+	}
 
 	/*
-	 * Wipe out old address space.
-	 *
-	 * Note: once this is done, execv() must not fail, because there's
-	 * nothing left for it to return an error to.
+	 * If vfork lent us our parent's address space it has to go
+	 * back intact; otherwise reuse our own.
 	 */
-	if (oldvm) {
-		as_destroy(oldvm);
+	if (proc_getas() != NULL && curproc->p_vforkwait == NULL) {
+		result = loadinplace(path, args, es, wiped);
+		if (result) {
+			kfree(newname);
+			return result;
+		}
+	}
+	else {
+		result = loadimage(path, args, &newvm, es);
+		if (result) {
+			kfree(newname);
+			return result;
+		}
+
+		/* replace address spaces, and activate the new one */
+		oldvm = proc_setas(newvm);
+		as_activate();
+
+		/*
+		 * Give the old address space back to our vfork parent.
+		 *
+		 * Note: once this is done, execv() must not fail, because
+		 * there's nothing left for it to return an error to.
+		 */
+		if (oldvm && !proc_vfork_return(curproc, oldvm)) {
+			as_destroy(oldvm);
+		}
 	}
 
 	/*
@@ -405,7 +467,6 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 	return 0;
 }
 
-
 /*
  * Open a file on a selected file descriptor. Takes care of various
  * minutiae, like the vfs-level open destroying pathnames.
@@ -483,9 +544,8 @@ int
 runprogram(char *progname)
 {
 	struct argbuf kargv;
-	vaddr_t entrypoint, stackptr;
-	int argc;
-	userptr_t uargv;
+	struct execstart es;
+	bool wiped;
 	int result;
 
 	/* We must be a thread that can run in a user process. */
@@ -519,23 +579,17 @@ runprogram(char *progname)
 	}
 
 	/* Load the executable. Note: must not fail after this succeeds. */
-	result = loadexec(progname, &entrypoint, &stackptr);
+	result = loadexec(progname, &kargv, &es, &wiped);
+	argbuf_cleanup(&kargv);
 	if (result) {
-		argbuf_cleanup(&kargv);
 		return result;
 	}
 
-	result = argbuf_copyout(&kargv, &stackptr, &argc, &uargv);
-	if (result) {
-		/* If copyout fails, *we* messed up, so panic */
-		panic("execv: copyout_args failed: %s\n", strerror(result));
-	}
-
-	/* free the space */
-	argbuf_cleanup(&kargv);
+	boot_firstexec();
 
 	/* Warp to user mode. */
-	enter_new_process(argc, uargv, NULL /*uenv*/, stackptr, entrypoint);
+	enter_new_process(es.es_argc, es.es_argv, NULL /*uenv*/,
+			  es.es_stack, es.es_entry);
 
 	/* enter_new_process does not return. */
 	panic("enter_new_process returned\n");
@@ -556,10 +610,12 @@ sys_execv(userptr_t prog, userptr_t uargv)
 {
 	char *path;
 	struct argbuf kargv;
-	vaddr_t entrypoint, stackptr;
-	int argc;
+	struct execstart es;
+	bool wiped;
 	int result;
 
+	ktime_begin(KTIME_EXEC);
+
 	path = kmalloc(PATH_MAX);
 	if (!path) {
 		return ENOMEM;
@@ -583,31 +639,137 @@ sys_execv(userptr_t prog, userptr_t uargv)
 		return result;
 	}
 
-	/* Load the executable. Note: must not fail after this succeeds. */
-	result = loadexec(path, &entrypoint, &stackptr);
+	/* Other threads would be left running in the old image */
+	result = proc_exec_begin(curproc);
 	if (result) {
 		argbuf_cleanup(&kargv);
 		kfree(path);
 		return result;
 	}
 
-	/* don't need this any more */
+	/* Load the executable. Note: must not fail after this succeeds. */
+	result = loadexec(path, &kargv, &es, &wiped);
+	proc_exec_end(curproc);
+	argbuf_cleanup(&kargv);
 	kfree(path);
-
-	/* Send the argv strings to the process. */
-	result = argbuf_copyout(&kargv, &stackptr, &argc, &uargv);
+	if (result && wiped) {
+		/* the old image is gone; nothing to return the error to */
+		proc_exit(_MKWAIT_SIG(SIGKILL));
+	}
 	if (result) {
-		/* if copyout fails, *we* messed up, so panic */
-		panic("execv: copyout_args failed: %s\n", strerror(result));
+		return result;
 	}
-
-	/* free the argv buffer space */
-	argbuf_cleanup(&kargv);
+	ktime_end(KTIME_EXEC);
 
 	/* Warp to user mode. */
-	enter_new_process(argc, uargv, NULL /*uenv*/, stackptr, entrypoint);
+	enter_new_process(es.es_argc, es.es_argv, NULL /*uenv*/,
+			  es.es_stack, es.es_entry);
 
 	/* enter_new_process does not return. */
 	panic("enter_new_process returned\n");
 	return EINVAL;
 }
+
+/*
+ * Where a process made by spawnv starts: its image, arguments and all,
+ * is already set up.
+ */
+static
+void
+spawn_newthread(void *ves, unsigned long junk)
+{
+	struct execstart es;
+
+	(void)junk;
+
+	es = *(struct execstart *)ves;
+	kfree(ves);
+
+	/* Warp to user mode. */
+	enter_new_process(es.es_argc, es.es_argv, NULL /*uenv*/,
+			  es.es_stack, es.es_entry);
+
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+}
+
+/*
+ * sys_spawnv: fork and execv in one go, except that the child's image
+ * is built directly from the executable instead of by copying ours
+ * and then throwing the copy away. Everything that can fail is done
+ * here in the parent, so errors (like not finding the program) come
+ * back from spawnv itself.
+ */
+int
+sys_spawnv(userptr_t prog, userptr_t uargv, pid_t *retval)
+{
+	struct argbuf kargv;
+	struct execstart *es;
+	struct addrspace *newvm;
+	struct proc *newproc;
+	char *path, *name;
+	int result;
+
+	path = kmalloc(PATH_MAX);
+	if (!path) {
+		return ENOMEM;
+	}
+
+	/* Get the filename. */
+	result = copyinstr(prog, path, PATH_MAX, NULL);
+	if (result) {
+		kfree(path);
+		return result;
+	}
+
+	es = kmalloc(sizeof(*es));
+	if (es == NULL) {
+		kfree(path);
+		return ENOMEM;
+	}
+
+	/* get the argv strings. */
+	argbuf_init(&kargv);
+	result = argbuf_fromuser(&kargv, uargv);
+	if (result) {
+		goto fail;
+	}
+
+	/* the child thread's name; loading may alter path */
+	name = kstrdup(path);
+	if (name == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	result = loadimage(path, &kargv, &newvm, es);
+	if (result) {
+		kfree(name);
+		goto fail;
+	}
+
+	result = proc_spawn(&newproc, newvm);
+	if (result) {
+		as_destroy(newvm);
+		kfree(name);
+		goto fail;
+	}
+	*retval = newproc->p_pid;
+
+	result = thread_fork(name, newproc, spawn_newthread, es, 0);
+	kfree(name);
+	if (result) {
+		proc_unfork(newproc);
+		goto fail;
+	}
+
+	argbuf_cleanup(&kargv);
+	kfree(path);
+	return 0;
+
+ fail:
+	argbuf_cleanup(&kargv);
+	kfree(es);
+	kfree(path);
+	return result;
+}
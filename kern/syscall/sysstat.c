@@ -0,0 +1,187 @@
+/*
+ * System call statistics; see <kern/sysstat.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/syscall.h>
+#include <kern/sysstat.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <clock.h>
+#include <current.h>
+#include <copyinout.h>
+#include <platform/maxcpus.h>
+#include <syscall.h>
+
+/*
+ * Each CPU's table is only updated by that CPU, with interrupts off,
+ * so no lock is needed; readers may see counts a call or two stale.
+ * A call is counted on the CPU it started on and timed on the one it
+ * finished on, which may differ, but the sums come out right. Until
+ * sysstat_bootstrap there are no tables and nothing is counted.
+ */
+static struct sysstat *sysstat_cpus[MAXCPUS];
+
+void
+sysstat_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; cpu_bynumber(i) != NULL; i++) {
+		sysstat_cpus[i] = kmalloc(SYSSTAT_NCALLS *
+					  sizeof(struct sysstat));
+		if (sysstat_cpus[i] == NULL) {
+			panic("sysstat_bootstrap: Out of memory\n");
+		}
+		bzero(sysstat_cpus[i], SYSSTAT_NCALLS * sizeof(struct sysstat));
+	}
+}
+
+void
+sysstat_enter(int callno, struct timespec *start)
+{
+	struct sysstat *ss;
+	int spl;
+
+	clock_now(start);
+	if (callno < 0 || callno >= SYSSTAT_NCALLS) {
+		return;
+	}
+
+	spl = splhigh();
+	ss = sysstat_cpus[curcpu->c_number];
+	if (ss != NULL) {
+		ss[callno].ss_calls++;
+	}
+	splx(spl);
+}
+
+void
+sysstat_exit(int callno, int err, const struct timespec *start)
+{
+	struct sysstat *ss;
+	struct timespec now, diff;
+	uint32_t usecs;
+	int spl;
+
+	if (callno < 0 || callno >= SYSSTAT_NCALLS) {
+		return;
+	}
+
+	clock_now(&now);
+	timespec_sub(&now, start, &diff);
+	usecs = diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+
+	spl = splhigh();
+	ss = sysstat_cpus[curcpu->c_number];
+	if (ss != NULL) {
+		ss += callno;
+		if (err) {
+			ss->ss_errors++;
+		}
+		ss->ss_usecs += usecs;
+		if (usecs > ss->ss_maxusecs) {
+			ss->ss_maxusecs = usecs;
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Fill in RET (SYSSTAT_NCALLS of them) with CPU's statistics, or the
+ * totals over all CPUs if CPU is -1.
+ */
+static
+int
+sysstat_get(int cpu, struct sysstat *ret)
+{
+	const struct sysstat *ss;
+	unsigned c, i;
+
+	if (cpu < -1 || cpu >= MAXCPUS ||
+	    (cpu >= 0 && sysstat_cpus[cpu] == NULL)) {
+		return EINVAL;
+	}
+	if (cpu >= 0) {
+		memcpy(ret, sysstat_cpus[cpu],
+		       SYSSTAT_NCALLS * sizeof(struct sysstat));
+		return 0;
+	}
+
+	bzero(ret, SYSSTAT_NCALLS * sizeof(struct sysstat));
+	for (c=0; c<MAXCPUS; c++) {
+		ss = sysstat_cpus[c];
+		if (ss == NULL) {
+			continue;
+		}
+		for (i=0; i<SYSSTAT_NCALLS; i++) {
+			ret[i].ss_calls += ss[i].ss_calls;
+			ret[i].ss_errors += ss[i].ss_errors;
+			ret[i].ss_usecs += ss[i].ss_usecs;
+			if (ss[i].ss_maxusecs > ret[i].ss_maxusecs) {
+				ret[i].ss_maxusecs = ss[i].ss_maxusecs;
+			}
+		}
+	}
+	return 0;
+}
+
+void
+sysstat_print(void)
+{
+	static const char *const names[SYSSTAT_NCALLS] = SYSSTAT_NAMES;
+	struct sysstat *total;
+	unsigned i;
+
+	total = kmalloc(SYSSTAT_NCALLS * sizeof(struct sysstat));
+	if (total == NULL) {
+		kprintf("sysstat: Out of memory\n");
+		return;
+	}
+	sysstat_get(-1, total);
+
+	kprintf("%-14s %10s %8s %12s %10s %10s\n", "call", "calls",
+		"errors", "total us", "avg us", "max us");
+	for (i=0; i<SYSSTAT_NCALLS; i++) {
+		if (total[i].ss_calls == 0) {
+			continue;
+		}
+		if (names[i] != NULL) {
+			kprintf("%-14s", names[i]);
+		}
+		else {
+			kprintf("#%-13u", i);
+		}
+		kprintf(" %10u %8u %12llu %10llu %10u\n",
+			total[i].ss_calls, total[i].ss_errors,
+			total[i].ss_usecs,
+			total[i].ss_usecs / total[i].ss_calls,
+			total[i].ss_maxusecs);
+	}
+	kfree(total);
+}
+
+/*
+ * sysstat: copy out CPU's system call statistics, or their totals
+ * over all CPUs if CPU is -1.
+ */
+int
+sys_sysstat(int cpu, userptr_t buf)
+{
+	struct sysstat *stats;
+	int result;
+
+	stats = kmalloc(SYSSTAT_NCALLS * sizeof(struct sysstat));
+	if (stats == NULL) {
+		return ENOMEM;
+	}
+	result = sysstat_get(cpu, stats);
+	if (result == 0) {
+		result = copyout(stats, buf,
+				 SYSSTAT_NCALLS * sizeof(struct sysstat));
+	}
+	kfree(stats);
+	return result;
+}
@@ -0,0 +1,322 @@
+/*
+ * Memory-management system calls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/vmstat.h>
+#include <limits.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes (which may be
+ * negative) and return the old end. Pages are not actually allocated
+ * until touched; pages given back are freed straight away.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * Shared anonymous memory is a nameless file in the shm: tmpfs,
+ * LENGTH bytes long, mapped like any other: its pages are page cache
+ * frames that every mapping holds a reference to, so as_copy hands the
+ * child the same frames rather than copies. The name is only there
+ * long enough to make the file; it goes away with its last mapping.
+ */
+static unsigned mmap_shared_next;	/* for names; EEXIST sorts out races */
+
+static
+int
+mmap_shared_anon(struct addrspace *as, size_t length, int prot,
+		 vaddr_t *retval)
+{
+	char path[NAME_MAX];
+	struct vnode *vn;
+	unsigned n;
+	int result;
+
+	do {
+		n = mmap_shared_next++;
+		snprintf(path, sizeof(path), "shm:.anon.%d.%u",
+			 curproc->p_pid, n);
+		result = vfs_open(path, O_RDWR | O_CREAT | O_EXCL, 0600, &vn);
+	} while (result == EEXIST);
+	if (result) {
+		return result;
+	}
+
+	/* vfs_open may have scribbled on the path */
+	snprintf(path, sizeof(path), "shm:.anon.%d.%u", curproc->p_pid, n);
+	result = VOP_TRUNCATE(vn, ROUNDUP(length, PAGE_SIZE));
+	vfs_remove(path);
+	if (result == 0) {
+		result = VOP_MMAP(vn);
+	}
+	if (result == 0) {
+		/* as_mmap takes its own reference to the vnode */
+		result = as_mmap(as, length, prot & PROT_READ,
+				 prot & PROT_WRITE, vn, 0, retval);
+	}
+
+	vfs_close(vn);
+	return result;
+}
+
+/*
+ * mmap: map LENGTH bytes of file FD, starting at OFFSET, shared: all
+ * mappings of a file see the same pages, and changes are written back
+ * to the file once nobody has it mapped any more. An FD of -1 gives
+ * zero-filled memory instead, private unless PROT has MAP_SHARED. The
+ * kernel picks the address.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct openfile *file;
+	struct vnode *vn;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	if (length == 0 ||
+	    (prot & ~(PROT_READ | PROT_WRITE | MAP_SHARED)) != 0) {
+		return EINVAL;
+	}
+
+	if (fd == -1 && (prot & MAP_SHARED)) {
+		return mmap_shared_anon(as, length, prot, retval);
+	}
+	if (fd == -1) {
+		return as_mmap(as, length, prot & PROT_READ,
+			       prot & PROT_WRITE, NULL, 0, retval);
+	}
+
+	if (offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	/* mappings are read back from the file, and maybe written */
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode == O_RDONLY)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	vn = file->of_vnode;
+	result = VOP_MMAP(vn);
+	if (result == 0) {
+		/* as_mmap takes its own reference to the vnode */
+		result = as_mmap(as, length, prot & PROT_READ,
+				 prot & PROT_WRITE, vn, offset, retval);
+	}
+
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * munmap: remove the mapping made by mmap at ADDR.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_munmap(as, (vaddr_t)addr);
+}
+
+/*
+ * Turn the LENGTH bytes at ADDR given to mprotect or the madvise
+ * family into a range of whole pages. ADDR must be page aligned; the
+ * range must be in user space.
+ */
+static int
+vm_syscall_range(userptr_t addr, size_t length, vaddr_t *start_ret,
+		 vaddr_t *end_ret)
+{
+	vaddr_t start = (vaddr_t)addr;
+
+	if (start % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (start > USERSPACETOP || length > USERSPACETOP - start) {
+		return ENOMEM;
+	}
+	*start_ret = start;
+	*end_ret = ROUNDUP(start + length, PAGE_SIZE);
+	return 0;
+}
+
+/*
+ * mprotect: change the permissions of the pages in LENGTH bytes at
+ * ADDR, which must be page aligned, to PROT.
+ */
+int
+sys_mprotect(userptr_t addr, size_t length, int prot)
+{
+	struct addrspace *as;
+	vaddr_t start, end;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	if ((prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+	result = vm_syscall_range(addr, length, &start, &end);
+	if (result) {
+		return result;
+	}
+	if (start == end) {
+		return 0;
+	}
+	return as_mprotect(as, start, end, prot & PROT_READ, prot & PROT_WRITE);
+}
+
+/*
+ * madvise: say how the pages in LENGTH bytes at ADDR will be used; see
+ * <kern/mman.h>.
+ */
+int
+sys_madvise(userptr_t addr, size_t length, int advice)
+{
+	struct addrspace *as;
+	vaddr_t start, end;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	result = vm_syscall_range(addr, length, &start, &end);
+	if (result) {
+		return result;
+	}
+	return as_madvise(as, start, end, advice);
+}
+
+/*
+ * mincore: for each page in LENGTH bytes at ADDR, set a byte of VEC to
+ * 1 if it is in memory and 0 if not. A chunk at a time, so as not to
+ * hold the regions lock while copying out, which may fault.
+ */
+#define MINCORE_CHUNK 128
+
+int
+sys_mincore(userptr_t addr, size_t length, userptr_t vec)
+{
+	unsigned char buf[MINCORE_CHUNK];
+	struct addrspace *as;
+	vaddr_t start, end;
+	unsigned npages;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	result = vm_syscall_range(addr, length, &start, &end);
+	if (result) {
+		return result;
+	}
+
+	while (start < end) {
+		npages = (end - start) / PAGE_SIZE;
+		if (npages > MINCORE_CHUNK) {
+			npages = MINCORE_CHUNK;
+		}
+		result = as_mincore(as, start, npages, buf);
+		if (result) {
+			return result;
+		}
+		result = copyout(buf, vec, npages);
+		if (result) {
+			return result;
+		}
+		start += npages * PAGE_SIZE;
+		vec += npages;
+	}
+	return 0;
+}
+
+/*
+ * mlock/munlock: pin the pages in LENGTH bytes at ADDR in memory, or
+ * let them be paged out again.
+ */
+int
+sys_mlock(userptr_t addr, size_t length, bool lock)
+{
+	struct addrspace *as;
+	vaddr_t start, end;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	result = vm_syscall_range(addr, length, &start, &end);
+	if (result) {
+		return result;
+	}
+	return as_mlock(as, start, end, lock);
+}
+
+/*
+ * vmstat: copy out the VM event counters of CPU, or their totals over
+ * all CPUs if CPU is -1.
+ */
+int
+sys_vmstat(int cpu, userptr_t buf)
+{
+	struct vmstat stats;
+	int result;
+
+	result = vm_getstats(cpu, &stats);
+	if (result) {
+		return result;
+	}
+
+	return copyout(&stats, buf, sizeof(stats));
+}
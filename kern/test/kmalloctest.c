@@ -35,6 +35,8 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <cpu.h>
+#include <clock.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
 
@@ -379,3 +381,259 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5/km6/km7
+
+/*
+ * kmalloc benchmarks. For each size, allocate KMB_BATCH blocks and
+ * then free them, KMB_ROUNDS times over (or as many as the argument
+ * says), and report the allocations plus frees per second. km5 runs
+ * in the menu thread; km6 runs one thread on each CPU at once, each
+ * pinned there, and reports the total, so per-CPU caching shows up
+ * as the rate growing with the number of CPUs.
+ *
+ * km7 churns through KMF_ITERS allocations of mixed sizes, keeping
+ * KMF_LIVE of them at a time, and reports how much of the memory the
+ * heap holds for small blocks is in use, then again after freeing
+ * every other one.
+ */
+
+#define KMB_BATCH  64
+#define KMB_ROUNDS 500
+#define KMF_LIVE   512
+#define KMF_ITERS  20000
+
+static const size_t kmb_sizes[] = {
+	16, 32, 64, 128, 256, 512, 1024, 2000, PAGE_SIZE,
+};
+#define KMB_NSIZES (sizeof(kmb_sizes) / sizeof(kmb_sizes[0]))
+
+static struct semaphore *kmb_ready, *kmb_go, *kmb_done;
+static unsigned kmb_rounds;
+
+/*
+ * Allocate and free KMB_BATCH blocks of SIZE kmb_rounds times.
+ */
+static
+void
+kmb_run(size_t size)
+{
+	void *ptrs[KMB_BATCH];
+	unsigned r, i;
+
+	for (r=0; r<kmb_rounds; r++) {
+		for (i=0; i<KMB_BATCH; i++) {
+			ptrs[i] = kmalloc(size);
+			if (ptrs[i] == NULL) {
+				panic("kmallocbench: kmalloc(%zu) failed\n",
+				      size);
+			}
+		}
+		for (i=0; i<KMB_BATCH; i++) {
+			kfree(ptrs[i]);
+		}
+	}
+}
+
+/*
+ * Print the rate for OPS operations in the time since BEFORE.
+ */
+static
+void
+kmb_report(size_t size, uint64_t ops, const struct timespec *before)
+{
+	struct timespec after;
+	uint64_t ns;
+
+	gettime(&after);
+	timespec_sub(&after, before, &after);
+	ns = (uint64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("  %4zu bytes: %9llu ops/sec, %6llu ns/op\n", size,
+		(unsigned long long)(ops * 1000000000 / ns),
+		(unsigned long long)(ns / ops));
+}
+
+static
+int
+kmb_getrounds(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: %s [rounds]\n", args[0]);
+		return EINVAL;
+	}
+	kmb_rounds = nargs == 2 ? (unsigned)atoi(args[1]) : KMB_ROUNDS;
+	if (kmb_rounds == 0) {
+		kmb_rounds = 1;
+	}
+	return 0;
+}
+
+int
+kmallocbench(int nargs, char **args)
+{
+	struct timespec before;
+	unsigned i;
+
+	if (kmb_getrounds(nargs, args)) {
+		return EINVAL;
+	}
+
+	kprintf("kmalloc benchmark, 1 thread, %u x %u per size:\n",
+		kmb_rounds, KMB_BATCH);
+	for (i=0; i<KMB_NSIZES; i++) {
+		gettime(&before);
+		kmb_run(kmb_sizes[i]);
+		kmb_report(kmb_sizes[i],
+			   (uint64_t)2 * kmb_rounds * KMB_BATCH, &before);
+	}
+	kprintf("kmalloc benchmark done\n");
+	return 0;
+}
+
+static
+void
+kmb_thread(void *junk, unsigned long cpunum)
+{
+	uint32_t oldmask;
+	unsigned i;
+
+	(void)junk;
+
+	if (thread_setaffinity((uint32_t)1 << cpunum, &oldmask)) {
+		panic("kmallocbench: can't move to cpu%lu\n", cpunum);
+	}
+	for (i=0; i<KMB_NSIZES; i++) {
+		V(kmb_ready);
+		P(kmb_go);
+		kmb_run(kmb_sizes[i]);
+		V(kmb_done);
+	}
+}
+
+int
+kmallocbench_mp(int nargs, char **args)
+{
+	struct timespec before;
+	unsigned ncpus, i, j;
+	int result;
+
+	if (kmb_getrounds(nargs, args)) {
+		return EINVAL;
+	}
+
+	for (ncpus=0; cpu_bynumber(ncpus) != NULL; ncpus++) {
+		/* count them */
+	}
+
+	kmb_ready = sem_create("kmb_ready", 0);
+	kmb_go = sem_create("kmb_go", 0);
+	kmb_done = sem_create("kmb_done", 0);
+	if (kmb_ready == NULL || kmb_go == NULL || kmb_done == NULL) {
+		panic("kmallocbench: sem_create failed\n");
+	}
+
+	kprintf("kmalloc benchmark, %u threads, %u x %u per size each:\n",
+		ncpus, kmb_rounds, KMB_BATCH);
+	for (i=0; i<ncpus; i++) {
+		result = thread_fork("kmallocbench", NULL, kmb_thread,
+				     NULL, i);
+		if (result) {
+			panic("kmallocbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<KMB_NSIZES; i++) {
+		for (j=0; j<ncpus; j++) {
+			P(kmb_ready);
+		}
+		gettime(&before);
+		for (j=0; j<ncpus; j++) {
+			V(kmb_go);
+		}
+		for (j=0; j<ncpus; j++) {
+			P(kmb_done);
+		}
+		kmb_report(kmb_sizes[i],
+			   (uint64_t)2 * kmb_rounds * KMB_BATCH * ncpus,
+			   &before);
+	}
+
+	sem_destroy(kmb_ready);
+	sem_destroy(kmb_go);
+	sem_destroy(kmb_done);
+	kprintf("kmalloc benchmark done\n");
+	return 0;
+}
+
+/*
+ * Print the small-block footprint, less what was there at the start.
+ */
+static
+void
+kmf_report(const char *when, size_t used0, size_t held0)
+{
+	size_t used, held;
+
+	kheap_usage(&used, &held);
+	used = used > used0 ? used - used0 : 0;
+	held = held > held0 ? held - held0 : 0;
+	kprintf("  %s: %zu bytes in use in %zu bytes of pages (%u%%)\n",
+		when, used, held,
+		held == 0 ? 100 : (unsigned)((uint64_t)used * 100 / held));
+}
+
+int
+kmallocfrag(int nargs, char **args)
+{
+	void **ptrs;
+	size_t used0, held0, size;
+	unsigned i, slot;
+
+	(void)nargs;
+	(void)args;
+
+	ptrs = kmalloc(KMF_LIVE * sizeof(ptrs[0]));
+	if (ptrs == NULL) {
+		kprintf("kmallocfrag: out of memory\n");
+		return ENOMEM;
+	}
+	for (i=0; i<KMF_LIVE; i++) {
+		ptrs[i] = NULL;
+	}
+	kheap_usage(&used0, &held0);
+
+	kprintf("kmalloc fragmentation test, %u allocations, %u live:\n",
+		KMF_ITERS, KMF_LIVE);
+	for (i=0; i<KMF_ITERS; i++) {
+		slot = prandom() % KMF_LIVE;
+		if (ptrs[slot] != NULL) {
+			kfree(ptrs[slot]);
+		}
+		/* skewed toward small sizes, as most allocations are */
+		size = 8 + prandom() % (16 << (prandom() % 8));
+		ptrs[slot] = kmalloc(size);
+		if (ptrs[slot] == NULL) {
+			panic("kmallocfrag: kmalloc(%zu) failed\n", size);
+		}
+	}
+	kmf_report("after churn", used0, held0);
+
+	for (i=0; i<KMF_LIVE; i+=2) {
+		kfree(ptrs[i]);
+		ptrs[i] = NULL;
+	}
+	kmf_report("half freed ", used0, held0);
+
+	for (i=1; i<KMF_LIVE; i+=2) {
+		kfree(ptrs[i]);
+	}
+	kfree(ptrs);
+	kmf_report("all freed  ", used0, held0);
+	kprintf("kmalloc fragmentation test done\n");
+	return 0;
+}
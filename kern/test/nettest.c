@@ -28,17 +28,63 @@
  */
 
 /*
- * Network test code.
+ * Network test code: send a few broadcast packets out of lnet0.
  */
 #include <types.h>
+#include <kern/fcntl.h>
+#include <kern/lnet.h>
 #include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
 #include <test.h>
 
+#define NETTEST_PACKETS	5
+#define NETTEST_SLOGAN	"lnet test packet"
+
 int
 nettest(int nargs, char **args)
 {
+	struct {
+		struct lnet_linkheader hdr;
+		char data[64];
+	} pkt;
+	char name[16];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	size_t len;
+	int i, result;
+
 	(void)nargs;
 	(void)args;
-	kprintf("No network support available\n");
-	return 1;
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(name, "lnet0:");
+	result = vfs_open(name, O_WRONLY, 0, &vn);
+	if (result) {
+		kprintf("nettest: lnet0: %s\n", strerror(result));
+		kprintf("No network support available\n");
+		return result;
+	}
+
+	for (i=0; i<NETTEST_PACKETS; i++) {
+		/* the driver fills in the frame word, sender, and length */
+		bzero(&pkt, sizeof(pkt));
+		pkt.hdr.lh_to = LNET_BROADCAST;
+		snprintf(pkt.data, sizeof(pkt.data), "%s %d", NETTEST_SLOGAN, i);
+		len = sizeof(pkt.hdr) + strlen(pkt.data) + 1;
+
+		uio_kinit(&iov, &ku, &pkt, len, 0, UIO_WRITE);
+		result = VOP_WRITE(vn, &ku);
+		if (result) {
+			kprintf("nettest: send %d: %s\n", i, strerror(result));
+			vfs_close(vn);
+			return result;
+		}
+	}
+
+	vfs_close(vn);
+	kprintf("nettest: sent %d packets\n", NETTEST_PACKETS);
+	return 0;
 }
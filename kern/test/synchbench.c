@@ -0,0 +1,359 @@
+/*
+ * Benchmarks for the synchronization primitives, reporting cycles per
+ * operation. These measure rather than check; synchtest.c and
+ * semunit.c do the checking.
+ *
+ * sb1 times lock_acquire/lock_release with one thread, then with one
+ * thread on each of 2, 3, ... CPUs all using the same lock. sb2 bounces
+ * a turn between two threads with a CV, and sb3 with a pair of
+ * semaphores, first with both threads on one CPU and then (given a
+ * second CPU) on two. sb4 is sb1 for a spinlock.
+ *
+ * Times come from the real-time clock and are converted to cycles, as
+ * for ktime, since the cycle counter differs between CPUs.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <test.h>
+#include <platform/cpufreq.h>
+
+#define SB_ITERS	10000	/* per thread, for sb1 and sb4 */
+#define SB_ROUNDS	2000	/* round trips, for sb2 and sb3 */
+
+static struct semaphore *sb_ready, *sb_go, *sb_done;
+static struct lock *sb_lock;
+static struct spinlock sb_spinlock = SPINLOCK_INITIALIZER;
+static struct cv *sb_cv;
+static struct semaphore *sb_ping, *sb_pong;
+static volatile unsigned sb_turn;
+
+/*
+ * Count the CPUs.
+ */
+static
+unsigned
+sb_ncpus(void)
+{
+	unsigned n;
+
+	for (n=0; cpu_bynumber(n) != NULL; n++) {
+		/* nothing */
+	}
+	return n;
+}
+
+/*
+ * Turn the time since BEFORE into cycles.
+ */
+static
+uint64_t
+sb_cycles(const struct timespec *before)
+{
+	struct timespec after;
+
+	gettime(&after);
+	timespec_sub(&after, before, &after);
+	return ((uint64_t)after.tv_sec * 1000000000 + after.tv_nsec)
+		* (CPU_FREQUENCY / 1000000) / 1000;
+}
+
+static
+void
+sb_setup(void)
+{
+	sb_ready = sem_create("sb_ready", 0);
+	sb_go = sem_create("sb_go", 0);
+	sb_done = sem_create("sb_done", 0);
+	sb_lock = lock_create("sb_lock");
+	sb_cv = cv_create("sb_cv");
+	sb_ping = sem_create("sb_ping", 0);
+	sb_pong = sem_create("sb_pong", 0);
+	if (sb_ready == NULL || sb_go == NULL || sb_done == NULL ||
+	    sb_lock == NULL || sb_cv == NULL || sb_ping == NULL ||
+	    sb_pong == NULL) {
+		panic("synchbench: out of memory\n");
+	}
+}
+
+static
+void
+sb_cleanup(void)
+{
+	sem_destroy(sb_ready);
+	sem_destroy(sb_go);
+	sem_destroy(sb_done);
+	lock_destroy(sb_lock);
+	cv_destroy(sb_cv);
+	sem_destroy(sb_ping);
+	sem_destroy(sb_pong);
+}
+
+/*
+ * What sb_run's threads are to do.
+ */
+struct sb_job {
+	void (*func)(unsigned long arg);
+	unsigned long arg;
+};
+
+/*
+ * Thread body for sb_run: move to CPU CPUNUM, wait for the start, do
+ * the work, and say so.
+ */
+static
+void
+sb_thread(void *jobp, unsigned long cpunum)
+{
+	struct sb_job *job = jobp;
+	uint32_t oldmask;
+
+	if (thread_setaffinity((uint32_t)1 << cpunum, &oldmask)) {
+		panic("synchbench: can't move to cpu%lu\n", cpunum);
+	}
+	V(sb_ready);
+	P(sb_go);
+	job->func(job->arg);
+	V(sb_done);
+}
+
+/*
+ * Run FUNC(ARG) in NTHREADS threads at once, the Ith on CPU CPUS[I],
+ * and return the cycles from the start until the last one finished.
+ */
+static
+uint64_t
+sb_run(unsigned nthreads, const unsigned *cpus,
+       void (*func)(unsigned long), unsigned long arg)
+{
+	struct sb_job job = { func, arg };
+	struct timespec before;
+	unsigned i;
+	int result;
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("synchbench", NULL, sb_thread, &job,
+				     cpus[i]);
+		if (result) {
+			panic("synchbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sb_ready);
+	}
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		V(sb_go);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sb_done);
+	}
+	return sb_cycles(&before);
+}
+
+/*
+ * Run FUNC on 1, 2, ... CPUs, one thread each, printing the cycles
+ * per operation for SB_ITERS operations per thread.
+ */
+static
+void
+sb_scale(const char *what, void (*func)(unsigned long))
+{
+	unsigned cpus[32];
+	unsigned ncpus, n;
+	uint64_t cycles;
+
+	ncpus = sb_ncpus();
+	if (ncpus > 32) {
+		ncpus = 32;
+	}
+	for (n=0; n<ncpus; n++) {
+		cpus[n] = n;
+	}
+
+	kprintf("%s, %u per thread:\n", what, SB_ITERS);
+	for (n=1; n<=ncpus; n++) {
+		cycles = sb_run(n, cpus, func, SB_ITERS);
+		kprintf("  %2u CPU%s: %6llu cycles/op\n", n, n == 1 ? " " : "s",
+			(unsigned long long)(cycles / ((uint64_t)n * SB_ITERS)));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// sb1: locks
+
+static
+void
+sb_lockloop(unsigned long iters)
+{
+	unsigned long i;
+
+	for (i=0; i<iters; i++) {
+		lock_acquire(sb_lock);
+		lock_release(sb_lock);
+	}
+}
+
+int
+synchbench_lock(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sb_setup();
+	sb_scale("lock_acquire + lock_release", sb_lockloop);
+	sb_cleanup();
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// sb2, sb3: handoffs
+
+/*
+ * CV ping-pong: thread WHO waits for its turn, then hands the turn
+ * to the other.
+ */
+static
+void
+sb_cvloop(unsigned long who)
+{
+	unsigned i;
+
+	lock_acquire(sb_lock);
+	for (i=0; i<SB_ROUNDS; i++) {
+		while (sb_turn != who) {
+			cv_wait(sb_cv, sb_lock);
+		}
+		sb_turn = !who;
+		cv_signal(sb_cv, sb_lock);
+	}
+	lock_release(sb_lock);
+}
+
+/*
+ * Semaphore handoff: thread 0 Vs ping and Ps pong, thread 1 the
+ * other way round.
+ */
+static
+void
+sb_semloop(unsigned long who)
+{
+	unsigned i;
+
+	for (i=0; i<SB_ROUNDS; i++) {
+		if (who == 0) {
+			V(sb_ping);
+			P(sb_pong);
+		}
+		else {
+			P(sb_ping);
+			V(sb_pong);
+		}
+	}
+}
+
+/*
+ * Thread body for sb_pair: the two sides number themselves 0 and 1
+ * in the order they get going.
+ */
+static void (*sb_pairfunc)(unsigned long);
+static unsigned sb_pairnext;
+
+static
+void
+sb_pairside(unsigned long junk)
+{
+	unsigned long who;
+
+	(void)junk;
+
+	lock_acquire(sb_lock);
+	who = sb_pairnext++;
+	lock_release(sb_lock);
+	sb_pairfunc(who);
+}
+
+/*
+ * Time FUNC run by a pair of threads on the same CPU, and then on two.
+ */
+static
+void
+sb_pair(const char *what, void (*func)(unsigned long))
+{
+	static const unsigned samecpu[2] = { 0, 0 };
+	static const unsigned twocpus[2] = { 0, 1 };
+	uint64_t cycles;
+
+	sb_pairfunc = func;
+	kprintf("%s, %u round trips:\n", what, SB_ROUNDS);
+
+	sb_turn = 0;
+	sb_pairnext = 0;
+	cycles = sb_run(2, samecpu, sb_pairside, 0);
+	kprintf("  same CPU:  %6llu cycles/round trip\n",
+		(unsigned long long)(cycles / SB_ROUNDS));
+
+	if (sb_ncpus() > 1) {
+		sb_turn = 0;
+		sb_pairnext = 0;
+		cycles = sb_run(2, twocpus, sb_pairside, 0);
+		kprintf("  two CPUs:  %6llu cycles/round trip\n",
+			(unsigned long long)(cycles / SB_ROUNDS));
+	}
+}
+
+int
+synchbench_cv(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sb_setup();
+	sb_pair("CV ping-pong", sb_cvloop);
+	sb_cleanup();
+	return 0;
+}
+
+int
+synchbench_sem(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sb_setup();
+	sb_pair("Semaphore handoff", sb_semloop);
+	sb_cleanup();
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// sb4: spinlocks
+
+static
+void
+sb_spinloop(unsigned long iters)
+{
+	unsigned long i;
+
+	for (i=0; i<iters; i++) {
+		spinlock_acquire(&sb_spinlock);
+		spinlock_release(&sb_spinlock);
+	}
+}
+
+int
+synchbench_spinlock(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sb_setup();
+	sb_scale("spinlock_acquire + spinlock_release", sb_spinloop);
+	sb_cleanup();
+	return 0;
+}
@@ -30,17 +30,24 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
+#include <prof.h>
+#include <kinfo.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Each CPU's on-chip timer is run one-shot: clock_interrupt works out
+ * when the next thing is due on that CPU, either the next hardclock
+ * tick or the soonest of the CPU's one-shot timers, and asks for an
+ * interrupt then. This gives timed sleeps better than tick resolution,
+ * and lets an idle CPU stop ticking altogether ("tickless idle") and
+ * wake only for its timers or for an interrupt.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -50,14 +57,25 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	100	/* Boost priorities every second. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
+#define TICK_NSECS		(1000000000 / HZ)
+#define TICKLESS_MAX_NSECS	1000000000	/* Longest idle sleep. */
+
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * One-shot timers (see clock.h), for threads in clocknanosleep and
+ * for clocktimer_start. A timer lives on the c_timers list of the CPU
+ * it was started on, soonest first, and that CPU's interrupt handler
+ * fires it when the time comes; the lists are protected by
+ * clocktimer_lock. A thread in clocknanosleep waits on
+ * clocktimer_wchan with its timer as its waiter class.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+static struct wchan *clocktimer_wchan;
+static struct spinlock clocktimer_lock;
+
+/* Set once there's a clock to read; until then, just tick. */
+static bool clock_started;
 
 /*
  * Setup.
@@ -65,36 +83,217 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	spinlock_init(&clocktimer_lock);
+	clocktimer_wchan = wchan_create("clocksleep");
+	if (clocktimer_wchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
 	}
 }
 
 /*
- * This is called once per second, on one processor, by the timer
- * code.
+ * Called once the devices are attached, so gettime works, to switch
+ * from plain periodic ticks to programmed ones.
  */
 void
-timerclock(void)
+hardclock_start(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
+	clock_started = true;
 }
 
 /*
- * This is called HZ times a second (on each processor) by the timer
- * code.
+ * Like gettime, but may be called before the clock is attached, in
+ * which case the time reads as zero. For accounting.
  */
 void
-hardclock(void)
+clock_now(struct timespec *ret)
+{
+	if (!clock_started) {
+		ret->tv_sec = 0;
+		ret->tv_nsec = 0;
+		return;
+	}
+	gettime(ret);
+}
+
+/*
+ * Compare two times, returning <0, 0, or >0, like strcmp.
+ */
+static
+int
+timespec_cmp(const struct timespec *t1, const struct timespec *t2)
+{
+	if (t1->tv_sec != t2->tv_sec) {
+		return t1->tv_sec < t2->tv_sec ? -1 : 1;
+	}
+	return t1->tv_nsec - t2->tv_nsec;
+}
+
+/*
+ * Nanoseconds from NOW until WHEN (0 if it has passed), capped at MAX.
+ */
+static
+uint32_t
+timespec_until(const struct timespec *now, const struct timespec *when,
+	       uint32_t max)
+{
+	struct timespec diff;
+
+	if (timespec_cmp(when, now) <= 0) {
+		return 0;
+	}
+	timespec_sub(when, now, &diff);
+	if (diff.tv_sec >= (time_t)(max / 1000000000)) {
+		if ((uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec > max) {
+			return max;
+		}
+	}
+	return diff.tv_sec * 1000000000 + diff.tv_nsec;
+}
+
+/*
+ * Program this CPU's timer for whatever is due next.
+ */
+static
+void
+clock_program(const struct timespec *now)
+{
+	uint32_t nsecs;
+
+	if (curcpu->c_tickless) {
+		nsecs = TICKLESS_MAX_NSECS;
+	}
+	else {
+		nsecs = timespec_until(now, &curcpu->c_nexttick, TICK_NSECS);
+	}
+	if (curcpu->c_timers != NULL) {
+		nsecs = timespec_until(now, &curcpu->c_timers->ct_when, nsecs);
+	}
+	mainbus_timer_set(nsecs);
+}
+
+/*
+ * Wake the sleepers whose timers have gone off.
+ */
+static
+void
+clocktimer_expire(const struct timespec *now)
+{
+	struct clocktimer *ct;
+
+	if (curcpu->c_timers == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&clocktimer_lock);
+	while ((ct = curcpu->c_timers) != NULL &&
+	       timespec_cmp(&ct->ct_when, now) <= 0) {
+		curcpu->c_timers = ct->ct_next;
+		ct->ct_done = true;
+		if (ct->ct_func != NULL) {
+			ct->ct_func(ct->ct_data);
+		}
+		else {
+			wchan_wakeclass(clocktimer_wchan, &clocktimer_lock,
+					(uintptr_t)ct);
+		}
+	}
+	spinlock_release(&clocktimer_lock);
+}
+
+/*
+ * This is called by the MD code on every timer interrupt, with
+ * interrupts off. Fire any timers that are due, call hardclock if a
+ * tick is due, and set up the next interrupt.
+ */
+void
+clock_interrupt(void)
 {
+	struct timespec now, tick;
+	bool ticked;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	if (!clock_started) {
+		/* The MD code has already asked for the next tick. */
+		hardclock();
+		return;
+	}
+
+	gettime(&now);
+	clocktimer_expire(&now);
+
+	ticked = false;
+	if (!curcpu->c_tickless &&
+	    timespec_cmp(&now, &curcpu->c_nexttick) >= 0) {
+		tick.tv_sec = 0;
+		tick.tv_nsec = TICK_NSECS;
+		timespec_add(&curcpu->c_nexttick, &tick,
+			     &curcpu->c_nexttick);
+		if (timespec_cmp(&curcpu->c_nexttick, &now) <= 0) {
+			/* we fell behind; don't try to catch up */
+			timespec_add(&now, &tick, &curcpu->c_nexttick);
+		}
+		ticked = true;
+	}
+
 	/*
-	 * Collect statistics here as desired.
+	 * Program the next interrupt before calling hardclock, since
+	 * hardclock may switch to another thread.
 	 */
+	clock_program(&now);
+
+	if (ticked) {
+		hardclock();
+	}
+}
+
+/*
+ * Called from the idle loop, with interrupts off, as the CPU goes
+ * idle (IDLE true) and once it has a thread to run again: an idle
+ * CPU has no use for hardclock, so stop ticking until then. Only
+ * the one-shot timers, if any, wake it meanwhile.
+ */
+void
+clock_idle(bool idle)
+{
+	struct timespec now, tick;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	if (!clock_started || curcpu->c_tickless == idle) {
+		return;
+	}
+
+	gettime(&now);
+	curcpu->c_tickless = idle;
+	if (!idle) {
+		/* Start ticking again a tick from now. */
+		tick.tv_sec = 0;
+		tick.tv_nsec = TICK_NSECS;
+		timespec_add(&now, &tick, &curcpu->c_nexttick);
+	}
+	clock_program(&now);
+}
+
+/*
+ * This is called once a second, on one processor, by the timer
+ * code. Timed sleeps don't depend on it any more, so there's nothing
+ * to do.
+ */
+void
+timerclock(void)
+{
+}
+
+/*
+ * This is called HZ times a second (on each processor that isn't
+ * idle) by the timer code.
+ */
+void
+hardclock(void)
+{
+	prof_hardclock();
+	kinfo_hardclock();
 
 	curcpu->c_hardclocks++;
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
@@ -103,7 +302,104 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	thread_timeslice();
+}
+
+/*
+ * Put CT on this CPU's list, which must be locked, to go off TS from
+ * now.
+ */
+static
+void
+clocktimer_insert(struct clocktimer *ct, const struct timespec *ts)
+{
+	struct clocktimer **p;
+	struct timespec now;
+
+	KASSERT(spinlock_do_i_hold(&clocktimer_lock));
+
+	gettime(&now);
+	timespec_add(&now, ts, &ct->ct_when);
+	ct->ct_done = false;
+	ct->ct_cpu = curcpu;
+
+	for (p = &curcpu->c_timers; *p != NULL; p = &(*p)->ct_next) {
+		if (timespec_cmp(&ct->ct_when, &(*p)->ct_when) < 0) {
+			break;
+		}
+	}
+	ct->ct_next = *p;
+	*p = ct;
+	if (p == &curcpu->c_timers) {
+		/* we're first; the interrupt may need to come sooner */
+		clock_program(&now);
+	}
+}
+
+/*
+ * Suspend execution for the time in TS.
+ */
+void
+clocknanosleep(const struct timespec *ts)
+{
+	struct clocktimer ct;
+
+	KASSERT(clock_started);
+
+	ct.ct_func = NULL;
+	ct.ct_data = NULL;
+
+	/*
+	 * Holding the spinlock keeps interrupts off, so we stay on
+	 * this CPU until we're on its list and asleep.
+	 */
+	spinlock_acquire(&clocktimer_lock);
+	clocktimer_insert(&ct, ts);
+	while (!ct.ct_done) {
+		wchan_sleep_class(clocktimer_wchan, &clocktimer_lock,
+				  (uintptr_t)&ct);
+	}
+	spinlock_release(&clocktimer_lock);
+}
+
+/*
+ * Start a timer to call FUNC(DATA) when TS has passed.
+ */
+void
+clocktimer_start(struct clocktimer *ct, const struct timespec *ts,
+		 void (*func)(void *), void *data)
+{
+	KASSERT(clock_started);
+	KASSERT(func != NULL);
+
+	ct->ct_func = func;
+	ct->ct_data = data;
+
+	spinlock_acquire(&clocktimer_lock);
+	clocktimer_insert(ct, ts);
+	spinlock_release(&clocktimer_lock);
+}
+
+/*
+ * Cancel a timer, if it hasn't gone off. It may be on another CPU's
+ * list by now, if we've moved; that's fine, as the lists are all
+ * under the one lock. If it was first there, that CPU's interrupt
+ * comes for nothing and is reprogrammed.
+ */
+void
+clocktimer_stop(struct clocktimer *ct)
+{
+	struct clocktimer **p;
+
+	spinlock_acquire(&clocktimer_lock);
+	if (!ct->ct_done) {
+		for (p = &ct->ct_cpu->c_timers; *p != ct; p = &(*p)->ct_next) {
+			KASSERT(*p != NULL);
+		}
+		*p = ct->ct_next;
+		ct->ct_done = true;
+	}
+	spinlock_release(&clocktimer_lock);
 }
 
 /*
@@ -112,10 +408,12 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	struct timespec ts;
+
+	if (num_secs <= 0) {
+		return;
 	}
-	spinlock_release(&lbolt_lock);
+	ts.tv_sec = num_secs;
+	ts.tv_nsec = 0;
+	clocknanosleep(&ts);
 }
@@ -0,0 +1,120 @@
+/*
+ * Kernel region timing; see <ktime.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <platform/cpufreq.h>
+#include <platform/maxcpus.h>
+#include <ktime.h>
+
+/*
+ * Bucket N of the histogram counts times of 2^(N-1) to 2^N - 1
+ * cycles, bucket 0 times too short to see.
+ */
+#define KTIME_NBUCKETS 33
+
+struct ktime_stats {
+	unsigned kt_count;
+	uint64_t kt_cycles;
+	uint32_t kt_max;
+	unsigned kt_buckets[KTIME_NBUCKETS];
+};
+
+/*
+ * Counts for each CPU, updated by only that CPU (the one a region
+ * ends on) with interrupts off, as in sysstat.c.
+ */
+static struct ktime_stats ktime_stats[MAXCPUS][KTIME_NTAGS];
+
+void
+ktime_begin(unsigned tag)
+{
+	KASSERT(tag < KTIME_NTAGS);
+	clock_now(&curthread->t_ktime[tag]);
+}
+
+void
+ktime_end(unsigned tag)
+{
+	struct ktime_stats *kt;
+	struct timespec now, diff;
+	uint64_t nsecs;
+	uint32_t cycles;
+	unsigned bucket;
+	int spl;
+
+	KASSERT(tag < KTIME_NTAGS);
+	clock_now(&now);
+	timespec_sub(&now, &curthread->t_ktime[tag], &diff);
+	nsecs = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+	cycles = nsecs * (CPU_FREQUENCY / 1000000) / 1000;
+
+	for (bucket = 0; bucket < KTIME_NBUCKETS - 1 &&
+		     (cycles >> bucket) != 0; bucket++) {
+		/* nothing */
+	}
+
+	spl = splhigh();
+	kt = &ktime_stats[curcpu->c_number][tag];
+	kt->kt_count++;
+	kt->kt_cycles += cycles;
+	if (cycles > kt->kt_max) {
+		kt->kt_max = cycles;
+	}
+	kt->kt_buckets[bucket]++;
+	splx(spl);
+}
+
+/*
+ * A region under way on some CPU may still get counted just after
+ * this.
+ */
+void
+ktime_reset(void)
+{
+	bzero(ktime_stats, sizeof(ktime_stats));
+}
+
+void
+ktime_print(void)
+{
+	static const char *const names[KTIME_NTAGS] = KTIME_NAMES;
+	struct ktime_stats total;
+	unsigned cpu, tag, b;
+
+	for (tag=0; tag<KTIME_NTAGS; tag++) {
+		bzero(&total, sizeof(total));
+		for (cpu=0; cpu<MAXCPUS; cpu++) {
+			const struct ktime_stats *kt = &ktime_stats[cpu][tag];
+
+			total.kt_count += kt->kt_count;
+			total.kt_cycles += kt->kt_cycles;
+			if (kt->kt_max > total.kt_max) {
+				total.kt_max = kt->kt_max;
+			}
+			for (b=0; b<KTIME_NBUCKETS; b++) {
+				total.kt_buckets[b] += kt->kt_buckets[b];
+			}
+		}
+		if (total.kt_count == 0) {
+			continue;
+		}
+
+		kprintf("%s: %u times, %llu cycles average, %u max\n",
+			names[tag], total.kt_count,
+			total.kt_cycles / total.kt_count, total.kt_max);
+		for (b=0; b<KTIME_NBUCKETS; b++) {
+			if (total.kt_buckets[b] == 0) {
+				continue;
+			}
+			kprintf("  < %10llu cycles: %u\n",
+				(uint64_t)1 << b, total.kt_buckets[b]);
+		}
+	}
+}
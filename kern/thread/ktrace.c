@@ -0,0 +1,307 @@
+/*
+ * Kernel event tracing; see <ktrace.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <ktrace.h>
+
+/*
+ * Each CPU has a ring of KTRACE_NEVENTS events; kr_head counts every
+ * event ever put in it, and the next goes at kr_head % KTRACE_NEVENTS,
+ * so the ring holds the last min(kr_head, KTRACE_NEVENTS). Only the
+ * CPU itself writes to its ring, with interrupts off, so recording
+ * takes no lock. As with the profiler the rings are allocated by the
+ * first ktrace_start and never freed, so an event recorded just as
+ * tracing is turned on or off can't land anywhere it shouldn't.
+ *
+ * ktrace_lock only serializes installing the rings.
+ */
+#define KTRACE_NEVENTS 1024	/* must be a power of 2 */
+
+struct ktrace_event {
+	uint32_t ke_sec;
+	uint32_t ke_nsec;
+	uint16_t ke_type;
+	uint16_t ke_cpu;
+	uint32_t ke_thread;
+	uint32_t ke_a;
+	uint32_t ke_b;
+};
+
+struct ktrace_ring {
+	struct ktrace_event *kr_events;
+	unsigned kr_head;
+};
+
+static struct spinlock ktrace_lock = SPINLOCK_INITIALIZER;
+static struct ktrace_ring ktrace_rings[MAXCPUS];
+static volatile bool ktrace_on;
+
+void
+ktrace_record(unsigned type, uint32_t a, uint32_t b)
+{
+	struct ktrace_ring *r;
+	struct ktrace_event *e;
+	struct timespec now;
+	int spl;
+
+	if (!ktrace_on) {
+		return;
+	}
+
+	spl = splhigh();
+	r = &ktrace_rings[curcpu->c_number];
+	if (r->kr_events != NULL) {
+		clock_now(&now);
+		e = &r->kr_events[r->kr_head % KTRACE_NEVENTS];
+		r->kr_head++;
+		e->ke_sec = now.tv_sec;
+		e->ke_nsec = now.tv_nsec;
+		e->ke_type = type;
+		e->ke_cpu = curcpu->c_number;
+		e->ke_thread = (uint32_t)(uintptr_t)curthread;
+		e->ke_a = a;
+		e->ke_b = b;
+	}
+	splx(spl);
+}
+
+int
+ktrace_start(void)
+{
+	struct ktrace_ring *r;
+	struct ktrace_event *events;
+	unsigned i;
+
+	COMPILE_ASSERT((KTRACE_NEVENTS & (KTRACE_NEVENTS - 1)) == 0);
+
+	ktrace_on = false;
+	for (i=0; cpu_bynumber(i) != NULL; i++) {
+		r = &ktrace_rings[i];
+		if (r->kr_events == NULL) {
+			events = kmalloc(KTRACE_NEVENTS * sizeof(*events));
+			if (events == NULL) {
+				return ENOMEM;
+			}
+			spinlock_acquire(&ktrace_lock);
+			if (r->kr_events == NULL) {
+				r->kr_events = events;
+				events = NULL;
+			}
+			spinlock_release(&ktrace_lock);
+			if (events != NULL) {
+				kfree(events);
+			}
+		}
+		r->kr_head = 0;
+	}
+	ktrace_on = true;
+	return 0;
+}
+
+void
+ktrace_stop(void)
+{
+	ktrace_on = false;
+}
+
+////////////////////////////////////////////////////////////
+// Decoding
+
+/*
+ * Things started whose end hasn't been seen yet, so as to print how
+ * long each took: system calls and faults, by thread, and disk
+ * requests, by request. If there are too many the oldest is forgotten.
+ */
+#define KTRACE_OPEN 64
+
+struct ktrace_open {
+	unsigned ko_type;		/* 0 if the slot is free */
+	uint32_t ko_key;
+	const struct ktrace_event *ko_start;
+};
+
+static struct ktrace_open ktrace_open[KTRACE_OPEN];
+static unsigned ktrace_nextopen;
+
+static
+void
+ktrace_begin(unsigned type, uint32_t key, const struct ktrace_event *e)
+{
+	unsigned i;
+
+	for (i=0; i<KTRACE_OPEN; i++) {
+		if (ktrace_open[i].ko_type == type &&
+		    ktrace_open[i].ko_key == key) {
+			break;
+		}
+	}
+	if (i == KTRACE_OPEN) {
+		for (i=0; i<KTRACE_OPEN; i++) {
+			if (ktrace_open[i].ko_type == 0) {
+				break;
+			}
+		}
+	}
+	if (i == KTRACE_OPEN) {
+		i = ktrace_nextopen;
+		ktrace_nextopen = (ktrace_nextopen + 1) % KTRACE_OPEN;
+	}
+	ktrace_open[i].ko_type = type;
+	ktrace_open[i].ko_key = key;
+	ktrace_open[i].ko_start = e;
+}
+
+/*
+ * Microseconds from the matching start event to E, or KTRACE_UNKNOWN
+ * (printed as "?") if it isn't known.
+ */
+#define KTRACE_UNKNOWN 0xffffffff
+
+static
+uint32_t
+ktrace_end(unsigned type, uint32_t key, const struct ktrace_event *e)
+{
+	const struct ktrace_event *s;
+	unsigned i;
+
+	for (i=0; i<KTRACE_OPEN; i++) {
+		if (ktrace_open[i].ko_type == type &&
+		    ktrace_open[i].ko_key == key) {
+			ktrace_open[i].ko_type = 0;
+			s = ktrace_open[i].ko_start;
+			return (e->ke_sec - s->ke_sec) * 1000000 +
+				(e->ke_nsec / 1000) - (s->ke_nsec / 1000);
+		}
+	}
+	return KTRACE_UNKNOWN;
+}
+
+static
+void
+ktrace_printus(const char *what, uint32_t us)
+{
+	if (us == KTRACE_UNKNOWN) {
+		kprintf(" (%s ?)\n", what);
+	}
+	else {
+		kprintf(" (%s %u us)\n", what, us);
+	}
+}
+
+static
+void
+ktrace_decode(const struct ktrace_event *e)
+{
+	static const char *const statenames[] = {
+		"running", "ready", "sleeping", "zombie",
+	};
+	const char *state;
+
+	kprintf("%u.%09u cpu%u %08x ", e->ke_sec, e->ke_nsec,
+		e->ke_cpu, e->ke_thread);
+
+	switch (e->ke_type) {
+	    case KTRACE_SWITCH:
+		state = e->ke_b < ARRAYCOUNT(statenames) ?
+			statenames[e->ke_b] : "?";
+		kprintf("switch to %08x, old one %s\n", e->ke_a, state);
+		break;
+	    case KTRACE_SYSCALL:
+		kprintf("syscall %u\n", e->ke_a);
+		ktrace_begin(KTRACE_SYSCALL, e->ke_thread, e);
+		break;
+	    case KTRACE_SYSRET:
+		kprintf("syscall %u returns, error %u", e->ke_a, e->ke_b);
+		ktrace_printus("took",
+			       ktrace_end(KTRACE_SYSCALL, e->ke_thread, e));
+		break;
+	    case KTRACE_FAULT:
+		kprintf("fault type %u at 0x%x\n", e->ke_a, e->ke_b);
+		ktrace_begin(KTRACE_FAULT, e->ke_thread, e);
+		break;
+	    case KTRACE_FAULTDONE:
+		kprintf("fault at 0x%x done, error %u", e->ke_b, e->ke_a);
+		ktrace_printus("took",
+			       ktrace_end(KTRACE_FAULT, e->ke_thread, e));
+		break;
+	    case KTRACE_DISKQ:
+		kprintf("disk request %08x queued, sector %u\n",
+			e->ke_a, e->ke_b);
+		ktrace_begin(KTRACE_DISKQ, e->ke_a, e);
+		break;
+	    case KTRACE_DISKSTART:
+		kprintf("disk request %08x starts, %u sectors, %s",
+			e->ke_a, e->ke_b & ~KTRACE_WRITE,
+			(e->ke_b & KTRACE_WRITE) ? "write" : "read");
+		ktrace_printus("waited",
+			       ktrace_end(KTRACE_DISKQ, e->ke_a, e));
+		ktrace_begin(KTRACE_DISKSTART, e->ke_a, e);
+		break;
+	    case KTRACE_DISKDONE:
+		kprintf("disk request %08x done, error %u", e->ke_a, e->ke_b);
+		ktrace_printus("took",
+			       ktrace_end(KTRACE_DISKSTART, e->ke_a, e));
+		break;
+	    default:
+		kprintf("event %u: %08x %08x\n", e->ke_type, e->ke_a, e->ke_b);
+		break;
+	}
+}
+
+/*
+ * Print the events in time order, merging the CPUs' rings: each
+ * ring is in order already, so repeatedly take the earliest of the
+ * events next in each.
+ */
+void
+ktrace_print(void)
+{
+	unsigned pos[MAXCPUS], end[MAXCPUS];
+	const struct ktrace_event *e, *best;
+	struct ktrace_ring *r;
+	unsigned i, bestcpu, numcpus, total;
+
+	kprintf("Trace (%s):\n", ktrace_on ? "running" : "stopped");
+
+	total = 0;
+	for (i=0; cpu_bynumber(i) != NULL; i++) {
+		r = &ktrace_rings[i];
+		end[i] = r->kr_events == NULL ? 0 : r->kr_head;
+		pos[i] = end[i] > KTRACE_NEVENTS ? end[i] - KTRACE_NEVENTS : 0;
+		total += end[i] - pos[i];
+	}
+	numcpus = i;
+
+	bzero(ktrace_open, sizeof(ktrace_open));
+	ktrace_nextopen = 0;
+
+	while (total > 0) {
+		best = NULL;
+		bestcpu = 0;
+		for (i=0; i<numcpus; i++) {
+			if (pos[i] == end[i]) {
+				continue;
+			}
+			e = &ktrace_rings[i].kr_events[pos[i] % KTRACE_NEVENTS];
+			if (best == NULL || e->ke_sec < best->ke_sec ||
+			    (e->ke_sec == best->ke_sec &&
+			     e->ke_nsec < best->ke_nsec)) {
+				best = e;
+				bestcpu = i;
+			}
+		}
+		ktrace_decode(best);
+		pos[bestcpu]++;
+		total--;
+	}
+}
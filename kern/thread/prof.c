@@ -0,0 +1,184 @@
+/*
+ * Kernel profiler; see <prof.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <ksyms.h>
+#include <prof.h>
+
+/*
+ * Each CPU has PROF_NSAMPLES slots for kernel PCs, about 40 seconds'
+ * worth at HZ; once they're full further kernel samples are counted
+ * as dropped. Only the CPU itself writes to its prof_cpu, from
+ * hardclock with interrupts off, so sampling takes no lock. The
+ * buffers are allocated by the first prof_start and never freed, so a
+ * sample racing with prof_stop or prof_start is harmless: at worst it
+ * lands in the old run's counts or the new one's.
+ *
+ * prof_lock only serializes installing the buffers.
+ */
+#define PROF_NSAMPLES 4096
+
+struct prof_cpu {
+	vaddr_t *pc_samples;		/* kernel PCs */
+	unsigned pc_nsamples;		/* slots used */
+	unsigned pc_user;		/* samples in user mode */
+	unsigned pc_dropped;		/* kernel samples with no slot */
+};
+
+static struct spinlock prof_lock = SPINLOCK_INITIALIZER;
+static struct prof_cpu prof_cpus[MAXCPUS];
+static volatile bool prof_on;
+
+void
+prof_hardclock(void)
+{
+	struct prof_cpu *p;
+	vaddr_t pc;
+	unsigned n;
+	bool user;
+
+	if (!prof_on) {
+		return;
+	}
+	p = &prof_cpus[curcpu->c_number];
+	if (p->pc_samples == NULL) {
+		return;
+	}
+
+	pc = prof_interrupted_pc(&user);
+	if (user) {
+		p->pc_user++;
+		return;
+	}
+	n = p->pc_nsamples;
+	if (n < PROF_NSAMPLES) {
+		p->pc_samples[n] = pc;
+		p->pc_nsamples = n + 1;
+	}
+	else {
+		p->pc_dropped++;
+	}
+}
+
+int
+prof_start(void)
+{
+	struct cpu *c;
+	struct prof_cpu *p;
+	vaddr_t *samples;
+	unsigned i;
+
+	prof_on = false;
+	for (i=0; (c = cpu_bynumber(i)) != NULL; i++) {
+		p = &prof_cpus[i];
+		if (p->pc_samples == NULL) {
+			samples = kmalloc(PROF_NSAMPLES * sizeof(vaddr_t));
+			if (samples == NULL) {
+				return ENOMEM;
+			}
+			spinlock_acquire(&prof_lock);
+			if (p->pc_samples == NULL) {
+				p->pc_samples = samples;
+				samples = NULL;
+			}
+			spinlock_release(&prof_lock);
+			if (samples != NULL) {
+				kfree(samples);
+			}
+		}
+		p->pc_nsamples = 0;
+		p->pc_user = 0;
+		p->pc_dropped = 0;
+	}
+	prof_on = true;
+	return 0;
+}
+
+void
+prof_stop(void)
+{
+	prof_on = false;
+}
+
+/*
+ * Tally the samples by symbol into COUNTS, which has a slot for each
+ * symbol and one more at the end for PCs below them all.
+ */
+static
+void
+prof_tally(unsigned *counts)
+{
+	struct prof_cpu *p;
+	unsigned i, j, n;
+	int sym;
+
+	for (i=0; cpu_bynumber(i) != NULL; i++) {
+		p = &prof_cpus[i];
+		if (p->pc_samples == NULL) {
+			continue;
+		}
+		n = p->pc_nsamples;
+		for (j=0; j<n; j++) {
+			sym = ksym_index(p->pc_samples[j]);
+			counts[sym < 0 ? nksyms : (unsigned)sym]++;
+		}
+	}
+}
+
+void
+prof_print(unsigned max)
+{
+	struct prof_cpu *p;
+	unsigned *counts;
+	unsigned i, best, kernel, user, dropped, shown;
+
+	kprintf("Profile (%s):\n", prof_on ? "running" : "stopped");
+	kernel = user = dropped = 0;
+	for (i=0; cpu_bynumber(i) != NULL; i++) {
+		p = &prof_cpus[i];
+		kprintf("  cpu%u: %u kernel, %u user, %u dropped\n",
+			i, p->pc_nsamples, p->pc_user, p->pc_dropped);
+		kernel += p->pc_nsamples;
+		user += p->pc_user;
+		dropped += p->pc_dropped;
+	}
+	kprintf("  total: %u kernel, %u user, %u dropped\n",
+		kernel, user, dropped);
+	if (kernel == 0) {
+		return;
+	}
+
+	counts = kmalloc((nksyms + 1) * sizeof(unsigned));
+	if (counts == NULL) {
+		kprintf("prof: Out of memory\n");
+		return;
+	}
+	bzero(counts, (nksyms + 1) * sizeof(unsigned));
+	prof_tally(counts);
+
+	/* Print the busiest first, clearing each count once shown. */
+	kprintf("  samples    %%  function\n");
+	for (shown = 0; shown < max; shown++) {
+		best = 0;
+		for (i=1; i<=nksyms; i++) {
+			if (counts[i] > counts[best]) {
+				best = i;
+			}
+		}
+		if (counts[best] == 0) {
+			break;
+		}
+		kprintf("  %7u %3u%%  %s\n", counts[best],
+			counts[best] * 100 / kernel,
+			best < nksyms ? ksyms[best].ks_name : "(unknown)");
+		counts[best] = 0;
+	}
+	kfree(counts);
+}
@@ -30,6 +30,7 @@
 /* Make sure to build out-of-line versions of inline functions */
 #define SPINLOCK_INLINE   /* empty */
 #define MEMBAR_INLINE     /* empty */
+#define ATOMIC_INLINE     /* empty */
 
 #include <types.h>
 #include <lib.h>
@@ -37,12 +38,20 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <membar.h>
+#include <atomic.h>
+#include <clock.h>
 #include <current.h>	/* for curcpu */
 
 /*
  * Spinlocks.
  */
 
+/* Every spinlock_stats that has been used, for spinlock_printstats. */
+static struct spinlock spinlock_stats_lock = SPINLOCK_INITIALIZER;
+static struct spinlock_stats *spinlock_stats_list;
+
+/* Timing waits and holds? See spinlock_profile. */
+static volatile bool spinlock_profiling;
 
 /*
  * Initialize spinlock.
@@ -51,7 +60,10 @@ void
 spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
 	splk->splk_holder = NULL;
+	splk->splk_stats = NULL;
+	splk->splk_since = 0;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
 
@@ -62,20 +74,116 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(spinlock_data_get(&splk->splk_lock) ==
+		spinlock_data_get(&splk->splk_next));
+}
+
+/*
+ * Put STATS on the list, the first time a lock using it is acquired.
+ * Called with that lock held; spinlock_stats_lock has no stats, so
+ * this doesn't recurse.
+ */
+static
+void
+spinlock_liststats(struct spinlock_stats *stats)
+{
+	spinlock_acquire(&spinlock_stats_lock);
+	if (!stats->sls_listed) {
+		stats->sls_next = spinlock_stats_list;
+		spinlock_stats_list = stats;
+		stats->sls_listed = true;
+	}
+	spinlock_release(&spinlock_stats_lock);
+}
+
+/*
+ * Nanoseconds since BEFORE, which must be recent; and the time now
+ * in RET.
+ */
+static
+uint32_t
+spinlock_nsecsince(const struct timespec *before, struct timespec *ret)
+{
+	clock_now(ret);
+	return (ret->tv_sec - before->tv_sec) * 1000000000 +
+		ret->tv_nsec - before->tv_nsec;
+}
+
+/*
+ * Count the just-finished acquire of SPLK, which took SPINS spins.
+ * If BEFORE isn't NULL it's when we started waiting; time the wait,
+ * and note when the hold started for spinlock_release. splk_since is
+ * the nanosecond part of that plus one, so that 0 can mean the hold
+ * isn't being timed.
+ */
+static
+void
+spinlock_count(struct spinlock *splk, unsigned spins,
+	       const struct timespec *before)
+{
+	struct spinlock_stats *stats = splk->splk_stats;
+	struct timespec now;
+	uint32_t wait;
+
+	if (!stats->sls_listed) {
+		spinlock_liststats(stats);
+	}
+	stats->sls_acquires++;
+	if (spins > 0) {
+		stats->sls_contended++;
+		stats->sls_spins += spins;
+		if (spins > stats->sls_maxspins) {
+			stats->sls_maxspins = spins;
+		}
+	}
+	if (before != NULL) {
+		wait = spinlock_nsecsince(before, &now);
+		stats->sls_waitnsec += wait;
+		if (wait > stats->sls_maxwait) {
+			stats->sls_maxwait = wait;
+		}
+		splk->splk_since = now.tv_nsec + 1;
+	}
+}
+
+/*
+ * Count the time SPLK has been held, just before releasing it. The
+ * clock's seconds aren't kept, so this only works for holds of less
+ * than a second, which for a spinlock is all of them.
+ */
+static
+void
+spinlock_counthold(struct spinlock *splk)
+{
+	struct spinlock_stats *stats = splk->splk_stats;
+	struct timespec now;
+	uint32_t hold;
+
+	clock_now(&now);
+	hold = (now.tv_nsec + 1000000000 - (splk->splk_since - 1))
+		% 1000000000;
+	splk->splk_since = 0;
+	stats->sls_holdnsec += hold;
+	if (hold > stats->sls_maxhold) {
+		stats->sls_maxhold = hold;
+	}
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket with
+ * a machine-level atomic operation and wait for it to be served.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	unsigned spins;
+	struct timespec before;
+	bool timed;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,28 +201,27 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * Once we have a ticket we're committed: the CPUs behind us
+	 * wait for us to take our turn and pass it on. Waiting is only
+	 * reads of the lock word, so it stays in our cache until the
+	 * holder's release.
+	 */
+	timed = splk->splk_stats != NULL && spinlock_profiling;
+	if (timed) {
+		clock_now(&before);
+	}
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+	spins = 0;
+	while (spinlock_data_get(&splk->splk_lock) != ticket) {
+		spins++;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+	if (splk->splk_stats != NULL) {
+		spinlock_count(splk, spins, timed ? &before : NULL);
+	}
 
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
@@ -135,9 +242,14 @@ spinlock_release(struct spinlock *splk)
 		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
 
+	if (splk->splk_since != 0) {
+		spinlock_counthold(splk);
+	}
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	/* Serve the next ticket; only the holder writes this word. */
+	spinlock_data_set(&splk->splk_lock,
+			  spinlock_data_get(&splk->splk_lock) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -154,3 +266,109 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Attach contention counts to a lock.
+ */
+void
+spinlock_setstats(struct spinlock *splk, struct spinlock_stats *stats)
+{
+	KASSERT(splk->splk_holder == NULL);
+	splk->splk_stats = stats;
+}
+
+/*
+ * Start or stop timing. Starting clears the counts, so they cover
+ * just the profiled period; a lock being acquired right then may keep
+ * an acquire or two from before. Stopping keeps them for printing.
+ */
+void
+spinlock_profile(bool on)
+{
+	struct spinlock_stats *stats;
+
+	spinlock_acquire(&spinlock_stats_lock);
+	if (on) {
+		for (stats = spinlock_stats_list; stats != NULL;
+		     stats = stats->sls_next) {
+			stats->sls_acquires = 0;
+			stats->sls_contended = 0;
+			stats->sls_spins = 0;
+			stats->sls_maxspins = 0;
+			stats->sls_waitnsec = 0;
+			stats->sls_holdnsec = 0;
+			stats->sls_maxwait = 0;
+			stats->sls_maxhold = 0;
+		}
+	}
+	spinlock_profiling = on;
+	spinlock_release(&spinlock_stats_lock);
+}
+
+/*
+ * Does A belong ahead of B in the printout? By wait time if that's
+ * been measured, else by how often they were contended.
+ */
+static
+bool
+spinlock_statsbefore(const struct spinlock_stats *a,
+		     const struct spinlock_stats *b)
+{
+	if (a->sls_waitnsec != b->sls_waitnsec) {
+		return a->sls_waitnsec > b->sls_waitnsec;
+	}
+	return a->sls_contended > b->sls_contended;
+}
+
+/* Most spinlock_stats printstats will rank; there are only a few. */
+#define SPINLOCK_MAXPRINT 32
+
+/*
+ * Print the counts for every spinlock that keeps them, the most
+ * waited-for first.
+ */
+void
+spinlock_printstats(void)
+{
+	struct spinlock_stats *sorted[SPINLOCK_MAXPRINT];
+	struct spinlock_stats *stats;
+	unsigned i, j, num, more;
+
+	kprintf("Spinlocks%s:\n", spinlock_profiling ? " (profiling)" : "");
+
+	spinlock_acquire(&spinlock_stats_lock);
+	num = more = 0;
+	for (stats = spinlock_stats_list; stats != NULL;
+	     stats = stats->sls_next) {
+		if (num == SPINLOCK_MAXPRINT) {
+			more++;
+			continue;
+		}
+		for (i = num; i > 0 &&
+			     spinlock_statsbefore(stats, sorted[i-1]); i--) {
+			sorted[i] = sorted[i-1];
+		}
+		sorted[i] = stats;
+		num++;
+	}
+	for (j=0; j<num; j++) {
+		stats = sorted[j];
+		kprintf("  %-15s %10u acquires, %8u contended, "
+			"%10u spins, %8u max\n",
+			stats->sls_name, stats->sls_acquires,
+			stats->sls_contended, stats->sls_spins,
+			stats->sls_maxspins);
+		if (stats->sls_waitnsec != 0 || stats->sls_holdnsec != 0) {
+			kprintf("  %-15s %10llu us waiting (max %u ns), "
+				"%10llu us held (max %u ns)\n", "",
+				stats->sls_waitnsec / 1000,
+				stats->sls_maxwait,
+				stats->sls_holdnsec / 1000,
+				stats->sls_maxhold);
+		}
+	}
+	spinlock_release(&spinlock_stats_lock);
+	if (more > 0) {
+		kprintf("  (%u more not shown)\n", more);
+	}
+}
@@ -33,10 +33,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <membar.h>
+#include <clock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
 
@@ -138,6 +142,39 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * How long an adaptive lock spins, in lock_spin iterations, before
+ * giving up and sleeping even if the holder is still running.
+ */
+#define LOCK_SPIN_MAX 1000
+
+/*
+ * Totals over all adaptive locks, for lock_stats; and the list of all
+ * locks, for lock_printprofile. Each lock's lk_lock may be taken while
+ * holding lock_stats_lock, but not the other way round.
+ */
+static struct spinlock lock_stats_lock = SPINLOCK_INITIALIZER;
+static unsigned lock_total_contended;
+static unsigned lock_total_spun;
+static unsigned lock_total_slept;
+static struct lock *lock_list;
+
+/* Timing waits and holds? See lock_profile. */
+static volatile bool lock_profiling;
+
+/*
+ * Nanoseconds from BEFORE to AFTER.
+ */
+static
+uint64_t
+lock_nsecs(const struct timespec *before, const struct timespec *after)
+{
+	struct timespec diff;
+
+	timespec_sub(after, before, &diff);
+	return (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+}
+
 struct lock *
 lock_create(const char *name)
 {
@@ -164,7 +201,40 @@ lock_create(const char *name)
 	}
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
+	lock->lk_adaptive = false;
+	lock->lk_waitlevel = RUNQUEUE_LEVELS;
+	lock->lk_lent = false;
+	lock->lk_acquires = 0;
+	lock->lk_contended = 0;
+	lock->lk_spun = 0;
+	lock->lk_slept = 0;
+	lock->lk_waitnsec = 0;
+	lock->lk_holdnsec = 0;
+	lock->lk_maxwait = 0;
+	lock->lk_maxhold = 0;
+	lock->lk_timed = false;
+
+	spinlock_acquire(&lock_stats_lock);
+	lock->lk_next = lock_list;
+	lock->lk_prevp = &lock_list;
+	if (lock_list != NULL) {
+		lock_list->lk_prevp = &lock->lk_next;
+	}
+	lock_list = lock;
+	spinlock_release(&lock_stats_lock);
+
+	return lock;
+}
 
+struct lock *
+lock_create_adaptive(const char *name)
+{
+	struct lock *lock;
+
+	lock = lock_create(name);
+	if (lock != NULL) {
+		lock->lk_adaptive = true;
+	}
 	return lock;
 }
 
@@ -174,6 +244,14 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+
+	spinlock_acquire(&lock_stats_lock);
+	*lock->lk_prevp = lock->lk_next;
+	if (lock->lk_next != NULL) {
+		lock->lk_next->lk_prevp = lock->lk_prevp;
+	}
+	spinlock_release(&lock_stats_lock);
+
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
 
@@ -181,9 +259,45 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * Wait, without lk_lock, while LOCK is still held by HOLDER and HOLDER
+ * is running on some other CPU. Returns true if the holder let go
+ * (though someone else may have got in first), false if we should
+ * sleep instead.
+ *
+ * The holder's thread structure is looked at without any lock, and it
+ * might even have exited and gone away once it let go of the lock;
+ * that's harmless, since it only decides whether to keep spinning and
+ * the lock itself is checked again before the holder is.
+ */
+static
+bool
+lock_spin(struct lock *lock, struct thread *holder)
+{
+	unsigned i;
+
+	for (i=0; i<LOCK_SPIN_MAX; i++) {
+		membar_load_load();
+		if (lock->lk_holder != holder) {
+			return true;
+		}
+		if (holder->t_state != S_RUN ||
+		    holder->t_cpu == curcpu->c_self) {
+			return false;
+		}
+	}
+	return false;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	bool contended, spun, slept, timed;
+	struct timespec before, now;
+	uint64_t wait;
+	unsigned level;
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -193,27 +307,119 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
+	contended = spun = slept = false;
+	timed = lock_profiling;
+	while ((holder = lock->lk_holder) != NULL) {
+		if (!contended && timed) {
+			clock_now(&before);
+		}
+		contended = true;
+		if (lock->lk_adaptive && !slept) {
+			spinlock_release(&lock->lk_lock);
+			spun = lock_spin(lock, holder);
+			spinlock_acquire(&lock->lk_lock);
+			if (spun) {
+				continue;
+			}
+		}
+		/* Lend the holder our level while we wait for it. */
+		level = THREAD_LEVEL(curthread);
+		if (level < lock->lk_waitlevel) {
+			lock->lk_waitlevel = level;
+		}
+		if (level < THREAD_LEVEL(holder)) {
+			thread_lend_priority(holder, level, !lock->lk_lent);
+			lock->lk_lent = true;
+		}
 		/* As in the semaphore. */
+		slept = true;
+		lock->lk_slept++;
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
 	lock->lk_holder = curthread;
+	lock->lk_acquires++;
+
+	/*
+	 * If others are still asleep waiting, take on the best level
+	 * any of them had. (It may be better than what's left, since
+	 * lk_waitlevel only resets once nobody is waiting.)
+	 */
+	if (lock->lk_waitlevel < RUNQUEUE_LEVELS) {
+		if (wchan_isempty(lock->lk_wchan, &lock->lk_lock)) {
+			lock->lk_waitlevel = RUNQUEUE_LEVELS;
+		}
+		else if (lock->lk_waitlevel < THREAD_LEVEL(curthread)) {
+			thread_lend_priority(curthread, lock->lk_waitlevel,
+					     true);
+			lock->lk_lent = true;
+		}
+	}
+	if (contended) {
+		lock->lk_contended++;
+		if (spun && !slept) {
+			lock->lk_spun++;
+		}
+	}
+	if (timed) {
+		clock_now(&now);
+		if (contended) {
+			wait = lock_nsecs(&before, &now);
+			lock->lk_waitnsec += wait;
+			if (wait > lock->lk_maxwait) {
+				lock->lk_maxwait = wait;
+			}
+		}
+		lock->lk_since = now;
+	}
+	lock->lk_timed = timed;
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
 
 	spinlock_release(&lock->lk_lock);
+
+	if (contended && lock->lk_adaptive) {
+		spinlock_acquire(&lock_stats_lock);
+		lock_total_contended++;
+		if (spun && !slept) {
+			lock_total_spun++;
+		}
+		if (slept) {
+			lock_total_slept++;
+		}
+		spinlock_release(&lock_stats_lock);
+	}
 }
 
 void
 lock_release(struct lock *lock)
 {
+	struct timespec now;
+	uint64_t hold;
+
 	DEBUGASSERT(lock != NULL);
 
+	/* Read the clock before lk_lock, which is a spinlock. */
+	if (lock->lk_timed) {
+		clock_now(&now);
+	}
+
 	spinlock_acquire(&lock->lk_lock);
 
 	KASSERT(lock->lk_holder == curthread);
+	if (lock->lk_timed) {
+		hold = lock_nsecs(&lock->lk_since, &now);
+		lock->lk_holdnsec += hold;
+		if (hold > lock->lk_maxhold) {
+			lock->lk_maxhold = hold;
+		}
+		lock->lk_timed = false;
+	}
 	lock->lk_holder = NULL;
+	if (lock->lk_lent) {
+		lock->lk_lent = false;
+		thread_unlend_priority();
+	}
 	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
 
 	/* Call this (atomically) when the lock is released */
@@ -222,6 +428,180 @@ lock_release(struct lock *lock)
 	spinlock_release(&lock->lk_lock);
 }
 
+/*
+ * Print how the adaptive locks have been doing.
+ */
+void
+lock_stats(void)
+{
+	spinlock_acquire(&lock_stats_lock);
+	kprintf("Adaptive locks: %u contended acquires, %u by spinning, "
+		"%u after sleeping\n", lock_total_contended,
+		lock_total_spun, lock_total_slept);
+	spinlock_release(&lock_stats_lock);
+}
+
+/*
+ * Start or stop timing. Starting clears every lock's counts, so they
+ * cover just the profiled period; stopping keeps them for printing.
+ * Locks destroyed in the meantime take their counts with them.
+ */
+void
+lock_profile(bool on)
+{
+	struct lock *lock;
+
+	spinlock_acquire(&lock_stats_lock);
+	if (on) {
+		for (lock = lock_list; lock != NULL; lock = lock->lk_next) {
+			spinlock_acquire(&lock->lk_lock);
+			lock->lk_acquires = 0;
+			lock->lk_contended = 0;
+			lock->lk_spun = 0;
+			lock->lk_slept = 0;
+			lock->lk_waitnsec = 0;
+			lock->lk_holdnsec = 0;
+			lock->lk_maxwait = 0;
+			lock->lk_maxhold = 0;
+			spinlock_release(&lock->lk_lock);
+		}
+	}
+	lock_profiling = on;
+	spinlock_release(&lock_stats_lock);
+
+	spinlock_profile(on);
+}
+
+/*
+ * Counts summed by lock name for lock_printprofile. Names past the
+ * first LOCK_PROFNAMES seen go in the last entry, "(others)". This is
+ * static rather than on the stack because it's big; only the menu
+ * prints the profile, so there's no call for a lock round it.
+ */
+#define LOCK_PROFNAMES 64
+
+struct lock_profent {
+	char lp_name[16];
+	unsigned lp_locks;
+	unsigned lp_acquires;
+	unsigned lp_contended;
+	uint64_t lp_waitnsec;
+	uint64_t lp_holdnsec;
+	uint64_t lp_maxwait;
+	uint64_t lp_maxhold;
+};
+
+static struct lock_profent lock_profents[LOCK_PROFNAMES];
+
+/*
+ * Copy as much of NAME as fits into BUF, an lp_name.
+ */
+static
+void
+lock_profname(char *buf, const char *name)
+{
+	size_t i;
+
+	for (i=0; i < sizeof(lock_profents[0].lp_name) - 1 && name[i]; i++) {
+		buf[i] = name[i];
+	}
+	buf[i] = 0;
+}
+
+static
+void
+lock_profadd(struct lock_profent *lp, const struct lock *lock)
+{
+	lp->lp_locks++;
+	lp->lp_acquires += lock->lk_acquires;
+	lp->lp_contended += lock->lk_contended;
+	lp->lp_waitnsec += lock->lk_waitnsec;
+	lp->lp_holdnsec += lock->lk_holdnsec;
+	if (lock->lk_maxwait > lp->lp_maxwait) {
+		lp->lp_maxwait = lock->lk_maxwait;
+	}
+	if (lock->lk_maxhold > lp->lp_maxhold) {
+		lp->lp_maxhold = lock->lk_maxhold;
+	}
+}
+
+/*
+ * Does A belong ahead of B in the printout? By wait time, then by how
+ * often they were contended.
+ */
+static
+bool
+lock_profbefore(const struct lock_profent *a, const struct lock_profent *b)
+{
+	if (a->lp_waitnsec != b->lp_waitnsec) {
+		return a->lp_waitnsec > b->lp_waitnsec;
+	}
+	return a->lp_contended > b->lp_contended;
+}
+
+void
+lock_printprofile(void)
+{
+	struct lock_profent *lp, tmp;
+	struct lock *lock;
+	char name[sizeof(tmp.lp_name)];
+	unsigned i, j, num;
+
+	bzero(lock_profents, sizeof(lock_profents));
+	num = 0;
+
+	/* Nothing here may sleep or kprintf; we hold a spinlock. */
+	spinlock_acquire(&lock_stats_lock);
+	for (lock = lock_list; lock != NULL; lock = lock->lk_next) {
+		if (lock->lk_acquires == 0) {
+			continue;
+		}
+		lock_profname(name, lock->lk_name);
+		for (i=0; i<num; i++) {
+			if (!strcmp(lock_profents[i].lp_name, name)) {
+				break;
+			}
+		}
+		if (i == num) {
+			if (num < LOCK_PROFNAMES - 1) {
+				strcpy(lock_profents[i].lp_name, name);
+				num++;
+			}
+			else {
+				i = LOCK_PROFNAMES - 1;
+				strcpy(lock_profents[i].lp_name, "(others)");
+			}
+		}
+		lock_profadd(&lock_profents[i], lock);
+	}
+	spinlock_release(&lock_stats_lock);
+	if (lock_profents[LOCK_PROFNAMES - 1].lp_locks > 0) {
+		num = LOCK_PROFNAMES;
+	}
+
+	for (i=1; i<num; i++) {
+		tmp = lock_profents[i];
+		for (j=i; j>0 && lock_profbefore(&tmp, &lock_profents[j-1]);
+		     j--) {
+			lock_profents[j] = lock_profents[j-1];
+		}
+		lock_profents[j] = tmp;
+	}
+
+	kprintf("Sleep locks%s:\n", lock_profiling ? " (profiling)" : "");
+	kprintf("  %-15s %5s %10s %9s %10s %8s %10s %8s\n", "name", "locks",
+		"acquires", "contended", "wait us", "max us",
+		"held us", "max us");
+	for (i=0; i<num; i++) {
+		lp = &lock_profents[i];
+		kprintf("  %-15s %5u %10u %9u %10llu %8llu %10llu %8llu\n",
+			lp->lp_name, lp->lp_locks, lp->lp_acquires,
+			lp->lp_contended, lp->lp_waitnsec / 1000,
+			lp->lp_maxwait / 1000, lp->lp_holdnsec / 1000,
+			lp->lp_maxhold / 1000);
+	}
+}
+
 bool
 lock_do_i_hold(struct lock *lock)
 {
@@ -315,3 +695,391 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+void
+cv_wait_class(struct cv *cv, struct lock *lock, uintptr_t class)
+{
+	spinlock_acquire(&cv->cv_wchanlock);
+	lock_release(lock);
+	wchan_sleep_class(cv->cv_wchan, &cv->cv_wchanlock, class);
+	spinlock_release(&cv->cv_wchanlock);
+	lock_acquire(lock);
+}
+
+void
+cv_broadcast_class(struct cv *cv, struct lock *lock, uintptr_t class)
+{
+	(void)lock;
+	spinlock_acquire(&cv->cv_wchanlock);
+	wchan_wakeclass(cv->cv_wchan, &cv->cv_wchanlock, class);
+	spinlock_release(&cv->cv_wchanlock);
+}
+
+/*
+ * A thread in cv_timedwait sleeps as a waiter of its own class, so
+ * the timer can wake just it. cw_asleep and cw_timedout are protected
+ * by cv_wchanlock.
+ */
+struct cv_timedwaiter {
+	struct cv *cw_cv;
+	bool cw_asleep;
+	bool cw_timedout;
+};
+
+/*
+ * Timer function: called from the timer interrupt.
+ */
+static
+void
+cv_timedwait_expire(void *data)
+{
+	struct cv_timedwaiter *cw = data;
+	struct cv *cv = cw->cw_cv;
+
+	spinlock_acquire(&cv->cv_wchanlock);
+	if (cw->cw_asleep) {
+		cw->cw_timedout = true;
+		wchan_wakeclass(cv->cv_wchan, &cv->cv_wchanlock,
+				(uintptr_t)cw);
+	}
+	spinlock_release(&cv->cv_wchanlock);
+}
+
+int
+cv_timedwait(struct cv *cv, struct lock *lock, const struct timespec *ts)
+{
+	struct cv_timedwaiter cw;
+	struct clocktimer ct;
+
+	cw.cw_cv = cv;
+	cw.cw_asleep = true;
+	cw.cw_timedout = false;
+
+	/*
+	 * The timer's function takes cv_wchanlock, so start it before
+	 * we do; if it goes off before we get to sleep, we don't.
+	 * Nobody can signal us in between, as we hold LOCK.
+	 */
+	clocktimer_start(&ct, ts, cv_timedwait_expire, &cw);
+
+	spinlock_acquire(&cv->cv_wchanlock);
+	lock_release(lock);
+	if (!cw.cw_timedout) {
+		wchan_sleep_class(cv->cv_wchan, &cv->cv_wchanlock,
+				  (uintptr_t)&cw);
+	}
+	cw.cw_asleep = false;
+	spinlock_release(&cv->cv_wchanlock);
+
+	clocktimer_stop(&ct);
+	lock_acquire(lock);
+	return cw.cw_timedout ? ETIMEDOUT : 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// RW lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_writewchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_writerswaiting == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0) {
+		wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+	}
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	/* Writers first; the readers get in once they've all been. */
+	if (rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Completion.
+
+struct completion *
+completion_create(const char *name)
+{
+	struct completion *cm;
+
+	cm = kmalloc(sizeof(*cm));
+	if (cm == NULL) {
+		return NULL;
+	}
+
+	cm->cm_name = kstrdup(name);
+	if (cm->cm_name == NULL) {
+		kfree(cm);
+		return NULL;
+	}
+
+	cm->cm_wchan = wchan_create(cm->cm_name);
+	if (cm->cm_wchan == NULL) {
+		kfree(cm->cm_name);
+		kfree(cm);
+		return NULL;
+	}
+
+	spinlock_init(&cm->cm_lock);
+	cm->cm_done = 0;
+	cm->cm_all = false;
+
+	return cm;
+}
+
+void
+completion_destroy(struct completion *cm)
+{
+	KASSERT(cm != NULL);
+
+	/* wchan_destroy will assert if anyone's waiting on it */
+	spinlock_cleanup(&cm->cm_lock);
+	wchan_destroy(cm->cm_wchan);
+	kfree(cm->cm_name);
+	kfree(cm);
+}
+
+void
+complete(struct completion *cm)
+{
+	DEBUGASSERT(cm != NULL);
+
+	spinlock_acquire(&cm->cm_lock);
+	cm->cm_done++;
+	KASSERT(cm->cm_done > 0);
+	/* Only one wait can use it, so only wake one. */
+	wchan_wakeone(cm->cm_wchan, &cm->cm_lock);
+	spinlock_release(&cm->cm_lock);
+}
+
+void
+complete_all(struct completion *cm)
+{
+	DEBUGASSERT(cm != NULL);
+
+	spinlock_acquire(&cm->cm_lock);
+	cm->cm_all = true;
+	wchan_wakeall(cm->cm_wchan, &cm->cm_lock);
+	spinlock_release(&cm->cm_lock);
+}
+
+void
+completion_wait(struct completion *cm)
+{
+	DEBUGASSERT(cm != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&cm->cm_lock);
+	while (cm->cm_done == 0 && !cm->cm_all) {
+		wchan_sleep(cm->cm_wchan, &cm->cm_lock);
+	}
+	if (!cm->cm_all) {
+		cm->cm_done--;
+	}
+	spinlock_release(&cm->cm_lock);
+}
+
+void
+completion_reinit(struct completion *cm)
+{
+	DEBUGASSERT(cm != NULL);
+
+	spinlock_acquire(&cm->cm_lock);
+	cm->cm_done = 0;
+	cm->cm_all = false;
+	spinlock_release(&cm->cm_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Barrier.
+
+struct kbarrier *
+kbarrier_create(const char *name, unsigned count)
+{
+	struct kbarrier *kb;
+
+	KASSERT(count > 0);
+
+	kb = kmalloc(sizeof(*kb));
+	if (kb == NULL) {
+		return NULL;
+	}
+
+	kb->kb_name = kstrdup(name);
+	if (kb->kb_name == NULL) {
+		kfree(kb);
+		return NULL;
+	}
+
+	kb->kb_wchan = wchan_create(kb->kb_name);
+	if (kb->kb_wchan == NULL) {
+		kfree(kb->kb_name);
+		kfree(kb);
+		return NULL;
+	}
+
+	spinlock_init(&kb->kb_lock);
+	kb->kb_count = count;
+	kb->kb_arrived = 0;
+	kb->kb_round = 0;
+
+	return kb;
+}
+
+void
+kbarrier_destroy(struct kbarrier *kb)
+{
+	KASSERT(kb != NULL);
+	KASSERT(kb->kb_arrived == 0);
+
+	spinlock_cleanup(&kb->kb_lock);
+	wchan_destroy(kb->kb_wchan);
+	kfree(kb->kb_name);
+	kfree(kb);
+}
+
+bool
+kbarrier_wait(struct kbarrier *kb)
+{
+	unsigned round;
+
+	DEBUGASSERT(kb != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&kb->kb_lock);
+	kb->kb_arrived++;
+	if (kb->kb_arrived == kb->kb_count) {
+		/* Last one in; let the round go. */
+		kb->kb_arrived = 0;
+		kb->kb_round++;
+		wchan_wakeall(kb->kb_wchan, &kb->kb_lock);
+		spinlock_release(&kb->kb_lock);
+		return true;
+	}
+
+	/* The round number tells a real wakeup from a stray one. */
+	round = kb->kb_round;
+	while (kb->kb_round == round) {
+		wchan_sleep(kb->kb_wchan, &kb->kb_lock);
+	}
+	spinlock_release(&kb->kb_lock);
+	return false;
+}
@@ -36,9 +36,13 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <limits.h>
 #include <lib.h>
 #include <array.h>
+#include <atomic.h>
+#include <membar.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -49,10 +53,12 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid.h>
+#include <ktrace.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -70,7 +76,7 @@ DEFARRAY(cpu, static __UNUSED inline);
 static struct cpuarray allcpus;
 
 /* Used to wait for secondary CPUs to come online. */
-static struct semaphore *cpu_startup_sem;
+static struct completion *cpu_startup;
 
 ////////////////////////////////////////////////////////////
 
@@ -112,45 +118,423 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Run queues.
+ *
+ * Each CPU has one run queue per priority level (see the scheduler
+ * comments further down); these work on the lot of them as one run
+ * queue, in priority order. Call with the run queue lock held.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(THREAD_LEVEL(t) < RUNQUEUE_LEVELS);
+	threadlist_addtail(&c->c_runqueue[THREAD_LEVEL(t)], t);
+}
+
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<RUNQUEUE_LEVELS; i++) {
+		count += c->c_runqueue[i].tl_count;
+	}
+	return count;
+}
+
+/*
+ * Take the first thread of the highest priority, or NULL.
  */
 static
 struct thread *
-thread_create(const char *name)
+runqueue_remhead(struct cpu *c)
 {
-	struct thread *thread;
+	struct thread *t;
+	unsigned i;
 
-	DEBUGASSERT(name != NULL);
+	for (i=0; i<RUNQUEUE_LEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			return t;
+		}
+	}
+	return NULL;
+}
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+/*
+ * Take the last thread of the lowest priority, or NULL.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=RUNQUEUE_LEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			return t;
+		}
 	}
+	return NULL;
+}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+/*
+ * Gangs.
+ *
+ * The threads of a gang (see thread_setgang) are meant to run at the
+ * same time on different CPUs, as the processes of a parallel job
+ * that wait for each other at barriers want to. Time is divided into
+ * slots of GANG_SLOT_NSECS, numbered from the clock so every CPU
+ * agrees on them, and the slots go round the gangs in turn, with one
+ * turn in each round left for nobody so that other threads aren't
+ * shut out. In its gang's slot, a CPU runs that gang's threads ahead
+ * of every other time-sharing thread it has (see runqueue_next and
+ * thread_timeslice); the rest of the time they're scheduled as usual.
+ *
+ * New members are dealt round the CPUs and stay where they're put:
+ * stealing, migration, and wakeup placement leave them alone, so that
+ * two of a gang don't end up taking turns on one CPU.
+ */
+#define GANG_MAX 16
+#define GANG_SLOT_NSECS (4 * (1000000000 / HZ))
+
+static struct spinlock gang_lock = SPINLOCK_INITIALIZER;
+static struct {
+	unsigned g_id;			/* Gang, or 0 if free */
+	unsigned g_nthreads;		/* Threads in it */
+	unsigned g_nextcpu;		/* Where the next one goes */
+} gangs[GANG_MAX];
+static unsigned gang_count;		/* Gangs in use */
+static unsigned gang_lastid;		/* Last gang number given out */
+
+/*
+ * Put thread T in gang ID, or in a new gang if ID is 0. If PLACE is
+ * set, choose its CPU too; the current thread stays where it is.
+ */
+static
+int
+gang_join(struct thread *t, unsigned id, bool place)
+{
+	unsigned i, n, numcpus;
+	struct cpu *c;
+
+	KASSERT(t->t_gang == 0);
+
+	spinlock_acquire(&gang_lock);
+	if (id != 0) {
+		for (i=0; i<GANG_MAX && gangs[i].g_id != id; i++) {
+			/* nothing */
+		}
+		/* the thread forking T is in it, so it's there */
+		KASSERT(i < GANG_MAX);
+	}
+	else {
+		for (i=0; i<GANG_MAX && gangs[i].g_id != 0; i++) {
+			/* nothing */
+		}
+		if (i == GANG_MAX) {
+			spinlock_release(&gang_lock);
+			return EAGAIN;
+		}
+		gangs[i].g_id = ++gang_lastid;
+		if (gangs[i].g_id == 0) {
+			gangs[i].g_id = ++gang_lastid;
+		}
+		gangs[i].g_nthreads = 0;
+		gangs[i].g_nextcpu = t->t_cpu->c_number + 1;
+		gang_count++;
+	}
+	gangs[i].g_nthreads++;
+	t->t_gang = gangs[i].g_id;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (n=0; place && n<numcpus; n++) {
+		c = cpuarray_get(&allcpus, gangs[i].g_nextcpu++ % numcpus);
+		if (THREAD_CAN_RUN(t, c)) {
+			t->t_cpu = c;
+			break;
+		}
+	}
+	spinlock_release(&gang_lock);
+	return 0;
+}
+
+/*
+ * Take thread T out of its gang.
+ */
+static
+void
+gang_leave(struct thread *t)
+{
+	unsigned i;
+
+	KASSERT(t->t_gang != 0);
+
+	spinlock_acquire(&gang_lock);
+	for (i=0; i<GANG_MAX && gangs[i].g_id != t->t_gang; i++) {
+		/* nothing */
+	}
+	KASSERT(i < GANG_MAX);
+	KASSERT(gangs[i].g_nthreads > 0);
+	gangs[i].g_nthreads--;
+	if (gangs[i].g_nthreads == 0) {
+		gangs[i].g_id = 0;
+		gang_count--;
 	}
+	spinlock_release(&gang_lock);
+	t->t_gang = 0;
+}
+
+/*
+ * Called from thread_timeslice: work out whose slot it is now, if the
+ * slot has changed. gang_count is only a hint; with no gangs there's
+ * no need to read the clock.
+ */
+static
+void
+gang_tick(void)
+{
+	struct timespec now;
+	unsigned slot, i, turn;
+
+	if (gang_count == 0) {
+		curcpu->c_gang = 0;
+		return;
+	}
+
+	clock_now(&now);
+	slot = now.tv_sec * (1000000000 / GANG_SLOT_NSECS) +
+		now.tv_nsec / GANG_SLOT_NSECS;
+	if (slot == curcpu->c_gangslot) {
+		return;
+	}
+	curcpu->c_gangslot = slot;
+	curcpu->c_gang = 0;
+
+	spinlock_acquire(&gang_lock);
+	/* gang_count + 1 turns; the last one is nobody's */
+	turn = slot % (gang_count + 1);
+	for (i=0; i<GANG_MAX; i++) {
+		if (gangs[i].g_id != 0 && turn-- == 0) {
+			curcpu->c_gang = gangs[i].g_id;
+			break;
+		}
+	}
+	spinlock_release(&gang_lock);
+}
+
+int
+thread_setgang(bool on)
+{
+	struct thread *cur = curthread;
+
+	if (cur->t_gang != 0) {
+		gang_leave(cur);
+	}
+	if (on) {
+		return gang_join(cur, 0, false);
+	}
+	return 0;
+}
+
+/*
+ * Find a time-sharing thread of GANG on C's run queues, or NULL, and
+ * the level it's on. Call with the run queue lock held.
+ */
+static
+struct thread *
+runqueue_findgang(struct cpu *c, unsigned gang, unsigned *level)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=RUNQUEUE_TS; i<RUNQUEUE_LEVELS; i++) {
+		THREADLIST_FORALL(t, c->c_runqueue[i]) {
+			if (t->t_gang == gang) {
+				*level = i;
+				return t;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take the thread C should run next: a SCHED_FIFO one if there is
+ * one, then one of the gang whose slot it is, then the first of the
+ * highest priority as usual. Call with the run queue lock held.
+ */
+static
+struct thread *
+runqueue_next(struct cpu *c)
+{
+	struct thread *t;
+	unsigned level;
+
+	if (c->c_gang != 0 &&
+	    threadlist_isempty(&c->c_runqueue[RUNQUEUE_RT])) {
+		t = runqueue_findgang(c, c->c_gang, &level);
+		if (t != NULL) {
+			threadlist_remove(&c->c_runqueue[level], t);
+			return t;
+		}
+	}
+	return runqueue_remhead(c);
+}
+
+/*
+ * Wakeup inboxes.
+ *
+ * A thread woken from another CPU is pushed onto its CPU's c_inbox, a
+ * singly linked stack threaded through t_inboxnext, with a
+ * compare-and-swap on the top pointer and no lock, so that the waker
+ * doesn't fight the CPU's own scheduler for its run queue lock. The
+ * CPU moves the lot onto its run queue whenever it next looks at it:
+ * in thread_switch, thread_timeslice, or on IPI_UNIDLE. Another CPU
+ * stealing from it does the same, holding its lock.
+ *
+ * There may be any number of pushers but only one taker at a time,
+ * since it holds the run queue lock, and it takes everything at once
+ * by swapping in 0. So there is no ABA problem: a thread can't be
+ * popped and pushed again while a push of it is being attempted.
+ */
+static
+void
+inbox_push(struct cpu *c, struct thread *t)
+{
+	int old;
+
+	do {
+		old = atomic_get(&c->c_inbox);
+		t->t_inboxnext = (struct thread *)(uintptr_t)old;
+	} while (atomic_cmpxchg(&c->c_inbox, old, (int)(uintptr_t)t) != old);
+}
+
+static
+bool
+inbox_isempty(struct cpu *c)
+{
+	return atomic_get(&c->c_inbox) == 0;
+}
+
+/*
+ * Move everything in C's inbox to its run queue, oldest first. Call
+ * with the run queue lock held. Returns true if there was anything.
+ */
+static
+bool
+inbox_drain(struct cpu *c)
+{
+	struct thread *t, *next, *list;
+	int old;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	do {
+		old = atomic_get(&c->c_inbox);
+		if (old == 0) {
+			return false;
+		}
+	} while (atomic_cmpxchg(&c->c_inbox, old, 0) != old);
+
+	/* It's a stack; turn it round so they queue in wakeup order. */
+	list = NULL;
+	for (t = (struct thread *)(uintptr_t)old; t != NULL; t = next) {
+		next = t->t_inboxnext;
+		t->t_inboxnext = list;
+		list = t;
+	}
+	for (t = list; t != NULL; t = next) {
+		next = t->t_inboxnext;
+		t->t_inboxnext = NULL;
+		KASSERT(t->t_cpu == c);
+		runqueue_add(c, t);
+	}
+	return true;
+}
+
+/*
+ * Maximum number of reaped threads each CPU keeps, with their stacks,
+ * for thread_fork to reuse.
+ */
+#define THREAD_POOL_MAX 16
+
+/*
+ * Initialize the fields of a new thread, or one coming out of the
+ * thread pool, other than its name and stack.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+	thread->t_class = SCHED_OTHER;
+	thread->t_nice = 0;
+	thread->t_priority = RUNQUEUE_TS;
+	thread->t_inherit = RUNQUEUE_LEVELS;
+	thread->t_nlenders = 0;
+	spinlock_init(&thread->t_inheritlock);
+	thread->t_ticks = 0;
+	thread->t_arrived = 0;
+	thread->t_wchan_class = 0;
+	thread->t_affinity = THREAD_AFFINITY_ALL;
+	thread->t_gang = 0;
+	thread->t_lastcpu = NULL;
+	thread->t_inboxnext = NULL;
+	bzero(&thread->t_stats, sizeof(thread->t_stats));
+	thread->t_stamp.tv_sec = 0;
+	thread->t_stamp.tv_nsec = 0;
+	thread->t_ustack = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Public fields */
+	thread->t_fsdepth = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	DEBUGASSERT(name != NULL);
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_name = kstrdup(name);
+	if (thread->t_name == NULL) {
+		kfree(thread);
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	thread_init(thread);
 
 	return thread;
 }
@@ -168,6 +552,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,12 +565,43 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadpool);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_kmalloc = NULL;
+	c->c_nexttick.tv_sec = 0;
+	c->c_nexttick.tv_nsec = 0;
+	c->c_tickless = false;
+	c->c_gangslot = 0;
+	c->c_gang = 0;
+	c->c_timers = NULL;
+	c->c_switchtime.tv_sec = 0;
+	c->c_switchtime.tv_nsec = 0;
+	for (i=0; i<CPU_IRQSOURCES; i++) {
+		c->c_irqs[i] = 0;
+		c->c_irqusecs[i] = 0;
+	}
+	c->c_strayirqs = 0;
+	for (i=0; i<IPI_NTYPES; i++) {
+		c->c_ipis[i] = 0;
+		c->c_ipisent[i] = 0;
+	}
+	c->c_ipiusecs = 0;
+	c->c_shootdowns = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<RUNQUEUE_LEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
 	spinlock_init(&c->c_runqueue_lock);
+	bzero(&c->c_runqueue_stats, sizeof(c->c_runqueue_stats));
+	spinlock_setstats(&c->c_runqueue_lock, &c->c_runqueue_stats);
+	atomic_set(&c->c_inbox, 0);
+
+	c->c_work = NULL;
+	c->c_worktail = &c->c_work;
+	c->c_workwchan = NULL;
+	spinlock_init(&c->c_work_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -195,6 +611,9 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	snprintf(c->c_runqueue_stats.sls_name,
+		 sizeof(c->c_runqueue_stats.sls_name),
+		 "runqueue %u", c->c_number);
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -282,6 +701,8 @@ thread_destroy(struct thread *thread)
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
+	KASSERT(thread->t_nlenders == 0);
+	spinlock_cleanup(&thread->t_inheritlock);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
@@ -290,9 +711,69 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Put a dead thread in this CPU's thread pool instead of destroying
+ * it, if there's room; it keeps its stack. Returns false if the
+ * thread should be destroyed after all. Call with interrupts off.
+ */
+static
+bool
+thread_pool_put(struct thread *thread)
+{
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(thread->t_proc == NULL);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_threadpool.tl_count >= THREAD_POOL_MAX) {
+		return false;
+	}
+	thread_checkstack(thread);
+
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread->t_wchan_name = "POOLED";
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+
+	threadlist_addhead(&curcpu->c_threadpool, thread);
+	return true;
+}
+
+/*
+ * Get a thread from this CPU's thread pool, named NAME and otherwise
+ * as thread_create would make it, but with a stack. Returns NULL if
+ * the pool is empty.
+ */
+static
+struct thread *
+thread_pool_get(const char *name)
+{
+	struct thread *thread;
+	char *tname;
+	int spl;
+
+	tname = kstrdup(name);
+	if (tname == NULL) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadpool);
+	splx(spl);
+	if (thread == NULL) {
+		kfree(tname);
+		return NULL;
+	}
+
+	thread->t_name = tname;
+	thread_init(thread);
+	thread_checkstack_init(thread);
+	return thread;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Up to THREAD_POOL_MAX
+ * are kept in the thread pool rather than destroyed.
  *
  * The list of zombies is per-cpu.
  */
@@ -305,7 +786,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_pool_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -317,6 +800,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *tl;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -331,9 +817,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<RUNQUEUE_LEVELS; i++) {
+		tl = &curcpu->c_runqueue[i];
+		tl->tl_count = 0;
+		tl->tl_head.tln_next = &tl->tl_tail;
+		tl->tl_tail.tln_prev = &tl->tl_head;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -419,10 +908,19 @@ cpu_hatch(unsigned software_number)
 
 	kprintf("cpu%u: %s\n", software_number, buf);
 
-	V(cpu_startup_sem);
+	complete(cpu_startup);
 	thread_exit();
 }
 
+struct cpu *
+cpu_bynumber(unsigned num)
+{
+	if (num >= cpuarray_num(&allcpus)) {
+		return NULL;
+	}
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -435,20 +933,159 @@ thread_start_cpus(void)
 	cpu_identify(buf, sizeof(buf));
 	kprintf("cpu0: %s\n", buf);
 
-	cpu_startup_sem = sem_create("cpu_hatch", 0);
+	cpu_startup = completion_create("cpu_hatch");
+	if (cpu_startup == NULL) {
+		panic("thread_start_cpus: Out of memory\n");
+	}
 	mainbus_start_cpus();
 
 	for (i=0; i<cpuarray_num(&allcpus) - 1; i++) {
-		P(cpu_startup_sem);
+		completion_wait(cpu_startup);
+	}
+	completion_destroy(cpu_startup);
+	cpu_startup = NULL;
+}
+
+/*
+ * Send IPI_UNIDLE to some idle CPU other than BUSY and this one, so
+ * that it comes and looks for work to steal. The idle flags are read
+ * without their locks; this is only a hint.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * Let TARGETCPU know it has new work on its run queue, whose lock is
+ * held.
+ */
+static
+void
+thread_notify_cpu(struct cpu *targetcpu)
+{
+	KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+
+	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
+		/*
+		 * Other processor is idle; send interrupt to make
+		 * sure it unidles.
+		 */
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+	else if (!targetcpu->c_isidle) {
+		/*
+		 * It's busy, so the thread will have to wait. Wake up
+		 * an idle processor, if there is one, to steal it.
+		 */
+		thread_kick_idle(targetcpu);
+	}
+}
+
+/*
+ * Choose a CPU, out of those it is allowed on, to run thread T, which
+ * is waking up or new. In order of preference:
+ *   - the CPU it last ran on, if that's idle (its cache is still warm);
+ *   - an idle sibling of the waker's CPU (see CPU_SIBLINGS), which
+ *     likely shares a cache with whatever it was woken to look at;
+ *   - the CPU it last ran on, busy or not;
+ *   - whichever allowed CPU has the shortest run queue.
+ * The idle flags and queue lengths are read without the run queue
+ * locks; they only need to be good hints.
+ */
+static
+struct cpu *
+thread_place(struct thread *t)
+{
+	struct cpu *c, *last, *best;
+	unsigned i, first, numcpus;
+
+	last = t->t_lastcpu != NULL ? t->t_lastcpu : t->t_cpu;
+	if (THREAD_CAN_RUN(t, last) && last->c_isidle) {
+		return last;
+	}
+
+	numcpus = cpuarray_num(&allcpus);
+	first = curcpu->c_number - curcpu->c_number % CPU_SIBLINGS;
+	for (i = first; i < first + CPU_SIBLINGS && i < numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_isidle && THREAD_CAN_RUN(t, c)) {
+			return c;
+		}
+	}
+
+	if (THREAD_CAN_RUN(t, last)) {
+		return last;
+	}
+
+	best = NULL;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (THREAD_CAN_RUN(t, c) &&
+		    (best == NULL || runqueue_count(c) < runqueue_count(best))) {
+			best = c;
+		}
+	}
+	/* thread_setaffinity doesn't allow masks naming no CPU */
+	KASSERT(best != NULL);
+	return best;
+}
+
+/*
+ * Move a sleeping thread T that is being woken to the CPU thread_place
+ * picks. Called with the wchan's lock held, like thread_wakeup_boost.
+ *
+ * T can't move if its old CPU is still its c_curthread: that happens
+ * when T went to sleep and the CPU went idle, in which case the CPU is
+ * still running on T's stack (see thread_consider_migration). The old
+ * CPU holds its run queue lock from before it changes c_curthread
+ * until it is off T's stack, so checking under that lock is safe.
+ */
+static
+void
+thread_wakeup_place(struct thread *t)
+{
+	struct cpu *oldcpu, *newcpu;
+	bool stuck;
+
+	if (t->t_gang != 0) {
+		/* see "Gangs" above */
+		return;
+	}
+
+	newcpu = thread_place(t);
+	oldcpu = t->t_cpu;
+	if (newcpu == oldcpu) {
+		return;
+	}
+
+	spinlock_acquire(&oldcpu->c_runqueue_lock);
+	stuck = (oldcpu->c_curthread == t);
+	spinlock_release(&oldcpu->c_runqueue_lock);
+
+	if (!stuck) {
+		t->t_cpu = newcpu;
+		t->t_arrived = newcpu->c_hardclocks;
 	}
-	sem_destroy(cpu_startup_sem);
-	cpu_startup_sem = NULL;
 }
 
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too.
+ * targetcpu might be curcpu; it might not be, too. If it isn't, the
+ * thread goes in its inbox rather than locking its run queue.
  */
 static
 void
@@ -456,9 +1093,27 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 {
 	struct cpu *targetcpu;
 
-	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
 
+	if (!already_have_lock && targetcpu != curcpu->c_self) {
+		target->t_state = S_READY;
+		inbox_push(targetcpu, target);
+		/*
+		 * The push is a full barrier, and the target sets
+		 * c_isidle before its last look at the inbox, so
+		 * either it sees the thread or we see it idle. If
+		 * it's busy it'll find the thread on its next tick.
+		 */
+		if (targetcpu->c_isidle) {
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+		else {
+			thread_kick_idle(targetcpu);
+		}
+		return;
+	}
+
+	/* Lock the run queue of the target thread's cpu. */
 	if (already_have_lock) {
 		/* The target thread's cpu should be already locked. */
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
@@ -469,21 +1124,55 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
-	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
-	}
+	thread_notify_cpu(targetcpu);
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
+/*
+ * Make every thread on LIST runnable, emptying it. Threads going to
+ * the same CPU are put on its run queue together, under one
+ * acquisition of its lock and with at most one IPI, rather than each
+ * going through thread_make_runnable.
+ */
+static
+void
+thread_make_runnable_list(struct threadlist *list)
+{
+	struct threadlist rest;
+	struct thread *target;
+	struct cpu *targetcpu;
+
+	threadlist_init(&rest);
+	while ((target = threadlist_remhead(list)) != NULL) {
+		targetcpu = target->t_cpu;
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		do {
+			if (target->t_cpu == targetcpu) {
+				target->t_state = S_READY;
+				runqueue_add(targetcpu, target);
+			}
+			else {
+				threadlist_addtail(&rest, target);
+			}
+		} while ((target = threadlist_remhead(list)) != NULL);
+		thread_notify_cpu(targetcpu);
+		spinlock_release(&targetcpu->c_runqueue_lock);
+
+		/* Go round again with the ones for other CPUs */
+		while ((target = threadlist_remhead(&rest)) != NULL) {
+			threadlist_addtail(list, target);
+		}
+	}
+	threadlist_cleanup(&rest);
+}
+
+static unsigned thread_toplevel(const struct thread *t); /* scheduler */
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -491,8 +1180,9 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
  *
  * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * process is inherited from the caller, as is the caller's affinity
+ * mask. It will start on the same CPU as the caller, unless the
+ * scheduler intervenes first or that CPU isn't in the mask.
  */
 int
 thread_fork(const char *name,
@@ -503,25 +1193,36 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread and its stack, if we have one */
+	newthread = thread_pool_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
 	/* Thread subsystem fields */
+	newthread->t_affinity = curthread->t_affinity;
+	newthread->t_class = curthread->t_class;
+	newthread->t_nice = curthread->t_nice;
+	newthread->t_priority = thread_toplevel(newthread);
 	newthread->t_cpu = curthread->t_cpu;
+	if (!THREAD_CAN_RUN(newthread, newthread->t_cpu)) {
+		newthread->t_cpu = thread_place(newthread);
+	}
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -534,6 +1235,12 @@ thread_fork(const char *name,
 		return result;
 	}
 
+	/* Join the parent's gang, which also picks the CPU */
+	if (curthread->t_gang != 0) {
+		result = gang_join(newthread, curthread->t_gang, true);
+		KASSERT(result == 0);
+	}
+
 	/*
 	 * Because new threads come out holding the cpu runqueue lock
 	 * (see notes at bottom of thread_switch), we need to account
@@ -541,13 +1248,160 @@ thread_fork(const char *name,
 	 */
 	newthread->t_iplhigh_count++;
 
-	/* Set up the switchframe so entrypoint() gets called */
-	switchframe_init(newthread, entrypoint, data1, data2);
+	/* Set up the switchframe so entrypoint() gets called */
+	switchframe_init(newthread, entrypoint, data1, data2);
+
+	/* It starts waiting to run now */
+	clock_now(&newthread->t_stamp);
+
+	/* Lock the current cpu's run queue and make the new thread runnable */
+	thread_make_runnable(newthread, false);
+
+	return 0;
+}
+
+/*
+ * Work stealing.
+ *
+ * Before going idle, a CPU looks for the busy CPU with the most
+ * threads waiting and takes one off the tail of its run queues (the
+ * lowest priority, least recently queued end). A thread that moved
+ * onto its CPU less than STEAL_MIN_HARDCLOCKS ago is left alone, so
+ * threads aren't bounced back and forth between CPUs that go idle
+ * in turn, and keep some of their cache behind them.
+ *
+ * Called from the idle loop with interrupts off and no run queue
+ * locks held. Returns true if it found something; the thread is then
+ * on our run queue.
+ */
+#define STEAL_MIN_HARDCLOCKS 2
+
+static
+bool
+thread_steal(void)
+{
+	unsigned i, numcpus, count, best_count;
+	struct cpu *c, *victim;
+	struct thread *t;
+	int level;
+
+	/* Find the longest queue; the counts needn't be exact. */
+	victim = NULL;
+	best_count = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			continue;
+		}
+		count = runqueue_count(c) + (inbox_isempty(c) ? 0 : 1);
+		if (count > best_count) {
+			best_count = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	inbox_drain(victim);
+	t = NULL;
+	for (level = RUNQUEUE_LEVELS - 1; level >= 0 && t == NULL; level--) {
+		THREADLIST_FORALL_REV(t, victim->c_runqueue[level]) {
+			/* see thread_consider_migration about curthread */
+			if (t != victim->c_curthread &&
+			    t->t_gang == 0 &&
+			    THREAD_CAN_RUN(t, curcpu) &&
+			    victim->c_hardclocks - t->t_arrived >=
+			    STEAL_MIN_HARDCLOCKS) {
+				threadlist_remove(&victim->c_runqueue[level],
+						  t);
+				break;
+			}
+		}
+	}
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+		t->t_arrived = curcpu->c_hardclocks;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_add(curcpu, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
+/*
+ * Scheduling accounting. t_stamp is when thread T last started running
+ * or waiting, and this adds the time from then until NOW to TOTAL and
+ * restamps it. A zero stamp was made before the clock was attached, so
+ * there's nothing meaningful to charge.
+ */
+static
+void
+thread_charge(struct thread *t, struct timespec *total,
+	      const struct timespec *now)
+{
+	struct timespec elapsed;
+
+	if (t->t_stamp.tv_sec != 0) {
+		timespec_sub(now, &t->t_stamp, &elapsed);
+		timespec_add(total, &elapsed, total);
+	}
+	t->t_stamp = *now;
+}
+
+void
+schedstats_add(struct schedstats *to, const struct schedstats *from)
+{
+	timespec_add(&to->ss_runtime, &from->ss_runtime, &to->ss_runtime);
+	timespec_add(&to->ss_waittime, &from->ss_waittime, &to->ss_waittime);
+	to->ss_nvcsw += from->ss_nvcsw;
+	to->ss_nivcsw += from->ss_nivcsw;
+}
+
+/*
+ * Fetch the current thread's accounting, counting the time it has been
+ * running since it was switched in, which thread_switch hasn't charged
+ * yet. thread_takestats also starts the count again from zero.
+ */
+static
+void
+thread_readstats(struct schedstats *ret, bool reset)
+{
+	struct thread *cur = curthread;
+	struct timespec now;
+	int spl;
+
+	spl = splhigh();
+	clock_now(&now);
+	thread_charge(cur, &cur->t_stats.ss_runtime, &now);
+	*ret = cur->t_stats;
+	if (reset) {
+		bzero(&cur->t_stats, sizeof(cur->t_stats));
+	}
+	splx(spl);
+}
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
-	thread_make_runnable(newthread, false);
+void
+thread_getstats(struct schedstats *ret)
+{
+	thread_readstats(ret, false);
+}
 
-	return 0;
+void
+thread_takestats(struct schedstats *ret)
+{
+	thread_readstats(ret, true);
 }
 
 /*
@@ -587,16 +1441,32 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
-	/* Lock the run queue. */
+	/* Lock the run queue, and pick up any remote wakeups. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
+	inbox_drain(curcpu);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/*
+	 * Charge cur for its run. This is done holding the run queue
+	 * lock so that any thread we find on the queue below was
+	 * stamped by its waker before c_switchtime was read.
+	 */
+	clock_now(&curcpu->c_switchtime);
+	thread_charge(cur, &cur->t_stats.ss_runtime, &curcpu->c_switchtime);
+	if (newstate == S_READY && cur->t_in_interrupt) {
+		/* thread_timeslice preempted it */
+		cur->t_stats.ss_nivcsw++;
+	}
+	else if (newstate != S_ZOMBIE) {
+		cur->t_stats.ss_nvcsw++;
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -636,22 +1506,51 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * interrupt from another cpu posting a wakeup) and idling
 	 * *is* atomic with respect to re-enabling interrupts.
 	 *
+	 * Every path that queues a thread for an idle CPU sends it
+	 * IPI_UNIDLE (see thread_notify_cpu and thread_make_runnable),
+	 * so once in cpu_idle there is no need to look again until
+	 * some interrupt arrives.
+	 *
 	 * Note that c_isidle becomes true briefly even if we don't go
-	 * idle. However, because one is supposed to hold the runqueue
-	 * lock to look at it, this should not be visible or matter.
+	 * idle. Remote wakers read it without the lock, so this can
+	 * cost a spurious IPI, but no more.
 	 */
 
-	/* The current cpu is now idle. */
+	/*
+	 * The current cpu is now idle. Make sure that's visible before
+	 * the inbox is checked; see thread_make_runnable.
+	 */
 	curcpu->c_isidle = true;
+	membar_any_any();
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		inbox_drain(curcpu);
+		next = runqueue_next(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/*
+			 * Take work from a busy CPU if there is any,
+			 * else let the VM system use the time, if it
+			 * wants, before really idling.
+			 */
+			if (!thread_steal() && !vm_idle()) {
+				/*
+				 * Stop ticking while there's nothing
+				 * to run. The clock stays stopped
+				 * until there's a thread to run, so
+				 * interrupts that bring no work
+				 * don't start it up again.
+				 */
+				clock_idle(true);
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			clock_now(&curcpu->c_switchtime);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	clock_idle(false);
+
+	KTRACE(KTRACE_SWITCH, next, newstate);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -716,6 +1615,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Clear the wait channel and set the thread state. */
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
+	cur->t_lastcpu = curcpu->c_self;
+	thread_charge(cur, &cur->t_stats.ss_waittime, &curcpu->c_switchtime);
 
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -749,6 +1650,8 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Clear the wait channel and set the thread state. */
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
+	cur->t_lastcpu = curcpu->c_self;
+	thread_charge(cur, &cur->t_stats.ss_waittime, &curcpu->c_switchtime);
 
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -797,6 +1700,10 @@ thread_exit(void)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	if (cur->t_gang != 0) {
+		gang_leave(cur);
+	}
+
 	/* Interrupts off on this processor */
         splhigh();
 
@@ -816,22 +1723,393 @@ thread_yield(void)
 	thread_switch(S_READY, NULL, NULL);
 }
 
+/*
+ * Set the current thread's affinity mask.
+ *
+ * curthread can't be moved while it's running, so if this CPU is no
+ * longer allowed it yields; thread_consider_migration then sends it
+ * away from the run queue. If nothing else is runnable here it gets
+ * picked again and stays until that changes or it next sleeps, as a
+ * wakeup always places it on an allowed CPU.
+ */
+int
+thread_setaffinity(uint32_t mask, uint32_t *oldmask)
+{
+	unsigned numcpus;
+	uint32_t present;
+
+	numcpus = cpuarray_num(&allcpus);
+	present = numcpus >= 32 ? THREAD_AFFINITY_ALL :
+		((uint32_t)1 << numcpus) - 1;
+	if ((mask & present) == 0) {
+		return EINVAL;
+	}
+
+	*oldmask = curthread->t_affinity;
+	curthread->t_affinity = mask;
+	if (!THREAD_CAN_RUN(curthread, curcpu)) {
+		thread_yield();
+	}
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multilevel feedback queue. Each CPU has RUNQUEUE_LEVELS
+ * run queues, and always runs the first thread of the highest
+ * priority (lowest numbered) queue that has one. A thread at level P
+ * gets a time slice of THREAD_QUANTUM(P) hardclocks; if it uses all of
+ * it, it drops a level. A thread woken from wchan_sleep goes up a
+ * level and starts a fresh slice, so threads that mostly wait for
+ * input or I/O stay near the top while CPU-bound ones sink to the
+ * bottom, where they get longer slices but only run when nothing
+ * else wants to.
+ *
+ * So that the bottom queues don't starve, schedule() periodically
+ * moves every thread on the CPU back to the top.
+ *
+ * That is for SCHED_OTHER threads. The top is RUNQUEUE_TS, or lower
+ * for threads with a positive nice value, which never get above
+ * THREAD_NICELEVEL; a negative one stretches their slices instead,
+ * doubling them for each THREAD_NICESTEP. SCHED_FIFO threads sit at
+ * RUNQUEUE_RT, above all the others, with no slices at all.
+ */
+#define THREAD_QUANTUM(p) (1U << ((p) - RUNQUEUE_TS))
+#define THREAD_NICESTEP 10
+#define THREAD_NICELEVEL(n) \
+	(RUNQUEUE_TS + ((n) > 0 ? \
+	 (n) * (RUNQUEUE_LEVELS - RUNQUEUE_TS) / (PRIO_MAX + 1) : 0))
+
+/*
+ * The best level thread T can have, not counting what's lent to it.
+ */
+static
+unsigned
+thread_toplevel(const struct thread *t)
+{
+	if (t->t_class == SCHED_FIFO) {
+		return RUNQUEUE_RT;
+	}
+	return THREAD_NICELEVEL(t->t_nice);
+}
+
+/*
+ * Length of slice, in hardclocks, for thread T at its level.
+ */
+static
+unsigned
+thread_quantum(const struct thread *t)
+{
+	unsigned quantum;
+
+	quantum = THREAD_QUANTUM(t->t_priority);
+	if (t->t_nice < 0) {
+		quantum <<= (-t->t_nice + THREAD_NICESTEP - 1) /
+			THREAD_NICESTEP;
+	}
+	return quantum;
+}
+
+int
+thread_getclass(void)
+{
+	return curthread->t_class;
+}
+
+/*
+ * Change the current thread's class. It starts over at the top of the
+ * new one; going down from SCHED_FIFO, it also gives way to whatever
+ * is waiting.
+ */
+int
+thread_setclass(int class)
+{
+	struct thread *cur = curthread;
+	bool demoted;
+	int spl;
+
+	if (class != SCHED_OTHER && class != SCHED_FIFO) {
+		return EINVAL;
+	}
+
+	/* schedule() changes t_priority from the timer interrupt */
+	spl = splhigh();
+	demoted = (cur->t_class == SCHED_FIFO && class != SCHED_FIFO);
+	cur->t_class = class;
+	cur->t_priority = thread_toplevel(cur);
+	cur->t_ticks = 0;
+	splx(spl);
+
+	if (demoted) {
+		thread_yield();
+	}
+	return 0;
+}
+
+int
+thread_getnice(void)
+{
+	return curthread->t_nice;
+}
+
+/*
+ * Change the current thread's nice value. If that puts its top level
+ * below where it is, it goes down to it.
+ */
+int
+thread_setnice(int nice)
+{
+	struct thread *cur = curthread;
+	unsigned top;
+	int spl;
+
+	if (nice < PRIO_MIN || nice > PRIO_MAX) {
+		return EINVAL;
+	}
+
+	spl = splhigh();
+	cur->t_nice = nice;
+	top = thread_toplevel(cur);
+	if (cur->t_priority < top) {
+		cur->t_priority = top;
+	}
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Called from hardclock() on every tick, with interrupts off.
+ */
+void
+thread_timeslice(void)
+{
+	struct thread *cur;
+	bool preempt;
+	unsigned i, top, level;
+
+	gang_tick();
+
+	cur = curthread;
+	if (curcpu->c_isidle) {
+		/* cur isn't actually running; nothing to charge */
+		return;
+	}
+
+	if (cur->t_class == SCHED_FIFO) {
+		/* no slices; nothing ranks above it */
+		return;
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= thread_quantum(cur)) {
+		if (cur->t_priority < RUNQUEUE_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		thread_yield();
+		return;
+	}
+
+	/*
+	 * Give way early if something more important is waiting. In
+	 * its gang's slot, only SCHED_FIFO threads are; outside it, a
+	 * thread of the gang whose slot it is also is.
+	 */
+	top = THREAD_LEVEL(cur);
+	if (curcpu->c_gang != 0 && cur->t_gang == curcpu->c_gang &&
+	    top > RUNQUEUE_TS) {
+		top = RUNQUEUE_TS;
+	}
+	preempt = false;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	inbox_drain(curcpu);
+	for (i=0; i<top; i++) {
+		if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+			preempt = true;
+			break;
+		}
+	}
+	if (!preempt && curcpu->c_gang != 0 && cur->t_gang != curcpu->c_gang &&
+	    runqueue_findgang(curcpu, curcpu->c_gang, &level) != NULL) {
+		preempt = true;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * Priority inheritance.
+ *
+ * A thread that holds a sleep lock a more important thread is waiting
+ * for runs at the waiter's level (t_inherit) until it lets go, so
+ * that it isn't left behind less important threads while the waiter
+ * can do nothing. t_nlenders counts the locks it holds that have lent
+ * it a level; t_inherit is the best level any of them lent, and stays
+ * until the last of them is released. This only goes one step: a
+ * holder that is itself asleep on another lock doesn't pass its
+ * boost on.
+ *
+ * runqueue_add reads t_inherit, through THREAD_LEVEL, without
+ * t_inheritlock; a stale value only puts the thread on a different
+ * level for one turn.
+ */
+void
+thread_lend_priority(struct thread *holder, unsigned level, bool newlock)
+{
+	struct cpu *c;
+	struct thread *t;
+	unsigned i;
+	bool raised;
+
+	KASSERT(level < RUNQUEUE_LEVELS);
+
+	spinlock_acquire(&holder->t_inheritlock);
+	if (newlock) {
+		holder->t_nlenders++;
+	}
+	raised = level < THREAD_LEVEL(holder);
+	if (level < holder->t_inherit) {
+		holder->t_inherit = level;
+	}
+	spinlock_release(&holder->t_inheritlock);
+
+	if (!raised) {
+		return;
+	}
+
+	/*
+	 * If it's on a run queue, move it to its new level. If it's
+	 * between queues, it goes on the right one when it lands.
+	 */
+	c = holder->t_cpu;
+	spinlock_acquire(&c->c_runqueue_lock);
+	if (holder->t_state == S_READY && holder->t_cpu == c) {
+		for (i=level+1; i<RUNQUEUE_LEVELS; i++) {
+			THREADLIST_FORALL(t, c->c_runqueue[i]) {
+				if (t == holder) {
+					break;
+				}
+			}
+			if (t != NULL) {
+				threadlist_remove(&c->c_runqueue[i], t);
+				runqueue_add(c, t);
+				break;
+			}
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+void
+thread_unlend_priority(void)
+{
+	struct thread *cur = curthread;
+
+	spinlock_acquire(&cur->t_inheritlock);
+	KASSERT(cur->t_nlenders > 0);
+	cur->t_nlenders--;
+	if (cur->t_nlenders == 0) {
+		cur->t_inherit = RUNQUEUE_LEVELS;
+	}
+	spinlock_release(&cur->t_inheritlock);
+}
+
+/*
+ * Raise the priority of a thread being woken up. Called with the
+ * wchan's lock held, so the thread is still ours to change.
  */
+static
+void
+thread_wakeup_boost(struct thread *t)
+{
+	if (t->t_priority > thread_toplevel(t)) {
+		t->t_priority--;
+	}
+	t->t_ticks = 0;
+
+	/* It starts waiting to run now */
+	clock_now(&t->t_stamp);
+}
 
+/*
+ * This is called periodically from hardclock(), and puts every thread
+ * on the current CPU back at the top priority.
+ */
 void
 schedule(void)
 {
+	struct threadlist moving;
+	struct thread *t;
+	unsigned i;
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Threads with a nice value go back to their own top level,
+	 * which may be the one they're on, so take them all off first.
 	 */
+	threadlist_init(&moving);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=RUNQUEUE_TS+1; i<RUNQUEUE_LEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			threadlist_addtail(&moving, t);
+		}
+	}
+	while ((t = threadlist_remhead(&moving)) != NULL) {
+		t->t_priority = thread_toplevel(t);
+		t->t_ticks = 0;
+		runqueue_add(curcpu, t);
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = thread_toplevel(curthread);
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&moving);
+}
+
+/*
+ * Send the threads queued on this CPU that aren't allowed to run here
+ * to CPUs where they are. (Except curthread; see below.)
+ */
+static
+void
+thread_evict(void)
+{
+	struct threadlist evict;
+	struct threadlist *q;
+	struct thread *t;
+	unsigned i, n, level;
+
+	threadlist_init(&evict);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (level=0; level<RUNQUEUE_LEVELS; level++) {
+		q = &curcpu->c_runqueue[level];
+		n = q->tl_count;
+		for (i=0; i<n; i++) {
+			t = threadlist_remhead(q);
+			if (t != curthread && !THREAD_CAN_RUN(t, curcpu)) {
+				threadlist_addtail(&evict, t);
+			}
+			else {
+				threadlist_addtail(q, t);
+			}
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	while ((t = threadlist_remhead(&evict)) != NULL) {
+		t->t_cpu = thread_place(t);
+		t->t_arrived = t->t_cpu->c_hardclocks;
+		DEBUG(DB_THREADS, "Evicted thread %s: cpu %u -> %u",
+		      t->t_name, curcpu->c_number, t->t_cpu->c_number);
+		thread_make_runnable(t, false);
+	}
+	threadlist_cleanup(&evict);
 }
 
 /*
@@ -850,6 +2128,10 @@ schedule(void)
  * For here and now, because we know we're running on System/161 and
  * System/161 does not (yet) model such cache effects, we'll be very
  * aggressive.
+ *
+ * Threads only go to CPUs their affinity masks allow, and any queued
+ * here that aren't allowed here (because the mask was changed) are
+ * sent away first.
  */
 void
 thread_consider_migration(void)
@@ -860,14 +2142,17 @@ thread_consider_migration(void)
 	struct threadlist victims;
 	struct thread *t;
 
+	thread_evict();
+
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		inbox_drain(c);
+		total_count += runqueue_count(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = runqueue_count(c);
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -881,7 +2166,7 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remtail(curcpu);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -892,7 +2177,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (runqueue_count(c) < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -915,15 +2200,20 @@ thread_consider_migration(void)
 			 * the list and decrement to_send in order to
 			 * skip it. Then it goes back on our own run
 			 * queue below.
+			 *
+			 * Likewise threads that aren't allowed on C, and
+			 * gang members, which stay where they're put.
 			 */
-			if (t == curthread) {
+			if (t == curthread || t->t_gang != 0 ||
+			    !THREAD_CAN_RUN(t, c)) {
 				threadlist_addtail(&victims, t);
 				to_send--;
 				continue;
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			t->t_arrived = c->c_hardclocks;
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -947,7 +2237,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1005,6 +2295,15 @@ wchan_destroy(struct wchan *wc)
  */
 void
 wchan_sleep(struct wchan *wc, struct spinlock *lk)
+{
+	wchan_sleep_class(wc, lk, 0);
+}
+
+/*
+ * Likewise, but as a waiter of class CLASS, for wchan_wakeclass.
+ */
+void
+wchan_sleep_class(struct wchan *wc, struct spinlock *lk, uintptr_t class)
 {
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
@@ -1015,6 +2314,7 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	/* must not hold other spinlocks */
 	KASSERT(curcpu->c_spinlocks == 1);
 
+	curthread->t_wchan_class = class;
 	thread_switch(S_SLEEP, wc, lk);
 	spinlock_acquire(lk);
 }
@@ -1045,6 +2345,8 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
+	thread_wakeup_boost(target);
+	thread_wakeup_place(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1066,18 +2368,50 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * private list.
 	 */
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		thread_wakeup_boost(target);
+		thread_wakeup_place(target);
 		threadlist_addtail(&list, target);
 	}
 
-	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
-	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+	/* Make them runnable, a CPU at a time. */
+	thread_make_runnable_list(&list);
+
+	threadlist_cleanup(&list);
+}
+
+/*
+ * Wake up the threads sleeping on a wait channel with class CLASS
+ * (see wchan_sleep_class), leaving the others asleep.
+ */
+void
+wchan_wakeclass(struct wchan *wc, struct spinlock *lk, uintptr_t class)
+{
+	struct thread *target;
+	struct threadlist list, others;
+
+	KASSERT(spinlock_do_i_hold(lk));
+
+	threadlist_init(&list);
+	threadlist_init(&others);
+
+	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		if (target->t_wchan_class == class) {
+			thread_wakeup_boost(target);
+			thread_wakeup_place(target);
+			threadlist_addtail(&list, target);
+		}
+		else {
+			threadlist_addtail(&others, target);
+		}
+	}
+	/* Put the rest back, still in order */
+	while ((target = threadlist_remhead(&others)) != NULL) {
+		threadlist_addtail(&wc->wc_threads, target);
 	}
 
+	thread_make_runnable_list(&list);
+
+	threadlist_cleanup(&others);
 	threadlist_cleanup(&list);
 }
 
@@ -1111,8 +2445,20 @@ ipi_send(struct cpu *target, int code)
 	KASSERT(code >= 0 && code < 32);
 
 	spinlock_acquire(&target->c_ipi_lock);
+	if (target->c_ipi_pending & ((uint32_t)1 << code)) {
+		/*
+		 * One is already on its way and hasn't been handled
+		 * yet; it'll see this too. This mostly saves waking
+		 * an idle CPU over and over for the same UNIDLE.
+		 */
+		spinlock_release(&target->c_ipi_lock);
+		return;
+	}
 	target->c_ipi_pending |= (uint32_t)1 << code;
 	mainbus_send_ipi(target);
+	if (code < IPI_NTYPES) {
+		curcpu->c_ipisent[code]++;
+	}
 	spinlock_release(&target->c_ipi_lock);
 }
 
@@ -1163,6 +2509,7 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
+	curcpu->c_ipisent[IPI_TLBSHOOTDOWN]++;
 
 	spinlock_release(&target->c_ipi_lock);
 }
@@ -1173,11 +2520,19 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 void
 interprocessor_interrupt(void)
 {
+	struct timespec start, end, diff;
 	uint32_t bits;
 	unsigned i;
 
+	clock_now(&start);
+
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
+	for (i=0; i<IPI_NTYPES; i++) {
+		if (bits & (1U << i)) {
+			curcpu->c_ipis[i]++;
+		}
+	}
 
 	if (bits & (1U << IPI_PANIC)) {
 		/* panic on another cpu - just stop dead */
@@ -1199,7 +2554,7 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt; just collect whatever was sent, below.
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
@@ -1211,9 +2566,57 @@ interprocessor_interrupt(void)
 		for (i=0; i<curcpu->c_numshootdown; i++) {
 			vm_tlbshootdown(&curcpu->c_shootdown[i]);
 		}
+		curcpu->c_shootdowns += curcpu->c_numshootdown;
 		curcpu->c_numshootdown = 0;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	/*
+	 * Not under the IPI lock: wakers hold the run queue lock when
+	 * they send IPIs.
+	 */
+	if (bits & (1U << IPI_UNIDLE)) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		inbox_drain(curcpu);
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+
+	clock_now(&end);
+	timespec_sub(&end, &start, &diff);
+	curcpu->c_ipiusecs += diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+/*
+ * Print the interrupt counts, for the menu.
+ */
+void
+cpu_printintrstats(void)
+{
+	static const char *const ipinames[IPI_NTYPES] = IPI_NAMES;
+	struct cpu *c;
+	unsigned i, j;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: %u hardclocks, %u stray interrupts\n",
+			c->c_number, c->c_hardclocks, c->c_strayirqs);
+		for (j=0; j<CPU_IRQSOURCES; j++) {
+			if (c->c_irqs[j] == 0) {
+				continue;
+			}
+			kprintf("  slot %2u: %10u interrupts, %12llu us "
+				"(avg %llu)\n", j, c->c_irqs[j],
+				c->c_irqusecs[j],
+				c->c_irqusecs[j] / c->c_irqs[j]);
+		}
+		kprintf("  IPIs taken/sent:");
+		for (j=0; j<IPI_NTYPES; j++) {
+			kprintf(" %s %u/%u", ipinames[j], c->c_ipis[j],
+				c->c_ipisent[j]);
+		}
+		kprintf("\n  %u TLB shootdowns done, %llu us in IPI "
+			"handlers\n", c->c_shootdowns, c->c_ipiusecs);
+	}
 }
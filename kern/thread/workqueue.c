@@ -0,0 +1,147 @@
+/*
+ * Deferred work; see <workqueue.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <workqueue.h>
+
+/*
+ * Each CPU's queue is in its struct cpu: a singly linked list, oldest
+ * first, with c_worktail pointing at the link to add at, all under
+ * c_work_lock. Items are queued on the CPU that's running when
+ * work_schedule is called and wake that CPU's work thread, which is
+ * pinned there. Until workqueue_bootstrap has made the wchan there is
+ * no thread to wake, and items just wait.
+ *
+ * w_queued is set atomically by whoever queues the item, so that two
+ * CPUs can't both put it on their lists. The thread clears it once it
+ * has unlinked the item and copied out the function and argument,
+ * before calling the function, which may then queue it again.
+ */
+
+static
+void
+workqueue_thread(void *data1, unsigned long data2)
+{
+	struct cpu *c = data1;
+	struct work *w;
+	void (*func)(void *);
+	void *arg;
+	uint32_t oldmask;
+	int result;
+
+	(void)data2;
+
+	result = thread_setaffinity((uint32_t)1 << c->c_number, &oldmask);
+	KASSERT(result == 0);
+
+	spinlock_acquire(&c->c_work_lock);
+	while (1) {
+		while (c->c_work == NULL) {
+			wchan_sleep(c->c_workwchan, &c->c_work_lock);
+		}
+		w = c->c_work;
+		c->c_work = w->w_next;
+		if (c->c_work == NULL) {
+			c->c_worktail = &c->c_work;
+		}
+		spinlock_release(&c->c_work_lock);
+
+		func = w->w_func;
+		arg = w->w_arg;
+		spinlock_data_set(&w->w_queued, 0);
+		if (w->w_allocated) {
+			kfree(w);
+		}
+		func(arg);
+
+		spinlock_acquire(&c->c_work_lock);
+	}
+}
+
+void
+workqueue_bootstrap(void)
+{
+	struct cpu *c;
+	struct wchan *wc;
+	unsigned i;
+	char name[16];
+	int result;
+
+	for (i=0; (c = cpu_bynumber(i)) != NULL; i++) {
+		snprintf(name, sizeof(name), "work%u", i);
+		wc = wchan_create(name);
+		if (wc == NULL) {
+			panic("workqueue_bootstrap: wchan_create failed\n");
+		}
+
+		/* from now on work_schedule wakes the thread */
+		spinlock_acquire(&c->c_work_lock);
+		c->c_workwchan = wc;
+		spinlock_release(&c->c_work_lock);
+
+		result = thread_fork(name, NULL, workqueue_thread, c, 0);
+		if (result) {
+			panic("workqueue_bootstrap: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+}
+
+void
+work_init(struct work *w, void (*func)(void *), void *arg)
+{
+	w->w_func = func;
+	w->w_arg = arg;
+	spinlock_data_set(&w->w_queued, 0);
+	w->w_allocated = false;
+	w->w_next = NULL;
+}
+
+bool
+work_schedule(struct work *w)
+{
+	struct cpu *c;
+	int spl;
+
+	if (spinlock_data_testandset(&w->w_queued) != 0) {
+		return false;
+	}
+
+	/* stay on this cpu while picking its queue */
+	spl = splhigh();
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_work_lock);
+	w->w_next = NULL;
+	*c->c_worktail = w;
+	c->c_worktail = &w->w_next;
+	if (c->c_workwchan != NULL) {
+		wchan_wakeone(c->c_workwchan, &c->c_work_lock);
+	}
+	spinlock_release(&c->c_work_lock);
+	splx(spl);
+	return true;
+}
+
+int
+workqueue_enqueue(void (*func)(void *), void *arg)
+{
+	struct work *w;
+
+	w = kmalloc(sizeof(*w));
+	if (w == NULL) {
+		return ENOMEM;
+	}
+	work_init(w, func, arg);
+	w->w_allocated = true;
+	work_schedule(w);
+	return 0;
+}
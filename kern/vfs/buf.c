@@ -0,0 +1,1135 @@
+/*
+ * Buffer cache; see <buf.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/iostat.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <device.h>
+#include <objcache.h>
+#include <buf.h>
+
+/*
+ * The buffers are in a hash table keyed by (device, block). Those not
+ * pinned are also on the LRU list, least recently released first,
+ * which is where eviction takes from; a pinned buffer is never
+ * evicted. Up to BUF_MAX buffers are made before eviction starts;
+ * if they are all pinned, more are made rather than wait.
+ *
+ * buf_lock protects all of this and the fields of every buffer but
+ * the contents. It isn't held over I/O: a buffer being read in or
+ * written back is marked busy, and anyone who needs it to settle
+ * waits on buf_cv. Nor is it held over allocating memory, which
+ * might page something out through the file system and back in here.
+ *
+ * Dirty buffers are written back by the flusher thread, which looks
+ * every BUF_FLUSH_PERIOD for ones that have been dirty longer than
+ * BUF_FLUSH_AGE, or at all if more than BUF_DIRTY_HIGH are; also by
+ * eviction and buf_sync. Every write takes along the dirty blocks
+ * either side of the one wanted, up to BUF_CLUSTER in all, as one
+ * device transfer.
+ *
+ * Read-ahead requests from buf_readahead go on a small queue, also
+ * under buf_lock, for the read-ahead thread, which reads the blocks
+ * that aren't cached already in runs of up to BUF_CLUSTER. They are
+ * only hints; if the queue is full they are dropped.
+ *
+ * A held buffer (see <buf.h>) has an extra pin for the hold, so is off
+ * the LRU list, and neither written back by any of the above nor
+ * taken along with a neighbour that is.
+ *
+ * A buffer's data is allocated separately, at the size of its
+ * device's blocks, which is the device's own unless it's on the
+ * buf_devs list (from buf_attach). A buffer that's evicted keeps its
+ * data for the next block if that's the same size.
+ */
+#define BUF_BUCKETS	64
+#define BUF_MAX		128
+#define BUF_DIRTY_HIGH	(BUF_MAX / 2)
+#define BUF_CLUSTER	16
+#define BUF_FLUSH_AGE	2		/* seconds */
+#define BUF_FLUSH_PERIOD 500000000	/* nanoseconds */
+#define BUF_RAQUEUE	16
+
+struct buf {
+	struct device *b_dev;
+	daddr_t b_block;
+	unsigned b_refcount;		/* pins */
+	bool b_valid;			/* b_data is the block's */
+	bool b_dirty;			/* ... and newer than the disk's */
+	bool b_busy;			/* being read in or written back */
+	bool b_readahead;		/* read ahead, and not used since */
+	bool b_held;			/* dirty, for the file system to write */
+	struct timespec b_dirtied;	/* when it last became dirty */
+	const void *b_owner;		/* see buf_setowner, or NULL */
+	struct buf *b_hashnext;		/* next in the hash bucket */
+	struct buf *b_lrunext;		/* LRU list, if not pinned */
+	struct buf **b_lruprevp;	/* what points at us on that list */
+	unsigned b_size;		/* size of b_data */
+	char *b_data;
+};
+
+/* Devices used in blocks not their own size; see buf_attach */
+struct buf_dev {
+	struct device *bd_dev;
+	unsigned bd_blocksize;
+	struct buf_dev *bd_next;
+};
+
+static struct buf *buf_hash[BUF_BUCKETS];
+static struct buf *buf_lru;		/* oldest first */
+static struct buf **buf_lrutail = &buf_lru;
+static unsigned buf_count;		/* buffers in existence */
+static unsigned buf_ndirty;		/* ... of which dirty */
+static unsigned buf_nheld;		/* ... of those, held */
+static struct buf_dev *buf_devs;
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+
+/* Read-ahead queue, a ring */
+struct buf_rareq {
+	struct device *ra_dev;
+	daddr_t ra_block;
+	unsigned ra_nblocks;
+};
+static struct buf_rareq buf_raqueue[BUF_RAQUEUE];
+static unsigned buf_rahead, buf_racount;
+static struct device *buf_radev;	/* whose request is being done */
+static struct cv *buf_racv;		/* for the read-ahead thread */
+
+static struct objcache buf_cache =
+	OBJCACHE_INITIALIZER("buf", sizeof(struct buf), NULL, NULL);
+
+/* Statistics, protected by buf_lock */
+static unsigned buf_hits, buf_misses, buf_evictions;
+static unsigned buf_writes, buf_blockswritten, buf_flushes;
+static unsigned buf_raread, buf_rahits, buf_radropped;
+static unsigned buf_shrunk;
+
+static void buf_flusher(void *data1, unsigned long data2);
+static void buf_reader(void *data1, unsigned long data2);
+
+void
+buf_bootstrap(void)
+{
+	int result;
+
+	buf_lock = lock_create("buf");
+	buf_cv = cv_create("buf");
+	buf_racv = cv_create("bufra");
+	if (buf_lock == NULL || buf_cv == NULL || buf_racv == NULL) {
+		panic("buf_bootstrap: out of memory\n");
+	}
+
+	result = thread_fork("bufflush", NULL, buf_flusher, NULL, 0);
+	if (result) {
+		panic("buf_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("bufread", NULL, buf_reader, NULL, 0);
+	if (result) {
+		panic("buf_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Lists
+
+/*
+ * Return the link pointing at the buffer for (DEV, BLOCK), or at the
+ * NULL ending its chain.
+ */
+static
+struct buf **
+buf_find(struct device *dev, daddr_t block)
+{
+	struct buf **link;
+	unsigned bucket;
+
+	bucket = ((uintptr_t)dev / sizeof(void *) + block) % BUF_BUCKETS;
+	link = &buf_hash[bucket];
+	while (*link != NULL &&
+	       ((*link)->b_dev != dev || (*link)->b_block != block)) {
+		link = &(*link)->b_hashnext;
+	}
+	return link;
+}
+
+static
+void
+buf_unhash(struct buf *b)
+{
+	struct buf **link;
+
+	link = buf_find(b->b_dev, b->b_block);
+	KASSERT(*link == b);
+	*link = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buf_lru_add(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprevp = buf_lrutail;
+	*buf_lrutail = b;
+	buf_lrutail = &b->b_lrunext;
+}
+
+static
+void
+buf_lru_remove(struct buf *b)
+{
+	*b->b_lruprevp = b->b_lrunext;
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprevp = b->b_lruprevp;
+	}
+	else {
+		buf_lrutail = b->b_lruprevp;
+	}
+	b->b_lrunext = NULL;
+	b->b_lruprevp = NULL;
+}
+
+/*
+ * Throw away a buffer that is off both lists.
+ */
+static
+void
+buf_free(struct buf *b)
+{
+	KASSERT(b->b_refcount == 0);
+	KASSERT(b->b_lruprevp == NULL);
+	buf_count--;
+	kfree(b->b_data);
+	objcache_free(&buf_cache, b);
+}
+
+static
+void
+buf_pin(struct buf *b)
+{
+	if (b->b_refcount++ == 0) {
+		buf_lru_remove(b);
+	}
+}
+
+/*
+ * Drop a pin. A buffer with nothing in it is only any use while
+ * someone is filling it in, so once unpinned it goes.
+ */
+static
+void
+buf_unpin(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	if (--b->b_refcount > 0) {
+		return;
+	}
+	if (b->b_valid) {
+		buf_lru_add(b);
+	}
+	else {
+		KASSERT(!b->b_dirty);
+		buf_unhash(b);
+		buf_free(b);
+	}
+}
+
+/*
+ * Mark a buffer dirty or clean, keeping count.
+ */
+static
+void
+buf_setdirty(struct buf *b, bool dirty)
+{
+	if (dirty && !b->b_dirty) {
+		gettime(&b->b_dirtied);
+		buf_ndirty++;
+	}
+	else if (!dirty && b->b_dirty) {
+		KASSERT(buf_ndirty > 0);
+		buf_ndirty--;
+	}
+	b->b_dirty = dirty;
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+/*
+ * Read or write the N buffers in BUFS, which are of consecutive
+ * blocks, in one transfer, retrying I/O errors.
+ */
+static
+int
+buf_io(struct buf **bufs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[BUF_CLUSTER];
+	struct uio ku;
+	daddr_t block;
+	unsigned i, size;
+	int result, tries;
+
+	KASSERT(n > 0 && n <= BUF_CLUSTER);
+	block = bufs[0]->b_block;
+	size = bufs[0]->b_size;
+
+	for (tries = 0; tries < 10; tries++) {
+		uio_kinit(&iov[0], &ku, bufs[0]->b_data, n * size,
+			  (off_t)block * size, rw);
+		for (i=0; i<n; i++) {
+			KASSERT(bufs[i]->b_block == block + i);
+			KASSERT(bufs[i]->b_size == size);
+			iov[i].iov_kbase = bufs[i]->b_data;
+			iov[i].iov_len = size;
+		}
+		ku.uio_iovcnt = n;
+
+		result = DEVOP_IO(bufs[0]->b_dev, &ku);
+		if (result == EINVAL) {
+			/* out of range or misaligned: our fault */
+			panic("buf: block %u: DEVOP_IO returned EINVAL\n",
+			      block);
+		}
+		if (result != EIO) {
+			return result;
+		}
+		if (tries == 0) {
+			kprintf("buf: block %u I/O error, retrying\n",
+				block);
+		}
+	}
+	kprintf("buf: block %u I/O error, giving up after %d retries\n",
+		block, tries);
+	return EIO;
+}
+
+static
+void
+buf_waitbusy(struct buf *b)
+{
+	while (b->b_busy) {
+		cv_wait(buf_cv, buf_lock);
+	}
+}
+
+/*
+ * Is the buffer for (DEV, BLOCK) there to be written along with a
+ * neighbour? If so, pin it.
+ */
+static
+struct buf *
+buf_cluster_get(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	b = *buf_find(dev, block);
+	if (b == NULL || !b->b_dirty || b->b_busy || b->b_held) {
+		return NULL;
+	}
+	buf_pin(b);
+	return b;
+}
+
+/*
+ * Write back a dirty buffer, which the caller has pinned, along with
+ * whatever dirty neighbours it has. Called, and returns, with
+ * buf_lock held. If the write fails the buffers are still dirty.
+ */
+static
+int
+buf_writeback(struct buf *b)
+{
+	struct buf *bufs[BUF_CLUSTER];
+	struct buf *nb;
+	unsigned first, n, i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_refcount > 0);
+
+	buf_waitbusy(b);
+	if (!b->b_dirty) {
+		/* someone else got there first */
+		return 0;
+	}
+
+	/*
+	 * Gather the run of dirty blocks around B: up to half a cluster
+	 * before it, and as many after as fill up the rest.
+	 */
+	first = BUF_CLUSTER / 2;
+	bufs[first] = b;
+	while (first > 0 && bufs[first]->b_block > 0 &&
+	       (nb = buf_cluster_get(b->b_dev,
+			bufs[first]->b_block - 1)) != NULL) {
+		bufs[--first] = nb;
+	}
+	n = BUF_CLUSTER / 2 - first + 1;
+	while (first + n < BUF_CLUSTER &&
+	       (nb = buf_cluster_get(b->b_dev,
+			bufs[first + n - 1]->b_block + 1)) != NULL) {
+		bufs[first + n] = nb;
+		n++;
+	}
+
+	for (i=first; i<first+n; i++) {
+		bufs[i]->b_busy = true;
+		buf_setdirty(bufs[i], false);
+	}
+	buf_writes++;
+	buf_blockswritten += n;
+	lock_release(buf_lock);
+
+	result = buf_io(&bufs[first], n, UIO_WRITE);
+
+	lock_acquire(buf_lock);
+	for (i=first; i<first+n; i++) {
+		bufs[i]->b_busy = false;
+		if (result) {
+			buf_setdirty(bufs[i], true);
+		}
+		if (bufs[i] != b) {
+			buf_unpin(bufs[i]);
+		}
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Getting buffers
+
+/*
+ * The size of DEV's blocks in the cache; with buf_lock held.
+ */
+static
+unsigned
+buf_blocksize(struct device *dev)
+{
+	struct buf_dev *bd;
+
+	for (bd = buf_devs; bd != NULL; bd = bd->bd_next) {
+		if (bd->bd_dev == dev) {
+			return bd->bd_blocksize;
+		}
+	}
+	return dev->d_blocksize;
+}
+
+/*
+ * Find a buffer to use for another block, of SIZE bytes: a new one if
+ * there's room, or otherwise the least recently used one, written back
+ * first if need be. Called, and returns, with buf_lock held; the
+ * buffer is off both lists and not on the books as anything.
+ */
+static
+int
+buf_spare(unsigned size, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	while (1) {
+		if (buf_count < BUF_MAX || buf_lru == NULL) {
+			buf_count++;
+			lock_release(buf_lock);
+			b = objcache_alloc(&buf_cache);
+			lock_acquire(buf_lock);
+			if (b == NULL) {
+				buf_count--;
+				return ENOMEM;
+			}
+			b->b_size = 0;
+			b->b_data = NULL;
+			break;
+		}
+
+		b = buf_lru;
+		buf_pin(b);
+		result = b->b_dirty ? buf_writeback(b) : 0;
+		if (b->b_refcount == 1) {
+			/* nobody wanted it while we were writing */
+			if (result) {
+				/* and there's nowhere left to put it */
+				kprintf("buf: block %u: discarding "
+					"unwritable data\n", b->b_block);
+				buf_setdirty(b, false);
+			}
+			b->b_refcount = 0;
+			buf_unhash(b);
+			buf_evictions++;
+			break;
+		}
+		buf_unpin(b);
+	}
+
+	if (b->b_size != size) {
+		lock_release(buf_lock);
+		kfree(b->b_data);
+		b->b_data = kmalloc(size);
+		lock_acquire(buf_lock);
+		if (b->b_data == NULL) {
+			buf_count--;
+			objcache_free(&buf_cache, b);
+			return ENOMEM;
+		}
+		b->b_size = size;
+	}
+
+	b->b_refcount = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = false;
+	b->b_readahead = false;
+	b->b_held = false;
+	b->b_owner = NULL;
+	b->b_hashnext = NULL;
+	b->b_lrunext = NULL;
+	b->b_lruprevp = NULL;
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Common code for buf_read and buf_get: find (DEV, BLOCK), or make a
+ * buffer for it, and pin it; and if DOREAD, make sure it's read in.
+ */
+static
+int
+buf_lookup(struct device *dev, daddr_t block, bool doread, struct buf **ret)
+{
+	struct buf **link;
+	struct buf *b, *spare;
+	int result;
+
+	spare = NULL;
+	lock_acquire(buf_lock);
+	while (1) {
+		link = buf_find(dev, block);
+		b = *link;
+		if (b != NULL) {
+			buf_pin(b);
+			break;
+		}
+		if (spare != NULL) {
+			b = spare;
+			spare = NULL;
+			b->b_dev = dev;
+			b->b_block = block;
+			b->b_refcount = 1;
+			*link = b;
+			break;
+		}
+		/* may drop the lock, so look again afterwards */
+		result = buf_spare(buf_blocksize(dev), &spare);
+		if (result) {
+			lock_release(buf_lock);
+			return result;
+		}
+	}
+	if (spare != NULL) {
+		/* someone else made one meanwhile */
+		buf_free(spare);
+	}
+
+	buf_waitbusy(b);
+	if (b->b_valid || !doread) {
+		if (b->b_valid) {
+			buf_hits++;
+		}
+		if (b->b_readahead) {
+			buf_rahits++;
+			b->b_readahead = false;
+		}
+		lock_release(buf_lock);
+		*ret = b;
+		return 0;
+	}
+
+	buf_misses++;
+	b->b_busy = true;
+	lock_release(buf_lock);
+
+	result = buf_io(&b, 1, UIO_READ);
+
+	lock_acquire(buf_lock);
+	b->b_busy = false;
+	cv_broadcast(buf_cv, buf_lock);
+	if (result) {
+		buf_unpin(b);
+		lock_release(buf_lock);
+		return result;
+	}
+	b->b_valid = true;
+	lock_release(buf_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buf_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buf_lookup(dev, block, true, ret);
+}
+
+int
+buf_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buf_lookup(dev, block, false, ret);
+}
+
+void *
+buf_data(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	return b->b_data;
+}
+
+bool
+buf_valid(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	return b->b_valid;
+}
+
+void
+buf_markdirty(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_refcount > 0);
+	b->b_valid = true;
+	buf_setdirty(b, true);
+	lock_release(buf_lock);
+}
+
+void
+buf_setowner(struct buf *b, const void *owner)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_refcount > 0);
+	b->b_owner = owner;
+	lock_release(buf_lock);
+}
+
+void
+buf_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	buf_unpin(b);
+	lock_release(buf_lock);
+}
+
+bool
+buf_markheld(struct buf *b)
+{
+	bool fresh;
+
+	lock_acquire(buf_lock);
+	KASSERT(b->b_refcount > 0);
+	b->b_valid = true;
+	buf_setdirty(b, true);
+	fresh = !b->b_held;
+	if (fresh) {
+		/* the caller's pin keeps it off the LRU list already */
+		b->b_held = true;
+		b->b_refcount++;
+		buf_nheld++;
+	}
+	lock_release(buf_lock);
+	return fresh;
+}
+
+/*
+ * Drop a buffer's hold, with buf_lock held; it stays dirty.
+ */
+static
+void
+buf_drophold(struct buf *b)
+{
+	KASSERT(b->b_held);
+	KASSERT(buf_nheld > 0);
+	b->b_held = false;
+	buf_nheld--;
+	buf_unpin(b);
+}
+
+unsigned
+buf_held(struct device *dev, struct buf **bufs, unsigned max)
+{
+	struct buf *b;
+	unsigned i, n;
+
+	n = 0;
+	lock_acquire(buf_lock);
+	for (i=0; i<BUF_BUCKETS; i++) {
+		for (b = buf_hash[i]; b != NULL; b = b->b_hashnext) {
+			if (b->b_dev == dev && b->b_held) {
+				if (n < max) {
+					bufs[n] = b;
+				}
+				n++;
+			}
+		}
+	}
+	lock_release(buf_lock);
+	return n;
+}
+
+void
+buf_unhold(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	buf_drophold(b);
+	lock_release(buf_lock);
+}
+
+daddr_t
+buf_block(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	return b->b_block;
+}
+
+////////////////////////////////////////////////////////////
+// Whole-device operations
+
+/*
+ * Forget a block. If someone else has it pinned it goes when they let
+ * go, unless they fill it in again first.
+ */
+void
+buf_discard(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	b = *buf_find(dev, block);
+	if (b != NULL) {
+		buf_pin(b);
+		buf_waitbusy(b);
+		if (b->b_held) {
+			/* our pin keeps it for the moment */
+			buf_drophold(b);
+		}
+		b->b_valid = false;
+		b->b_owner = NULL;
+		buf_setdirty(b, false);
+		buf_unpin(b);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Find a buffer of DEV that is dirty (but not held), or busy, and if
+ * OWNER isn't NULL is OWNER's; with buf_lock held.
+ */
+static
+struct buf *
+buf_find_unsettled(struct device *dev, const void *owner)
+{
+	struct buf *b;
+	unsigned i;
+
+	for (i=0; i<BUF_BUCKETS; i++) {
+		for (b = buf_hash[i]; b != NULL; b = b->b_hashnext) {
+			if (b->b_dev == dev &&
+			    (owner == NULL || b->b_owner == owner) &&
+			    ((b->b_dirty && !b->b_held) || b->b_busy)) {
+				return b;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write back everything dirty on DEV (of OWNER's, if not NULL) but
+ * held buffers, and wait for any I/O already going on, so that when
+ * we return the disk is up to date. Every write drops the lock, so
+ * start looking from the top again after each; there are only so
+ * many buffers.
+ */
+static
+int
+buf_settle(struct device *dev, const void *owner)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+	while ((b = buf_find_unsettled(dev, owner)) != NULL) {
+		buf_pin(b);
+		result = buf_writeback(b);
+		buf_unpin(b);
+		if (result) {
+			lock_release(buf_lock);
+			return result;
+		}
+	}
+	lock_release(buf_lock);
+	return 0;
+}
+
+int
+buf_sync(struct device *dev)
+{
+	return buf_settle(dev, NULL);
+}
+
+int
+buf_syncowner(struct device *dev, const void *owner)
+{
+	KASSERT(owner != NULL);
+	return buf_settle(dev, owner);
+}
+
+int
+buf_attach(struct device *dev, unsigned blocksize)
+{
+	struct buf_dev *bd;
+
+	KASSERT(blocksize > 0 && blocksize % dev->d_blocksize == 0);
+
+	bd = kmalloc(sizeof(*bd));
+	if (bd == NULL) {
+		return ENOMEM;
+	}
+	bd->bd_dev = dev;
+	bd->bd_blocksize = blocksize;
+
+	lock_acquire(buf_lock);
+	KASSERT(buf_blocksize(dev) == dev->d_blocksize);
+	bd->bd_next = buf_devs;
+	buf_devs = bd;
+	lock_release(buf_lock);
+	return 0;
+}
+
+int
+buf_detach(struct device *dev)
+{
+	struct buf_dev **bdp, *bd;
+	struct buf **link;
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	/*
+	 * Drop DEV's read-ahead requests and let any in progress
+	 * finish, so that nothing more gets cached for it.
+	 */
+	lock_acquire(buf_lock);
+	for (i=0; i<buf_racount; i++) {
+		if (buf_raqueue[(buf_rahead + i) % BUF_RAQUEUE].ra_dev == dev) {
+			buf_raqueue[(buf_rahead + i) % BUF_RAQUEUE].ra_nblocks = 0;
+		}
+	}
+	while (buf_radev == dev) {
+		cv_wait(buf_cv, buf_lock);
+	}
+	lock_release(buf_lock);
+
+	result = buf_sync(dev);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(buf_lock);
+	for (i=0; i<BUF_BUCKETS; i++) {
+		link = &buf_hash[i];
+		while ((b = *link) != NULL) {
+			if (b->b_dev != dev) {
+				link = &b->b_hashnext;
+				continue;
+			}
+			KASSERT(b->b_refcount == 0);
+			KASSERT(!b->b_dirty && !b->b_busy);
+			*link = b->b_hashnext;
+			buf_lru_remove(b);
+			buf_free(b);
+		}
+	}
+	bd = NULL;
+	for (bdp = &buf_devs; *bdp != NULL; bdp = &(*bdp)->bd_next) {
+		if ((*bdp)->bd_dev == dev) {
+			bd = *bdp;
+			*bdp = bd->bd_next;
+			break;
+		}
+	}
+	lock_release(buf_lock);
+
+	kfree(bd);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Flusher
+
+/*
+ * Find a buffer the flusher should write back: an unpinned, dirty one
+ * that has been dirty long enough, or any such if there are too many
+ * dirty buffers. With buf_lock held. Looking on the LRU list finds
+ * the unpinned ones, oldest use first.
+ */
+static
+struct buf *
+buf_find_flushable(const struct timespec *now)
+{
+	struct timespec age;
+	struct buf *b;
+
+	for (b = buf_lru; b != NULL; b = b->b_lrunext) {
+		if (!b->b_dirty || b->b_busy) {
+			continue;
+		}
+		if (buf_ndirty - buf_nheld > BUF_DIRTY_HIGH) {
+			return b;
+		}
+		timespec_sub(now, &b->b_dirtied, &age);
+		if (age.tv_sec >= BUF_FLUSH_AGE) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The flusher thread, which keeps dirty data from sitting in memory
+ * indefinitely and keeps a supply of clean buffers for eviction. If
+ * a write fails, give up on this round rather than retrying the same
+ * buffer straight away.
+ */
+static
+void
+buf_flusher(void *data1, unsigned long data2)
+{
+	struct timespec period, now;
+	struct buf *b;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	period.tv_sec = 0;
+	period.tv_nsec = BUF_FLUSH_PERIOD;
+
+	while (1) {
+		clocknanosleep(&period);
+		gettime(&now);
+
+		lock_acquire(buf_lock);
+		while ((b = buf_find_flushable(&now)) != NULL) {
+			buf_pin(b);
+			buf_flushes++;
+			result = buf_writeback(b);
+			buf_unpin(b);
+			if (result) {
+				break;
+			}
+		}
+		lock_release(buf_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Read-ahead
+
+void
+buf_readahead(struct device *dev, daddr_t block, unsigned nblocks)
+{
+	struct buf_rareq *ra;
+
+	lock_acquire(buf_lock);
+	if (buf_racount == BUF_RAQUEUE) {
+		buf_radropped++;
+		lock_release(buf_lock);
+		return;
+	}
+	ra = &buf_raqueue[(buf_rahead + buf_racount) % BUF_RAQUEUE];
+	ra->ra_dev = dev;
+	ra->ra_block = block;
+	ra->ra_nblocks = nblocks;
+	buf_racount++;
+	cv_signal(buf_racv, buf_lock);
+	lock_release(buf_lock);
+}
+
+/*
+ * Read in the N fresh buffers in BUFS, which the caller has made for
+ * consecutive blocks, pinned, and marked busy. With buf_lock held. If
+ * the read fails they're left invalid, and so go away on unpinning
+ * unless someone else has them (who then reads for themselves).
+ */
+static
+void
+buf_readahead_io(struct buf **bufs, unsigned n)
+{
+	unsigned i;
+	int result;
+
+	lock_release(buf_lock);
+	result = buf_io(bufs, n, UIO_READ);
+	lock_acquire(buf_lock);
+
+	for (i=0; i<n; i++) {
+		bufs[i]->b_busy = false;
+		if (result == 0) {
+			bufs[i]->b_valid = true;
+			bufs[i]->b_readahead = true;
+		}
+		buf_unpin(bufs[i]);
+	}
+	if (result == 0) {
+		buf_raread += n;
+	}
+	cv_broadcast(buf_cv, buf_lock);
+}
+
+/*
+ * Read ahead NBLOCKS blocks from BLOCK on DEV, skipping the ones that
+ * are cached. With buf_lock held.
+ */
+static
+void
+buf_readahead_run(struct device *dev, daddr_t block, unsigned nblocks)
+{
+	struct buf *bufs[BUF_CLUSTER];
+	struct buf **link;
+	struct buf *b;
+	unsigned n;
+
+	n = 0;
+	while (1) {
+		if (nblocks > 0 && n < BUF_CLUSTER &&
+		    *buf_find(dev, block) == NULL) {
+			/* may drop the lock, so look again afterwards */
+			if (buf_spare(buf_blocksize(dev), &b)) {
+				/* no memory; just read what we have */
+				nblocks = 0;
+				continue;
+			}
+			link = buf_find(dev, block);
+			if (*link == NULL) {
+				b->b_dev = dev;
+				b->b_block = block;
+				b->b_refcount = 1;
+				b->b_busy = true;
+				*link = b;
+				bufs[n++] = b;
+				block++;
+				nblocks--;
+				continue;
+			}
+			buf_free(b);
+		}
+
+		/* the run ends here */
+		if (n > 0) {
+			buf_readahead_io(bufs, n);
+			n = 0;
+			continue;
+		}
+		if (nblocks == 0) {
+			break;
+		}
+		/* cached already */
+		block++;
+		nblocks--;
+	}
+}
+
+/*
+ * The read-ahead thread.
+ */
+static
+void
+buf_reader(void *data1, unsigned long data2)
+{
+	struct buf_rareq ra;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(buf_lock);
+	while (1) {
+		while (buf_racount == 0) {
+			cv_wait(buf_racv, buf_lock);
+		}
+		ra = buf_raqueue[buf_rahead];
+		buf_rahead = (buf_rahead + 1) % BUF_RAQUEUE;
+		buf_racount--;
+
+		buf_radev = ra.ra_dev;
+		buf_readahead_run(ra.ra_dev, ra.ra_block, ra.ra_nblocks);
+		buf_radev = NULL;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+}
+
+unsigned
+buf_shrink(void)
+{
+	struct buf *b, *next;
+	unsigned n = 0;
+
+	lock_acquire(buf_lock);
+	for (b = buf_lru; b != NULL; b = next) {
+		next = b->b_lrunext;
+		if (b->b_dirty) {
+			continue;
+		}
+		buf_lru_remove(b);
+		buf_unhash(b);
+		buf_free(b);
+		n++;
+	}
+	buf_shrunk += n;
+	lock_release(buf_lock);
+	return n;
+}
+
+void
+buf_printstats(void)
+{
+	lock_acquire(buf_lock);
+	kprintf("Buffer cache: %u buffers (%u kept), %u dirty, %u hits, "
+		"%u misses, %u evictions\n", buf_count, BUF_MAX, buf_ndirty,
+		buf_hits, buf_misses, buf_evictions);
+	kprintf("  %u writes of %u blocks, %u by the flusher\n",
+		buf_writes, buf_blockswritten, buf_flushes);
+	kprintf("  %u blocks read ahead, %u of them used; "
+		"%u requests dropped\n", buf_raread, buf_rahits, buf_radropped);
+	kprintf("  %u buffers given up for memory; %u held\n",
+		buf_shrunk, buf_nheld);
+	lock_release(buf_lock);
+}
+
+void
+buf_getstats(struct bufstat *ret)
+{
+	lock_acquire(buf_lock);
+	ret->bs_buffers = buf_count;
+	ret->bs_dirty = buf_ndirty;
+	ret->bs_hits = buf_hits;
+	ret->bs_misses = buf_misses;
+	ret->bs_evictions = buf_evictions;
+	ret->bs_writes = buf_writes;
+	ret->bs_blockswritten = buf_blockswritten;
+	ret->bs_flushes = buf_flushes;
+	ret->bs_raread = buf_raread;
+	ret->bs_rahits = buf_rahits;
+	ret->bs_radropped = buf_radropped;
+	ret->bs_shrunk = buf_shrunk;
+	lock_release(buf_lock);
+}
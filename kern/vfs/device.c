@@ -36,12 +36,15 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/ioctl.h>
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <synch.h>
 #include <vnode.h>
 #include <device.h>
+#include <poll.h>
 
 /*
  * Called for each open().
@@ -140,16 +143,49 @@ dev_write(struct vnode *v, struct uio *uio)
 }
 
 /*
- * Called for ioctl(). Just pass through.
+ * Called for ioctl(). The statistics are the same for every device
+ * that keeps them, so are done here; the rest pass through.
  */
 static
 int
 dev_ioctl(struct vnode *v, int op, userptr_t data)
 {
 	struct device *d = v->vn_data;
+	struct iostat is;
+
+	switch (op) {
+	    case DIOC_GETSTATS:
+		if (d->d_stats == NULL) {
+			return EIOCTL;
+		}
+		devstats_get(d->d_stats, &is);
+		return copyout(&is, data, sizeof(is));
+	    case DIOC_RESETSTATS:
+		if (d->d_stats == NULL) {
+			return EIOCTL;
+		}
+		devstats_reset(d->d_stats);
+		return 0;
+	}
 	return DEVOP_IOCTL(d, op, data);
 }
 
+/*
+ * Called for poll(). Devices that never make anyone wait needn't
+ * have a devop_poll.
+ */
+static
+int
+dev_poll(struct vnode *v, struct pollentry *pe)
+{
+	struct device *d = v->vn_data;
+
+	if (d->d_ops->devop_poll == NULL) {
+		return POLLIN | POLLOUT;
+	}
+	return DEVOP_POLL(d, pe);
+}
+
 /*
  * Called for stat().
  * Set the type and the size (block devices only).
@@ -237,15 +273,15 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. None of our devices make sense to map (the VM system
+ * would page them in and out with VOP_READ/VOP_WRITE).
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
@@ -338,7 +374,10 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_fsync = null_fsync,
 	.vop_mmap = dev_mmap,
 	.vop_truncate = dev_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = vopnull_seekhole,
 	.vop_namefile = dev_namefile,
+	.vop_poll = dev_poll,
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
 	.vop_mkdir = vopfail_mkdir_notdir,
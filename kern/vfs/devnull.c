@@ -115,6 +115,7 @@ devnull_create(void)
 
 	dev->d_devnumber = 0; /* assigned by vfs_adddev */
 
+	dev->d_stats = NULL;
 	dev->d_data = NULL;
 
 	result = vfs_adddev("null", dev, 0);
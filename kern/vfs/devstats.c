@@ -0,0 +1,146 @@
+/*
+ * Block device I/O statistics; see <device.h> and <kern/iostat.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <device.h>
+
+void
+devstats_init(struct devstats *ds)
+{
+	spinlock_init(&ds->ds_lock);
+	bzero(&ds->ds_io, sizeof(ds->ds_io));
+}
+
+void
+devstats_cleanup(struct devstats *ds)
+{
+	KASSERT(ds->ds_io.is_queued == 0);
+	spinlock_cleanup(&ds->ds_lock);
+}
+
+/*
+ * REQ has been accepted: note the time and count it as outstanding.
+ */
+void
+devstats_submit(struct devstats *ds, struct devreq *req)
+{
+	clock_now(&req->dr_start);
+
+	spinlock_acquire(&ds->ds_lock);
+	ds->ds_io.is_queued++;
+	if (ds->ds_io.is_queued > ds->ds_io.is_maxqueued) {
+		ds->ds_io.is_maxqueued = ds->ds_io.is_queued;
+	}
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * REQ is finished, with RESULT.
+ */
+void
+devstats_done(struct devstats *ds, struct devreq *req, int result)
+{
+	struct timespec now, diff;
+	uint32_t usecs;
+	unsigned bucket;
+
+	clock_now(&now);
+	timespec_sub(&now, &req->dr_start, &diff);
+	usecs = diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+
+	bucket = 0;
+	while (bucket < IOSTAT_NBUCKETS - 1 &&
+	       (usecs >> (bucket + IOSTAT_HISTSHIFT)) != 0) {
+		bucket++;
+	}
+
+	spinlock_acquire(&ds->ds_lock);
+	KASSERT(ds->ds_io.is_queued > 0);
+	ds->ds_io.is_queued--;
+	if (result) {
+		ds->ds_io.is_errors++;
+	}
+	else if (req->dr_iswrite) {
+		ds->ds_io.is_writes++;
+		ds->ds_io.is_wbytes += req->dr_len;
+	}
+	else {
+		ds->ds_io.is_reads++;
+		ds->ds_io.is_rbytes += req->dr_len;
+	}
+	ds->ds_io.is_usecs += usecs;
+	if (usecs > ds->ds_io.is_maxusecs) {
+		ds->ds_io.is_maxusecs = usecs;
+	}
+	ds->ds_io.is_hist[bucket]++;
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * Copy out the counts.
+ */
+void
+devstats_get(struct devstats *ds, struct iostat *ret)
+{
+	spinlock_acquire(&ds->ds_lock);
+	*ret = ds->ds_io;
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * Zero the counts, except for the requests still outstanding.
+ */
+void
+devstats_reset(struct devstats *ds)
+{
+	unsigned queued;
+
+	spinlock_acquire(&ds->ds_lock);
+	queued = ds->ds_io.is_queued;
+	bzero(&ds->ds_io, sizeof(ds->ds_io));
+	ds->ds_io.is_queued = queued;
+	ds->ds_io.is_maxqueued = queued;
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * Print the counts for the device NAME, for the menu.
+ */
+void
+devstats_print(const char *name, struct devstats *ds)
+{
+	struct iostat is;
+	unsigned done, i;
+
+	devstats_get(ds, &is);
+	done = is.is_reads + is.is_writes + is.is_errors;
+
+	kprintf("%s: %u reads (%llu KB), %u writes (%llu KB), %u errors\n",
+		name, is.is_reads, is.is_rbytes / 1024,
+		is.is_writes, is.is_wbytes / 1024, is.is_errors);
+	kprintf("  queue depth %u, most %u; latency avg %llu us, "
+		"max %u us\n", is.is_queued, is.is_maxqueued,
+		done ? is.is_usecs / done : 0, is.is_maxusecs);
+	if (done == 0) {
+		return;
+	}
+	kprintf("  us:");
+	for (i=0; i<IOSTAT_NBUCKETS; i++) {
+		if (is.is_hist[i] == 0) {
+			continue;
+		}
+		if (i == IOSTAT_NBUCKETS - 1) {
+			kprintf(" >=%u:%u", 1U << (i - 1 + IOSTAT_HISTSHIFT),
+				is.is_hist[i]);
+		}
+		else {
+			kprintf(" <%u:%u", 1U << (i + IOSTAT_HISTSHIFT),
+				is.is_hist[i]);
+		}
+	}
+	kprintf("\n");
+}
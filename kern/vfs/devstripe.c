@@ -0,0 +1,544 @@
+/*
+ * Striped (RAID-0) device: one mountable device made of several
+ * disks, with consecutive stripe units of it going to each disk in
+ * turn. A transfer is split into one request per disk, all started
+ * at once with devop_submit, so the disks work in parallel.
+ *
+ * Because unit K of the stripe is at unit K/N of disk K%N, the units
+ * of one transfer that land on the same disk are consecutive there;
+ * each disk's share is one request, gathered from and scattered to
+ * memory with an iovec per piece.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/iovec.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vfs.h>
+#include <device.h>
+
+/*
+ * The stripe set.
+ */
+struct stripe_softc {
+	struct device sc_dev;			/* Our own device */
+	unsigned sc_ndisks;			/* Number of disks */
+	struct device **sc_disks;		/* The disks */
+	size_t sc_unit;				/* Stripe unit, in bytes */
+	struct spinlock sc_lock;		/* For completions */
+	struct wchan *sc_wchan;			/* Where sync I/O waits */
+	struct devstats sc_stats;		/* I/O statistics */
+};
+
+/*
+ * One disk's part of a transfer.
+ */
+struct stripe_part {
+	struct devreq sp_req;			/* Request to the disk */
+	struct stripe_io *sp_io;		/* Transfer it's part of */
+};
+
+/*
+ * A transfer in progress. The parts and their iovecs are allocated
+ * along with it.
+ */
+struct stripe_io {
+	struct stripe_softc *si_sc;
+	struct devreq *si_req;			/* Request we were given */
+	unsigned si_pending;			/* Parts not yet done */
+	int si_result;				/* First error */
+	struct stripe_part *si_parts;		/* One per disk */
+};
+
+/*
+ * Where byte POS of the stripe set is: which disk, where on it, and
+ * how much of the stripe unit is left from there.
+ */
+static
+void
+stripe_map(struct stripe_softc *sc, off_t pos, unsigned *disk,
+	   off_t *diskpos, size_t *left)
+{
+	off_t unitnum;
+	size_t within;
+
+	unitnum = pos / sc->sc_unit;
+	within = pos % sc->sc_unit;
+	*disk = unitnum % sc->sc_ndisks;
+	*diskpos = (unitnum / sc->sc_ndisks) * sc->sc_unit + within;
+	*left = sc->sc_unit - within;
+}
+
+/*
+ * Go through REQ piece by piece, a piece being as much as is in one
+ * stripe unit and one iovec. Without IO, count the pieces for each
+ * disk into COUNTS. With IO, append each piece to its disk's part,
+ * whose iovecs have been set up with room for COUNTS of them.
+ */
+static
+void
+stripe_walk(struct stripe_softc *sc, struct devreq *req, unsigned *counts,
+	    struct stripe_io *io)
+{
+	struct devreq *part;
+	struct iovec *iov;
+	unsigned iovidx, disk;
+	size_t iovoff, left, amt;
+	off_t pos, end, diskpos;
+
+	pos = req->dr_offset;
+	end = req->dr_offset + req->dr_len;
+	iovidx = 0;
+	iovoff = 0;
+	while (pos < end) {
+		while (req->dr_iov[iovidx].iov_len == iovoff) {
+			iovidx++;
+			iovoff = 0;
+		}
+		iov = &req->dr_iov[iovidx];
+
+		stripe_map(sc, pos, &disk, &diskpos, &left);
+		amt = iov->iov_len - iovoff;
+		if (amt > left) {
+			amt = left;
+		}
+
+		if (io == NULL) {
+			counts[disk]++;
+		}
+		else {
+			part = &io->si_parts[disk].sp_req;
+			if (part->dr_iovcnt == 0) {
+				part->dr_offset = diskpos;
+			}
+			part->dr_iov[part->dr_iovcnt].iov_kbase =
+				(char *)iov->iov_kbase + iovoff;
+			part->dr_iov[part->dr_iovcnt].iov_len = amt;
+			part->dr_iovcnt++;
+			KASSERT(part->dr_iovcnt <= counts[disk]);
+		}
+
+		pos += amt;
+		iovoff += amt;
+	}
+}
+
+/*
+ * One part is finished; if it's the last, so is the transfer. Called
+ * from the disks' interrupt handlers.
+ */
+static
+void
+stripe_partdone(struct devreq *dr, int result)
+{
+	struct stripe_part *sp = dr->dr_data;
+	struct stripe_io *io = sp->sp_io;
+	struct stripe_softc *sc = io->si_sc;
+	struct devreq *req;
+	bool last;
+
+	spinlock_acquire(&sc->sc_lock);
+	if (result && io->si_result == 0) {
+		io->si_result = result;
+	}
+	KASSERT(io->si_pending > 0);
+	io->si_pending--;
+	last = io->si_pending == 0;
+	spinlock_release(&sc->sc_lock);
+
+	if (last) {
+		req = io->si_req;
+		result = io->si_result;
+		kfree(io);
+		devstats_done(&sc->sc_stats, req, result);
+		req->dr_done(req, result);
+	}
+}
+
+/*
+ * Start a transfer. See <device.h>.
+ */
+static
+int
+stripe_submit(struct device *d, struct devreq *req)
+{
+	struct stripe_softc *sc = d->d_data;
+	struct stripe_io *io;
+	struct stripe_part *sp;
+	struct iovec *iovs;
+	unsigned *counts;
+	unsigned i, total;
+	size_t len;
+	int result;
+
+	len = 0;
+	for (i=0; i<req->dr_iovcnt; i++) {
+		if (req->dr_iov[i].iov_len % d->d_blocksize != 0) {
+			return EINVAL;
+		}
+		len += req->dr_iov[i].iov_len;
+	}
+
+	/* Don't allow I/O that isn't block-aligned, or outside the device. */
+	if (req->dr_offset < 0) {
+		return EINVAL;
+	}
+	if (req->dr_offset % d->d_blocksize != 0 || len == 0 ||
+	    (uint64_t)(req->dr_offset / d->d_blocksize) + len / d->d_blocksize
+	    > (uint64_t)d->d_blocks) {
+		return EINVAL;
+	}
+	req->dr_len = len;
+
+	counts = kmalloc(sc->sc_ndisks * sizeof(unsigned));
+	if (counts == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<sc->sc_ndisks; i++) {
+		counts[i] = 0;
+	}
+	stripe_walk(sc, req, counts, NULL);
+	total = 0;
+	for (i=0; i<sc->sc_ndisks; i++) {
+		total += counts[i];
+	}
+
+	io = kmalloc(sizeof(*io) + sc->sc_ndisks * sizeof(*sp) +
+		     total * sizeof(struct iovec));
+	if (io == NULL) {
+		kfree(counts);
+		return ENOMEM;
+	}
+	io->si_sc = sc;
+	io->si_req = req;
+	io->si_result = 0;
+	io->si_parts = (struct stripe_part *)(io + 1);
+	iovs = (struct iovec *)(io->si_parts + sc->sc_ndisks);
+
+	for (i=0; i<sc->sc_ndisks; i++) {
+		sp = &io->si_parts[i];
+		sp->sp_io = io;
+		sp->sp_req.dr_offset = 0;
+		sp->sp_req.dr_iov = iovs;
+		sp->sp_req.dr_iovcnt = 0;
+		sp->sp_req.dr_iswrite = req->dr_iswrite;
+		sp->sp_req.dr_done = stripe_partdone;
+		sp->sp_req.dr_data = sp;
+		iovs += counts[i];
+	}
+	stripe_walk(sc, req, counts, io);
+	kfree(counts);
+	devstats_submit(&sc->sc_stats, req);
+
+	/*
+	 * Hold one count ourselves while starting the parts, so the
+	 * transfer can't finish, and IO go away, before they're all
+	 * started.
+	 */
+	io->si_pending = 1;
+	for (i=0; i<sc->sc_ndisks; i++) {
+		if (io->si_parts[i].sp_req.dr_iovcnt > 0) {
+			io->si_pending++;
+		}
+	}
+	for (i=0; i<sc->sc_ndisks; i++) {
+		sp = &io->si_parts[i];
+		if (sp->sp_req.dr_iovcnt == 0) {
+			continue;
+		}
+		result = DEVOP_SUBMIT(sc->sc_disks[i], &sp->sp_req);
+		if (result) {
+			/* it won't be calling us back */
+			stripe_partdone(&sp->sp_req, result);
+		}
+	}
+	stripe_partdone(&io->si_parts[0].sp_req, 0);
+
+	return 0;
+}
+
+/*
+ * Synchronous I/O goes through stripe_submit and waits on sc_wchan, as
+ * waiter class the address of its stripe_wait, so only it is woken.
+ */
+struct stripe_wait {
+	struct stripe_softc *sw_sc;
+	bool sw_done;
+	int sw_result;
+};
+
+static
+void
+stripe_wakeup(struct devreq *req, int result)
+{
+	struct stripe_wait *sw = req->dr_data;
+	struct stripe_softc *sc = sw->sw_sc;
+
+	spinlock_acquire(&sc->sc_lock);
+	sw->sw_result = result;
+	sw->sw_done = true;
+	wchan_wakeclass(sc->sc_wchan, &sc->sc_lock, (uintptr_t)sw);
+	spinlock_release(&sc->sc_lock);
+}
+
+/*
+ * Transfer the iovecs IOV (IOVCNT of them) at OFFSET and wait for it.
+ */
+static
+int
+stripe_rw(struct stripe_softc *sc, struct iovec *iov, unsigned iovcnt,
+	  off_t offset, bool iswrite)
+{
+	struct devreq req;
+	struct stripe_wait sw;
+	int result;
+
+	sw.sw_sc = sc;
+	sw.sw_done = false;
+	sw.sw_result = 0;
+
+	req.dr_offset = offset;
+	req.dr_iov = iov;
+	req.dr_iovcnt = iovcnt;
+	req.dr_iswrite = iswrite;
+	req.dr_done = stripe_wakeup;
+	req.dr_data = &sw;
+
+	result = stripe_submit(&sc->sc_dev, &req);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&sc->sc_lock);
+	while (!sw.sw_done) {
+		wchan_sleep_class(sc->sc_wchan, &sc->sc_lock,
+				  (uintptr_t)&sw);
+	}
+	spinlock_release(&sc->sc_lock);
+	return sw.sw_result;
+}
+
+/*
+ * Move the uio on by LEN, as uiomove would have.
+ */
+static
+void
+stripe_uioskip(struct uio *uio, size_t len)
+{
+	size_t amt;
+
+	uio->uio_offset += len;
+	uio->uio_resid -= len;
+	while (len > 0) {
+		amt = uio->uio_iov->iov_len < len ? uio->uio_iov->iov_len : len;
+		uio->uio_iov->iov_kbase = (char *)uio->uio_iov->iov_kbase + amt;
+		uio->uio_iov->iov_len -= amt;
+		len -= amt;
+		if (uio->uio_iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+		}
+	}
+}
+
+/*
+ * I/O function (for both reads and writes)
+ *
+ * As for lhd, kernel memory in whole blocks is handed to the disks as
+ * is, and anything else goes through a bounce buffer, a full stripe
+ * (one unit on every disk) at a time so all the disks still get work.
+ */
+static
+int
+stripe_io(struct device *d, struct uio *uio)
+{
+	struct stripe_softc *sc = d->d_data;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	struct iovec iov;
+	size_t len, bouncelen;
+	unsigned i;
+	bool direct;
+	void *bounce;
+	int result;
+
+	/* Don't allow I/O that isn't block-aligned. */
+	if (uio->uio_offset % d->d_blocksize != 0 ||
+	    uio->uio_resid % d->d_blocksize != 0) {
+		return EINVAL;
+	}
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	direct = (uio->uio_segflg == UIO_SYSSPACE);
+	for (i=0; direct && i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len % d->d_blocksize != 0) {
+			direct = false;
+		}
+	}
+	if (direct) {
+		result = stripe_rw(sc, uio->uio_iov, uio->uio_iovcnt,
+				   uio->uio_offset, iswrite);
+		if (result == 0) {
+			stripe_uioskip(uio, uio->uio_resid);
+		}
+		return result;
+	}
+
+	bouncelen = sc->sc_unit * sc->sc_ndisks;
+	bounce = kmalloc(bouncelen);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	result = 0;
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid < bouncelen ? uio->uio_resid : bouncelen;
+		iov.iov_kbase = bounce;
+		iov.iov_len = len;
+		if (iswrite) {
+			result = uiomove(bounce, len, uio);
+			if (result) {
+				break;
+			}
+			/* uiomove moved the offset on; the disks haven't */
+			result = stripe_rw(sc, &iov, 1, uio->uio_offset - len,
+					   true);
+		}
+		else {
+			result = stripe_rw(sc, &iov, 1, uio->uio_offset,
+					   false);
+			if (result == 0) {
+				result = uiomove(bounce, len, uio);
+			}
+		}
+		if (result) {
+			break;
+		}
+	}
+	kfree(bounce);
+	return result;
+}
+
+static
+int
+stripe_eachopen(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+stripe_ioctl(struct device *d, int op, userptr_t data)
+{
+	(void)d;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static const struct device_ops stripe_devops = {
+	.devop_eachopen = stripe_eachopen,
+	.devop_io = stripe_io,
+	.devop_ioctl = stripe_ioctl,
+	.devop_submit = stripe_submit,
+};
+
+/*
+ * Make the device NAME, striped UNIT bytes at a time across the
+ * NDISKS devices named in DISKS, and add it as a mountable device.
+ * The disks must do devop_submit and have the same block size, and
+ * are claimed so nothing else can use them; each contributes as many
+ * whole units as the smallest of them has.
+ */
+int
+devstripe_create(const char *name, size_t unit, unsigned ndisks,
+		 char **disks)
+{
+	struct stripe_softc *sc;
+	struct device *disk;
+	blkcnt_t units, n;
+	unsigned i, claimed;
+	int result;
+
+	if (ndisks == 0 || unit == 0) {
+		return EINVAL;
+	}
+
+	sc = kmalloc(sizeof(*sc));
+	if (sc == NULL) {
+		return ENOMEM;
+	}
+	sc->sc_disks = kmalloc(ndisks * sizeof(struct device *));
+	if (sc->sc_disks == NULL) {
+		kfree(sc);
+		return ENOMEM;
+	}
+	sc->sc_wchan = wchan_create("stripe");
+	if (sc->sc_wchan == NULL) {
+		kfree(sc->sc_disks);
+		kfree(sc);
+		return ENOMEM;
+	}
+	spinlock_init(&sc->sc_lock);
+	devstats_init(&sc->sc_stats);
+	sc->sc_ndisks = ndisks;
+	sc->sc_unit = unit;
+
+	units = 0;
+	for (claimed=0; claimed<ndisks; claimed++) {
+		result = vfs_claimdev(disks[claimed], &disk);
+		if (result) {
+			goto fail;
+		}
+		sc->sc_disks[claimed] = disk;
+
+		if (disk->d_ops->devop_submit == NULL ||
+		    disk->d_blocksize != sc->sc_disks[0]->d_blocksize ||
+		    unit % disk->d_blocksize != 0) {
+			result = EINVAL;
+			claimed++;
+			goto fail;
+		}
+		n = disk->d_blocks / (unit / disk->d_blocksize);
+		if (claimed == 0 || n < units) {
+			units = n;
+		}
+	}
+	if (units == 0) {
+		result = EINVAL;
+		goto fail;
+	}
+
+	sc->sc_dev.d_ops = &stripe_devops;
+	sc->sc_dev.d_blocksize = sc->sc_disks[0]->d_blocksize;
+	sc->sc_dev.d_blocks = units * (unit / sc->sc_dev.d_blocksize) * ndisks;
+	sc->sc_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	sc->sc_dev.d_stats = &sc->sc_stats;
+	sc->sc_dev.d_data = sc;
+
+	result = vfs_adddev(name, &sc->sc_dev, 1);
+	if (result) {
+		goto fail;
+	}
+
+	kprintf("%s: %u disks, %lu-byte stripe unit, %llu blocks\n",
+		name, ndisks, (unsigned long)unit,
+		(unsigned long long)sc->sc_dev.d_blocks);
+	return 0;
+
+ fail:
+	for (i=0; i<claimed; i++) {
+		vfs_unclaimdev(disks[i]);
+	}
+	devstats_cleanup(&sc->sc_stats);
+	spinlock_cleanup(&sc->sc_lock);
+	wchan_destroy(sc->sc_wchan);
+	kfree(sc->sc_disks);
+	kfree(sc);
+	return result;
+}
@@ -0,0 +1,290 @@
+/*
+ * Name cache; see <namecache.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <objcache.h>
+#include <namecache.h>
+
+/*
+ * The entries are in a hash table keyed by (directory, name), and all
+ * of them are also on an LRU list, least recently used first. Up to
+ * NC_MAX entries are made; after that, adding one recycles the oldest.
+ * Names of NC_NAMELEN or more characters aren't cached, which keeps
+ * the entries small; most names are short.
+ *
+ * nc_lock protects all of this. It's only held for list surgery and
+ * comparing names, never over allocating memory.
+ */
+#define NC_BUCKETS	64
+#define NC_MAX		256
+#define NC_NAMELEN	32
+
+struct ncentry {
+	struct vnode *nc_dir;
+	ino_t nc_ino;			/* 0 if the name isn't there */
+	int nc_cookie;
+	struct ncentry *nc_hashnext;	/* next in the hash bucket */
+	struct ncentry *nc_lrunext;	/* LRU list */
+	struct ncentry **nc_lruprevp;	/* what points at us on that list */
+	char nc_name[NC_NAMELEN];
+};
+
+static struct spinlock nc_lock = SPINLOCK_INITIALIZER;
+static struct ncentry *nc_hash[NC_BUCKETS];
+static struct ncentry *nc_lru;		/* oldest first */
+static struct ncentry **nc_lrutail = &nc_lru;
+static unsigned nc_count;
+
+static struct objcache nc_cache =
+	OBJCACHE_INITIALIZER("namecache", sizeof(struct ncentry), NULL, NULL);
+
+/* Statistics, protected by nc_lock */
+static unsigned nc_hits, nc_neghits, nc_misses, nc_recycled;
+
+////////////////////////////////////////////////////////////
+// Lists
+
+/*
+ * Return the link pointing at the entry for (DIR, NAME), or at the
+ * NULL ending its chain.
+ */
+static
+struct ncentry **
+nc_find(struct vnode *dir, const char *name)
+{
+	struct ncentry **link;
+	const char *s;
+	unsigned hash;
+
+	hash = (uintptr_t)dir / sizeof(void *);
+	for (s = name; *s != 0; s++) {
+		hash = hash * 31 + (unsigned char)*s;
+	}
+
+	link = &nc_hash[hash % NC_BUCKETS];
+	while (*link != NULL &&
+	       ((*link)->nc_dir != dir || strcmp((*link)->nc_name, name))) {
+		link = &(*link)->nc_hashnext;
+	}
+	return link;
+}
+
+static
+void
+nc_lru_remove(struct ncentry *e)
+{
+	*e->nc_lruprevp = e->nc_lrunext;
+	if (e->nc_lrunext != NULL) {
+		e->nc_lrunext->nc_lruprevp = e->nc_lruprevp;
+	}
+	else {
+		nc_lrutail = e->nc_lruprevp;
+	}
+}
+
+static
+void
+nc_lru_append(struct ncentry *e)
+{
+	e->nc_lrunext = NULL;
+	e->nc_lruprevp = nc_lrutail;
+	*nc_lrutail = e;
+	nc_lrutail = &e->nc_lrunext;
+}
+
+/*
+ * Put E in the table under (DIR, NAME), which must not be there
+ * already. It goes on the LRU list when it's filled in.
+ */
+static
+void
+nc_insert(struct ncentry *e, struct vnode *dir, const char *name)
+{
+	struct ncentry **link;
+
+	e->nc_dir = dir;
+	strcpy(e->nc_name, name);
+	link = nc_find(dir, name);
+	KASSERT(*link == NULL);
+	e->nc_hashnext = NULL;
+	*link = e;
+	nc_count++;
+}
+
+/*
+ * Take E out of the table and off the LRU list.
+ */
+static
+void
+nc_unhash(struct ncentry *e)
+{
+	struct ncentry **link;
+
+	link = nc_find(e->nc_dir, e->nc_name);
+	KASSERT(*link == e);
+	*link = e->nc_hashnext;
+	nc_lru_remove(e);
+	KASSERT(nc_count > 0);
+	nc_count--;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+bool
+namecache_lookup(struct vnode *dir, const char *name,
+		 ino_t *ino, int *cookie)
+{
+	struct ncentry *e;
+
+	if (strlen(name) >= NC_NAMELEN) {
+		return false;
+	}
+
+	spinlock_acquire(&nc_lock);
+	e = *nc_find(dir, name);
+	if (e == NULL) {
+		nc_misses++;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+	nc_lru_remove(e);
+	nc_lru_append(e);
+	*ino = e->nc_ino;
+	*cookie = e->nc_cookie;
+	if (e->nc_ino != 0) {
+		nc_hits++;
+	}
+	else {
+		nc_neghits++;
+	}
+	spinlock_release(&nc_lock);
+	return true;
+}
+
+void
+namecache_enter(struct vnode *dir, const char *name, ino_t ino, int cookie)
+{
+	struct ncentry *e, *new = NULL;
+
+	if (strlen(name) >= NC_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&nc_lock);
+	e = *nc_find(dir, name);
+	if (e == NULL && nc_count < NC_MAX) {
+		spinlock_release(&nc_lock);
+		new = objcache_alloc(&nc_cache);
+		spinlock_acquire(&nc_lock);
+		/* someone else may have come along meanwhile */
+		e = *nc_find(dir, name);
+	}
+
+	if (e != NULL) {
+		/* replace it */
+		nc_lru_remove(e);
+	}
+	else if (new != NULL && nc_count < NC_MAX) {
+		e = new;
+		new = NULL;
+		nc_insert(e, dir, name);
+	}
+	else if (nc_lru != NULL) {
+		/* full, or out of memory: recycle the oldest */
+		e = nc_lru;
+		nc_unhash(e);
+		nc_insert(e, dir, name);
+		nc_recycled++;
+	}
+	else {
+		spinlock_release(&nc_lock);
+		return;
+	}
+	e->nc_ino = ino;
+	e->nc_cookie = cookie;
+	nc_lru_append(e);
+	spinlock_release(&nc_lock);
+
+	if (new != NULL) {
+		objcache_free(&nc_cache, new);
+	}
+}
+
+void
+namecache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *e;
+
+	if (strlen(name) >= NC_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&nc_lock);
+	e = *nc_find(dir, name);
+	if (e != NULL) {
+		nc_unhash(e);
+	}
+	spinlock_release(&nc_lock);
+
+	if (e != NULL) {
+		objcache_free(&nc_cache, e);
+	}
+}
+
+/*
+ * Every bucket may have some of DIR's entries, so look at them all.
+ * Chain the ones taken out together through nc_hashnext, to free
+ * once the lock is dropped.
+ */
+void
+namecache_purge(struct vnode *dir)
+{
+	struct ncentry **link;
+	struct ncentry *e, *dead = NULL;
+	unsigned i;
+
+	spinlock_acquire(&nc_lock);
+	for (i=0; i<NC_BUCKETS; i++) {
+		link = &nc_hash[i];
+		while ((e = *link) != NULL) {
+			if (e->nc_dir != dir) {
+				link = &e->nc_hashnext;
+				continue;
+			}
+			*link = e->nc_hashnext;
+			nc_lru_remove(e);
+			KASSERT(nc_count > 0);
+			nc_count--;
+			e->nc_hashnext = dead;
+			dead = e;
+		}
+	}
+	spinlock_release(&nc_lock);
+
+	while ((e = dead) != NULL) {
+		dead = e->nc_hashnext;
+		objcache_free(&nc_cache, e);
+	}
+}
+
+void
+namecache_printstats(void)
+{
+	unsigned count, hits, neghits, misses, recycled;
+
+	spinlock_acquire(&nc_lock);
+	count = nc_count;
+	hits = nc_hits;
+	neghits = nc_neghits;
+	misses = nc_misses;
+	recycled = nc_recycled;
+	spinlock_release(&nc_lock);
+
+	kprintf("Name cache: %u entries (%u kept), %u hits, "
+		"%u negative hits, %u misses, %u recycled\n",
+		count, NC_MAX, hits, neghits, misses, recycled);
+}
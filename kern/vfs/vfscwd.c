@@ -33,6 +33,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <limits.h>
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
@@ -71,6 +72,7 @@ int
 vfs_setcurdir(struct vnode *dir)
 {
 	struct vnode *old;
+	char *oldname;
 	mode_t vtype;
 	int result;
 
@@ -87,11 +89,16 @@ vfs_setcurdir(struct vnode *dir)
 	spinlock_acquire(&curproc->p_lock);
 	old = curproc->p_cwd;
 	curproc->p_cwd = dir;
+	oldname = curproc->p_cwdname;
+	curproc->p_cwdname = NULL;
 	spinlock_release(&curproc->p_lock);
 
 	if (old!=NULL) {
 		VOP_DECREF(old);
 	}
+	if (oldname!=NULL) {
+		kfree(oldname);
+	}
 
 	return 0;
 }
@@ -103,15 +110,21 @@ int
 vfs_clearcurdir(void)
 {
 	struct vnode *old;
+	char *oldname;
 
 	spinlock_acquire(&curproc->p_lock);
 	old = curproc->p_cwd;
 	curproc->p_cwd = NULL;
+	oldname = curproc->p_cwdname;
+	curproc->p_cwdname = NULL;
 	spinlock_release(&curproc->p_lock);
 
 	if (old!=NULL) {
 		VOP_DECREF(old);
 	}
+	if (oldname!=NULL) {
+		kfree(oldname);
+	}
 
 	return 0;
 }
@@ -136,49 +149,112 @@ vfs_chdir(char *path)
 }
 
 /*
- * Get current directory, as a pathname.
+ * Work out the name of the directory CWD, as device:path, into a
+ * freshly allocated string.
  * Use VOP_NAMEFILE to get the pathname and FSOP_GETVOLNAME to get the
  * volume name.
  */
+static
 int
-vfs_getcwd(struct uio *uio)
+getcwdname(struct vnode *cwd, char **ret)
 {
-	struct vnode *cwd;
-	int result;
+	struct iovec iov;
+	struct uio ku;
 	const char *name;
-	char colon=':';
-
-	KASSERT(uio->uio_rw==UIO_READ);
-
-	result = vfs_getcurdir(&cwd);
-	if (result) {
-		return result;
-	}
+	char *buf;
+	size_t len;
+	int result;
 
 	/* The current dir must be a directory, and thus it is not a device. */
 	KASSERT(cwd->vn_fs != NULL);
 
 	name = FSOP_GETVOLNAME(cwd->vn_fs);
 	if (name==NULL) {
-		vfs_biglock_acquire();
 		name = vfs_getdevname(cwd->vn_fs);
-		vfs_biglock_release();
 	}
 	KASSERT(name != NULL);
 
-	result = uiomove((char *)name, strlen(name), uio);
-	if (result) {
-		goto out;
+	buf = kmalloc(PATH_MAX);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	len = snprintf(buf, PATH_MAX, "%s:", name);
+	if (len >= PATH_MAX - 1) {
+		kfree(buf);
+		return ENAMETOOLONG;
+	}
+
+	/* Leave room for the terminating null. */
+	uio_kinit(&iov, &ku, buf + len, PATH_MAX - 1 - len, 0, UIO_READ);
+	result = VOP_NAMEFILE(cwd, &ku);
+	if (result == 0 && ku.uio_resid == 0) {
+		/* Filled the buffer; assume it didn't all fit. */
+		result = ENAMETOOLONG;
 	}
-	result = uiomove(&colon, 1, uio);
 	if (result) {
-		goto out;
+		kfree(buf);
+		return result;
 	}
+	buf[PATH_MAX - 1 - ku.uio_resid] = 0;
 
-	result = VOP_NAMEFILE(cwd, uio);
+	*ret = kstrdup(buf);
+	kfree(buf);
+	if (*ret == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
 
- out:
+/*
+ * Get current directory, as a pathname.
+ *
+ * The name is worked out once and kept in p_cwdname until the current
+ * directory changes, since the shell asks for it at every prompt. We
+ * take the cached name out of the proc while copying it out, as that
+ * can sleep, and put it back afterwards unless the current directory
+ * moved meanwhile.
+ */
+int
+vfs_getcwd(struct uio *uio)
+{
+	struct vnode *cwd;
+	char *name;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	spinlock_acquire(&curproc->p_lock);
+	cwd = curproc->p_cwd;
+	if (cwd == NULL) {
+		spinlock_release(&curproc->p_lock);
+		return ENOENT;
+	}
+	VOP_INCREF(cwd);
+	name = curproc->p_cwdname;
+	curproc->p_cwdname = NULL;
+	spinlock_release(&curproc->p_lock);
+
+	if (name == NULL) {
+		result = getcwdname(cwd, &name);
+		if (result) {
+			VOP_DECREF(cwd);
+			return result;
+		}
+	}
+
+	result = uiomove(name, strlen(name), uio);
 
+	spinlock_acquire(&curproc->p_lock);
+	if (curproc->p_cwd == cwd && curproc->p_cwdname == NULL) {
+		curproc->p_cwdname = name;
+		name = NULL;
+	}
+	spinlock_release(&curproc->p_lock);
+
+	if (name != NULL) {
+		kfree(name);
+	}
 	VOP_DECREF(cwd);
 	return result;
 }
@@ -43,6 +43,8 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <addrspace.h>
+#include "opt-tmpfs.h"
 
 /*
  * Structure for a single named device.
@@ -85,11 +87,25 @@ struct knowndev {
 /* A placeholder for kd_fs for devices used as swap */
 #define SWAP_FS	((struct fs *)-1)
 
+/* A placeholder for kd_fs for devices claimed by another device */
+#define CLAIMED_FS ((struct fs *)-2)
+
+/* Whether kd_fs is a real filesystem */
+#define ISFS(fs) ((fs) != NULL && (fs) != SWAP_FS && (fs) != CLAIMED_FS)
+
 DECLARRAY(knowndev, static __UNUSED inline);
 DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * knowndevs, and the kd_fs fields in it, are only changed holding both
+ * vfs_biglock and knowndevs_lock for writing, so either of those is
+ * enough to look at them: a read lock will do for code that doesn't
+ * otherwise need the big lock.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -112,8 +128,16 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	devnull_create();
 	semfs_bootstrap();
+#if OPT_TMPFS
+	tmpfs_bootstrap();
+#endif
 }
 
 /*
@@ -180,7 +204,7 @@ vfs_sync(void)
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		dev = knowndevarray_get(knowndevs, i);
-		if (dev->kd_fs != NULL && dev->kd_fs != SWAP_FS) {
+		if (ISFS(dev->kd_fs)) {
 			/*result =*/ FSOP_SYNC(dev->kd_fs);
 		}
 	}
@@ -215,7 +239,7 @@ vfs_getroot(const char *devname, struct vnode **ret)
 		 * and DEVNAME names the device, return ENXIO.
 		 */
 
-		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS) {
+		if (ISFS(kd->kd_fs)) {
 			const char *volname;
 			volname = FSOP_GETVOLNAME(kd->kd_fs);
 
@@ -281,8 +305,7 @@ vfs_getdevname(struct fs *fs)
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
-
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -294,9 +317,11 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
+			rwlock_release_read(knowndevs_lock);
 			return kd->kd_name;
 		}
 	}
+	rwlock_release_read(knowndevs_lock);
 
 	return NULL;
 }
@@ -364,7 +389,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
 
-		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS) {
+		if (ISFS(kd->kd_fs)) {
 			volname = FSOP_GETVOLNAME(kd->kd_fs);
 			if (samestring3(volname, n1, n2, n3)) {
 				return 1;
@@ -443,7 +468,9 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		goto fail;
 	}
 
+	rwlock_acquire_write(knowndevs_lock);
 	result = knowndevarray_add(knowndevs, kd, &index);
+	rwlock_release_write(knowndevs_lock);
 	if (result) {
 		goto fail;
 	}
@@ -499,7 +526,7 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold vfs_biglock.
  */
 static
 int
@@ -567,7 +594,9 @@ vfs_mount(const char *devname, void *data,
 	KASSERT(fs != NULL);
 	KASSERT(fs != SWAP_FS); 
 
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = fs;
+	rwlock_release_write(knowndevs_lock);
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
@@ -617,7 +646,9 @@ vfs_swapon(const char *devname, struct vnode **ret)
 
 	kprintf("vfs: Swap attached to %s\n", kd->kd_name);
 
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = SWAP_FS;
+	rwlock_release_write(knowndevs_lock);
 	VOP_INCREF(kd->kd_vnode);
 	*ret = kd->kd_vnode;
 
@@ -630,6 +661,62 @@ vfs_swapon(const char *devname, struct vnode **ret)
 	return result;
 }
 
+/*
+ * Claim a device for the use of another device built on it, such as
+ * a stripe set. Like swapon, but hands back the device itself.
+ */
+int
+vfs_claimdev(const char *devname, struct device **ret)
+{
+	struct knowndev *kd;
+	int result;
+
+	vfs_biglock_acquire();
+
+	result = findmount(devname, &kd);
+	if (result) {
+		goto out;
+	}
+
+	if (kd->kd_fs != NULL) {
+		result = EBUSY;
+		goto out;
+	}
+	KASSERT(kd->kd_rawname != NULL);
+	KASSERT(kd->kd_device != NULL);
+
+	rwlock_acquire_write(knowndevs_lock);
+	kd->kd_fs = CLAIMED_FS;
+	rwlock_release_write(knowndevs_lock);
+	*ret = kd->kd_device;
+
+ out:
+	vfs_biglock_release();
+	return result;
+}
+
+/*
+ * Give back a device taken with vfs_claimdev.
+ */
+void
+vfs_unclaimdev(const char *devname)
+{
+	struct knowndev *kd;
+	int result;
+
+	vfs_biglock_acquire();
+
+	result = findmount(devname, &kd);
+	KASSERT(result == 0);
+	KASSERT(kd->kd_fs == CLAIMED_FS);
+
+	rwlock_acquire_write(knowndevs_lock);
+	kd->kd_fs = NULL;
+	rwlock_release_write(knowndevs_lock);
+
+	vfs_biglock_release();
+}
+
 /*
  * Unmount a filesystem/device by name.
  * First calls FSOP_SYNC on the filesystem; then calls FSOP_UNMOUNT.
@@ -647,13 +734,16 @@ vfs_unmount(const char *devname)
 		goto fail;
 	}
 
-	if (kd->kd_fs == NULL || kd->kd_fs == SWAP_FS) {
+	if (!ISFS(kd->kd_fs)) {
 		result = EINVAL;
 		goto fail;
 	}
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* let go of the executables load_elf is holding on to */
+	load_elf_purge(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -668,7 +758,9 @@ vfs_unmount(const char *devname)
 	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
 
 	/* now drop the filesystem */
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = NULL;
+	rwlock_release_write(knowndevs_lock);
 
 	KASSERT(result==0);
 
@@ -705,7 +797,9 @@ vfs_swapoff(const char *devname)
 	kprintf("vfs: Swap detached from %s:\n", kd->kd_name);
 
 	/* drop it */
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = NULL;
+	rwlock_release_write(knowndevs_lock);
 
 	KASSERT(result==0);
 
@@ -737,14 +831,22 @@ vfs_unmountall(void)
 			/* not mounted */
 			continue;
 		}
+		if (dev->kd_fs == CLAIMED_FS) {
+			/* goes with the device that has it */
+			continue;
+		}
 		if (dev->kd_fs == SWAP_FS) {
 			/* just drop it */
+			rwlock_acquire_write(knowndevs_lock);
 			dev->kd_fs = NULL;
+			rwlock_release_write(knowndevs_lock);
 			continue;
 		}
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		load_elf_purge(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -777,10 +879,35 @@ vfs_unmountall(void)
 		}
 
 		/* now drop the filesystem */
+		rwlock_acquire_write(knowndevs_lock);
 		dev->kd_fs = NULL;
+		rwlock_release_write(knowndevs_lock);
 	}
 
 	vfs_biglock_release();
 
 	return 0;
 }
+
+/*
+ * Print each device's I/O statistics.
+ */
+void
+vfs_printiostats(void)
+{
+	struct knowndev *dev;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		dev = knowndevarray_get(knowndevs, i);
+		if (dev->kd_device == NULL || dev->kd_device->d_stats == NULL) {
+			continue;
+		}
+		devstats_print(dev->kd_name, dev->kd_device->d_stats);
+	}
+
+	vfs_biglock_release();
+}
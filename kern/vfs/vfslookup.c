@@ -254,7 +254,7 @@ vfs_lookparent(char *path, struct vnode **retval,
 		return result;
 	}
 
-	if (strlen(path)==0) {
+	if (path[0]==0) {
 		/*
 		 * It does not make sense to use just a device name in
 		 * a context where "lookparent" is the desired
@@ -286,7 +286,7 @@ vfs_lookup(char *path, struct vnode **retval)
 		return result;
 	}
 
-	if (strlen(path)==0) {
+	if (path[0]==0) {
 		*retval = startvn;
 		vfs_biglock_release();
 		return 0;
@@ -298,3 +298,39 @@ vfs_lookup(char *path, struct vnode **retval)
 	vfs_biglock_release();
 	return result;
 }
+
+/*
+ * Step through a path one name at a time without copying it: return
+ * the next name in *PATH, null-terminated in place, and advance *PATH
+ * past it and any slashes after it, so **PATH is 0 exactly when the
+ * name returned is the last one. Empty names, from doubled or
+ * trailing slashes, are skipped. Returns NULL when no names are left.
+ */
+char *
+vfs_nextname(char **path)
+{
+	char *s, *name;
+
+	s = *path;
+	while (*s=='/') {
+		s++;
+	}
+	if (*s==0) {
+		*path = s;
+		return NULL;
+	}
+
+	name = s;
+	while (*s!=0 && *s!='/') {
+		s++;
+	}
+	if (*s=='/') {
+		*s++ = 0;
+		while (*s=='/') {
+			s++;
+		}
+	}
+
+	*path = s;
+	return name;
+}
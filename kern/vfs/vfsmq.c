@@ -0,0 +1,403 @@
+/*
+ * Message queues.
+ *
+ * A message queue is a ring of mq_maxmsgs fixed-size slots of
+ * mq_msgsize bytes in kernel memory, with a vnode that isn't in any
+ * file system, so it is passed on by fork and goes away when its last
+ * file handle is closed. Each send puts one message in a slot and
+ * each receive takes the oldest one out whole; messages are never
+ * split or merged the way pipe data is.
+ *
+ * mq_lock covers everything, and is held over copying to and from the
+ * user's buffer. Receivers waiting for a message sleep on mq_recvcv
+ * and senders waiting for a slot on mq_sendcv, and each message sent
+ * (or slot freed) wakes just one of them, so a waiting receiver gets
+ * the message handed straight to it rather than the whole queue
+ * stampeding for it. Pollers wait on mq_pollq.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mqueue.h>
+#include <stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <poll.h>
+
+struct mqueue {
+	struct vnode mq_vn;
+	struct lock *mq_lock;
+	struct cv *mq_recvcv;		/* receivers waiting for a message */
+	struct cv *mq_sendcv;		/* senders waiting for a slot */
+	struct pollq mq_pollq;		/* pollers */
+	char *mq_slots;			/* mq_maxmsgs slots of mq_msgsize */
+	size_t *mq_lens;		/* length of the message in each */
+	unsigned mq_msgsize;		/* size of each slot */
+	unsigned mq_maxmsgs;		/* number of slots */
+	unsigned mq_head;		/* slot of the oldest message */
+	unsigned mq_count;		/* how many messages there are */
+};
+
+static const struct vnode_ops mq_vnode_ops;
+
+static
+void
+mq_destroy(struct mqueue *mq)
+{
+	kfree(mq->mq_lens);
+	kfree(mq->mq_slots);
+	pollq_cleanup(&mq->mq_pollq);
+	cv_destroy(mq->mq_sendcv);
+	cv_destroy(mq->mq_recvcv);
+	lock_destroy(mq->mq_lock);
+	kfree(mq);
+}
+
+/*
+ * Put the message in UIO in the next free slot, waiting for one
+ * unless NONBLOCK, and hand it to a waiting receiver if there is one.
+ */
+static
+int
+mq_send(struct mqueue *mq, struct uio *uio, bool nonblock)
+{
+	unsigned slot;
+	size_t len;
+	int result;
+
+	len = uio->uio_resid;
+	if (len > mq->mq_msgsize) {
+		return EMSGSIZE;
+	}
+
+	lock_acquire(mq->mq_lock);
+	while (mq->mq_count == mq->mq_maxmsgs) {
+		if (nonblock) {
+			lock_release(mq->mq_lock);
+			return EAGAIN;
+		}
+		cv_wait(mq->mq_sendcv, mq->mq_lock);
+	}
+
+	slot = (mq->mq_head + mq->mq_count) % mq->mq_maxmsgs;
+	result = uiomove(mq->mq_slots + slot * mq->mq_msgsize, len, uio);
+	if (result) {
+		/* we may have been woken for this slot; pass it on */
+		cv_signal(mq->mq_sendcv, mq->mq_lock);
+		lock_release(mq->mq_lock);
+		return result;
+	}
+	mq->mq_lens[slot] = len;
+	mq->mq_count++;
+
+	cv_signal(mq->mq_recvcv, mq->mq_lock);
+	pollq_wakeup(&mq->mq_pollq);
+	lock_release(mq->mq_lock);
+	return 0;
+}
+
+/*
+ * Take the oldest message into UIO, waiting for one unless NONBLOCK.
+ * It must all fit.
+ */
+static
+int
+mq_receive(struct mqueue *mq, struct uio *uio, bool nonblock)
+{
+	unsigned slot;
+	int result;
+
+	lock_acquire(mq->mq_lock);
+	while (mq->mq_count == 0) {
+		if (nonblock) {
+			lock_release(mq->mq_lock);
+			return EAGAIN;
+		}
+		cv_wait(mq->mq_recvcv, mq->mq_lock);
+	}
+
+	slot = mq->mq_head;
+	if (mq->mq_lens[slot] > uio->uio_resid) {
+		result = EMSGSIZE;
+	}
+	else {
+		result = uiomove(mq->mq_slots + slot * mq->mq_msgsize,
+				 mq->mq_lens[slot], uio);
+	}
+	if (result) {
+		/* the message is still there for someone else */
+		cv_signal(mq->mq_recvcv, mq->mq_lock);
+		lock_release(mq->mq_lock);
+		return result;
+	}
+	mq->mq_head = (slot + 1) % mq->mq_maxmsgs;
+	mq->mq_count--;
+
+	cv_signal(mq->mq_sendcv, mq->mq_lock);
+	pollq_wakeup(&mq->mq_pollq);
+	lock_release(mq->mq_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vnode operations
+
+static
+int
+mq_eachopen(struct vnode *v, int flags)
+{
+	/* Queues are made already open, and can't be opened by name. */
+	(void)v;
+	(void)flags;
+	return 0;
+}
+
+/*
+ * Called when the last handle has been closed.
+ */
+static
+int
+mq_reclaim(struct vnode *v)
+{
+	struct mqueue *mq = v->vn_data;
+
+	vnode_cleanup(v);
+	mq_destroy(mq);
+	return 0;
+}
+
+/*
+ * Plain read and write receive and send one message, waiting.
+ */
+static
+int
+mq_read(struct vnode *v, struct uio *uio)
+{
+	return mq_receive(v->vn_data, uio, false);
+}
+
+static
+int
+mq_write(struct vnode *v, struct uio *uio)
+{
+	return mq_send(v->vn_data, uio, false);
+}
+
+/*
+ * Poll. Readable when there's a message, writable when there's a
+ * free slot.
+ */
+static
+int
+mq_poll(struct vnode *v, struct pollentry *pe)
+{
+	struct mqueue *mq = v->vn_data;
+	int ret = 0;
+
+	lock_acquire(mq->mq_lock);
+	pollq_register(&mq->mq_pollq, pe);
+	if (mq->mq_count > 0) {
+		ret |= POLLIN;
+	}
+	if (mq->mq_count < mq->mq_maxmsgs) {
+		ret |= POLLOUT;
+	}
+	lock_release(mq->mq_lock);
+
+	return ret;
+}
+
+static
+int
+mq_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+mq_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+/*
+ * The size of a queue is how many messages are in it; the block size
+ * is the biggest message it takes.
+ */
+static
+int
+mq_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct mqueue *mq = v->vn_data;
+	int result;
+
+	bzero(statbuf, sizeof(struct stat));
+
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	if (result) {
+		return result;
+	}
+	statbuf->st_mode |= 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = mq->mq_msgsize;
+
+	lock_acquire(mq->mq_lock);
+	statbuf->st_size = mq->mq_count;
+	lock_release(mq->mq_lock);
+
+	return 0;
+}
+
+static
+bool
+mq_isseekable(struct vnode *v)
+{
+	(void)v;
+	return false;
+}
+
+static
+int
+mq_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+mq_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static const struct vnode_ops mq_vnode_ops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = mq_eachopen,
+	.vop_reclaim = mq_reclaim,
+	.vop_read = mq_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = mq_write,
+	.vop_ioctl = mq_ioctl,
+	.vop_stat = mq_stat,
+	.vop_gettype = mq_gettype,
+	.vop_isseekable = mq_isseekable,
+	.vop_fsync = mq_fsync,
+	.vop_mmap = vopfail_mmap_perm,
+	.vop_truncate = mq_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_namefile = vopfail_uio_notdir,
+	.vop_poll = mq_poll,
+
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Make a message queue of MAXMSGS slots of MSGSIZE bytes. It comes
+ * with one reference, to be dropped with vfs_close like an opened
+ * file.
+ */
+int
+vfs_mqueue(unsigned msgsize, unsigned maxmsgs, struct vnode **ret)
+{
+	struct mqueue *mq;
+
+	if (msgsize == 0 || msgsize > MQ_MSGSIZE_MAX ||
+	    maxmsgs == 0 || maxmsgs > MQ_MAXMSG_MAX ||
+	    msgsize * maxmsgs > MQ_BYTES_MAX) {
+		return EINVAL;
+	}
+
+	mq = kmalloc(sizeof(*mq));
+	if (mq == NULL) {
+		goto fail_total;
+	}
+	mq->mq_slots = kmalloc(msgsize * maxmsgs);
+	if (mq->mq_slots == NULL) {
+		goto fail_mq;
+	}
+	mq->mq_lens = kmalloc(maxmsgs * sizeof(size_t));
+	if (mq->mq_lens == NULL) {
+		goto fail_slots;
+	}
+	mq->mq_lock = lock_create("mqueue");
+	if (mq->mq_lock == NULL) {
+		goto fail_lens;
+	}
+	mq->mq_recvcv = cv_create("mqueue recv");
+	if (mq->mq_recvcv == NULL) {
+		goto fail_lock;
+	}
+	mq->mq_sendcv = cv_create("mqueue send");
+	if (mq->mq_sendcv == NULL) {
+		goto fail_recvcv;
+	}
+	pollq_init(&mq->mq_pollq);
+	mq->mq_msgsize = msgsize;
+	mq->mq_maxmsgs = maxmsgs;
+	mq->mq_head = 0;
+	mq->mq_count = 0;
+
+	vnode_init(&mq->mq_vn, &mq_vnode_ops, NULL, mq);
+	*ret = &mq->mq_vn;
+	return 0;
+
+ fail_recvcv:
+	cv_destroy(mq->mq_recvcv);
+ fail_lock:
+	lock_destroy(mq->mq_lock);
+ fail_lens:
+	kfree(mq->mq_lens);
+ fail_slots:
+	kfree(mq->mq_slots);
+ fail_mq:
+	kfree(mq);
+ fail_total:
+	return ENOMEM;
+}
+
+/*
+ * Send or receive one message on the queue VN, for the mq_send and
+ * mq_receive system calls. EINVAL if VN isn't a queue.
+ */
+int
+vfs_mqueue_send(struct vnode *vn, struct uio *uio, bool nonblock)
+{
+	if (vn->vn_ops != &mq_vnode_ops) {
+		return EINVAL;
+	}
+	return mq_send(vn->vn_data, uio, nonblock);
+}
+
+int
+vfs_mqueue_receive(struct vnode *vn, struct uio *uio, bool nonblock)
+{
+	if (vn->vn_ops != &mq_vnode_ops) {
+		return EINVAL;
+	}
+	return mq_receive(vn->vn_data, uio, nonblock);
+}
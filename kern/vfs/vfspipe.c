@@ -0,0 +1,498 @@
+/*
+ * Pipes.
+ *
+ * A pipe is a ring buffer of PIPE_SIZE bytes with two vnodes, one for
+ * each end; neither is in any file system. Since a vnode is reclaimed
+ * when its last reference goes, that tells us when the last reader or
+ * the last writer has closed: readers then get EOF once the buffer is
+ * drained, and writers get EPIPE. The pipe itself goes when both ends
+ * have.
+ *
+ * p_lock covers everything, and is held over copying to and from the
+ * user's buffer; readers and writers that have to wait do so on
+ * p_cv, and pollers of either end on p_pollq. A write of up to PIPE_BUF bytes waits until there's room for
+ * all of it and then copies it at once, so it can't be interleaved
+ * with other writers'; a longer one takes whatever room there is as
+ * it goes.
+ *
+ * A writer handing over a whole page of its memory when the pipe is
+ * empty lends it instead (see vm_loan_page), and the lent page stands
+ * in for the buffer until it has been read. A reader taking all of it
+ * into a whole page of its own gets it mapped there, so for large
+ * aligned transfers nothing is copied at all. Until the lent page is
+ * used up writers wait as if the pipe were full.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <stat.h>
+#include <limits.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vm.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <poll.h>
+#include "opt-dumbvm.h"
+
+#define PIPE_SIZE PAGE_SIZE
+
+struct pipe {
+	struct vnode p_readvn;
+	struct vnode p_writevn;
+	struct lock *p_lock;
+	struct cv *p_cv;
+	struct pollq p_pollq;		/* pollers, on either end */
+	char *p_buf;
+	paddr_t p_loan;			/* lent page in place of p_buf, or 0 */
+	unsigned p_head;		/* where the data starts */
+	unsigned p_count;		/* how much there is */
+	bool p_readopen;		/* read end not reclaimed yet */
+	bool p_writeopen;		/* write end not reclaimed yet */
+};
+
+static const struct vnode_ops pipe_vnode_ops;
+
+static
+void
+pipe_destroy(struct pipe *p)
+{
+	if (p->p_loan != 0) {
+		free_kpages(PADDR_TO_KVADDR(p->p_loan));
+	}
+	kfree(p->p_buf);
+	pollq_cleanup(&p->p_pollq);
+	cv_destroy(p->p_cv);
+	lock_destroy(p->p_lock);
+	kfree(p);
+}
+
+/*
+ * Something has changed; wake whoever is waiting, in read, write, or
+ * poll.
+ */
+static
+void
+pipe_wakeup(struct pipe *p)
+{
+	cv_broadcast(p->p_cv, p->p_lock);
+	pollq_wakeup(&p->p_pollq);
+}
+
+/*
+ * Move up to LEN bytes between the ring at offset POS and UIO, in at
+ * most two pieces.
+ */
+static
+int
+pipe_uiomove(struct pipe *p, unsigned pos, unsigned len, struct uio *uio)
+{
+	char *buf;
+	unsigned amt;
+	int result;
+
+	buf = p->p_loan != 0 ? (char *)PADDR_TO_KVADDR(p->p_loan) : p->p_buf;
+	while (len > 0) {
+		pos %= PIPE_SIZE;
+		amt = len;
+		if (amt > PIPE_SIZE - pos) {
+			amt = PIPE_SIZE - pos;
+		}
+		result = uiomove(buf + pos, amt, uio);
+		if (result) {
+			return result;
+		}
+		pos += amt;
+		len -= amt;
+	}
+	return 0;
+}
+
+/*
+ * Lend the next page of UIO to the pipe, which must be empty, if it
+ * is a whole page.
+ */
+static
+bool
+pipe_lend(struct pipe *p, struct uio *uio)
+{
+#if OPT_DUMBVM
+	(void)p;
+	(void)uio;
+	return false;
+#else
+	vaddr_t page;
+
+	KASSERT(p->p_count == 0 && p->p_loan == 0);
+	if (!uio_userpage(uio, &page) ||
+	    vm_loan_page(uio->uio_space, page, &p->p_loan)) {
+		return false;
+	}
+	uio_skip(uio, PAGE_SIZE);
+	p->p_head = 0;
+	p->p_count = PIPE_SIZE;
+	return true;
+#endif
+}
+
+/*
+ * Map the lent page into UIO, if it's all still there and UIO wants
+ * a whole page. The pipe is left empty.
+ */
+static
+bool
+pipe_flip(struct pipe *p, struct uio *uio)
+{
+#if OPT_DUMBVM
+	(void)p;
+	(void)uio;
+	return false;
+#else
+	vaddr_t page;
+
+	if (p->p_loan == 0 || p->p_count != PIPE_SIZE ||
+	    !uio_userpage(uio, &page) ||
+	    vm_accept_page(uio->uio_space, page, p->p_loan)) {
+		return false;
+	}
+	uio_skip(uio, PAGE_SIZE);
+	p->p_loan = 0;
+	p->p_head = 0;
+	p->p_count = 0;
+	return true;
+#endif
+}
+
+////////////////////////////////////////////////////////////
+// vnode operations
+
+static
+int
+pipe_eachopen(struct vnode *v, int flags)
+{
+	/* Pipes are made already open, and can't be opened by name. */
+	(void)v;
+	(void)flags;
+	return 0;
+}
+
+/*
+ * Called when one end has been closed for the last time.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *p = v->vn_data;
+	bool gone;
+
+	lock_acquire(p->p_lock);
+	if (v == &p->p_readvn) {
+		KASSERT(p->p_readopen);
+		p->p_readopen = false;
+	}
+	else {
+		KASSERT(v == &p->p_writevn);
+		KASSERT(p->p_writeopen);
+		p->p_writeopen = false;
+	}
+	vnode_cleanup(v);
+	pipe_wakeup(p);
+	gone = !p->p_readopen && !p->p_writeopen;
+	lock_release(p->p_lock);
+
+	if (gone) {
+		pipe_destroy(p);
+	}
+	return 0;
+}
+
+/*
+ * Read: wait for there to be something, unless there are no writers
+ * left, then take as much as there is, up to what was asked for.
+ */
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	unsigned amt;
+	int result;
+
+	if (v != &p->p_readvn) {
+		return EBADF;
+	}
+
+	lock_acquire(p->p_lock);
+	while (p->p_count == 0 && p->p_writeopen) {
+		cv_wait(p->p_cv, p->p_lock);
+	}
+
+	if (pipe_flip(p, uio)) {
+		pipe_wakeup(p);
+		lock_release(p->p_lock);
+		return 0;
+	}
+
+	amt = p->p_count;
+	if (amt > uio->uio_resid) {
+		amt = uio->uio_resid;
+	}
+	result = pipe_uiomove(p, p->p_head, amt, uio);
+	if (result == 0) {
+		p->p_head = (p->p_head + amt) % PIPE_SIZE;
+		p->p_count -= amt;
+		if (p->p_count == 0 && p->p_loan != 0) {
+			/* back to the buffer */
+			free_kpages(PADDR_TO_KVADDR(p->p_loan));
+			p->p_loan = 0;
+			p->p_head = 0;
+		}
+		pipe_wakeup(p);
+	}
+	lock_release(p->p_lock);
+	return result;
+}
+
+/*
+ * Write: wait for room, all at once for writes of up to PIPE_BUF
+ * bytes and a piece at a time for longer ones, and fail with EPIPE
+ * if the readers have gone. Once something has been written that's
+ * reported instead of the error.
+ */
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	size_t want, amt;
+	bool wrote = false;
+	int result = 0;
+
+	if (v != &p->p_writevn) {
+		return EBADF;
+	}
+
+	want = uio->uio_resid <= PIPE_BUF ? uio->uio_resid : 1;
+
+	lock_acquire(p->p_lock);
+	while (uio->uio_resid > 0) {
+		while (p->p_readopen &&
+		       (p->p_loan != 0 || PIPE_SIZE - p->p_count < want)) {
+			cv_wait(p->p_cv, p->p_lock);
+		}
+		if (!p->p_readopen) {
+			result = wrote ? 0 : EPIPE;
+			break;
+		}
+
+		if (p->p_count == 0 && pipe_lend(p, uio)) {
+			wrote = true;
+			want = 1;
+			pipe_wakeup(p);
+			continue;
+		}
+
+		amt = PIPE_SIZE - p->p_count;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
+		}
+		result = pipe_uiomove(p, p->p_head + p->p_count, amt, uio);
+		if (result) {
+			break;
+		}
+		p->p_count += amt;
+		wrote = true;
+		want = 1;
+		pipe_wakeup(p);
+	}
+	lock_release(p->p_lock);
+	return result;
+}
+
+/*
+ * Poll. The read end is ready when there's something to read, and
+ * gets POLLHUP once the writers have gone; the write end is ready
+ * when a write of PIPE_BUF bytes wouldn't wait, and gets POLLERR once
+ * the readers have gone.
+ */
+static
+int
+pipe_poll(struct vnode *v, struct pollentry *pe)
+{
+	struct pipe *p = v->vn_data;
+	int ret = 0;
+
+	lock_acquire(p->p_lock);
+	pollq_register(&p->p_pollq, pe);
+	if (v == &p->p_readvn) {
+		if (p->p_count > 0) {
+			ret |= POLLIN;
+		}
+		if (!p->p_writeopen) {
+			ret |= POLLHUP;
+		}
+	}
+	else if (!p->p_readopen) {
+		ret |= POLLERR;
+	}
+	else if (p->p_loan == 0 && PIPE_SIZE - p->p_count >= PIPE_BUF) {
+		ret |= POLLOUT;
+	}
+	lock_release(p->p_lock);
+
+	return ret;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+/*
+ * The size of a pipe is how much is in it.
+ */
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *p = v->vn_data;
+	int result;
+
+	bzero(statbuf, sizeof(struct stat));
+
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	if (result) {
+		return result;
+	}
+	statbuf->st_mode |= 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = PIPE_BUF;
+
+	lock_acquire(p->p_lock);
+	statbuf->st_size = p->p_count;
+	lock_release(p->p_lock);
+
+	return 0;
+}
+
+static
+bool
+pipe_isseekable(struct vnode *v)
+{
+	(void)v;
+	return false;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+	.vop_read = pipe_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = pipe_write,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_mmap = vopfail_mmap_perm,
+	.vop_truncate = pipe_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_namefile = vopfail_uio_notdir,
+	.vop_poll = pipe_poll,
+
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Make a pipe. Each end comes with one reference, to be dropped with
+ * vfs_close like an opened file.
+ */
+int
+vfs_pipe(struct vnode **readvn, struct vnode **writevn)
+{
+	struct pipe *p;
+
+	p = kmalloc(sizeof(*p));
+	if (p == NULL) {
+		return ENOMEM;
+	}
+	p->p_buf = kmalloc(PIPE_SIZE);
+	if (p->p_buf == NULL) {
+		kfree(p);
+		return ENOMEM;
+	}
+	p->p_lock = lock_create("pipe");
+	if (p->p_lock == NULL) {
+		kfree(p->p_buf);
+		kfree(p);
+		return ENOMEM;
+	}
+	p->p_cv = cv_create("pipe");
+	if (p->p_cv == NULL) {
+		lock_destroy(p->p_lock);
+		kfree(p->p_buf);
+		kfree(p);
+		return ENOMEM;
+	}
+	pollq_init(&p->p_pollq);
+	p->p_loan = 0;
+	p->p_head = 0;
+	p->p_count = 0;
+	p->p_readopen = true;
+	p->p_writeopen = true;
+
+	vnode_init(&p->p_readvn, &pipe_vnode_ops, NULL, p);
+	vnode_init(&p->p_writevn, &pipe_vnode_ops, NULL, p);
+
+	*readvn = &p->p_readvn;
+	*writevn = &p->p_writevn;
+	return 0;
+}
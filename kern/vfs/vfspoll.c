@@ -0,0 +1,211 @@
+/*
+ * Poll queues and sets; see <poll.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <vnode.h>
+#include <poll.h>
+
+/*
+ * ps_lock covers ps_woken and ps_timedout and goes with ps_wchan. It
+ * is taken inside a pollq's pq_lock by pollq_wakeup, and inside the
+ * clock's timer lock by pollset_expire, so neither may be taken while
+ * holding it.
+ */
+struct pollset {
+	struct spinlock ps_lock;
+	struct wchan *ps_wchan;
+	bool ps_woken;			/* a queue was woken since the wait */
+	bool ps_timedout;
+	bool ps_hastimer;
+	struct clocktimer ps_timer;
+	unsigned ps_n;
+	struct pollentry ps_entries[];
+};
+
+////////////////////////////////////////////////////////////
+// Queues
+
+void
+pollq_init(struct pollq *pq)
+{
+	spinlock_init(&pq->pq_lock);
+	pq->pq_entries = NULL;
+}
+
+void
+pollq_cleanup(struct pollq *pq)
+{
+	KASSERT(pq->pq_entries == NULL);
+	spinlock_cleanup(&pq->pq_lock);
+}
+
+void
+pollq_register(struct pollq *pq, struct pollentry *pe)
+{
+	if (pe == NULL || pe->pe_q == pq) {
+		return;
+	}
+	/* the files are held, so an entry only ever polls one object */
+	KASSERT(pe->pe_q == NULL);
+
+	spinlock_acquire(&pq->pq_lock);
+	pe->pe_q = pq;
+	pe->pe_next = pq->pq_entries;
+	pe->pe_prevp = &pq->pq_entries;
+	if (pe->pe_next != NULL) {
+		pe->pe_next->pe_prevp = &pe->pe_next;
+	}
+	pq->pq_entries = pe;
+	spinlock_release(&pq->pq_lock);
+}
+
+void
+pollq_wakeup(struct pollq *pq)
+{
+	struct pollentry *pe;
+	struct pollset *ps;
+
+	spinlock_acquire(&pq->pq_lock);
+	for (pe = pq->pq_entries; pe != NULL; pe = pe->pe_next) {
+		ps = pe->pe_set;
+		spinlock_acquire(&ps->ps_lock);
+		ps->ps_woken = true;
+		wchan_wakeall(ps->ps_wchan, &ps->ps_lock);
+		spinlock_release(&ps->ps_lock);
+	}
+	spinlock_release(&pq->pq_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Sets
+
+struct pollset *
+pollset_create(unsigned n)
+{
+	struct pollset *ps;
+	unsigned i;
+
+	ps = kmalloc(sizeof(*ps) + n * sizeof(ps->ps_entries[0]));
+	if (ps == NULL) {
+		return NULL;
+	}
+	ps->ps_wchan = wchan_create("poll");
+	if (ps->ps_wchan == NULL) {
+		kfree(ps);
+		return NULL;
+	}
+	spinlock_init(&ps->ps_lock);
+	ps->ps_woken = false;
+	ps->ps_timedout = false;
+	ps->ps_hastimer = false;
+	ps->ps_n = n;
+	for (i=0; i<n; i++) {
+		ps->ps_entries[i].pe_set = ps;
+		ps->ps_entries[i].pe_q = NULL;
+		ps->ps_entries[i].pe_next = NULL;
+		ps->ps_entries[i].pe_prevp = NULL;
+	}
+	return ps;
+}
+
+struct pollentry *
+pollset_entry(struct pollset *ps, unsigned i)
+{
+	KASSERT(i < ps->ps_n);
+	return &ps->ps_entries[i];
+}
+
+/*
+ * Timer function: called from the timer interrupt.
+ */
+static
+void
+pollset_expire(void *data)
+{
+	struct pollset *ps = data;
+
+	spinlock_acquire(&ps->ps_lock);
+	ps->ps_timedout = true;
+	wchan_wakeall(ps->ps_wchan, &ps->ps_lock);
+	spinlock_release(&ps->ps_lock);
+}
+
+void
+pollset_timeout(struct pollset *ps, const struct timespec *ts)
+{
+	KASSERT(!ps->ps_hastimer);
+	ps->ps_hastimer = true;
+	clocktimer_start(&ps->ps_timer, ts, pollset_expire, ps);
+}
+
+/*
+ * If we were woken and the time also ran out, say we were woken, so
+ * the caller looks again; the next wait returns false at once.
+ */
+bool
+pollset_wait(struct pollset *ps)
+{
+	bool woken;
+
+	spinlock_acquire(&ps->ps_lock);
+	while (!ps->ps_woken && !ps->ps_timedout) {
+		wchan_sleep(ps->ps_wchan, &ps->ps_lock);
+	}
+	woken = ps->ps_woken;
+	ps->ps_woken = false;
+	spinlock_release(&ps->ps_lock);
+
+	return woken;
+}
+
+void
+pollset_destroy(struct pollset *ps)
+{
+	struct pollentry *pe;
+	struct pollq *pq;
+	unsigned i;
+
+	if (ps->ps_hastimer) {
+		clocktimer_stop(&ps->ps_timer);
+	}
+
+	/* once off the queues, nobody else can be looking at us */
+	for (i=0; i<ps->ps_n; i++) {
+		pe = &ps->ps_entries[i];
+		pq = pe->pe_q;
+		if (pq == NULL) {
+			continue;
+		}
+		spinlock_acquire(&pq->pq_lock);
+		*pe->pe_prevp = pe->pe_next;
+		if (pe->pe_next != NULL) {
+			pe->pe_next->pe_prevp = pe->pe_prevp;
+		}
+		spinlock_release(&pq->pq_lock);
+		pe->pe_q = NULL;
+	}
+
+	spinlock_cleanup(&ps->ps_lock);
+	wchan_destroy(ps->ps_wchan);
+	kfree(ps);
+}
+
+////////////////////////////////////////////////////////////
+// Common vop_poll
+
+/*
+ * For objects that never block, like regular files and directories:
+ * always ready, and there's nothing to wait on.
+ */
+int
+vopnull_poll(struct vnode *vn, struct pollentry *pe)
+{
+	(void)vn;
+	(void)pe;
+	return POLLIN | POLLOUT;
+}
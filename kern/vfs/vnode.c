@@ -33,6 +33,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <stat.h>
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
@@ -48,8 +49,8 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	KASSERT(ops != NULL);
 
 	vn->vn_ops = ops;
-	vn->vn_refcount = 1;
-	spinlock_init(&vn->vn_countlock);
+	atomic_set(&vn->vn_refcount, 1);
+	atomic_set(&vn->vn_wgen, 0);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
 	return 0;
@@ -61,12 +62,10 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 void
 vnode_cleanup(struct vnode *vn)
 {
-	KASSERT(vn->vn_refcount == 1);
-
-	spinlock_cleanup(&vn->vn_countlock);
+	KASSERT(atomic_get(&vn->vn_refcount) == 1);
 
 	vn->vn_ops = NULL;
-	vn->vn_refcount = 0;
+	atomic_set(&vn->vn_refcount, 0);
 	vn->vn_fs = NULL;
 	vn->vn_data = NULL;
 }
@@ -81,9 +80,38 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	spinlock_acquire(&vn->vn_countlock);
-	vn->vn_refcount++;
-	spinlock_release(&vn->vn_countlock);
+	atomic_inc(&vn->vn_refcount);
+}
+
+/*
+ * Note a change to the file.
+ * Called by VOP_WRITE and VOP_TRUNCATE, after the operation, even if
+ * it failed, since it might have done part of the job.
+ */
+int
+vnode_wrote(struct vnode *vn, int result)
+{
+	atomic_inc(&vn->vn_wgen);
+	return result;
+}
+
+/*
+ * Decrement refcount unless it's the last reference.
+ * Called by VOP_DECREF and VOP_RECLAIM.
+ */
+bool
+vnode_decref_unless_last(struct vnode *vn)
+{
+	int count;
+
+	do {
+		count = atomic_get(&vn->vn_refcount);
+		KASSERT(count > 0);
+		if (count == 1) {
+			return false;
+		}
+	} while (atomic_cmpxchg(&vn->vn_refcount, count, count - 1) != count);
+	return true;
 }
 
 /*
@@ -99,18 +127,8 @@ vnode_decref(struct vnode *vn)
 
 	KASSERT(vn != NULL);
 
-	spinlock_acquire(&vn->vn_countlock);
-
-	KASSERT(vn->vn_refcount > 0);
-	if (vn->vn_refcount > 1) {
-		vn->vn_refcount--;
-		destroy = false;
-	}
-	else {
-		/* Don't decrement; pass the reference to VOP_RECLAIM. */
-		destroy = true;
-	}
-	spinlock_release(&vn->vn_countlock);
+	/* If it's the last, don't decrement; pass the reference to VOP_RECLAIM. */
+	destroy = !vnode_decref_unless_last(vn);
 
 	if (destroy) {
 		result = VOP_RECLAIM(vn);
@@ -129,6 +147,8 @@ vnode_decref(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
+	int refcount;
+
 	/* not safe, and not really needed to check constant fields */
 	/*vfs_biglock_acquire();*/
 
@@ -159,20 +179,39 @@ vnode_check(struct vnode *v, const char *opstr)
 		panic("vnode_check: vop_%s: deadbeef fs pointer\n", opstr);
 	}
 
-	spinlock_acquire(&v->vn_countlock);
-
-	if (v->vn_refcount < 0) {
+	refcount = atomic_get(&v->vn_refcount);
+	if (refcount < 0) {
 		panic("vnode_check: vop_%s: negative refcount %d\n", opstr,
-		      v->vn_refcount);
+		      refcount);
 	}
-	else if (v->vn_refcount == 0) {
+	else if (refcount == 0) {
 		panic("vnode_check: vop_%s: zero refcount\n", opstr);
 	}
-	else if (v->vn_refcount > 0x100000) {
+	else if (refcount > 0x100000) {
 		kprintf("vnode_check: vop_%s: warning: large refcount %d\n",
-			opstr, v->vn_refcount);
+			opstr, refcount);
 	}
 
-	spinlock_release(&v->vn_countlock);
 	/*vfs_biglock_release();*/
 }
+
+/*
+ * Common vop_seekhole, for objects that are all data: POS itself, or
+ * the end.
+ */
+int
+vopnull_seekhole(struct vnode *vn, off_t pos, bool hole, off_t *result)
+{
+	struct stat st;
+	int err;
+
+	err = VOP_STAT(vn, &st);
+	if (err) {
+		return err;
+	}
+	if (pos >= st.st_size) {
+		return ENXIO;
+	}
+	*result = hole ? st.st_size : pos;
+	return 0;
+}
@@ -29,15 +29,22 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/vmstat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <swap.h>
 #include <proc.h>
+#include <vnode.h>
 #include <elf.h>
+#include <objcache.h>
+#include <kinfo.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -52,189 +59,536 @@
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+// one of each per process, so they get their own caches rather than kmalloc size classes
+static struct objcache addrspace_cache =
+    OBJCACHE_INITIALIZER("addrspace", sizeof(struct addrspace), NULL, NULL);
+static struct objcache page_table_cache =
+    OBJCACHE_INITIALIZER("pagetable", sizeof(PageTable), NULL, NULL);
+
 static PageTable *
 page_table_init(void) {
-    PageTable *page_table = kmalloc(sizeof(PageTable));
+    PageTable *page_table = objcache_alloc(&page_table_cache);
     if (page_table == NULL) {
         return NULL;
     }
 
-    for (int i = 0; i < 1 << L1_BITS; i++) {
-        page_table->tables[i] = NULL;
-    }
+#if OPT_HASHPT
+    page_table->entries = NULL;
+    page_table->nentries = 0;
+#else
+    // start with no L2 tables and no full directory
+    page_table->nslots = 0;
+    page_table->directory = NULL;
+    page_table->dir_occupancy = NULL;
+#endif
 
     return page_table;
 }
 
+/*
+ * Resident frames are handed back FREE_BATCH at a time, so tearing down
+ * a big process doesn't take the frame table lock once per page.
+ */
+#define FREE_BATCH 64
+
+/*
+ * Drop every page in PAGE_TABLE, leaving it empty but still allocated
+ * for reuse (see as_reset). Call with the VM lock held.
+ */
+#if OPT_HASHPT
+
+static void
+page_table_clear(struct addrspace *as, PageTable *page_table) {
+    struct hashpt_entry *cursor = NULL;
+    paddr_t batch[FREE_BATCH];
+    vaddr_t batch_vaddrs[FREE_BATCH];
+    unsigned nbatch = 0;
+    vaddr_t vaddr;
+    PTE *pte;
+
+    while ((pte = page_table_next_entry(page_table, &cursor, &vaddr)) != NULL) {
+        if (PTE_VALID(pte)) {
+            batch[nbatch] = pte->frame & PAGE_FRAME;
+            batch_vaddrs[nbatch] = vaddr;
+            nbatch++;
+            if (nbatch == FREE_BATCH) {
+                frame_unmap_batch(as, batch, batch_vaddrs, nbatch);
+                nbatch = 0;
+            }
+        } else if (PTE_IS_SWAPPED(pte)) {
+            swap_free(PTE_SWAP_SLOT(pte));
+        }
+    }
+    frame_unmap_batch(as, batch, batch_vaddrs, nbatch);
+    page_table_free_entries(page_table);
+}
+
 static void
-page_table_destroy(PageTable *page_table) {
-    for (int i = 0; i < 1 << L1_BITS; i++) {
-        if (page_table->tables[i] != NULL) {
-            for (int j = 0; j < 1 << L2_BITS; j++) {
-                if (page_table->tables[i]->entries[j] != NULL) {
-                    // Free the frame
-                    paddr_t frame = page_table->tables[i]->entries[j]->frame;
-                    vaddr_t page = PADDR_TO_KVADDR(frame & PAGE_FRAME);
-                    free_kpages(page);
-                    kfree(page_table->tables[i]->entries[j]);
-                    page_table->tables[i]->entries[j] = NULL;
+page_table_destroy(struct addrspace *as, PageTable *page_table) {
+    page_table_clear(as, page_table);
+    objcache_free(&page_table_cache, page_table);
+}
+
+#else
+
+static void
+page_table_clear(struct addrspace *as, PageTable *page_table) {
+    unsigned cursor = 0, l1_index;
+    L2Table *l2;
+    paddr_t batch[FREE_BATCH];
+    vaddr_t batch_vaddrs[FREE_BATCH];
+    unsigned nbatch = 0;
+
+    while (page_table_next_l2(page_table, &cursor, &l1_index, &l2)) {
+        struct l2_occupancy *occ = page_table_get_occupancy(page_table, l1_index);
+        unsigned seen = 0;
+        for (int j = 0; j < 1 << L2_BITS && seen < occ->live; j++) {
+            if (!L2_GROUP_MAYBE_LIVE(occ, j)) {
+                j |= L2_GROUP_SIZE - 1; // nothing in this group
+                continue;
+            }
+            if (l2->entries[j].frame != 0) {
+                seen++;
+            }
+            if (PTE_VALID(&l2->entries[j])) {
+                // Drop our reference to the frame (freed once unshared)
+                batch[nbatch] = l2->entries[j].frame & PAGE_FRAME;
+                batch_vaddrs[nbatch] = ((vaddr_t)l1_index << (L2_BITS + OFFSET_BITS)) |
+                                       ((vaddr_t)j << OFFSET_BITS);
+                nbatch++;
+                if (nbatch == FREE_BATCH) {
+                    frame_unmap_batch(as, batch, batch_vaddrs, nbatch);
+                    nbatch = 0;
                 }
+            } else if (PTE_IS_SWAPPED(&l2->entries[j])) {
+                swap_free(PTE_SWAP_SLOT(&l2->entries[j]));
             }
-            kfree(page_table->tables[i]);
-            page_table->tables[i] = NULL;
         }
+        kfree(l2);
+    }
+    frame_unmap_batch(as, batch, batch_vaddrs, nbatch);
+    if (page_table->directory != NULL) {
+        // keep the directory, now that we know it's needed
+        bzero(page_table->directory, (sizeof(L2Table *) + sizeof(struct l2_occupancy)) << L1_BITS);
     }
-    kfree(page_table);
+    page_table->nslots = 0;
 }
 
-// for fork, copy page table and alloc new frames
-static PageTable *
-page_table_copy(PageTable *old) {
-    PageTable *new = page_table_init();
-    if (new == NULL) {
-        return NULL;
+static void
+page_table_destroy(struct addrspace *as, PageTable *page_table) {
+    page_table_clear(as, page_table);
+    if (page_table->directory != NULL) {
+        kfree(page_table->directory); // and dir_occupancy with it
+    }
+    objcache_free(&page_table_cache, page_table);
+}
+
+#endif /* OPT_HASHPT */
+
+/*
+ * For fork, share every resident frame between OLD and NEW copy-on-write.
+ *
+ * Both page tables end up pointing at the same frames with the dirty
+ * (writeable) bit cleared, and each frame picks up one extra reference,
+ * with both mappings noted in its reverse map (see frame_share).
+ * The first write by either side takes a VM_FAULT_READONLY, which is
+ * resolved by vm_fault making a private copy (or, if the other side
+ * has already let go of the frame, simply turning the dirty bit back on).
+ *
+ * Pages that are out on swap can't be shared this way; the child gets
+ * its own copy of the swap slot.
+ *
+ * NEW must be empty. On failure NEW may be partially filled in; the
+ * caller should destroy it.
+ */
+#if OPT_HASHPT
+
+static int
+page_table_copy(struct addrspace *old_as, struct addrspace *new_as) {
+    struct hashpt_entry *cursor = NULL;
+    vaddr_t vaddr;
+    PTE *old_pte;
+
+    while ((old_pte = page_table_next_entry(old_as->page_table, &cursor, &vaddr)) != NULL) {
+        if (!PTE_VALID(old_pte) && !PTE_IS_SWAPPED(old_pte)) {
+            continue;
+        }
+        PTE *new_pte = page_table_find(new_as->page_table, vaddr, true);
+        if (new_pte == NULL) {
+            return ENOMEM;
+        }
+        if (PTE_VALID(old_pte)) {
+            // write-protect the parent's mapping and share the frame with the child
+            old_pte->frame &= ~TLBLO_DIRTY;
+            frame_share(old_pte->frame & PAGE_FRAME, old_as, vaddr, new_as, vaddr);
+            new_pte->frame = old_pte->frame & ~PTE_LOCKED;
+            vmstat_inc(VMSTAT_FORK_SHARED);
+        } else {
+            unsigned slot;
+            int result = swap_copy(PTE_SWAP_SLOT(old_pte), &slot);
+            if (result) {
+                return result;
+            }
+            new_pte->frame = PTE_MAKE_SWAPPED(slot);
+            vmstat_inc(VMSTAT_FORK_SWAPCOPIES);
+        }
     }
 
-    for (int i = 0; i < 1 << L1_BITS; i++) {
-        if (old->tables[i] != NULL) {
-            new->tables[i] = kmalloc(sizeof(*new->tables[i]));
-            if (new->tables[i] == NULL) {
-                page_table_destroy(new);
-                return NULL;
+    return 0;
+}
+
+static int
+page_table_identical(PageTable *pt1, PageTable *pt2) {
+    struct hashpt_entry *cursor;
+    unsigned count1 = 0, count2 = 0;
+    vaddr_t vaddr;
+    PTE *a;
+
+    cursor = NULL;
+    while ((a = page_table_next_entry(pt2, &cursor, &vaddr)) != NULL) {
+        if (a->frame != 0) {
+            count2++;
+        }
+    }
+
+    cursor = NULL;
+    while ((a = page_table_next_entry(pt1, &cursor, &vaddr)) != NULL) {
+        if (a->frame == 0) {
+            continue;
+        }
+        PTE *b = page_table_find(pt2, vaddr, false);
+        if (b == NULL) {
+            return 0;
+        }
+        if (!(PTE_IS_SWAPPED(a) && PTE_IS_SWAPPED(b)) &&
+            ((a->frame ^ b->frame) & ~PTE_LOCKED) != 0) {
+            return 0;
+        }
+        count1++;
+    }
+
+    return count1 == count2;
+}
+
+#else
+
+static int
+page_table_copy(struct addrspace *old_as, struct addrspace *new_as) {
+    PageTable *old = old_as->page_table, *new = new_as->page_table;
+    unsigned cursor = 0, l1_index;
+    L2Table *old_l2;
+
+    while (page_table_next_l2(old, &cursor, &l1_index, &old_l2)) {
+        struct l2_occupancy *old_occ = page_table_get_occupancy(old, l1_index);
+        if (old_occ->live == 0) {
+            continue; // emptied since; the child can do without
+        }
+
+        L2Table *new_l2 = kmalloc(sizeof(*new_l2));
+        if (new_l2 == NULL) {
+            return ENOMEM;
+        }
+        bzero(new_l2, sizeof(*new_l2));
+
+        // install the table first, so page_table_destroy can clean up after us
+        int result = page_table_set_l2(new, l1_index, new_l2);
+        if (result) {
+            kfree(new_l2);
+            return result;
+        }
+
+        struct l2_occupancy *new_occ = page_table_get_occupancy(new, l1_index);
+        unsigned seen = 0;
+        uint16_t found = 0; // groups really in use
+        for (int j = 0; j < 1 << L2_BITS && seen < old_occ->live; j++) {
+            unsigned group = j >> L2_GROUP_BITS;
+            if (!L2_GROUP_MAYBE_LIVE(old_occ, j)) {
+                j |= L2_GROUP_SIZE - 1;
+                continue;
             }
 
-            for (int j = 0; j < 1 << L2_BITS; j++) {
-                if (old->tables[i]->entries[j] != NULL) {
-                    new->tables[i]->entries[j] = kmalloc(sizeof(*new->tables[i]->entries[j]));
-                    if (new->tables[i]->entries[j] == NULL) {
-                        page_table_destroy(new);
-                        return NULL;
-                    }
-
-                    vaddr_t new_page = alloc_kpages(1);
-                    if (new_page == 0) {
-                        page_table_destroy(new);
-                        return NULL;
-                    }
-                    // copy the contents of the old frame to the new frame
-                    memcpy((void *)new_page, (void *)PADDR_TO_KVADDR(old->tables[i]->entries[j]->frame & PAGE_FRAME), PAGE_SIZE);
-
-                    // we have the offset of the old frame, we need to copy offset bits to combine with the new frame address bits
-                    paddr_t new_paddr = KVADDR_TO_PADDR(new_page);
-                    paddr_t old_paddr = old->tables[i]->entries[j]->frame;
-
-                    // copy offset bits
-                    new->tables[i]->entries[j]->frame = new_paddr | (old_paddr & (~PAGE_FRAME));
-
-                } else {
-                    new->tables[i]->entries[j] = NULL;
+            PTE *old_pte = &old_l2->entries[j];
+            if (old_pte->frame != 0) {
+                found |= 1 << group;
+                seen++;
+            }
+            if (PTE_VALID(old_pte)) {
+                // write-protect the parent's mapping and share the frame with the child
+                old_pte->frame &= ~TLBLO_DIRTY;
+                vaddr_t vaddr = ((vaddr_t)l1_index << (L2_BITS + OFFSET_BITS)) |
+                                ((vaddr_t)j << OFFSET_BITS);
+                frame_share(old_pte->frame & PAGE_FRAME, old_as, vaddr, new_as, vaddr);
+                new_l2->entries[j].frame = old_pte->frame & ~PTE_LOCKED;
+                new_occ->live++;
+                new_occ->groups |= 1 << group;
+                vmstat_inc(VMSTAT_FORK_SHARED);
+            } else if (PTE_IS_SWAPPED(old_pte)) {
+                unsigned slot;
+                result = swap_copy(PTE_SWAP_SLOT(old_pte), &slot);
+                if (result) {
+                    return result;
                 }
+                new_l2->entries[j].frame = PTE_MAKE_SWAPPED(slot);
+                new_occ->live++;
+                new_occ->groups |= 1 << group;
+                vmstat_inc(VMSTAT_FORK_SWAPCOPIES);
             }
-        } else {
-            new->tables[i] = NULL;
         }
+        // and since we've been through them all, forget the groups that are empty
+        old_occ->groups = found;
     }
 
-    return new;
+    return 0;
 }
 
+/* Empty L2 tables don't count, as page_table_copy leaves them out. */
 static int
 page_table_identical(PageTable *pt1, PageTable *pt2) {
-    for (int i = 0; i < 1 << L1_BITS; i++) {
-        if (pt1->tables[i] == NULL && pt2->tables[i] == NULL) {
-            continue;
+    unsigned cursor, l1_index;
+    unsigned count1 = 0, count2 = 0;
+    L2Table *l2;
+
+    cursor = 0;
+    while (page_table_next_l2(pt2, &cursor, &l1_index, &l2)) {
+        if (page_table_get_occupancy(pt2, l1_index)->live != 0) {
+            count2++;
         }
+    }
 
-        if (pt1->tables[i] == NULL || pt2->tables[i] == NULL) {
+    cursor = 0;
+    while (page_table_next_l2(pt1, &cursor, &l1_index, &l2)) {
+        struct l2_occupancy *occ = page_table_get_occupancy(pt1, l1_index);
+        if (occ->live == 0) {
+            continue;
+        }
+        L2Table *other = page_table_get_l2(pt2, l1_index);
+        if (other == NULL) {
+            return 0;
+        }
+        struct l2_occupancy *other_occ = page_table_get_occupancy(pt2, l1_index);
+        if (other_occ->live != occ->live) {
             return 0;
         }
 
+        // entries outside both tables' groups are 0 on both sides
+        struct l2_occupancy either = { 0, occ->groups | other_occ->groups };
         for (int j = 0; j < 1 << L2_BITS; j++) {
-            if (pt1->tables[i]->entries[j] == NULL && pt2->tables[i]->entries[j] == NULL) {
+            if (!L2_GROUP_MAYBE_LIVE(&either, j)) {
+                j |= L2_GROUP_SIZE - 1;
                 continue;
             }
-
-            if (pt1->tables[i]->entries[j] == NULL || pt2->tables[i]->entries[j] == NULL) {
-                return 0;
+            PTE *a = &l2->entries[j], *b = &other->entries[j];
+            if (PTE_IS_SWAPPED(a) && PTE_IS_SWAPPED(b)) {
+                continue; // different slots holding the same contents
             }
-
-            if (pt1->tables[i]->entries[j]->frame != pt2->tables[i]->entries[j]->frame) {
-                return 0;
+            if (((a->frame ^ b->frame) & ~PTE_LOCKED) != 0) {
+                return 0; // (locks aren't copied)
             }
         }
+        count1++;
     }
 
-    return 1;
+    return count1 == count2;
 }
 
-static struct region *
-regions_copy(struct region *old) {
-    struct region *new = kmalloc(sizeof(struct region));
-    if (new == NULL) {
-        return NULL;
+#endif /* OPT_HASHPT */
+
+/*
+ * Regions are kept in an array sorted by vbase, so lookups can binary
+ * search. The array is grown by doubling in as_define_region.
+ */
+#define REGIONS_INITIAL 4
+
+/* Make room in the regions array for N more. */
+static int
+regions_reserve(struct addrspace *as, unsigned n) {
+    if (as->nregions + n <= as->regions_max) {
+        return 0;
+    }
+
+    unsigned max = as->regions_max == 0 ? REGIONS_INITIAL : 2 * as->regions_max;
+    while (max < as->nregions + n) {
+        max *= 2;
+    }
+    struct region *regions = kmalloc(max * sizeof(struct region));
+    if (regions == NULL) {
+        return ENOMEM;
+    }
+    if (as->regions != NULL) {
+        memcpy(regions, as->regions, as->nregions * sizeof(struct region));
+        kfree(as->regions);
+    }
+    as->regions = regions;
+    as->regions_max = max;
+    as->last_region = NULL; // entries moved
+    return 0;
+}
+
+/*
+ * mprotect gives part of a region different permissions by splitting
+ * it, here at VADDR, a page boundary inside region I. The upper piece
+ * is marked as continuing the lower one, so that the pieces of one
+ * mapping are still treated as a whole (see mapping_first and
+ * mapping_last) and go back together once their attributes match
+ * again (see regions_merge). Each piece holds its own references to
+ * the files behind it. The caller has made room with regions_reserve.
+ */
+static void
+region_split(struct addrspace *as, unsigned i, vaddr_t vaddr) {
+    KASSERT(as->nregions < as->regions_max);
+    struct region *lower = &as->regions[i];
+    KASSERT(vaddr > lower->vbase && vaddr < lower->vtop && (vaddr & PAGE_FRAME) == vaddr);
+
+    struct region upper = *lower;
+    upper.vbase = vaddr;
+    upper.npages = (upper.vtop - vaddr) / PAGE_SIZE;
+    upper.continued = 1;
+    upper.growsdown = 0; // that's up to the bottom piece
+    if (upper.vn != NULL) {
+        upper.file_offset += vaddr - lower->vbase;
+        VOP_INCREF(upper.vn);
+    }
+    if (upper.elf_vn != NULL) {
+        VOP_INCREF(upper.elf_vn);
     }
+    lower->vtop = vaddr;
+    lower->npages = (vaddr - lower->vbase) / PAGE_SIZE;
 
-    new->vbase = old->vbase;
-    new->npages = old->npages;
-    new->vtop = old->vtop;
-    new->readable = old->readable;
-    new->writeable = old->writeable;
-    new->executable = old->executable;
+    memmove(&as->regions[i + 2], &as->regions[i + 1], (as->nregions - i - 1) * sizeof(struct region));
+    as->regions[i + 1] = upper;
+    as->nregions++;
+    as->last_region = NULL; // entries moved
+}
 
-    if (old->next != NULL) {
-        new->next = regions_copy(old->next);
-        if (new->next == NULL) {
-            kfree(new);
-            return NULL;
+/* Join back the pieces of split regions among regions LO to HI that now match. */
+static void
+regions_merge(struct addrspace *as, unsigned lo, unsigned hi) {
+    for (unsigned j = hi; j > lo; j--) {
+        struct region *lower = &as->regions[j - 1], *upper = &as->regions[j];
+        if (!upper->continued || lower->readable != upper->readable ||
+            lower->writeable != upper->writeable || lower->advice != upper->advice) {
+            continue;
         }
-    } else {
-        new->next = NULL;
+
+        lower->vtop = upper->vtop;
+        lower->npages = (lower->vtop - lower->vbase) / PAGE_SIZE;
+        if (upper->vn != NULL) {
+            VOP_DECREF(upper->vn);
+        }
+        if (upper->elf_vn != NULL) {
+            VOP_DECREF(upper->elf_vn);
+        }
+        memmove(upper, upper + 1, (as->nregions - j - 1) * sizeof(struct region));
+        as->nregions--;
+        as->last_region = NULL; // entries moved
     }
+}
 
-    return new;
+/* The first and last pieces of the mapping region I is part of. */
+static unsigned
+mapping_first(struct addrspace *as, unsigned i) {
+    while (as->regions[i].continued) {
+        KASSERT(i > 0);
+        i--;
+    }
+    return i;
 }
 
-static int
-regions_identical(struct region *r1, struct region *r2) {
-    if (r1 == NULL && r2 == NULL) {
-        return 1;
+static unsigned
+mapping_last(struct addrspace *as, unsigned i) {
+    while (i + 1 < as->nregions && as->regions[i + 1].continued) {
+        i++;
     }
+    return i;
+}
 
-    if (r1 == NULL || r2 == NULL) {
+static int
+regions_copy(struct addrspace *old, struct addrspace *new) {
+    KASSERT(new->regions == NULL);
+
+    if (old->nregions == 0) {
         return 0;
     }
 
-    if (r1->vbase != r2->vbase || r1->npages != r2->npages || r1->vtop != r2->vtop || r1->readable != r2->readable || r1->writeable != r2->writeable || r1->executable != r2->executable) {
+    new->regions = kmalloc(old->regions_max * sizeof(struct region));
+    if (new->regions == NULL) {
+        return ENOMEM;
+    }
+    memcpy(new->regions, old->regions, old->nregions * sizeof(struct region));
+    new->nregions = old->nregions;
+    new->regions_max = old->regions_max;
+
+    // the child's regions hold their own references to the files behind them
+    for (unsigned i = 0; i < new->nregions; i++) {
+        if (new->regions[i].vn != NULL) {
+            VOP_INCREF(new->regions[i].vn);
+        }
+        if (new->regions[i].elf_vn != NULL) {
+            VOP_INCREF(new->regions[i].elf_vn);
+        }
+    }
+
+    return 0;
+}
+
+static int
+regions_identical(struct addrspace *as1, struct addrspace *as2) {
+    if (as1->nregions != as2->nregions) {
         return 0;
     }
 
-    return regions_identical(r1->next, r2->next);
+    for (unsigned i = 0; i < as1->nregions; i++) {
+        struct region *r1 = &as1->regions[i], *r2 = &as2->regions[i];
+        if (r1->vbase != r2->vbase || r1->npages != r2->npages || r1->vtop != r2->vtop || r1->readable != r2->readable || r1->writeable != r2->writeable || r1->executable != r2->executable || r1->vn != r2->vn || r1->file_offset != r2->file_offset || r1->elf_vn != r2->elf_vn) {
+            return 0;
+        }
+    }
+
+    return 1;
 }
 
-static void
-free_region(struct region *region) {
-    if (region->next != NULL) {
-        free_region(region->next);
+/* Return the index of the first region starting above VADDR. */
+static unsigned
+regions_search(struct addrspace *as, vaddr_t vaddr) {
+    unsigned lo = 0, hi = as->nregions;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (as->regions[mid].vbase <= vaddr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    kfree(region);
+    return lo;
 }
 
-static void
-flush_tlb(void) {
-    int spl = splhigh();
+struct region *
+as_region_lookup(struct addrspace *as, vaddr_t vaddr) {
+    // faults tend to come in runs within one region
+    struct region *region = as->last_region;
+    if (region != NULL && region->vbase <= vaddr && vaddr < region->vtop) {
+        return region;
+    }
 
-    for (int i = 0; i < NUM_TLB; i++) {
-        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    unsigned i = regions_search(as, vaddr);
+    if (i == 0) {
+        return NULL;
+    }
+    region = &as->regions[i - 1];
+    if (vaddr >= region->vtop) {
+        return NULL;
     }
 
-    splx(spl);
+    as->last_region = region;
+    return region;
 }
 
 struct addrspace *
 as_create(void) {
     struct addrspace *as;
 
-    as = kmalloc(sizeof(struct addrspace));
+    as = objcache_alloc(&addrspace_cache);
     if (as == NULL) {
         return NULL;
     }
@@ -243,9 +597,37 @@ as_create(void) {
      * Initialize as needed.
      */
 
+    as->regions_lock = rwlock_create("addrspace");
+    if (as->regions_lock == NULL) {
+        objcache_free(&addrspace_cache, as);
+        return NULL;
+    }
     as->regions = NULL;
+    as->nregions = 0;
+    as->regions_max = 0;
+    as->last_region = NULL;
+    as->heap_start = 0;
+    as->heap_end = 0;
     as->page_table = page_table_init();
-    as->force_readwrite = 0;
+    if (as->page_table == NULL) {
+        rwlock_destroy(as->regions_lock);
+        objcache_free(&addrspace_cache, as);
+        return NULL;
+    }
+    as->asid = 0;
+    as->asid_generation = 0; // no ASID until first activated
+    as->tlb_cpus = 0;
+    as->fault_next = 0;
+    as->rss_estimate = 0;
+    vm_ws_init(as);
+    as->kinfo = alloc_kpages(1);
+    if (as->kinfo == 0) {
+        objcache_free(&page_table_cache, as->page_table);
+        rwlock_destroy(as->regions_lock);
+        objcache_free(&addrspace_cache, as);
+        return NULL;
+    }
+    bzero((void *)as->kinfo, PAGE_SIZE);
 
     return as;
 }
@@ -259,23 +641,35 @@ as_copy(struct addrspace *old, struct addrspace **ret) {
         return ENOMEM;
     }
 
-    (void)old;
-
-    newas->regions = regions_copy(old->regions);
-    if (newas->regions == NULL) {
+    // other threads may be faulting in OLD, but not changing its regions
+    rwlock_acquire_read(old->regions_lock);
+    int result = regions_copy(old, newas);
+    if (result) {
+        rwlock_release_read(old->regions_lock);
         as_destroy(newas);
-        return ENOMEM;
+        return result;
     }
-    KASSERT(regions_identical(old->regions, newas->regions));
+    KASSERT(regions_identical(old, newas));
+
+    vm_lock_acquire();
+    result = page_table_copy(old, newas);
+    KASSERT(result || page_table_identical(old->page_table, newas->page_table));
+    vm_lock_release();
+    newas->heap_start = old->heap_start;
+    newas->heap_end = old->heap_end;
+    rwlock_release_read(old->regions_lock);
+
+    /*
+     * The parent's writeable mappings are now read-only in its page
+     * table, but may still be loaded writeable in the TLB. Knock them
+     * out (even on failure, since some entries were already changed).
+     */
+    vm_tlb_forget(old);
 
-    newas->page_table = page_table_copy(old->page_table);
-    if (newas->page_table == NULL) {
+    if (result) {
         as_destroy(newas);
-        return ENOMEM;
+        return result;
     }
-    KASSERT(!page_table_identical(old->page_table, newas->page_table));
-
-    newas->force_readwrite = old->force_readwrite;
 
     *ret = newas;
     return 0;
@@ -287,14 +681,67 @@ as_destroy(struct addrspace *as) {
      * Clean up as needed.
      */
 
-    free_region(as->regions);
-    as->regions = NULL;
-    page_table_destroy(as->page_table);
+    // cached file pages go back to the page cache first, while we can still find them
+    for (unsigned i = 0; i < as->nregions; i++) {
+        if (as->regions[i].vn != NULL) {
+            vm_unmap_region(as, &as->regions[i]);
+            VOP_DECREF(as->regions[i].vn);
+        }
+        if (as->regions[i].elf_vn != NULL) {
+            vm_unmap_region(as, &as->regions[i]);
+            VOP_DECREF(as->regions[i].elf_vn);
+        }
+    }
+
+    if (as->regions != NULL) {
+        kfree(as->regions);
+        as->regions = NULL;
+    }
+    vm_tlb_deactivate(as);
+    vm_lock_acquire();
+    page_table_destroy(as, as->page_table);
+    vm_lock_release();
     as->page_table = NULL;
-    kfree(as);
+    // vm_tlb_deactivate has knocked out any mappings of it
+    free_kpages(as->kinfo);
+    rwlock_destroy(as->regions_lock);
+    objcache_free(&addrspace_cache, as);
     as = NULL;
 }
 
+/*
+ * Empty AS for exec to load a new image into, as though it had just
+ * come from as_create, but keeping the structure, its lock and kinfo
+ * page, its regions array and the page table's own allocations. AS
+ * must belong to the current process, with no other thread using it.
+ */
+void
+as_reset(struct addrspace *as) {
+    for (unsigned i = 0; i < as->nregions; i++) {
+        if (as->regions[i].vn != NULL) {
+            vm_unmap_region(as, &as->regions[i]);
+            VOP_DECREF(as->regions[i].vn);
+        }
+        if (as->regions[i].elf_vn != NULL) {
+            vm_unmap_region(as, &as->regions[i]);
+            VOP_DECREF(as->regions[i].elf_vn);
+        }
+    }
+    as->nregions = 0;
+    as->last_region = NULL;
+    as->heap_start = 0;
+    as->heap_end = 0;
+    as->fault_next = 0;
+    as->rss_estimate = 0;
+    vm_ws_init(as);
+
+    vm_lock_acquire();
+    page_table_clear(as, as->page_table);
+    vm_lock_release();
+    // and take a new ASID, so no stale TLB entry can match
+    vm_tlb_forget(as);
+}
+
 void
 as_activate(void) {
     struct addrspace *as;
@@ -309,10 +756,11 @@ as_activate(void) {
     }
 
     /*
-     * Flush the TLB. Or set the ASID.
+     * Switch to this address space's ASID; its TLB entries from
+     * last time it ran are still there.
      */
 
-    flush_tlb();
+    vm_tlb_activate(as);
 }
 
 void
@@ -324,9 +772,11 @@ as_deactivate(void) {
      */
 
     /*
-     * Flush the TLB. Or flush the TLB for this specific ASID.
+     * The TLB entries can stay: they are tagged with the ASID, so the
+     * next address space won't match them. Just stop the refill
+     * handler walking this page table.
      */
-    flush_tlb();
+    vm_tlb_deactivate(NULL);
 }
 
 /*
@@ -340,6 +790,24 @@ as_deactivate(void) {
  * want to implement them.
  */
 
+/*
+ * Would NPAGES more pages of regions take AS past RLIMIT_AS? The limit
+ * is the current process's, whose address space AS is or is to be.
+ */
+static bool
+as_over_limit(struct addrspace *as, size_t npages) {
+    rlim_t limit = proc_getrlimit(RLIMIT_AS);
+    if (limit == RLIM_INFINITY) {
+        return false;
+    }
+
+    rlim_t total = npages;
+    for (unsigned i = 0; i < as->nregions; i++) {
+        total += as->regions[i].npages;
+    }
+    return total * PAGE_SIZE > limit;
+}
+
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
                  int readable, int writeable, int executable) {
@@ -358,69 +826,520 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 
     /*
      * When this function is called, it means we have a region, can be data, text, stack etc.
-     * We need to create a new region and add it to the regions list of the address space.
+     * We need to create a new region and add it, in order, to the regions of the address space.
      */
 
-    struct region *new_region = kmalloc(sizeof(struct region));
-    if (new_region == NULL) {
+    struct region new_region;
+    new_region.vbase = vaddr; // vbase is inclusive
+    new_region.npages = npages;
+    new_region.vtop = vaddr + npages * PAGE_SIZE; // vtop is exclusive
+    new_region.readable = readable == PF_R;
+    new_region.writeable = writeable == PF_W;
+    new_region.executable = executable == PF_X;
+    new_region.mmapped = 0;
+    new_region.threadstack = 0;
+    new_region.growsdown = 0;
+    new_region.continued = 0;
+    new_region.maywrite = 1;
+    new_region.advice = MADV_NORMAL;
+    new_region.vn = NULL;
+    new_region.file_offset = 0;
+    new_region.elf_vn = NULL;
+    new_region.elf_offset = 0;
+    new_region.elf_vaddr = 0;
+    new_region.elf_filesize = 0;
+
+    // only the neighbours either side can overlap the new region
+    unsigned pos = regions_search(as, vaddr);
+    if ((pos > 0 && as->regions[pos - 1].vtop > new_region.vbase) ||
+        (pos < as->nregions && as->regions[pos].vbase < new_region.vtop)) {
+        // regions overlap, bad ELF region definitions
+        return EINVAL;
+    }
+    if (new_region.vbase < KINFO_END && new_region.vtop > KINFO_VADDR) {
+        // the kernel information pages are there
+        return EINVAL;
+    }
+    if (as_over_limit(as, npages)) {
         return ENOMEM;
     }
 
-    new_region->vbase = vaddr; // vbase is inclusive
-    new_region->npages = npages;
-    new_region->vtop = vaddr + npages * PAGE_SIZE; // vtop is exclusive
-    new_region->next = NULL;
-    new_region->readable = readable == PF_R;
-    new_region->writeable = writeable == PF_W;
-    new_region->executable = executable == PF_X;
+    int result = regions_reserve(as, 1);
+    if (result) {
+        return result;
+    }
 
-    if (as->regions == NULL) {
-        as->regions = new_region;
-    } else {
-        struct region *current = as->regions;
-        while (current->next != NULL) {
-            // meanwhile we would like to sanity check if the regions overlap
-            if (MAX(current->vbase, new_region->vbase) < MIN(current->vtop, new_region->vtop)) {
-                // regions overlap, bad ELF region definitions
-                kfree(new_region);
-                return EINVAL;
-            }
-            current = current->next;
-        }
-        current->next = new_region;
+    memmove(&as->regions[pos + 1], &as->regions[pos], (as->nregions - pos) * sizeof(struct region));
+    as->regions[pos] = new_region;
+    as->nregions++;
+    as->last_region = NULL; // entries moved
+
+    return 0;
+}
+
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                  struct vnode *vn, off_t offset, size_t filesize) {
+    if (filesize == 0) {
+        return 0; // all zero-fill, like any other region
+    }
+
+    struct region *region = as_region_lookup(as, vaddr);
+    if (region == NULL || region->elf_vn != NULL || filesize > region->vtop - vaddr) {
+        return EINVAL;
     }
 
+    VOP_INCREF(vn);
+    region->elf_vn = vn;
+    region->elf_offset = offset;
+    region->elf_vaddr = vaddr;
+    region->elf_filesize = filesize;
+
     return 0;
 }
 
+/*
+ * Nothing is written into the address space while loading: each page
+ * of a segment is read into its frame from the kernel side when first
+ * touched (see as_define_backing), and mapped with the region's own
+ * permissions, so read-only pages are never writeable, even then.
+ */
 int
 as_prepare_load(struct addrspace *as) {
-    /*
-     * make READONLY regions READWRITE for loading purposes
-     */
+    KASSERT(as != NULL);
+    KASSERT(as->nregions > 0);
 
+    return 0;
+}
+
+int
+as_complete_load(struct addrspace *as) {
     KASSERT(as != NULL);
-    KASSERT(as->regions != NULL);
+    KASSERT(as->nregions > 0);
+
+    // The heap starts out empty, just past the highest segment
+    as->heap_start = as->regions[as->nregions - 1].vtop;
+    as->heap_end = as->heap_start;
+
+    return as_define_region(as, as->heap_start, 0, PF_R, PF_W, 0);
+}
+
+/* Unmap and remove the region at index I. */
+static void
+region_remove(struct addrspace *as, unsigned i) {
+    struct region *region = &as->regions[i];
+
+    if (region->vn != NULL) {
+        vm_unmap_region(as, region);
+        VOP_DECREF(region->vn);
+    } else {
+        vm_unmap_range(as, region->vbase, region->vtop);
+    }
+
+    memmove(region, region + 1, (as->nregions - i - 1) * sizeof(struct region));
+    as->nregions--;
+    as->last_region = NULL; // entries moved
+}
+
+/* Remove the whole mapping whose first piece is region I. */
+static void
+mapping_remove(struct addrspace *as, unsigned i) {
+    KASSERT(!as->regions[i].continued);
+    for (unsigned j = mapping_last(as, i); j > i; j--) {
+        region_remove(as, j);
+    }
+    region_remove(as, i);
+}
+
+/*
+ * The lowest address region I may come to occupy, less a guard page if
+ * it grows down, so nothing else should be put above this.
+ */
+static vaddr_t
+region_reserved_base(struct addrspace *as, unsigned i) {
+    struct region *region = &as->regions[i];
+    if (!region->growsdown) {
+        return region->vbase;
+    }
+    vaddr_t top = as->regions[mapping_last(as, i)].vtop;
+    vaddr_t base = top - YANG_VM_STACKMAXPAGES * PAGE_SIZE;
+    return MIN(base, region->vbase) - PAGE_SIZE;
+}
+
+static int
+sbrk_locked(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak) {
+    // the heap region is the one starting at heap_start, or its top piece if mprotect split it
+    unsigned i = regions_search(as, as->heap_start);
+    if (i == 0 || as->regions[i - 1].vbase != as->heap_start) {
+        return ENOMEM; // no heap, e.g. not loaded from an ELF file
+    }
+    unsigned first = i - 1;
+    i = mapping_last(as, first) + 1;
+    struct region *heap = &as->regions[i - 1];
+
+    // it may grow as far as the next region (normally the stack, and all the room that may grow into)
+    vaddr_t limit = i < as->nregions ? region_reserved_base(as, i) : USERSPACETOP;
+    vaddr_t old = as->heap_end;
+
+    if (amount < 0 && (vaddr_t)-amount > old - as->heap_start) {
+        return EINVAL;
+    }
+    if (amount > 0 && (vaddr_t)amount > limit - old) {
+        return ENOMEM;
+    }
+
+    vaddr_t new = old + amount;
+    vaddr_t new_top = ROUNDUP(new, PAGE_SIZE);
 
-    as->force_readwrite = 1;
+    // shrinking may take whole pieces away
+    while (i - 1 > first && heap->vbase >= new_top) {
+        region_remove(as, i - 1);
+        i--;
+        heap = &as->regions[i - 1];
+    }
+    vaddr_t old_top = heap->vtop;
+    if (new_top > old_top && as_over_limit(as, (new_top - old_top) / PAGE_SIZE)) {
+        return ENOMEM;
+    }
+
+    // if mprotect has changed the top piece, what's added is read/write as usual
+    bool fresh = new_top > old_top && !(heap->readable && heap->writeable);
+    if (fresh) {
+        int result = regions_reserve(as, 1);
+        if (result) {
+            return result;
+        }
+        heap = &as->regions[i - 1];
+    }
 
+    // Pages are only allocated when faulted on; just move the top
+    heap->vtop = new_top;
+    heap->npages = (new_top - heap->vbase) / PAGE_SIZE;
+    as->heap_end = new;
+    if (fresh) {
+        region_split(as, i - 1, old_top);
+        as->regions[i].readable = 1;
+        as->regions[i].writeable = 1;
+    }
+
+    if (new_top < old_top) {
+        vm_unmap_range(as, new_top, old_top);
+    }
+
+    *oldbreak = old;
     return 0;
 }
 
 int
-as_complete_load(struct addrspace *as) {
-    /*
-     * enforce READONLY again
-     */
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak) {
+    rwlock_acquire_write(as->regions_lock);
+    int result = sbrk_locked(as, amount, oldbreak);
+    rwlock_release_write(as->regions_lock);
+    return result;
+}
 
-    KASSERT(as != NULL);
-    KASSERT(as->regions != NULL);
+/*
+ * Find SIZE bytes of unused address space for as_mmap: the highest gap
+ * above the heap that fits. That is normally just under the room the
+ * stack may grow into, which leaves the heap room to grow too. Returns
+ * 0 if there isn't one.
+ */
+static vaddr_t
+find_gap(struct addrspace *as, vaddr_t size) {
+    for (unsigned i = as->nregions; i > 0; i--) {
+        struct region *below = &as->regions[i - 1];
+        vaddr_t top = i < as->nregions ? region_reserved_base(as, i) : USERSPACETOP;
+        if (below->vbase < as->heap_start) {
+            break;
+        }
+        if (top - below->vtop >= size) {
+            return top - size;
+        }
+    }
+    return 0;
+}
+
+static int
+mmap_locked(struct addrspace *as, size_t length, int readable, int writeable,
+            struct vnode *vn, off_t offset, vaddr_t *addr_ret) {
+    size_t npages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (length == 0 || npages > (USERSPACETOP >> OFFSET_BITS)) {
+        return EINVAL;
+    }
+    vaddr_t size = npages * PAGE_SIZE;
+
+    vaddr_t base = find_gap(as, size);
+    if (base == 0) {
+        return ENOMEM;
+    }
+
+    int result = as_define_region(as, base, size, readable ? PF_R : 0, writeable ? PF_W : 0, 0);
+    if (result) {
+        return result;
+    }
+
+    struct region *region = as_region_lookup(as, base);
+    KASSERT(region != NULL && region->vbase == base);
+    region->mmapped = 1;
+    region->maywrite = vn == NULL || writeable;
+    region->vn = vn;
+    region->file_offset = offset;
+    if (vn != NULL) {
+        VOP_INCREF(vn);
+    }
 
-    as->force_readwrite = 0;
+    *addr_ret = base;
+    return 0;
+}
+
+int
+as_mmap(struct addrspace *as, size_t length, int readable, int writeable,
+        struct vnode *vn, off_t offset, vaddr_t *addr_ret) {
+    rwlock_acquire_write(as->regions_lock);
+    int result = mmap_locked(as, length, readable, writeable, vn, offset, addr_ret);
+    rwlock_release_write(as->regions_lock);
+    return result;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr) {
+    rwlock_acquire_write(as->regions_lock);
+    unsigned i = regions_search(as, addr);
+    if (i == 0 || as->regions[i - 1].vbase != addr || !as->regions[i - 1].mmapped ||
+        as->regions[i - 1].continued) {
+        rwlock_release_write(as->regions_lock);
+        return EINVAL;
+    }
+    mapping_remove(as, i - 1);
+    rwlock_release_write(as->regions_lock);
+
+    return 0;
+}
+
+int
+as_define_thread_stack(struct addrspace *as, vaddr_t *stackptr) {
+    vaddr_t size = YANG_VM_THREAD_STACKPAGES * PAGE_SIZE;
+
+    rwlock_acquire_write(as->regions_lock);
+    // the guard page below is left out of the region, so overflowing faults
+    vaddr_t base = find_gap(as, size + PAGE_SIZE);
+    if (base == 0) {
+        rwlock_release_write(as->regions_lock);
+        return ENOMEM;
+    }
+    base += PAGE_SIZE;
+
+    int result = as_define_region(as, base, size, PF_R, PF_W, 0);
+    if (result) {
+        rwlock_release_write(as->regions_lock);
+        return result;
+    }
+    struct region *region = as_region_lookup(as, base);
+    KASSERT(region != NULL && region->vbase == base);
+    region->threadstack = 1;
+    rwlock_release_write(as->regions_lock);
+
+    *stackptr = base + size;
+    return 0;
+}
+
+void
+as_destroy_thread_stack(struct addrspace *as, vaddr_t stackptr) {
+    rwlock_acquire_write(as->regions_lock);
+    unsigned i = regions_search(as, stackptr - 1);
+    KASSERT(i > 0 && as->regions[i - 1].vtop == stackptr && as->regions[i - 1].threadstack);
+    mapping_remove(as, mapping_first(as, i - 1));
+    rwlock_release_write(as->regions_lock);
+}
+
+int
+as_grow_stack(struct addrspace *as, vaddr_t vaddr) {
+    vaddr_t page = vaddr & PAGE_FRAME;
+    int result = EFAULT;
+
+    rwlock_acquire_write(as->regions_lock);
+    unsigned i = regions_search(as, page);
+    if (i > 0 && page < as->regions[i - 1].vtop) {
+        // another thread got here first
+        result = 0;
+    } else if (i < as->nregions && as->regions[i].growsdown) {
+        struct region *stack = &as->regions[i];
+        // keep an unmapped guard page above whatever is below
+        vaddr_t floor = i > 0 ? as->regions[i - 1].vtop + PAGE_SIZE : KINFO_END;
+        vaddr_t top = as->regions[mapping_last(as, i)].vtop;
+        if (page >= floor && top - page <= YANG_VM_STACKMAXPAGES * PAGE_SIZE &&
+            !as_over_limit(as, (stack->vbase - page) / PAGE_SIZE)) {
+            stack->vbase = page;
+            stack->npages = (stack->vtop - page) / PAGE_SIZE;
+            vmstat_inc(VMSTAT_STACK_GROWS);
+            result = 0;
+        }
+    }
+    rwlock_release_write(as->regions_lock);
+    return result;
+}
+
+/* Is all of [START, END) inside regions? Needs the regions lock. */
+static bool
+range_mapped(struct addrspace *as, vaddr_t start, vaddr_t end) {
+    for (vaddr_t va = start; va < end;) {
+        struct region *region = as_region_lookup(as, va);
+        if (region == NULL) {
+            return false;
+        }
+        va = region->vtop;
+    }
+    return true;
+}
+
+int
+as_madvise(struct addrspace *as, vaddr_t start, vaddr_t end, int advice) {
+    struct region *region;
+    int result = 0;
+
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+        // the fault path reads the advice, so this changes the regions
+        rwlock_acquire_write(as->regions_lock);
+        if (!range_mapped(as, start, end)) {
+            result = ENOMEM;
+        } else {
+            for (vaddr_t va = start; va < end; va = region->vtop) {
+                region = as_region_lookup(as, va);
+                region->advice = advice;
+            }
+        }
+        rwlock_release_write(as->regions_lock);
+        return result;
+    case MADV_WILLNEED:
+    case MADV_DONTNEED:
+        break;
+    default:
+        return EINVAL;
+    }
+
+    rwlock_acquire_read(as->regions_lock);
+    if (!range_mapped(as, start, end)) {
+        rwlock_release_read(as->regions_lock);
+        return ENOMEM;
+    }
+    for (vaddr_t va = start; va < end; va = region->vtop) {
+        region = as_region_lookup(as, va);
+        vaddr_t top = region->vtop < end ? region->vtop : end;
+        if (advice == MADV_DONTNEED) {
+            vm_discard_range(as, region, va, top);
+        } else {
+            // only a hint, so failing to bring pages in isn't an error
+            vm_prefault_range(as, region, va, top);
+        }
+    }
+    rwlock_release_read(as->regions_lock);
+    return 0;
+}
 
+int
+as_mincore(struct addrspace *as, vaddr_t start, unsigned npages, unsigned char *vec) {
+    rwlock_acquire_read(as->regions_lock);
+    if (!range_mapped(as, start, start + npages * PAGE_SIZE)) {
+        rwlock_release_read(as->regions_lock);
+        return ENOMEM;
+    }
+    vm_mincore_range(as, start, npages, vec);
+    rwlock_release_read(as->regions_lock);
     return 0;
 }
 
+int
+as_mlock(struct addrspace *as, vaddr_t start, vaddr_t end, bool lock) {
+    struct region *region;
+    int result = 0;
+
+    rwlock_acquire_read(as->regions_lock);
+    if (!range_mapped(as, start, end)) {
+        rwlock_release_read(as->regions_lock);
+        return ENOMEM;
+    }
+    for (vaddr_t va = start; result == 0 && va < end; va = region->vtop) {
+        region = as_region_lookup(as, va);
+        vaddr_t top = region->vtop < end ? region->vtop : end;
+        result = vm_lock_range(as, region, va, top, lock);
+    }
+    rwlock_release_read(as->regions_lock);
+    return result;
+}
+
+/*
+ * May mprotect make REGION writeable, or not, as WRITEABLE says? Not a
+ * file mapping the file wasn't open for writing, and not program text,
+ * whose pages are shared through the page cache only while it's
+ * read-only (see region_cached_page in vm.c).
+ */
+static bool
+region_may_protect(struct region *region, int writeable) {
+    if ((bool)writeable == (bool)region->writeable) {
+        return true;
+    }
+    if (region->elf_vn != NULL && region->executable) {
+        return false;
+    }
+    return !writeable || region->maywrite;
+}
+
+static int
+mprotect_locked(struct addrspace *as, vaddr_t start, vaddr_t end, int readable, int writeable) {
+    struct region *region;
+
+    if (!range_mapped(as, start, end)) {
+        return ENOMEM;
+    }
+    // check it all first, so that nothing changes on failure
+    for (vaddr_t va = start; va < end; va = region->vtop) {
+        region = as_region_lookup(as, va);
+        if (!region_may_protect(region, writeable)) {
+            return EACCES;
+        }
+    }
+    int result = regions_reserve(as, 2);
+    if (result) {
+        return result;
+    }
+
+    // split off whatever lies outside the range at either end
+    unsigned first = regions_search(as, start) - 1;
+    if (as->regions[first].vbase < start) {
+        region_split(as, first, start);
+        first++;
+    }
+    unsigned last = regions_search(as, end - 1) - 1;
+    if (as->regions[last].vtop > end) {
+        region_split(as, last, end);
+    }
+
+    for (unsigned i = first; i <= last; i++) {
+        as->regions[i].readable = readable != 0;
+        as->regions[i].writeable = writeable != 0;
+    }
+    vm_protect_range(as, start, end, readable, writeable);
+
+    regions_merge(as, first > 0 ? first - 1 : 0, last + 1 < as->nregions ? last + 1 : last);
+    return 0;
+}
+
+int
+as_mprotect(struct addrspace *as, vaddr_t start, vaddr_t end, int readable, int writeable) {
+    rwlock_acquire_write(as->regions_lock);
+    int result = mprotect_locked(as, start, end, readable, writeable);
+    rwlock_release_write(as->regions_lock);
+    return result;
+}
+
+void
+as_setkinfo(struct addrspace *as, pid_t pid, pid_t ppid) {
+    kinfo_set(as->kinfo, pid, ppid);
+}
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
 
@@ -433,8 +1352,14 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
     // and it grows downwards
     // We need to define the stack region here
 
-    // Stack region is read/write and not executable
-    as_define_region(as, USERSTACK - YANG_VM_STACKPAGES * PAGE_SIZE, YANG_VM_STACKPAGES * PAGE_SIZE, PF_R, PF_W, 0);
-
+    // Stack region is read/write and not executable, and grows down from here as needed
+    vaddr_t base = USERSTACK - YANG_VM_STACKPAGES * PAGE_SIZE;
+    int result = as_define_region(as, base, YANG_VM_STACKPAGES * PAGE_SIZE, PF_R, PF_W, 0);
+    if (result) {
+        return result;
+    }
+    struct region *region = as_region_lookup(as, base);
+    KASSERT(region != NULL && region->vbase == base);
+    region->growsdown = 1;
     return 0;
 }
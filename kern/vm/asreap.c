@@ -0,0 +1,88 @@
+/*
+ * Destroying address spaces in the background; see as_destroy_async
+ * in <addrspace.h>. This is shared by both VM systems, since it only
+ * calls as_destroy.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <workqueue.h>
+#include <addrspace.h>
+
+/*
+ * asreap_count is how many address spaces have been queued and not yet
+ * destroyed; whoever makes it 0 wakes everyone in as_reap_wait. Each
+ * one is queued with its own work item, on the CPU of the process that
+ * exited, so the CPUs share the work out between them. Until
+ * as_reap_bootstrap there's no wchan and nothing is queued.
+ */
+static struct spinlock asreap_lock = SPINLOCK_INITIALIZER;
+static struct wchan *asreap_wchan;
+static unsigned asreap_count;
+
+void
+as_reap_bootstrap(void)
+{
+	asreap_wchan = wchan_create("asreap");
+	if (asreap_wchan == NULL) {
+		panic("as_reap_bootstrap: Out of memory\n");
+	}
+}
+
+static
+void
+as_reap(void *data)
+{
+	struct addrspace *as = data;
+
+	as_destroy(as);
+
+	spinlock_acquire(&asreap_lock);
+	KASSERT(asreap_count > 0);
+	asreap_count--;
+	if (asreap_count == 0) {
+		wchan_wakeall(asreap_wchan, &asreap_lock);
+	}
+	spinlock_release(&asreap_lock);
+}
+
+void
+as_destroy_async(struct addrspace *as)
+{
+	if (as == NULL) {
+		return;
+	}
+	if (asreap_wchan == NULL) {
+		as_destroy(as);
+		return;
+	}
+
+	spinlock_acquire(&asreap_lock);
+	asreap_count++;
+	spinlock_release(&asreap_lock);
+
+	if (workqueue_enqueue(as_reap, as)) {
+		/* no memory for the work item; just do it */
+		as_reap(as);
+	}
+}
+
+bool
+as_reap_wait(void)
+{
+	bool waited = false;
+
+	if (asreap_wchan == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&asreap_lock);
+	while (asreap_count > 0) {
+		wchan_sleep(asreap_wchan, &asreap_lock);
+		waited = true;
+	}
+	spinlock_release(&asreap_lock);
+	return waited;
+}
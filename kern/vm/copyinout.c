@@ -30,9 +30,6 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <setjmp.h>
-#include <thread.h>
-#include <current.h>
 #include <vm.h>
 #include <copyinout.h>
 
@@ -40,9 +37,13 @@
  * User/kernel memory copying functions.
  *
  * These are arranged to prevent fatal kernel memory faults if invalid
- * addresses are supplied by user-level code. This code is itself
- * machine-independent; it uses the machine-dependent C setjmp/longjmp
- * facility to perform recovery.
+ * addresses are supplied by user-level code. The copying itself is
+ * done by the machine-dependent usercopy and usercopystr, whose loads
+ * and stores are listed in a table of instructions that may fault,
+ * each with where to go if one does; the trap code looks a fatal
+ * kernel-mode fault up there with copyfixup before giving up. Nothing
+ * needs arming before each copy, which matters as syscalls do a lot
+ * of them and hardly any fault.
  *
  * However, it assumes things about the memory subsystem that may not
  * be true on all platforms.
@@ -67,39 +68,34 @@
  * that the correct faults will occur and the VM system will load the
  * necessary pages and whatnot.
  *
- * (5) It assumes that the machine-dependent trap logic provides and
- * honors a tm_badfaultfunc field in the thread_machdep structure.
- * This feature works as follows: if an otherwise fatal fault occurs
- * in kernel mode, and tm_badfaultfunc is set, execution resumes in
- * the function pointed to by tm_badfaultfunc.
- *
- * This code works by setting tm_badfaultfunc and then copying memory
- * in an ordinary fashion. If these five assumptions are satisfied,
- * which is the case for many ordinary CPU types, this code should
- * function correctly. If the assumptions are not satisfied on some
- * platform (for instance, certain old 80386 processors violate
- * assumption 3), this code cannot be used, and cpu- or platform-
- * specific code must be written.
- *
- * To make use of this code, in addition to tm_badfaultfunc the
- * thread_machdep structure should contain a jmp_buf called
- * "tm_copyjmp".
+ * (5) It assumes that the machine-dependent trap logic calls
+ * copyfixup for an otherwise fatal fault in kernel mode, and resumes
+ * at the address it returns, if any.
  */
 
 /*
- * Recovery function. If a fatal fault occurs during copyin, copyout,
- * copyinstr, or copyoutstr, execution resumes here. (This behavior is
- * caused by setting t_machdep.tm_badfaultfunc and is implemented in
- * machine-dependent code.)
- *
- * We use the C standard function longjmp() to teleport up the call
- * stack to where setjmp() was called. At that point we return EFAULT.
+ * The fixup table, built by usercopy.S: a (faulting PC, where to
+ * resume) pair for each instruction there that touches user memory.
  */
-static
-void
-copyfail(void)
+struct copyfixup {
+	vaddr_t cf_pc;
+	vaddr_t cf_resume;
+};
+
+extern const struct copyfixup usercopy_fixups[];
+extern const struct copyfixup usercopy_fixups_end[];
+
+vaddr_t
+copyfixup(vaddr_t pc)
 {
-	longjmp(curthread->t_machdep.tm_copyjmp, 1);
+	const struct copyfixup *cf;
+
+	for (cf = usercopy_fixups; cf < usercopy_fixups_end; cf++) {
+		if (cf->cf_pc == pc) {
+			return cf->cf_resume;
+		}
+	}
+	return 0;
 }
 
 /*
@@ -146,8 +142,7 @@ copycheck(const_userptr_t userptr, size_t len, size_t *stoplen)
  * copyin
  *
  * Copy a block of memory of length LEN from user-level address USERSRC
- * to kernel address DEST. We can use memcpy because it's protected by
- * the tm_badfaultfunc/copyfail logic.
+ * to kernel address DEST.
  */
 int
 copyin(const_userptr_t usersrc, void *dest, size_t len)
@@ -164,26 +159,14 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
 		return EFAULT;
 	}
 
-	curthread->t_machdep.tm_badfaultfunc = copyfail;
-
-	result = setjmp(curthread->t_machdep.tm_copyjmp);
-	if (result) {
-		curthread->t_machdep.tm_badfaultfunc = NULL;
-		return EFAULT;
-	}
-
-	memcpy(dest, (const void *)usersrc, len);
-
-	curthread->t_machdep.tm_badfaultfunc = NULL;
-	return 0;
+	return usercopy(dest, (const void *)usersrc, len);
 }
 
 /*
  * copyout
  *
  * Copy a block of memory of length LEN from kernel address SRC to
- * user-level address USERDEST. We can use memcpy because it's
- * protected by the tm_badfaultfunc/copyfail logic.
+ * user-level address USERDEST.
  */
 int
 copyout(const void *src, userptr_t userdest, size_t len)
@@ -200,18 +183,7 @@ copyout(const void *src, userptr_t userdest, size_t len)
 		return EFAULT;
 	}
 
-	curthread->t_machdep.tm_badfaultfunc = copyfail;
-
-	result = setjmp(curthread->t_machdep.tm_copyjmp);
-	if (result) {
-		curthread->t_machdep.tm_badfaultfunc = NULL;
-		return EFAULT;
-	}
-
-	memcpy((void *)userdest, src, len);
-
-	curthread->t_machdep.tm_badfaultfunc = NULL;
-	return 0;
+	return usercopy((void *)userdest, src, len);
 }
 
 /*
@@ -235,32 +207,22 @@ int
 copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	size_t *gotlen)
 {
-	size_t i;
+	int result;
 
-	for (i=0; i<maxlen && i<stoplen; i++) {
-		dest[i] = src[i];
-		if (src[i] == 0) {
-			if (gotlen != NULL) {
-				*gotlen = i+1;
-			}
-			return 0;
-		}
-	}
-	if (stoplen < maxlen) {
+	result = usercopystr(dest, src, maxlen < stoplen ? maxlen : stoplen,
+			     gotlen);
+	if (result == ENAMETOOLONG && stoplen < maxlen) {
 		/* ran into user-kernel boundary */
 		return EFAULT;
 	}
-	/* otherwise just ran out of space */
-	return ENAMETOOLONG;
+	return result;
 }
 
 /*
  * copyinstr
  *
  * Copy a string from user-level address USERSRC to kernel address
- * DEST, as per copystr above. Uses the tm_badfaultfunc/copyfail
- * logic to protect against invalid addresses supplied by a user
- * process.
+ * DEST, as per copystr above.
  */
 int
 copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *actual)
@@ -273,27 +235,14 @@ copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *actual)
 		return result;
 	}
 
-	curthread->t_machdep.tm_badfaultfunc = copyfail;
-
-	result = setjmp(curthread->t_machdep.tm_copyjmp);
-	if (result) {
-		curthread->t_machdep.tm_badfaultfunc = NULL;
-		return EFAULT;
-	}
-
-	result = copystr(dest, (const char *)usersrc, len, stoplen, actual);
-
-	curthread->t_machdep.tm_badfaultfunc = NULL;
-	return result;
+	return copystr(dest, (const char *)usersrc, len, stoplen, actual);
 }
 
 /*
  * copyoutstr
  *
  * Copy a string from kernel address SRC to user-level address
- * USERDEST, as per copystr above. Uses the tm_badfaultfunc/copyfail
- * logic to protect against invalid addresses supplied by a user
- * process.
+ * USERDEST, as per copystr above.
  */
 int
 copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *actual)
@@ -306,16 +255,5 @@ copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *actual)
 		return result;
 	}
 
-	curthread->t_machdep.tm_badfaultfunc = copyfail;
-
-	result = setjmp(curthread->t_machdep.tm_copyjmp);
-	if (result) {
-		curthread->t_machdep.tm_badfaultfunc = NULL;
-		return EFAULT;
-	}
-
-	result = copystr((char *)userdest, src, len, stoplen, actual);
-
-	curthread->t_machdep.tm_badfaultfunc = NULL;
-	return result;
+	return copystr((char *)userdest, src, len, stoplen, actual);
 }
@@ -0,0 +1,70 @@
+/*
+ * Kernel information pages; see <kinfo.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <clock.h>
+#include <vm.h>
+#include <kinfo.h>
+
+/*
+ * Every CPU that ticks updates the time, since an idle CPU doesn't
+ * tick and any one of them might be; kinfo_lock keeps them from doing
+ * it at once, which would confuse readers about kt_seq.
+ */
+static struct spinlock kinfo_lock = SPINLOCK_INITIALIZER;
+static struct kinfo_time *kinfo_time;
+
+void
+kinfo_bootstrap(void)
+{
+	vaddr_t kpage;
+
+	kpage = alloc_kpages(1);
+	if (kpage == 0) {
+		panic("kinfo_bootstrap: Out of memory\n");
+	}
+	bzero((void *)kpage, PAGE_SIZE);
+	kinfo_time = (struct kinfo_time *)kpage;
+}
+
+void
+kinfo_hardclock(void)
+{
+	struct timespec now;
+
+	if (kinfo_time == NULL) {
+		return;
+	}
+	clock_now(&now);
+
+	spinlock_acquire(&kinfo_lock);
+	kinfo_time->kt_seq++;
+	membar_store_store();
+	kinfo_time->kt_sec = now.tv_sec;
+	kinfo_time->kt_nsec = now.tv_nsec;
+	membar_store_store();
+	kinfo_time->kt_seq++;
+	spinlock_release(&kinfo_lock);
+}
+
+paddr_t
+kinfo_timepage(void)
+{
+	if (kinfo_time == NULL) {
+		return 0;
+	}
+	return KVADDR_TO_PADDR((vaddr_t)kinfo_time);
+}
+
+void
+kinfo_set(vaddr_t kpage, pid_t pid, pid_t ppid)
+{
+	struct kinfo *ki = (struct kinfo *)kpage;
+
+	ki->ki_pid = pid;
+	ki->ki_ppid = ppid;
+}
@@ -29,8 +29,13 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <clock.h>
+#include "opt-unsw.h"
 
 /*
  * Kernel malloc.
@@ -121,6 +126,16 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * MAGAZINES puts a per-CPU cache of free blocks in front of the
+ * subpage allocator; see below. It needs the frame table to tell the
+ * size of a block being freed, and is left out when debugging the heap
+ * so every block still goes through the checks.
+ */
+#if OPT_UNSW && !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -166,88 +181,125 @@ struct pageref {
  * OS/161 performance and scalability aren't super-critical.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock_stats kmalloc_lockstats =
+	SPINLOCK_STATS_INITIALIZER("kmalloc");
+static struct spinlock kmalloc_spinlock =
+	SPINLOCK_INITIALIZER_STATS(&kmalloc_lockstats);
 
 ////////////////////////////////////////
 
 /*
  * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * Each such page carries its own header: the bitmap of which of its
+ * pagerefs are in use, and the link to the next page. Because the
+ * header is on the same page, freeing a pageref finds its page by
+ * just masking the address.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each pageref page contains 253 pagerefs, which can manage up to
+ * 253 * 4K (just under 1M) of kernel heap.
  */
 
-#define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+#define INUSE_WORDS (PAGE_SIZE / sizeof(struct pageref) / 32)
+
+struct pagerefpage_header {
+	struct pagerefpage *next;
+	unsigned numinuse;
+	uint32_t pagerefs_inuse[INUSE_WORDS];
+};
+
+#define NPAGEREFS_PER_PAGE \
+	((PAGE_SIZE - sizeof(struct pagerefpage_header)) / sizeof(struct pageref))
 
 struct pagerefpage {
+	struct pagerefpage_header hdr;
 	struct pageref refs[NPAGEREFS_PER_PAGE];
 };
 
 /*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
+ * The pageref pages, grown on demand and given back when they empty
+ * out. To avoid thrashing when one subpage page comes and goes, a
+ * page that becomes empty is kept as long as it would be the only
+ * one with free pagerefs.
  */
+static struct pagerefpage *pagerefpages;
+static unsigned num_pagerefpages;
+static unsigned pagerefs_free;
 
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
-};
+#define TOTAL_PAGEREFS (num_pagerefpages * NPAGEREFS_PER_PAGE)
 
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * Return the index of the lowest clear bit of a word that has one.
  */
-
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static
+unsigned
+lowest_clear_bit(uint32_t word)
+{
+	uint32_t bit;
+	unsigned ix;
+
+	KASSERT(word != 0xffffffff);
+	bit = ~word & (word + 1);
+	ix = 0;
+	if ((bit & 0x0000ffff) == 0) {
+		ix += 16;
+	}
+	if ((bit & 0x00ff00ff) == 0) {
+		ix += 8;
+	}
+	if ((bit & 0x0f0f0f0f) == 0) {
+		ix += 4;
+	}
+	if ((bit & 0x33333333) == 0) {
+		ix += 2;
+	}
+	if ((bit & 0x55555555) == 0) {
+		ix += 1;
+	}
+	return ix;
+}
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate a page to hold pagerefs and put it on the list. Returns
+ * false if no page could be had.
  */
 static
-void
-allocpagerefpage(struct kheap_root *root)
+bool
+allocpagerefpage(void)
 {
+	struct pagerefpage *page;
 	vaddr_t va;
-
-	KASSERT(root->page == NULL);
+	unsigned i;
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
+	 * Note that this means things can change behind our back;
+	 * but having an extra pageref page around is harmless.
 	 */
 	spinlock_release(&kmalloc_spinlock);
 	va = alloc_kpages(1);
 	spinlock_acquire(&kmalloc_spinlock);
 	if (va == 0) {
 		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
+		return false;
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
+	page = (struct pagerefpage *)va;
+	page->hdr.numinuse = 0;
+	for (i=0; i<INUSE_WORDS; i++) {
+		page->hdr.pagerefs_inuse[i] = 0;
+	}
+	/* The bits past the end of refs[] are permanently in use. */
+	for (i=NPAGEREFS_PER_PAGE; i<INUSE_WORDS*32; i++) {
+		page->hdr.pagerefs_inuse[i/32] |= ((uint32_t)1) << (i%32);
 	}
 
-	root->page = (struct pagerefpage *)va;
+	page->hdr.next = pagerefpages;
+	pagerefpages = page;
+	num_pagerefpages++;
+	pagerefs_free += NPAGEREFS_PER_PAGE;
+	return true;
 }
 
 /*
@@ -257,83 +309,80 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
+	struct pagerefpage *page;
+	uint32_t word;
+	unsigned i, j;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
+	while (pagerefs_free == 0) {
+		if (!allocpagerefpage()) {
+			return NULL;
 		}
+	}
 
-		/*
-		 * This should probably not be a linear search.
-		 */
+	for (page = pagerefpages; page != NULL; page = page->hdr.next) {
+		if (page->hdr.numinuse >= NPAGEREFS_PER_PAGE) {
+			continue;
+		}
 		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
+			word = page->hdr.pagerefs_inuse[i];
+			if (word == 0xffffffff) {
 				/* full */
 				continue;
 			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
+			j = lowest_clear_bit(word);
+			page->hdr.pagerefs_inuse[i] = word | (((uint32_t)1) << j);
+			page->hdr.numinuse++;
+			pagerefs_free--;
+			KASSERT(i*32 + j < NPAGEREFS_PER_PAGE);
+			return &page->refs[i*32 + j];
 		}
+		/* numinuse said there was a free one */
+		KASSERT(0);
 	}
 
-	/* ran out */
+	/* pagerefs_free said there was a free one */
+	panic("kmalloc: pageref free count is wrong\n");
 	return NULL;
 }
 
 /*
- * Release a pageref structure.
+ * Release a pageref structure. If that leaves its page empty and
+ * there are enough other free pagerefs, unlink the page and return
+ * it; the caller should give it to free_kpages after dropping the
+ * spinlock. Otherwise returns 0.
  */
 static
-void
+vaddr_t
 freepageref(struct pageref *p)
 {
-	size_t i, j;
+	struct pagerefpage *page, **pp;
+	size_t j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
+	page = (struct pagerefpage *)((vaddr_t)p & PAGE_FRAME);
+	j = p - page->refs;
+	KASSERT(j < NPAGEREFS_PER_PAGE);
 
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	k = ((uint32_t)1) << (j%32);
+	KASSERT((page->hdr.pagerefs_inuse[j/32] & k) != 0);
+	page->hdr.pagerefs_inuse[j/32] &= ~k;
+	KASSERT(page->hdr.numinuse > 0);
+	page->hdr.numinuse--;
+	pagerefs_free++;
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
+	if (page->hdr.numinuse > 0 ||
+	    pagerefs_free < 2 * NPAGEREFS_PER_PAGE) {
+		return 0;
 	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+
+	for (pp = &pagerefpages; *pp != page; pp = &(*pp)->hdr.next) {
+		/* pageref wasn't on any of the pages */
+		KASSERT(*pp != NULL);
+	}
+	*pp = page->hdr.next;
+	num_pagerefpages--;
+	pagerefs_free -= NPAGEREFS_PER_PAGE;
+	return (vaddr_t)page;
 }
 
 ////////////////////////////////////////
@@ -345,6 +394,76 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+////////////////////////////////////////
+//
+// Statistics.
+//
+//    kheapstats[] keeps cumulative counts for each block size, under
+//    kmalloc_spinlock; the extra last entry counts whole-page
+//    allocations, under kheapstats_lock. With magazines, blocks the
+//    subpage allocator hands out count as in use until they come back
+//    to it, wherever they are meanwhile; blocks recycled through the
+//    magazines are counted per CPU (see struct kmalloc_cpu).
+//
+//    Two dearer kinds of accounting can be turned on at run time (see
+//    kheap_trace): a log2 histogram of kmalloc latency, which reads
+//    the clock twice per call, and counts by call site, using the
+//    return address as LABELS does. Call sites are only counted at
+//    allocation; LABELS and khdump are still the way to see which
+//    blocks are outstanding.
+//
+
+struct kheap_sizestats {
+	unsigned allocs;	/* blocks (or big allocations) handed out */
+	unsigned frees;		/* ... and given back */
+	unsigned fills;		/* fresh pages carved into blocks */
+	unsigned returns;	/* pages given back to the page allocator */
+	unsigned inuse;		/* outstanding now */
+	unsigned peak;		/* at most */
+};
+
+static struct kheap_sizestats kheapstats[NSIZES + 1];
+static struct spinlock kheapstats_lock = SPINLOCK_INITIALIZER;
+
+#define KHEAP_LATENCY_BUCKETS 32	/* bucket i is [2^i, 2^(i+1)) ns */
+static volatile bool kheap_latency_on;
+static unsigned kheap_latency[KHEAP_LATENCY_BUCKETS];
+
+#define KHEAP_SITES 64
+static volatile bool kheap_sites_on;
+static struct {
+	vaddr_t site;
+	unsigned allocs;
+	size_t bytes;
+} kheap_sites[KHEAP_SITES];
+static unsigned kheap_sites_overflow;	/* calls from sites not in the table */
+
+static
+void
+kheapstats_alloc(struct kheap_sizestats *ks)
+{
+	ks->allocs++;
+	ks->inuse++;
+	if (ks->inuse > ks->peak) {
+		ks->peak = ks->inuse;
+	}
+}
+
+static
+void
+kheapstats_free(struct kheap_sizestats *ks)
+{
+	ks->frees++;
+	/* pages from alloc_kpages are sometimes handed to kfree */
+	if (ks->inuse > 0) {
+		ks->inuse--;
+	}
+}
+
+#ifdef MAGAZINES
+static void magazine_counts(unsigned *hits, unsigned *cached);
+#endif
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -794,6 +913,106 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+/*
+ * Print the counts for each block size. "used" is how much of the
+ * space in the pages held for that size is in blocks in use.
+ */
+static
+void
+kheap_printsizes(void)
+{
+	struct kheap_sizestats ks[NSIZES + 1];
+	unsigned hits[NSIZES], cached[NSIZES];
+	unsigned i, npages;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	memcpy(ks, kheapstats, NSIZES * sizeof(ks[0]));
+	spinlock_release(&kmalloc_spinlock);
+	spinlock_acquire(&kheapstats_lock);
+	ks[NSIZES] = kheapstats[NSIZES];
+	spinlock_release(&kheapstats_lock);
+
+	bzero(hits, sizeof(hits));
+	bzero(cached, sizeof(cached));
+#ifdef MAGAZINES
+	magazine_counts(hits, cached);
+#endif
+
+	kprintf("  size     allocs      frees   mag hits mag frees  "
+		"pages  fills returns  in use    peak  used\n");
+	for (i=0; i<NSIZES; i++) {
+		npages = ks[i].fills - ks[i].returns;
+		kprintf("  %4zu %10u %10u %10u %9u %6u %6u %7u %7u %7u  %3u%%\n",
+			sizes[i], ks[i].allocs, ks[i].frees, hits[i],
+			cached[i], npages, ks[i].fills, ks[i].returns,
+			ks[i].inuse, ks[i].peak,
+			npages == 0 ? 0 :
+			(unsigned)((uint64_t)ks[i].inuse * sizes[i] * 100 /
+				   ((uint64_t)npages * PAGE_SIZE)));
+	}
+	kprintf("  large %9u %10u %51u %7u\n",
+		ks[NSIZES].allocs, ks[NSIZES].frees,
+		ks[NSIZES].inuse, ks[NSIZES].peak);
+}
+
+/*
+ * Report the subpage allocator's footprint: the bytes in blocks
+ * outstanding, and the bytes in the pages it holds for them.
+ */
+void
+kheap_usage(size_t *used, size_t *held)
+{
+	unsigned i;
+
+	*used = 0;
+	*held = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<NSIZES; i++) {
+		*used += (size_t)kheapstats[i].inuse * sizes[i];
+		*held += (size_t)(kheapstats[i].fills - kheapstats[i].returns)
+			* PAGE_SIZE;
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Print whatever kheap_trace has collected.
+ */
+static
+void
+kheap_printtrace(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&kheapstats_lock);
+	if (kheap_latency_on) {
+		kprintf("kmalloc latency:\n");
+		for (i=0; i<KHEAP_LATENCY_BUCKETS; i++) {
+			if (kheap_latency[i] != 0) {
+				kprintf("  %10u+ ns %10u\n",
+					i == 0 ? 0 : 1U << i,
+					kheap_latency[i]);
+			}
+		}
+	}
+	if (kheap_sites_on) {
+		kprintf("kmalloc call sites:\n");
+		for (i=0; i<KHEAP_SITES; i++) {
+			if (kheap_sites[i].site != 0) {
+				kprintf("  0x%08lx %10u calls %10zu bytes\n",
+					(unsigned long)kheap_sites[i].site,
+					kheap_sites[i].allocs,
+					kheap_sites[i].bytes);
+			}
+		}
+		if (kheap_sites_overflow > 0) {
+			kprintf("  (other)    %10u calls\n",
+				kheap_sites_overflow);
+		}
+	}
+	spinlock_release(&kheapstats_lock);
+}
+
 /*
  * Print the whole heap.
  */
@@ -812,6 +1031,33 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kheap_printsizes();
+	kheap_printtrace();
+}
+
+/*
+ * Turn the run-time accounting in WHAT (KHEAP_TRACE_LATENCY and/or
+ * KHEAP_TRACE_SITES) on or off. Turning it on starts it afresh.
+ */
+void
+kheap_trace(int what, bool on)
+{
+	spinlock_acquire(&kheapstats_lock);
+	if (what & KHEAP_TRACE_LATENCY) {
+		if (on) {
+			bzero(kheap_latency, sizeof(kheap_latency));
+		}
+		kheap_latency_on = on;
+	}
+	if (what & KHEAP_TRACE_SITES) {
+		if (on) {
+			bzero(kheap_sites, sizeof(kheap_sites));
+			kheap_sites_overflow = 0;
+		}
+		kheap_sites_on = on;
+	}
+	spinlock_release(&kheapstats_lock);
 }
 
 ////////////////////////////////////////
@@ -929,6 +1175,7 @@ subpage_kmalloc(size_t sz
 			retptr = fl;
 			fl = fl->next;
 			pr->nfree--;
+			kheapstats_alloc(&kheapstats[blktype]);
 
 			if (fl != NULL) {
 				KASSERT(pr->nfree > 0);
@@ -971,6 +1218,9 @@ subpage_kmalloc(size_t sz
 		return NULL;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
+#ifdef MAGAZINES
+	frame_set_kmalloc_type(KVADDR_TO_PADDR(prpage), blktype);
+#endif
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
@@ -988,6 +1238,7 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	kheapstats[blktype].fills++;
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1029,6 +1280,7 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t refpage;	// emptied pageref page to give back
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
@@ -1136,15 +1388,20 @@ subpage_kfree(void *ptr)
 	}
 	pr->freelist_offset = offset;
 	pr->nfree++;
+	kheapstats_free(&kheapstats[blktype]);
 
 	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
-		freepageref(pr);
+		refpage = freepageref(pr);
+		kheapstats[blktype].returns++;
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
+		if (refpage != 0) {
+			free_kpages(refpage);
+		}
 	}
 	else {
 		spinlock_release(&kmalloc_spinlock);
@@ -1162,25 +1419,293 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+#ifdef MAGAZINES
+
+////////////////////////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+//    Each CPU keeps, for each block size, two small stacks of free
+//    blocks ("magazines"): a loaded one that kmalloc pops from and
+//    kfree pushes onto, and the previously loaded one. Both are
+//    touched only by their CPU with interrupts off, so the common case
+//    takes no lock at all. When both are empty (on allocation) or both
+//    are full (on free), a magazine is traded with the depot, a global
+//    pool of full and empty magazines under its own lock. Only when
+//    the depot has nothing to offer does a request fall through to the
+//    subpage allocator and kmalloc_spinlock.
+//
+//    The depot keeps at most DEPOT_MAX_FULL full magazines per size;
+//    beyond that the blocks are handed back to the subpage allocator,
+//    so a burst of frees doesn't pin heap pages forever. Blocks sitting
+//    in magazines show as in use in kheap_printstats.
+//
+//    kfree finds a block's size by the tag frame_set_kmalloc_type
+//    leaves on each subpage page.
+//
+
+#define MAG_ROUNDS 14		/* makes struct magazine 64 bytes */
+#define DEPOT_MAX_FULL 4
+
+struct magazine {
+	struct magazine *next;	/* on a depot list */
+	unsigned nrounds;	/* blocks in rounds[] */
+	void *rounds[MAG_ROUNDS];
+};
+
+struct kmalloc_cpu {
+	struct magazine *loaded[NSIZES];
+	struct magazine *previous[NSIZES];
+	unsigned hits[NSIZES];		/* allocations served from magazines */
+	unsigned cached[NSIZES];	/* frees kept in them */
+	struct kmalloc_cpu *next;	/* list of all of them, for stats */
+};
+
+static struct spinlock depot_lock = SPINLOCK_INITIALIZER;
+static struct magazine *depot_full[NSIZES];
+static unsigned depot_nfull[NSIZES];
+static struct magazine *depot_empty;
+static struct kmalloc_cpu *kmalloc_cpus;	/* under depot_lock */
+
+/*
+ * Return this CPU's magazines, setting them up the first time. NULL
+ * if that fails, or if it's too early in boot to tell which CPU we
+ * are on; the caller then goes straight to the subpage allocator.
+ * Called with interrupts off.
+ */
+static
+struct kmalloc_cpu *
+magazine_cpu(void)
+{
+	struct kmalloc_cpu *kc;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	kc = curcpu->c_kmalloc;
+	if (kc == NULL) {
+		kc = subpage_kmalloc(sizeof(*kc));
+		if (kc == NULL) {
+			return NULL;
+		}
+		bzero(kc, sizeof(*kc));
+		curcpu->c_kmalloc = kc;
+		spinlock_acquire(&depot_lock);
+		kc->next = kmalloc_cpus;
+		kmalloc_cpus = kc;
+		spinlock_release(&depot_lock);
+	}
+	return kc;
+}
+
+/*
+ * Get an empty magazine from the depot, or make one.
+ */
+static
+struct magazine *
+magazine_get_empty(void)
+{
+	struct magazine *mag;
+
+	spinlock_acquire(&depot_lock);
+	mag = depot_empty;
+	if (mag != NULL) {
+		depot_empty = mag->next;
+	}
+	spinlock_release(&depot_lock);
+
+	if (mag == NULL) {
+		mag = subpage_kmalloc(sizeof(*mag));
+		if (mag == NULL) {
+			return NULL;
+		}
+	}
+	mag->next = NULL;
+	mag->nrounds = 0;
+	return mag;
+}
+
+/*
+ * Hand a full magazine of BLKTYPE blocks to the depot, or if the depot
+ * has enough already, empty it back into the subpage allocator.
+ * Returns the magazine, now empty, if the depot didn't take it.
+ */
+static
+struct magazine *
+magazine_put_full(struct magazine *mag, unsigned blktype)
+{
+	int result;
+
+	spinlock_acquire(&depot_lock);
+	if (depot_nfull[blktype] < DEPOT_MAX_FULL) {
+		mag->next = depot_full[blktype];
+		depot_full[blktype] = mag;
+		depot_nfull[blktype]++;
+		mag = NULL;
+	}
+	spinlock_release(&depot_lock);
+
+	if (mag != NULL) {
+		while (mag->nrounds > 0) {
+			result = subpage_kfree(mag->rounds[--mag->nrounds]);
+			KASSERT(result == 0);
+		}
+	}
+	return mag;
+}
+
+/*
+ * Allocate a block of size class BLKTYPE from this CPU's magazines.
+ * Returns NULL if there is none to hand.
+ */
+static
+void *
+magazine_alloc(unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	void *ret;
+	int spl;
+
+	spl = splhigh();
+	kc = magazine_cpu();
+	if (kc == NULL) {
+		splx(spl);
+		return NULL;
+	}
+
+	mag = kc->loaded[blktype];
+	if (mag == NULL || mag->nrounds == 0) {
+		mag = kc->previous[blktype];
+		if (mag == NULL || mag->nrounds == 0) {
+			/* trade the empty one for a full one from the depot */
+			spinlock_acquire(&depot_lock);
+			mag = depot_full[blktype];
+			if (mag != NULL) {
+				depot_full[blktype] = mag->next;
+				depot_nfull[blktype]--;
+				if (kc->previous[blktype] != NULL) {
+					kc->previous[blktype]->next =
+						depot_empty;
+					depot_empty = kc->previous[blktype];
+				}
+			}
+			spinlock_release(&depot_lock);
+			if (mag == NULL) {
+				splx(spl);
+				return NULL;
+			}
+			kc->previous[blktype] = NULL;
+		}
+		/* load it, keeping the other one as previous */
+		kc->previous[blktype] = kc->loaded[blktype];
+		kc->loaded[blktype] = mag;
+	}
+
+	KASSERT(mag->nrounds > 0);
+	ret = mag->rounds[--mag->nrounds];
+	kc->hits[blktype]++;
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Free PTR into this CPU's magazines. Returns -1 if PTR isn't a
+ * subpage block, or if it couldn't be cached, in which case the
+ * caller should free it the ordinary way.
+ */
+static
+int
+magazine_free(void *ptr)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	int blktype;
+	int spl;
+
+	if ((vaddr_t)ptr < MIPS_KSEG0 || (vaddr_t)ptr >= MIPS_KSEG1) {
+		return -1;
+	}
+	blktype = frame_kmalloc_type(KVADDR_TO_PADDR((vaddr_t)ptr));
+	if (blktype < 0) {
+		return -1;
+	}
+	KASSERT(blktype < NSIZES);
+	if (((vaddr_t)ptr % PAGE_SIZE) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	spl = splhigh();
+	kc = magazine_cpu();
+	if (kc == NULL) {
+		splx(spl);
+		return -1;
+	}
+
+	mag = kc->loaded[blktype];
+	if (mag == NULL || mag->nrounds == MAG_ROUNDS) {
+		mag = kc->previous[blktype];
+		if (mag == NULL || mag->nrounds == MAG_ROUNDS) {
+			/* get rid of the full one and start an empty one */
+			if (mag != NULL) {
+				mag = magazine_put_full(mag, blktype);
+			}
+			if (mag == NULL) {
+				mag = magazine_get_empty();
+			}
+			kc->previous[blktype] = NULL;
+			if (mag == NULL) {
+				splx(spl);
+				return -1;
+			}
+		}
+		kc->previous[blktype] = kc->loaded[blktype];
+		kc->loaded[blktype] = mag;
+	}
+
+	/* as subpage_kfree does, to catch uses after free */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	KASSERT(mag->nrounds < MAG_ROUNDS);
+	mag->rounds[mag->nrounds++] = ptr;
+	kc->cached[blktype]++;
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Add up the magazine counts over all CPUs.
+ */
+static
+void
+magazine_counts(unsigned *hits, unsigned *cached)
+{
+	struct kmalloc_cpu *kc;
+	unsigned i;
+
+	spinlock_acquire(&depot_lock);
+	for (kc = kmalloc_cpus; kc != NULL; kc = kc->next) {
+		for (i=0; i<NSIZES; i++) {
+			hits[i] += kc->hits[i];
+			cached[i] += kc->cached[i];
+		}
+	}
+	spinlock_release(&depot_lock);
+}
+
+#endif /* MAGAZINES */
+
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * alloc_kpages depending on how big SZ is. CALLER is kmalloc's caller.
  */
+static
 void *
-kmalloc(size_t sz)
+kmalloc_block(size_t sz, vaddr_t caller)
 {
 	size_t checksz;
-#ifdef LABELS
-	vaddr_t label;
-#endif
 
-#ifdef LABELS
-#ifdef __GNUC__
-	label = (vaddr_t)__builtin_return_address(0);
-#else
-#error "Don't know how to get return address with this compiler"
-#endif /* __GNUC__ */
-#endif /* LABELS */
+	(void)caller;
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
@@ -1195,16 +1720,108 @@ kmalloc(size_t sz)
 		}
 		KASSERT(address % PAGE_SIZE == 0);
 
+		spinlock_acquire(&kheapstats_lock);
+		kheapstats_alloc(&kheapstats[NSIZES]);
+		spinlock_release(&kheapstats_lock);
+
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	{
+		void *ptr;
+
+		ptr = magazine_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
+
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+	return subpage_kmalloc(sz, caller);
 #else
 	return subpage_kmalloc(sz);
 #endif
 }
 
+/*
+ * Record a kmalloc call for the run-time accounting, if it's on.
+ * BEFORE is NULL if the call wasn't timed.
+ */
+static
+void
+kheap_trace_record(vaddr_t caller, size_t sz,
+		   const struct timespec *before, const struct timespec *after)
+{
+	struct timespec diff;
+	uint64_t ns;
+	unsigned i, bucket;
+
+	spinlock_acquire(&kheapstats_lock);
+	if (kheap_latency_on && before != NULL) {
+		timespec_sub(after, before, &diff);
+		ns = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+		for (bucket = 0; bucket < KHEAP_LATENCY_BUCKETS-1 && ns > 1;
+		     bucket++) {
+			ns >>= 1;
+		}
+		kheap_latency[bucket]++;
+	}
+	if (kheap_sites_on) {
+		i = (caller >> 2) % KHEAP_SITES;
+		while (kheap_sites[i].site != caller &&
+		       kheap_sites[i].site != 0) {
+			i = (i + 1) % KHEAP_SITES;
+			if (i == (caller >> 2) % KHEAP_SITES) {
+				break;
+			}
+		}
+		if (kheap_sites[i].site == caller ||
+		    kheap_sites[i].site == 0) {
+			kheap_sites[i].site = caller;
+			kheap_sites[i].allocs++;
+			kheap_sites[i].bytes += sz;
+		}
+		else {
+			kheap_sites_overflow++;
+		}
+	}
+	spinlock_release(&kheapstats_lock);
+}
+
+void *
+kmalloc(size_t sz)
+{
+	struct timespec before, after;
+	vaddr_t caller;
+	bool timed;
+	void *ptr;
+
+#ifdef __GNUC__
+	caller = (vaddr_t)__builtin_return_address(0);
+#else
+#error "Don't know how to get return address with this compiler"
+#endif /* __GNUC__ */
+
+	if (!kheap_latency_on && !kheap_sites_on) {
+		return kmalloc_block(sz, caller);
+	}
+
+	timed = kheap_latency_on;
+	if (timed) {
+		gettime(&before);
+	}
+	ptr = kmalloc_block(sz, caller);
+	if (timed) {
+		gettime(&after);
+	}
+	if (ptr != NULL) {
+		kheap_trace_record(caller, sz, timed ? &before : NULL, &after);
+	}
+	return ptr;
+}
+
 /*
  * Free a block previously returned from kmalloc.
  */
@@ -1216,9 +1833,19 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	if (magazine_free(ptr) == 0) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
+
+		spinlock_acquire(&kheapstats_lock);
+		kheapstats_free(&kheapstats[NSIZES]);
+		spinlock_release(&kheapstats_lock);
 	}
 }
 
@@ -0,0 +1,338 @@
+/*
+ * Object caches (slab allocator); see <objcache.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+/*
+ * A slab is one page. It starts with this header, which holds a stack
+ * of the indices of its free objects (free objects may be constructed,
+ * so they can't be chained through their own storage), and the
+ * objects follow, OBJ_ALIGN aligned.
+ */
+#define OBJ_ALIGN 8
+
+struct slab {
+	struct objcache *s_cache;
+	struct slab *s_next;		/* on oc_partial or oc_full */
+	struct slab **s_prevp;		/* what points at us */
+	unsigned s_nfree;
+	uint16_t s_free[];		/* the first s_nfree are free */
+};
+
+#define SLAB_OBJECTS(oc) \
+	ROUNDUP(sizeof(struct slab) + (oc)->oc_perslab * sizeof(uint16_t), \
+		OBJ_ALIGN)
+
+static struct spinlock objcache_list_lock = SPINLOCK_INITIALIZER;
+static struct objcache *objcache_list;
+
+////////////////////////////////////////////////////////////
+
+static
+void
+slab_insert(struct slab **head, struct slab *slab)
+{
+	slab->s_next = *head;
+	if (*head != NULL) {
+		(*head)->s_prevp = &slab->s_next;
+	}
+	slab->s_prevp = head;
+	*head = slab;
+}
+
+static
+void
+slab_remove(struct slab *slab)
+{
+	*slab->s_prevp = slab->s_next;
+	if (slab->s_next != NULL) {
+		slab->s_next->s_prevp = slab->s_prevp;
+	}
+	slab->s_next = NULL;
+	slab->s_prevp = NULL;
+}
+
+static
+void *
+slab_object(struct objcache *oc, struct slab *slab, unsigned index)
+{
+	return (char *)slab + SLAB_OBJECTS(oc) + index * oc->oc_stride;
+}
+
+/*
+ * Work out the layout on first use, and put OC on the list of caches.
+ */
+static
+void
+objcache_setup(struct objcache *oc)
+{
+	size_t stride;
+	unsigned n;
+
+	spinlock_acquire(&oc->oc_lock);
+	if (oc->oc_stride != 0) {
+		spinlock_release(&oc->oc_lock);
+		return;
+	}
+
+	stride = ROUNDUP(oc->oc_size, OBJ_ALIGN);
+	n = (PAGE_SIZE - sizeof(struct slab)) / (stride + sizeof(uint16_t));
+	while (n > 0 &&
+	       ROUNDUP(sizeof(struct slab) + n * sizeof(uint16_t), OBJ_ALIGN)
+	       + n * stride > PAGE_SIZE) {
+		n--;
+	}
+	if (n == 0) {
+		panic("objcache %s: %zu-byte objects don't fit in a slab\n",
+		      oc->oc_name, oc->oc_size);
+	}
+	oc->oc_perslab = n;
+	oc->oc_stride = stride;
+	spinlock_release(&oc->oc_lock);
+
+	spinlock_acquire(&objcache_list_lock);
+	if (!oc->oc_listed) {
+		oc->oc_next = objcache_list;
+		objcache_list = oc;
+		oc->oc_listed = true;
+	}
+	spinlock_release(&objcache_list_lock);
+}
+
+/*
+ * Get a fresh slab for OC and construct its objects. Called without
+ * the cache lock, as the constructor may well allocate memory.
+ */
+static
+struct slab *
+slab_create(struct objcache *oc)
+{
+	struct slab *slab;
+	unsigned i;
+
+	slab = (struct slab *)alloc_kpages(1);
+	if (slab == NULL) {
+		return NULL;
+	}
+	slab->s_cache = oc;
+	slab->s_next = NULL;
+	slab->s_prevp = NULL;
+
+	for (i=0; i<oc->oc_perslab; i++) {
+		if (oc->oc_ctor != NULL &&
+		    oc->oc_ctor(slab_object(oc, slab, i))) {
+			/* undo the ones that worked */
+			while (i-- > 0) {
+				if (oc->oc_dtor != NULL) {
+					oc->oc_dtor(slab_object(oc, slab, i));
+				}
+			}
+			free_kpages((vaddr_t)slab);
+			return NULL;
+		}
+		slab->s_free[i] = oc->oc_perslab - 1 - i;
+	}
+	slab->s_nfree = oc->oc_perslab;
+	return slab;
+}
+
+/*
+ * Destroy the objects of an unused slab, already off the lists, and
+ * give its page back. Called without the cache lock.
+ */
+static
+void
+slab_destroy(struct objcache *oc, struct slab *slab)
+{
+	unsigned i;
+
+	KASSERT(slab->s_nfree == oc->oc_perslab);
+	if (oc->oc_dtor != NULL) {
+		for (i=0; i<oc->oc_perslab; i++) {
+			oc->oc_dtor(slab_object(oc, slab, i));
+		}
+	}
+	free_kpages((vaddr_t)slab);
+}
+
+////////////////////////////////////////////////////////////
+
+struct objcache *
+objcache_create(const char *name, size_t size,
+		int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct objcache *oc;
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+
+	oc->oc_name = name;
+	oc->oc_size = size;
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+	oc->oc_typesafe = false;
+	spinlock_init(&oc->oc_lock);
+	oc->oc_stride = 0;
+	oc->oc_perslab = 0;
+	oc->oc_partial = NULL;
+	oc->oc_full = NULL;
+	oc->oc_nslabs = 0;
+	oc->oc_nempty = 0;
+	oc->oc_inuse = 0;
+	oc->oc_allocs = 0;
+	oc->oc_frees = 0;
+	oc->oc_ctors = 0;
+	oc->oc_next = NULL;
+	oc->oc_listed = false;
+
+	objcache_setup(oc);
+	return oc;
+}
+
+/*
+ * Destroy a cache made by objcache_create. Every object must have been
+ * freed.
+ */
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache **p;
+	struct slab *slab;
+
+	KASSERT(oc->oc_inuse == 0);
+	KASSERT(oc->oc_full == NULL);
+
+	spinlock_acquire(&objcache_list_lock);
+	for (p = &objcache_list; *p != NULL; p = &(*p)->oc_next) {
+		if (*p == oc) {
+			*p = oc->oc_next;
+			break;
+		}
+	}
+	spinlock_release(&objcache_list_lock);
+
+	while ((slab = oc->oc_partial) != NULL) {
+		slab_remove(slab);
+		slab_destroy(oc, slab);
+	}
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc);
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct slab *slab;
+	void *obj;
+
+	if (oc->oc_stride == 0) {
+		objcache_setup(oc);
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	slab = oc->oc_partial;
+	if (slab == NULL) {
+		spinlock_release(&oc->oc_lock);
+		slab = slab_create(oc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		slab_insert(&oc->oc_partial, slab);
+		oc->oc_nslabs++;
+		oc->oc_nempty++;
+		if (oc->oc_ctor != NULL) {
+			oc->oc_ctors += oc->oc_perslab;
+		}
+	}
+
+	KASSERT(slab->s_nfree > 0);
+	if (slab->s_nfree == oc->oc_perslab) {
+		oc->oc_nempty--;
+	}
+	obj = slab_object(oc, slab, slab->s_free[--slab->s_nfree]);
+	if (slab->s_nfree == 0) {
+		slab_remove(slab);
+		slab_insert(&oc->oc_full, slab);
+	}
+	oc->oc_inuse++;
+	oc->oc_allocs++;
+	spinlock_release(&oc->oc_lock);
+
+	return obj;
+}
+
+/*
+ * Give OBJ back to OC, in its constructed state. One completely unused
+ * slab is kept around so that alternating allocs and frees don't keep
+ * making and destroying slabs; any more than that are given back,
+ * unless the cache is type-safe.
+ */
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct slab *slab;
+	vaddr_t offset;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	slab = (struct slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(slab->s_cache == oc);
+	offset = (vaddr_t)obj - (vaddr_t)slab - SLAB_OBJECTS(oc);
+	if (offset % oc->oc_stride != 0 ||
+	    offset / oc->oc_stride >= oc->oc_perslab) {
+		panic("objcache_free: %s: invalid object %p\n",
+		      oc->oc_name, obj);
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(slab->s_nfree < oc->oc_perslab);
+	if (slab->s_nfree == 0) {
+		slab_remove(slab);
+		slab_insert(&oc->oc_partial, slab);
+	}
+	slab->s_free[slab->s_nfree++] = offset / oc->oc_stride;
+	oc->oc_inuse--;
+	oc->oc_frees++;
+
+	if (slab->s_nfree == oc->oc_perslab) {
+		if (oc->oc_nempty > 0 && !oc->oc_typesafe) {
+			slab_remove(slab);
+			oc->oc_nslabs--;
+			spinlock_release(&oc->oc_lock);
+			slab_destroy(oc, slab);
+			return;
+		}
+		oc->oc_nempty++;
+	}
+	spinlock_release(&oc->oc_lock);
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+
+	kprintf("Object caches:\n");
+
+	spinlock_acquire(&objcache_list_lock);
+	for (oc = objcache_list; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		kprintf("  %-12s %4zu bytes, %3u/slab: %u slabs, %u in use, "
+			"%u allocs, %u frees, %u constructed\n",
+			oc->oc_name, oc->oc_size, oc->oc_perslab,
+			oc->oc_nslabs, oc->oc_inuse, oc->oc_allocs,
+			oc->oc_frees, oc->oc_ctors);
+		spinlock_release(&oc->oc_lock);
+	}
+	spinlock_release(&objcache_list_lock);
+}
@@ -0,0 +1,309 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <objcache.h>
+#include <pagecache.h>
+
+/*
+ * The cache is a hash table of pages keyed by (vnode, offset). An
+ * entry is busy while it is being read in or written back; anyone
+ * else wanting it waits on pagecache_cv. No lock is held over the
+ * I/O itself, since the file system may in turn wait for the VM lock
+ * (a read() into a user buffer can fault).
+ *
+ * An entry is idle if nothing maps it but it's kept anyway, because its
+ * vnode is retained. Idle pages can't be paged out, so there's a cap on
+ * how many there may be; past it, pages are freed as usual.
+ */
+#define PAGECACHE_BUCKETS 64
+#define PAGECACHE_RETAINED 16
+#define PAGECACHE_IDLE_MAX 64
+
+struct pagecache_entry {
+    struct vnode *vn;
+    off_t offset;
+    paddr_t paddr;
+    bool dirty;
+    bool busy;
+    bool idle;
+    struct pagecache_entry *next;
+};
+
+static struct pagecache_entry *pagecache[PAGECACHE_BUCKETS];
+static struct vnode *pagecache_retained[PAGECACHE_RETAINED];
+static unsigned pagecache_idle;
+static struct objcache pagecache_entry_cache =
+    OBJCACHE_INITIALIZER("pagecache", sizeof(struct pagecache_entry), NULL, NULL);
+static struct lock *pagecache_lock;
+static struct cv *pagecache_cv;
+
+void
+pagecache_bootstrap(void) {
+    pagecache_lock = lock_create("pagecache");
+    pagecache_cv = cv_create("pagecache");
+    if (pagecache_lock == NULL || pagecache_cv == NULL) {
+        panic("pagecache_bootstrap: out of memory\n");
+    }
+}
+
+/* Return the link pointing at the entry for (VN, OFFSET), or at the NULL ending its chain. */
+static struct pagecache_entry **
+pagecache_find(struct vnode *vn, off_t offset) {
+    unsigned bucket = ((uintptr_t)vn / sizeof(void *) + offset / PAGE_SIZE) % PAGECACHE_BUCKETS;
+    struct pagecache_entry **link = &pagecache[bucket];
+
+    while (*link != NULL && ((*link)->vn != vn || (*link)->offset != offset)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static int
+pagecache_read(struct vnode *vn, off_t offset, vaddr_t kpage) {
+    struct iovec iov;
+    struct uio u;
+
+    uio_kinit(&iov, &u, (void *)kpage, PAGE_SIZE, offset, UIO_READ);
+    int result = VOP_READ(vn, &u);
+    if (result) {
+        return result;
+    }
+
+    // the part past the end of the file reads as zeros
+    bzero((char *)kpage + PAGE_SIZE - u.uio_resid, u.uio_resid);
+    return 0;
+}
+
+static int
+pagecache_write(struct vnode *vn, off_t offset, vaddr_t kpage) {
+    struct iovec iov;
+    struct uio u;
+    struct stat st;
+
+    int result = VOP_STAT(vn, &st);
+    if (result) {
+        return result;
+    }
+
+    // mapping a file never makes it longer
+    if (offset >= st.st_size) {
+        return 0;
+    }
+    size_t len = st.st_size - offset < PAGE_SIZE ? st.st_size - offset : PAGE_SIZE;
+
+    uio_kinit(&iov, &u, (void *)kpage, len, offset, UIO_WRITE);
+    return VOP_WRITE(vn, &u);
+}
+
+int
+pagecache_get(struct vnode *vn, off_t offset, vaddr_t kpage,
+              paddr_t *paddr_ret, bool *used_kpage) {
+    struct pagecache_entry *entry;
+
+    KASSERT((offset % PAGE_SIZE) == 0);
+    KASSERT(!vm_lock_do_i_hold());
+
+    lock_acquire(pagecache_lock);
+    while ((entry = *pagecache_find(vn, offset)) != NULL) {
+        if (!entry->busy) {
+            if (entry->idle) {
+                entry->idle = false;
+                pagecache_idle--;
+            }
+            frame_incref(entry->paddr);
+            lock_release(pagecache_lock);
+            *paddr_ret = entry->paddr;
+            *used_kpage = false;
+            return 0;
+        }
+        // wait for this entry only: broadcasts about other pages leave us asleep
+        cv_wait_class(pagecache_cv, pagecache_lock, (uintptr_t)entry);
+    }
+
+    // Not cached: KPAGE becomes the cache's frame for this page
+    entry = objcache_alloc(&pagecache_entry_cache);
+    if (entry == NULL) {
+        lock_release(pagecache_lock);
+        return ENOMEM;
+    }
+    entry->vn = vn;
+    entry->offset = offset;
+    entry->paddr = KVADDR_TO_PADDR(kpage);
+    entry->dirty = false;
+    entry->busy = true;
+    entry->idle = false;
+    struct pagecache_entry **link = pagecache_find(vn, offset);
+    entry->next = *link;
+    *link = entry;
+    lock_release(pagecache_lock);
+
+    int result = pagecache_read(vn, offset, kpage);
+
+    lock_acquire(pagecache_lock);
+    if (result) {
+        *pagecache_find(vn, offset) = entry->next;
+        cv_broadcast_class(pagecache_cv, pagecache_lock, (uintptr_t)entry);
+        lock_release(pagecache_lock);
+        objcache_free(&pagecache_entry_cache, entry);
+        return result;
+    }
+    entry->busy = false;
+    frame_incref(entry->paddr); // the caller's reference
+    cv_broadcast_class(pagecache_cv, pagecache_lock, (uintptr_t)entry);
+    lock_release(pagecache_lock);
+
+    *paddr_ret = entry->paddr;
+    *used_kpage = true;
+    return 0;
+}
+
+void
+pagecache_mark_dirty(struct vnode *vn, off_t offset) {
+    lock_acquire(pagecache_lock);
+    struct pagecache_entry *entry = *pagecache_find(vn, offset);
+    KASSERT(entry != NULL);
+    entry->dirty = true;
+    lock_release(pagecache_lock);
+}
+
+/* Is VN retained? Called with pagecache_lock held. */
+static bool
+pagecache_is_retained(struct vnode *vn) {
+    for (unsigned i = 0; i < PAGECACHE_RETAINED; i++) {
+        if (pagecache_retained[i] == vn) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Write back and free ENTRY, which nothing maps. Called with
+ * pagecache_lock held; returns with it released.
+ */
+static void
+pagecache_evict(struct pagecache_entry *entry) {
+    struct vnode *vn = entry->vn;
+    off_t offset = entry->offset;
+
+    KASSERT(!entry->busy && !entry->idle);
+    entry->busy = true;
+    lock_release(pagecache_lock);
+
+    if (entry->dirty) {
+        int result = pagecache_write(vn, offset, PADDR_TO_KVADDR(entry->paddr));
+        if (result) {
+            kprintf("pagecache: write back failed: %s\n", strerror(result));
+        }
+    }
+
+    lock_acquire(pagecache_lock);
+    *pagecache_find(vn, offset) = entry->next;
+    cv_broadcast_class(pagecache_cv, pagecache_lock, (uintptr_t)entry);
+    lock_release(pagecache_lock);
+
+    free_kpages(PADDR_TO_KVADDR(entry->paddr));
+    objcache_free(&pagecache_entry_cache, entry);
+}
+
+void
+pagecache_release(struct vnode *vn, off_t offset) {
+    KASSERT(!vm_lock_do_i_hold());
+
+    lock_acquire(pagecache_lock);
+    struct pagecache_entry *entry = *pagecache_find(vn, offset);
+    // still mapped somewhere, or another release got here first
+    if (entry == NULL || entry->busy || entry->idle ||
+        frame_refcount(entry->paddr) > 1) {
+        lock_release(pagecache_lock);
+        return;
+    }
+    // keep it if we may, clean, for the next mapping, unless memory is short
+    if (!entry->dirty && pagecache_idle < PAGECACHE_IDLE_MAX &&
+        pagecache_is_retained(vn) && frame_pressure() == FRAME_PRESSURE_NONE) {
+        entry->idle = true;
+        pagecache_idle++;
+        lock_release(pagecache_lock);
+        return;
+    }
+    pagecache_evict(entry);
+}
+
+bool
+pagecache_retain(struct vnode *vn) {
+    lock_acquire(pagecache_lock);
+    if (pagecache_is_retained(vn)) {
+        lock_release(pagecache_lock);
+        return true;
+    }
+    for (unsigned i = 0; i < PAGECACHE_RETAINED; i++) {
+        if (pagecache_retained[i] == NULL) {
+            pagecache_retained[i] = vn;
+            lock_release(pagecache_lock);
+            return true;
+        }
+    }
+    lock_release(pagecache_lock);
+    return false;
+}
+
+void
+pagecache_forget(struct vnode *vn) {
+    lock_acquire(pagecache_lock);
+    for (unsigned i = 0; i < PAGECACHE_RETAINED; i++) {
+        if (pagecache_retained[i] == vn) {
+            pagecache_retained[i] = NULL;
+        }
+    }
+
+    // evict drops the lock, so start over after each one
+    unsigned bucket = 0;
+    while (bucket < PAGECACHE_BUCKETS) {
+        struct pagecache_entry *entry = pagecache[bucket];
+        while (entry != NULL && (entry->vn != vn || !entry->idle)) {
+            entry = entry->next;
+        }
+        if (entry == NULL) {
+            bucket++;
+            continue;
+        }
+        entry->idle = false;
+        pagecache_idle--;
+        pagecache_evict(entry);
+        lock_acquire(pagecache_lock);
+    }
+    lock_release(pagecache_lock);
+}
+
+unsigned
+pagecache_shrink(void) {
+    unsigned n = 0;
+
+    KASSERT(!vm_lock_do_i_hold());
+
+    // as in pagecache_forget, start over after each one
+    lock_acquire(pagecache_lock);
+    unsigned bucket = 0;
+    while (bucket < PAGECACHE_BUCKETS) {
+        struct pagecache_entry *entry = pagecache[bucket];
+        while (entry != NULL && !entry->idle) {
+            entry = entry->next;
+        }
+        if (entry == NULL) {
+            bucket++;
+            continue;
+        }
+        entry->idle = false;
+        pagecache_idle--;
+        pagecache_evict(entry);
+        n++;
+        lock_acquire(pagecache_lock);
+    }
+    lock_release(pagecache_lock);
+    return n;
+}
@@ -0,0 +1,591 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <kern/vmstat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <mainbus.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * Swap lives on the second disk, used raw. Disk slot N occupies bytes
+ * [N * PAGE_SIZE, (N + 1) * PAGE_SIZE) of the device.
+ */
+#define SWAP_DEVICE "lhd1raw:"
+
+/*
+ * In front of the disk is a pool of compressed pages in kernel memory.
+ * The slots handed out by swap_alloc are our own numbers, and each says
+ * where its page went: compressed in the pool, just a repeated word (a
+ * page of zeroes, say, takes no space at all), or out on disk. swap_out
+ * tries the pool first; pages that don't compress to ZSWAP_MAXLEN go to
+ * disk, and when the pool would grow past swap_pool_max bytes, the
+ * pages longest in it are written back to disk to make room. So a
+ * working set a little bigger than memory pages without touching the
+ * disk, and with no swap disk at all there is still the pool.
+ *
+ * The disk is used in clusters of up to SWAP_CLUSTER pages where it
+ * can be. swap_writeback moves a run of neighbouring slots out of the
+ * pool at once, to as many disk slots in a row, in one request; a page
+ * that goes straight to disk goes after the disk slot of the slot
+ * before it. And reading a disk slot reads the in-use disk slots after
+ * it in the same request, keeping them in swap_rabuffer, so that the
+ * faults that follow on the pages after it don't wait for the disk.
+ * Since the VM gives virtually adjacent pages neighbouring slots
+ * (swap_alloc_near), a sequential scan pages in and out in clusters.
+ *
+ * The pool takes up to ZSWAP_POOL_DIV'th of physical memory, and there
+ * are enough slots for it plus the disk.
+ */
+#define ZSWAP_POOL_DIV 8
+#define ZSWAP_MAXLEN (PAGE_SIZE * 3 / 4)
+#define SWAP_CLUSTER 8
+
+enum swap_where {
+    SWAP_POOL,   // zdata holds zlen bytes of compressed page
+    SWAP_FILLED, // every word of the page is fill
+    SWAP_DISK,   // in disk slot disk
+};
+
+struct swap_slot {
+    union {
+        void *zdata;
+        uint32_t fill;
+        uint32_t disk;
+    } s;
+    uint16_t zlen;
+    uint8_t where;
+};
+
+static struct vnode *swap_vnode;  // NULL if there is no swap disk
+static struct bitmap *swap_map;   // one bit per disk slot, set if in use
+static unsigned swap_nslots;      // disk slots
+
+static struct bitmap *swap_slotmap; // one bit per slot of ours, set if in use
+static struct swap_slot *swap_slots;
+static unsigned swap_nvslots;
+static unsigned swap_pool_bytes, swap_pool_max, swap_pool_pages;
+static unsigned swap_hand;        // where swap_writeback looks next
+
+static void *swap_buffer;         // bounce page
+static uint8_t *swap_zbuffer;     // compression output
+static uint8_t *swap_wbuffer;     // SWAP_CLUSTER pages being written back
+
+static uint8_t *swap_rabuffer;    // SWAP_CLUSTER pages read ahead
+static unsigned swap_ra_first;    // disk slot of the first of them
+static bool swap_ra_valid[SWAP_CLUSTER]; // which are still good
+
+void
+swap_bootstrap(void) {
+    char path[] = SWAP_DEVICE;
+    struct stat st;
+    int result;
+
+    result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+    if (result) {
+        kprintf("swap: %s: %s; no swap disk\n", SWAP_DEVICE,
+                strerror(result));
+        swap_vnode = NULL;
+    } else {
+        result = VOP_STAT(swap_vnode, &st);
+        if (result || st.st_size < PAGE_SIZE) {
+            kprintf("swap: %s: unusable; no swap disk\n", SWAP_DEVICE);
+            vfs_close(swap_vnode);
+            swap_vnode = NULL;
+        } else {
+            swap_nslots = st.st_size / PAGE_SIZE;
+        }
+    }
+
+    // compressed pages are usually no more than half size
+    swap_pool_max = mainbus_ramsize() / ZSWAP_POOL_DIV;
+    swap_nvslots = swap_nslots + 2 * swap_pool_max / PAGE_SIZE;
+
+    swap_map = bitmap_create(swap_nslots > 0 ? swap_nslots : 1);
+    swap_slotmap = bitmap_create(swap_nvslots);
+    swap_slots = kmalloc(swap_nvslots * sizeof(*swap_slots));
+    swap_buffer = kmalloc(PAGE_SIZE);
+    swap_zbuffer = kmalloc(PAGE_SIZE);
+    swap_wbuffer = kmalloc(SWAP_CLUSTER * PAGE_SIZE);
+    swap_rabuffer = kmalloc(SWAP_CLUSTER * PAGE_SIZE);
+    if (swap_map == NULL || swap_slotmap == NULL || swap_slots == NULL ||
+        swap_buffer == NULL || swap_zbuffer == NULL ||
+        swap_wbuffer == NULL || swap_rabuffer == NULL) {
+        panic("swap: out of memory in bootstrap\n");
+    }
+
+    kprintf("swap: %u pages on %s, %uK compressed pool\n", swap_nslots,
+            swap_vnode == NULL ? "no disk" : SWAP_DEVICE, swap_pool_max / 1024);
+}
+
+////////////////////////////////////////////////////////////
+// Compression
+
+/*
+ * LZSS: a control byte, then for each of its bits, lowest first, a
+ * literal byte (0) or a match (1) of two bytes, a 12-bit distance back
+ * and a 4-bit length less ZSWAP_MINMATCH. Matches are found through a
+ * hash of the next 3 bytes.
+ */
+#define ZSWAP_MINMATCH 3
+#define ZSWAP_MAXMATCH (ZSWAP_MINMATCH + 15)
+#define ZSWAP_MAXDIST 4095
+#define ZSWAP_HASHBITS 10
+#define ZSWAP_NOPOS 0xffff
+
+static uint16_t swap_lzhash[1 << ZSWAP_HASHBITS];
+
+static unsigned
+zswap_hash(const uint8_t *p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761U) >> (32 - ZSWAP_HASHBITS);
+}
+
+/* Compress the page at SRC into DST; returns the length, or 0 if over MAX. */
+static unsigned
+zswap_compress(const uint8_t *src, uint8_t *dst, unsigned max) {
+    unsigned ip = 0, op = 0;
+
+    for (unsigned i = 0; i < 1 << ZSWAP_HASHBITS; i++) {
+        swap_lzhash[i] = ZSWAP_NOPOS;
+    }
+
+    while (ip < PAGE_SIZE) {
+        // room for a control byte and eight matches
+        if (op + 1 + 16 > max) {
+            return 0;
+        }
+        unsigned ctrlpos = op++;
+        uint8_t ctrl = 0;
+
+        for (unsigned bit = 0; bit < 8 && ip < PAGE_SIZE; bit++) {
+            if (ip + ZSWAP_MINMATCH <= PAGE_SIZE) {
+                unsigned h = zswap_hash(&src[ip]);
+                unsigned cand = swap_lzhash[h];
+                swap_lzhash[h] = ip;
+                if (cand != ZSWAP_NOPOS && ip - cand <= ZSWAP_MAXDIST &&
+                    src[cand] == src[ip] && src[cand + 1] == src[ip + 1] &&
+                    src[cand + 2] == src[ip + 2]) {
+                    unsigned len = ZSWAP_MINMATCH;
+                    while (len < ZSWAP_MAXMATCH && ip + len < PAGE_SIZE &&
+                           src[cand + len] == src[ip + len]) {
+                        len++;
+                    }
+                    unsigned dist = ip - cand;
+                    dst[op++] = dist >> 4;
+                    dst[op++] = ((dist & 0xf) << 4) | (len - ZSWAP_MINMATCH);
+                    ctrl |= 1 << bit;
+                    ip += len;
+                    continue;
+                }
+            }
+            dst[op++] = src[ip++];
+        }
+        dst[ctrlpos] = ctrl;
+    }
+    return op;
+}
+
+static void
+zswap_decompress(const uint8_t *src, unsigned len, uint8_t *dst) {
+    unsigned ip = 0, op = 0;
+
+    while (op < PAGE_SIZE) {
+        KASSERT(ip < len);
+        uint8_t ctrl = src[ip++];
+        for (unsigned bit = 0; bit < 8 && op < PAGE_SIZE; bit++) {
+            if (ctrl & (1 << bit)) {
+                unsigned dist = (src[ip] << 4) | (src[ip + 1] >> 4);
+                unsigned n = (src[ip + 1] & 0xf) + ZSWAP_MINMATCH;
+                ip += 2;
+                KASSERT(dist > 0 && dist <= op && op + n <= PAGE_SIZE);
+                // may overlap, so a byte at a time
+                for (unsigned i = 0; i < n; i++, op++) {
+                    dst[op] = dst[op - dist];
+                }
+            } else {
+                dst[op++] = src[ip++];
+            }
+        }
+    }
+    KASSERT(ip == len);
+}
+
+/* If every word of the page at KPAGE is the same, return true and it. */
+static bool
+zswap_filled(vaddr_t kpage, uint32_t *fill_ret) {
+    const uint32_t *words = (const uint32_t *)kpage;
+
+    for (unsigned i = 1; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != words[0]) {
+            return false;
+        }
+    }
+    *fill_ret = words[0];
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+// Disk slots
+
+/* Read or write COUNT disk slots in a row, from SLOT on, in one request. */
+static int
+swap_io(unsigned slot, unsigned count, void *buf, enum uio_rw rw) {
+    struct iovec iov;
+    struct uio u;
+    int result;
+
+    KASSERT(vm_lock_do_i_hold());
+    KASSERT(swap_vnode != NULL);
+    KASSERT(count > 0 && slot + count <= swap_nslots);
+    for (unsigned i = 0; i < count; i++) {
+        KASSERT(bitmap_isset(swap_map, slot + i));
+    }
+
+    uio_kinit(&iov, &u, buf, count * PAGE_SIZE, (off_t)slot * PAGE_SIZE, rw);
+    if (rw == UIO_READ) {
+        result = VOP_READ(swap_vnode, &u);
+    } else {
+        result = VOP_WRITE(swap_vnode, &u);
+    }
+    if (result) {
+        return result;
+    }
+    if (u.uio_resid != 0) {
+        return EIO;
+    }
+    return 0;
+}
+
+/* Forget anything read ahead from disk slot DISK, which is being freed. */
+static void
+swap_ra_forget(unsigned disk) {
+    if (disk >= swap_ra_first && disk < swap_ra_first + SWAP_CLUSTER) {
+        swap_ra_valid[disk - swap_ra_first] = false;
+    }
+}
+
+/*
+ * Read disk slot DISK into the page at KPAGE, from what was read ahead
+ * if it's there; if not, read it and the in-use slots after it.
+ */
+static int
+swap_disk_in(unsigned disk, vaddr_t kpage) {
+    unsigned i, count;
+    int result;
+
+    if (disk >= swap_ra_first && disk < swap_ra_first + SWAP_CLUSTER &&
+        swap_ra_valid[disk - swap_ra_first]) {
+        memcpy((void *)kpage, swap_rabuffer + (disk - swap_ra_first) * PAGE_SIZE,
+               PAGE_SIZE);
+        vmstat_inc(VMSTAT_SWAP_RAHITS);
+        return 0;
+    }
+
+    count = 1;
+    while (count < SWAP_CLUSTER && disk + count < swap_nslots &&
+           bitmap_isset(swap_map, disk + count)) {
+        count++;
+    }
+    for (i = 0; i < SWAP_CLUSTER; i++) {
+        swap_ra_valid[i] = false;
+    }
+    result = swap_io(disk, count, swap_rabuffer, UIO_READ);
+    if (result) {
+        return result;
+    }
+    swap_ra_first = disk;
+    for (i = 0; i < count; i++) {
+        swap_ra_valid[i] = true;
+    }
+    memcpy((void *)kpage, swap_rabuffer, PAGE_SIZE);
+    return 0;
+}
+
+/* Write the page at KPAGE to a new disk slot, at GOAL if it's free. */
+static int
+swap_disk_out(vaddr_t kpage, unsigned goal, unsigned *disk_ret) {
+    unsigned disk;
+    int result;
+
+    if (swap_vnode == NULL) {
+        return ENOSPC;
+    }
+    result = bitmap_alloc_near(swap_map, goal, &disk);
+    if (result) {
+        return result;
+    }
+    result = swap_io(disk, 1, (void *)kpage, UIO_WRITE);
+    if (result) {
+        bitmap_unmark(swap_map, disk);
+        return result;
+    }
+    *disk_ret = disk;
+    return 0;
+}
+
+static bool
+swap_in_pool(unsigned slot) {
+    return bitmap_isset(swap_slotmap, slot) && swap_slots[slot].where == SWAP_POOL;
+}
+
+/*
+ * Where to put slot SLOT on disk: after the disk slot of the slot
+ * before it, if that's on disk.
+ */
+static unsigned
+swap_disk_goal(unsigned slot) {
+    if (slot > 0 && bitmap_isset(swap_slotmap, slot - 1) &&
+        swap_slots[slot - 1].where == SWAP_DISK) {
+        return swap_slots[slot - 1].s.disk + 1;
+    }
+    return 0;
+}
+
+/*
+ * Move pages from the pool out to disk, to make room; the hand goes
+ * round the slots, so they are roughly the ones that went in first.
+ * The run of pool slots where the hand stops goes out together, up to
+ * SWAP_CLUSTER of them, if there are that many free disk slots in a
+ * row.
+ */
+static int
+swap_writeback(void) {
+    if (swap_vnode == NULL) {
+        return ENOSPC;
+    }
+
+    for (unsigned n = 0; n < swap_nvslots; n++) {
+        unsigned slot = swap_hand;
+        swap_hand = (swap_hand + 1) % swap_nvslots;
+        if (!swap_in_pool(slot)) {
+            continue;
+        }
+
+        unsigned count = 1;
+        while (count < SWAP_CLUSTER && slot + count < swap_nvslots &&
+               swap_in_pool(slot + count)) {
+            count++;
+        }
+
+        unsigned disk;
+        int result = bitmap_alloc_range(swap_map, count, &disk);
+        if (result) {
+            count = 1;
+            result = bitmap_alloc_near(swap_map, swap_disk_goal(slot), &disk);
+            if (result) {
+                return result;
+            }
+        }
+
+        for (unsigned i = 0; i < count; i++) {
+            struct swap_slot *ss = &swap_slots[slot + i];
+            zswap_decompress(ss->s.zdata, ss->zlen, swap_wbuffer + i * PAGE_SIZE);
+        }
+        result = swap_io(disk, count, swap_wbuffer, UIO_WRITE);
+        if (result) {
+            bitmap_unmark_range(swap_map, disk, count);
+            return result;
+        }
+
+        for (unsigned i = 0; i < count; i++) {
+            struct swap_slot *ss = &swap_slots[slot + i];
+            kfree(ss->s.zdata);
+            swap_pool_bytes -= ss->zlen;
+            swap_pool_pages--;
+            ss->where = SWAP_DISK;
+            ss->s.disk = disk + i;
+        }
+        swap_hand = (slot + count) % swap_nvslots;
+        vmstat_add(VMSTAT_ZSWAP_WRITEBACKS, count);
+        if (count > 1) {
+            vmstat_inc(VMSTAT_SWAP_CLUSTERS);
+        }
+        return 0;
+    }
+    return ENOSPC;
+}
+
+/* Put LEN bytes of compressed page at DATA into the pool as SLOT. */
+static int
+swap_pool_store(unsigned slot, const void *data, unsigned len) {
+    while (swap_pool_bytes + len > swap_pool_max) {
+        int result = swap_writeback();
+        if (result) {
+            return result;
+        }
+    }
+
+    void *zdata = kmalloc(len);
+    if (zdata == NULL) {
+        return ENOMEM;
+    }
+    memcpy(zdata, data, len);
+    swap_slots[slot].where = SWAP_POOL;
+    swap_slots[slot].s.zdata = zdata;
+    swap_slots[slot].zlen = len;
+    swap_pool_bytes += len;
+    swap_pool_pages++;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Slots
+
+int
+swap_alloc(unsigned *slot_ret) {
+    KASSERT(vm_lock_do_i_hold());
+
+    int result = bitmap_alloc(swap_slotmap, slot_ret);
+    if (result == 0) {
+        // nothing to release until swap_out puts it somewhere
+        swap_slots[*slot_ret].where = SWAP_FILLED;
+    }
+    return result;
+}
+
+int
+swap_alloc_near(unsigned goal, unsigned *slot_ret) {
+    KASSERT(vm_lock_do_i_hold());
+
+    int result = bitmap_alloc_near(swap_slotmap, goal, slot_ret);
+    if (result == 0) {
+        swap_slots[*slot_ret].where = SWAP_FILLED;
+    }
+    return result;
+}
+
+void
+swap_free(unsigned slot) {
+    KASSERT(vm_lock_do_i_hold());
+    KASSERT(slot < swap_nvslots);
+    KASSERT(bitmap_isset(swap_slotmap, slot));
+
+    struct swap_slot *ss = &swap_slots[slot];
+    switch (ss->where) {
+    case SWAP_POOL:
+        kfree(ss->s.zdata);
+        swap_pool_bytes -= ss->zlen;
+        swap_pool_pages--;
+        break;
+    case SWAP_DISK:
+        swap_ra_forget(ss->s.disk);
+        bitmap_unmark(swap_map, ss->s.disk);
+        break;
+    }
+    ss->where = SWAP_FILLED;
+    bitmap_unmark(swap_slotmap, slot);
+}
+
+int
+swap_in(unsigned slot, vaddr_t kpage) {
+    KASSERT(vm_lock_do_i_hold());
+    KASSERT(slot < swap_nvslots);
+    KASSERT(bitmap_isset(swap_slotmap, slot));
+
+    struct swap_slot *ss = &swap_slots[slot];
+    switch (ss->where) {
+    case SWAP_POOL:
+        zswap_decompress(ss->s.zdata, ss->zlen, (uint8_t *)kpage);
+        vmstat_inc(VMSTAT_ZSWAP_LOADS);
+        return 0;
+    case SWAP_FILLED:
+        for (unsigned i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+            ((uint32_t *)kpage)[i] = ss->s.fill;
+        }
+        vmstat_inc(VMSTAT_ZSWAP_LOADS);
+        return 0;
+    default:
+        return swap_disk_in(ss->s.disk, kpage);
+    }
+}
+
+int
+swap_out(unsigned slot, vaddr_t kpage) {
+    KASSERT(vm_lock_do_i_hold());
+    KASSERT(slot < swap_nvslots);
+    KASSERT(bitmap_isset(swap_slotmap, slot));
+
+    struct swap_slot *ss = &swap_slots[slot];
+    uint32_t fill;
+    if (zswap_filled(kpage, &fill)) {
+        ss->where = SWAP_FILLED;
+        ss->s.fill = fill;
+        vmstat_inc(VMSTAT_ZSWAP_STORES);
+        return 0;
+    }
+
+    unsigned len = zswap_compress((const uint8_t *)kpage, swap_zbuffer, ZSWAP_MAXLEN);
+    if (len > 0 && swap_pool_store(slot, swap_zbuffer, len) == 0) {
+        vmstat_inc(VMSTAT_ZSWAP_STORES);
+        return 0;
+    }
+
+    // doesn't compress, or no room for it
+    unsigned disk;
+    int result = swap_disk_out(kpage, swap_disk_goal(slot), &disk);
+    if (result) {
+        return result;
+    }
+    ss->where = SWAP_DISK;
+    ss->s.disk = disk;
+    return 0;
+}
+
+int
+swap_copy(unsigned from, unsigned *slot_ret) {
+    unsigned to;
+    int result;
+
+    KASSERT(from < swap_nvslots);
+    KASSERT(bitmap_isset(swap_slotmap, from));
+
+    result = swap_alloc(&to);
+    if (result) {
+        return result;
+    }
+
+    // the pool entry may move to disk to make room for its copy
+    struct swap_slot *ss = &swap_slots[from];
+    if (ss->where == SWAP_POOL) {
+        memcpy(swap_zbuffer, ss->s.zdata, ss->zlen);
+        result = swap_pool_store(to, swap_zbuffer, ss->zlen);
+        if (result == 0) {
+            *slot_ret = to;
+            return 0;
+        }
+    } else if (ss->where == SWAP_FILLED) {
+        swap_slots[to] = *ss;
+        *slot_ret = to;
+        return 0;
+    }
+
+    result = swap_in(from, (vaddr_t)swap_buffer);
+    if (result == 0) {
+        unsigned disk;
+        result = swap_disk_out((vaddr_t)swap_buffer, 0, &disk);
+        if (result == 0) {
+            swap_slots[to].where = SWAP_DISK;
+            swap_slots[to].s.disk = disk;
+        }
+    }
+    if (result) {
+        bitmap_unmark(swap_slotmap, to);
+        return result;
+    }
+
+    *slot_ret = to;
+    return 0;
+}
+
+void
+swap_printstats(void) {
+    kprintf("Swap: %u pages in a %u/%uK compressed pool, %u slots, %u on disk\n",
+            swap_pool_pages, swap_pool_bytes / 1024, swap_pool_max / 1024,
+            swap_nvslots, swap_nslots);
+}
@@ -1,81 +1,2249 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/vmstat.h>
 #include <lib.h>
+#include <uio.h>
+#include <vnode.h>
 #include <thread.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <machine/tlb.h>
 #include <spl.h>
 #include <proc.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <ktrace.h>
+#include <ktime.h>
+#include <kinfo.h>
+#include <clock.h>
+#include <mainbus.h>
+#include <objcache.h>
+#include <buf.h>
+
+/* Serializes paging; see vm_lock_acquire in <vm.h>. */
+static struct lock *vm_lock;
+
+/*
+ * For each CPU, the page table the assembly TLB refill handler
+ * (mips_utlb_refill in exception-mips1.S) walks, or NULL to send every
+ * miss to vm_fault; and somewhere for it to park two registers.
+ */
+PageTable *vm_utlb_pagetable[MAXCPUS];
+uint32_t vm_utlb_scratch[MAXCPUS][2];
+
+/*
+ * A frame of zeros, mapped read-only in place of fresh anonymous pages
+ * that have only been read so far. It is never freed, so its refcount
+ * never drops to one and the first write always gets a private copy.
+ */
+static paddr_t vm_zero_frame;
+static vaddr_t vm_bounce_page; // high memory frames go through here to swap
+
+/*
+ * Pool of already-zeroed frames for anonymous faults, filled by
+ * zero_thread using time the CPU would otherwise spend idle. It only
+ * runs when vm_idle wakes it, one page per wakeup. If memory is full
+ * it backs off for ZERO_POOL_BACKOFF idle periods (about one a clock
+ * tick) before trying again.
+ */
+#define ZERO_POOL_MAX 8
+#define ZERO_POOL_BACKOFF 100
+
+static struct spinlock zero_pool_lock = SPINLOCK_INITIALIZER;
+static struct wchan *zero_pool_wchan;
+static vaddr_t zero_pool[ZERO_POOL_MAX];
+static unsigned zero_pool_count;
+static unsigned zero_pool_backoff;
+
+/* What vm_reclaim does when all else fails; see <vm.h>. */
+static int vm_oom_policy = OOM_KILL_LARGEST;
+
+/*
+ * Event counters (see <kern/vmstat.h>), one set per CPU, each in its
+ * own cache lines so CPUs don't fight over them. A CPU only ever
+ * updates its own, with interrupts off, so no lock is needed; readers
+ * may see a count a few events stale.
+ */
+#define VMSTAT_CACHELINE 64
+
+static union {
+    uint32_t count[VMSTAT_NCOUNTERS];
+    char pad[ROUNDUP(sizeof(uint32_t) * VMSTAT_NCOUNTERS, VMSTAT_CACHELINE)];
+} vm_cpustats[MAXCPUS] __attribute__((aligned(VMSTAT_CACHELINE)));
 
 /* Place your page table functions here */
 
-static PTE *
-page_table_lookup(PageTable *page_table, vaddr_t vaddr) {
-    int l1_index = L1_INDEX(vaddr);
-    int l2_index = L2_INDEX(vaddr);
+#if OPT_HASHPT
+
+/*
+ * Hashed page table; see <addrspace.h>. Each entry is on its bucket's
+ * chain and on its page table's list. Everything is under the VM lock,
+ * which also keeps entries from moving while callers hold on to PTE
+ * pointers.
+ */
+struct hashpt_entry {
+    PageTable *pt;
+    vaddr_t page;
+    PTE pte;
+    struct hashpt_entry *hash_next;
+    struct hashpt_entry *pt_next;
+};
+
+static struct objcache hashpt_cache =
+    OBJCACHE_INITIALIZER("hashpt", sizeof(struct hashpt_entry), NULL, NULL);
+static struct hashpt_entry **hashpt_buckets;
+static unsigned hashpt_nbuckets; // a power of 2
+static unsigned hashpt_nentries;
+
+static void
+hashpt_bootstrap(void) {
+    unsigned nframes = mainbus_ramsize() / PAGE_SIZE;
+
+    hashpt_nbuckets = 1;
+    while (hashpt_nbuckets < nframes) {
+        hashpt_nbuckets *= 2;
+    }
+    hashpt_buckets = kmalloc(hashpt_nbuckets * sizeof(*hashpt_buckets));
+    if (hashpt_buckets == NULL) {
+        panic("vm_bootstrap: no memory for the page table\n");
+    }
+    bzero(hashpt_buckets, hashpt_nbuckets * sizeof(*hashpt_buckets));
+}
+
+static unsigned
+hashpt_hash(PageTable *pt, vaddr_t page) {
+    // page tables come from an objcache, so the low bits of the pointer say little
+    uint32_t key = ((uint32_t)(uintptr_t)pt >> 4) * 0x9e3779b1 ^ (page >> OFFSET_BITS);
+    return ((key * 0x9e3779b1) >> 16) & (hashpt_nbuckets - 1);
+}
 
-    if (page_table->tables[l1_index] == NULL) {
+PTE *
+page_table_find(PageTable *pt, vaddr_t vaddr, bool create) {
+    vaddr_t page = vaddr & PAGE_FRAME;
+    unsigned b = hashpt_hash(pt, page);
+    struct hashpt_entry *e;
+
+    KASSERT(vm_lock_do_i_hold());
+
+    for (e = hashpt_buckets[b]; e != NULL; e = e->hash_next) {
+        if (e->pt == pt && e->page == page) {
+            return &e->pte;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    e = objcache_alloc(&hashpt_cache);
+    if (e == NULL) {
+        return NULL;
+    }
+    e->pt = pt;
+    e->page = page;
+    e->pte.frame = 0;
+    e->hash_next = hashpt_buckets[b];
+    hashpt_buckets[b] = e;
+    e->pt_next = pt->entries;
+    pt->entries = e;
+    pt->nentries++;
+    hashpt_nentries++;
+    return &e->pte;
+}
+
+PTE *
+page_table_next_entry(PageTable *pt, struct hashpt_entry **cursor, vaddr_t *vaddr_ret) {
+    struct hashpt_entry *e = *cursor == NULL ? pt->entries : (*cursor)->pt_next;
+    if (e == NULL) {
         return NULL;
     }
+    *cursor = e;
+    *vaddr_ret = e->page;
+    return &e->pte;
+}
+
+void
+page_table_free_entries(PageTable *pt) {
+    struct hashpt_entry *e, **ep;
+
+    KASSERT(vm_lock_do_i_hold());
+
+    while ((e = pt->entries) != NULL) {
+        pt->entries = e->pt_next;
+        for (ep = &hashpt_buckets[hashpt_hash(pt, e->page)]; *ep != e; ep = &(*ep)->hash_next) {
+            KASSERT(*ep != NULL);
+        }
+        *ep = e->hash_next;
+        objcache_free(&hashpt_cache, e);
+        hashpt_nentries--;
+    }
+    pt->nentries = 0;
+}
+
+/* Return the entry slot for VADDR, valid or not, or NULL if there is none. */
+static PTE *
+page_table_slot(PageTable *page_table, vaddr_t vaddr) {
+    return page_table_find(page_table, vaddr, false);
+}
 
-    PTE *entry = page_table->tables[l1_index]->entries[l2_index];
+static PTE *
+page_table_lookup(PageTable *page_table, vaddr_t vaddr) {
+    PTE *entry = page_table_slot(page_table, vaddr);
+    if (entry == NULL || !PTE_VALID(entry)) {
+        return NULL;
+    }
     return entry;
 }
 
 static int
 page_table_add_entry(PageTable *page_table, vaddr_t vaddr, paddr_t paddr) {
+    KASSERT(paddr & TLBLO_VALID);
 
-    PTE *pte = kmalloc(sizeof(*pte));
+    PTE *pte = page_table_find(page_table, vaddr, true);
     if (pte == NULL) {
         return ENOMEM;
     }
-
+    KASSERT(!PTE_VALID(pte));
     pte->frame = paddr;
 
+    return 0;
+}
+
+void
+page_table_set_pte(PageTable *pt, vaddr_t vaddr, PTE *pte, paddr_t frame) {
+    (void)pt;
+    (void)vaddr;
+    pte->frame = frame;
+}
+
+#else /* OPT_HASHPT */
+
+L2Table *
+page_table_get_l2(PageTable *pt, unsigned l1_index) {
+    KASSERT(l1_index < 1 << L1_BITS);
+
+    if (pt->directory != NULL) {
+        return pt->directory[l1_index];
+    }
+    for (unsigned i = 0; i < pt->nslots; i++) {
+        if (pt->slots[i].l1_index == l1_index) {
+            return pt->slots[i].table;
+        }
+    }
+    return NULL;
+}
+
+struct l2_occupancy *
+page_table_get_occupancy(PageTable *pt, unsigned l1_index) {
+    KASSERT(l1_index < 1 << L1_BITS);
+
+    if (pt->directory != NULL) {
+        return pt->directory[l1_index] != NULL ? &pt->dir_occupancy[l1_index] : NULL;
+    }
+    for (unsigned i = 0; i < pt->nslots; i++) {
+        if (pt->slots[i].l1_index == l1_index) {
+            return &pt->occupancy[i];
+        }
+    }
+    return NULL;
+}
+
+int
+page_table_set_l2(PageTable *pt, unsigned l1_index, L2Table *l2) {
+    KASSERT(l2 != NULL);
+    KASSERT(page_table_get_l2(pt, l1_index) == NULL);
+
+    if (pt->directory == NULL && pt->nslots < PT_INLINE_SLOTS) {
+        pt->slots[pt->nslots].l1_index = l1_index;
+        pt->slots[pt->nslots].table = l2;
+        pt->occupancy[pt->nslots].live = 0;
+        pt->occupancy[pt->nslots].groups = 0;
+        pt->nslots++;
+        return 0;
+    }
+
+    if (pt->directory == NULL) {
+        // out of inline slots, switch over to a full directory (occupancy after it)
+        size_t size = (sizeof(L2Table *) + sizeof(struct l2_occupancy)) << L1_BITS;
+        L2Table **directory = kmalloc(size);
+        if (directory == NULL) {
+            return ENOMEM;
+        }
+        bzero(directory, size);
+        struct l2_occupancy *occupancy = (struct l2_occupancy *)(directory + (1 << L1_BITS));
+        for (unsigned i = 0; i < pt->nslots; i++) {
+            directory[pt->slots[i].l1_index] = pt->slots[i].table;
+            occupancy[pt->slots[i].l1_index] = pt->occupancy[i];
+        }
+        pt->dir_occupancy = occupancy;
+        pt->directory = directory;
+        pt->nslots = 0;
+    }
+
+    pt->directory[l1_index] = l2;
+    pt->dir_occupancy[l1_index].live = 0;
+    pt->dir_occupancy[l1_index].groups = 0;
+    return 0;
+}
+
+/*
+ * Take the L2 table for L1_INDEX out of PT and return it, for the
+ * caller to free once no TLB refill can be looking at it.
+ */
+static L2Table *
+page_table_unset_l2(PageTable *pt, unsigned l1_index) {
+    L2Table *l2;
+
+    if (pt->directory != NULL) {
+        l2 = pt->directory[l1_index];
+        pt->directory[l1_index] = NULL;
+        return l2;
+    }
+    for (unsigned i = 0; i < pt->nslots; i++) {
+        if (pt->slots[i].l1_index == l1_index) {
+            // fill the hole with the last slot
+            l2 = pt->slots[i].table;
+            pt->nslots--;
+            pt->slots[i] = pt->slots[pt->nslots];
+            pt->occupancy[i] = pt->occupancy[pt->nslots];
+            return l2;
+        }
+    }
+    return NULL;
+}
+
+bool
+page_table_next_l2(PageTable *pt, unsigned *cursor,
+                   unsigned *l1_index_ret, L2Table **l2_ret) {
+    if (pt->directory != NULL) {
+        while (*cursor < 1 << L1_BITS) {
+            unsigned i = (*cursor)++;
+            if (pt->directory[i] != NULL) {
+                *l1_index_ret = i;
+                *l2_ret = pt->directory[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (*cursor < pt->nslots) {
+        unsigned i = (*cursor)++;
+        *l1_index_ret = pt->slots[i].l1_index;
+        *l2_ret = pt->slots[i].table;
+        return true;
+    }
+    return false;
+}
+
+/* Return the entry slot for VADDR, valid or not, or NULL if there is no L2 table. */
+static PTE *
+page_table_slot(PageTable *page_table, vaddr_t vaddr) {
+    L2Table *l2 = page_table_get_l2(page_table, L1_INDEX(vaddr));
+    if (l2 == NULL) {
+        return NULL;
+    }
+    return &l2->entries[L2_INDEX(vaddr)];
+}
+
+static PTE *
+page_table_lookup(PageTable *page_table, vaddr_t vaddr) {
+    PTE *entry = page_table_slot(page_table, vaddr);
+    if (entry == NULL || !PTE_VALID(entry)) {
+        return NULL;
+    }
+    return entry;
+}
+
+static int
+page_table_add_entry(PageTable *page_table, vaddr_t vaddr, paddr_t paddr) {
     int l1_index = L1_INDEX(vaddr);
     int l2_index = L2_INDEX(vaddr);
 
-    if (page_table->tables[l1_index] == NULL) {
-        page_table->tables[l1_index] = kmalloc(sizeof(L2Table));
-        if (page_table->tables[l1_index] == NULL) {
-            kfree(pte);
-            return ENOMEM;
+    KASSERT(paddr & TLBLO_VALID);
+
+    L2Table *l2 = page_table_get_l2(page_table, l1_index);
+    if (l2 == NULL) {
+        l2 = kmalloc(sizeof(L2Table));
+        if (l2 == NULL) {
+            return ENOMEM;
+        }
+        bzero(l2, sizeof(L2Table));
+
+        int result = page_table_set_l2(page_table, l1_index, l2);
+        if (result) {
+            kfree(l2);
+            return result;
+        }
+    }
+
+    PTE *pte = &l2->entries[l2_index];
+    KASSERT(!PTE_VALID(pte));
+    page_table_set_pte(page_table, vaddr, pte, paddr);
+
+    return 0;
+}
+
+void
+page_table_set_pte(PageTable *pt, vaddr_t vaddr, PTE *pte, paddr_t frame) {
+    if ((pte->frame == 0) != (frame == 0)) {
+        struct l2_occupancy *occ = page_table_get_occupancy(pt, L1_INDEX(vaddr));
+        KASSERT(occ != NULL);
+        if (frame != 0) {
+            occ->live++;
+            occ->groups |= 1 << (L2_INDEX(vaddr) >> L2_GROUP_BITS);
+        } else {
+            KASSERT(occ->live > 0);
+            if (--occ->live == 0) {
+                occ->groups = 0;
+            }
+        }
+    }
+    pte->frame = frame;
+}
+
+#endif /* OPT_HASHPT */
+
+/*
+ * Address space IDs.
+ *
+ * Each address space is tagged with one of the NUM_ASID - 1 hardware
+ * ASIDs (0 is left for the invalid entries) so that switching between
+ * processes doesn't need a TLB flush. ASIDs are shared by all CPUs and
+ * handed out in generations: once they run out, the generation number
+ * goes up, and every address space gets a fresh ASID the next time it
+ * is activated. Each CPU flushes its own TLB the first time it
+ * activates anything in a new generation.
+ *
+ * So AS can have entries in CPU c's TLB only if c has run it since it
+ * got its ASID (bit c of as->tlb_cpus) and c hasn't flushed since
+ * (tlb_generation[c] == as->asid_generation). Mappings that change or
+ * go away are shot down on just those CPUs; see vm_tlb_invalidate.
+ *
+ * asid_current[], tlb_generation[] and vm_utlb_pagetable[] for a CPU
+ * are only written by that CPU, with asid_lock held.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_generation = 1; // 0 is never current, see as_create
+static unsigned asid_next = 1;
+static unsigned asid_current[MAXCPUS];
+static unsigned tlb_generation[MAXCPUS];
+static struct cpu *vm_cpus[MAXCPUS]; // each CPU that has run a user address space
+
+/*
+ * A sender waiting for shootdowns to finish. Asynchronous TS_FLUSHALL
+ * requests aren't waited for; flushall_pending keeps there being at
+ * most one queued per CPU.
+ */
+struct tlbshootdown_wait {
+    struct spinlock lock;
+    unsigned pending;
+};
+
+static struct spinlock flushall_lock = SPINLOCK_INITIALIZER;
+static bool flushall_pending[MAXCPUS];
+
+/* Invalidate this CPU's whole TLB. Call with interrupts off. */
+static void
+tlb_flush_all(void) {
+    for (int i = 0; i < NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_setpid(asid_current[curcpu->c_number]);
+}
+
+/* Drop this CPU's entry for VADDR under ASID, if any. Call with interrupts off. */
+static void
+tlb_invalidate_local(unsigned asid, vaddr_t vaddr) {
+    uint32_t ehi = (vaddr & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT);
+    int result = tlb_probe(ehi, 0);
+    if (result >= 0) {
+        tlb_write(TLBHI_INVALID(result), TLBLO_INVALID(), result);
+    }
+    tlb_setpid(asid_current[curcpu->c_number]);
+}
+
+/* May this CPU hold entries for AS? Call with asid_lock held. */
+static bool
+tlb_local_has(struct addrspace *as) {
+    return as->asid_generation == tlb_generation[curcpu->c_number] &&
+           (as->tlb_cpus & ((uint32_t)1 << curcpu->c_number)) != 0;
+}
+
+/* The CPUs other than this one that may hold entries for AS. Call with asid_lock held. */
+static uint32_t
+tlb_remote_cpus(struct addrspace *as) {
+    uint32_t cpus = 0;
+
+    for (unsigned c = 0; c < MAXCPUS; c++) {
+        if ((as->tlb_cpus & ((uint32_t)1 << c)) != 0 && c != curcpu->c_number &&
+            tlb_generation[c] == as->asid_generation) {
+            cpus |= (uint32_t)1 << c;
+        }
+    }
+    return cpus;
+}
+
+/*
+ * Send TS to each CPU in CPUS and wait until they have all dealt with
+ * it. We may not hold any spinlocks, since a target spinning with
+ * interrupts off would never answer. Senders are the VM lock holder
+ * and kseg2_flush, so few are ever in flight at once.
+ */
+static void
+tlb_shootdown_wait(uint32_t cpus, struct tlbshootdown *ts) {
+    struct tlbshootdown_wait wait;
+
+    if (cpus == 0) {
+        return;
+    }
+    KASSERT(curcpu->c_spinlocks == 0);
+
+    spinlock_init(&wait.lock);
+    wait.pending = 0;
+    for (unsigned c = 0; c < MAXCPUS; c++) {
+        if (cpus & ((uint32_t)1 << c)) {
+            wait.pending++;
+        }
+    }
+    ts->ts_wait = &wait;
+
+    for (unsigned c = 0; c < MAXCPUS; c++) {
+        if (cpus & ((uint32_t)1 << c)) {
+            ipi_tlbshootdown(vm_cpus[c], ts);
+            vmstat_inc(VMSTAT_SHOOTDOWNS_SENT);
+        }
+    }
+
+    spinlock_acquire(&wait.lock);
+    while (wait.pending > 0) {
+        spinlock_release(&wait.lock);
+        // interrupts are on here, so shootdowns sent to us still get done
+        spinlock_acquire(&wait.lock);
+    }
+    spinlock_release(&wait.lock);
+    spinlock_cleanup(&wait.lock);
+}
+
+/* Ask each CPU in CPUS to flush its TLB, without waiting. Safe with spinlocks held. */
+static void
+tlb_shootdown_flushall(uint32_t cpus) {
+    struct tlbshootdown ts = { 0, 0, TS_FLUSHALL, 0, NULL };
+
+    for (unsigned c = 0; c < MAXCPUS; c++) {
+        if ((cpus & ((uint32_t)1 << c)) == 0) {
+            continue;
+        }
+        spinlock_acquire(&flushall_lock);
+        bool send = !flushall_pending[c];
+        flushall_pending[c] = true;
+        spinlock_release(&flushall_lock);
+        if (send) {
+            ipi_tlbshootdown(vm_cpus[c], &ts);
+            vmstat_inc(VMSTAT_SHOOTDOWNS_SENT);
+        }
+    }
+}
+
+/*
+ * Make AS the one this CPU runs in. Switching between threads of the
+ * address space already loaded here (another thread of the process, or
+ * a kernel thread, which leaves it in place) changes nothing, so that
+ * case leaves without touching the MMU.
+ */
+void
+vm_tlb_activate(struct addrspace *as) {
+    spinlock_acquire(&asid_lock);
+    unsigned cpu = curcpu->c_number;
+
+    if (as->asid_generation == asid_generation && tlb_generation[cpu] == asid_generation &&
+        asid_current[cpu] == as->asid && (as->tlb_cpus & ((uint32_t)1 << cpu)) != 0
+#if !OPT_HASHPT
+        && vm_utlb_pagetable[cpu] == as->page_table
+#endif
+        ) {
+        spinlock_release(&asid_lock);
+        return;
+    }
+
+    if (as->asid_generation != asid_generation) {
+        if (asid_next == NUM_ASID) {
+            // out of ASIDs: start a new generation, forgetting every old tag
+            asid_generation++;
+            asid_next = 1;
+        }
+        as->asid = asid_next++;
+        as->asid_generation = asid_generation;
+        as->tlb_cpus = 0; // nothing is tagged with the new ASID yet
+    }
+
+    if (tlb_generation[cpu] != asid_generation) {
+        // our TLB may hold entries under ASIDs now being handed out again
+        asid_current[cpu] = 0;
+        tlb_flush_all();
+        tlb_generation[cpu] = asid_generation;
+    }
+
+    vm_cpus[cpu] = curcpu->c_self;
+    as->tlb_cpus |= (uint32_t)1 << cpu;
+    asid_current[cpu] = as->asid;
+    tlb_setpid(asid_current[cpu]);
+#if !OPT_HASHPT
+    vm_utlb_pagetable[cpu] = as->page_table;
+#endif
+
+    spinlock_release(&asid_lock);
+}
+
+void
+vm_tlb_deactivate(struct addrspace *as) {
+    spinlock_acquire(&asid_lock);
+    if (as == NULL) {
+        vm_utlb_pagetable[curcpu->c_number] = NULL;
+    } else {
+        // a CPU that last ran AS may still point at its page table
+        for (unsigned c = 0; c < MAXCPUS; c++) {
+            if (vm_utlb_pagetable[c] == as->page_table) {
+                vm_utlb_pagetable[c] = NULL;
+            }
+        }
+    }
+    spinlock_release(&asid_lock);
+}
+
+void
+vm_tlb_forget(struct addrspace *as) {
+    spinlock_acquire(&asid_lock);
+    unsigned cpu = curcpu->c_number;
+#if OPT_HASHPT
+    // the refill handler is never given a hashed table, so go by the process
+    bool current = as->asid_generation == tlb_generation[cpu] && as->asid == asid_current[cpu] &&
+                   proc_getas() == as;
+#else
+    bool current = as->asid_generation == tlb_generation[cpu] && as->asid == asid_current[cpu] &&
+                   vm_utlb_pagetable[cpu] == as->page_table;
+#endif
+    // entries under the old ASID can no longer match, and it won't be reused this generation
+    as->asid_generation = 0;
+    spinlock_release(&asid_lock);
+
+    if (current) {
+        vm_tlb_activate(as);
+    }
+}
+
+void
+vm_tlb_flush(void) {
+    spinlock_acquire(&asid_lock);
+    tlb_flush_all();
+    spinlock_release(&asid_lock);
+}
+
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr) {
+    struct tlbshootdown ts;
+
+    spinlock_acquire(&asid_lock);
+    if (tlb_local_has(as)) {
+        tlb_invalidate_local(as->asid, vaddr);
+    }
+    uint32_t remote = tlb_remote_cpus(as);
+    ts.ts_asid = as->asid;
+    ts.ts_generation = as->asid_generation;
+    ts.ts_vaddr = vaddr & PAGE_FRAME;
+    ts.ts_npages = 1;
+    spinlock_release(&asid_lock);
+
+    tlb_shootdown_wait(remote, &ts);
+}
+
+/*
+ * Batched invalidation, for operations on many pages of one address
+ * space at once. Each page is dropped from this CPU's TLB as it is
+ * added, but the other CPUs are sent a single shootdown covering the
+ * whole span of the batch when it fills up or is finished, instead of
+ * one per page. Frames unmapped along the way can't be let go until
+ * the other CPUs have dropped them, so they are kept in the batch and
+ * released after the shootdown. Call with the VM lock held, as for
+ * vm_tlb_invalidate, and finish before releasing it.
+ */
+#define TLB_BATCH_MAX 32
+
+struct tlb_batch {
+    struct addrspace *as;
+    vaddr_t start, end;              // span of the pages added, if any
+    bool any;
+    unsigned nframes;                // frames to frame_unmap afterwards
+    paddr_t frames[TLB_BATCH_MAX];
+    vaddr_t vaddrs[TLB_BATCH_MAX];
+};
+
+static void
+tlb_batch_init(struct tlb_batch *b, struct addrspace *as) {
+    b->as = as;
+    b->any = false;
+    b->nframes = 0;
+}
+
+/* Send the shootdown for the pages so far, then let their frames go. */
+static void
+tlb_batch_finish(struct tlb_batch *b) {
+    struct tlbshootdown ts;
+
+    if (!b->any) {
+        return;
+    }
+
+    spinlock_acquire(&asid_lock);
+    uint32_t remote = tlb_remote_cpus(b->as);
+    ts.ts_asid = b->as->asid;
+    ts.ts_generation = b->as->asid_generation;
+    ts.ts_vaddr = b->start;
+    ts.ts_npages = (b->end - b->start) / PAGE_SIZE;
+    spinlock_release(&asid_lock);
+
+    tlb_shootdown_wait(remote, &ts);
+
+    if (b->nframes > 0) {
+        frame_unmap_batch(b->as, b->frames, b->vaddrs, b->nframes);
+    }
+    b->any = false;
+    b->nframes = 0;
+}
+
+/* Invalidate page VADDR, whose mapping of PADDR (if not 0) is going away. */
+static void
+tlb_batch_add(struct tlb_batch *b, vaddr_t vaddr, paddr_t paddr) {
+    vaddr &= PAGE_FRAME;
+
+    spinlock_acquire(&asid_lock);
+    if (tlb_local_has(b->as)) {
+        tlb_invalidate_local(b->as->asid, vaddr);
+    }
+    spinlock_release(&asid_lock);
+
+    if (!b->any) {
+        b->start = vaddr;
+        b->end = vaddr + PAGE_SIZE;
+        b->any = true;
+    } else if (vaddr < b->start) {
+        b->start = vaddr;
+    } else if (vaddr + PAGE_SIZE > b->end) {
+        b->end = vaddr + PAGE_SIZE;
+    }
+
+    if (paddr != 0) {
+        b->frames[b->nframes] = paddr;
+        b->vaddrs[b->nframes] = vaddr;
+        b->nframes++;
+        if (b->nframes == TLB_BATCH_MAX) {
+            tlb_batch_finish(b);
+        }
+    }
+}
+
+/* Load a translation for the current address space. */
+static void
+load_tlb(vaddr_t vaddr, paddr_t paddr) {
+    uint32_t ehi, elo;
+
+    spinlock_acquire(&asid_lock);
+
+    ehi = (vaddr & TLBHI_VPAGE) | (asid_current[curcpu->c_number] << TLBHI_PIDSHIFT);
+    elo = (paddr & ~PTE_SOFTBITS) | TLBLO_VALID;
+
+    int result = tlb_probe(ehi, 0);
+    if (result >= 0) {
+        tlb_write(ehi, elo, result);
+    } else {
+        tlb_random(ehi, elo);
+    }
+
+    spinlock_release(&asid_lock);
+    vmstat_inc(VMSTAT_TLB_LOADS);
+}
+
+/*
+ * Mapped kernel heap. Multi-page kernel allocations that can't get
+ * physically contiguous frames are instead made of single frames
+ * mapped at consecutive pages of kseg2, which the TLB translates. The
+ * map below is the kernel's page table for kseg2: an entry is a TLBLO
+ * word (valid, dirty and global), or one of the states below.
+ * kseg2_len[] holds the length of each allocation at its first page.
+ *
+ * kseg2 misses come to vm_fault, which loads the entry from the map
+ * without taking any lock, so kernel code may touch this memory with
+ * interrupts off or spinlocks held. That means a freed range can't be
+ * handed out again while any CPU may still have one of its old entries
+ * in its TLB. Rather than a shootdown per free, freed pages are left
+ * STALE, stamped with the current kseg2_flushgen; once the map runs
+ * out, every CPU that has loaded kseg2 entries flushes its TLB, and
+ * pages freed before that flush began become reusable.
+ */
+#define KSEG2_PAGES 1024     // 4MB of mapped heap
+#define KSEG2_FREE 0
+#define KSEG2_RESERVED 1     // being set up by vm_kseg2_alloc
+#define KSEG2_STALE 2
+
+static struct spinlock kseg2_lock = SPINLOCK_INITIALIZER;
+static paddr_t kseg2_map[KSEG2_PAGES];
+static uint16_t kseg2_len[KSEG2_PAGES];
+static unsigned kseg2_stalegen[KSEG2_PAGES];
+static unsigned kseg2_nstale;
+static unsigned kseg2_flushgen;
+static uint32_t kseg2_cpus; // CPUs that have loaded kseg2 entries
+
+/*
+ * Make the stale pages freed before now reusable, flushing the TLB of
+ * every CPU that may still map them. Must be able to wait for the
+ * other CPUs, so no spinlocks and not in an interrupt handler.
+ */
+static void
+kseg2_flush(void) {
+    struct tlbshootdown ts = { 0, 0, TS_FLUSHALL, 0, NULL };
+
+    spinlock_acquire(&kseg2_lock);
+    unsigned gen = kseg2_flushgen++;
+    uint32_t cpus = kseg2_cpus & ~((uint32_t)1 << curcpu->c_number);
+    spinlock_release(&kseg2_lock);
+
+    int spl = splhigh();
+    tlb_flush_all();
+    splx(spl);
+    tlb_shootdown_wait(cpus, &ts);
+
+    spinlock_acquire(&kseg2_lock);
+    for (unsigned i = 0; i < KSEG2_PAGES; i++) {
+        if (kseg2_map[i] == KSEG2_STALE && (int)(gen - kseg2_stalegen[i]) >= 0) {
+            kseg2_map[i] = KSEG2_FREE;
+            kseg2_nstale--;
+        }
+    }
+    spinlock_release(&kseg2_lock);
+}
+
+/* Find and reserve NPAGES free map entries, returning the first, or -1. */
+static int
+kseg2_reserve(unsigned npages) {
+    unsigned run = 0;
+
+    KASSERT(spinlock_do_i_hold(&kseg2_lock));
+    for (unsigned i = 0; i < KSEG2_PAGES; i++) {
+        run = kseg2_map[i] == KSEG2_FREE ? run + 1 : 0;
+        if (run == npages) {
+            unsigned first = i + 1 - npages;
+            for (unsigned j = first; j <= i; j++) {
+                kseg2_map[j] = KSEG2_RESERVED;
+            }
+            kseg2_len[first] = npages;
+            return first;
+        }
+    }
+    return -1;
+}
+
+vaddr_t
+vm_kseg2_alloc(unsigned npages) {
+    KASSERT(npages > 0);
+    if (npages > KSEG2_PAGES) {
+        return 0;
+    }
+
+    spinlock_acquire(&kseg2_lock);
+    int first = kseg2_reserve(npages);
+    // kseg2_flush waits for other CPUs, so the caller mustn't hold spinlocks (kseg2_lock aside)
+    bool can_flush = kseg2_nstale > 0 && CURCPU_EXISTS() &&
+                     curcpu->c_spinlocks == 1 && !curthread->t_in_interrupt;
+    spinlock_release(&kseg2_lock);
+    if (first < 0 && can_flush) {
+        kseg2_flush();
+        spinlock_acquire(&kseg2_lock);
+        first = kseg2_reserve(npages);
+        spinlock_release(&kseg2_lock);
+    }
+    if (first < 0) {
+        return 0;
+    }
+
+    // the entries are ours while reserved, and nobody can fault on them yet
+    for (unsigned i = 0; i < npages; i++) {
+        vaddr_t frame = alloc_kpages(1);
+        if (frame == 0) {
+            for (unsigned j = 0; j < i; j++) {
+                free_kpages(PADDR_TO_KVADDR(kseg2_map[first + j] & PAGE_FRAME));
+            }
+            spinlock_acquire(&kseg2_lock);
+            for (unsigned j = 0; j < npages; j++) {
+                // never reachable, so never in a TLB
+                kseg2_map[first + j] = KSEG2_FREE;
+            }
+            kseg2_len[first] = 0;
+            spinlock_release(&kseg2_lock);
+            return 0;
+        }
+        kseg2_map[first + i] = KVADDR_TO_PADDR(frame) | TLBLO_VALID | TLBLO_DIRTY | TLBLO_GLOBAL;
+    }
+
+    return MIPS_KSEG2 + (vaddr_t)first * PAGE_SIZE;
+}
+
+void
+vm_kseg2_free(vaddr_t addr) {
+    paddr_t frames[64];
+    unsigned i, n = 0;
+
+    KASSERT(addr >= MIPS_KSEG2 && (addr & PAGE_FRAME) == addr);
+    unsigned first = (addr - MIPS_KSEG2) / PAGE_SIZE;
+    KASSERT(first < KSEG2_PAGES);
+
+    spinlock_acquire(&kseg2_lock);
+    unsigned npages = kseg2_len[first];
+    KASSERT(npages > 0 && first + npages <= KSEG2_PAGES);
+    kseg2_len[first] = 0;
+    for (i = 0; i < npages; i++) {
+        paddr_t entry = kseg2_map[first + i];
+        KASSERT(entry & TLBLO_VALID);
+        kseg2_map[first + i] = KSEG2_STALE;
+        kseg2_stalegen[first + i] = kseg2_flushgen;
+        kseg2_nstale++;
+        // our own TLB we can fix now, so use after free shows up at least here
+        tlb_invalidate_local(0, addr + i * PAGE_SIZE);
+        frames[n++] = entry & PAGE_FRAME;
+        if (n == 64) {
+            spinlock_release(&kseg2_lock);
+            frame_free_batch(frames, n);
+            n = 0;
+            spinlock_acquire(&kseg2_lock);
+        }
+    }
+    spinlock_release(&kseg2_lock);
+    frame_free_batch(frames, n);
+}
+
+/*
+ * Temporary mappings, for getting at frames of high memory. Each CPU
+ * has KMAP_SLOTS pages of kseg2 of its own, just past the mapped heap.
+ * A mapping lasts from vm_kmap to vm_kunmap with interrupts off, so
+ * only the CPU that made it can ever use the address: a TLB miss on it
+ * is loaded from kmap_map by vm_kmap_fault, and vm_kunmap need only
+ * invalidate the local TLB. Frames kseg0 reaches are just returned at
+ * their kseg0 address.
+ */
+#define KMAP_SLOTS 2
+#define KMAP_BASE (MIPS_KSEG2 + KSEG2_PAGES * PAGE_SIZE)
+
+static paddr_t kmap_map[MAXCPUS][KMAP_SLOTS];
+static int kmap_spl[MAXCPUS][KMAP_SLOTS];
+
+vaddr_t
+vm_kmap(paddr_t paddr, unsigned slot) {
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+    KASSERT(slot < KMAP_SLOTS);
+    if (!PADDR_IS_HIGH(paddr)) {
+        return PADDR_TO_KVADDR(paddr);
+    }
+
+    int spl = splhigh();
+    unsigned cpu = curcpu->c_number;
+    KASSERT(kmap_map[cpu][slot] == 0);
+    kmap_map[cpu][slot] = paddr | TLBLO_VALID | TLBLO_DIRTY | TLBLO_GLOBAL;
+    kmap_spl[cpu][slot] = spl;
+    return KMAP_BASE + (cpu * KMAP_SLOTS + slot) * PAGE_SIZE;
+}
+
+void
+vm_kunmap(vaddr_t va, unsigned slot) {
+    KASSERT(slot < KMAP_SLOTS);
+    if (va < MIPS_KSEG2) {
+        return;
+    }
+
+    unsigned cpu = curcpu->c_number;
+    KASSERT(va == KMAP_BASE + (cpu * KMAP_SLOTS + slot) * PAGE_SIZE);
+    KASSERT(kmap_map[cpu][slot] != 0);
+    int spl = kmap_spl[cpu][slot];
+    kmap_map[cpu][slot] = 0;
+    tlb_invalidate_local(0, va);
+    splx(spl);
+}
+
+/* Load the TLB for one of this CPU's temporary mappings. */
+static int
+vm_kmap_fault(vaddr_t faultaddress) {
+    if (faultaddress < KMAP_BASE) {
+        return EFAULT;
+    }
+    unsigned n = (faultaddress - KMAP_BASE) / PAGE_SIZE;
+    if (n >= MAXCPUS * KMAP_SLOTS) {
+        return EFAULT;
+    }
+
+    int spl = splhigh();
+    unsigned cpu = curcpu->c_number;
+    paddr_t entry = n / KMAP_SLOTS == cpu ? kmap_map[cpu][n % KMAP_SLOTS] : 0;
+    if (entry == 0) {
+        splx(spl);
+        return EFAULT;
+    }
+    tlb_random(faultaddress & TLBHI_VPAGE, entry);
+    tlb_setpid(asid_current[cpu]);
+    splx(spl);
+    vmstat_inc(VMSTAT_TLB_LOADS);
+    return 0;
+}
+
+/* Zero or copy whole frames, wherever they are. */
+static void
+vm_frame_zero(paddr_t paddr) {
+    vaddr_t va = vm_kmap(paddr, 0);
+    page_zero(va);
+    vm_kunmap(va, 0);
+}
+
+static void
+vm_frame_copy(paddr_t dst, paddr_t src) {
+    vaddr_t dva = vm_kmap(dst, 0);
+    vaddr_t sva = vm_kmap(src, 1);
+    page_copy(dva, sva);
+    vm_kunmap(sva, 1);
+    vm_kunmap(dva, 0);
+}
+
+/* Load the TLB for a kseg2 address in the mapped heap. No locks: see above. */
+static int
+vm_kseg2_fault(vaddr_t faultaddress) {
+    unsigned page = (faultaddress - MIPS_KSEG2) / PAGE_SIZE;
+    if (page >= KSEG2_PAGES) {
+        return vm_kmap_fault(faultaddress);
+    }
+
+    int spl = splhigh();
+    paddr_t entry = kseg2_map[page];
+    if ((entry & TLBLO_VALID) == 0) {
+        splx(spl);
+        return EFAULT;
+    }
+
+    unsigned cpu = curcpu->c_number;
+    if ((kseg2_cpus & ((uint32_t)1 << cpu)) == 0) {
+        spinlock_acquire(&kseg2_lock);
+        vm_cpus[cpu] = curcpu->c_self;
+        kseg2_cpus |= (uint32_t)1 << cpu;
+        spinlock_release(&kseg2_lock);
+    }
+    tlb_random(faultaddress & TLBHI_VPAGE, entry);
+    tlb_setpid(asid_current[cpu]);
+    splx(spl);
+    vmstat_inc(VMSTAT_TLB_LOADS);
+    return 0;
+}
+
+void
+vm_lock_acquire(void) {
+    lock_acquire(vm_lock);
+}
+
+void
+vm_lock_release(void) {
+    lock_release(vm_lock);
+}
+
+bool
+vm_lock_do_i_hold(void) {
+    return lock_do_i_hold(vm_lock);
+}
+
+/*
+ * Page out one user frame to swap, so that it can be reused.
+ *
+ * The victim may belong to any address space, or only to ONLY if that
+ * isn't NULL; its TLB entry (if any) is found by that address space's
+ * ASID.
+ */
+static int
+vm_evict_page(struct addrspace *only) {
+    struct addrspace *victim_as;
+    vaddr_t victim_vaddr;
+    unsigned slot;
+    int result;
+
+    KASSERT(vm_lock_do_i_hold());
+
+    paddr_t paddr = frame_choose_victim(only, &victim_as, &victim_vaddr);
+    if (paddr == 0) {
+        return ENOMEM;
+    }
+
+    PTE *pte = page_table_lookup(victim_as->page_table, victim_vaddr);
+    KASSERT(pte != NULL);
+    KASSERT((pte->frame & PAGE_FRAME) == paddr);
+
+    // next to the page before it, if that's out too, so that runs of
+    // pages go out and come back in together
+    PTE *prev = victim_vaddr >= PAGE_SIZE ?
+        page_table_lookup(victim_as->page_table, victim_vaddr - PAGE_SIZE) : NULL;
+    if (prev != NULL && PTE_IS_SWAPPED(prev)) {
+        result = swap_alloc_near(PTE_SWAP_SLOT(prev) + 1, &slot);
+    } else {
+        result = swap_alloc(&slot);
+    }
+    if (result) {
+        return ENOMEM;
+    }
+
+    // unmap the page before writing it out, so it can't change underneath us
+    paddr_t old_frame = pte->frame;
+    pte->frame = PTE_MAKE_SWAPPED(slot);
+    vm_tlb_invalidate(victim_as, victim_vaddr);
+
+    vaddr_t kpage = PADDR_TO_KVADDR(paddr);
+    if (PADDR_IS_HIGH(paddr)) {
+        // swap_out may sleep, so it gets a copy (the VM lock covers vm_bounce_page)
+        vaddr_t va = vm_kmap(paddr, 0);
+        page_copy(vm_bounce_page, va);
+        vm_kunmap(va, 0);
+        kpage = vm_bounce_page;
+    }
+
+    result = swap_out(slot, kpage);
+    if (result) {
+        pte->frame = old_frame;
+        swap_free(slot);
+        return result;
+    }
+
+    frame_free(paddr);
+    vmstat_inc(VMSTAT_EVICTIONS);
+    return 0;
+}
+
+bool
+vm_page_locked(struct addrspace *as, vaddr_t vaddr) {
+    PTE *pte = page_table_lookup(as->page_table, vaddr);
+    KASSERT(pte != NULL);
+
+    return (pte->frame & PTE_LOCKED) != 0;
+}
+
+bool
+vm_page_test_and_clear_referenced(struct addrspace *as, vaddr_t vaddr) {
+    PTE *pte = page_table_lookup(as->page_table, vaddr);
+    KASSERT(pte != NULL);
+
+    if ((pte->frame & PTE_REFERENCED) == 0) {
+        return false;
+    }
+    pte->frame &= ~PTE_REFERENCED;
+
+    /*
+     * The next use must miss in the TLB for the bit to be set again.
+     * We are called with the frame table spinlock held, so we can't
+     * wait for other CPUs; just ask them to flush. Until they do they
+     * may use the page without it looking referenced, which at worst
+     * gets it paged out early (eviction does wait).
+     */
+    spinlock_acquire(&asid_lock);
+    if (tlb_local_has(as)) {
+        tlb_invalidate_local(as->asid, vaddr);
+    }
+    uint32_t remote = tlb_remote_cpus(as);
+    spinlock_release(&asid_lock);
+    tlb_shootdown_flushall(remote);
+
+    return true;
+}
+
+/* Take a frame from the pre-zeroed pool, or return 0 if it is empty. */
+static vaddr_t
+zero_pool_take(void) {
+    vaddr_t page = 0;
+
+    spinlock_acquire(&zero_pool_lock);
+    if (zero_pool_count > 0) {
+        page = zero_pool[--zero_pool_count];
+    }
+    spinlock_release(&zero_pool_lock);
+    return page;
+}
+
+static void
+zero_thread(void *data1, unsigned long data2) {
+    (void)data1;
+    (void)data2;
+
+    spinlock_acquire(&zero_pool_lock);
+    for (;;) {
+        wchan_sleep(zero_pool_wchan, &zero_pool_lock);
+        spinlock_release(&zero_pool_lock);
+
+        vaddr_t page = alloc_kpages(1);
+        if (page != 0) {
+            page_zero(page);
+        }
+
+        spinlock_acquire(&zero_pool_lock);
+        if (page == 0) {
+            zero_pool_backoff = ZERO_POOL_BACKOFF;
+            continue;
+        }
+        // only we add to the pool, and vm_idle checked there was room
+        KASSERT(zero_pool_count < ZERO_POOL_MAX);
+        zero_pool[zero_pool_count++] = page;
+    }
+}
+
+bool
+vm_idle(void) {
+    bool woken = false;
+
+    if (zero_pool_wchan == NULL) {
+        return false; // not bootstrapped yet
+    }
+
+    // the pool is only worth filling from memory nobody is short of
+    if (frame_pressure() != FRAME_PRESSURE_NONE) {
+        return false;
+    }
+
+    spinlock_acquire(&zero_pool_lock);
+    if (zero_pool_backoff > 0) {
+        zero_pool_backoff--;
+    } else if (zero_pool_count < ZERO_POOL_MAX && !wchan_isempty(zero_pool_wchan, &zero_pool_lock)) {
+        wchan_wakeone(zero_pool_wchan, &zero_pool_lock);
+        woken = true;
+    }
+    spinlock_release(&zero_pool_lock);
+    return woken;
+}
+
+/*
+ * Allocate a frame for a user page, paging something out if memory is
+ * short. The last few free frames are left for the kernel, which can't
+ * page anything out for its own allocations (and needs some to do the
+ * paging); only if there's nothing left to page out are they used.
+ */
+static vaddr_t
+vm_alloc_page(void) {
+    vaddr_t page;
+
+    for (;;) {
+        if (frame_pressure() != FRAME_PRESSURE_MIN) {
+            page = alloc_kpages(1);
+            if (page != 0) {
+                return page;
+            }
+        }
+        // pre-zeroed frames are better used than paging something out
+        page = zero_pool_take();
+        if (page != 0) {
+            return page;
+        }
+        if (vm_evict_page(NULL)) {
+            return alloc_kpages(1);
+        }
+    }
+}
+
+/* As vm_alloc_page, but zero-filled; from the pool if possible. */
+static vaddr_t
+vm_alloc_zeroed_page(void) {
+    vaddr_t page = zero_pool_take();
+    if (page != 0) {
+        vmstat_inc(VMSTAT_PREZEROED);
+        return page;
+    }
+
+    page = vm_alloc_page();
+    if (page != 0) {
+        page_zero(page);
+        vmstat_inc(VMSTAT_ZERO_FILLS);
+    }
+    return page;
+}
+
+/*
+ * Allocate a frame for an anonymous user page, zero-filled if ZEROED,
+ * returning its physical address. High memory, which nothing else can
+ * use, goes first; pre-zeroed frames, if wanted, before even that.
+ * The frame may only be touched through vm_kmap.
+ */
+static paddr_t
+vm_alloc_user_frame(bool zeroed) {
+    vaddr_t page;
+
+    if (zeroed) {
+        page = zero_pool_take();
+        if (page != 0) {
+            vmstat_inc(VMSTAT_PREZEROED);
+            return KVADDR_TO_PADDR(page);
+        }
+    }
+
+    paddr_t paddr = frame_alloc_high();
+    if (paddr != 0) {
+        if (zeroed) {
+            vm_frame_zero(paddr);
+            vmstat_inc(VMSTAT_ZERO_FILLS);
+        }
+        return paddr;
+    }
+
+    page = zeroed ? vm_alloc_zeroed_page() : vm_alloc_page();
+    return page == 0 ? 0 : KVADDR_TO_PADDR(page);
+}
+
+int
+vm_map_kpage(struct addrspace *as, vaddr_t vaddr, vaddr_t kpage) {
+    KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+    struct region *region = as_region_lookup(as, vaddr);
+    if (region == NULL || !region->writeable) {
+        return EFAULT;
+    }
+
+    paddr_t paddr = KVADDR_TO_PADDR(kpage) | TLBLO_VALID | TLBLO_DIRTY;
+
+    vm_lock_acquire();
+    int result = page_table_add_entry(as->page_table, vaddr, paddr);
+    if (result == 0) {
+        // from here on it's an ordinary user page, which may be paged out
+        frame_set_owner(paddr & PAGE_FRAME, as, vaddr);
+    }
+    vm_lock_release();
+    return result;
+}
+
+static unsigned
+resident_pages_locked(struct addrspace *as) {
+    unsigned count = 0;
+
+    KASSERT(vm_lock_do_i_hold());
+#if OPT_HASHPT
+    struct hashpt_entry *cursor = NULL;
+    vaddr_t va;
+    PTE *pte;
+    while ((pte = page_table_next_entry(as->page_table, &cursor, &va)) != NULL) {
+        if (PTE_VALID(pte)) {
+            count++;
+        }
+    }
+#else
+    unsigned cursor = 0, l1_index;
+    L2Table *l2;
+    while (page_table_next_l2(as->page_table, &cursor, &l1_index, &l2)) {
+        struct l2_occupancy *occ = page_table_get_occupancy(as->page_table, l1_index);
+        unsigned seen = 0;
+        for (unsigned i = 0; i < 1 << L2_BITS && seen < occ->live; i++) {
+            if (!L2_GROUP_MAYBE_LIVE(occ, i)) {
+                i |= L2_GROUP_SIZE - 1;
+                continue;
+            }
+            if (l2->entries[i].frame != 0) {
+                seen++;
+            }
+            if (PTE_VALID(&l2->entries[i])) {
+                count++;
+            }
+        }
+    }
+#endif
+    return count;
+}
+
+unsigned
+vm_resident_pages(struct addrspace *as) {
+    vm_lock_acquire();
+    unsigned count = resident_pages_locked(as);
+    vm_lock_release();
+    return count;
+}
+
+/*
+ * Keep AS under MAX resident pages (RLIMIT_RSS) by paging out pages of
+ * its own before it faults in another; pages it shares don't go. Once
+ * over, it's taken down by an eighth, so it has a while to run before
+ * the next time. Counting its pages means walking the page table, so
+ * that's only done when as->rss_estimate, bumped on every fault since
+ * the last count (an overestimate, as pages go too), says it may be
+ * over.
+ */
+#define RSS_MIN_PAGES 8 // any fewer and an instruction may never get all it needs in at once
+
+static void
+vm_rss_enforce(struct addrspace *as, unsigned max) {
+    KASSERT(vm_lock_do_i_hold());
+
+    if (++as->rss_estimate < max) {
+        return;
+    }
+    unsigned n = resident_pages_locked(as);
+    if (n >= max) {
+        while (n > max - max / 8 && vm_evict_page(as) == 0) {
+            vmstat_inc(VMSTAT_RSS_EVICTIONS);
+            n--;
+        }
+    }
+    as->rss_estimate = n;
+}
+
+/*
+ * Free the L2 tables covering [START, END) of AS that nothing is left
+ * in, after an unmap. mips_utlb_refill walks the page table without
+ * locks, so this is only done while no other CPU has it loaded (the
+ * tables otherwise stay, empty, until the next unmap or as_destroy).
+ * Callers hold the regions lock for writing, so no fault is hanging on
+ * to an entry either.
+ */
+static void
+release_empty_l2s(struct addrspace *as, vaddr_t start, vaddr_t end) {
+#if OPT_HASHPT
+    (void)as;
+    (void)start;
+    (void)end;
+#else
+    PageTable *pt = as->page_table;
+
+    KASSERT(vm_lock_do_i_hold());
+    if (start >= end) {
+        return;
+    }
+    for (unsigned l1_index = L1_INDEX(start); l1_index <= L1_INDEX(end - 1); l1_index++) {
+        struct l2_occupancy *occ = page_table_get_occupancy(pt, l1_index);
+        if (occ == NULL || occ->live != 0) {
+            continue;
+        }
+
+        L2Table *l2 = NULL;
+        spinlock_acquire(&asid_lock);
+        bool loaded = false;
+        for (unsigned c = 0; c < MAXCPUS; c++) {
+            if (c != curcpu->c_number && vm_utlb_pagetable[c] == pt) {
+                loaded = true;
+            }
+        }
+        if (!loaded) {
+            l2 = page_table_unset_l2(pt, l1_index);
+        }
+        spinlock_release(&asid_lock);
+
+        if (l2 == NULL) {
+            return;
+        }
+        kfree(l2);
+    }
+#endif
+}
+
+void
+vm_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end) {
+    struct tlb_batch batch;
+
+    KASSERT((start & PAGE_FRAME) == start);
+    KASSERT((end & PAGE_FRAME) == end);
+
+    vm_lock_acquire();
+    tlb_batch_init(&batch, as);
+#if OPT_HASHPT
+    // the range may be large and mostly untouched, so go by what's there
+    struct hashpt_entry *cursor = NULL;
+    vaddr_t va;
+    PTE *pte;
+    while ((pte = page_table_next_entry(as->page_table, &cursor, &va)) != NULL) {
+        if (va < start || va >= end) {
+            continue;
+        }
+#else
+    vaddr_t va = start;
+    while (va < end) {
+        PTE *pte = page_table_slot(as->page_table, va);
+        if (pte == NULL) {
+            // no L2 table, so nothing mapped until the next one
+            va = (va | ((1 << (L2_BITS + OFFSET_BITS)) - 1)) + 1;
+            continue;
+        }
+#endif
+
+        // clear the entry first, so no CPU can load it again once shot down
+        PTE old = *pte;
+        page_table_set_pte(as->page_table, va, pte, 0);
+        if (PTE_VALID(&old)) {
+            tlb_batch_add(&batch, va, old.frame & PAGE_FRAME);
+        } else if (PTE_IS_SWAPPED(&old)) {
+            swap_free(PTE_SWAP_SLOT(&old));
+        }
+#if !OPT_HASHPT
+        va += PAGE_SIZE;
+#endif
+    }
+    tlb_batch_finish(&batch);
+    release_empty_l2s(as, start, end);
+    vm_lock_release();
+}
+
+/*
+ * Does page PAGE of REGION live in the page cache? If so, return the
+ * file page in *VN_RET and *OFFSET_RET. That covers every page of a
+ * file mapping, and those pages of read-only program text that are
+ * wholly file data, so every process running a program shares one copy
+ * of its text. (Text pages needing a zeroed tail are kept private.)
+ */
+static bool
+region_cached_page(struct region *region, vaddr_t page,
+                   struct vnode **vn_ret, off_t *offset_ret) {
+    if (region->vn != NULL) {
+        *vn_ret = region->vn;
+        *offset_ret = region->file_offset + (page - region->vbase);
+        return true;
+    }
+
+    if (region->elf_vn != NULL && region->executable && !region->writeable &&
+        (region->elf_vaddr - region->elf_offset) % PAGE_SIZE == 0 &&
+        page + PAGE_SIZE <= region->elf_vaddr + region->elf_filesize) {
+        *vn_ret = region->elf_vn;
+        *offset_ret = region->elf_offset - (off_t)(region->elf_vaddr - page);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Throw away the pages of REGION in [START, END), handing page cache
+ * pages back as vm_unmap_region says. Locked pages stay if KEEP_LOCKED.
+ */
+static void
+vm_unmap_pages(struct addrspace *as, struct region *region, vaddr_t start, vaddr_t end,
+               bool keep_locked) {
+    struct tlb_batch batch;
+    // page cache pages to hand back, which can't be done with the VM lock held
+    struct vnode *vns[TLB_BATCH_MAX];
+    off_t offsets[TLB_BATCH_MAX];
+
+    tlb_batch_init(&batch, as);
+    vaddr_t va = start;
+    while (va < end) {
+        // a batch's worth of pages under each hold of the lock
+        unsigned nrelease = 0;
+        vm_lock_acquire();
+        for (unsigned n = 0; n < TLB_BATCH_MAX && va < end; n++, va += PAGE_SIZE) {
+            PTE *pte = page_table_slot(as->page_table, va);
+            if (pte == NULL || (keep_locked && (pte->frame & PTE_LOCKED))) {
+                continue;
+            }
+            // clear the entry first, so no CPU can load it again once shot down
+            PTE old = *pte;
+            page_table_set_pte(as->page_table, va, pte, 0);
+            if (PTE_VALID(&old)) {
+                tlb_batch_add(&batch, va, old.frame & PAGE_FRAME);
+                if (region_cached_page(region, va, &vns[nrelease], &offsets[nrelease])) {
+                    nrelease++;
+                }
+            } else if (PTE_IS_SWAPPED(&old)) {
+                swap_free(PTE_SWAP_SLOT(&old));
+            }
+        }
+        tlb_batch_finish(&batch);
+        vm_lock_release();
+
+        for (unsigned i = 0; i < nrelease; i++) {
+            pagecache_release(vns[i], offsets[i]);
+        }
+    }
+
+    if (!keep_locked) {
+        vm_lock_acquire();
+        release_empty_l2s(as, start, end);
+        vm_lock_release();
+    }
+}
+
+void
+vm_unmap_region(struct addrspace *as, struct region *region) {
+    vm_unmap_pages(as, region, region->vbase, region->vtop, false);
+}
+
+void
+vm_discard_range(struct addrspace *as, struct region *region, vaddr_t start, vaddr_t end) {
+    vm_unmap_pages(as, region, start, end, true);
+}
+
+/*
+ * Map FAULTADDRESS to page OFFSET of VN, through the page cache. The
+ * frame is shared with every other mapping of the page, so it has no
+ * owner and is never paged out; the page cache writes it back instead.
+ * Writeable pages start out read-only unless this is a write fault, so
+ * the first write can mark the page dirty.
+ *
+ * Called, like the rest of vm_handle_fault, with the VM lock held, but
+ * drops it around the file I/O. The regions stay put, as vm_fault holds
+ * the regions lock, but another thread of the process may fault the
+ * same page in meanwhile, in which case we use its mapping.
+ */
+static int
+vm_map_cached_page(struct addrspace *as, struct vnode *vn, off_t offset,
+                   bool writeable, int faulttype, vaddr_t faultaddress) {
+    vaddr_t page = faultaddress & PAGE_FRAME;
+    paddr_t paddr;
+    bool used_kpage = false;
+
+    vaddr_t kpage = vm_alloc_page();
+    if (kpage == 0) {
+        return ENOMEM;
+    }
+
+    vm_lock_release();
+    int result = pagecache_get(vn, offset, kpage, &paddr, &used_kpage);
+    vm_lock_acquire();
+    if (!used_kpage) {
+        free_kpages(kpage);
+    }
+    if (result) {
+        return result;
+    }
+
+    PTE *pte = page_table_lookup(as->page_table, page);
+    if (pte != NULL) {
+        // another thread got there first
+        free_kpages(PADDR_TO_KVADDR(paddr & PAGE_FRAME));
+        vm_lock_release();
+        pagecache_release(vn, offset);
+        vm_lock_acquire();
+        pte->frame |= PTE_REFERENCED;
+        load_tlb(faultaddress, pte->frame);
+        return 0;
+    }
+
+    paddr |= TLBLO_VALID | PTE_REFERENCED;
+    if (writeable && faulttype == VM_FAULT_WRITE) {
+        pagecache_mark_dirty(vn, offset);
+        paddr |= TLBLO_DIRTY;
+    }
+
+    result = page_table_add_entry(as->page_table, page, paddr);
+    if (result) {
+        free_kpages(PADDR_TO_KVADDR(paddr & PAGE_FRAME));
+        vm_lock_release();
+        pagecache_release(vn, offset);
+        vm_lock_acquire();
+        return result;
+    }
+
+    load_tlb(faultaddress, paddr);
+    vmstat_inc(VMSTAT_CACHE_MAPS);
+    return 0;
+}
+
+/* Does any of page PAGE of REGION come from the executable? */
+static bool
+elf_page_has_data(struct region *region, vaddr_t page) {
+    return region->elf_vn != NULL &&
+           page + PAGE_SIZE > region->elf_vaddr &&
+           page < region->elf_vaddr + region->elf_filesize;
+}
+
+/*
+ * Fill KPAGE with the contents of page PAGE of an ELF segment region
+ * that has file data: the part the file covers is read in, the rest
+ * zeroed.
+ * Drops the VM lock around the read, as vm_map_cached_page does; KPAGE
+ * isn't in any page table yet, so it can't be paged out meanwhile.
+ */
+static int
+vm_load_elf_page(struct region *region, vaddr_t page, vaddr_t kpage) {
+    struct iovec iov;
+    struct uio u;
+
+    KASSERT(elf_page_has_data(region, page));
+    page_zero(kpage);
+
+    vaddr_t file_end = region->elf_vaddr + region->elf_filesize;
+    vaddr_t start = page > region->elf_vaddr ? page : region->elf_vaddr;
+    vaddr_t end = page + PAGE_SIZE < file_end ? page + PAGE_SIZE : file_end;
+
+    uio_kinit(&iov, &u, (void *)(kpage + (start - page)), end - start,
+              region->elf_offset + (start - region->elf_vaddr), UIO_READ);
+    vm_lock_release();
+    int result = VOP_READ(region->elf_vn, &u);
+    vm_lock_acquire();
+    if (result) {
+        return result;
+    }
+    vmstat_inc(VMSTAT_ELF_READS);
+
+    // load_elf checked the file was long enough; it must have shrunk since
+    return u.uio_resid != 0 ? EIO : 0;
+}
+
+/*
+ * Resolve a write to a page that is mapped read-only because it is
+ * shared copy-on-write after fork, or is the zero frame. If we still
+ * share the frame, copy it into a private frame and drop our reference
+ * to the shared one;
+ * if we are the last user, just make the existing mapping writeable.
+ */
+static int
+vm_copy_on_write(struct addrspace *as, PTE *pte, vaddr_t faultaddress) {
+    paddr_t old_paddr = pte->frame & PAGE_FRAME;
+
+    if (frame_refcount(old_paddr) > 1) {
+        bool zero = old_paddr == vm_zero_frame;
+        paddr_t new_paddr = vm_alloc_user_frame(zero);
+        if (new_paddr == 0) {
+            return ENOMEM;
+        }
+        if (!zero) {
+            vm_frame_copy(new_paddr, old_paddr);
+        }
+
+        // keep the flag bits, swap in the new frame
+        pte->frame = new_paddr | (pte->frame & ~PAGE_FRAME);
+        // other CPUs we ran on may still map the old frame
+        vm_tlb_invalidate(as, faultaddress);
+        frame_unmap(old_paddr, as, faultaddress & PAGE_FRAME);
+        vmstat_inc(VMSTAT_COW_COPIES);
+    } else {
+        vmstat_inc(VMSTAT_COW_REUSES);
+    }
+
+    // the frame is ours alone now, so it may be paged out
+    frame_set_owner(pte->frame & PAGE_FRAME, as, faultaddress & PAGE_FRAME);
+    pte->frame |= TLBLO_DIRTY | PTE_REFERENCED;
+    load_tlb(faultaddress, pte->frame);
+
+    return 0;
+}
+
+/*
+ * Is page PAGE of AS private memory that can be shared copy-on-write?
+ * Not file pages, which are shared through the page cache and never
+ * copied. Call with the regions lock held.
+ */
+static bool
+vm_page_loanable(struct addrspace *as, vaddr_t page, bool writeable) {
+    struct vnode *vn;
+    off_t offset;
+
+    struct region *region = as_region_lookup(as, page);
+    if (region == NULL || !region->readable) {
+        return false;
+    }
+    if (writeable && !region->writeable) {
+        return false;
+    }
+    return !region_cached_page(region, page, &vn, &offset);
+}
+
+/*
+ * A loaned page is shared just as fork shares pages: the lender's
+ * mapping is made read-only, so its next write takes a private copy
+ * (see vm_copy_on_write), and the frame gets another reference, for
+ * the borrower.
+ */
+int
+vm_loan_page(struct addrspace *as, vaddr_t vaddr, paddr_t *paddr_ret) {
+    KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+    rwlock_acquire_read(as->regions_lock);
+    if (!vm_page_loanable(as, vaddr, false)) {
+        rwlock_release_read(as->regions_lock);
+        return EINVAL;
+    }
+
+    vm_lock_acquire();
+    PTE *pte = page_table_lookup(as->page_table, vaddr);
+    if (pte == NULL) {
+        // not touched yet, or paged out; not worth bringing in for this
+        vm_lock_release();
+        rwlock_release_read(as->regions_lock);
+        return EINVAL;
+    }
+
+    paddr_t paddr = pte->frame & PAGE_FRAME;
+    if (PADDR_IS_HIGH(paddr)) {
+        // the borrower wants it at a kernel address; let it copy instead
+        vm_lock_release();
+        rwlock_release_read(as->regions_lock);
+        return EINVAL;
+    }
+    frame_incref(paddr);
+    if (pte->frame & TLBLO_DIRTY) {
+        pte->frame &= ~TLBLO_DIRTY;
+        vm_tlb_invalidate(as, vaddr);
+    }
+    vm_lock_release();
+    rwlock_release_read(as->regions_lock);
+
+    vmstat_inc(VMSTAT_PAGE_LOANS);
+    *paddr_ret = paddr;
+    return 0;
+}
+
+/*
+ * The borrower's mapping starts out read-only too, so that whichever
+ * side writes first while the frame is still shared gets the copy.
+ */
+int
+vm_accept_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr) {
+    KASSERT((vaddr & PAGE_FRAME) == vaddr);
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+
+    rwlock_acquire_read(as->regions_lock);
+    if (!vm_page_loanable(as, vaddr, true)) {
+        rwlock_release_read(as->regions_lock);
+        return EINVAL;
+    }
+
+    vm_lock_acquire();
+    paddr_t frame = paddr | TLBLO_VALID | PTE_REFERENCED;
+    PTE *pte = page_table_slot(as->page_table, vaddr);
+    if (pte == NULL) {
+        int result = page_table_add_entry(as->page_table, vaddr, frame);
+        if (result) {
+            vm_lock_release();
+            rwlock_release_read(as->regions_lock);
+            return result;
+        }
+    } else {
+        // switch the entry over before the TLB lets go of the old frame
+        PTE old = *pte;
+        page_table_set_pte(as->page_table, vaddr, pte, frame | (old.frame & PTE_LOCKED));
+        if (PTE_VALID(&old)) {
+            vm_tlb_invalidate(as, vaddr);
+            frame_unmap(old.frame & PAGE_FRAME, as, vaddr);
+        } else if (PTE_IS_SWAPPED(&old)) {
+            swap_free(PTE_SWAP_SLOT(&old));
+        }
+    }
+    vm_lock_release();
+    rwlock_release_read(as->regions_lock);
+
+    vmstat_inc(VMSTAT_PAGE_FLIPS);
+    return 0;
+}
+
+/*
+ * Same-page merging. While turned on, the "pagemerge" thread works its
+ * way round the frame table, MERGE_BATCH owned (so anonymous, private)
+ * frames at a time with the VM lock held, and MERGE_DELAY_NS apart.
+ * Each frame's contents are hashed into merge_table, which remembers
+ * the last frame seen with each hash. If that frame is still one whose
+ * mappings are all known (see frame_mappings_known) and has the same
+ * contents, the page is remapped to it, shared copy-on-write as fork
+ * would share it, and its own frame is freed; pages of zeroes are
+ * remapped to the zero frame instead. A write to a merged page then
+ * takes a private copy in vm_copy_on_write, as after fork.
+ *
+ * Both pages are write-protected before being compared, so neither can
+ * change until the compare is done, and a frame is only merged into
+ * if all its mappings are read-only. The table is only a hint: every
+ * entry is checked again when it is used.
+ */
+#define MERGE_BUCKETS 1024 // a power of 2
+#define MERGE_BATCH 64
+#define MERGE_DELAY_NS 10000000
+
+static struct {
+    uint32_t hash;
+    paddr_t paddr;
+} merge_table[MERGE_BUCKETS];
+static unsigned merge_cursor;
+
+static struct spinlock merge_lock = SPINLOCK_INITIALIZER;
+static bool merge_on;
+static bool merge_running; // the thread exists
+
+/* Hash frame PADDR, and say whether it's all zeroes. */
+static uint32_t
+merge_hash(paddr_t paddr, bool *zero_ret) {
+    vaddr_t kvaddr = vm_kmap(paddr, 0);
+    const uint32_t *words = (const uint32_t *)kvaddr;
+    uint32_t hash = 0, any = 0;
+
+    for (unsigned i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        hash = hash * 31 + words[i];
+        any |= words[i];
+    }
+    vm_kunmap(kvaddr, 0);
+    *zero_ret = any == 0;
+    return hash;
+}
+
+/* Are frames PADDR1 and PADDR2 the same? */
+static bool
+merge_same(paddr_t paddr1, paddr_t paddr2) {
+    vaddr_t kvaddr1 = vm_kmap(paddr1, 0);
+    vaddr_t kvaddr2 = vm_kmap(paddr2, 1);
+    const uint32_t *a = (const uint32_t *)kvaddr1, *b = (const uint32_t *)kvaddr2;
+    bool same = true;
+
+    for (unsigned i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (a[i] != b[i]) {
+            same = false;
+            break;
+        }
+    }
+    vm_kunmap(kvaddr2, 1);
+    vm_kunmap(kvaddr1, 0);
+    return same;
+}
+
+/* Make AS's mapping PTE of page VADDR read-only, if it isn't. */
+static void
+merge_write_protect(struct addrspace *as, PTE *pte, vaddr_t vaddr) {
+    if (pte->frame & TLBLO_DIRTY) {
+        pte->frame &= ~TLBLO_DIRTY;
+        vm_tlb_invalidate(as, vaddr);
+    }
+}
+
+/*
+ * Can PADDR be merged into? If it has an owner, write-protect the
+ * owner's mapping; a frame with a reverse map is read-only already.
+ */
+static bool
+merge_target_ok(paddr_t paddr, struct addrspace **as_ret, vaddr_t *vaddr_ret) {
+    if (!frame_mappings_known(paddr, as_ret, vaddr_ret)) {
+        return false;
+    }
+    if (*as_ret == NULL) {
+        return true;
+    }
+    PTE *pte = page_table_lookup((*as_ret)->page_table, *vaddr_ret);
+    KASSERT(pte != NULL && (pte->frame & PAGE_FRAME) == paddr);
+    merge_write_protect(*as_ret, pte, *vaddr_ret);
+    return true;
+}
+
+/* Consider merging frame PADDR, mapped only at VADDR of AS, with another. */
+static void
+merge_page(paddr_t paddr, struct addrspace *as, vaddr_t vaddr) {
+    KASSERT(vm_lock_do_i_hold());
+    vmstat_inc(VMSTAT_MERGE_SCANS);
+
+    PTE *pte = page_table_lookup(as->page_table, vaddr);
+    KASSERT(pte != NULL && (pte->frame & PAGE_FRAME) == paddr);
+
+    bool zero;
+    uint32_t hash = merge_hash(paddr, &zero);
+    paddr_t target;
+    struct addrspace *target_as = NULL;
+    vaddr_t target_vaddr = 0;
+    if (zero) {
+        target = vm_zero_frame;
+    } else {
+        unsigned b = hash & (MERGE_BUCKETS - 1);
+        target = merge_table[b].paddr;
+        if (target == 0 || target == paddr || merge_table[b].hash != hash ||
+            !merge_target_ok(target, &target_as, &target_vaddr)) {
+            merge_table[b].hash = hash;
+            merge_table[b].paddr = paddr;
+            return;
+        }
+    }
+
+    // now ours can't change either; see if they really are the same
+    merge_write_protect(as, pte, vaddr);
+    if (zero) {
+        merge_hash(paddr, &zero);
+        if (!zero) {
+            return;
+        }
+        frame_incref(vm_zero_frame);
+    } else {
+        if (!merge_same(paddr, target)) {
+            return;
+        }
+        frame_share(target, target_as, target_vaddr, as, vaddr);
+    }
+
+    // switch the entry over before the TLB lets go of the old frame
+    pte->frame = target | (pte->frame & ~PAGE_FRAME);
+    vm_tlb_invalidate(as, vaddr);
+    frame_unmap(paddr, as, vaddr);
+    vmstat_inc(VMSTAT_PAGES_MERGED);
+}
+
+static void
+merge_thread(void *data1, unsigned long data2) {
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = MERGE_DELAY_NS };
+    struct addrspace *as;
+    vaddr_t vaddr;
+
+    (void)data1;
+    (void)data2;
+
+    for (;;) {
+        spinlock_acquire(&merge_lock);
+        if (!merge_on) {
+            merge_running = false;
+            spinlock_release(&merge_lock);
+            break;
+        }
+        spinlock_release(&merge_lock);
+
+        vm_lock_acquire();
+        for (unsigned n = 0; n < MERGE_BATCH; n++) {
+            paddr_t paddr = frame_next_owned(&merge_cursor, &as, &vaddr);
+            if (paddr == 0) {
+                break;
+            }
+            merge_page(paddr, as, vaddr);
+        }
+        vm_lock_release();
+
+        clocknanosleep(&delay);
+    }
+    thread_exit();
+}
+
+int
+vm_merge_start(void) {
+    spinlock_acquire(&merge_lock);
+    merge_on = true;
+    if (merge_running) {
+        spinlock_release(&merge_lock);
+        return 0;
+    }
+    merge_running = true;
+    spinlock_release(&merge_lock);
+
+    int result = thread_fork("pagemerge", NULL, merge_thread, NULL, 0);
+    if (result) {
+        spinlock_acquire(&merge_lock);
+        merge_running = false;
+        merge_on = false;
+        spinlock_release(&merge_lock);
+    }
+    return result;
+}
+
+void
+vm_merge_stop(void) {
+    spinlock_acquire(&merge_lock);
+    merge_on = false;
+    spinlock_release(&merge_lock);
+}
+
+bool
+vm_merge_running(void) {
+    return merge_on;
+}
+
+/*
+ * Compaction. User pages scattered through low memory can leave no
+ * free block big enough for a multi-page alloc_kpages, which then has
+ * to map separate frames into kseg2 instead, or fail. vm_compact takes
+ * the size of the block that was wanted (see frame_compact_wanted) and
+ * looks for a window of that many frames, aligned as a buddy block,
+ * holding only free frames and user frames whose mappings are all
+ * known: ones with an owner or a reverse map. Each of the latter moves
+ * out, into high memory if there's any, since only user pages can use
+ * that. Its mappings are write-protected while it is copied, as for
+ * merging, and then switched over to the copy. Windows are taken in
+ * order from where the last pass stopped; one that turns out to hold a
+ * frame that can't move is given up, keeping what moved.
+ *
+ * It needs the VM lock, so it is left to vm_reclaim, which is called
+ * without locks held, rather than done in alloc_kpages, which is called
+ * with all sorts of locks held, some of which are taken under the VM
+ * lock.
+ */
+#define COMPACT_MAXMAP 16 // a frame shared more widely than this stays put
+
+static unsigned compact_cursor;
+
+/*
+ * Move frame PADDR out of a compaction window, if it's in use. Returns
+ * EBUSY if it can't be moved and ENOMEM if there's nowhere to put it.
+ */
+static int
+compact_move(paddr_t paddr) {
+    struct addrspace *ases[COMPACT_MAXMAP];
+    vaddr_t vaddrs[COMPACT_MAXMAP];
+    PTE *ptes[COMPACT_MAXMAP];
+    paddr_t flags[COMPACT_MAXMAP];
+
+    KASSERT(vm_lock_do_i_hold());
+
+    int n = frame_compact_mappings(paddr, ases, vaddrs, COMPACT_MAXMAP);
+    if (n <= 0) {
+        return n == 0 ? 0 : EBUSY;
+    }
+    for (int k = 0; k < n; k++) {
+        ptes[k] = page_table_lookup(ases[k]->page_table, vaddrs[k]);
+        KASSERT(ptes[k] != NULL && (ptes[k]->frame & PAGE_FRAME) == paddr);
+    }
+
+    paddr_t new_paddr = frame_alloc_high();
+    if (new_paddr == 0) {
+        vaddr_t page = alloc_kpages(1); // not from the window, whose free frames are taken
+        if (page == 0) {
+            return ENOMEM;
+        }
+        new_paddr = KVADDR_TO_PADDR(page);
+    }
+
+    // nobody can write to it while it's copied
+    for (int k = 0; k < n; k++) {
+        flags[k] = ptes[k]->frame & ~PAGE_FRAME;
+        merge_write_protect(ases[k], ptes[k], vaddrs[k]);
+    }
+    vm_frame_copy(new_paddr, paddr);
+
+    // switch the entries over before the TLBs let go of the old frame
+    for (int k = 0; k < n; k++) {
+        ptes[k]->frame = new_paddr | flags[k];
+        vm_tlb_invalidate(ases[k], vaddrs[k]);
+    }
+    frame_compact_moved(paddr, new_paddr);
+    vmstat_inc(VMSTAT_PAGES_MIGRATED);
+    return 0;
+}
+
+/*
+ * Make a free block of the size last wanted, if one was. Returns true
+ * if it did, so the allocation is worth trying again.
+ */
+static bool
+vm_compact(void) {
+    int order = frame_compact_wanted();
+    if (order < 0) {
+        return false;
+    }
+
+    bool made = false;
+    vm_lock_acquire();
+    // at most once round: frame_compact_isolate starts the cursor over at the end
+    bool wrapped = compact_cursor == 0;
+    while (!made) {
+        paddr_t start = frame_compact_isolate(order, &compact_cursor);
+        if (start == 0) {
+            if (wrapped) {
+                break;
+            }
+            wrapped = true;
+            continue;
+        }
+
+        int result = 0;
+        for (unsigned k = 0; k < (1U << order) && result == 0; k++) {
+            result = compact_move(start + k * PAGE_SIZE);
         }
-        for (int i = 0; i < 1 << L2_BITS; i++) {
-            page_table->tables[l1_index]->entries[i] = NULL;
+        frame_compact_release(start, order);
+        if (result == 0) {
+            made = true;
+            vmstat_inc(VMSTAT_COMPACTIONS);
+        } else if (result == ENOMEM) {
+            break;
         }
     }
-    // TODO: Can we have a collision here?
-    page_table->tables[l1_index]->entries[l2_index] = pte;
+    vm_lock_release();
+    return made;
+}
 
-    return 0;
+/*
+ * Working sets. The "wsample" thread goes round the frame table once
+ * per window, WS_BATCH owned frames at a time with the VM lock held,
+ * and then sleeps WS_WINDOW_NS. Each page's referenced bit is tested
+ * and cleared, and the ones found set are counted for their address
+ * space. The count for the last complete window is the working set
+ * estimate; an address space none of whose pages were referenced in
+ * it is idle, and frame_choose_victim takes its pages first.
+ *
+ * The sampler and the clock hand share the referenced bit, so to the
+ * clock a page now gets its second chance only if used since the
+ * last of the two to look at it. Shared and file pages have no owner
+ * and aren't counted.
+ */
+#define WS_BATCH 128
+#define WS_WINDOW_NS 1000000000
+
+static unsigned ws_now = 1; // current window; 0 is before any
+static unsigned ws_cursor;
+
+/* Sample page VADDR of AS, mapped by an owned frame. */
+static void
+ws_sample_page(struct addrspace *as, vaddr_t vaddr) {
+    KASSERT(vm_lock_do_i_hold());
+
+    if (as->ws_window != ws_now) {
+        // first page of AS this window: the last one is complete
+        as->ws_pages = as->ws_window + 1 == ws_now ? as->ws_count : 0;
+        as->ws_window = ws_now;
+        as->ws_count = 0;
+    }
+    if (vm_page_test_and_clear_referenced(as, vaddr)) {
+        as->ws_count++;
+        as->ws_active = ws_now;
+    }
 }
 
 static void
-load_tlb(vaddr_t vaddr, paddr_t paddr, bool force_rw) {
-    uint32_t ehi, elo;
-    int spl;
+ws_thread(void *data1, unsigned long data2) {
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = WS_WINDOW_NS };
+    struct addrspace *as;
+    vaddr_t vaddr;
 
-    spl = splhigh();
+    (void)data1;
+    (void)data2;
 
-    if (force_rw) {
-        paddr |= TLBLO_DIRTY;
+    for (;;) {
+        bool done = false;
+        while (!done) {
+            vm_lock_acquire();
+            for (unsigned n = 0; n < WS_BATCH; n++) {
+                if (frame_next_owned(&ws_cursor, &as, &vaddr) == 0) {
+                    done = true;
+                    break;
+                }
+                ws_sample_page(as, vaddr);
+            }
+            vm_lock_release();
+            thread_yield();
+        }
+
+        clocknanosleep(&delay);
+        vm_lock_acquire();
+        ws_now++;
+        vm_lock_release();
     }
+}
 
-    ehi = vaddr & TLBHI_VPAGE;
-    elo = paddr | TLBLO_VALID;
+void
+vm_ws_init(struct addrspace *as) {
+    // a new process counts as active until it has had a window to show otherwise
+    as->ws_window = ws_now;
+    as->ws_count = 0;
+    as->ws_pages = 0;
+    as->ws_active = ws_now;
+}
 
-    int result = tlb_probe(ehi, 0);
-    if (result >= 0) {
-        tlb_write(ehi, elo, result);
-        splx(spl);
-        return;
+unsigned
+vm_working_set(struct addrspace *as) {
+    vm_lock_acquire();
+    unsigned n = 0;
+    if (as->ws_window == ws_now) {
+        n = as->ws_pages;
+    } else if (as->ws_window + 1 == ws_now) {
+        n = as->ws_count; // this window's lap hasn't got to it yet
     }
+    vm_lock_release();
+    return n;
+}
 
-    tlb_random(ehi, elo);
-
-    splx(spl);
+/*
+ * Was nothing of AS referenced in the last complete window? Called by
+ * frame_choose_victim with the VM lock held.
+ */
+bool
+vm_as_idle(struct addrspace *as) {
+    return ws_now - as->ws_active > 1;
 }
 
 void
@@ -85,38 +2253,177 @@ vm_bootstrap(void) {
      * You may or may not need to add anything here depending what's
      * provided or required by the assignment spec.
      */
+#if OPT_HASHPT
+    hashpt_bootstrap();
+#else
+    // mips_utlb_refill hardcodes the page table layout
+    COMPILE_ASSERT(__builtin_offsetof(PageTable, nslots) == 0);
+    COMPILE_ASSERT(__builtin_offsetof(PageTable, slots) == 4);
+    COMPILE_ASSERT(__builtin_offsetof(PageTable, slots[0].table) == 8);
+    COMPILE_ASSERT(sizeof(((PageTable *)0)->slots[0]) == 8);
+    COMPILE_ASSERT(__builtin_offsetof(PageTable, directory) == 52);
+#endif
+    COMPILE_ASSERT(L2_BITS + OFFSET_BITS == 21);
+    COMPILE_ASSERT(PTE_REFERENCED == 0x2 && PTE_SOFTBITS == 0xff);
+    COMPILE_ASSERT(sizeof(vm_utlb_scratch[0]) == 8);
+    COMPILE_ASSERT(MAXCPUS <= 32); // one bit each in tlb_cpus
+
+    vm_lock = lock_create("vm");
+    if (vm_lock == NULL) {
+        panic("vm_bootstrap: lock_create failed\n");
+    }
+    vaddr_t zero_page = alloc_kpages(1);
+    if (zero_page == 0) {
+        panic("vm_bootstrap: no memory for the zero page\n");
+    }
+    page_zero(zero_page);
+    vm_zero_frame = KVADDR_TO_PADDR(zero_page);
+    if (ram_gethighsize() > 0) {
+        vm_bounce_page = alloc_kpages(1);
+        if (vm_bounce_page == 0) {
+            panic("vm_bootstrap: no memory for the bounce page\n");
+        }
+    }
+
+    swap_bootstrap();
+    pagecache_bootstrap();
+
+    zero_pool_wchan = wchan_create("zeropool");
+    if (zero_pool_wchan == NULL) {
+        panic("vm_bootstrap: wchan_create failed\n");
+    }
+    int result = thread_fork("pagezero", NULL, zero_thread, NULL, 0);
+    if (result) {
+        panic("vm_bootstrap: thread_fork failed: %s\n", strerror(result));
+    }
+    result = thread_fork("wsample", NULL, ws_thread, NULL, 0);
+    if (result) {
+        panic("vm_bootstrap: thread_fork failed: %s\n", strerror(result));
+    }
 }
 
-int
-vm_fault(int faulttype, vaddr_t faultaddress) {
-    (void)faulttype;
-    (void)faultaddress;
+void
+vmstat_add(unsigned counter, uint32_t n) {
+    KASSERT(counter < VMSTAT_NCOUNTERS);
+    if (!CURCPU_EXISTS()) {
+        return; // early boot allocations aren't interesting
+    }
 
-    /*
-     * Check fault type
-     */
-    switch (faulttype) {
-    case VM_FAULT_READ:
-        break;
-    case VM_FAULT_WRITE:
-        break;
-    case VM_FAULT_READONLY:
-        return EFAULT;
-    default:
+    int spl = splhigh(); // stay on this CPU, and keep interrupts from counting in between
+    vm_cpustats[curcpu->c_number].count[counter] += n;
+    splx(spl);
+}
+
+void
+vmstat_inc(unsigned counter) {
+    vmstat_add(counter, 1);
+}
+
+int
+vm_getstats(int cpu, struct vmstat *ret) {
+    if (cpu < -1 || cpu >= MAXCPUS) {
         return EINVAL;
     }
 
-    /*
-     * At this point, we know that the fault was a read or write fault.
-     * Handle this fault. Look up page table first
-     */
+    for (unsigned i = 0; i < VMSTAT_NCOUNTERS; i++) {
+        if (cpu >= 0) {
+            ret->vs_count[i] = vm_cpustats[cpu].count[i];
+            continue;
+        }
+        ret->vs_count[i] = 0;
+        for (unsigned c = 0; c < MAXCPUS; c++) {
+            ret->vs_count[i] += vm_cpustats[c].count[i];
+        }
+    }
+    return 0;
+}
 
-    struct addrspace *as;
-    as = proc_getas();
-    if (as == NULL) {
-        return EFAULT;
+void
+vm_printstats(void) {
+    static const char *const names[VMSTAT_NCOUNTERS] = VMSTAT_NAMES;
+    struct vmstat total;
+    bool active[MAXCPUS];
+
+    vm_getstats(-1, &total);
+
+    // only show CPUs that have done something
+    kprintf("%-18s %10s", "", "total");
+    for (unsigned c = 0; c < MAXCPUS; c++) {
+        active[c] = false;
+        for (unsigned i = 0; i < VMSTAT_NCOUNTERS; i++) {
+            if (vm_cpustats[c].count[i] != 0) {
+                active[c] = true;
+                break;
+            }
+        }
+        if (active[c]) {
+            kprintf("   cpu%-4u", c);
+        }
+    }
+    kprintf("\n");
+
+    for (unsigned i = 0; i < VMSTAT_NCOUNTERS; i++) {
+        kprintf("%-18s %10u", names[i], total.vs_count[i]);
+        for (unsigned c = 0; c < MAXCPUS; c++) {
+            if (active[c]) {
+                kprintf(" %9u", vm_cpustats[c].count[i]);
+            }
+        }
+        kprintf("\n");
+    }
+
+#if OPT_HASHPT
+    kprintf("Hashed page table: %u entries in %u buckets\n", hashpt_nentries, hashpt_nbuckets);
+#endif
+    frame_printstats();
+    swap_printstats();
+}
+
+bool
+vm_reclaim(void) {
+    KASSERT(!vm_lock_do_i_hold());
+
+    // memory may be on its way back from processes that exited
+    if (as_reap_wait()) {
+        return true;
+    }
+
+    // enough frames, perhaps, but not together
+    if (vm_compact()) {
+        return true;
+    }
+
+    // then whatever the caches can give up without any I/O
+    if (pagecache_shrink() + buf_shrink() > 0) {
+        vmstat_inc(VMSTAT_RECLAIMS);
+        return true;
+    }
+
+    if (vm_oom_policy == OOM_KILL_LARGEST && proc_kill_largest()) {
+        vmstat_inc(VMSTAT_OOM_KILLS);
+        // its address space is destroyed in the background
+        as_reap_wait();
+        return true;
     }
+    return false;
+}
+
+void
+vm_set_oom_policy(int policy) {
+    KASSERT(policy == OOM_KILL_FAULTING || policy == OOM_KILL_LARGEST);
+    vm_oom_policy = policy;
+}
+
+int
+vm_get_oom_policy(void) {
+    return vm_oom_policy;
+}
 
+/*
+ * The body of vm_fault, called with the VM lock held.
+ */
+static int
+vm_handle_fault(struct addrspace *as, int faulttype, vaddr_t faultaddress) {
     PageTable *pt = as->page_table;
     if (pt == NULL) {
         return EFAULT;
@@ -126,11 +2433,43 @@ vm_fault(int faulttype, vaddr_t faultaddress) {
     PTE *pte = page_table_lookup(pt, faultaddress);
 
     /*
-     * If this is a valid translation, we can load TLB
+     * A write to a page loaded read-only. This is only legal if the
+     * region is writeable, in which case the page is copy-on-write.
+     */
+    if (faulttype == VM_FAULT_READONLY) {
+        struct region *region = as_region_lookup(as, faultaddress);
+        if (pte == NULL || region == NULL) {
+            return EFAULT;
+        }
+        if (!region->writeable) {
+            return EFAULT;
+        }
+        struct vnode *vn;
+        off_t offset;
+        if (region_cached_page(region, faultaddress & PAGE_FRAME, &vn, &offset)) {
+            // file pages are shared, never copied; just note the page needs writing back
+            pagecache_mark_dirty(vn, offset);
+            pte->frame |= TLBLO_DIRTY | PTE_REFERENCED;
+            load_tlb(faultaddress, pte->frame);
+            return 0;
+        }
+        return vm_copy_on_write(as, pte, faultaddress);
+    }
+
+    /*
+     * If this is a valid translation, we can load TLB, unless mprotect
+     * has since taken the page away (see vm_protect_range)
      */
     if (pte) {
+        struct region *region = as_region_lookup(as, faultaddress);
+        if (region == NULL || (!region->readable && !region->writeable) ||
+            (!region->readable && faulttype == VM_FAULT_READ)) {
+            return EFAULT;
+        }
         paddr_t paddr = pte->frame;
-        load_tlb(faultaddress, paddr, as->force_readwrite);
+        pte->frame |= PTE_REFERENCED;
+        load_tlb(faultaddress, paddr);
+        vmstat_inc(VMSTAT_TLB_RELOADS);
         return 0;
     }
 
@@ -138,13 +2477,7 @@ vm_fault(int faulttype, vaddr_t faultaddress) {
      * Otherwise we need to check if this is a valid translation, we need to look up in regions
      */
 
-    struct region *current_region = as->regions;
-    while (current_region != NULL) {
-        if (current_region->vbase <= faultaddress && faultaddress < current_region->vtop) {
-            break;
-        }
-        current_region = current_region->next;
-    }
+    struct region *current_region = as_region_lookup(as, faultaddress);
     if (current_region == NULL) {
         /*
          * Not found in regions, this is an invalid address
@@ -157,31 +2490,92 @@ vm_fault(int faulttype, vaddr_t faultaddress) {
         return EFAULT;
     }
 
-    /* now check if we receive a write fault on a read-only page, with forced write off */
-    if (!current_region->writeable && !as->force_readwrite && faulttype == VM_FAULT_WRITE) {
+    /* now check if we receive a write fault on a read-only page */
+    if (!current_region->writeable && faulttype == VM_FAULT_WRITE) {
         return EFAULT;
     }
 
+    struct vnode *cache_vn;
+    off_t cache_offset;
+    if (region_cached_page(current_region, faultaddress & PAGE_FRAME, &cache_vn, &cache_offset)) {
+        return vm_map_cached_page(as, cache_vn, cache_offset, current_region->writeable,
+                                  faulttype, faultaddress);
+    }
+
+    PTE *slot_pte = page_table_slot(pt, faultaddress);
+    bool swapped = slot_pte != NULL && PTE_IS_SWAPPED(slot_pte);
+
+    /*
+     * Reading memory nobody has written yet: map the zero frame, and
+     * leave allocating a page to the write fault (see vm_copy_on_write).
+     */
+    if (faulttype == VM_FAULT_READ && !swapped &&
+        !elf_page_has_data(current_region, faultaddress & PAGE_FRAME)) {
+        paddr_t paddr = vm_zero_frame | TLBLO_VALID | PTE_REFERENCED;
+        int result = page_table_add_entry(pt, faultaddress, paddr);
+        if (result) {
+            return result;
+        }
+        frame_incref(vm_zero_frame);
+        load_tlb(faultaddress, paddr);
+        vmstat_inc(VMSTAT_ZERO_FRAME_MAPS);
+        return 0;
+    }
+
     /*
      * At this point we know this is in a valid region, we need to allocate a page and add it to the page table
      */
-    vaddr_t vaddr = alloc_kpages(1);
-    if (vaddr == 0) {
-        return ENOMEM;
+    bool has_data = swapped || elf_page_has_data(current_region, faultaddress & PAGE_FRAME);
+    vaddr_t vaddr = 0;
+    paddr_t paddr;
+    if (has_data) {
+        // reading it in may sleep, so it needs a kseg0 address
+        vaddr = vm_alloc_page();
+        if (vaddr == 0) {
+            return ENOMEM;
+        }
+        paddr = KVADDR_TO_PADDR(vaddr);
+    } else {
+        paddr = vm_alloc_user_frame(true);
+        if (paddr == 0) {
+            return ENOMEM;
+        }
     }
 
-    // Zero fill the page
-    bzero((void *)vaddr, PAGE_SIZE);
+    if (swapped) {
+        // Bring the page back in from swap
+        unsigned slot = PTE_SWAP_SLOT(slot_pte);
+        int result = swap_in(slot, vaddr);
+        if (result) {
+            free_kpages(vaddr);
+            return result;
+        }
+        swap_free(slot);
+        page_table_set_pte(pt, faultaddress, slot_pte, 0);
+        vmstat_inc(VMSTAT_SWAPINS);
+    } else if (has_data) {
+        // First touch of a program segment: read it from the executable
+        int result = vm_load_elf_page(current_region, faultaddress & PAGE_FRAME, vaddr);
+        if (result) {
+            free_kpages(vaddr);
+            return result;
+        }
+        // the VM lock was dropped, so another thread may have loaded it
+        pte = page_table_lookup(pt, faultaddress);
+        if (pte != NULL) {
+            free_kpages(vaddr);
+            pte->frame |= PTE_REFERENCED;
+            load_tlb(faultaddress, pte->frame);
+            return 0;
+        }
+    }
+    // otherwise vm_alloc_user_frame has already zero filled the page
 
     /*
      * Now add this to the page table
      */
 
-    // First, we need to get the physical address
-
-    paddr_t paddr = KVADDR_TO_PADDR(vaddr);
-
-    paddr |= TLBLO_VALID;
+    paddr |= TLBLO_VALID | PTE_REFERENCED;
 
     // find out if the region is writeable
     if (current_region->writeable) {
@@ -191,24 +2585,357 @@ vm_fault(int faulttype, vaddr_t faultaddress) {
     // Add the new page table entry to the page table
     int result = page_table_add_entry(pt, faultaddress, paddr);
     if (result) {
+        frame_free(paddr & PAGE_FRAME);
         return result;
     }
+    frame_set_owner(paddr & PAGE_FRAME, as, faultaddress & PAGE_FRAME);
 
     /*
      * Now we can load the TLB
      */
 
-    load_tlb(faultaddress, paddr, as->force_readwrite);
+    load_tlb(faultaddress, paddr);
 
     return 0;
 }
 
 /*
- * SMP-specific functions.  Unused in our UNSW configuration.
+ * Fault-around: after a fault that continues a sequential run, map the
+ * next few pages of REGION ahead of time, so a scan traps once every
+ * FAULT_AROUND_PAGES + 1 pages rather than on every page. Only cheap
+ * cases are handled: resident pages are just loaded into the TLB, and
+ * untouched anonymous pages get the zero frame on a read run, or a
+ * pre-zeroed or free frame on a write run. We stop at the first page
+ * that needs I/O or an eviction and leave it to its own fault.
+ *
+ * Returns how many pages past PAGE were mapped.
+ */
+#define FAULT_AROUND_PAGES 4
+
+static unsigned
+vm_fault_around(struct addrspace *as, struct region *region, int faulttype, vaddr_t page) {
+    unsigned n;
+
+    for (n = 0; n < FAULT_AROUND_PAGES; n++) {
+        vaddr_t va = page + (n + 1) * PAGE_SIZE;
+        if (va >= region->vtop) {
+            break;
+        }
+
+        PTE *pte = page_table_slot(as->page_table, va);
+        if (pte != NULL && PTE_VALID(pte)) {
+            pte->frame |= PTE_REFERENCED;
+            load_tlb(va, pte->frame);
+            continue;
+        }
+        if ((pte != NULL && PTE_IS_SWAPPED(pte)) || region->vn != NULL ||
+            elf_page_has_data(region, va)) {
+            break;
+        }
+
+        paddr_t paddr;
+        if (faulttype == VM_FAULT_WRITE && region->writeable) {
+            vaddr_t kpage = zero_pool_take();
+            if (kpage != 0) {
+                paddr = KVADDR_TO_PADDR(kpage);
+                vmstat_inc(VMSTAT_PREZEROED);
+            } else {
+                paddr = frame_alloc_high();
+                if (paddr == 0) {
+                    kpage = alloc_kpages(1);
+                    if (kpage == 0) {
+                        break;
+                    }
+                    paddr = KVADDR_TO_PADDR(kpage);
+                }
+                vm_frame_zero(paddr);
+                vmstat_inc(VMSTAT_ZERO_FILLS);
+            }
+            paddr |= TLBLO_VALID | TLBLO_DIRTY | PTE_REFERENCED;
+            if (page_table_add_entry(as->page_table, va, paddr)) {
+                frame_free(paddr & PAGE_FRAME);
+                break;
+            }
+            frame_set_owner(paddr & PAGE_FRAME, as, va);
+        } else if (faulttype == VM_FAULT_READ && region->readable) {
+            paddr = vm_zero_frame | TLBLO_VALID | PTE_REFERENCED;
+            if (page_table_add_entry(as->page_table, va, paddr)) {
+                break;
+            }
+            frame_incref(vm_zero_frame);
+            vmstat_inc(VMSTAT_ZERO_FRAME_MAPS);
+        } else {
+            break;
+        }
+        load_tlb(va, paddr);
+    }
+    vmstat_add(VMSTAT_FAULT_AROUND, n);
+
+    return n;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress) {
+    (void)faulttype;
+    (void)faultaddress;
+
+    /*
+     * Check fault type
+     */
+    switch (faulttype) {
+    case VM_FAULT_READ:
+        vmstat_inc(VMSTAT_FAULTS_READ);
+        break;
+    case VM_FAULT_WRITE:
+        vmstat_inc(VMSTAT_FAULTS_WRITE);
+        break;
+    case VM_FAULT_READONLY:
+        vmstat_inc(VMSTAT_FAULTS_READONLY);
+        break;
+    default:
+        return EINVAL;
+    }
+    vmstat_inc(VMSTAT_FAULTS);
+    KTRACE(KTRACE_FAULT, faulttype, faultaddress);
+
+    // the mapped kernel heap is handled without the VM lock, from any context
+    if (faultaddress >= MIPS_KSEG2) {
+        int result = vm_kseg2_fault(faultaddress);
+        if (result) {
+            vmstat_inc(VMSTAT_FAULTS_FAILED);
+        }
+        KTRACE(KTRACE_FAULTDONE, result, faultaddress);
+        return result;
+    }
+
+    /*
+     * At this point, we know that the fault was a read or write fault.
+     * Handle this fault. Look up page table first
+     */
+
+    struct addrspace *as;
+    as = proc_getas();
+    if (as == NULL) {
+        KTRACE(KTRACE_FAULTDONE, EFAULT, faultaddress);
+        return EFAULT;
+    }
+
+    // the kernel information pages aren't in the page table; map them straight in, read-only
+    if (faultaddress >= KINFO_VADDR && faultaddress < KINFO_END) {
+        int result = EFAULT;
+        if (faulttype == VM_FAULT_READ) {
+            paddr_t paddr = faultaddress < KINFO_TIMEVADDR ?
+                KVADDR_TO_PADDR(as->kinfo) : kinfo_timepage();
+            load_tlb(faultaddress, paddr | TLBLO_VALID);
+            result = 0;
+        }
+        KTRACE(KTRACE_FAULTDONE, result, faultaddress);
+        return result;
+    }
+
+    // RLIMIT_RSS, in pages, or 0 for none
+    rlim_t rss_limit = proc_getrlimit(RLIMIT_RSS);
+    unsigned rss_max = 0;
+    if (rss_limit < (rlim_t)USERSPACETOP) {
+        rss_max = rss_limit / PAGE_SIZE;
+        if (rss_max < RSS_MIN_PAGES) {
+            rss_max = RSS_MIN_PAGES;
+        }
+    }
+
+    ktime_begin(KTIME_FAULT);
+retry:
+    rwlock_acquire_read(as->regions_lock);
+    int result = 0;
+    if (as_region_lookup(as, faultaddress) == NULL) {
+        // maybe just below the stack, which then grows down to take it in
+        rwlock_release_read(as->regions_lock);
+        result = as_grow_stack(as, faultaddress);
+        rwlock_acquire_read(as->regions_lock);
+    }
+    vm_lock_acquire();
+    if (result == 0 && rss_max != 0) {
+        vm_rss_enforce(as, rss_max);
+    }
+    if (result == 0) {
+        result = vm_handle_fault(as, faulttype, faultaddress);
+    }
+    if (result == 0 && faulttype != VM_FAULT_READONLY) {
+        vaddr_t page = faultaddress & PAGE_FRAME;
+        unsigned ahead = 0;
+        struct region *region = as_region_lookup(as, page);
+        // madvise may have said whether to expect a sequential run
+        if (region != NULL && region->advice != MADV_RANDOM &&
+            (page == as->fault_next || region->advice == MADV_SEQUENTIAL)) {
+            ahead = vm_fault_around(as, region, faulttype, page);
+        }
+        as->fault_next = page + (ahead + 1) * PAGE_SIZE;
+    }
+    vm_lock_release();
+    rwlock_release_read(as->regions_lock);
+    if (result == ENOMEM && vm_reclaim()) {
+        goto retry;
+    }
+    ktime_end(KTIME_FAULT);
+    if (result) {
+        vmstat_inc(VMSTAT_FAULTS_FAILED);
+    }
+    KTRACE(KTRACE_FAULTDONE, result, faultaddress);
+
+    return result;
+}
+
+void
+vm_prefault_range(struct addrspace *as, struct region *region, vaddr_t start, vaddr_t end) {
+    if (!region->readable) {
+        return;
+    }
+
+    vm_lock_acquire();
+    for (vaddr_t va = start; va < end; va += PAGE_SIZE) {
+        PTE *pte = page_table_slot(as->page_table, va);
+        struct vnode *vn;
+        off_t offset;
+
+        if (pte != NULL && PTE_VALID(pte)) {
+            continue;
+        }
+        // untouched anonymous pages cost nothing to fault on later
+        if ((pte == NULL || !PTE_IS_SWAPPED(pte)) && !elf_page_has_data(region, va) &&
+            !region_cached_page(region, va, &vn, &offset)) {
+            continue;
+        }
+        if (vm_handle_fault(as, VM_FAULT_READ, va)) {
+            break;
+        }
+        vmstat_inc(VMSTAT_PREFAULTS);
+    }
+    vm_lock_release();
+}
+
+int
+vm_lock_range(struct addrspace *as, struct region *region, vaddr_t start, vaddr_t end,
+              bool lock) {
+    int result = 0;
+
+    /*
+     * Private writeable pages are faulted in for writing, so that each
+     * gets a frame of its own now rather than a copy-on-write fault
+     * (and maybe an eviction) later.
+     */
+    bool write = region->writeable && region->vn == NULL;
+
+    vm_lock_acquire();
+    for (vaddr_t va = start; va < end; va += PAGE_SIZE) {
+        PTE *pte = page_table_slot(as->page_table, va);
+        if (!lock) {
+            if (pte != NULL) {
+                pte->frame &= ~PTE_LOCKED;
+            }
+            continue;
+        }
+
+        if (pte == NULL || !PTE_VALID(pte)) {
+            result = vm_handle_fault(as, write ? VM_FAULT_WRITE : VM_FAULT_READ, va);
+        } else if (write && (pte->frame & TLBLO_DIRTY) == 0) {
+            result = vm_handle_fault(as, VM_FAULT_READONLY, va);
+        }
+        if (result) {
+            break;
+        }
+        pte = page_table_lookup(as->page_table, va);
+        KASSERT(pte != NULL);
+        pte->frame |= PTE_LOCKED;
+    }
+    vm_lock_release();
+    return result;
+}
+
+void
+vm_protect_range(struct addrspace *as, vaddr_t start, vaddr_t end, int readable, int writeable) {
+    /*
+     * Write-protected pages fault on the next write, which fails unless
+     * the region is writeable again by then. Pages that may not be
+     * touched at all lose their referenced bit too, which keeps the
+     * refill handler from loading them, so every access reaches
+     * vm_handle_fault and fails there.
+     */
+    paddr_t clear = 0;
+    if (!writeable) {
+        clear |= TLBLO_DIRTY;
+    }
+    if (!readable && !writeable) {
+        clear |= PTE_REFERENCED;
+    }
+    if (clear == 0) {
+        return;
+    }
+
+    struct tlb_batch batch;
+    vm_lock_acquire();
+    tlb_batch_init(&batch, as);
+    vaddr_t va = start;
+    while (va < end) {
+        PTE *pte = page_table_slot(as->page_table, va);
+#if !OPT_HASHPT
+        if (pte == NULL) {
+            // no L2 table, so nothing mapped until the next one
+            va = (va | ((1 << (L2_BITS + OFFSET_BITS)) - 1)) + 1;
+            continue;
+        }
+#endif
+        if (pte != NULL && PTE_VALID(pte)) {
+            // even if the bits are clear already, an old TLB entry may linger
+            pte->frame &= ~clear;
+            tlb_batch_add(&batch, va, 0);
+        }
+        va += PAGE_SIZE;
+    }
+    tlb_batch_finish(&batch);
+    vm_lock_release();
+}
+
+void
+vm_mincore_range(struct addrspace *as, vaddr_t start, unsigned npages, unsigned char *vec) {
+    vm_lock_acquire();
+    for (unsigned i = 0; i < npages; i++) {
+        PTE *pte = page_table_slot(as->page_table, start + i * PAGE_SIZE);
+        vec[i] = pte != NULL && PTE_VALID(pte);
+    }
+    vm_lock_release();
+}
+
+/*
+ * SMP-specific functions. Called from interprocessor_interrupt, with
+ * interrupts off.
  */
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts) {
-    (void)ts;
-    panic("vm tried to do tlb shootdown?!\n");
+    unsigned cpu = curcpu->c_number;
+
+    vmstat_inc(VMSTAT_SHOOTDOWNS_RECV);
+    if (ts->ts_vaddr == TS_FLUSHALL) {
+        // clear the flag first, so a request made while we flush isn't lost
+        spinlock_acquire(&flushall_lock);
+        flushall_pending[cpu] = false;
+        spinlock_release(&flushall_lock);
+        tlb_flush_all();
+    } else if (ts->ts_generation == tlb_generation[cpu]) {
+        if (ts->ts_npages > NUM_TLB) {
+            // probing for each page would cost more than starting over
+            tlb_flush_all();
+        } else {
+            for (unsigned i = 0; i < ts->ts_npages; i++) {
+                tlb_invalidate_local(ts->ts_asid, ts->ts_vaddr + i * PAGE_SIZE);
+            }
+        }
+    }
+    // otherwise we have flushed since, and the entry is long gone
+
+    if (ts->ts_wait != NULL) {
+        spinlock_acquire(&ts->ts_wait->lock);
+        ts->ts_wait->pending--;
+        spinlock_release(&ts->ts_wait->lock);
+    }
 }
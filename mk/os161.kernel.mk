@@ -95,12 +95,22 @@ all: includelinks .WAIT $(KERNEL)
 # The version number is kept in the file called "version" in the build
 # directory.
 #
+# ksyms.c/.o is the kernel's symbol table, for the profiler. It's made
+# from the symbols of the linked kernel, so the kernel is linked once
+# with an empty table and then again with the real one; the table is
+# only data, so the functions don't move in between.
+#
 # By immemorial tradition, "size" is run on the kernel after it's linked.
 #
 $(KERNEL):
 	$(KTOP)/conf/newvers.sh $(CONFNAME)
 	$(CC) $(KCFLAGS) -c vers.c
-	$(LD) $(KLDFLAGS) $(OBJS) vers.o -o $(KERNEL)
+	$(KTOP)/conf/gensyms.sh < /dev/null > ksyms.c
+	$(CC) $(KCFLAGS) -c ksyms.c
+	$(LD) $(KLDFLAGS) $(OBJS) vers.o ksyms.o -o $(KERNEL)
+	$(NM) -n $(KERNEL) | $(KTOP)/conf/gensyms.sh > ksyms.c
+	$(CC) $(KCFLAGS) -c ksyms.c
+	$(LD) $(KLDFLAGS) $(OBJS) vers.o ksyms.o -o $(KERNEL)
 	@echo '*** This is $(CONFNAME) build #'`cat version`' ***'
 	$(SIZE) $(KERNEL)
 
@@ -0,0 +1,318 @@
+#!/usr/pkg/bin/python2.7
+# bench.py - run the benchmarks across machine sizes
+# usage: testscripts/bench.py [options] [benchmark...]
+# options:
+#    --conf=sys161.conf	Use alternate sys161 config
+#    --cpus=N,N,...	CPU counts to sweep (default 1,2,4)
+#    --ram=R,R,...	RAM sizes to sweep (default 4M,8M)
+#    --kernel=KERNEL	Kernel to run; repeat to compare builds
+#    --timeout=N	Global timeout per run, in seconds (default 600)
+#    --format=FMT	Output "csv" (default) or "json"
+#    --output=FILE	Write results to FILE (default stdout)
+#    --verbose		Copy the System/161 output to stderr
+#
+# The benchmarks are:
+#    vm		/testbin/vmbench
+#    fs		/testbin/fsbench, in the current directory (emu0:)
+#    sync	the kernel menu benchmarks sb1-sb4
+#    ipc	/testbin/schedpong -l
+# The default is all of them.
+#
+# Each benchmark runs in a fresh boot of each kernel for each
+# combination of CPU count and RAM size, so the runs don't disturb
+# each other. The output from each is parsed into results: the
+# programs print lines of a test name and name=value pairs, and the
+# kernel benchmarks print cycles per operation. Each boot also
+# yields the total cycle count sys161 prints at shutdown.
+#
+# The CSV form has one row per number, with the columns
+#    kernel,cpus,ram,bench,test,params,metric,value
+# where params holds the non-numeric fields of the line (such as
+# op=read) separated by spaces. A failed run has a row with metric
+# "error" and the message as its value. The JSON form is a list of
+# runs, each with its kernel, cpus, ram, bench, error (or null),
+# cycles, and a list of results that each have a test name and the
+# fields of its line.
+#
+# See the top of runtest.py for more about running System/161.
+#
+
+import sys
+import re
+import json
+from optparse import OptionParser
+
+import runtest
+
+############################################################
+# benchmarks
+
+#
+# Commands for each benchmark, as for runtest.run.
+#
+benchmarks = [
+	("vm", "p /testbin/vmbench"),
+	("fs", "p /testbin/fsbench -s 256 -r 256 -f 64"),
+	("sync", "sb1; sb2; sb3; sb4"),
+	("ipc", "p /testbin/schedpong -l 200; " +
+		"p /testbin/schedpong -l 200 -t 2"),
+]
+
+#
+# Turn a field value into a number if it is one.
+#
+def number(s):
+	try:
+		return int(s)
+	except ValueError:
+		pass
+	try:
+		return float(s)
+	except ValueError:
+		return None
+# end number
+
+#
+# Lines from the kernel benchmarks. A heading names the benchmark
+# and the lines under it give cycles per operation for a CPU count
+# or a placement.
+#
+sb_heading = re.compile(r"^(\S.*), \d+ (?:per thread|round trips):\s*$")
+sb_cpus = re.compile(r"^\s+(\d+) CPUs?\s*:\s+(\d+) cycles/op")
+sb_pair = re.compile(r"^\s+(same CPU|two CPUs):\s+(\d+) cycles/round trip")
+cyclesline = re.compile(r"^sys161: (\d+) cycles")
+latload = re.compile(r"^Measuring latencies with (\d+) thinkers")
+sb_names = {
+	"lock_acquire + lock_release": "sb1",
+	"CV ping-pong": "sb2",
+	"Semaphore handoff": "sb3",
+	"spinlock_acquire + spinlock_release": "sb4",
+}
+
+#
+# Parse the output of one run. Returns (cycles, results).
+#
+def parse(bench, text):
+	cycles = None
+	results = []
+	test = None
+	thinkers = None
+	for line in text.splitlines():
+		line = line.rstrip("\r")
+		m = cyclesline.match(line)
+		if m:
+			cycles = int(m.group(1))
+			continue
+		m = latload.match(line)
+		if m:
+			# schedpong -l; say which load each result had
+			thinkers = int(m.group(1))
+			continue
+		if bench == "sync":
+			m = sb_heading.match(line)
+			if m:
+				test = sb_names.get(m.group(1), m.group(1))
+				continue
+			m = sb_cpus.match(line)
+			if m and test is not None:
+				results.append({ "test": test,
+					"cpus": int(m.group(1)),
+					"cycles_per_op": int(m.group(2)) })
+				continue
+			m = sb_pair.match(line)
+			if m and test is not None:
+				results.append({ "test": test,
+					"placement": m.group(1),
+					"cycles_per_op": int(m.group(2)) })
+			continue
+
+		# name=value lines from the user-level benchmarks
+		words = line.split()
+		if len(words) < 2 or "=" in words[0]:
+			continue
+		fields = [w.split("=", 1) for w in words[1:]]
+		if [f for f in fields if len(f) != 2]:
+			continue
+		result = { "test": words[0] }
+		if thinkers is not None:
+			result["thinkers"] = thinkers
+		for (k, v) in fields:
+			n = number(v)
+			result[k] = v if n is None else n
+		results.append(result)
+	return (cycles, results)
+# end parse
+
+############################################################
+# running
+
+#
+# File-like object that collects the System/161 output.
+#
+class Capture:
+	def __init__(self, echo):
+		self.chunks = []
+		self.echo = echo
+	def write(self, s):
+		self.chunks.append(s)
+		if self.echo:
+			sys.stderr.write(s)
+	def flush(self):
+		if self.echo:
+			sys.stderr.flush()
+	def text(self):
+		return "".join(self.chunks)
+# end Capture
+
+def runone(kernel, cpus, ram, bench, commands):
+	out = Capture(g_verbose)
+	msg = runtest.run(commands, out,
+		conf=g_conf,
+		ram=ram,
+		cpus=cpus,
+		progress=None,
+		timeout=g_timeout,
+		kernel=kernel)
+	(cycles, results) = parse(bench, out.text())
+	return {
+		"kernel": kernel if kernel is not None else "kernel",
+		"cpus": cpus,
+		"ram": ram,
+		"bench": bench,
+		"error": msg,
+		"cycles": cycles,
+		"results": results,
+	}
+# end runone
+
+############################################################
+# output
+
+def csvquote(s):
+	s = str(s)
+	if re.search(r'[",\n]', s):
+		s = '"%s"' % s.replace('"', '""')
+	return s
+# end csvquote
+
+def writecsv(f, runs):
+	f.write("kernel,cpus,ram,bench,test,params,metric,value\n")
+	for run in runs:
+		head = [run["kernel"], run["cpus"], run["ram"], run["bench"]]
+		rows = []
+		if run["error"] is not None:
+			rows.append(["", "", "error", run["error"]])
+		if run["cycles"] is not None:
+			rows.append(["sys161", "", "cycles", run["cycles"]])
+		for result in run["results"]:
+			keys = sorted([k for k in result if k != "test"])
+			params = " ".join(["%s=%s" % (k, result[k])
+					   for k in keys
+					   if isinstance(result[k], str)])
+			for k in keys:
+				if not isinstance(result[k], str):
+					rows.append([result["test"], params,
+						     k, result[k]])
+		for row in rows:
+			f.write(",".join([csvquote(x) for x in head + row]))
+			f.write("\n")
+# end writecsv
+
+############################################################
+# global settings
+
+g_conf = None
+g_cpus = [1, 2, 4]
+g_kernels = [None]
+g_ram = ["4M", "8M"]
+g_timeout = 600
+g_format = "csv"
+g_output = None
+g_verbose = False
+
+############################################################
+# main
+
+def getargs():
+	global g_conf
+	global g_cpus
+	global g_kernels
+	global g_ram
+	global g_timeout
+	global g_format
+	global g_output
+	global g_verbose
+
+	p = OptionParser()
+	p.add_option("-c", "--conf", dest="conf")
+	p.add_option("-j", "--cpus", dest="cpus")
+	p.add_option("-k", "--kernel", dest="kernels", action="append")
+	p.add_option("-r", "--ram", dest="ram")
+	p.add_option("-t", "--timeout", dest="timeout")
+	p.add_option("-f", "--format", dest="format")
+	p.add_option("-o", "--output", dest="output")
+	p.add_option("-v", "--verbose", dest="verbose",
+		     action="store_true")
+
+	(options, args) = p.parse_args()
+	if options.conf is not None:
+		g_conf = options.conf
+	if options.cpus is not None:
+		g_cpus = [int(n) for n in options.cpus.split(",")]
+	if options.kernels is not None:
+		g_kernels = options.kernels
+	if options.ram is not None:
+		g_ram = options.ram.split(",")
+	if options.timeout is not None:
+		g_timeout = int(options.timeout)
+	if options.format is not None:
+		g_format = options.format
+	if options.output is not None:
+		g_output = options.output
+	if options.verbose:
+		g_verbose = True
+
+	if g_format not in ["csv", "json"]:
+		sys.stderr.write("bench.py: unknown format %s\n" % g_format)
+		exit(1)
+	known = [name for (name, commands) in benchmarks]
+	for arg in args:
+		if arg not in known:
+			sys.stderr.write("bench.py: unknown benchmark %s\n" %
+					 arg)
+			exit(1)
+	if len(args) == 0:
+		args = known
+	return args
+# end getargs
+
+which = getargs()
+runs = []
+for kernel in g_kernels:
+	for cpus in g_cpus:
+		for ram in g_ram:
+			for (bench, commands) in benchmarks:
+				if bench not in which:
+					continue
+				sys.stderr.write("bench.py: %s cpus=%d ram=%s %s\n"
+						 % (kernel or "kernel", cpus,
+						    ram, bench))
+				run = runone(kernel, cpus, ram, bench,
+					     commands)
+				if run["error"] is not None:
+					sys.stderr.write("bench.py: %s\n" %
+							 run["error"])
+				runs.append(run)
+
+if g_output is not None:
+	f = open(g_output, "w")
+else:
+	f = sys.stdout
+if g_format == "json":
+	json.dump(runs, f, indent=1, sort_keys=True)
+	f.write("\n")
+else:
+	writecsv(f, runs)
+if g_output is not None:
+	f.close()
+exit(0)
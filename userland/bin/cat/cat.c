@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <err.h>
@@ -38,12 +40,32 @@
 
 
 
-/* Print a file that's already been opened. */
+/*
+ * How much to copy at a time: a good many of the file's preferred I/O
+ * size, as fstat reports it, but at least CHUNK bytes.
+ */
+#define CHUNK 65536
+
+static
+size_t
+chunksize(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st)==0 && st.st_blksize > CHUNK/16) {
+		return st.st_blksize * 16;
+	}
+	return CHUNK;
+}
+
+/*
+ * Print a file that's already been opened by copying it through BUF,
+ * of LEN bytes.
+ */
 static
 void
-docat(const char *name, int fd)
+readwrite(const char *name, int fd, char *buf, size_t buflen)
 {
-	char buf[1024];
 	int len, wr, wrtot;
 
 	/*
@@ -52,7 +74,7 @@ docat(const char *name, int fd)
 	 * We may read less than we asked for, though, in various cases
 	 * for various reasons.
 	 */
-	while ((len = read(fd, buf, sizeof(buf)))>0) {
+	while ((len = read(fd, buf, buflen))>0) {
 		/*
 		 * Likewise, we may actually write less than we attempted
 		 * to. So loop until we're done.
@@ -74,6 +96,41 @@ docat(const char *name, int fd)
 	}
 }
 
+/* Print a file that's already been opened. */
+static
+void
+docat(const char *name, int fd)
+{
+	size_t chunk;
+	ssize_t len;
+	int copied = 0;
+	void *buf;
+
+	/*
+	 * Have the kernel copy it straight to stdout, a big piece at a
+	 * time. If it can't (reading and writing the same file, say)
+	 * it fails before copying anything; then copy it ourselves,
+	 * through a page-aligned buffer from mmap.
+	 */
+	chunk = chunksize(fd);
+	while ((len = sendfile(STDOUT_FILENO, fd, NULL, chunk)) > 0) {
+		copied = 1;
+	}
+	if (len==0) {
+		return;
+	}
+	if (copied) {
+		err(1, "%s", name);
+	}
+
+	buf = mmap(chunk, PROT_READ|PROT_WRITE, -1, 0);
+	if (buf == (void *)-1) {
+		err(1, "mmap");
+	}
+	readwrite(name, fd, buf, chunk);
+	munmap(buf);
+}
+
 /* Print a file by name. */
 static
 void
@@ -27,7 +27,10 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <errno.h>
 #include <err.h>
 
 /*
@@ -36,15 +39,61 @@
  */
 
 
-/* Copy one file to another. */
+/*
+ * How much to copy at a time: a good many of the source's preferred
+ * I/O size, as fstat reports it, but at least CHUNK bytes.
+ */
+#define CHUNK 65536
+
+/*
+ * Copy LEN bytes, or to EOF if LEN is negative, from FROMFD's current
+ * position to TOFD's. The kernel does the copying, a big piece at a
+ * time, so the data never comes up here. Zero means EOF. Less than
+ * zero means an error occurred, which could be on either side.
+ */
+static
+void
+copydata(int fromfd, int tofd, off_t len, size_t chunk,
+	 const char *from, const char *to)
+{
+	size_t amount;
+	ssize_t done;
+
+	while (len != 0) {
+		amount = chunk;
+		if (len > 0 && (off_t)amount > len) {
+			amount = len;
+		}
+		done = sendfile(tofd, fromfd, NULL, amount);
+		if (done < 0) {
+			err(1, "%s to %s", from, to);
+		}
+		if (done == 0) {
+			break;
+		}
+		if (len > 0) {
+			len -= done;
+		}
+	}
+}
+
+/*
+ * Copy one file to another. Only the stretches SEEK_DATA and
+ * SEEK_HOLE find with data in them are copied, each to the same
+ * place, so the holes in a sparse file stay holes; setting the size
+ * at the end makes any hole at the end too. Where holes can't be
+ * found, or the output can't seek, it all gets copied.
+ */
 static
 void
 copy(const char *from, const char *to)
 {
 	int fromfd;
 	int tofd;
-	char buf[1024];
-	int len, wr, wrtot;
+	struct stat st;
+	size_t chunk;
+	off_t pos, data, hole;
+	int seekable;
 
 	/*
 	 * Open the files, and give up if they won't open
@@ -58,31 +107,44 @@ copy(const char *from, const char *to)
 		err(1, "%s", to);
 	}
 
-	/*
-	 * As long as we get more than zero bytes, we haven't hit EOF.
-	 * Zero means EOF. Less than zero means an error occurred.
-	 * We may read less than we asked for, though, in various cases
-	 * for various reasons.
-	 */
-	while ((len = read(fromfd, buf, sizeof(buf)))>0) {
-		/*
-		 * Likewise, we may actually write less than we attempted
-		 * to. So loop until we're done.
-		 */
-		wrtot = 0;
-		while (wrtot < len) {
-			wr = write(tofd, buf+wrtot, len-wrtot);
-			if (wr<0) {
-				err(1, "%s", to);
+	if (fstat(fromfd, &st) < 0) {
+		err(1, "%s: fstat", from);
+	}
+	chunk = CHUNK;
+	if (st.st_blksize > CHUNK/16) {
+		chunk = st.st_blksize * 16;
+	}
+
+	/* Holes can only be skipped over where the output can seek */
+	seekable = lseek(tofd, 0, SEEK_CUR) >= 0;
+
+	pos = 0;
+	while (1) {
+		data = seekable ? lseek(fromfd, pos, SEEK_DATA) : -1;
+		if (data < 0 && seekable && errno == ENXIO) {
+			/* nothing but hole from here to the end */
+			if (ftruncate(tofd, st.st_size) < 0) {
+				err(1, "%s: ftruncate", to);
 			}
-			wrtot += wr;
+			break;
 		}
-	}
-	/*
-	 * If we got a read error, print it and exit.
-	 */
-	if (len<0) {
-		err(1, "%s", from);
+		if (data < 0) {
+			/* no holes to be found; copy whatever is left */
+			copydata(fromfd, tofd, -1, chunk, from, to);
+			break;
+		}
+		hole = lseek(fromfd, data, SEEK_HOLE);
+		if (hole < 0) {
+			err(1, "%s: lseek", from);
+		}
+		if (lseek(fromfd, data, SEEK_SET) < 0) {
+			err(1, "%s: lseek", from);
+		}
+		if (lseek(tofd, data, SEEK_SET) < 0) {
+			err(1, "%s: lseek", to);
+		}
+		copydata(fromfd, tofd, hole - data, chunk, from, to);
+		pos = hole;
 	}
 
 	if (close(fromfd) < 0) {
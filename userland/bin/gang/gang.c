@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * gang - run a parallel job as a gang.
+ * Usage: gang command [arg...]
+ *
+ * The command, and every process and thread it starts, are scheduled
+ * together: they're spread across the CPUs and get time slots in
+ * which they all run at once, so that ones waiting for each other at
+ * a barrier aren't left waiting for one that isn't running. Useful
+ * for psort and parallelvm.
+ */
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2 || argv[1][0] == '-') {
+		errx(1, "Usage: gang command [arg...]");
+	}
+
+	if (setgang(1) < 0) {
+		err(1, "setgang");
+	}
+
+	execvp(argv[1], argv + 1);
+	err(1, "%s", argv[1]);
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+/*
+ * iostat - print the disks' request counts and latencies, and the
+ * buffer cache's hits and misses.
+ * Usage: iostat [-z] [device...]
+ *
+ * With no devices, shows each of lhd0raw: through lhd7raw: that
+ * exists. With -z, zeroes the disks' counts after printing them.
+ */
+
+#define MAXDEFAULT 8
+
+/*
+ * Print one disk's counts; returns -1 if it can't be opened or
+ * doesn't keep any.
+ */
+static
+int
+showdisk(const char *name, int reset, int quiet)
+{
+	struct iostat is;
+	unsigned done, i;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		if (!quiet) {
+			warn("%s", name);
+		}
+		return -1;
+	}
+	if (ioctl(fd, DIOC_GETSTATS, &is) < 0) {
+		if (!quiet) {
+			warn("%s", name);
+		}
+		close(fd);
+		return -1;
+	}
+	if (reset && ioctl(fd, DIOC_RESETSTATS, NULL) < 0) {
+		warn("%s: reset", name);
+	}
+	close(fd);
+
+	done = is.is_reads + is.is_writes + is.is_errors;
+	printf("%s %u reads (%llu KB), %u writes (%llu KB), %u errors\n",
+	       name, is.is_reads, is.is_rbytes / 1024,
+	       is.is_writes, is.is_wbytes / 1024, is.is_errors);
+	printf("  queue depth %u, most %u; latency avg %llu us, max %u us\n",
+	       is.is_queued, is.is_maxqueued,
+	       done ? is.is_usecs / done : 0, is.is_maxusecs);
+	for (i=0; i<IOSTAT_NBUCKETS; i++) {
+		if (is.is_hist[i] == 0) {
+			continue;
+		}
+		if (i == IOSTAT_NBUCKETS - 1) {
+			printf("  >= %7u us %10u\n",
+			       1U << (i - 1 + IOSTAT_HISTSHIFT), is.is_hist[i]);
+		}
+		else {
+			printf("  <  %7u us %10u\n",
+			       1U << (i + IOSTAT_HISTSHIFT), is.is_hist[i]);
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bufstat bs;
+	char name[32];
+	int reset, i, shown;
+
+	reset = 0;
+	i = 1;
+	if (i < argc && !strcmp(argv[i], "-z")) {
+		reset = 1;
+		i++;
+	}
+	if (i < argc && argv[i][0] == '-') {
+		errx(1, "Usage: iostat [-z] [device...]");
+	}
+
+	if (i < argc) {
+		for (; i<argc; i++) {
+			showdisk(argv[i], reset, 0);
+		}
+	}
+	else {
+		shown = 0;
+		for (i=0; i<MAXDEFAULT; i++) {
+			snprintf(name, sizeof(name), "lhd%draw:", i);
+			if (showdisk(name, reset, 1) == 0) {
+				shown++;
+			}
+		}
+		if (shown == 0) {
+			warnx("No disks found");
+		}
+	}
+
+	if (bufstat(&bs) < 0) {
+		err(1, "bufstat");
+	}
+	printf("buffer cache: %u buffers, %u dirty; %u hits, %u misses, "
+	       "%u evictions\n", bs.bs_buffers, bs.bs_dirty, bs.bs_hits,
+	       bs.bs_misses, bs.bs_evictions);
+	printf("  %u writebacks of %u blocks, %u by the flusher\n",
+	       bs.bs_writes, bs.bs_blockswritten, bs.bs_flushes);
+	printf("  %u blocks read ahead, %u used, %u requests dropped; "
+	       "%u buffers given up for memory\n", bs.bs_raread,
+	       bs.bs_rahits, bs.bs_radropped, bs.bs_shrunk);
+	return 0;
+}
@@ -92,17 +92,10 @@ int
 isdir(const char *path)
 {
 	struct stat buf;
-	int fd;
 
-	/* Assume stat() may not be implemented; use fstat */
-	fd = open(path, O_RDONLY);
-	if (fd<0) {
+	if (stat(path, &buf)<0) {
 		err(1, "%s", path);
 	}
-	if (fstat(fd, &buf)<0) {
-		err(1, "%s: fstat", path);
-	}
-	close(fd);
 
 	return S_ISDIR(buf.st_mode);
 }
@@ -127,28 +120,24 @@ printheader(const char *file)
 }
 
 /*
- * Show a single file.
+ * Show a single file, using STATP for it if not NULL.
  * We don't do the neat multicolumn listing that Unix ls does.
  */
 static
 void
-print(const char *path)
+print(const char *path, const struct stat *statp)
 {
 	struct stat statbuf;
 	const char *file;
 	int typech;
 
-	if (lopt || sopt) {
-		int fd;
-
-		fd = open(path, O_RDONLY);
-		if (fd<0) {
+	if (statp != NULL) {
+		statbuf = *statp;
+	}
+	else if (lopt || sopt) {
+		if (stat(path, &statbuf)<0) {
 			err(1, "%s", path);
 		}
-		if (fstat(fd, &statbuf)<0) {
-			err(1, "%s: fstat", path);
-		}
-		close(fd);
 	}
 
 	file = basename(path);
@@ -185,6 +174,23 @@ print(const char *path)
 	printf("%s\n", file);
 }
 
+/*
+ * Directory records are read this many bytes at a time, into a buffer
+ * of off_t so they come out aligned.
+ */
+#define DIRBUFSIZE 4096
+
+/*
+ * Check a directory record is one ls wants: everything with -a, else
+ * not names beginning with a dot.
+ */
+static
+int
+wanted(const struct dirent *d)
+{
+	return aopt || d->d_name[0]!='.';
+}
+
 /*
  * List a directory.
  */
@@ -193,9 +199,11 @@ void
 listdir(const char *path, int showheader)
 {
 	int fd;
-	char buf[1024];
+	off_t buf[DIRBUFSIZE / sizeof(off_t)];
 	char newpath[1024];
-	ssize_t len;
+	struct stat statbuf;
+	struct dirent *d;
+	ssize_t len, pos;
 
 	if (showheader) {
 		printheader(path);
@@ -210,21 +218,39 @@ listdir(const char *path, int showheader)
 	}
 
 	/*
-	 * List the directory.
+	 * List the directory, a bufferful of names at a time. Each
+	 * comes with what fstat would say about it, unless it has
+	 * gone away since (st_mode 0), in which case print finds out.
 	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
+	while ((len = getdirentries(fd, buf, sizeof(buf), NULL)) > 0) {
+		for (pos = 0; pos < len; pos += d->d_reclen) {
+			d = (struct dirent *)((char *)buf + pos);
+
+			/* Assemble the full name of the new item */
+			snprintf(newpath, sizeof(newpath), "%s/%s",
+				 path, d->d_name);
+
+			if (!wanted(d)) {
+				continue;
+			}
+			if (d->d_mode == 0) {
+				print(newpath, NULL);
+				continue;
+			}
 
-		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
+			memset(&statbuf, 0, sizeof(statbuf));
+			statbuf.st_size = d->d_size;
+			statbuf.st_mode = d->d_mode;
+			statbuf.st_nlink = d->d_nlink;
+			statbuf.st_blocks = d->d_blocks;
+			statbuf.st_ino = d->d_ino;
 
-		if (aopt || buf[0]!='.') {
 			/* Print it */
-			print(newpath);
+			print(newpath, &statbuf);
 		}
 	}
 	if (len<0) {
-		err(1, "%s: getdirentry", path);
+		err(1, "%s: getdirentries", path);
 	}
 
 	/* Done */
@@ -236,9 +262,10 @@ void
 recursedir(const char *path)
 {
 	int fd;
-	char buf[1024];
+	off_t buf[DIRBUFSIZE / sizeof(off_t)];
 	char newpath[1024];
-	int len;
+	struct dirent *d;
+	ssize_t len, pos;
 
 	/*
 	 * Open it.
@@ -251,29 +278,34 @@ recursedir(const char *path)
 	/*
 	 * List the directory.
 	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
+	while ((len = getdirentries(fd, buf, sizeof(buf), NULL)) > 0) {
+		for (pos = 0; pos < len; pos += d->d_reclen) {
+			d = (struct dirent *)((char *)buf + pos);
 
-		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
+			/* Assemble the full name of the new item */
+			snprintf(newpath, sizeof(newpath), "%s/%s",
+				 path, d->d_name);
 
-		if (!aopt && buf[0]=='.') {
-			/* skip this one */
-			continue;
-		}
+			if (!wanted(d)) {
+				/* skip this one */
+				continue;
+			}
 
-		if (!strcmp(buf, ".") || !strcmp(buf, "..")) {
-			/* always skip these */
-			continue;
-		}
+			if (!strcmp(d->d_name, ".") ||
+			    !strcmp(d->d_name, "..")) {
+				/* always skip these */
+				continue;
+			}
 
-		if (!isdir(newpath)) {
-			continue;
-		}
+			if (d->d_mode == 0 ? !isdir(newpath)
+			    : !S_ISDIR(d->d_mode)) {
+				continue;
+			}
 
-		listdir(newpath, 1 /*showheader*/);
-		if (Ropt) {
-			recursedir(newpath);
+			listdir(newpath, 1 /*showheader*/);
+			if (Ropt) {
+				recursedir(newpath);
+			}
 		}
 	}
 	if (len<0) {
@@ -294,7 +326,7 @@ listitem(const char *path, int showheader)
 		}
 	}
 	else {
-		print(path);
+		print(path, NULL);
 	}
 }
 
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+/*
+ * nice - run a command at a different priority.
+ * Usage: nice [-n increment | -f] command [arg...]
+ *
+ * Adds INCREMENT (default 10) to the nice value the command starts
+ * with, so "nice hog" runs hog behind the interactive programs. With
+ * -f, runs it in the real-time class (SCHED_FIFO) instead, ahead of
+ * everything else; use with care, since it doesn't give up the CPU
+ * until it waits for something.
+ */
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: nice [-n increment | -f] command [arg...]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int incr, fifo, prio, i;
+
+	incr = 10;
+	fifo = 0;
+	i = 1;
+	if (i < argc && !strcmp(argv[i], "-n")) {
+		if (i + 1 >= argc) {
+			usage();
+		}
+		incr = atoi(argv[i + 1]);
+		i += 2;
+	}
+	else if (i < argc && !strcmp(argv[i], "-f")) {
+		fifo = 1;
+		i++;
+	}
+	if (i >= argc || argv[i][0] == '-') {
+		usage();
+	}
+
+	if (fifo) {
+		if (sched_setscheduler(0, SCHED_FIFO) < 0) {
+			err(1, "sched_setscheduler");
+		}
+	}
+	else {
+		errno = 0;
+		prio = getpriority(PRIO_PROCESS, 0);
+		if (prio == -1 && errno != 0) {
+			err(1, "getpriority");
+		}
+		if (setpriority(PRIO_PROCESS, 0, prio + incr) < 0) {
+			err(1, "setpriority");
+		}
+	}
+
+	execvp(argv[i], argv + i);
+	err(1, "%s", argv[i]);
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * ps - list the processes that exist.
+ * Usage: ps
+ *
+ * For each process prints its pid, its parent's, its state (see
+ * kern/procstat.h), how many threads it has, how many pages it has
+ * resident and files open, its time running and waiting to run, and
+ * its name.
+ */
+
+int
+main(int argc, char *argv[])
+{
+	static const char states[] = PS_STATECHARS;
+	struct procstat *procs;
+	size_t max;
+	int num, i;
+
+	(void)argv;
+	if (argc != 1) {
+		errx(1, "Usage: ps");
+	}
+
+	/* The table may grow while we look; ask until it fits */
+	max = 16;
+	while (1) {
+		procs = malloc(max * sizeof(*procs));
+		if (procs == NULL) {
+			err(1, "malloc");
+		}
+		num = procstat(procs, max);
+		if (num < 0) {
+			err(1, "procstat");
+		}
+		if ((size_t)num <= max) {
+			break;
+		}
+		free(procs);
+		max = num + 16;
+	}
+
+	printf("  PID  PPID S THR PAGES    WS FDS       TIME       WAIT NAME\n");
+	for (i=0; i<num; i++) {
+		printf("%5d %5d %c %3u %5u %5u %3u %6ld.%03ld %6ld.%03ld %s\n",
+		       procs[i].ps_pid, procs[i].ps_ppid,
+		       states[procs[i].ps_state], procs[i].ps_nthreads,
+		       procs[i].ps_respages, procs[i].ps_wspages,
+		       procs[i].ps_nfiles,
+		       (long)procs[i].ps_runtime.tv_sec,
+		       (long)procs[i].ps_runtime.tv_usec / 1000,
+		       (long)procs[i].ps_waittime.tv_sec,
+		       (long)procs[i].ps_waittime.tv_usec / 1000,
+		       procs[i].ps_name);
+	}
+	free(procs);
+	return 0;
+}
@@ -36,6 +36,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <assert.h>
 #include <unistd.h>
@@ -111,6 +112,178 @@ remember_bg(pid_t pid)
 	assert(0);
 }
 
+/*
+ * Where commands found on the search path were found, so that each is
+ * only looked for once rather than tried in every directory every time
+ * it's run. "hash -r" forgets them all, for when a program has been
+ * added or moved; one that has gone away is looked for again anyway.
+ * Names with a slash in them aren't looked for and so aren't kept.
+ */
+#define NHASH 64
+
+struct hashent {
+	struct hashent *next;
+	unsigned hits;
+	char *path;
+	char name[];		/* followed by the path */
+};
+
+static struct hashent *hashtab[NHASH];
+
+static
+unsigned
+hashname(const char *name)
+{
+	unsigned h = 0;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % NHASH;
+}
+
+/*
+ * pathfind
+ * finds NAME on the search path, as execvp would: the first directory
+ * with a regular file of that name in it. Puts the whole path in PATH
+ * and returns 0, or returns -1 if there isn't one.
+ */
+static
+int
+pathfind(const char *name, char *path, size_t pathlen)
+{
+	const char *searchpath, *s, *t;
+	struct stat st;
+	size_t len;
+
+	searchpath = getenv("PATH");
+	if (searchpath == NULL) {
+		return -1;
+	}
+
+	for (s = searchpath; s != NULL; s = t) {
+		t = strchr(s, ':');
+		if (t != NULL) {
+			len = t - s;
+			t++;
+		}
+		else {
+			len = strlen(s);
+		}
+		if (len == 0 || len >= pathlen) {
+			continue;
+		}
+		memcpy(path, s, len);
+		snprintf(path + len, pathlen - len, "/%s", name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * hash_lookup
+ * returns where NAME is on the search path, looking for it only if it
+ * hasn't been found before; NULL if it isn't anywhere.
+ */
+static
+const char *
+hash_lookup(const char *name)
+{
+	static char unhashed[PATH_MAX];
+	char path[PATH_MAX];
+	struct hashent *he;
+	unsigned h;
+	size_t namelen;
+
+	h = hashname(name);
+	for (he = hashtab[h]; he != NULL; he = he->next) {
+		if (!strcmp(he->name, name)) {
+			he->hits++;
+			return he->path;
+		}
+	}
+
+	if (pathfind(name, path, sizeof(path)) < 0) {
+		return NULL;
+	}
+
+	namelen = strlen(name);
+	he = malloc(sizeof(*he) + namelen + 1 + strlen(path) + 1);
+	if (he == NULL) {
+		/* can't remember it, so it'll be looked for next time */
+		strcpy(unhashed, path);
+		return unhashed;
+	}
+	he->hits = 1;
+	strcpy(he->name, name);
+	he->path = he->name + namelen + 1;
+	strcpy(he->path, path);
+	he->next = hashtab[h];
+	hashtab[h] = he;
+	return he->path;
+}
+
+/*
+ * hash_forget
+ * drops what's known about where NAME is, or everything if NAME is NULL.
+ */
+static
+void
+hash_forget(const char *name)
+{
+	struct hashent *he, **hep;
+	unsigned i;
+
+	for (i = 0; i < NHASH; i++) {
+		hep = &hashtab[i];
+		while ((he = *hep) != NULL) {
+			if (name == NULL || !strcmp(he->name, name)) {
+				*hep = he->next;
+				free(he);
+			}
+			else {
+				hep = &he->next;
+			}
+		}
+	}
+}
+
+/*
+ * spawncmd
+ * starts ARGS[0] like spawnvp, but finds it with hash_lookup. If it
+ * isn't where it was, it's looked for again.
+ */
+static
+pid_t
+spawncmd(char **args)
+{
+	const char *path;
+	pid_t pid;
+
+	if (strchr(args[0], '/') != NULL) {
+		return spawnv(args[0], args);
+	}
+
+	path = hash_lookup(args[0]);
+	if (path == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	pid = spawnv(path, args);
+	if (pid < 0 && (errno == ENOENT || errno == ENOTDIR)) {
+		hash_forget(args[0]);
+		path = hash_lookup(args[0]);
+		if (path == NULL) {
+			errno = ENOENT;
+			return -1;
+		}
+		pid = spawnv(path, args);
+	}
+	return pid;
+}
+
 /*
  * constructor for exitinfo
  */
@@ -340,6 +513,36 @@ cmd_exit(int ac, char *av[], struct exitinfo *ei)
 	exit(code);
 }
 
+/*
+ * hash
+ * lists the commands whose places are known, and how often they've been
+ * run; with -r, forgets them.
+ */
+static
+void
+cmd_hash(int ac, char *av[], struct exitinfo *ei)
+{
+	struct hashent *he;
+	unsigned i;
+
+	if (ac == 1) {
+		for (i = 0; i < NHASH; i++) {
+			for (he = hashtab[i]; he != NULL; he = he->next) {
+				printf("%6u %s\n", he->hits, he->path);
+			}
+		}
+		exitinfo_exit(ei, 0);
+		return;
+	}
+	if (ac == 2 && !strcmp(av[1], "-r")) {
+		hash_forget(NULL);
+		exitinfo_exit(ei, 0);
+		return;
+	}
+	printf("Usage: hash [-r]\n");
+	exitinfo_exit(ei, 1);
+}
+
 /*
  * a struct of the builtins associates the builtin name with the function that
  * executes it.  they must all take an argc and argv.
@@ -351,6 +554,7 @@ static struct {
 	{ "cd",    cmd_chdir },
 	{ "chdir", cmd_chdir },
 	{ "exit",  cmd_exit },
+	{ "hash",  cmd_hash },
 	{ "wait",  cmd_wait },
 	{ NULL, NULL }
 };
@@ -421,30 +625,20 @@ docommand(char *buf, struct exitinfo *ei)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
-	switch (pid) {
-		case -1:
-			/* error */
-			warn("fork");
-			exitinfo_exit(ei, 255);
-			return;
-		case 0:
-			/* child */
-			execvp(args[0], args);
-			warn("%s", args[0]);
-			/*
-			 * Use _exit() instead of exit() in the child
-			 * process to avoid calling atexit() functions,
-			 * which would cause hostcompat (if present) to
-			 * reset the tty state and mess up our input
-			 * handling.
-			 */
-			_exit(1);
-		default:
-			break;
-	}
-
-	/* parent */
+	/*
+	 * Start the child with spawnv rather than fork and execvp, so
+	 * our whole address space isn't copied just to be thrown away,
+	 * at the place on the search path it was found last time.
+	 * A program that can't be run is reported here, as a failed
+	 * exec in the child would be: a message and exit status 1.
+	 */
+	pid = spawncmd(args);
+	if (pid < 0) {
+		warn("%s", args[0]);
+		exitinfo_exit(ei, 1);
+		return;
+	}
+
 	if (bg) {
 		/* background this command */
 		remember_bg(pid);
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <kern/syscall.h>
+
+/*
+ * sysstat - print the kernel's per-system-call counts and times.
+ * Usage: sysstat [cpu]
+ *
+ * With no argument, prints the totals over all CPUs. Only calls that
+ * have been made are shown.
+ */
+
+int
+main(int argc, char *argv[])
+{
+	static const char *const names[SYSSTAT_NCALLS] = SYSSTAT_NAMES;
+	static struct sysstat stats[SYSSTAT_NCALLS];
+	int cpu, i;
+
+	if (argc == 1) {
+		cpu = -1;
+	}
+	else if (argc == 2) {
+		cpu = atoi(argv[1]);
+	}
+	else {
+		errx(1, "Usage: sysstat [cpu]");
+	}
+
+	if (sysstat(cpu, stats) < 0) {
+		err(1, "sysstat");
+	}
+
+	printf("%-14s %10s %8s %12s %10s %10s\n", "call", "calls",
+	       "errors", "total us", "avg us", "max us");
+	for (i=0; i<SYSSTAT_NCALLS; i++) {
+		if (stats[i].ss_calls == 0) {
+			continue;
+		}
+		if (names[i] != NULL) {
+			printf("%-14s", names[i]);
+		}
+		else {
+			printf("#%-13d", i);
+		}
+		printf(" %10u %8u %12llu %10llu %10u\n",
+		       stats[i].ss_calls, stats[i].ss_errors,
+		       stats[i].ss_usecs,
+		       stats[i].ss_usecs / stats[i].ss_calls,
+		       stats[i].ss_maxusecs);
+	}
+	return 0;
+}
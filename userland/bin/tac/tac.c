@@ -31,10 +31,14 @@
  * tac - print file backwards line by line (reverse cat)
  * usage: tac [files]
  *
- * This implementation copies the input to a scratch file, using a
- * second scratch file to keep notes, and then prints the scratch file
- * backwards. This is inefficient, but has the side effect of testing
- * the behavior of scratch files that have been unlinked.
+ * Given one file that can seek, tac reads it backwards from the end
+ * in large blocks with pread and prints each line as it's found.
+ *
+ * Otherwise this implementation copies the input to a scratch file,
+ * using a second scratch file to keep notes, and then prints the
+ * scratch file backwards. This is inefficient, but has the side
+ * effect of testing the behavior of scratch files that have been
+ * unlinked.
  *
  * Note that if the remove system call isn't implemented, unlinking
  * the scratch files will fail and the scratch files will get left
@@ -42,7 +46,7 @@
  * complain about this.
  *
  * This program uses these system calls:
- *    getpid open read write lseek close remove _exit
+ *    getpid open read pread write lseek close remove _exit
  */
 
 #include <stdio.h>
@@ -62,26 +66,7 @@ static int datafd = -1, indexfd = -1;
 static char dataname[64], indexname[64];
 
 static char buf[4096];
-
-////////////////////////////////////////////////////////////
-// string ops
-
-/* this is standard and should go into libc */
-static
-void *
-memchr(const void *buf, int ch, size_t buflen)
-{
-	const unsigned char *ubuf = buf;
-	size_t i;
-
-	for (i=0; i<buflen; i++) {
-		if (ubuf[i] == ch) {
-			/* this must launder const */
-			return (void *)(ubuf + i);
-		}
-	}
-	return NULL;
-}
+static char backbuf[65536];
 
 ////////////////////////////////////////////////////////////
 // syscall wrappers
@@ -224,6 +209,99 @@ dumpdata(void)
 	}
 }
 
+////////////////////////////////////////////////////////////
+// backwards
+
+/*
+ * Print bytes START to END of the file, which are in backbuf from
+ * START up to BUFEND, and after that in the file.
+ */
+static
+void
+printrange(int fd, const char *name, off_t start, off_t end, off_t bufpos,
+	   off_t bufend)
+{
+	off_t pos;
+	size_t amount;
+	ssize_t len;
+
+	pos = end < bufend ? end : bufend;
+	dowrite(STDOUT_FILENO, "stdout", backbuf + (start - bufpos),
+		pos - start);
+	for (; pos < end; pos += amount) {
+		amount = sizeof(buf);
+		if ((off_t)amount > end - pos) {
+			amount = end - pos;
+		}
+		len = pread(fd, buf, amount, pos);
+		if (len < 0) {
+			err(1, "%s: pread", name);
+		}
+		if ((size_t)len != amount) {
+			errx(1, "%s: pread: Unexpected short count"
+			     " %zd of %zu", name, len, amount);
+		}
+		dowrite(STDOUT_FILENO, "stdout", buf, amount);
+	}
+}
+
+/*
+ * Print the file backwards by reading it backwards. Returns nonzero
+ * if it can't seek, in which case nothing has been printed.
+ *
+ * The lines are the same as readfile's: each runs up to and includes
+ * a newline, and anything after the last newline is one more.
+ */
+static
+int
+tacfile(const char *name)
+{
+	int fd;
+	off_t size, bufpos, bufend, end;
+	size_t len;
+	ssize_t r, i;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		close(fd);
+		return -1;
+	}
+
+	/* END is where the lines not printed yet stop */
+	end = size;
+	for (bufend = size; bufend > 0; bufend = bufpos) {
+		len = bufend < (off_t)sizeof(backbuf) ?
+			(size_t)bufend : sizeof(backbuf);
+		bufpos = bufend - len;
+		r = pread(fd, backbuf, len, bufpos);
+		if (r < 0) {
+			err(1, "%s: pread", name);
+		}
+		if ((size_t)r != len) {
+			errx(1, "%s: pread: Unexpected short count"
+			     " %zd of %zu", name, r, len);
+		}
+		for (i = len - 1; i >= 0; i--) {
+			if (backbuf[i] == '\n' && bufpos + i + 1 < end) {
+				printrange(fd, name, bufpos + i + 1, end,
+					   bufpos, bufend);
+				end = bufpos + i + 1;
+			}
+		}
+	}
+	if (end > 0) {
+		/* bufpos is now 0 */
+		printrange(fd, name, 0, end, 0, len);
+	}
+
+	close(fd);
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 // main
 
@@ -274,6 +352,10 @@ main(int argc, char *argv[])
 {
 	int i;
 
+	if (argc == 2 && strcmp(argv[1], "-") && tacfile(argv[1]) == 0) {
+		return 0;
+	}
+
 	openfiles();
 
 	if (argc > 1) {
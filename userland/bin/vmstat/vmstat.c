@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * vmstat - print the kernel's virtual memory event counters.
+ * Usage: vmstat [cpu]
+ *
+ * With no argument, prints the totals over all CPUs.
+ */
+
+int
+main(int argc, char *argv[])
+{
+	static const char *const names[VMSTAT_NCOUNTERS] = VMSTAT_NAMES;
+	struct vmstat stats;
+	int cpu, i;
+
+	if (argc == 1) {
+		cpu = -1;
+	}
+	else if (argc == 2) {
+		cpu = atoi(argv[1]);
+	}
+	else {
+		errx(1, "Usage: vmstat [cpu]");
+	}
+
+	if (vmstat(cpu, &stats) < 0) {
+		err(1, "vmstat");
+	}
+
+	for (i=0; i<VMSTAT_NCOUNTERS; i++) {
+		printf("%-18s %10u\n", names[i], stats.vs_count[i]);
+	}
+	return 0;
+}
@@ -41,6 +41,54 @@
 /* Constant returned by a bunch of stdio functions on error */
 #define EOF (-1)
 
+/*
+ * Output streams. Output is collected in the stream's buffer and
+ * written out when the buffer fills, at each newline with line
+ * buffering, when fflush is called, and at exit (but not _exit) or
+ * fork. stdout is line buffered if it's the console and fully
+ * buffered otherwise; stderr is unbuffered. Input (getchar) is not
+ * buffered, but flushes stdout first so prompts appear.
+ *
+ * Streams are not locked, so threads (threadfork) sharing one must
+ * take turns.
+ */
+#define _IOFBF 0	/* full buffering */
+#define _IOLBF 1	/* line buffering */
+#define _IONBF 2	/* no buffering */
+
+#define BUFSIZ 1024
+
+typedef struct __file {
+	int f_fd;
+	int f_mode;		/* one of the above; -1 until first used */
+	int f_error;		/* a write has failed */
+	char *f_buf;
+	size_t f_size;		/* of f_buf */
+	size_t f_len;		/* bytes waiting in f_buf */
+} FILE;
+
+extern FILE *stdout;
+extern FILE *stderr;
+
+/* Flush a stream, or every stream if NULL. Returns 0 or EOF. */
+int fflush(FILE *f);
+
+/* Set a stream's buffering; BUF of SIZE bytes, or the default if NULL. */
+int setvbuf(FILE *f, char *buf, int mode, size_t size);
+
+/* Write to a stream. */
+size_t fwrite(const void *ptr, size_t size, size_t nitems, FILE *f);
+int fputc(int ch, FILE *f);
+int fputs(const char *s, FILE *f);
+int fprintf(FILE *f, const char *fmt, ...);
+int vfprintf(FILE *f, const char *fmt, __va_list ap);
+
+/*
+ * Write LEN bytes to a stream, buffering as appropriate. Returns 0,
+ * or -1 with errno set. (for libc internal use only)
+ */
+int __stdio_write(FILE *f, const char *data, size_t len);
+
 /*
  * The actual guts of printf
  * (for libc internal use only)
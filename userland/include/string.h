@@ -50,6 +50,7 @@ void *memset(void *, int c, size_t);
 void *memcpy(void *, const void *, size_t);
 void *memmove(void *, const void *, size_t);
 int memcmp(const void *, const void *, size_t);
+void *memchr(const void *, int, size_t);
 
 /*
  * POSIX string functions.
@@ -38,12 +38,23 @@
  * kernel includes. This way user-level code doesn't need to know
  * about the kern/ headers.
  */
+#include <kern/dirent.h>
 #include <kern/fcntl.h>
+#include <kern/futex.h>
+#include <kern/iovec.h>
 #include <kern/ioctl.h>
+#include <kern/iostat.h>
+#include <kern/mman.h>
+#include <kern/mqueue.h>
+#include <kern/poll.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
+#include <kern/sysstat.h>
 #include <kern/time.h>
+#include <kern/resource.h>  /* uses struct timeval */
+#include <kern/procstat.h>  /* likewise */
 #include <kern/unistd.h>
+#include <kern/vmstat.h>
 #include <kern/wait.h>
 
 
@@ -111,7 +122,7 @@
 /* Required. */
 __DEAD void _exit(int code);
 int execv(const char *prog, char *const *args);
-pid_t fork(void);
+pid_t fork(void);			/* calls __fork */
 pid_t waitpid(pid_t pid, int *returncode, int flags);
 /*
  * Open actually takes either two or three args: the optional third
@@ -128,11 +139,12 @@ int sync(void);
 int rmdir(const char *dirname);
 
 /* Recommended. */
-pid_t getpid(void);
+pid_t getpid(void);			/* see kern/kinfo.h */
 int ioctl(int filehandle, int code, void *buf);
 off_t lseek(int filehandle, off_t pos, int code);
 int fsync(int filehandle);
 int ftruncate(int filehandle, off_t size);
+int fallocate(int filehandle, off_t pos, off_t len);
 int remove(const char *filename);
 int rename(const char *oldfile, const char *newfile);
 int link(const char *oldfile, const char *newfile);
@@ -142,12 +154,75 @@ int chdir(const char *path);
 /* Optional. */
 void *sbrk(__intptr_t change);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
+/*
+ * Fill BUF with records for as many names in directory FILEHANDLE as
+ * fit, carrying on from *COOKIE (0 to start), which is updated, or
+ * from the seek position if COOKIE is NULL. Returns the bytes filled,
+ * or 0 at the end; see kern/dirent.h.
+ */
+ssize_t getdirentries(int filehandle, void *buf, size_t buflen,
+		      off_t *cookie);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+/*
+ * Sleep for the time in *REQ; *REM, if not NULL, gets the time that
+ * was left, which in OS/161 is always none.
+ */
+int nanosleep(const struct timespec *req, struct timespec *rem);
 ssize_t __getcwd(char *buf, size_t buflen);
+ssize_t pread(int filehandle, void *buf, size_t size, off_t pos);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+ssize_t readv(int filehandle, const struct iovec *iov, int iovcnt);
+ssize_t writev(int filehandle, const struct iovec *iov, int iovcnt);
+ssize_t preadv(int filehandle, const struct iovec *iov, int iovcnt,
+	       off_t pos);
+ssize_t pwritev(int filehandle, const struct iovec *iov, int iovcnt,
+		off_t pos);
+/*
+ * Copy up to COUNT bytes from INFD to OUTFD inside the kernel. INFD is
+ * read at *OFFSET, which is updated, or at its seek position if OFFSET
+ * is NULL.
+ */
+ssize_t sendfile(int outfd, int infd, off_t *offset, size_t count);
+
+/*
+ * Wait until one of the NFDS file handles in FDS is ready for its
+ * events, or TIMEOUT milliseconds pass (forever if negative; not at
+ * all if 0). Returns how many are ready; see kern/poll.h.
+ */
+int poll(struct pollfd *fds, unsigned nfds, int timeout);
+
+/*
+ * P and V on a semaphore (a file on sem:) open on FD: the same as
+ * reading and writing COUNT bytes of it, only quicker.
+ */
+int semwait(int fd, unsigned count);
+int sempost(int fd, unsigned count);
+
+/*
+ * Message queues: mq_create makes a queue of up to MAXMSGS messages of
+ * up to MSGSIZE bytes each and returns a file handle for it, which
+ * children inherit. mq_send and mq_receive move one whole message;
+ * with MQ_NONBLOCK they fail with EAGAIN rather than wait for a slot
+ * or a message. read and write on the handle do the same, waiting.
+ * See kern/mqueue.h.
+ */
+int mq_create(size_t msgsize, unsigned maxmsgs);
+int mq_send(int fd, const void *buf, size_t len, int flags);
+ssize_t mq_receive(int fd, void *buf, size_t len, int flags);
+
+/*
+ * vfork: like fork, but the child borrows this process's memory, and
+ * the parent waits until the child calls execv or _exit, which is all
+ * the child should do; it fails with EINVAL if this process has other
+ * threads (see threadfork). spawnv: run PROG with ARGS in a new child
+ * process, as fork and then execv would, without copying this one.
+ */
+pid_t vfork(void);
+pid_t spawnv(const char *prog, char *const *args);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -156,18 +231,118 @@ ssize_t __getcwd(char *buf, size_t buflen);
  */
 
 int execvp(const char *prog, char *const *args); /* calls execv */
+pid_t spawnvp(const char *prog, char *const *args); /* calls spawnv */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
-time_t time(time_t *seconds);			/* calls __time */
+time_t time(time_t *seconds);			/* see kern/kinfo.h */
 
 /* UNSW versions of mmap() and munmap()
  * This are simplified compared to the standard version on UNIX
  * You should implement this version as this is what we expect to test.
  */
 
-#define PROT_READ 1
-#define PROT_WRITE 2
-
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
 
+/*
+ * Named shared-memory objects: files in the in-memory shm: volume,
+ * opened with open() flags, to be sized with ftruncate and mapped with
+ * mmap. NAME may have a leading slash but no others. For memory shared
+ * only with children, mmap with fd -1 and MAP_SHARED is simpler.
+ */
+int shm_open(const char *name, int flags, mode_t mode);	/* calls open */
+int shm_unlink(const char *name);			/* calls remove */
+
+/*
+ * Change the permissions (PROT_*, see kern/mman.h) of the whole pages
+ * from page-aligned ADDR on, all of which must be mapped.
+ */
+int mprotect(void *addr, size_t len, int prot);
+
+/*
+ * Memory hints, for whole pages from page-aligned ADDR on: how they
+ * will be used (MADV_*, see kern/mman.h); which are in memory, a byte
+ * per page in VEC; and pinning them in memory or letting them go.
+ */
+int madvise(void *addr, size_t len, int advice);
+int mincore(void *addr, size_t len, unsigned char *vec);
+int mlock(const void *addr, size_t len);
+int munlock(const void *addr, size_t len);
+
+/* VM event counters for one CPU, or all of them with CPU -1; see kern/vmstat.h */
+int vmstat(int cpu, struct vmstat *buf);
+
+/*
+ * System call statistics, SYSSTAT_NCALLS of them, for one CPU or all
+ * of them with CPU -1; see kern/sysstat.h.
+ */
+int sysstat(int cpu, struct sysstat *buf);
+
+/*
+ * Buffer cache counts; see kern/iostat.h. (Each disk's own counts
+ * come from ioctl DIOC_GETSTATS on its device.)
+ */
+int bufstat(struct bufstat *buf);
+
+/*
+ * Run the calling thread only on the CPUs whose numbers are the bits
+ * set in MASK. The previous mask goes in *OLDMASK unless it's NULL.
+ */
+int setaffinity(unsigned mask, unsigned *oldmask);
+
+/* CPU time and context switches of this process, or (RUSAGE_CHILDREN)
+ * of the children it has waited for; see kern/resource.h */
+int getrusage(int who, struct rusage *usage);
+
+/* Limits on the resources of this process; see kern/resource.h */
+int getrlimit(int resource, struct rlimit *rlp);
+int setrlimit(int resource, const struct rlimit *rlp);
+
+/*
+ * Nice value (PRIO_MIN to PRIO_MAX) and scheduling class (SCHED_OTHER
+ * or SCHED_FIFO) of the calling thread; see kern/resource.h. WHICH
+ * must be PRIO_PROCESS, and WHO or PID 0 or the caller's own pid.
+ * Forked processes and threads inherit both. (getpriority can return
+ * -1 legitimately; clear errno first to tell.)
+ */
+int getpriority(int which, int who);
+int setpriority(int which, int who, int prio);
+int sched_setscheduler(pid_t pid, int policy);
+int sched_getscheduler(pid_t pid);
+
+/*
+ * Start a new gang (ON nonzero) with the calling thread in it, or
+ * leave the one it is in. Threads and processes it forks afterwards
+ * join the gang, and the gang's members are scheduled to run at the
+ * same time on different CPUs, for parallel jobs that synchronize
+ * often.
+ */
+int setgang(int on);
+
+/*
+ * Describe up to MAX processes in BUF, and return how many there are
+ * (which may be more); see kern/procstat.h.
+ */
+int procstat(struct procstat *buf, size_t max);
+
+/*
+ * Start a new thread in this process, sharing its memory and open
+ * files, running FUNC on a stack of its own. The thread exits when
+ * FUNC returns; the process exits when its last thread does.
+ */
+int threadfork(void (*func)(void));	/* calls __threadfork */
+int __threadfork(void (*entry)(void *), void *arg);
+
+/* The fork system call itself, without flushing stdio first */
+pid_t __fork(void);
+
+/* The getpid system call, which getpid itself doesn't need to make */
+pid_t __getpid(void);
+
+/*
+ * Wait on, or wake threads waiting on, the word at ADDR, for building
+ * locks that only enter the kernel when they must; see kern/futex.h.
+ * FUTEX_WAKE returns how many it woke.
+ */
+int futex(volatile int *addr, int op, int val, int timeout);
+
 #endif /* _UNISTD_H_ */
@@ -36,6 +36,10 @@
  * printf - C standard I/O function.
  */
 
+struct __printf_data {
+	FILE *f;
+	int err;
+};
 
 /*
  * Function passed to __vprintf to do the actual output.
@@ -44,14 +48,14 @@ static
 void
 __printf_send(void *mydata, const char *data, size_t len)
 {
-	ssize_t ret;
-	int *err = mydata;
+	struct __printf_data *pd = mydata;
 
-	ret = write(STDOUT_FILENO, data, len);
-	*err = (ret == -1) ? errno : 0;
+	if (__stdio_write(pd->f, data, len) < 0 && pd->err == 0) {
+		pd->err = errno;
+	}
 }
 
-/* printf: hand off to vprintf */
+/* printf: hand off to vfprintf */
 int
 printf(const char *fmt, ...)
 {
@@ -59,19 +63,43 @@ printf(const char *fmt, ...)
 	va_list ap;
 
 	va_start(ap, fmt);
-	chars = vprintf(fmt, ap);
+	chars = vfprintf(stdout, fmt, ap);
 	va_end(ap);
 	return chars;
 }
 
-/* vprintf: call __vprintf to do the work. */
+/* vprintf: likewise */
 int
 vprintf(const char *fmt, va_list ap)
 {
-	int chars, err;
-	chars = __vprintf(__printf_send, &err, fmt, ap);
-	if (err) {
-		errno = err;
+	return vfprintf(stdout, fmt, ap);
+}
+
+/* fprintf: hand off to vfprintf */
+int
+fprintf(FILE *f, const char *fmt, ...)
+{
+	int chars;
+	va_list ap;
+
+	va_start(ap, fmt);
+	chars = vfprintf(f, fmt, ap);
+	va_end(ap);
+	return chars;
+}
+
+/* vfprintf: call __vprintf to do the work. */
+int
+vfprintf(FILE *f, const char *fmt, va_list ap)
+{
+	struct __printf_data pd;
+	int chars;
+
+	pd.f = f;
+	pd.err = 0;
+	chars = __vprintf(__printf_send, &pd, fmt, ap);
+	if (pd.err) {
+		errno = pd.err;
 		return -1;
 	}
 	return chars;
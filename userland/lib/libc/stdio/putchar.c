@@ -28,23 +28,25 @@
  */
 
 #include <stdio.h>
-#include <unistd.h>
 
 /*
- * C standard function - print a single character.
- *
- * Properly, stdio is supposed to be buffered, but for present purposes
- * writing that code is not really worthwhile.
+ * C standard functions - print a single character, to stdout or to a
+ * given stream.
  */
 
 int
-putchar(int ch)
+fputc(int ch, FILE *f)
 {
 	char c = ch;
-	int len;
-	len = write(STDOUT_FILENO, &c, 1);
-	if (len<=0) {
+
+	if (__stdio_write(f, &c, 1) < 0) {
 		return EOF;
 	}
-	return ch;
+	return (int)(unsigned char)c;
+}
+
+int
+putchar(int ch)
+{
+	return fputc(ch, stdout);
 }
@@ -28,15 +28,27 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 /*
- * C standard I/O function - print a string and a newline.
+ * C standard I/O functions - print a string and a newline, or print a
+ * string to a stream.
  */
 
 int
 puts(const char *s)
 {
-	__puts(s);
-	putchar('\n');
+	if (__puts(s) == EOF || putchar('\n') == EOF) {
+		return EOF;
+	}
+	return 0;
+}
+
+int
+fputs(const char *s, FILE *f)
+{
+	if (__stdio_write(f, s, strlen(s)) < 0) {
+		return EOF;
+	}
 	return 0;
 }
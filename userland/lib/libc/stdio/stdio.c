@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Output streams and their buffers; see stdio.h.
+ */
+
+static char __stdout_buf[BUFSIZ];
+
+static FILE __stdout = {
+	STDOUT_FILENO, -1, 0, __stdout_buf, sizeof(__stdout_buf), 0
+};
+static FILE __stderr = {
+	STDERR_FILENO, _IONBF, 0, NULL, 0, 0
+};
+
+FILE *stdout = &__stdout;
+FILE *stderr = &__stderr;
+
+static FILE *const __streams[] = { &__stdout, &__stderr };
+#define NSTREAMS (sizeof(__streams) / sizeof(__streams[0]))
+
+/*
+ * Write all of DATA to the stream's file, or fail.
+ */
+static
+int
+__stdio_writeall(FILE *f, const char *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(f->f_fd, data, len);
+		if (ret < 0) {
+			f->f_error = 1;
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Decide how to buffer a stream on first use: by line if it's the
+ * console, which is the only thing that answers console ioctls, and
+ * otherwise in whole buffers.
+ */
+static
+void
+__stdio_setmode(FILE *f)
+{
+	int canon;
+
+	if (ioctl(f->f_fd, CONIOC_GETCANON, &canon) == 0) {
+		f->f_mode = _IOLBF;
+	}
+	else {
+		f->f_mode = _IOFBF;
+	}
+}
+
+static
+int
+__stdio_flush(FILE *f)
+{
+	size_t len;
+
+	len = f->f_len;
+	f->f_len = 0;
+	if (len > 0 && __stdio_writeall(f, f->f_buf, len) < 0) {
+		/* the output is lost either way */
+		return EOF;
+	}
+	return 0;
+}
+
+int
+__stdio_write(FILE *f, const char *data, size_t len)
+{
+	size_t i;
+
+	if (f->f_mode < 0) {
+		__stdio_setmode(f);
+	}
+
+	if (f->f_mode == _IONBF || f->f_buf == NULL) {
+		return __stdio_writeall(f, data, len);
+	}
+
+	if (len > f->f_size - f->f_len) {
+		if (__stdio_flush(f) == EOF) {
+			return -1;
+		}
+		if (len >= f->f_size) {
+			/* no point copying it */
+			return __stdio_writeall(f, data, len);
+		}
+	}
+
+	for (i=0; i<len; i++) {
+		f->f_buf[f->f_len++] = data[i];
+	}
+
+	if (f->f_mode == _IOLBF) {
+		for (i=0; i<len; i++) {
+			if (data[i] == '\n') {
+				return __stdio_flush(f) == EOF ? -1 : 0;
+			}
+		}
+	}
+	return 0;
+}
+
+int
+fflush(FILE *f)
+{
+	unsigned i;
+	int result;
+
+	if (f != NULL) {
+		return __stdio_flush(f);
+	}
+
+	result = 0;
+	for (i=0; i<NSTREAMS; i++) {
+		if (__stdio_flush(__streams[i]) == EOF) {
+			result = EOF;
+		}
+	}
+	return result;
+}
+
+/*
+ * Set the buffering. This should be done before the stream is used;
+ * anything already buffered is flushed.
+ */
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (__stdio_flush(f) == EOF) {
+		return -1;
+	}
+
+	f->f_mode = mode;
+	if (buf != NULL && size > 0) {
+		f->f_buf = buf;
+		f->f_size = size;
+	}
+	else if (f == &__stdout) {
+		f->f_buf = __stdout_buf;
+		f->f_size = sizeof(__stdout_buf);
+	}
+	return 0;
+}
+
+size_t
+fwrite(const void *ptr, size_t size, size_t nitems, FILE *f)
+{
+	if (size == 0 || nitems == 0) {
+		return 0;
+	}
+	if (__stdio_write(f, ptr, size * nitems) < 0) {
+		return 0;
+	}
+	return nitems;
+}
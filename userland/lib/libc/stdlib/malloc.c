@@ -30,10 +30,21 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * Blocks are laid out end to end in the heap, each with a header that
+ * gives the size of both it and the block below, so free can merge a
+ * block with its neighbours (boundary tags). Free blocks are kept on
+ * segregated free lists ("bins") by size: one for each small size,
+ * which makes small allocations O(1), and one for each power-of-two
+ * range of larger sizes, searched first-fit. A bitmap of nonempty bins
+ * finds the next larger bin quickly. Free space at the top of the heap
+ * is handed back with sbrk once there's enough of it.
+ *
+ * Since a process can have several threads (see threadfork), the heap
+ * has a lock. So that threads don't all queue for it, small blocks go
+ * through arenas in front of the heap: each thread uses the arena its
+ * stack hashes to, which keeps a few free blocks of each small size
+ * and refills from the heap several at a time. An arena's blocks are
+ * still in use as far as the heap is concerned.
  */
 
 #include <stdlib.h>
@@ -147,12 +158,126 @@ static size_t __malloc_pagesize;
 #define PAGE_SIZE 4096
 #endif
 
+/*
+ * A free block's data area holds its links on its bin's list. The
+ * smallest block has MBLOCKSIZE bytes of data, which is just room.
+ */
+struct mfree {
+	struct mfree *mf_next;
+	struct mfree **mf_prevp;
+};
+
+#define M_FREE(mh)	((struct mfree *)M_DATA(mh))
+#define M_HEADER(mf)	(((struct mheader *)(mf))-1)
+
+/*
+ * Bins.
+ *
+ * MSMALLBINS bins hold blocks of exactly 1, 2, ... MSMALLBINS blocksizes
+ * of data; after that, each bin covers sizes from 2^n up to but not
+ * including 2^(n+1) blocksizes. MNBINS is enough for the largest block
+ * a header can describe.
+ *
+ * Free space at the top of the heap is given back to the system once
+ * there's at least MTRIM bytes of it.
+ */
+#define MSMALLBINS	64
+#define MSMALLSHIFT	6		/* log2(MSMALLBINS) */
+#define MNBINS		128
+#define MBINWORDS	(MNBINS / 32)
+
+#define MTRIM		(4 * PAGE_SIZE)
+
+/*
+ * Arenas.
+ *
+ * There are MARENAS arenas. A thread's arena is chosen by which
+ * MSTACKSPAN-sized piece of memory its stack is in; that's the size
+ * of a thread's stack (see YANG_VM_THREAD_STACKPAGES in the kernel),
+ * so different threads' stacks are usually in different pieces.
+ * Threads that land on the same arena just share it.
+ *
+ * Each arena caches up to MCACHEMAX free blocks with each of 1, 2, ...
+ * MCACHECLASSES blocksizes of data, and fetches MCACHEBATCH at a time
+ * from the heap when it runs out.
+ */
+#define MARENAS		8
+#define MSTACKSPAN	(16 * 4096)
+#define MCACHECLASSES	16
+#define MCACHEMAX	8
+#define MCACHEBATCH	4
+
+struct marena {
+	volatile unsigned ma_lock;
+	struct mfree *ma_cache[MCACHECLASSES];	/* linked by mf_next */
+	unsigned ma_count[MCACHECLASSES];
+};
+
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap, the
+ * highest block (NULL if there are none), and the bins.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mheader *__heaplast;
+static struct mfree *__malloc_bins[MNBINS];
+static uint32_t __malloc_binmap[MBINWORDS];
+
+/* lock for all of the above, and the arenas */
+static volatile unsigned __malloc_heaplock;
+static struct marena __malloc_arenas[MARENAS];
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Locks. These just spin; they're held briefly.
+ *
+ * On OS/161 test-and-set is done with LL/SC, as for the kernel's
+ * spinlocks. A failed SC counts as finding the lock held.
+ */
+static
+unsigned
+__malloc_testandset(volatile unsigned *lk)
+{
+#if defined(__mips__)
+	unsigned x;
+	unsigned y;
+
+	y = 1;
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"ll %0, 0(%2);"		/*   x = *lk */
+		"sc %1, 0(%2);"		/*   *lk = y; y = success? */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "+r" (y) : "r" (lk) : "memory");
+	if (y == 0) {
+		return 1;
+	}
+	return x;
+#else
+	return __sync_lock_test_and_set(lk, 1);
+#endif
+}
+
+static
+void
+__malloc_lock(volatile unsigned *lk)
+{
+	while (*lk != 0 || __malloc_testandset(lk) != 0) {
+		/* spin */
+	}
+}
+
+static
+void
+__malloc_unlock(volatile unsigned *lk)
+{
+	__asm volatile("" ::: "memory");
+	*lk = 0;
+}
 
 /*
  * Setup function.
@@ -175,6 +300,9 @@ __malloc_init(void)
 	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
 		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
 	}
+	if (sizeof(struct mfree) > MBLOCKSIZE) {
+		errx(1, "malloc: Internal error - free links don't fit");
+	}
 
 	/* init should only be called once. */
 	if (__heapbase!=0 || __heaptop!=0) {
@@ -239,6 +367,7 @@ __malloc_dump(void)
 	warnx("heap: ************************************************");
 
 	rightprevblock = 0;
+	mh = NULL;
 	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
 		mh = (struct mheader *) i;
 		if (!M_OK(mh)) {
@@ -265,6 +394,10 @@ __malloc_dump(void)
 	if (i!=__heaptop) {
 		errx(1, "malloc: Heap corrupt; ran off end");
 	}
+	if (mh != __heaplast) {
+		errx(1, "malloc: Heap corrupt; last block is %p, not %p",
+		     mh, __heaplast);
+	}
 
 	warnx("heap: ************************************************");
 }
@@ -273,6 +406,139 @@ __malloc_dump(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Which bin a free block with SIZE bytes of data goes in. SIZE must
+ * be a nonzero multiple of MBLOCKSIZE.
+ */
+static
+unsigned
+__malloc_bin(size_t size)
+{
+	size_t blocks;
+	unsigned bin;
+
+	blocks = size >> MBLOCKSHIFT;
+	if (blocks <= MSMALLBINS) {
+		return blocks - 1;
+	}
+	bin = MSMALLBINS;
+	for (blocks >>= MSMALLSHIFT + 1; blocks > 0; blocks >>= 1) {
+		bin++;
+	}
+	return bin < MNBINS ? bin : MNBINS - 1;
+}
+
+/*
+ * Return the first nonempty bin at or above BIN, or MNBINS if none.
+ */
+static
+unsigned
+__malloc_nextbin(unsigned bin)
+{
+	unsigned word;
+	uint32_t bits;
+
+	word = bin / 32;
+	if (word >= MBINWORDS) {
+		return MNBINS;
+	}
+	bits = __malloc_binmap[word] & ~(((uint32_t)1 << (bin % 32)) - 1);
+	while (bits == 0) {
+		if (++word >= MBINWORDS) {
+			return MNBINS;
+		}
+		bits = __malloc_binmap[word];
+	}
+	bin = word * 32;
+	while ((bits & 1) == 0) {
+		bits >>= 1;
+		bin++;
+	}
+	return bin;
+}
+
+/*
+ * Put a free block on its bin's list.
+ */
+static
+void
+__malloc_binsert(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned bin;
+
+	bin = __malloc_bin(M_SIZE(mh));
+	mf->mf_next = __malloc_bins[bin];
+	mf->mf_prevp = &__malloc_bins[bin];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prevp = &mf->mf_next;
+	}
+	__malloc_bins[bin] = mf;
+	__malloc_binmap[bin / 32] |= (uint32_t)1 << (bin % 32);
+}
+
+/*
+ * Take a free block off its bin's list. Its size must not have changed
+ * since it was put there.
+ */
+static
+void
+__malloc_bremove(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned bin;
+
+	*mf->mf_prevp = mf->mf_next;
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prevp = mf->mf_prevp;
+	}
+	bin = __malloc_bin(M_SIZE(mh));
+	if (__malloc_bins[bin] == NULL) {
+		__malloc_binmap[bin / 32] &= ~((uint32_t)1 << (bin % 32));
+	}
+}
+
+/*
+ * Find a free block with at least SIZE bytes of data, and take it off
+ * its list. Returns NULL if there isn't one.
+ *
+ * A small bin holds blocks of just one size, so if there's anything in
+ * SIZE's own bin, the first one fits. A larger bin holds a range of
+ * sizes and has to be searched. Past that, anything in the next
+ * nonempty bin is big enough.
+ */
+static
+struct mheader *
+__malloc_findfree(size_t size)
+{
+	struct mheader *mh;
+	struct mfree *mf;
+	unsigned bin;
+
+	bin = __malloc_bin(size);
+	for (mf = __malloc_bins[bin]; mf != NULL; mf = mf->mf_next) {
+		mh = M_HEADER(mf);
+		if (M_SIZE(mh) >= size) {
+			goto found;
+		}
+	}
+
+	bin = __malloc_nextbin(bin + 1);
+	if (bin == MNBINS) {
+		return NULL;
+	}
+	mh = M_HEADER(__malloc_bins[bin]);
+
+ found:
+	if (!M_OK(mh) || mh->mh_inuse) {
+		errx(1, "malloc: Heap corrupt; bad free block at %p", mh);
+	}
+	__malloc_bremove(mh);
+	return mh;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Get more memory (at the top of the heap) using sbrk, and
  * return a pointer to it.
@@ -300,11 +566,14 @@ __malloc_sbrk(size_t size)
 
 /*
  * Make a new (free) block from the block passed in, leaving size
- * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * bytes for data in the current block, and put it in its bin. size
+ * must be a multiple of MBLOCKSIZE.
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
+ *
+ * The block above is never free (it would have been merged with this
+ * one) so the new block needn't be merged with anything.
  */
 static
 void
@@ -343,96 +612,27 @@ __malloc_split(struct mheader *mh, size_t size)
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__heaplast = mhnew;
+	}
+
+	__malloc_binsert(mhnew);
 }
 
 /*
- * malloc itself.
+ * Expand the heap to make a free block with at least size bytes of
+ * data at the top, and return it (not on any list). If the top block
+ * is already free it's grown; otherwise a new one is made.
  */
-void *
-malloc(size_t size)
+static
+struct mheader *
+__malloc_grow(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
 	size_t morespace;
 	void *p;
 
-	if (__heapbase==0) {
-		__malloc_init();
-	}
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
-		warnx("malloc: Internal error - local data corrupt");
-		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
-		     (unsigned long) __heapbase, (unsigned long) __heaptop);
-	}
-
-#ifdef MALLOCDEBUG
-	warnx("malloc: about to allocate %lu (0x%lx) bytes",
-	      (unsigned long) size, (unsigned long) size);
-	__malloc_dump();
-#endif
-
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	mh = NULL;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i,
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
-	}
-
-	/*
-	 * Didn't find anything. Expand the heap.
-	 *
-	 * If the heap is nonempty and the top block (the one mh is
-	 * left pointing to after the above loop) is free, we can
-	 * expand it. Otherwise we need a new block.
-	 */
+	mh = __heaplast;
 	if (mh != NULL && !mh->mh_inuse) {
 		assert(size > M_SIZE(mh));
 		morespace = size - M_SIZE(mh);
@@ -451,32 +651,153 @@ malloc(size_t size)
 
 	if (mh != NULL && !mh->mh_inuse) {
 		/* update old header */
+		__malloc_bremove(mh);
 		mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) + morespace);
-		mh->mh_inuse = 1;
 	}
 	else {
 		/* fill out new header */
 		mh = p;
-		mh->mh_prevblock = rightprevblock;
+		mh->mh_prevblock = __heaplast ? __heaplast->mh_nextblock : 0;
 		mh->mh_magic1 = MMAGIC;
 		mh->mh_magic2 = MMAGIC;
 		mh->mh_pad = 0;
-		mh->mh_inuse = 1;
+		mh->mh_inuse = 0;
 		mh->mh_nextblock = M_MKFIELD(morespace);
+		__heaplast = mh;
+	}
+	return mh;
+}
+
+/*
+ * Allocate a block with SIZE bytes of data from the heap, with the
+ * heap locked. SIZE is already a whole number of blocks.
+ */
+static
+struct mheader *
+__malloc_heapalloc(size_t size)
+{
+	struct mheader *mh;
+
+	if (__heapbase==0) {
+		__malloc_init();
+	}
+	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
+		warnx("malloc: Internal error - local data corrupt");
+		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
+		     (unsigned long) __heapbase, (unsigned long) __heaptop);
+	}
+
+#ifdef MALLOCDEBUG
+	warnx("malloc: about to allocate %lu (0x%lx) bytes",
+	      (unsigned long) size, (unsigned long) size);
+	__malloc_dump();
+#endif
+
+	mh = __malloc_findfree(size);
+	if (mh == NULL) {
+		/* Didn't find anything. Expand the heap. */
+		mh = __malloc_grow(size);
+		if (mh == NULL) {
+			return NULL;
+		}
 	}
 
 	/*
-	 * Either way, try splitting the block we got as because of
-	 * the page rounding it might be quite a bit bigger than we
-	 * needed.
+	 * Split off whatever we don't need, which with the page
+	 * rounding in __malloc_grow might be quite a bit.
 	 */
 	__malloc_split(mh, size);
 
+	/*
+	 * Now, allocate.
+	 */
+	mh->mh_inuse = 1;
+
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
 	__malloc_dump();
 #endif
-	return M_DATA(mh);
+	return mh;
+}
+
+/*
+ * Get the calling thread's arena.
+ */
+static
+struct marena *
+__malloc_myarena(void)
+{
+	char here;
+
+	return &__malloc_arenas[((uintptr_t)&here / MSTACKSPAN) % MARENAS];
+}
+
+/*
+ * Refill arena MA's cache for blocks of SIZE bytes of data, which is
+ * empty, from the heap. The blocks the heap gives back may be a bit
+ * bigger (if the leftover was too small to split off); that doesn't
+ * matter. Returns nonzero if it got any.
+ */
+static
+int
+__malloc_refill(struct marena *ma, size_t size)
+{
+	unsigned cls = (size >> MBLOCKSHIFT) - 1;
+	struct mheader *mh;
+	struct mfree *mf;
+	unsigned i;
+
+	__malloc_lock(&__malloc_heaplock);
+	for (i=0; i<MCACHEBATCH; i++) {
+		mh = __malloc_heapalloc(size);
+		if (mh == NULL) {
+			break;
+		}
+		mf = M_FREE(mh);
+		mf->mf_next = ma->ma_cache[cls];
+		ma->ma_cache[cls] = mf;
+		ma->ma_count[cls]++;
+	}
+	__malloc_unlock(&__malloc_heaplock);
+	return i > 0;
+}
+
+/*
+ * malloc itself.
+ */
+void *
+malloc(size_t size)
+{
+	struct marena *ma;
+	struct mheader *mh;
+	struct mfree *mf;
+	unsigned cls;
+
+	/* Round size up to an integral number of blocks. */
+	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		size = MBLOCKSIZE;
+	}
+
+	if (size <= MCACHECLASSES * MBLOCKSIZE) {
+		cls = (size >> MBLOCKSHIFT) - 1;
+		ma = __malloc_myarena();
+		__malloc_lock(&ma->ma_lock);
+		if (ma->ma_cache[cls] == NULL && !__malloc_refill(ma, size)) {
+			__malloc_unlock(&ma->ma_lock);
+			return NULL;
+		}
+		mf = ma->ma_cache[cls];
+		ma->ma_cache[cls] = mf->mf_next;
+		ma->ma_count[cls]--;
+		__malloc_unlock(&ma->ma_lock);
+		return mf;
+	}
+
+	__malloc_lock(&__malloc_heaplock);
+	mh = __malloc_heapalloc(size);
+	__malloc_unlock(&__malloc_heaplock);
+	return mh == NULL ? NULL : M_DATA(mh);
 }
 
 ////////////////////////////////////////////////////////////
@@ -497,23 +818,15 @@ __malloc_deadbeef(void *ptr, size_t size)
 }
 
 /*
- * Attempt to merge two adjacent blocks (mh below mhnext).
+ * Merge two adjacent free blocks (mh below mhnext), neither of which
+ * is on a list.
  */
 static
 void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
+__malloc_merge(struct mheader *mh, struct mheader *mhnext)
 {
 	struct mheader *mhnextnext;
 
-	if (mh->mh_nextblock != mhnext->mh_prevblock) {
-		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
-		     mh, mhnext);
-	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
-
 	mhnextnext = M_NEXT(mhnext);
 
 	mh->mh_nextblock = M_MKFIELD(MBLOCKSIZE + M_SIZE(mh) +
@@ -522,46 +835,92 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__heaplast = mh;
+	}
 
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
 }
 
 /*
- * The actual free() implementation.
+ * Check that two adjacent blocks (mh below mhnext) agree about where
+ * they are, and return whether they can be merged.
  */
-void
-free(void *x)
+static
+int
+__malloc_canmerge(struct mheader *mh, struct mheader *mhnext)
 {
-	struct mheader *mh, *mhnext, *mhprev;
+	if (!M_OK(mh) || !M_OK(mhnext) ||
+	    mh->mh_nextblock != mhnext->mh_prevblock) {
+		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
+		     mh, mhnext);
+	}
+	return !mh->mh_inuse && !mhnext->mh_inuse;
+}
 
-	if (x==NULL) {
-		/* safest practice */
-		return;
+/*
+ * Give back all but the first part of the free block at the top of
+ * the heap, if there's enough of it to bother: everything from the
+ * first page boundary that leaves room for the block's header and its
+ * free links, or all of it if it starts on one. Returns 1 if the whole
+ * block went.
+ */
+static
+int
+__malloc_trim(struct mheader *mh)
+{
+	uintptr_t keep;
+	void *x;
+
+	assert(mh == __heaplast && !mh->mh_inuse);
+
+	keep = (uintptr_t)mh;
+	if (keep % PAGE_SIZE != 0) {
+		keep += 2*MBLOCKSIZE + PAGE_SIZE - 1;
+		keep -= keep % PAGE_SIZE;
+	}
+	if (__heaptop - keep < MTRIM) {
+		return 0;
 	}
 
-	/* Consistency check. */
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
-		warnx("free: Internal error - local data corrupt");
-		errx(1, "free: heapbase 0x%lx; heaptop 0x%lx",
-		     (unsigned long) __heapbase, (unsigned long) __heaptop);
+	x = sbrk(-(intptr_t)(__heaptop - keep));
+	if (x == (void *)-1) {
+		/* not fatal; just keep it */
+		return 0;
+	}
+	if ((uintptr_t)x != __heaptop) {
+		errx(1, "free: Internal error - "
+		     "heap top moved itself from 0x%lx to 0x%lx",
+		     (unsigned long) __heaptop,
+		     (unsigned long) (uintptr_t) x);
 	}
+	__heaptop = keep;
 
-	/* Don't allow freeing pointers that aren't on the heap. */
-	if ((uintptr_t)x < __heapbase || (uintptr_t)x >= __heaptop) {
-		errx(1, "free: Invalid pointer %p freed (out of range)", x);
+	if (keep == (uintptr_t)mh) {
+		__heaplast = mh == (struct mheader *)__heapbase ?
+			NULL : M_PREV(mh);
+		return 1;
 	}
+	mh->mh_nextblock = M_MKFIELD(keep - (uintptr_t)mh);
+	return 0;
+}
+
+/*
+ * Give the block MH back to the heap, with the heap locked.
+ */
+static
+void
+__malloc_heapfree(struct mheader *mh)
+{
+	struct mheader *mhnext, *mhprev;
+	void *x = M_DATA(mh);
 
 #ifdef MALLOCDEBUG
 	warnx("free: about to free %p", x);
 	__malloc_dump();
 #endif
 
-	mh = ((struct mheader *)x)-1;
-	if (!M_OK(mh)) {
-		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
-	}
-
 	if (!mh->mh_inuse) {
 		errx(1, "free: Invalid pointer %p freed (already free)", x);
 	}
@@ -574,14 +933,25 @@ free(void *x)
 
 	/* Try merging with the block above (but not if we're at the top) */
 	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (mhnext != (struct mheader *)__heaptop &&
+	    __malloc_canmerge(mh, mhnext)) {
+		__malloc_bremove(mhnext);
+		__malloc_merge(mh, mhnext);
 	}
 
 	/* Try merging with the block below (but not if we're at the bottom) */
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (__malloc_canmerge(mhprev, mh)) {
+			__malloc_bremove(mhprev);
+			__malloc_merge(mhprev, mh);
+			mh = mhprev;
+		}
+	}
+
+	/* Give back the top of the heap, or file the block away */
+	if (mh != __heaplast || !__malloc_trim(mh)) {
+		__malloc_binsert(mh);
 	}
 
 #ifdef MALLOCDEBUG
@@ -589,3 +959,70 @@ free(void *x)
 	__malloc_dump();
 #endif
 }
+
+/*
+ * The actual free() implementation.
+ *
+ * A small block goes into the calling thread's arena if there's room
+ * for it, and otherwise back to the heap. The heap still thinks
+ * cached blocks are in use, so to catch freeing one twice, check the
+ * arena's list; that's short.
+ */
+void
+free(void *x)
+{
+	struct marena *ma;
+	struct mheader *mh;
+	struct mfree *mf;
+	size_t size;
+	unsigned cls;
+
+	if (x==NULL) {
+		/* safest practice */
+		return;
+	}
+
+	/* Consistency check. */
+	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
+		warnx("free: Internal error - local data corrupt");
+		errx(1, "free: heapbase 0x%lx; heaptop 0x%lx",
+		     (unsigned long) __heapbase, (unsigned long) __heaptop);
+	}
+
+	/* Don't allow freeing pointers that aren't on the heap. */
+	if ((uintptr_t)x < __heapbase || (uintptr_t)x >= __heaptop) {
+		errx(1, "free: Invalid pointer %p freed (out of range)", x);
+	}
+
+	mh = ((struct mheader *)x)-1;
+	if (!M_OK(mh)) {
+		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
+	}
+
+	size = M_SIZE(mh);
+	if (size <= MCACHECLASSES * MBLOCKSIZE && mh->mh_inuse) {
+		cls = (size >> MBLOCKSHIFT) - 1;
+		ma = __malloc_myarena();
+		__malloc_lock(&ma->ma_lock);
+		for (mf = ma->ma_cache[cls]; mf != NULL; mf = mf->mf_next) {
+			if (mf == x) {
+				errx(1, "free: Invalid pointer %p freed "
+				     "(already free)", x);
+			}
+		}
+		if (ma->ma_count[cls] < MCACHEMAX) {
+			__malloc_deadbeef(x, size);
+			mf = x;
+			mf->mf_next = ma->ma_cache[cls];
+			ma->ma_cache[cls] = mf;
+			ma->ma_count[cls]++;
+			__malloc_unlock(&ma->ma_lock);
+			return;
+		}
+		__malloc_unlock(&ma->ma_lock);
+	}
+
+	__malloc_lock(&__malloc_heaplock);
+	__malloc_heapfree(mh);
+	__malloc_unlock(&__malloc_heaplock);
+}
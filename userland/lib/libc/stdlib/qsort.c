@@ -29,117 +29,206 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 
 /*
  * qsort() for OS/161, where it isn't in libc.
+ *
+ * This is introsort: quicksort with a median-of-three pivot, switching
+ * to heapsort for any part that has needed more than about 2 log2(n)
+ * rounds of partitioning (so bad inputs can't make it quadratic), and
+ * leaving parts of SMALLSORT elements or fewer to a final insertion
+ * sort, which does them faster.
+ */
+
+#define SMALLSORT 8
+
+/*
+ * Everything a sort needs to know about the array.
+ */
+struct sortinfo {
+	char *data;
+	size_t size;
+	int wordswap;	/* elements are whole, aligned words */
+	int (*f)(const void *, const void *);
+};
+
+#define ELEM(si, i) ((si)->data + (size_t)(i) * (si)->size)
+#define COMPARE(si, a, b) ((si)->f(ELEM(si, a), ELEM(si, b)))
+
+/*
+ * Exchange elements A and B, a word at a time if we can.
  */
+static
 void
-qsort(void *vdata, unsigned num, size_t size,
-      int (*f)(const void *, const void *))
+exchange(const struct sortinfo *si, unsigned a, unsigned b)
 {
-	unsigned pivot, head, tail;
-	char *data = vdata;
-	char tmp[size];
+	size_t i;
 
-#define COMPARE(aa, bb) \
-		((aa) == (bb) ? 0 : f(data + (aa) * size, data + (bb) * size))
-#define EXCHANGE(aa, bb) \
-		memcpy(tmp, data + (aa) * size, size);			\
-		memcpy(data + (aa) * size, data + (bb) * size, size);	\
-		memcpy(data + (bb) * size, tmp, size)
+	if (si->wordswap) {
+		long *wa = (long *)ELEM(si, a), *wb = (long *)ELEM(si, b);
+		long t;
 
+		for (i = 0; i < si->size / sizeof(long); i++) {
+			t = wa[i];
+			wa[i] = wb[i];
+			wb[i] = t;
+		}
+	}
+	else {
+		char *ca = ELEM(si, a), *cb = ELEM(si, b);
+		char t;
 
-	if (num <= 1) {
-		return;
+		for (i = 0; i < si->size; i++) {
+			t = ca[i];
+			ca[i] = cb[i];
+			cb[i] = t;
+		}
 	}
-	if (num == 2) {
-		if (COMPARE(0, 1) > 0) {
-			EXCHANGE(0, 1);
+}
+
+/*
+ * Heapsort the NUM elements starting at BASE.
+ */
+static
+void
+siftdown(const struct sortinfo *si, unsigned base, unsigned root,
+	 unsigned num)
+{
+	unsigned child;
+
+	while ((child = 2 * root + 1) < num) {
+		if (child + 1 < num &&
+		    COMPARE(si, base + child, base + child + 1) < 0) {
+			child++;
+		}
+		if (COMPARE(si, base + root, base + child) >= 0) {
 			return;
 		}
+		exchange(si, base + root, base + child);
+		root = child;
 	}
+}
 
-	/*
-	 * 1. Pick a pivot value. For simplicity, always use the
-	 * middle of the array.
-	 */
-	pivot = num / 2;
+static
+void
+heapsort(const struct sortinfo *si, unsigned base, unsigned num)
+{
+	unsigned i;
 
-	/*
-	 * 2. Shift all values less than or equal to the pivot value
-	 * to the front of the array.
-	 */
-	head = 0;
-	tail = num - 1;
+	for (i = num / 2; i > 0; i--) {
+		siftdown(si, base, i - 1, num);
+	}
+	for (i = num - 1; i > 0; i--) {
+		exchange(si, base, base + i);
+		siftdown(si, base, 0, i);
+	}
+}
+
+/*
+ * Quicksort the NUM elements starting at BASE down to parts of
+ * SMALLSORT or fewer, each of which is then in the right place
+ * relative to the others. DEPTH is how many more rounds of
+ * partitioning to allow before giving up and heapsorting.
+ */
+static
+void
+introsort(const struct sortinfo *si, unsigned base, unsigned num,
+	  unsigned depth)
+{
+	unsigned mid, last, i, j;
 
-	while (head < tail) {
-		if (COMPARE(head, pivot) <= 0) {
-			head++;
+	while (num > SMALLSORT) {
+		if (depth == 0) {
+			heapsort(si, base, num);
+			return;
 		}
-		else if (COMPARE(tail, pivot) > 0) {
-			tail--;
+		depth--;
+
+		/*
+		 * Put the median of the first, middle, and last
+		 * elements first, as the pivot.
+		 */
+		mid = base + num / 2;
+		last = base + num - 1;
+		if (COMPARE(si, mid, base) < 0) {
+			exchange(si, mid, base);
 		}
-		else {
-			EXCHANGE(head, tail);
-			if (pivot == head) {
-				pivot = tail;
-			}
-			else if (pivot == tail) {
-				pivot = head;
+		if (COMPARE(si, last, mid) < 0) {
+			exchange(si, last, mid);
+			if (COMPARE(si, mid, base) < 0) {
+				exchange(si, mid, base);
 			}
-			head++;
-			tail--;
 		}
-	}
-
-	/*
-	 * 3. If there's an even number of elements and we swapped the
-	 * last two, the head and tail indexes will cross. In this
-	 * case the first entry on the tail side is tail+1. If there's
-	 * an odd number of elements, we stop with head == tail, and
-	 * the first entry on the tail side is this value (hence,
-	 * tail) if it's is greater than the pivot value, and the next
-	 * element (hence, tail+1) if it's less than or equal to the
-	 * pivot value.
-	 *
-	 * Henceforth use "tail" to hold the index of the first entry
-	 * of the back portion of the array.
-	 */
-	if (head > tail || COMPARE(head, pivot) <= 0) {
-		tail++;
-	}
+		exchange(si, base, mid);
 
-	/*
-	 * 4. If we got a bad pivot that gave us only one partition,
-	 * because of the order of the advances in the loop above it
-	 * will always put everything in the front portion of the
-	 * array (so tail == num). This happens if we picked the
-	 * largest value. Move the pivot to the end, if necessary, lop
-	 * off all values equal to it, and recurse on the rest.  (If
-	 * there is no rest, the array is already sorted and we're
-	 * done.)
-	 */
-	if (tail == num) {
-		if (pivot < num - 1) {
-			if (COMPARE(pivot, num - 1) > 0) {
-				EXCHANGE(pivot, num - 1);
+		/*
+		 * Partition around it. Both scans stop at elements
+		 * equal to the pivot, so lots of equal elements still
+		 * split evenly; the one from the right stops at the
+		 * pivot itself at the latest.
+		 */
+		i = 0;
+		j = num;
+		for (;;) {
+			do {
+				i++;
+			} while (i < num && COMPARE(si, base + i, base) < 0);
+			do {
+				j--;
+			} while (COMPARE(si, base + j, base) > 0);
+			if (i >= j) {
+				break;
 			}
+			exchange(si, base + i, base + j);
 		}
-		tail = num - 1;
-		while (tail > 0 && COMPARE(tail - 1, tail) == 0) {
-			tail--;
+		exchange(si, base, base + j);
+
+		/*
+		 * The pivot is now at J. Recurse on the smaller side
+		 * and go round again for the larger, so the stack
+		 * stays shallow.
+		 */
+		if (j < num - j - 1) {
+			introsort(si, base, j, depth);
+			base += j + 1;
+			num -= j + 1;
 		}
-		if (tail > 0) {
-			qsort(vdata, tail, size, f);
+		else {
+			introsort(si, base + j + 1, num - j - 1, depth);
+			num = j;
 		}
+	}
+}
+
+void
+qsort(void *vdata, unsigned num, size_t size,
+      int (*f)(const void *, const void *))
+{
+	struct sortinfo si;
+	unsigned depth, n, i, j;
+
+	if (num <= 1 || size == 0) {
 		return;
 	}
-	assert(tail > 0 && tail < num);
+
+	si.data = vdata;
+	si.size = size;
+	si.wordswap = ((unsigned long)vdata | size) % sizeof(long) == 0;
+	si.f = f;
+
+	depth = 0;
+	for (n = num; n > 1; n >>= 1) {
+		depth += 2;
+	}
+	introsort(&si, 0, num, depth);
 
 	/*
-	 * 5. Recurse on each subpart of the array.
+	 * Now everything is within SMALLSORT of where it belongs;
+	 * insertion sort the lot.
 	 */
-	qsort(vdata, tail, size, f);
-	qsort((char *)vdata + tail * size, num - tail, size, f);
+	for (i = 1; i < num; i++) {
+		for (j = i; j > 0 && COMPARE(&si, j - 1, j) > 0; j--) {
+			exchange(&si, j - 1, j);
+		}
+	}
 }
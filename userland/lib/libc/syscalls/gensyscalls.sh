@@ -5,10 +5,16 @@
 #
 # Parses the kernel's syscalls.h into the body of syscalls.S
 #
+# Calls that libc wraps in C get stubs named with a leading __
+# instead: fork, which flushes stdio first (unix/fork.c), and getpid,
+# which reads the kernel information page (unix/getpid.c).
+#
 
 # tabs to spaces, just in case
 tr '\t' ' ' |\
 awk '
+    BEGIN { wrapped["fork"] = 1; wrapped["getpid"] = 1; }
+
     # Do not read the parts of the file that are not between the markers.
     /^\/\*CALLBEGIN\*\// { look=1; }
     /^\/\*CALLEND\*\// { look=0; }
@@ -16,6 +22,9 @@ awk '
     # And, do not read lines that do not match the approximate right pattern.
     look && /^#define SYS_/ && NF==3 {
 	sub("^SYS_", "", $2);
+	if ($2 in wrapped) {
+	    $2 = "__" $2;
+	}
 	# print the name of the call and the number.
 	print $2, $3;
     }
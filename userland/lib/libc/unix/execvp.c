@@ -35,19 +35,22 @@
 #include <limits.h>
 
 /*
- * POSIX C function: exec a program on the search path. Tries
- * execv() repeatedly until one of the choices works.
+ * Look for PROG on the search path, calling RUN (execv or spawnv) on
+ * each place it might be until one works, or one fails for some
+ * reason other than the program not being there.
  */
+static
 int
-execvp(const char *prog, char *const *args)
+pathsearch(const char *prog, char *const *args,
+	   int (*run)(const char *, char *const *))
 {
 	const char *searchpath, *s, *t;
 	char progpath[PATH_MAX];
 	size_t len;
+	int result;
 
 	if (strchr(prog, '/') != NULL) {
-		execv(prog, args);
-		return -1;
+		return run(prog, args);
 	}
 
 	searchpath = getenv("PATH");
@@ -74,7 +77,10 @@ execvp(const char *prog, char *const *args)
 		}
 		memcpy(progpath, s, len);
 		snprintf(progpath + len, sizeof(progpath) - len, "/%s", prog);
-		execv(progpath, args);
+		result = run(progpath, args);
+		if (result >= 0) {
+			return result;
+		}
 		switch (errno) {
 		    case ENOENT:
 		    case ENOTDIR:
@@ -89,3 +95,24 @@ execvp(const char *prog, char *const *args)
 	errno = ENOENT;
 	return -1;
 }
+
+/*
+ * POSIX C function: exec a program on the search path. Tries
+ * execv() repeatedly until one of the choices works.
+ */
+int
+execvp(const char *prog, char *const *args)
+{
+	pathsearch(prog, args, execv);
+	return -1;
+}
+
+/*
+ * Start a program on the search path in a new process, the same way,
+ * with spawnv(). Returns the new process's pid.
+ */
+pid_t
+spawnvp(const char *prog, char *const *args)
+{
+	return pathsearch(prog, args, spawnv);
+}
@@ -0,0 +1,15 @@
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+ * Fork. Uses the system call __fork(), after writing out anything
+ * stdio has buffered, so that it isn't written out again by the
+ * child as well.
+ */
+
+pid_t
+fork(void)
+{
+	fflush(NULL);
+	return __fork();
+}
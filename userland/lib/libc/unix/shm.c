@@ -0,0 +1,59 @@
+/*
+ * Named shared-memory objects. They are files in the kernel's
+ * in-memory "shm:" volume: open one, size it with ftruncate, and mmap
+ * it in each process that wants to share it.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+/*
+ * Turn NAME, which may start with a slash as in POSIX, into a path in
+ * shm:. Names with other slashes in them are rejected.
+ */
+static
+int
+shm_path(const char *name, char *buf, size_t buflen)
+{
+	size_t len;
+
+	if (name[0] == '/') {
+		name++;
+	}
+	len = strlen(name);
+	if (len == 0 || strchr(name, '/') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len + 5 > buflen) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(buf, "shm:");
+	strcpy(buf + 4, name);
+	return 0;
+}
+
+int
+shm_open(const char *name, int flags, mode_t mode)
+{
+	char path[PATH_MAX];
+
+	if (shm_path(name, path, sizeof(path)) < 0) {
+		return -1;
+	}
+	return open(path, flags, mode);
+}
+
+int
+shm_unlink(const char *name)
+{
+	char path[PATH_MAX];
+
+	if (shm_path(name, path, sizeof(path)) < 0) {
+		return -1;
+	}
+	return remove(path);
+}
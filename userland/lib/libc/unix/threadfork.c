@@ -27,24 +27,24 @@
  * SUCH DAMAGE.
  */
 
-#include <string.h>
+#include <unistd.h>
 
 /*
- * Standard C string function: compare two memory blocks and return
- * their sort order.
+ * Start a thread running FUNC. Uses the system call __threadfork(),
+ * which starts the new thread here, so that returning from FUNC
+ * exits the thread rather than running off the end of its stack.
  */
 
-int
-memcmp(const void *av, const void *bv, size_t len)
+static
+void
+threadstart(void *func)
 {
-	const unsigned char *a = av;
-	const unsigned char *b = bv;
-	size_t i;
+	((void (*)(void))func)();
+	_exit(0);
+}
 
-	for (i=0; i<len; i++) {
-		if (a[i] != b[i]) {
-			return (int)(a[i] - b[i]);
-		}
-	}
-	return 0;
+int
+threadfork(void (*func)(void))
+{
+	return __threadfork(threadstart, (void *)func);
 }
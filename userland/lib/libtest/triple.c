@@ -40,7 +40,7 @@
 
 static
 pid_t
-spawnv(const char *prog, char **argv)
+forkexec(const char *prog, char **argv)
 {
 	pid_t pid = fork();
 	switch (pid) {
@@ -94,7 +94,7 @@ triple(const char *prog)
 	warnx("Starting: running three copies of %s...", prog);
 
 	for (i=0; i<3; i++) {
-		pids[i]=spawnv(args[0], args);
+		pids[i]=forkexec(args[0], args);
 	}
 
 	for (i=0; i<3; i++) {
@@ -73,6 +73,9 @@ static bool dofiles, dodirs;
 static bool doindirect;
 static bool recurse;
 
+/* Size of the volume's blocks, from the superblock */
+static uint32_t fsblocksize = SFS_BLOCKSIZE;
+
 ////////////////////////////////////////////////////////////
 // printouts
 
@@ -132,16 +135,39 @@ dumplval(const char *desc, const char *lval)
 
 static void dumpinode(uint32_t ino, const char *name);
 
+/*
+ * Read a structure of LEN bytes from the start of block BLOCK.
+ */
+static
+void
+readstruct(void *data, size_t len, uint32_t block)
+{
+	static char blockbuf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= fsblocksize);
+	diskread(blockbuf, block);
+	memcpy(data, blockbuf, len);
+}
+
 static
 uint32_t
 readsb(void)
 {
 	struct sfs_superblock sb;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	/* fsblocksize is still SFS_BLOCKSIZE, so this reads one sector */
+	readstruct(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	if (SWAP32(sb.sb_features) & SFS_FEATURE_BLOCKSIZE) {
+		fsblocksize = SWAP32(sb.sb_blocksize);
+	}
+	if (fsblocksize < SFS_BLOCKSIZE || fsblocksize > SFS_MAXBLOCKSIZE ||
+	    (fsblocksize & (fsblocksize - 1)) != 0) {
+		errx(1, "Invalid block size %u", fsblocksize);
+	}
+	disksetblocksize(fsblocksize);
 	return SWAP32(sb.sb_nblocks);
 }
 
@@ -152,7 +178,7 @@ dumpsb(void)
 	struct sfs_superblock sb;
 	unsigned i;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	readstruct(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 	sb.sb_volname[sizeof(sb.sb_volname)-1] = 0;
 
 	printf("Superblock\n");
@@ -160,9 +186,27 @@ dumpsb(void)
 	dumpvalf("Magic", "0x%8x", SWAP32(sb.sb_magic));
 	dumpvalf("Size", "%u blocks", SWAP32(sb.sb_nblocks));
 	dumpvalf("Freemap size", "%u blocks",
-		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
-	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
+		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks), fsblocksize));
+	dumpvalf("Block size", "%u bytes", fsblocksize);
 	dumplval("Volume name", sb.sb_volname);
+	dumpvalf("Features", "0x%x%s%s%s%s%s", SWAP32(sb.sb_features),
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_HASHDIRS) ?
+		 " (hashed directories)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_JOURNAL) ?
+		 " (journal)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_BLOCKSIZE) ?
+		 " (block size)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_INLINE) ?
+		 " (inline files)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_PREALLOC) ?
+		 " (preallocation)" : "");
+	if (SWAP32(sb.sb_features) & SFS_FEATURE_JOURNAL) {
+		dumpvalf("Journal", "%u blocks at %u",
+			 SWAP32(sb.sb_journalblocks),
+			 SWAP32(sb.sb_journalstart));
+	}
+	dumplval("State", SWAP32(sb.sb_clean) == SFS_CLEAN ?
+		 "clean" : "not clean");
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -177,9 +221,10 @@ static
 void
 dumpfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, fsblocksize);
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(fsblocksize);
 	uint32_t i, j, k, bn;
-	uint8_t data[SFS_BLOCKSIZE], mask;
+	uint8_t data[SFS_MAXBLOCKSIZE], mask;
 	char tmp[16];
 
 	printf("Free block bitmap\n");
@@ -189,16 +234,16 @@ dumpfreemap(uint32_t fsblocks)
 		printf("    Freemap block #%u in disk block %u: blocks %u - %u"
 		       " (0x%x - 0x%x)\n",
 		       i, SFS_FREEMAP_START+i,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		       i*bitsperblock, (i+1)*bitsperblock - 1,
+		       i*bitsperblock, (i+1)*bitsperblock - 1);
+		for (j=0; j<fsblocksize; j++) {
 			if (j % 8 == 0) {
 				snprintf(tmp, sizeof(tmp), "0x%x",
-					 i*SFS_BITSPERBLOCK + j*8);
+					 i*bitsperblock + j*8);
 				printf("%-7s ", tmp);
 			}
 			for (k=0; k<8; k++) {
-				bn = i*SFS_BITSPERBLOCK + j*8 + k;
+				bn = i*bitsperblock + j*8 + k;
 				mask = 1U << k;
 				if (bn >= fsblocks) {
 					if (data[j] & mask) {
@@ -228,21 +273,28 @@ dumpfreemap(uint32_t fsblocks)
 	printf("\n");
 }
 
+/*
+ * Dump an indirect block of level LEVEL (1 for single indirect) and
+ * the indirect blocks under it.
+ */
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned level)
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t nib = SFS_DBPERIDB(fsblocksize);
 	char tmp[128];
 	unsigned i;
 
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("%s block %u\n",
+	       level == 1 ? "Indirect" :
+	       level == 2 ? "Double indirect" : "Triple indirect", block);
 
 	diskread(ib, block);
-	for (i=0; i<ARRAYCOUNT(ib); i++) {
+	for (i=0; i<nib; i++) {
 		if (i % 4 == 0) {
 			printf("@%-3u   ", i);
 		}
@@ -253,14 +305,20 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+	if (level > 1) {
+		for (i=0; i<nib; i++) {
+			dumpindirect(SWAP32(ib[i]), level - 1);
+		}
+	}
 }
 
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t nib = SFS_DBPERIDB(fsblocksize);
 	unsigned i;
 
 	if (block == 0) {
@@ -269,8 +327,15 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 	else {
 		diskread(ib, block);
 	}
-	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+	for (i=0; i<nib && fileblock < numblocks; i++) {
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
@@ -283,7 +348,7 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	uint32_t numblocks;
 	unsigned i;
 
-	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
+	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), fsblocksize);
 
 	fileblock = 0;
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
@@ -291,7 +356,15 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3, doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -300,8 +373,8 @@ static
 void
 dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_DIRPERBLOCK(SFS_MAXBLOCKSIZE)];
+	int nsds = SFS_DIRPERBLOCK(fsblocksize);
 	int i;
 
 	(void)fileblock;
@@ -342,8 +415,8 @@ static
 void
 recursedirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_DIRPERBLOCK(SFS_MAXBLOCKSIZE)];
+	int nsds = SFS_DIRPERBLOCK(fsblocksize);
 	int i;
 
 	(void)fileblock;
@@ -374,23 +447,20 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 	printf("Done with directory %u\n", ino);
 }
 
+/*
+ * Hex dump LEN bytes of file data (a multiple of 16), which start at
+ * file offset POS.
+ */
 static
-void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+void
+dumpbytes(const uint8_t *data, unsigned len, uint32_t pos)
 {
-	uint8_t data[SFS_BLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
-	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
-		return;
-	}
-
-	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0) {
-			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+			snprintf(tmp, sizeof(tmp), "0x%x", pos + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -415,11 +485,39 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint8_t data[SFS_MAXBLOCKSIZE];
+
+	if (diskblock == 0) {
+		printf("    0x%6x  [sparse]\n", fileblock * fsblocksize);
+		return;
+	}
+
+	diskread(data, diskblock);
+	dumpbytes(data, fsblocksize, fileblock * fsblocksize);
+}
+
 static
 void
 dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 {
+	uint8_t data[SFS_ROUNDUP(SFS_INLINESIZE, 16)];
+	uint32_t len;
+
 	printf("File contents for inode %u:\n", ino);
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_INLINE) {
+		len = SWAP32(sfi->sfi_size);
+		if (len > SFS_INLINESIZE) {
+			len = SFS_INLINESIZE;
+		}
+		/* in whole lines */
+		memset(data, 0, sizeof(data));
+		memcpy(data, sfi->sfi_inline, SFS_INLINESIZE);
+		dumpbytes(data, SFS_ROUNDUP(len, 16), 0);
+		return;
+	}
 	traverse(sfi, dumpfileblock);
 }
 
@@ -432,7 +530,7 @@ dumpinode(uint32_t ino, const char *name)
 	char tmp[128];
 	unsigned i;
 
-	diskread(&sfi, ino);
+	readstruct(&sfi, sizeof(sfi), ino);
 
 	printf("Inode %u", ino);
 	if (name != NULL) {
@@ -449,6 +547,13 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	dumpvalf("Flags", "0x%x%s%s%s", SWAP32(sfi.sfi_flags),
+		 (SWAP32(sfi.sfi_flags) & SFS_IFLAG_HASHDIR) ?
+		 " (hashed)" : "",
+		 (SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) ?
+		 " (inline)" : "",
+		 (SWAP32(sfi.sfi_flags) & SFS_IFLAG_PREALLOC) ?
+		 " (preallocated)" : "");
 	printf("\n");
 
         printf("    Direct blocks:\n");
@@ -476,15 +581,22 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
-	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
-		if (sfi.sfi_waste[i] != 0) {
-			printf("    Word %u in waste area: 0x%x\n",
-			       i, SWAP32(sfi.sfi_waste[i]));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
+	for (i=0; i<ARRAYCOUNT(sfi.sfi_inline); i++) {
+		if ((SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) == 0 &&
+		    sfi.sfi_inline[i] != 0) {
+			printf("    Byte %u in inline area: 0x%x\n",
+			       i, (unsigned char)sfi.sfi_inline[i]);
 		}
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
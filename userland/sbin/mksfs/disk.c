@@ -41,14 +41,27 @@
 #include "disk.h"
 
 #define HOSTSTRING "System/161 Disk Image"
-#define BLOCKSIZE  512
+#define SECTORSIZE  512
 
 #ifndef EINTR
 #define EINTR 0
 #endif
 
 static int fd=-1;
-static uint32_t nblocks;
+static uint32_t nblocks;		/* in sectors */
+static uint32_t blocksize = SECTORSIZE;	/* see disksetblocksize */
+
+/*
+ * Reads go through a window of RA_BLOCKS sectors, filled a whole window
+ * at a time, so reading in order (the freemap; blocks that were
+ * allocated together) takes one seek and read per window rather than
+ * one per block. Writes go straight to disk, as many blocks at a time
+ * as the caller has, and into the window too where it has the sectors.
+ */
+#define RA_BLOCKS 64
+
+static char ra_buf[RA_BLOCKS * SECTORSIZE];
+static uint32_t ra_start, ra_count;
 
 /*
  * Open a disk. If we're built for the host OS, check that it's a
@@ -68,7 +81,7 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	nblocks = statbuf.st_size / SECTORSIZE;
 
 #ifdef HOST
 	nblocks--;
@@ -95,13 +108,25 @@ opendisk(const char *path)
 }
 
 /*
- * Return the block size. (This is fixed, but still...)
+ * Return the device's block (sector) size. (This is fixed, but
+ * still...)
  */
 uint32_t
 diskblocksize(void)
 {
 	assert(fd>=0);
-	return BLOCKSIZE;
+	return SECTORSIZE;
+}
+
+/*
+ * Read and write in blocks of SIZE bytes, a multiple of the sector
+ * size, from now on. Block numbers count in those.
+ */
+void
+disksetblocksize(uint32_t size)
+{
+	assert(size >= SECTORSIZE && size % SECTORSIZE == 0);
+	blocksize = size;
 }
 
 /*
@@ -111,32 +136,40 @@ uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nblocks / (blocksize / SECTORSIZE);
 }
 
 /*
- * Write a block.
+ * Write COUNT sectors, with one seek and (usually) one write.
  */
+static
 void
-diskwrite(const void *data, uint32_t block)
+sectorwrite(const void *data, uint32_t block, uint32_t count)
 {
 	const char *cdata = data;
-	uint32_t tot=0;
+	uint32_t tot=0, want = count * SECTORSIZE, i;
 	int len;
 
 	assert(fd>=0);
 
+	for (i=0; i<count; i++) {
+		if (block + i >= ra_start && block + i - ra_start < ra_count) {
+			memcpy(ra_buf + (block + i - ra_start) * SECTORSIZE,
+			       cdata + i * SECTORSIZE, SECTORSIZE);
+		}
+	}
+
 #ifdef HOST
 	// skip over disk file header
 	block++;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, block*SECTORSIZE, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < want) {
+		len = write(fd, cdata + tot, want - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -151,38 +184,89 @@ diskwrite(const void *data, uint32_t block)
 }
 
 /*
- * Read a block.
+ * Read a sector, filling the window starting there first if it isn't
+ * in the window already.
  */
+static
 void
-diskread(void *data, uint32_t block)
+sectorread(void *data, uint32_t block)
 {
-	char *cdata = data;
-	uint32_t tot=0;
+	uint32_t tot=0, want, pos;
 	int len;
 
 	assert(fd>=0);
 
+	if (block < ra_start || block - ra_start >= ra_count) {
+		want = RA_BLOCKS;
+		if (block < nblocks && nblocks - block < want) {
+			want = nblocks - block;
+		}
+		want *= SECTORSIZE;
+
+		pos = block;
 #ifdef HOST
-	// skip over disk file header
-	block++;
+		// skip over disk file header
+		pos++;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
+		if (lseek(fd, pos*SECTORSIZE, SEEK_SET)<0) {
+			err(1, "lseek");
+		}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
-		if (len < 0) {
-			if (errno==EINTR || errno==EAGAIN) {
-				continue;
+		while (tot < want) {
+			len = read(fd, ra_buf + tot, want - tot);
+			if (len < 0) {
+				if (errno==EINTR || errno==EAGAIN) {
+					continue;
+				}
+				err(1, "read");
+			}
+			if (len==0) {
+				break;
 			}
-			err(1, "read");
+			tot += len;
 		}
-		if (len==0) {
-			err(1, "unexpected EOF in mid-sector");
+		if (tot < SECTORSIZE) {
+			errx(1, "unexpected EOF in mid-sector");
 		}
-		tot += len;
+		ra_start = block;
+		ra_count = tot / SECTORSIZE;
+	}
+
+	memcpy(data, ra_buf + (block - ra_start) * SECTORSIZE, SECTORSIZE);
+}
+
+/*
+ * Write a block.
+ */
+void
+diskwrite(const void *data, uint32_t block)
+{
+	diskwriten(data, block, 1);
+}
+
+/*
+ * Write COUNT consecutive blocks starting at BLOCK.
+ */
+void
+diskwriten(const void *data, uint32_t block, uint32_t count)
+{
+	uint32_t spb = blocksize / SECTORSIZE;
+
+	sectorwrite(data, block*spb, count*spb);
+}
+
+/*
+ * Read a block, sector by sector.
+ */
+void
+diskread(void *data, uint32_t block)
+{
+	char *cdata = data;
+	uint32_t spb = blocksize / SECTORSIZE, i;
+
+	for (i=0; i<spb; i++) {
+		sectorread(cdata + i*SECTORSIZE, block*spb + i);
 	}
 }
 
@@ -197,4 +281,6 @@ closedisk(void)
 		err(1, "close");
 	}
 	fd = -1;
+	ra_count = 0;
+	blocksize = SECTORSIZE;
 }
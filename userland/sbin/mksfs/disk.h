@@ -30,9 +30,11 @@
 void opendisk(const char *path);
 
 uint32_t diskblocksize(void);
+void disksetblocksize(uint32_t size);
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
+void diskwriten(const void *data, uint32_t block, uint32_t count);
 void diskread(void *data, uint32_t block);
 
 void closedisk(void);
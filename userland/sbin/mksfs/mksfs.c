@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -57,11 +58,27 @@
 
 #include "disk.h"
 
-/* Maximum size of freemap we support */
-#define MAXFREEMAPBLOCKS 32
+/* Maximum size of freemap we support, in bytes */
+#define MAXFREEMAPBYTES (32 * SFS_BLOCKSIZE)
 
 /* Free block bitmap */
-static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
+static char freemapbuf[MAXFREEMAPBYTES];
+
+/*
+ * Everything mksfs writes is at the front of the volume: the
+ * superblock, the root directory inode, the freemap, and the journal
+ * header. It's put together here and written with one big write at
+ * the end. Nothing else is written: the rest of the volume is free in
+ * the freemap, and the journal is empty per its header, so whatever
+ * is there already is never looked at.
+ */
+#define MAXMETABYTES \
+	((SFS_FREEMAP_START + 1) * SFS_MAXBLOCKSIZE + MAXFREEMAPBYTES)
+static char metabuf[MAXMETABYTES];
+static uint32_t metablocks;
+
+/* Size of the volume's blocks (-b) */
+static uint32_t fsblocksize = SFS_BLOCKSIZE;
 
 /*
  * Assert that the on-disk data structures are correctly sized.
@@ -75,6 +92,22 @@ check(void)
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
 }
 
+/*
+ * Put a structure of LEN bytes (at most a block) at the start of
+ * block BLOCK, the rest being zeros, in metabuf.
+ */
+static
+void
+writestruct(const void *data, size_t len, uint32_t block)
+{
+	assert(len <= fsblocksize);
+	assert((block + 1) * fsblocksize <= MAXMETABYTES);
+	memcpy(metabuf + block * fsblocksize, data, len);
+	if (block >= metablocks) {
+		metablocks = block + 1;
+	}
+}
+
 /*
  * Mark a block allocated.
  */
@@ -96,13 +129,13 @@ static
 void
 initfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks);
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks, fsblocksize);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, fsblocksize);
 	uint32_t i;
 
-	if (freemapblocks > MAXFREEMAPBLOCKS) {
+	if (freemapblocks * fsblocksize > MAXFREEMAPBYTES) {
 		errx(1, "Filesystem too large -- "
-		     "increase MAXFREEMAPBLOCKS and recompile");
+		     "increase MAXFREEMAPBYTES and recompile");
 	}
 
 	/* mark the superblock and root inode in use */
@@ -120,12 +153,39 @@ initfreemap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Set aside the journal, right after the freemap, and write out its
+ * header empty. Returns the block it starts at.
+ */
+static
+uint32_t
+initjournal(uint32_t fsblocks)
+{
+	struct sfs_jheader jh;
+	uint32_t start, i;
+
+	assert(sizeof(jh) == SFS_BLOCKSIZE);
+
+	start = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(fsblocks, fsblocksize);
+	if (fsblocks < start + SFS_JOURNAL_SIZE * 2) {
+		errx(1, "Volume too small for a journal");
+	}
+	for (i=0; i<SFS_JOURNAL_SIZE; i++) {
+		allocblock(start + i);
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	writestruct(&jh, sizeof(jh), start);
+	return start;
+}
+
 /*
  * Initialize and write out the superblock.
  */
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks, uint32_t features,
+	   uint32_t journalstart)
 {
 	struct sfs_superblock sb;
 
@@ -140,27 +200,36 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_features = SWAP32(features);
+	sb.sb_clean = SWAP32(SFS_CLEAN);
+	if (features & SFS_FEATURE_JOURNAL) {
+		sb.sb_journalstart = SWAP32(journalstart);
+		sb.sb_journalblocks = SWAP32(SFS_JOURNAL_SIZE);
+	}
+	if (features & SFS_FEATURE_BLOCKSIZE) {
+		sb.sb_blocksize = SWAP32(fsblocksize);
+	}
 
 	/* and write it out. */
-	diskwrite(&sb, SFS_SUPER_BLOCK);
+	writestruct(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 }
 
 /*
- * Write out the free block bitmap.
+ * Put the free block bitmap in metabuf.
  */
 static
 void
 writefreemap(uint32_t fsblocks)
 {
 	uint32_t freemapblocks;
-	char *ptr;
-	uint32_t i;
 
-	/* Write out each of the blocks in the free block bitmap. */
-	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
-	for (i=0; i<freemapblocks; i++) {
-		ptr = freemapbuf + i*SFS_BLOCKSIZE;
-		diskwrite(ptr, SFS_FREEMAP_START+i);
+	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, fsblocksize);
+	assert((SFS_FREEMAP_START + freemapblocks) * fsblocksize
+	       <= MAXMETABYTES);
+	memcpy(metabuf + SFS_FREEMAP_START * fsblocksize, freemapbuf,
+	       freemapblocks * fsblocksize);
+	if (SFS_FREEMAP_START + freemapblocks > metablocks) {
+		metablocks = SFS_FREEMAP_START + freemapblocks;
 	}
 }
 
@@ -180,7 +249,7 @@ writerootdir(void)
 	sfi.sfi_linkcount = SWAP16(1);
 
 	/* Write it out */
-	diskwrite(&sfi, SFS_ROOTDIR_INO);
+	writestruct(&sfi, sizeof(sfi), SFS_ROOTDIR_INO);
 }
 
 /*
@@ -189,15 +258,53 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, features, journalstart;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/*
+	 * -H: let directories be hashed; -J: journal the metadata;
+	 * -I: keep small files in their inodes;
+	 * -b size: use blocks of SIZE bytes
+	 */
+	features = 0;
+	while (argc > 3 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-H")) {
+			features |= SFS_FEATURE_HASHDIRS;
+		}
+		else if (!strcmp(argv[1], "-J")) {
+			features |= SFS_FEATURE_JOURNAL;
+		}
+		else if (!strcmp(argv[1], "-I")) {
+			features |= SFS_FEATURE_INLINE;
+		}
+		else if (!strcmp(argv[1], "-b") && argc > 4) {
+			fsblocksize = atoi(argv[2]);
+			argc--;
+			argv++;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-H] [-J] [-I] [-b blocksize] "
+		     "device/diskfile volume-name");
+	}
+
+	if (fsblocksize < SFS_BLOCKSIZE || fsblocksize > SFS_MAXBLOCKSIZE ||
+	    (fsblocksize & (fsblocksize - 1)) != 0) {
+		errx(1, "Block size must be a power of 2 from %u to %u",
+		     SFS_BLOCKSIZE, SFS_MAXBLOCKSIZE);
+	}
+	if (fsblocksize != SFS_BLOCKSIZE) {
+		features |= SFS_FEATURE_BLOCKSIZE;
 	}
 
 	check();
@@ -226,13 +333,19 @@ main(int argc, char **argv)
 		errx(1, "Device has wrong blocksize %u (should be %u)\n",
 		     blocksize, SFS_BLOCKSIZE);
 	}
+	disksetblocksize(fsblocksize);
 	size = diskblocks();
 
 	/* Write out the on-disk structures */
 	initfreemap(size);
-	writesuper(volname, size);
+	journalstart = 0;
+	if (features & SFS_FEATURE_JOURNAL) {
+		journalstart = initjournal(size);
+	}
+	writesuper(volname, size, features, journalstart);
 	writefreemap(size);
 	writerootdir();
+	diskwriten(metabuf, 0, metablocks);
 
 	closedisk();
 
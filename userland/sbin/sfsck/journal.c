@@ -0,0 +1,112 @@
+/*
+ * Replaying the metadata journal (see kern/sfs.h).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "utils.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+/*
+ * Add LEN bytes at DATA to the checksum SUM. As in the kernel, this is
+ * over the bytes as they are on disk.
+ */
+static
+uint32_t
+journal_sum(uint32_t sum, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		sum ^= p[i];
+		sum *= SFS_DIRHASH_PRIME;
+	}
+	return sum;
+}
+
+/*
+ * If the journal holds a committed transaction, write its blocks home,
+ * and then clear it so the kernel doesn't do it again.
+ */
+void
+journal_replay(void)
+{
+	/* the header and commit records start blocks that may be bigger */
+	union {
+		struct sfs_jheader jh;
+		char block[SFS_MAXBLOCKSIZE];
+	} hd;
+	union {
+		struct sfs_jcommit jc;
+		char block[SFS_MAXBLOCKSIZE];
+	} cm;
+	struct sfs_jheader *jh = &hd.jh;
+	struct sfs_jcommit *jc = &cm.jc;
+	uint32_t start, end, n, i, sum, home, blocksize;
+	char *blocks;
+
+	if ((sb_features() & SFS_FEATURE_JOURNAL) == 0) {
+		return;
+	}
+	start = sb_journalstart();
+	end = start + sb_journalblocks();
+	blocksize = sb_blocksize();
+
+	diskread(&hd, start);
+	if (SWAP32(jh->jh_magic) != SFS_JMAGIC) {
+		return;
+	}
+	n = SWAP32(jh->jh_nblocks);
+	if (n == 0 || n > SFS_JHOMES) {
+		goto clear;
+	}
+	diskread(&cm, start + 1 + n);
+	if (SWAP32(jc->jc_magic) != SFS_JCMAGIC ||
+	    jc->jc_seq != jh->jh_seq || SWAP32(jc->jc_nblocks) != n) {
+		/* never committed */
+		goto clear;
+	}
+
+	blocks = domalloc(n * blocksize);
+	sum = journal_sum(SFS_DIRHASH_BASIS, jh->jh_home, n * sizeof(uint32_t));
+	for (i=0; i<n; i++) {
+		diskread(blocks + i*blocksize, start + 1 + i);
+		sum = journal_sum(sum, blocks + i*blocksize, blocksize);
+	}
+	if (sum != SWAP32(jc->jc_sum)) {
+		/* never committed either */
+		free(blocks);
+		goto clear;
+	}
+
+	for (i=0; i<n; i++) {
+		home = SWAP32(jh->jh_home[i]);
+		if (home == SFS_SUPER_BLOCK || home >= sb_totalblocks() ||
+		    (home >= start && home < end)) {
+			warnx("Journal has block %lu going to %lu; "
+			      "not replaying it",
+			      (unsigned long)i, (unsigned long)home);
+			setbadness(EXIT_RECOV);
+			free(blocks);
+			goto clear;
+		}
+	}
+	for (i=0; i<n; i++) {
+		diskwrite(blocks + i*blocksize, SWAP32(jh->jh_home[i]));
+	}
+	free(blocks);
+	warnx("Replayed %lu blocks from the journal", (unsigned long)n);
+
+ clear:
+	jh->jh_magic = 0;
+	diskwrite(&hd, start);
+}
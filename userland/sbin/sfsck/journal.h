@@ -0,0 +1,12 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * The journal module replays the metadata journal, on volumes that
+ * have one, the way the kernel would when mounting. Call after loading
+ * the superblock and before checking anything else.
+ */
+
+void journal_replay(void);
+
+#endif /* JOURNAL_H */
@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 
 #include "compat.h"
@@ -40,9 +41,11 @@
 #include "freemap.h"
 #include "inode.h"
 #include "passes.h"
+#include "journal.h"
 #include "main.h"
 
 static int badness=0;
+static int force=0;
 
 /*
  * Update the badness state. (codes are in main.h)
@@ -69,14 +72,32 @@ main(int argc, char **argv)
 #endif
 
 	/* FUTURE: add -n option */
+	if (argc==3 && !strcmp(argv[1], "-f")) {
+		force = 1;
+		argv++;
+		argc--;
+	}
 	if (argc!=2) {
-		errx(EXIT_USAGE, "Usage: sfsck device/diskfile");
+		errx(EXIT_USAGE, "Usage: sfsck [-f] device/diskfile");
 	}
 
 	opendisk(argv[1]);
 
 	sfs_setup();
 	sb_load();
+
+	/*
+	 * A volume that was unmounted cleanly doesn't need checking,
+	 * unless we're told to anyway (-f).
+	 */
+	if (!force && sb_isclean()) {
+		closedisk();
+		warnx("%s: clean, not checked (use -f to check anyway)",
+		      argv[1]);
+		return EXIT_CLEAN;
+	}
+
+	journal_replay();
 	sb_check();
 	freemap_setup();
 
@@ -91,6 +112,11 @@ main(int argc, char **argv)
 	printf("Phase 3 -- check reference counts\n");
 	inode_adjust_filelinks();
 
+	/* Anything that could be fixed has been */
+	if (badness != EXIT_UNRECOV) {
+		sb_setclean();
+	}
+
 	closedisk();
 
 	warnx("%lu blocks used (of %lu); %lu directories; %lu files",
@@ -54,10 +54,11 @@ static unsigned long count_dirs=0, count_files=0;
  */
 struct ibstate {
 	uint32_t ino;		/* inode we're doing (constant) */
-	uint32_t curfileblock;	/* current block offset in the file */
+	uint64_t curfileblock;	/* current block offset in the file */
 	uint32_t fileblocks;	/* file size in blocks (constant) */
 	uint32_t volblocks;	/* volume size in blocks (constant) */
 	unsigned pasteofcount;	/* number of blocks found past eof */
+	int keeppasteof;	/* ... which are preallocated, so keep */
 	blockusage_t usagetype;	/* how to call freemap_blockinuse() */
 };
 
@@ -81,9 +82,10 @@ void
 check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		     int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t dbperidb = SFS_DBPERIDB(sb_blocksize());
 	uint32_t i, ct;
-	uint32_t coveredblocks;
+	uint64_t coveredblocks;
 	int localchanged = 0;
 	int j;
 
@@ -105,14 +107,14 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		}
 		coveredblocks = 1;
 		for (j=0; j<indirection; j++) {
-			coveredblocks *= SFS_DBPERIDB;
+			coveredblocks *= dbperidb;
 		}
 		ibs->curfileblock += coveredblocks;
 		return;
 	}
 
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			check_indirect_block(ibs, &entries[i], &localchanged,
 					     indirection-1);
 		}
@@ -120,7 +122,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			if (entries[i] >= ibs->volblocks) {
 				setbadness(EXIT_RECOV);
 				warnx("Inode %lu: direct block pointer for "
@@ -133,7 +135,8 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 				localchanged = 1;
 			}
 			else if (entries[i] != 0) {
-				if (ibs->curfileblock < ibs->fileblocks) {
+				if (ibs->curfileblock < ibs->fileblocks ||
+				    ibs->keeppasteof) {
 					freemap_blockinuse(entries[i],
 							  ibs->usagetype,
 							  ibs->ino);
@@ -151,7 +154,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<dbperidb; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
@@ -189,13 +192,20 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	int changed;
 	int i;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
+	size = SFS_ROUNDUP(sfi->sfi_size, sb_blocksize());
 
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
-	ibs.fileblocks = size/SFS_BLOCKSIZE;
+	ibs.fileblocks = size/sb_blocksize();
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		/* its data is in the inode, so any blocks are extra */
+		ibs.fileblocks = 0;
+	}
 	ibs.volblocks = sb_totalblocks();
 	ibs.pasteofcount = 0;
+	ibs.keeppasteof = (sfi->sfi_flags &
+			   (SFS_IFLAG_PREALLOC | SFS_IFLAG_INLINE)) ==
+		SFS_IFLAG_PREALLOC;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
 
 	changed = 0;
@@ -214,7 +224,8 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 			changed = 1;
 		}
 		else if (datablock > 0) {
-			if (ibs.curfileblock < ibs.fileblocks) {
+			if (ibs.curfileblock < ibs.fileblocks ||
+			    ibs.keeppasteof) {
 				freemap_blockinuse(datablock, ibs.usagetype,
 						   ibs.ino);
 			}
@@ -270,8 +281,75 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 
 	freemap_blockinuse(ino, B_INODE, ino);
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
-		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
+	if (sfi->sfi_flags & ~(SFS_IFLAG_HASHDIR | SFS_IFLAG_INLINE |
+			       SFS_IFLAG_PREALLOC)) {
+		warnx("Inode %lu: Unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long) (sfi->sfi_flags &
+				       ~(SFS_IFLAG_HASHDIR | SFS_IFLAG_INLINE |
+					 SFS_IFLAG_PREALLOC)));
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IFLAG_HASHDIR | SFS_IFLAG_INLINE |
+			SFS_IFLAG_PREALLOC;
+		changed = 1;
+	}
+	if ((sfi->sfi_flags & SFS_IFLAG_HASHDIR) &&
+	    (!isdir || (sb_features() & SFS_FEATURE_HASHDIRS) == 0)) {
+		warnx("Inode %lu: Hashed but %s (cleared)",
+		      (unsigned long) ino,
+		      isdir ? "volume has no hashed directories"
+		      : "not a directory");
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IFLAG_HASHDIR;
+		changed = 1;
+	}
+
+	/* Without the flag, any blocks past EOF are freed below */
+	if ((sfi->sfi_flags & SFS_IFLAG_PREALLOC) &&
+	    (isdir || (sb_features() & SFS_FEATURE_PREALLOC) == 0)) {
+		warnx("Inode %lu: Preallocated but %s (cleared)",
+		      (unsigned long) ino,
+		      isdir ? "a directory"
+		      : "volume has no preallocation");
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IFLAG_PREALLOC;
+		changed = 1;
+	}
+
+	/*
+	 * Clearing the inline flag leaves a file of zeros, as the data
+	 * in the inode is then cleared below.
+	 */
+	if ((sfi->sfi_flags & SFS_IFLAG_INLINE) &&
+	    (isdir || (sb_features() & SFS_FEATURE_INLINE) == 0)) {
+		warnx("Inode %lu: Inline but %s (cleared)",
+		      (unsigned long) ino,
+		      isdir ? "a directory"
+		      : "volume has no inline files");
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IFLAG_INLINE;
+		changed = 1;
+	}
+	if ((sfi->sfi_flags & SFS_IFLAG_INLINE) &&
+	    sfi->sfi_size > SFS_INLINESIZE) {
+		warnx("Inode %lu: Inline but %lu bytes long (truncated)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_size);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_size = SFS_INLINESIZE;
+		changed = 1;
+	}
+
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		if (checkzeroed(sfi->sfi_inline + sfi->sfi_size,
+				SFS_INLINESIZE - sfi->sfi_size)) {
+			warnx("Inode %lu: Inline data past EOF not zeroed "
+			      "(fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+	}
+	else if (checkzeroed(sfi->sfi_inline, sizeof(sfi->sfi_inline))) {
+		warnx("Inode %lu: sfi_inline section not zeroed (fixed)",
 		      (unsigned long) ino);
 		setbadness(EXIT_RECOV);
 		changed = 1;
@@ -47,6 +47,63 @@
 #include "passes.h"
 #include "main.h"
 
+/*
+ * Check that each entry of a hashed directory is in its bucket, and
+ * move the ones that aren't (e.g. the ones pass2_dir just added) if
+ * there's room; if there isn't, or the size is wrong for a hashed
+ * directory, make it a plain directory, which it is already but for
+ * the flag. Nothing can be allocated here.
+ *
+ * Sets *DCHANGED if entries were moved, and returns nonzero if SFI
+ * was changed.
+ */
+static
+int
+pass2_hashdir(struct sfs_dinode *sfi, struct sfs_direntry *direntries,
+	      uint32_t ndirentries, const char *pathsofar, int *dchanged)
+{
+	uint32_t nbuckets, home, i;
+	uint32_t perblock = SFS_DIRPERBLOCK(sb_blocksize());
+
+	if (sfi->sfi_size == 0 || sfi->sfi_size % sb_blocksize() != 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: Invalid size %lu for hashed directory "
+		      "(made unhashed)", pathsofar,
+		      (unsigned long) sfi->sfi_size);
+		sfi->sfi_flags &= ~SFS_IFLAG_HASHDIR;
+		return 1;
+	}
+	nbuckets = ndirentries / perblock;
+
+	for (i=0; i<ndirentries; i++) {
+		if (direntries[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		home = sfsdir_hash(direntries[i].sfd_name) % nbuckets;
+		if (i / perblock == home) {
+			continue;
+		}
+
+		if (sfsdir_tryadd(direntries + home*perblock,
+				  perblock, direntries[i].sfd_name,
+				  direntries[i].sfd_ino)) {
+			setbadness(EXIT_RECOV);
+			warnx("Directory %s: No room for %s in its hash "
+			      "bucket (made unhashed)", pathsofar,
+			      direntries[i].sfd_name);
+			sfi->sfi_flags &= ~SFS_IFLAG_HASHDIR;
+			return 1;
+		}
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: %s in the wrong hash bucket (moved)",
+		      pathsofar, direntries[i].sfd_name);
+		direntries[i].sfd_ino = SFS_NOINO;
+		bzero(direntries[i].sfd_name, sizeof(direntries[i].sfd_name));
+		*dchanged = 1;
+	}
+	return 0;
+}
+
 /*
  * Process a directory. INO is the inode number; PARENTINO is the
  * parent's inode number; PATHSOFAR is the path to this directory.
@@ -84,7 +141,7 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_direntry);
 	maxdirentries = SFS_ROUNDUP(ndirentries,
-				    SFS_BLOCKSIZE/sizeof(struct sfs_direntry));
+				    SFS_DIRPERBLOCK(sb_blocksize()));
 	dirsize = maxdirentries * sizeof(struct sfs_direntry);
 	direntries = domalloc(dirsize);
 
@@ -297,6 +354,17 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	/*
+	 * Check the hashing, now that the entries are settled.
+	 */
+
+	if (sfi.sfi_flags & SFS_IFLAG_HASHDIR) {
+		if (pass2_hashdir(&sfi, direntries, ndirentries, pathsofar,
+				  &dchanged)) {
+			ichanged = 1;
+		}
+	}
+
 	/*
 	 * Write back anything that changed, clean up, and return.
 	 */
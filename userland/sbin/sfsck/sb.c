@@ -36,6 +36,7 @@
 #include "compat.h"
 #include <kern/sfs.h>
 
+#include "disk.h"
 #include "utils.h"
 #include "sfs.h"
 #include "sb.h"
@@ -45,18 +46,45 @@
 static struct sfs_superblock sb;
 
 /*
- * Load the superblock.
+ * Load the superblock. Until this is done the volume's block size
+ * reads as SFS_BLOCKSIZE, so the superblock itself is read as one
+ * sector; then we tell the disk code the real block size.
  */
 void
 sb_load(void)
 {
+	uint32_t blocksize;
+
 	sfs_readsb(SFS_SUPER_BLOCK, &sb);
 	if (sb.sb_magic != SFS_MAGIC) {
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
+	if (sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		errx(EXIT_FATAL, "Unknown filesystem features 0x%lx",
+		     (unsigned long) (sb.sb_features & ~SFS_FEATURES_KNOWN));
+	}
+
+	blocksize = SFS_SB_BLOCKSIZE(&sb);
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(EXIT_FATAL, "Invalid block size %lu",
+		     (unsigned long) blocksize);
+	}
+	disksetblocksize(blocksize);
 
 	assert(sb.sb_nblocks > 0);
-	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
+	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize) > 0);
+
+	if ((sb.sb_features & SFS_FEATURE_JOURNAL) &&
+	    (sb.sb_journalblocks < SFS_JOURNAL_SIZE ||
+	     sb.sb_journalblocks > sb.sb_nblocks ||
+	     sb.sb_journalstart < SFS_FREEMAP_START +
+	     SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize) ||
+	     sb.sb_journalstart > sb.sb_nblocks - sb.sb_journalblocks)) {
+		errx(EXIT_FATAL, "Bad journal (%lu blocks at %lu)",
+		     (unsigned long) sb.sb_journalblocks,
+		     (unsigned long) sb.sb_journalstart);
+	}
 }
 
 /*
@@ -95,6 +123,27 @@ sb_check(void)
 	}
 }
 
+/*
+ * Check if the volume was unmounted cleanly (see kern/sfs.h).
+ */
+int
+sb_isclean(void)
+{
+	return sb.sb_clean == SFS_CLEAN;
+}
+
+/*
+ * Mark the volume clean, once it's been checked.
+ */
+void
+sb_setclean(void)
+{
+	if (sb.sb_clean != SFS_CLEAN) {
+		sb.sb_clean = SFS_CLEAN;
+		sfs_writesb(SFS_SUPER_BLOCK, &sb);
+	}
+}
+
 /*
  * Return the total number of blocks in the volume.
  */
@@ -104,6 +153,15 @@ sb_totalblocks(void)
 	return sb.sb_nblocks;
 }
 
+/*
+ * Return the size of the volume's blocks.
+ */
+uint32_t
+sb_blocksize(void)
+{
+	return SFS_SB_BLOCKSIZE(&sb);
+}
+
 /*
  * Return the number of freemap blocks.
  * (this function probably ought to go away)
@@ -111,7 +169,7 @@ sb_totalblocks(void)
 uint32_t
 sb_freemapblocks(void)
 {
-	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
+	return SFS_FREEMAPBLOCKS(sb.sb_nblocks, sb_blocksize());
 }
 
 /*
@@ -122,3 +180,31 @@ sb_volname(void)
 {
 	return sb.sb_volname;
 }
+
+/*
+ * Return the feature flags.
+ */
+uint32_t
+sb_features(void)
+{
+	return sb.sb_features;
+}
+
+/*
+ * Return where the journal starts, and how long it is (0 if there
+ * isn't one).
+ */
+uint32_t
+sb_journalstart(void)
+{
+	return sb.sb_journalstart;
+}
+
+uint32_t
+sb_journalblocks(void)
+{
+	if ((sb.sb_features & SFS_FEATURE_JOURNAL) == 0) {
+		return 0;
+	}
+	return sb.sb_journalblocks;
+}
@@ -43,13 +43,29 @@ void sb_load(void);
 /* After the superblock is loaded: return volume size. */
 uint32_t sb_totalblocks(void);
 
+/* After the superblock is loaded: return the block size. */
+uint32_t sb_blocksize(void);
+
 /* After the superblock is loaded: return number of freemap blocks. */
 uint32_t sb_freemapblocks(void);
 
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
+/* After the superblock is loaded: return the SFS_FEATURE_* flags. */
+uint32_t sb_features(void);
+
+/* After the superblock is loaded: where the journal is, if any. */
+uint32_t sb_journalstart(void);
+uint32_t sb_journalblocks(void);
+
 /* Check the superblock. Must load it first. */
 void sb_check(void);
 
+/* After the superblock is loaded: was it unmounted cleanly? */
+int sb_isclean(void);
+
+/* Mark the volume clean. */
+void sb_setclean(void);
+
 #endif /* SB_H */
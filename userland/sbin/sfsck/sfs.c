@@ -40,6 +40,7 @@
 #include "utils.h"
 #include "ibmacros.h"
 #include "sfs.h"
+#include "sb.h"
 #include "main.h"
 
 ////////////////////////////////////////////////////////////
@@ -62,6 +63,11 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_features = SWAP32(sb->sb_features);
+	sb->sb_clean = SWAP32(sb->sb_clean);
+	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
+	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+	sb->sb_blocksize = SWAP32(sb->sb_blocksize);
 }
 
 static
@@ -97,6 +103,8 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
 }
 
 static
@@ -110,8 +118,8 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	uint32_t i;
+	for (i=0; i<SFS_DBPERIDB(sb_blocksize()); i++) {
 		entries[i] = SWAP32(entries[i]);
 	}
 }
@@ -132,7 +140,8 @@ static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t dbperidb = SFS_DBPERIDB(sb_blocksize());
 
 	if (iblock == 0) {
 		return 0;
@@ -144,10 +153,10 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset, entrysize/dbperidb);
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < dbperidb);
 		return entries[offset];
 	}
 }
@@ -187,6 +196,34 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 ////////////////////////////////////////////////////////////
 // superblock, free block bitmap, and inode I/O
 
+/*
+ * The superblock and inodes are SFS_BLOCKSIZE bytes at the start of
+ * their (maybe bigger) block; read and write them through a full
+ * block. The rest of the block is zeros.
+ */
+static
+void
+readstruct(void *data, size_t len, uint32_t block)
+{
+	static char blockbuf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= sb_blocksize());
+	diskread(blockbuf, block);
+	memcpy(data, blockbuf, len);
+}
+
+static
+void
+writestruct(const void *data, size_t len, uint32_t block)
+{
+	static char blockbuf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= sb_blocksize());
+	bzero(blockbuf, sb_blocksize());
+	memcpy(blockbuf, data, len);
+	diskwrite(blockbuf, block);
+}
+
 /*
  *  superblock - blocknum is a disk block number.
  */
@@ -194,7 +231,7 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 void
 sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb)
 {
-	diskread(sb, blocknum);
+	readstruct(sb, sizeof(*sb), blocknum);
 	swapsb(sb);
 }
 
@@ -202,7 +239,7 @@ void
 sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 {
 	swapsb(sb);
-	diskwrite(sb, blocknum);
+	writestruct(sb, sizeof(*sb), blocknum);
 	swapsb(sb);
 }
 
@@ -233,7 +270,7 @@ sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits)
 void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	diskread(sfi, ino);
+	readstruct(sfi, sizeof(*sfi), ino);
 	swapinode(sfi);
 }
 
@@ -241,7 +278,7 @@ void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
 	swapinode(sfi);
-	diskwrite(sfi, ino);
+	writestruct(sfi, sizeof(*sfi), ino);
 	swapinode(sfi);
 }
 
@@ -274,7 +311,7 @@ static
 void
 sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = SFS_DIRPERBLOCK(sb_blocksize());
 	unsigned j;
 
 	if (diskblock != 0) {
@@ -285,7 +322,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 	}
 	else {
 		warnx("Warning: sparse directory found");
-		bzero(d, SFS_BLOCKSIZE);
+		bzero(d, sb_blocksize());
 	}
 }
 
@@ -297,7 +334,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = SFS_DIRPERBLOCK(sb_blocksize());
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
@@ -330,7 +367,7 @@ static
 void
 sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = SFS_DIRPERBLOCK(sb_blocksize());
 	unsigned j, bad;
 
 	if (diskblock != 0) {
@@ -362,7 +399,7 @@ sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = SFS_DIRPERBLOCK(sb_blocksize());
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
@@ -442,6 +479,20 @@ sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector)
 	qsort(vector, nd, sizeof(int), dirsortfunc);
 }
 
+/*
+ * Hash a name for a hashed directory; see <kern/sfs.h>.
+ */
+uint32_t
+sfsdir_hash(const char *name)
+{
+	uint32_t hash = SFS_DIRHASH_BASIS;
+
+	for (; *name != 0; name++) {
+		hash = (hash ^ (unsigned char)*name) * SFS_DIRHASH_PRIME;
+	}
+	return hash;
+}
+
 /*
  * Try to add an entry NAME/INO to D (which has ND entries) by
  * finding an empty slot. Cannot allocate new space.
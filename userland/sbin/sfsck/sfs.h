@@ -77,5 +77,8 @@ int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 /* Sort a directory by creating a permutation vector. */
 void sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector);
 
+/* Hash a name, for finding its bucket in a hashed directory. */
+uint32_t sfsdir_hash(const char *name);
+
 
 #endif /* SFS_H */
@@ -0,0 +1,463 @@
+/*
+ * fsbench - file system throughput benchmarks.
+ *
+ * Usage: fsbench [-s kbytes] [-r ios] [-f files] [-c copies] [test...]
+ *
+ * where the tests are:
+ *    seq     sequential write (including fsync) and then read of a
+ *            file, at several block sizes;
+ *    rand    512-byte reads and writes at random places in a file;
+ *    meta    creating, looking up (with stat), and removing the files
+ *            of a directory.
+ * The default is all of them. -s gives the file size in kilobytes for
+ * seq and rand (default 1024), -r the number of random I/Os (default
+ * 1024), and -f the number of files for meta (default 128). With -c,
+ * that many copies run at once, each in its own files, and each
+ * reports for itself.
+ *
+ * Each result is one line on stdout: the test name and then
+ * space-separated name=value pairs, starting with which copy it is
+ * and ending with the elapsed milliseconds and a rate: kbps= (and the
+ * same in mbps=) for the sequential tests, and ops= (per second) for
+ * the others. For example:
+ *
+ *    seq copy=0 op=read bs=4096 bytes=1048576 ms=210 kbps=4876 mbps=4.76
+ *
+ * Times are wall-clock times from __time. The file system under test
+ * is whichever one holds the current directory.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define MAXBLOCK	65536
+#define RANDIO		512
+
+static unsigned filekb = 1024;
+static unsigned numios = 1024;
+static unsigned numfiles = 128;
+static unsigned numcopies = 1;
+static unsigned me;
+static const char *myname;
+
+static char buf[MAXBLOCK];
+
+////////////////////////////////////////////////////////////
+// Measuring
+
+struct stopwatch {
+	time_t sw_secs;
+	unsigned long sw_nsecs;
+};
+
+static
+void
+sw_start(struct stopwatch *sw)
+{
+	__time(&sw->sw_secs, &sw->sw_nsecs);
+}
+
+/*
+ * Return the milliseconds since SW was started, at least 1 so rates
+ * can be figured from it.
+ */
+static
+unsigned long
+sw_ms(const struct stopwatch *sw)
+{
+	time_t secs;
+	unsigned long nsecs, ms;
+
+	__time(&secs, &nsecs);
+
+	/* secs.nsecs -= sw_secs.sw_nsecs */
+	if (nsecs < sw->sw_nsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	nsecs -= sw->sw_nsecs;
+	secs -= sw->sw_secs;
+	ms = secs * 1000 + nsecs / 1000000;
+	return ms > 0 ? ms : 1;
+}
+
+/*
+ * Return AMOUNT per second, given that it took MS milliseconds,
+ * without overflowing 32 bits (userland has no 64-bit division).
+ */
+static
+unsigned long
+persec(unsigned long amount, unsigned long ms)
+{
+	return (amount / ms) * 1000 + ((amount % ms) * 1000) / ms;
+}
+
+static
+void
+report_ops(const struct stopwatch *sw, unsigned count)
+{
+	unsigned long ms;
+
+	ms = sw_ms(sw);
+	printf("ms=%lu ops=%lu\n", ms, persec(count, ms));
+}
+
+static
+void
+report_seq(const struct stopwatch *sw, const char *op, unsigned bs,
+	   unsigned long bytes)
+{
+	unsigned long ms, kbps;
+
+	ms = sw_ms(sw);
+	kbps = persec(bytes / 1024, ms);
+	printf("seq copy=%u op=%s bs=%u bytes=%lu ms=%lu kbps=%lu "
+	       "mbps=%lu.%02lu\n", me, op, bs, bytes, ms,
+	       kbps, kbps / 1024, (kbps % 1024) * 100 / 1024);
+}
+
+////////////////////////////////////////////////////////////
+// Files
+
+/*
+ * Name a file or directory for this copy.
+ */
+static
+const char *
+myfile(const char *what, unsigned num)
+{
+	static char name[64];
+
+	snprintf(name, sizeof(name), "fsbench-%u-%s%u", me, what, num);
+	return name;
+}
+
+static
+int
+doopen(const char *path, int flags)
+{
+	int fd;
+
+	fd = open(path, flags, 0664);
+	if (fd < 0) {
+		err(1, "%s", path);
+	}
+	return fd;
+}
+
+static
+void
+dowrite(const char *path, int fd, size_t len)
+{
+	ssize_t r;
+
+	r = write(fd, buf, len);
+	if (r < 0) {
+		err(1, "%s: write", path);
+	}
+	if ((size_t)r != len) {
+		errx(1, "%s: write: short count", path);
+	}
+}
+
+static
+void
+doread(const char *path, int fd, size_t len)
+{
+	ssize_t r;
+
+	r = read(fd, buf, len);
+	if (r < 0) {
+		err(1, "%s: read", path);
+	}
+	if ((size_t)r != len) {
+		errx(1, "%s: read: short count", path);
+	}
+}
+
+static
+void
+dolseek(const char *path, int fd, off_t pos)
+{
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "%s: lseek", path);
+	}
+}
+
+/*
+ * Make a file of filekb kilobytes.
+ */
+static
+void
+makefile(const char *path)
+{
+	unsigned i;
+	int fd;
+
+	fd = doopen(path, O_WRONLY|O_CREAT|O_TRUNC);
+	for (i=0; i<filekb; i++) {
+		dowrite(path, fd, 1024);
+	}
+	close(fd);
+}
+
+////////////////////////////////////////////////////////////
+// Tests
+
+static
+void
+test_seq(void)
+{
+	static const unsigned sizes[] = { 512, 4096, 16384, MAXBLOCK };
+	struct stopwatch sw;
+	unsigned long bytes;
+	unsigned i, j, bs, count;
+	const char *path;
+	int fd;
+
+	path = myfile("seq", 0);
+	bytes = filekb * 1024UL;
+	memset(buf, 'f', sizeof(buf));
+
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		bs = sizes[i];
+		if (bs > bytes) {
+			break;
+		}
+		count = bytes / bs;
+
+		sw_start(&sw);
+		fd = doopen(path, O_WRONLY|O_CREAT|O_TRUNC);
+		for (j=0; j<count; j++) {
+			dowrite(path, fd, bs);
+		}
+		if (fsync(fd) < 0) {
+			err(1, "%s: fsync", path);
+		}
+		close(fd);
+		report_seq(&sw, "write", bs, (unsigned long)count * bs);
+
+		sw_start(&sw);
+		fd = doopen(path, O_RDONLY);
+		for (j=0; j<count; j++) {
+			doread(path, fd, bs);
+		}
+		close(fd);
+		report_seq(&sw, "read", bs, (unsigned long)count * bs);
+	}
+
+	remove(path);
+}
+
+static
+void
+test_rand(void)
+{
+	struct stopwatch sw;
+	unsigned i, nblocks;
+	const char *path;
+	int fd;
+
+	path = myfile("rand", 0);
+	nblocks = filekb * 1024 / RANDIO;
+	memset(buf, 'r', sizeof(buf));
+	makefile(path);
+
+	fd = doopen(path, O_RDWR);
+
+	srandom(me + 1);
+	sw_start(&sw);
+	for (i=0; i<numios; i++) {
+		dolseek(path, fd, (off_t)(random() % nblocks) * RANDIO);
+		doread(path, fd, RANDIO);
+	}
+	printf("rand copy=%u op=read bs=%u ios=%u ", me, RANDIO, numios);
+	report_ops(&sw, numios);
+
+	sw_start(&sw);
+	for (i=0; i<numios; i++) {
+		dolseek(path, fd, (off_t)(random() % nblocks) * RANDIO);
+		dowrite(path, fd, RANDIO);
+	}
+	if (fsync(fd) < 0) {
+		err(1, "%s: fsync", path);
+	}
+	printf("rand copy=%u op=write bs=%u ios=%u ", me, RANDIO, numios);
+	report_ops(&sw, numios);
+
+	close(fd);
+	remove(path);
+}
+
+static
+void
+test_meta(void)
+{
+	struct stopwatch sw;
+	struct stat st;
+	char dir[64];
+	char path[128];
+	unsigned i;
+	int fd;
+
+	strcpy(dir, myfile("dir", 0));
+	if (mkdir(dir, 0775) < 0) {
+		err(1, "%s: mkdir", dir);
+	}
+
+	sw_start(&sw);
+	for (i=0; i<numfiles; i++) {
+		snprintf(path, sizeof(path), "%s/f%u", dir, i);
+		fd = doopen(path, O_WRONLY|O_CREAT|O_EXCL);
+		close(fd);
+	}
+	printf("meta copy=%u op=create files=%u ", me, numfiles);
+	report_ops(&sw, numfiles);
+
+	sw_start(&sw);
+	for (i=0; i<numfiles; i++) {
+		snprintf(path, sizeof(path), "%s/f%u", dir, i);
+		if (stat(path, &st) < 0) {
+			err(1, "%s: stat", path);
+		}
+	}
+	printf("meta copy=%u op=lookup files=%u ", me, numfiles);
+	report_ops(&sw, numfiles);
+
+	sw_start(&sw);
+	for (i=0; i<numfiles; i++) {
+		snprintf(path, sizeof(path), "%s/f%u", dir, i);
+		if (remove(path) < 0) {
+			err(1, "%s: remove", path);
+		}
+	}
+	printf("meta copy=%u op=unlink files=%u ", me, numfiles);
+	report_ops(&sw, numfiles);
+
+	if (rmdir(dir) < 0) {
+		err(1, "%s: rmdir", dir);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Main
+
+static const struct {
+	const char *name;
+	void (*func)(void);
+} tests[] = {
+	{ "seq", test_seq },
+	{ "rand", test_rand },
+	{ "meta", test_meta },
+};
+static const unsigned numtests = sizeof(tests) / sizeof(tests[0]);
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: %s [-s kbytes] [-r ios] [-f files] [-c copies] "
+	     "[seq|rand|meta...]", myname);
+}
+
+static
+int
+findtest(const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<numtests; i++) {
+		if (!strcmp(tests[i].name, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static
+void
+runtests(int argc, char *argv[], int first)
+{
+	unsigned i;
+	int j;
+
+	if (first == argc) {
+		for (i=0; i<numtests; i++) {
+			tests[i].func();
+		}
+		return;
+	}
+	for (j=first; j<argc; j++) {
+		tests[findtest(argv[j])].func();
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned val;
+	pid_t pids[64];
+	int i, ch, status, bad;
+	unsigned j;
+
+	myname = argc > 0 ? argv[0] : "fsbench";
+
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		ch = argv[i][1];
+		if (argv[i][2] != 0 || i+1 >= argc) {
+			usage();
+		}
+		val = atoi(argv[++i]);
+		switch (ch) {
+		    case 's': filekb = val; break;
+		    case 'r': numios = val; break;
+		    case 'f': numfiles = val; break;
+		    case 'c': numcopies = val; break;
+		    default: usage(); break;
+		}
+	}
+	if (filekb == 0 || numcopies == 0 ||
+	    numcopies > sizeof(pids)/sizeof(pids[0])) {
+		usage();
+	}
+	for (j=i; j<(unsigned)argc; j++) {
+		if (findtest(argv[j]) < 0) {
+			usage();
+		}
+	}
+
+	if (numcopies == 1) {
+		runtests(argc, argv, i);
+		return 0;
+	}
+
+	for (j=0; j<numcopies; j++) {
+		pids[j] = fork();
+		if (pids[j] < 0) {
+			err(1, "fork");
+		}
+		if (pids[j] == 0) {
+			me = j;
+			runtests(argc, argv, i);
+			exit(0);
+		}
+	}
+	bad = 0;
+	for (j=0; j<numcopies; j++) {
+		if (waitpid(pids[j], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("copy %u failed", j);
+			bad = 1;
+		}
+	}
+	return bad;
+}
@@ -100,6 +100,11 @@
  * Also note that you can set numprocs and numkeys on the command
  * line, but not WORKNUM.
  *
+ * With -b it also prints how long each phase took, and with -n it
+ * sorts the same keys several times and averages; this makes a
+ * standard number for comparing kernels. There's no sampling phase;
+ * the bins are split evenly over the range of random().
+ *
  * FUTURE: maybe make a build option to malloc the work space instead
  * of using a static buffer, which would allow choosing WORKNUM on the
  * command line too, at the cost of depending on malloc working.
@@ -125,6 +130,39 @@ static int me = NOBODY;
 
 static const char *progname;
 
+/*
+ * Benchmark mode (-b): time each phase, and sort the same keys
+ * numruns times (-n), to get numbers that can be compared from one
+ * kernel to the next. phasems is the total milliseconds spent in each
+ * phase over all the runs.
+ */
+enum phase {
+	PH_GENERATE,
+	PH_CHECKSUM,
+	PH_TOSS,
+	PH_SORT,
+	PH_MERGE,
+	PH_ASSEMBLE,
+	PH_VALIDATE,
+	NPHASES
+};
+
+static const char *const phasenames[NPHASES] = {
+	"generate",
+	"checksum",
+	"partition",
+	"sort",
+	"merge",
+	"assemble",
+	"validate",
+};
+
+static int benchmark;
+static int numruns = 1;
+static unsigned long phasems[NPHASES];
+static time_t phasesecs;
+static unsigned long phasensecs;
+
 ////////////////////////////////////////////////////////////
 
 static
@@ -179,6 +217,75 @@ sortints(int *v, int num)
 
 ////////////////////////////////////////////////////////////
 
+static
+void
+phase_begin(void)
+{
+	__time(&phasesecs, &phasensecs);
+}
+
+static
+void
+phase_end(enum phase ph)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+
+	/* secs.nsecs -= phasesecs.phasensecs */
+	if (nsecs < phasensecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	nsecs -= phasensecs;
+	secs -= phasesecs;
+	phasems[ph] += secs * 1000 + nsecs / 1000000;
+}
+
+/*
+ * Return AMOUNT per second, given that it took MS milliseconds,
+ * without overflowing.
+ */
+static
+unsigned long
+persec(unsigned long amount, unsigned long ms)
+{
+	if (ms == 0) {
+		ms = 1;
+	}
+	return (amount / ms) * 1000 + ((amount % ms) * 1000) / ms;
+}
+
+static
+void
+printreport(void)
+{
+	unsigned long ms, runms;
+	int i;
+
+	printf("psort: %d keys, %d procs, %d run%s\n", numkeys, numprocs,
+	       numruns, numruns == 1 ? "" : "s");
+	for (i=0; i<NPHASES; i++) {
+		ms = phasems[i];
+		if (i != PH_GENERATE) {
+			ms /= numruns;
+		}
+		printf("  %-12s %lu.%03lu s\n", phasenames[i],
+		       ms / 1000, ms % 1000);
+	}
+
+	/* the sort proper: partition, sort, merge, assemble */
+	runms = (phasems[PH_TOSS] + phasems[PH_SORT] + phasems[PH_MERGE] +
+		 phasems[PH_ASSEMBLE]) / numruns;
+	printf("Sort time: %lu.%03lu s per run; %lu keys/s, %lu KB/s\n",
+	       runms / 1000, runms % 1000,
+	       persec(numkeys, runms),
+	       persec(numkeys * sizeof(int) / 1024, runms));
+}
+
+////////////////////////////////////////////////////////////
+
 static
 void
 initprogname(const char *av0)
@@ -631,9 +738,11 @@ genkeys(void)
 
 	/* Do it. */
 	complainx("Generating %d integers using %d procs", numkeys, numprocs);
+	phase_begin();
 	seeds = seedspace;
 	doforkall("Initialization", genkeys_sub);
 	seeds = NULL;
+	phase_end(PH_GENERATE);
 
 	/* Cross-check the size of the output. */
 	if (getsize(PATH_KEYS) != correctsize) {
@@ -643,7 +752,9 @@ genkeys(void)
 
 	/* Checksum the output. */
 	complainx("Checksumming the data (using one proc)");
+	phase_begin();
 	checksum = checksum_file(PATH_KEYS);
+	phase_end(PH_CHECKSUM);
 	complainx("Checksum of unsorted keys: %ld", checksum);
 }
 
@@ -913,21 +1024,27 @@ sort(void)
 	/* Step 1. Toss into bins. */
 	complainx("Tossing into %d bins using %d procs",
 		  numprocs*numprocs, numprocs);
+	phase_begin();
 	doforkall("Tossing", bin);
+	phase_end(PH_TOSS);
 	checksize_bins();
 	complainx("Done tossing into bins.");
 
 	/* Step 2: Sort the bins. */
 	complainx("Sorting %d bins using %d procs",
 		  numprocs*numprocs, numprocs);
+	phase_begin();
 	doforkall("Sorting", sortbins);
+	phase_end(PH_SORT);
 	checksize_bins();
 	complainx("Done sorting the bins.");
 
 	/* Step 3: Merge corresponding bins. */
 	complainx("Merging %d bins using %d procs",
 		  numprocs*numprocs, numprocs);
+	phase_begin();
 	doforkall("Merging", mergebins);
+	phase_end(PH_MERGE);
 	checksize_merge();
 	complainx("Done merging the bins.");
 
@@ -940,8 +1057,10 @@ sort(void)
 
 	/* Step 4: assemble output file */
 	complainx("Assembling output file using %d procs", numprocs);
+	phase_begin();
 	docreate(PATH_SORTED);
 	doforkall("Final assembly", assemble);
+	phase_end(PH_ASSEMBLE);
 	if (getsize(PATH_SORTED) != correctsize) {
 		complainx("%s: file is wrong size", PATH_SORTED);
 		exit(1);
@@ -954,7 +1073,9 @@ sort(void)
 
 	/* Step 5: Checksum the result. */
 	complainx("Checksumming the output (using one proc)");
+	phase_begin();
 	sortedsum = checksum_file(PATH_SORTED);
+	phase_end(PH_CHECKSUM);
 	complainx("Checksum of sorted keys: %ld", sortedsum);
 
 	if (sortedsum != checksum) {
@@ -1065,7 +1186,9 @@ validate(void)
 	const char *name;
 
 	complainx("Validating the sorted data using %d procs", numprocs);
+	phase_begin();
 	doforkall("Validation", dovalidate);
+	phase_end(PH_VALIDATE);
 	checksize_valid();
 
 	prev_largest = 1;
@@ -1152,7 +1275,8 @@ static
 void
 usage(void)
 {
-	complain("Usage: %s [-p procs] [-k keys] [-s seed] [-r]", progname);
+	complain("Usage: %s [-p procs] [-k keys] [-s seed] [-r] "
+		 "[-b] [-n runs]", progname);
 	exit(1);
 }
 
@@ -1172,7 +1296,9 @@ doargs(int argc, char *argv[])
 		    case 'p': arg = 1; break;
 		    case 'k': arg = 1; break;
 		    case 's': arg = 1; break;
+		    case 'n': arg = 1; break;
 		    case 'r': arg = 0; break;
+		    case 'b': arg = 0; break;
 		    default: usage(); return;
 		}
 		if (arg) {
@@ -1192,12 +1318,14 @@ doargs(int argc, char *argv[])
 			    case 'p': numprocs = val; break;
 			    case 'k': numkeys = val; break;
 			    case 's': randomseed = val; break;
+			    case 'n': numruns = val; break;
 			    default: assert(0); break;
 			}
 		}
 		else {
 			switch (ch) {
 			    case 'r': randomize(); break;
+			    case 'b': benchmark = 1; break;
 			    default: assert(0); break;
 			}
 		}
@@ -1207,19 +1335,33 @@ doargs(int argc, char *argv[])
 int
 main(int argc, char *argv[])
 {
+	int i;
+
 	initprogname(argc > 0 ? argv[0] : NULL);
 
 	doargs(argc, argv);
+	if (numruns < 1) {
+		usage();
+	}
 	correctsize = (off_t) (numkeys*sizeof(int));
 
 	setdir();
 
 	genkeys();
-	sort();
-	validate();
+	for (i=0; i<numruns; i++) {
+		if (numruns > 1) {
+			complainx("Run %d of %d", i+1, numruns);
+		}
+		sort();
+		validate();
+	}
 	complainx("Succeeded.");
 
 	unsetdir();
 
+	if (benchmark) {
+		printreport();
+	}
+
 	return 0;
 }
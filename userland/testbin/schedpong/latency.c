@@ -0,0 +1,237 @@
+/*
+ * Latency mode (-l): time round trips between a pair of processes
+ * over semfs semaphores and over pipes, and the fork/exit/waitpid
+ * cycle, and print the min, median, 99th percentile, and max of
+ * each in nanoseconds. Any thinkers asked for run alongside as
+ * background load, so the tail shows what the scheduler does to a
+ * waiting process when the CPU is busy.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "usem.h"
+#include "tasks.h"
+
+#define MAXSAMPLES	8192
+#define WARMUP		16	/* untimed round trips first */
+
+static unsigned long samples[MAXSAMPLES];
+
+/*
+ * Nanoseconds since SECS.NSECS. Round trips are well under the four
+ * seconds that fit in an unsigned long.
+ */
+static
+unsigned long
+elapsed(time_t secs, unsigned long nsecs)
+{
+	time_t nowsecs;
+	unsigned long nownsecs;
+
+	__time(&nowsecs, &nownsecs);
+	return (unsigned long)(nowsecs - secs) * 1000000000 + nownsecs - nsecs;
+}
+
+static
+int
+cmpsample(const void *av, const void *bv)
+{
+	unsigned long a = *(const unsigned long *)av;
+	unsigned long b = *(const unsigned long *)bv;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+/*
+ * Sort the first COUNT samples and print the summary.
+ */
+static
+void
+report(const char *what, unsigned count)
+{
+	qsort(samples, count, sizeof(samples[0]), cmpsample);
+	printf("%-10s n=%u min=%lu median=%lu p99=%lu max=%lu\n", what,
+	       count, samples[0], samples[count / 2],
+	       samples[(count * 99) / 100], samples[count - 1]);
+}
+
+/*
+ * Wait for the partner process and make sure it was happy.
+ */
+static
+void
+reap(pid_t pid, const char *what)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "%s: waitpid", what);
+	}
+	if (WIFSIGNALED(status) ||
+	    (WIFEXITED(status) && WEXITSTATUS(status) != 0)) {
+		errx(1, "%s: partner process failed", what);
+	}
+}
+
+/*
+ * Semaphore round trip: we V ping and P pong, the partner P's ping
+ * and V's pong.
+ */
+static
+void
+lat_sem(unsigned count)
+{
+	struct usem ping, pong;
+	time_t secs;
+	unsigned long nsecs;
+	unsigned i;
+	pid_t pid;
+
+	usem_init(&ping, "sem:lat-ping");
+	usem_init(&pong, "sem:lat-pong");
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		usem_open(&ping);
+		usem_open(&pong);
+		for (i=0; i<WARMUP + count; i++) {
+			P(&ping);
+			V(&pong);
+		}
+		usem_close(&ping);
+		usem_close(&pong);
+		_exit(0);
+	}
+
+	usem_open(&ping);
+	usem_open(&pong);
+	for (i=0; i<WARMUP + count; i++) {
+		__time(&secs, &nsecs);
+		V(&ping);
+		P(&pong);
+		if (i >= WARMUP) {
+			samples[i - WARMUP] = elapsed(secs, nsecs);
+		}
+	}
+	usem_close(&ping);
+	usem_close(&pong);
+	reap(pid, "sem");
+	usem_cleanup(&ping);
+	usem_cleanup(&pong);
+
+	report("sem", count);
+}
+
+/*
+ * Pipe round trip: one byte each way over a pair of pipes.
+ */
+static
+void
+lat_pipe(unsigned count)
+{
+	int tochild[2], toparent[2];
+	time_t secs;
+	unsigned long nsecs;
+	unsigned i;
+	pid_t pid;
+	char ch;
+
+	if (pipe(tochild) < 0 || pipe(toparent) < 0) {
+		err(1, "pipe");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(tochild[1]);
+		close(toparent[0]);
+		for (i=0; i<WARMUP + count; i++) {
+			if (read(tochild[0], &ch, 1) != 1) {
+				err(1, "pipe: child read");
+			}
+			if (write(toparent[1], &ch, 1) != 1) {
+				err(1, "pipe: child write");
+			}
+		}
+		_exit(0);
+	}
+
+	close(tochild[0]);
+	close(toparent[1]);
+	ch = 'x';
+	for (i=0; i<WARMUP + count; i++) {
+		__time(&secs, &nsecs);
+		if (write(tochild[1], &ch, 1) != 1) {
+			err(1, "pipe: write");
+		}
+		if (read(toparent[0], &ch, 1) != 1) {
+			err(1, "pipe: read");
+		}
+		if (i >= WARMUP) {
+			samples[i - WARMUP] = elapsed(secs, nsecs);
+		}
+	}
+	close(tochild[1]);
+	close(toparent[0]);
+	reap(pid, "pipe");
+
+	report("pipe", count);
+}
+
+/*
+ * Fork a child that exits at once, and wait for it.
+ */
+static
+void
+lat_fork(unsigned count)
+{
+	time_t secs;
+	unsigned long nsecs;
+	unsigned i;
+	pid_t pid;
+
+	for (i=0; i<count; i++) {
+		__time(&secs, &nsecs);
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(0);
+		}
+		reap(pid, "fork");
+		samples[i] = elapsed(secs, nsecs);
+	}
+
+	report("fork-exit", count);
+}
+
+/*
+ * Run the latency tests, COUNT samples each.
+ */
+void
+latency(unsigned count)
+{
+	if (count == 0) {
+		count = 1;
+	}
+	if (count > MAXSAMPLES) {
+		warnx("Only %u samples at a time", MAXSAMPLES);
+		count = MAXSAMPLES;
+	}
+
+	printf("--- Latencies (ns) ---\n");
+	lat_sem(count);
+	lat_pipe(count);
+	lat_fork(count);
+}
@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -272,6 +273,36 @@ runit(unsigned numthinkers, unsigned numgrinders,
 	destroyresultsfile();
 }
 
+/*
+ * Measure latencies instead, with NUMTHINKERS thinkers for load.
+ */
+static
+void
+runlatency(unsigned numthinkers, unsigned count)
+{
+	pid_t pid;
+
+	printf("Measuring latencies with %u thinkers, %u samples each.\n",
+	       numthinkers, count);
+
+	if (numthinkers > 0) {
+		usem_init(&startsem, STARTSEM);
+		createresultsfile();
+		forkem(numthinkers, nop, think, nop, 0, &pid);
+		usem_open(&startsem);
+		Vn(&startsem, numthinkers);
+	}
+
+	latency(count);
+
+	if (numthinkers > 0) {
+		waitall(&pid, 1);
+		usem_close(&startsem);
+		usem_cleanup(&startsem);
+		destroyresultsfile();
+	}
+}
+
 static
 void
 usage(const char *av0)
@@ -281,8 +312,12 @@ usage(const char *av0)
 	warnx("  [-g grinders]         set number of grinders (default 0)");
 	warnx("  [-p ponggroups]       set number of pong groups (default 1)");
 	warnx("  [-s ponggroupsize]    set pong group size (default 6)");
+	warnx("  [-l samples]          measure latencies instead");
 	warnx("Thinkers are CPU bound; grinders are memory-bound;");
 	warnx("pong groups are I/O bound.");
+	warnx("With -l, any thinkers given with -t run as background load");
+	warnx("while semaphore and pipe round trips and fork/exit/waitpid");
+	warnx("are timed.");
 	exit(1);
 }
 
@@ -293,12 +328,15 @@ main(int argc, char *argv[])
 	unsigned numgrinders = 0;
 	unsigned numponggroups = 1;
 	unsigned ponggroupsize = 6;
+	unsigned latsamples = 0;
+	bool gotthinkers = false;
 
 	int i;
 
 	for (i=1; i<argc; i++) {
 		if (!strcmp(argv[i], "-t")) {
 			numthinkers = atoi(argv[++i]);
+			gotthinkers = true;
 		}
 		else if (!strcmp(argv[i], "-g")) {
 			numgrinders = atoi(argv[++i]);
@@ -309,11 +347,22 @@ main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "-s")) {
 			ponggroupsize = atoi(argv[++i]);
 		}
+		else if (!strcmp(argv[i], "-l")) {
+			latsamples = atoi(argv[++i]);
+			if (latsamples == 0) {
+				usage(argv[0]);
+			}
+		}
 		else {
 			usage(argv[0]);
 		}
 	}
 
-	runit(numthinkers, numgrinders, numponggroups, ponggroupsize);
+	if (latsamples > 0) {
+		runlatency(gotthinkers ? numthinkers : 0, latsamples);
+	}
+	else {
+		runit(numthinkers, numgrinders, numponggroups, ponggroupsize);
+	}
 	return 0;
 }
@@ -35,7 +35,6 @@
 
 #include <stdio.h>
 #include <stdarg.h>
-#include <string.h>
 #include <unistd.h>
 #include <err.h>
 
@@ -84,15 +83,8 @@ usem_cleanup(struct usem *sem)
 void
 Pn(struct usem *sem, unsigned count)
 {
-	ssize_t r;
-	char c[count];
-
-	r = read(sem->fd, c, count);
-	if (r < 0) {
-		err(1, "%s: read", sem->name);
-	}
-	if ((size_t)r < count) {
-		errx(1, "%s: read: unexpected EOF", sem->name);
+	if (semwait(sem->fd, count) < 0) {
+		err(1, "%s: semwait", sem->name);
 	}
 }
 
@@ -105,18 +97,8 @@ P(struct usem *sem)
 void
 Vn(struct usem *sem, unsigned count)
 {
-	ssize_t r;
-	char c[count];
-
-	/* semfs does not use these values, but be conservative */
-	memset(c, 0, count);
-
-	r = write(sem->fd, c, count);
-	if (r < 0) {
-		err(1, "%s: write", sem->name);
-	}
-	if ((size_t)r < count) {
-		errx(1, "%s: write: Short count", sem->name);
+	if (sempost(sem->fd, count) < 0) {
+		err(1, "%s: sempost", sem->name);
 	}
 }
 
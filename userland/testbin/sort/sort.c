@@ -38,6 +38,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <err.h>
 
 /* Larger than physical memory */
@@ -128,8 +129,25 @@ check(void)
 int
 main(void)
 {
+	time_t startsecs, secs;
+	unsigned long startnsecs, nsecs;
+
 	initarray();
+
+	__time(&startsecs, &startnsecs);
 	sort(A, SIZE);
+	__time(&secs, &nsecs);
+
+	/* secs.nsecs -= startsecs.startnsecs */
+	if (nsecs < startnsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	nsecs -= startnsecs;
+	secs -= startsecs;
+	warnx("Sorted %d integers in %lld.%03lu seconds", SIZE,
+	      (long long)secs, nsecs / 1000000);
+
 	check();
 	return 0;
 }
@@ -30,17 +30,24 @@
 /*
  * tail.c
  *
- * 	Outputs a file beginning at a specific location.
+ * 	Outputs a file beginning at a specific location, or its last
+ *	lines.
  *	Usage: tail <file> <location>
+ *	       tail -n <lines> <file>
+ *
+ * For the last lines, the file is read backwards from the end in
+ * large blocks until enough newlines have turned up, so the time it
+ * takes doesn't depend on the size of the file.
  *
  * This may be useful for testing during the file system assignment.
  */
 
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <err.h>
 
-#define BUFSIZE 1000
+#define BUFSIZE 65536
 
 /* Put buffer in data space.  We know that the program should allocate as */
 /* much data space as required, but stack space is tight. */
@@ -62,19 +69,71 @@ tail(int file, off_t where, const char *filename)
 	}
 }
 
+/*
+ * Find where the last NLINES lines of the file begin. A newline at
+ * the very end only ends the last line, so it doesn't count.
+ */
+static
+off_t
+findlines(int file, unsigned nlines, const char *filename)
+{
+	off_t size, pos;
+	ssize_t len, i;
+	unsigned found = 0;
+
+	size = lseek(file, 0, SEEK_END);
+	if (size < 0) {
+		err(1, "%s", filename);
+	}
+	if (nlines == 0) {
+		return size;
+	}
+
+	for (pos = size; pos > 0; pos -= len) {
+		len = pos < BUFSIZE ? pos : BUFSIZE;
+		if (pread(file, buffer, len, pos - len) != len) {
+			err(1, "%s: pread", filename);
+		}
+		for (i = len - 1; i >= 0; i--) {
+			if (buffer[i] != '\n' || pos - len + i == size - 1) {
+				continue;
+			}
+			if (++found == nlines) {
+				return pos - len + i + 1;
+			}
+		}
+	}
+	return 0;
+}
+
 int
 main(int argc, char **argv)
 {
 	int file;
+	const char *filename;
+	off_t where;
 
-	if (argc < 3) {
-		errx(1, "Usage: tail <file> <location>");
+	if (argc == 4 && !strcmp(argv[1], "-n")) {
+		filename = argv[3];
+	}
+	else if (argc == 3) {
+		filename = argv[1];
 	}
-	file = open(argv[1], O_RDONLY);
+	else {
+		errx(1, "Usage: tail <file> <location> | "
+		     "tail -n <lines> <file>");
+	}
+	file = open(filename, O_RDONLY);
 	if (file < 0) {
-		err(1, "%s", argv[1]);
+		err(1, "%s", filename);
+	}
+	if (argc == 4) {
+		where = findlines(file, atoi(argv[2]), filename);
+	}
+	else {
+		where = atoi(argv[2]);
 	}
-	tail(file, atoi(argv[2]), argv[1]);
+	tail(file, where, filename);
 	close(file);
 	return 0;
 }
@@ -0,0 +1,160 @@
+/*
+ * vforktest - check getpid() in the child of vfork.
+ *
+ * getpid() reads the kernel information page of the address space,
+ * which a vfork child borrows from its parent. The child must still
+ * see its own pid, the one vfork returned to the parent, and the
+ * parent must see its own again once it has its memory back, whether
+ * the child exits or execs.
+ *
+ * That sharing is also why vfork must refuse from a process with
+ * other threads, which would see the child's pid.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define NTRIES 8
+#define PROG "/testbin/vforktest"
+
+/* written by the child, which shares our memory until it's done */
+static volatile pid_t childpid;
+
+/* for the extra thread in trythreaded */
+static volatile int stopthread, threadgone;
+
+/*
+ * Wait for PID and make sure it exited cleanly.
+ */
+static
+void
+reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child %d failed", (int)pid);
+	}
+}
+
+/*
+ * vfork a child that records its pid and then exits, or (if EXECIT)
+ * execs us again to do the check where it can't write back.
+ */
+static
+void
+try(pid_t mypid, int execit)
+{
+	char pidstr[16];
+	char *args[4];
+	pid_t pid;
+
+	childpid = -1;
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		childpid = getpid();
+		if (execit) {
+			snprintf(pidstr, sizeof(pidstr), "%d", (int)childpid);
+			args[0] = (char *)PROG;
+			args[1] = (char *)"-c";
+			args[2] = pidstr;
+			args[3] = NULL;
+			execv(PROG, args);
+			_exit(1);
+		}
+		_exit(0);
+	}
+
+	if (childpid != pid) {
+		errx(1, "vfork child's getpid() gave %d, not %d",
+		     (int)childpid, (int)pid);
+	}
+	if (getpid() != mypid) {
+		errx(1, "after vfork child %s, getpid() gave %d, not %d",
+		     execit ? "execed" : "exited", (int)getpid(), (int)mypid);
+	}
+	reap(pid);
+}
+
+/*
+ * Keep a second thread busy until told to stop.
+ */
+static
+void
+spinner(void)
+{
+	while (!stopthread) {
+		/* nothing */
+	}
+	threadgone = 1;
+}
+
+/*
+ * With another thread running, vfork must fail with EINVAL.
+ */
+static
+void
+trythreaded(void)
+{
+	pid_t pid;
+
+	if (threadfork(spinner) < 0) {
+		err(1, "threadfork");
+	}
+	pid = vfork();
+	if (pid == 0) {
+		_exit(1);
+	}
+	stopthread = 1;
+	while (!threadgone) {
+		/* nothing */
+	}
+	if (pid > 0) {
+		reap(pid);
+		errx(1, "vfork worked with two threads");
+	}
+	if (errno != EINVAL) {
+		err(1, "vfork with two threads");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t mypid;
+	int i;
+
+	if (argc == 3 && !strcmp(argv[1], "-c")) {
+		/* the execed child: the page is our own now */
+		if (getpid() != atoi(argv[2])) {
+			errx(1, "execed child's getpid() gave %d, not %s",
+			     (int)getpid(), argv[2]);
+		}
+		return 0;
+	}
+	if (argc != 1) {
+		warnx("usage: vforktest");
+		return 1;
+	}
+
+	mypid = getpid();
+	for (i=0; i<NTRIES; i++) {
+		try(mypid, 0);
+		try(mypid, 1);
+	}
+	trythreaded();
+	printf("vforktest: passed\n");
+	return 0;
+}
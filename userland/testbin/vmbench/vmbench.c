@@ -0,0 +1,460 @@
+/*
+ * vmbench - VM microbenchmarks.
+ *
+ * Usage: vmbench [-p pages] [-n reps] [test...]
+ *
+ * where the tests are:
+ *    fault   page-fault latency: first writes and reads of fresh heap
+ *            pages (zero-fill), reads of a mapped file, and writes to
+ *            pages already resident (the floor);
+ *    fork    fork-and-wait latency against how much memory the parent
+ *            has touched;
+ *    exec    fork, exec, and wait latency against binary size;
+ *    tlb     time per access while striding through memory, to show
+ *            where the TLB stops covering it.
+ * The default is all of them. -p gives the size in pages of the memory
+ * used by the fault and tlb tests (default 256) and -n the number of
+ * forks and execs timed for each size (default 16).
+ *
+ * Each result is one line on stdout: the test name and then
+ * space-separated name=value pairs, always ending with ns= (the mean
+ * nanoseconds per operation) and faults= (the number of calls to
+ * vm_fault, per vmstat, over the whole measurement). For example:
+ *
+ *    fault kind=zero-write pages=256 ns=41210 faults=256
+ *
+ * Times are wall-clock times from __time, so run it on an otherwise
+ * idle system.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define PATH_FILE	"vmbench.tmp"
+
+static unsigned numpages = 256;
+static unsigned numreps = 16;
+static const char *myname;
+
+////////////////////////////////////////////////////////////
+// Measuring
+
+/*
+ * A measurement: when it started, and the vm_fault count then.
+ */
+struct stopwatch {
+	time_t sw_secs;
+	unsigned long sw_nsecs;
+	unsigned sw_faults;
+};
+
+static
+unsigned
+getfaults(void)
+{
+	struct vmstat vs;
+
+	if (vmstat(-1, &vs) < 0) {
+		return 0;
+	}
+	return vs.vs_count[VMSTAT_FAULTS];
+}
+
+static
+void
+sw_start(struct stopwatch *sw)
+{
+	sw->sw_faults = getfaults();
+	__time(&sw->sw_secs, &sw->sw_nsecs);
+}
+
+/*
+ * Print the result of a measurement of COUNT operations, after the
+ * name and parameters already printed. The arithmetic is done in
+ * microseconds, to stay in 32 bits.
+ */
+static
+void
+sw_report(const struct stopwatch *sw, unsigned count)
+{
+	time_t secs;
+	unsigned long nsecs, usecs, ns;
+	unsigned faults;
+
+	__time(&secs, &nsecs);
+	faults = getfaults() - sw->sw_faults;
+
+	/* secs.nsecs -= sw_secs.sw_nsecs */
+	if (nsecs < sw->sw_nsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	nsecs -= sw->sw_nsecs;
+	secs -= sw->sw_secs;
+	usecs = secs * 1000000 + nsecs / 1000;
+
+	if (count == 0) {
+		count = 1;
+	}
+	ns = (usecs / count) * 1000 + ((usecs % count) * 1000) / count;
+	printf("ns=%lu faults=%u\n", ns, faults);
+}
+
+////////////////////////////////////////////////////////////
+// Memory
+
+/*
+ * Get PAGES fresh pages from sbrk. They are untouched, so each one
+ * faults the first time it's used.
+ */
+static
+volatile char *
+getpages(unsigned pages)
+{
+	void *p;
+
+	p = sbrk(pages * PAGE_SIZE);
+	if (p == (void *)-1) {
+		err(1, "sbrk %u pages", pages);
+	}
+	return p;
+}
+
+static
+void
+putpages(unsigned pages)
+{
+	if (sbrk(-(intptr_t)(pages * PAGE_SIZE)) == (void *)-1) {
+		err(1, "sbrk -%u pages", pages);
+	}
+}
+
+static
+void
+touchpages(volatile char *p, unsigned pages)
+{
+	unsigned i;
+
+	for (i=0; i<pages; i++) {
+		p[i * PAGE_SIZE] = 1;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Faults
+
+static
+void
+fault_file(void)
+{
+	static char buf[PAGE_SIZE];
+	struct stopwatch sw;
+	volatile char *p;
+	unsigned i, sum;
+	int fd;
+
+	fd = open(PATH_FILE, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", PATH_FILE);
+	}
+	memset(buf, 'x', sizeof(buf));
+	for (i=0; i<numpages; i++) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			err(1, "%s: write", PATH_FILE);
+		}
+	}
+
+	p = mmap(numpages * PAGE_SIZE, PROT_READ, fd, 0);
+	if (p == (void *)-1) {
+		warn("mmap");
+		printf("fault kind=file-read skipped\n");
+	}
+	else {
+		sum = 0;
+		sw_start(&sw);
+		for (i=0; i<numpages; i++) {
+			sum += p[i * PAGE_SIZE];
+		}
+		printf("fault kind=file-read pages=%u ", numpages);
+		sw_report(&sw, numpages);
+		if (sum != numpages * 'x') {
+			errx(1, "%s: mapping has the wrong contents",
+			     PATH_FILE);
+		}
+		if (munmap((void *)p) < 0) {
+			err(1, "munmap");
+		}
+	}
+
+	close(fd);
+	remove(PATH_FILE);
+}
+
+static
+void
+test_fault(void)
+{
+	struct stopwatch sw;
+	volatile char *p;
+	unsigned i, sum;
+
+	p = getpages(numpages);
+	sw_start(&sw);
+	touchpages(p, numpages);
+	printf("fault kind=zero-write pages=%u ", numpages);
+	sw_report(&sw, numpages);
+
+	sw_start(&sw);
+	touchpages(p, numpages);
+	printf("fault kind=resident-write pages=%u ", numpages);
+	sw_report(&sw, numpages);
+	putpages(numpages);
+
+	p = getpages(numpages);
+	sum = 0;
+	sw_start(&sw);
+	for (i=0; i<numpages; i++) {
+		sum += p[i * PAGE_SIZE];
+	}
+	printf("fault kind=zero-read pages=%u ", numpages);
+	sw_report(&sw, numpages);
+	if (sum != 0) {
+		errx(1, "zero-filled pages aren't zero");
+	}
+	putpages(numpages);
+
+	fault_file();
+}
+
+////////////////////////////////////////////////////////////
+// Fork and exec
+
+/*
+ * Time NUMREPS rounds of forking a child that runs PROG (or just
+ * exits, if PROG is NULL) and waiting for it.
+ */
+static
+void
+forkwait(const char *prog, struct stopwatch *sw)
+{
+	char *args[3];
+	unsigned i;
+	pid_t pid;
+	int status;
+
+	sw_start(sw);
+	for (i=0; i<numreps; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			if (prog != NULL) {
+				args[0] = (char *)prog;
+				args[1] = (char *)"-x";
+				args[2] = NULL;
+				execv(prog, args);
+				_exit(127);
+			}
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (WIFSIGNALED(status) ||
+		    (WIFEXITED(status) && WEXITSTATUS(status) == 127)) {
+			errx(1, "%s: child failed", prog ? prog : "fork");
+		}
+	}
+}
+
+static
+void
+test_fork(void)
+{
+	static const unsigned sizes[] = { 0, 16, 64, 256 };
+	struct stopwatch sw;
+	volatile char *p;
+	unsigned i;
+
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		p = getpages(sizes[i]);
+		touchpages(p, sizes[i]);
+		forkwait(NULL, &sw);
+		printf("fork resident=%u ", sizes[i]);
+		sw_report(&sw, numreps);
+		putpages(sizes[i]);
+	}
+}
+
+/*
+ * Programs for the exec test, smallest first. They are run with the
+ * argument -x, which makes this one exit at once and which the others
+ * ignore. Only the ones that exist are used.
+ */
+static const char *const execprogs[] = {
+	"/bin/true",
+	"/bin/false",
+	"/testbin/vmbench",
+};
+
+static
+void
+test_exec(void)
+{
+	struct stopwatch sw;
+	struct stat st;
+	unsigned i;
+
+	for (i=0; i<sizeof(execprogs)/sizeof(execprogs[0]); i++) {
+		if (stat(execprogs[i], &st) < 0) {
+			continue;
+		}
+		forkwait(execprogs[i], &sw);
+		printf("exec prog=%s bytes=%lld ", execprogs[i],
+		       (long long)st.st_size);
+		sw_report(&sw, numreps);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// TLB
+
+/*
+ * Step through the memory STRIDE bytes at a time, wrapping around
+ * at the end, for a fixed number of accesses. Once STRIDE is a page
+ * or more, each access is on a different page, so past the number of
+ * TLB entries every access misses.
+ */
+#define TLB_ACCESSES	(64*1024)
+
+static
+void
+test_tlb(void)
+{
+	static const unsigned strides[] = {
+		16, 64, 256, 1024, 4096, 8192, 16384, 32768,
+	};
+	struct stopwatch sw;
+	volatile char *p;
+	unsigned i, j, pos, stride, pages, size, sum;
+
+	size = numpages * PAGE_SIZE;
+	p = getpages(numpages);
+	touchpages(p, numpages);
+
+	for (i=0; i<sizeof(strides)/sizeof(strides[0]); i++) {
+		stride = strides[i];
+		if (stride >= size) {
+			break;
+		}
+		pages = stride < PAGE_SIZE ? numpages : size / stride;
+
+		sum = 0;
+		pos = 0;
+		sw_start(&sw);
+		for (j=0; j<TLB_ACCESSES; j++) {
+			sum += p[pos];
+			pos += stride;
+			if (pos >= size) {
+				pos = 0;
+			}
+		}
+		printf("tlb stride=%u pages=%u ", stride, pages);
+		sw_report(&sw, TLB_ACCESSES);
+		(void)sum;
+	}
+
+	putpages(numpages);
+}
+
+////////////////////////////////////////////////////////////
+// Main
+
+static const struct {
+	const char *name;
+	void (*func)(void);
+} tests[] = {
+	{ "fault", test_fault },
+	{ "fork", test_fork },
+	{ "exec", test_exec },
+	{ "tlb", test_tlb },
+};
+static const unsigned numtests = sizeof(tests) / sizeof(tests[0]);
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: %s [-p pages] [-n reps] [fault|fork|exec|tlb...]",
+	     myname);
+}
+
+static
+void
+runtest(const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<numtests; i++) {
+		if (!strcmp(tests[i].name, name)) {
+			tests[i].func();
+			return;
+		}
+	}
+	usage();
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned i;
+	int ch;
+
+	myname = argc > 0 ? argv[0] : "vmbench";
+
+	/* When run by the exec test */
+	if (argc == 2 && !strcmp(argv[1], "-x")) {
+		return 0;
+	}
+
+	for (i=1; i<(unsigned)argc && argv[i][0] == '-'; i++) {
+		ch = argv[i][1];
+		if ((ch != 'p' && ch != 'n') || argv[i][2] != 0 ||
+		    i+1 >= (unsigned)argc) {
+			usage();
+		}
+		i++;
+		if (ch == 'p') {
+			numpages = atoi(argv[i]);
+		}
+		else {
+			numreps = atoi(argv[i]);
+		}
+	}
+	if (numpages == 0 || numreps == 0) {
+		usage();
+	}
+
+	if (i == (unsigned)argc) {
+		for (i=0; i<numtests; i++) {
+			tests[i].func();
+		}
+	}
+	else {
+		for (; i<(unsigned)argc; i++) {
+			runtest(argv[i]);
+		}
+	}
+	return 0;
+}